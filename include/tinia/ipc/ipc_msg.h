@@ -105,6 +105,11 @@ extern "C" {
  * timeout. Specifying a zero timeout disables any waiting, guaranteeing a
  * single pair of query-response-messages.
  *
+ * Clients waiting for a reply that is rendered in the background use a
+ * separate notification, invoked using \ref ipc_msg_server_notify_renders, so
+ * that a finished render doesn't wake every long-polling client and vice
+ * versa. The consumer asks for this notification by returning 2.
+ *
  * Server execution flow
  * ---------------------
  *
@@ -180,7 +185,8 @@ typedef int (*tinia_ipc_msg_periodic_func_t)( void* data );
  *
  * \return 0 on success, -1 on error, and if invoked on client-side, 1 indicates
  * a success, but client should wait on a notification followed by a new
- * iteration of send and receive (used to implement long-polling).
+ * iteration of send and receive (used to implement long-polling). 2 is as 1,
+ * but waits on a render notification (see \ref ipc_msg_server_notify_renders).
  *
  */
 typedef int (*tinia_ipc_msg_consumer_func_t)( void*         data,
@@ -427,6 +433,19 @@ int
 ipc_msg_server_notify( tinia_ipc_msg_server_t* server );
 
 
+/** Wake all clients waiting for render notification.
+ *
+ * As \ref ipc_msg_server_notify, but wakes only the clients whose consumer
+ * returned 2, that is, clients waiting for a reply rendered in the background.
+ *
+ * \param[in] server               Pointer to initialized server struct.
+ *
+ * \return 0 on success, or a negative value on failure.
+ */
+int
+ipc_msg_server_notify_renders( tinia_ipc_msg_server_t* server );
+
+
 /** Break and return from the mainloop.
  *
  * Make the mainloop stop running and return control to the function that
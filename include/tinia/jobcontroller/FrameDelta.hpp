@@ -0,0 +1,147 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+// QT's moc doesn't like BOOST_JOIN ( can be removed in QT 5.0 we think)
+#ifndef Q_MOC_RUN
+#include <boost/thread/mutex.hpp>
+#endif
+
+namespace tinia {
+namespace jobcontroller {
+
+/** Finds the parts of a snapshot that changed since the last one a client got.
+ *
+ * The last frame sent to each client (and viewer) is kept, and a new frame
+ * is compared to it in square tiles. Only the tiles that differ need to be
+ * sent, and the client pastes them onto the frame it has. If the client does
+ * not have the frame we compared with (e.g., a reply was lost), or too large
+ * a part of the frame has changed, the whole frame is sent instead.
+ *
+ * Frames are 8-bit rgb, with the bottom row first as read by glReadPixels,
+ * and rows stride bytes apart. Tiles are given with the origin in the top
+ * left corner, as on the client. Thread-safe.
+ */
+class FrameDelta
+{
+public:
+   struct Tile
+   {
+      unsigned int   x;
+      unsigned int   y;
+      unsigned int   width;
+      unsigned int   height;
+   };
+
+   struct Delta
+   {
+      /** Identifies the frame, the client gives it back as the base of the next request. */
+      unsigned int         frame;
+      /** True if tiles is just the whole frame. */
+      bool                 full;
+      std::vector<Tile>    tiles;
+   };
+
+   /** \param tile_size    Width and height of the tiles in pixels.
+    *  \param threshold    Send the whole frame if more than this fraction of it changed.
+    *  \param max_clients  The number of frames kept, the least recently used is dropped.
+    */
+   FrameDelta( unsigned int tile_size, double threshold, size_t max_clients = 64 );
+
+   /** The threshold read from env['TINIA_DELTA_THRESHOLD'] (default 0.5). */
+   static
+   double
+   thresholdFromEnvironment();
+
+   /** Compares a frame to the last one of the client, and keeps it as the new last frame.
+    *
+    * \param client  Identifies the client and the viewer.
+    * \param base    The frame the client has, 0 if none.
+    */
+   Delta
+   update( const std::string& client,
+           unsigned int base,
+           const unsigned char* rgb,
+           unsigned int width,
+           unsigned int height,
+           size_t stride );
+
+   /** Copies the pixels of a tile to dst, bottom row first and dst_stride bytes apart. */
+   static
+   void
+   copyTile( const unsigned char* rgb,
+             unsigned int height,
+             size_t stride,
+             const Tile& tile,
+             unsigned char* dst,
+             size_t dst_stride );
+
+   /** Number of frames passed to update(). */
+   unsigned long
+   frames() const;
+
+   /** Number of those that were sent whole. */
+   unsigned long
+   fullFrames() const;
+
+   /** Fraction of the pixels of all frames that were sent. */
+   double
+   sentFraction() const;
+
+protected:
+   typedef std::list<std::string> Recency;
+
+   struct Frame
+   {
+      unsigned int               id;
+      unsigned int               width;
+      unsigned int               height;
+      size_t                     stride;
+      std::vector<unsigned char> pixels;
+      Recency::iterator          recency;
+   };
+
+   /** True if the tile differs between the two frames. */
+   static
+   bool
+   tileChanged( const unsigned char* a,
+                const unsigned char* b,
+                unsigned int height,
+                size_t stride,
+                const Tile& tile );
+
+   unsigned int                  m_tile_size;
+   double                        m_threshold;
+   size_t                        m_max_clients;
+   std::map<std::string, Frame>  m_frames;
+   /** Keys of m_frames, most recently used first. */
+   Recency                       m_recency;
+   unsigned int                  m_next_id;
+   unsigned long                 m_frame_count;
+   unsigned long                 m_full_count;
+   double                        m_pixels_total;
+   double                        m_pixels_sent;
+   mutable boost::mutex          m_mutex;
+};
+
+}
+}
@@ -17,6 +17,7 @@
  */
 
 #pragma once
+#include <string>
 #include "tinia/model/ExposedModel.hpp"
 // QT's moc doesn't like BOOST_JOIN ( can be removed in QT 5.0 we think)
 #ifndef Q_MOC_RUN 
@@ -49,6 +50,25 @@ public:
    bool
    periodic();
 
+   /** Invoked when the job is about to hibernate, after the exposed model has
+    * been saved, to save application state that is not in the model.
+    *
+    * \param payload  Bytes that are handed back to restore().
+    * \returns False if the job cannot hibernate, and then keeps running.
+    */
+   virtual
+   bool
+   hibernate( std::string& payload );
+
+   /** Invoked when a hibernated job is restarted, after init() and after the
+    * exposed model has been restored.
+    *
+    * \param payload  The bytes from hibernate().
+    */
+   virtual
+   bool
+   restore( const std::string& payload );
+
    void quit();
 
    virtual boost::shared_ptr<model::ExposedModel> getExposedModel();
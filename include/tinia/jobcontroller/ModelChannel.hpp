@@ -0,0 +1,191 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+#include <stdexcept>
+
+namespace tinia {
+namespace jobcontroller {
+
+/** Server end of the model channel, a WebSocket that carries the exposed
+ * model updates both ways.
+ *
+ * The channel replaces the long-poll of getExposedModelUpdate.xml and the
+ * posts of updateState.xml. Every message is a text frame with a header line,
+ *
+ *    <type> <sequence> <revision>\n<body>
+ *
+ * where the types are
+ *  - sync (client): the client has revision, send it what is newer.
+ *  - update (client): body is an updateState document.
+ *  - ack (server): body is the sequence number of an update that has been
+ *    applied, after which the model was at revision (0 if not known).
+ *  - model (server): body is an update of the model from the revision the
+ *    client had to revision. Empty if the client is up to date, which is
+ *    the answer to a sync with nothing newer.
+ *
+ * Each end numbers the messages it sends from 1. Messages from the client
+ * that do not follow the last one (e.g., resent after a reconnect) are dropped.
+ *
+ * The class only does the framing and the bookkeeping, the bytes are read
+ * and written by the server (qtcontroller's HTTPServer or the trell gateway).
+ * Not thread safe.
+ */
+class ModelChannel
+{
+public:
+   enum Opcode {
+      OPCODE_CONTINUATION = 0x0,
+      OPCODE_TEXT         = 0x1,
+      OPCODE_BINARY       = 0x2,
+      OPCODE_CLOSE        = 0x8,
+      OPCODE_PING         = 0x9,
+      OPCODE_PONG         = 0xa
+   };
+
+   struct Frame
+   {
+      bool          fin;
+      bool          masked;
+      int           opcode;
+      std::string   payload;
+   };
+
+   struct Message
+   {
+      Message();
+
+      std::string    type;
+      unsigned long  sequence;
+      unsigned int   revision;
+      std::string    body;
+   };
+
+   /** Largest message accepted from a client. */
+   static const size_t max_message_size;
+
+   /** \param server True for the server end, which closes the channel on
+    *               frames that are not masked (RFC 6455, section 5.1).
+    */
+   explicit
+   ModelChannel( bool server = true );
+
+   /** Value of the Sec-WebSocket-Accept header for the Sec-WebSocket-Key of the client. */
+   static
+   std::string
+   acceptKey( const std::string& client_key );
+
+   /** The complete 101 Switching Protocols response to the handshake. */
+   static
+   std::string
+   handshakeResponse( const std::string& client_key );
+
+   /** A frame with the payload. Frames from clients must be masked with a
+    * nonzero mask, frames from servers are not.
+    */
+   static
+   std::string
+   encodeFrame( int opcode, const std::string& payload, unsigned int mask = 0 );
+
+   /** Decodes the first frame in data.
+    * \return The number of bytes of the frame, or 0 if data does not hold a
+    *         complete frame.
+    * \throws std::runtime_error if the frame is not valid.
+    */
+   static
+   size_t
+   decodeFrame( const char* data, size_t size, Frame& frame );
+
+   static
+   std::string
+   formatMessage( const Message& message );
+
+   /** False if text is not a message. */
+   static
+   bool
+   parseMessage( const std::string& text, Message& message );
+
+   /** The revision attribute of the root of an exposed model update, or 0. */
+   static
+   unsigned int
+   revisionOf( const std::string& xml );
+
+   /** Takes bytes read from the client. */
+   void
+   receive( const char* data, size_t size );
+
+   /** The next message from the client, in order. Control frames are
+    * answered on the way (see takeOutput).
+    * \return False if there is none (yet).
+    */
+   bool
+   next( Message& message );
+
+   /** Sends a message, numbered with the next sequence number. */
+   void
+   send( const std::string& type, unsigned int revision, const std::string& body = std::string() );
+
+   /** Bytes to write to the client, which are then forgotten. */
+   std::string
+   takeOutput();
+
+   /** Sends a close frame, and stops reading. */
+   void
+   close();
+
+   /** True if the channel is closed, because either end asked for it, or
+    * the client broke the protocol (e.g., sent a frame that is not masked). The connection may be closed when the
+    * output is written.
+    */
+   bool
+   closed() const
+   { return m_closed; }
+
+   /** The revision the client has, as far as we know. */
+   unsigned int
+   revision() const
+   { return m_revision; }
+
+   void
+   setRevision( unsigned int revision )
+   { m_revision = revision; }
+
+   /** Sequence number of the last message from the client that was passed on. */
+   unsigned long
+   lastReceived() const
+   { return m_last_received; }
+
+   /** Number of messages sent. */
+   unsigned long
+   lastSent() const
+   { return m_last_sent; }
+
+protected:
+   std::string      m_input;
+   std::string      m_output;
+   std::string      m_fragments;      // Payload of an unfinished message.
+   bool             m_server;
+   bool             m_closed;
+   unsigned int     m_revision;
+   unsigned long    m_last_received;
+   unsigned long    m_last_sent;
+};
+
+}
+}
@@ -0,0 +1,151 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+// QT's moc doesn't like BOOST_JOIN ( can be removed in QT 5.0 we think)
+#ifndef Q_MOC_RUN
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#endif
+#include "tinia/model/ExposedModel.hpp"
+
+namespace tinia {
+namespace jobcontroller {
+
+/** Decides when snapshots are rendered at reduced quality during interaction.
+ *
+ * While the updates of a viewer arrive at interaction rate, its snapshots are
+ * rendered at a reduced resolution, without multisampling, and encoded with a
+ * lower jpeg quality. When the viewer has been left alone for a while, the
+ * element ap_progressiveRefinements is incremented, which makes the clients
+ * fetch a new snapshot, now at full quality.
+ *
+ * Interaction is detected from the timestamp of the viewer (milliseconds,
+ * set by the client when it updates the matrices): the viewer is interactive
+ * if its last two timestamps are less than the idle time apart, and the last
+ * one arrived less than the idle time ago.
+ *
+ * The mode is turned on by the job, by adding the elements of enable() to its
+ * exposed model, and the settings can be changed through these elements.
+ */
+class ProgressiveRefinement
+{
+public:
+   struct Settings
+   {
+      Settings();
+
+      /** Scale of the width and height of the interactive frames. */
+      double   scale;
+      /** Jpeg quality of the interactive frames. */
+      int      jpeg_quality;
+      /** Milliseconds without viewer updates before the full quality frame. */
+      int      idle_ms;
+   };
+
+   /** Turns the mode on for a job, usually called from Job::init.
+    *
+    * Adds ap_progressive (true), ap_progressiveScale, ap_progressiveJpgQuality,
+    * ap_progressiveIdleTime and ap_progressiveRefinements to the model.
+    */
+   static
+   void
+   enable( model::ExposedModel& model, const Settings& settings = Settings() );
+
+   /** Starts a helper thread that asks for the full quality frames. */
+   explicit ProgressiveRefinement( boost::shared_ptr<model::ExposedModel> model );
+
+   ~ProgressiveRefinement();
+
+   /** True if the job has turned the mode on, and then the current settings. */
+   bool
+   settings( Settings& settings ) const;
+
+   /** True if the snapshot of the viewer key is to be rendered at
+    * interactive quality. Also notes the timestamp of the viewer.
+    */
+   bool
+   interactive( const std::string& key );
+
+   /** As interactive( key ), with the viewer timestamp, the current time and
+    * the settings given.
+    */
+   bool
+   interactive( const std::string& key,
+                double timestamp,
+                double now,
+                const Settings& settings );
+
+   /** Returns the viewers that were interactive, but have not been updated
+    * for the idle time at now. Each interaction is returned once.
+    */
+   std::vector<std::string>
+   due( double now );
+
+   /** The size scaled down for an interactive frame, at least 1. */
+   static
+   unsigned int
+   scaled( unsigned int size, double scale );
+
+   /** The current time in milliseconds. */
+   static
+   double
+   now();
+
+   /** Number of snapshots rendered at interactive quality. */
+   unsigned long
+   interactiveFrames() const;
+
+   /** Number of times the clients were asked for full quality frames. */
+   unsigned long
+   refinements() const;
+
+protected:
+   struct Viewer
+   {
+      Viewer();
+
+      /** The last timestamp of the viewer, and the time between the last two. */
+      double   timestamp;
+      double   interval;
+      /** When the last timestamp was seen, in our time. */
+      double   changed;
+      int      idle_ms;
+      /** True if an interactive frame has been sent since the last refinement. */
+      bool     pending;
+   };
+
+   /** Body of the helper thread, which bumps ap_progressiveRefinements. */
+   void
+   run();
+
+   boost::shared_ptr<model::ExposedModel>   m_model;
+   std::map<std::string, Viewer>            m_viewers;
+   unsigned long                            m_interactive_frames;
+   unsigned long                            m_refinements;
+   bool                                     m_stop;
+   mutable boost::mutex                     m_mutex;
+   boost::condition_variable                m_cond;
+   boost::thread                            m_thread;
+};
+
+}
+}
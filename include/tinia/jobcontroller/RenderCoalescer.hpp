@@ -0,0 +1,145 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+#include <map>
+#include "tinia/jobcontroller/SnapshotCache.hpp"
+// QT's moc doesn't like BOOST_JOIN ( can be removed in QT 5.0 we think)
+#ifndef Q_MOC_RUN
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#endif
+
+namespace tinia {
+namespace jobcontroller {
+
+/** Lets concurrent snapshot requests share renders.
+ *
+ * Renders are grouped in slots, one per viewer, size and format, and at most
+ * one render runs per slot at a time. A request joins the slot with the key of
+ * the image it needs (see SnapshotCache::makeKey()):
+ *
+ * - If no render is running, it becomes the leader, renders, and hands the
+ *   image to publish().
+ * - If a render of the same key is running, it waits for that image instead
+ *   of rendering.
+ * - If a render of another key is running (typically an older revision of
+ *   the model), it waits for that render to finish, and the requests still
+ *   waiting then share the next render.
+ *
+ * Thus, the number of renders grows with the number of viewers and model
+ * revisions, not with the number of clients watching them.
+ *
+ * A leader must publish() before it waits for anything else, or requests
+ * that wait for each other's images may deadlock. Thread-safe.
+ */
+class RenderCoalescer
+{
+public:
+   typedef SnapshotCache::Data Data;
+
+   /** A request's place in a slot. */
+   class Ticket
+   {
+   public:
+      Ticket()
+         : m_leader( false ), m_generation( 0 )
+      {}
+
+      /** True if the holder must render and publish() the image. */
+      bool
+      leader() const
+      { return m_leader; }
+
+   protected:
+      friend class RenderCoalescer;
+      std::string    m_slot;
+      std::string    m_key;
+      bool           m_leader;
+      /** The number of renders published in the slot when last looked at. */
+      unsigned long  m_generation;
+   };
+
+   RenderCoalescer();
+
+   /** Joins a slot without blocking.
+    *
+    * If the returned ticket is the leader, the caller must render and
+    * publish(), otherwise it must wait().
+    */
+   Ticket
+   join( const std::string& slot, const std::string& key );
+
+   /** Waits for the image of a follower's ticket.
+    *
+    * \returns True and sets data if another request rendered the image, false
+    *          if the ticket has become the leader of the next render.
+    */
+   bool
+   wait( Ticket& ticket, Data& data );
+
+   /** Hands the image of a leader's ticket to the requests waiting for it.
+    *
+    * An empty image means that the render failed, and one of the waiting
+    * requests becomes the leader of the next render.
+    */
+   void
+   publish( const Ticket& ticket, const Data& data );
+
+   /** Number of renders, i.e., leader tickets. */
+   unsigned long
+   renders() const;
+
+   /** Number of requests that got the image of another request's render. */
+   unsigned long
+   shared() const;
+
+protected:
+   struct Slot
+   {
+      Slot()
+         : m_running( false ), m_generation( 0 ), m_users( 0 )
+      {}
+
+      bool           m_running;
+      unsigned long  m_generation;
+      /** The key and image of the last render published. */
+      std::string    m_last_key;
+      Data           m_last_data;
+      /** The tickets that have not been published or finished waiting. */
+      size_t         m_users;
+   };
+
+   /** Makes the ticket the leader of the slot. */
+   void
+   lead( Slot& slot, Ticket& ticket );
+
+   /** Forgets the slot when no ticket refers to it. */
+   void
+   release( const std::string& name, Slot& slot );
+
+   std::map<std::string, Slot>   m_slots;
+   unsigned long                 m_renders;
+   unsigned long                 m_shared;
+   mutable boost::mutex          m_mutex;
+   boost::condition_variable     m_published;
+};
+
+}
+}
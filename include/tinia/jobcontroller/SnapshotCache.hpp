@@ -0,0 +1,141 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+// QT's moc doesn't like BOOST_JOIN ( can be removed in QT 5.0 we think)
+#ifndef Q_MOC_RUN
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#endif
+
+namespace tinia {
+namespace jobcontroller {
+
+/** Caches snapshots of views that have not changed.
+ *
+ * A snapshot is identified by a key built with makeKey() from everything that
+ * determines its content: the view, the image size and format, and the
+ * revision of the exposed model it was rendered from. Since any change to the
+ * model bumps the revision, a snapshot with the same key can be served
+ * without rendering or encoding it again, and a client that already has it
+ * (the same ETag) can be told so with a 304 Not Modified.
+ *
+ * The cache holds at most capacity() snapshots, and drops the least recently
+ * used one when full. A capacity of zero disables it. Thread-safe.
+ *
+ * Only a job whose frames are determined by its exposed model may enable it;
+ * a job that animates, or renders data that changes outside the model, would
+ * get stale snapshots (and 304s) until the model changes. It is therefore off
+ * unless env['TINIA_SNAPSHOT_CACHE_SIZE'] is set.
+ */
+class SnapshotCache
+{
+public:
+   typedef boost::shared_ptr<const std::vector<char> > Data;
+
+   /** \param capacity  The maximum number of snapshots, 0 disables the cache. */
+   explicit SnapshotCache( size_t capacity );
+
+   /** The capacity read from env['TINIA_SNAPSHOT_CACHE_SIZE'] (default 0,
+    * which disables the cache).
+    */
+   static
+   size_t
+   capacityFromEnvironment();
+
+   /** Builds the key of a snapshot.
+    *
+    * \param view      The viewer key, or a list of them.
+    * \param format    What is stored, e.g. "png", "jpg:80" or "rgb+depth".
+    * \param revision  The revision of the exposed model.
+    */
+   static
+   std::string
+   makeKey( const std::string& view,
+            unsigned int width,
+            unsigned int height,
+            const std::string& format,
+            unsigned int revision );
+
+   /** The ETag (including the quotes) of the snapshot with the given key. */
+   static
+   std::string
+   etag( const std::string& key );
+
+   bool
+   enabled() const
+   { return m_capacity > 0; }
+
+   size_t
+   capacity() const
+   { return m_capacity; }
+
+   /** Returns the cached snapshot, or an empty pointer on a miss. */
+   Data
+   lookup( const std::string& key );
+
+   /** Stores a snapshot, replacing any snapshot with the same key. */
+   void
+   insert( const std::string& key, const char* data, size_t size );
+
+   /** Records that a client was answered with 304 Not Modified. */
+   void
+   notModified();
+
+   /** Drops all snapshots, the statistics are kept. */
+   void
+   clear();
+
+   /** Number of lookups that found a snapshot. */
+   unsigned long
+   hits() const;
+
+   /** Number of lookups that did not. */
+   unsigned long
+   misses() const;
+
+   /** Number of 304 Not Modified replies. */
+   unsigned long
+   notModifiedCount() const;
+
+   /** Fraction of the requests answered without rendering, i.e. hits and
+    * 304s over all requests, or 0 if there have been none.
+    */
+   double
+   hitRate() const;
+
+protected:
+   typedef std::list<std::string>                Recency;
+   typedef std::pair<Data, Recency::iterator>    Entry;
+
+   size_t                              m_capacity;
+   std::map<std::string, Entry>        m_entries;
+   /** Keys of m_entries, most recently used first. */
+   Recency                             m_recency;
+   unsigned long                       m_hits;
+   unsigned long                       m_misses;
+   unsigned long                       m_not_modified;
+   mutable boost::mutex                m_mutex;
+};
+
+}
+}
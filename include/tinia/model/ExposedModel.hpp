@@ -19,6 +19,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <sstream>
 #include <stdexcept>
 #include <iostream>
@@ -28,6 +29,9 @@
 #include <boost/type_traits.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
 #include <boost/property_tree/ptree.hpp>
 #endif
 #include "tinia/model/impl/ElementData.hpp"
@@ -59,11 +63,20 @@ typedef boost::property_tree::basic_ptree<std::string, std::string> StringString
 
 struct Viewer; // Forward declaration.
 class ExposedModelLock; // Forward declartion
+class ExposedModelTransaction; // Forward declaration
 
-/** ExposedModel is responsible for holding the contents of a model. */
+/** ExposedModel is responsible for holding the contents of a model.
+
+    Writers are serialized by a recursive mutex. Readers do not take this
+    mutex; they read an immutable snapshot of the state which is published
+    when the outermost writer releases the mutex (and before any listener is
+    notified). A thread holding the mutex, e.g. through an ExposedModelLock,
+    always reads its own, possibly unpublished, changes.
+  */
 class ExposedModel {
    // The locking mechanism for ExposedModel
    friend class ExposedModelLock;
+   friend class ExposedModelTransaction;
 public:
    typedef class ExposedModelLock ExposedModelLock;
    ExposedModel();
@@ -287,7 +300,13 @@ The job can use this to get an update meant for the client. This version are for
    /** Returning the revision number.
  \deprecated An controller should implement its own revision scheme.
 */
-   inline int getRevisionNumber(void) const { scoped_lock lock(m_selfMutex); return revisionNumber; }
+   int getRevisionNumber(void) const;
+
+   /** Makes the revision number larger than revision, if it isn't already.
+      Used when a model is restored, so that clients holding a revision of the
+      previous model see the restored elements as updates.
+      */
+   void advanceRevisionNumber(unsigned int revision);
 
 
    /**
@@ -336,6 +355,46 @@ The job can use this to get an update meant for the client. This version are for
    void removeStateListener(std::string key, StateListener* listener);
 
 
+   /** How StateListeners are notified when an element in the state changes. */
+   enum StateEventDelivery {
+      /** Listeners are called from the modifying thread, with the model locked. This is the default. */
+      DELIVER_SYNCHRONOUSLY,
+      /** Events are queued, and delivered when the owner of the model calls
+          deliverQueuedStateEvents(), typically from its event loop. */
+      DELIVER_QUEUED,
+      /** Events are queued, and delivered by a dispatcher thread owned by the model. */
+      DELIVER_FROM_DISPATCHER_THREAD
+   };
+
+   /**
+     Selects how state events are delivered to the StateListeners.
+
+     In the queued modes, listeners are called without the model locked, so a
+     slow listener does not block other readers and writers of the model. Events
+     are coalesced per key; see impl::StateListenerHandler for the ordering
+     guarantees. Events that are pending when switching back to
+     DELIVER_SYNCHRONOUSLY are delivered before this method returns.
+
+     \param delivery The new delivery mode.
+     \param eventsPending Only used with DELIVER_QUEUED. Called when the event
+     queue goes from empty to non-empty, possibly with the model locked. It
+     should only schedule a call to deliverQueuedStateEvents(), e.g. by posting
+     to the owner's event loop.
+     \note Must not be called while holding an ExposedModelLock. Listeners may
+     be added and removed at any time, also while holding an ExposedModelLock
+     or from a listener. A listener removed while a delivery is in progress on
+     another thread may still get the events of that delivery.
+     */
+   void setStateEventDelivery(StateEventDelivery delivery,
+                              boost::function<void()> eventsPending = boost::function<void()>());
+
+   /**
+     Delivers the queued state events to the listeners.
+     \return the number of events delivered.
+     \note Must not be called while holding an ExposedModelLock.
+     */
+   size_t deliverQueuedStateEvents();
+
    /** Update an element with a new value given as a string.
      \param key The key to update.
      \param value The value for the element. The type of the value is already known, since this is an update only.
@@ -353,6 +412,49 @@ The job can use this to get an update meant for the client. This version are for
    void updateElementFromPTree( const std::string &key, const StringStringPTree &value );
 
 
+   /** Update the fields of a complex element (e.g. a Viewer) directly from (name, value)-pairs,
+       without going through a ptree. Fields not mentioned keep their value. The revision
+       number is incremented once, and one state event is fired.
+     \param key The key to update.
+     \param fields (field name, value as string) for each field to update.
+     \throws KeyNotFoundException if the key or one of the fields does not exist.
+     \throws RestrictionException or boost::bad_lexical_cast if a value is invalid.
+     Nothing is updated if anything is thrown.
+     */
+   void updateElementFields( const std::string &key,
+                             const std::vector< std::pair<std::string, std::string> > &fields );
+
+
+   /** The new value of an element, see updateElements. */
+   struct ElementUpdate {
+      enum Kind {
+         /** A simple type, given by value. */
+         VALUE,
+         /** A complex type with one level of fields, given by fields. */
+         FIELDS,
+         /** A deeper complex type, given by tree as for updateElementFromPTree. */
+         TREE
+      };
+      Kind kind;
+      std::string key;
+      std::string value;
+      std::vector< std::pair<std::string, std::string> > fields;
+      StringStringPTree tree;
+   };
+
+
+   /** Update several elements as one step.
+       All the values are converted and checked against the types and restrictions of their
+       elements before anything is changed. The elements get the same revision number, and
+       listeners get the changes in one stateElementsModified.
+     \throws KeyNotFoundException if a key or field does not exist.
+     \throws RestrictionException or boost::bad_lexical_cast if a value is invalid.
+     \throws std::runtime_error if a value-tree has the wrong topology.
+     Nothing is updated if anything is thrown.
+     */
+   void updateElements( const std::vector<ElementUpdate>& updates );
+
+
    /**
      Sets the GUI (represented by its root element) for the given device. Use
      model::gui::Device to specify this.
@@ -374,7 +476,8 @@ private:
     */
    void guiIsValid(gui::Element *rootElement);
    /**
-    * Finds the element in the Model, throws if it isn't found
+    * Finds the element in the Model, throws if it isn't found. The element is
+    * assumed to be modified, and will be part of the next published snapshot.
     */
    impl::ElementData& findElementInternal(const std::string& key);
 
@@ -385,8 +488,9 @@ private:
 
    /**
      Holds the StateEvents until releaseStateEvents is called
+     \param batch Deliver the held events as one batch on release.
      */
-   void holdStateEvents();
+   void holdStateEvents(bool batch = false);
    /**
      Releases the StateEvents
      */
@@ -401,9 +505,25 @@ private:
    impl::ElementData& addElementInternal(std::string key, T val);
 
    /** The revision number for the model is incremented, and the element that caused this increment gets
-      its revision number set to the global value prior to this incrementation. */
+      its revision number set to the global value prior to this incrementation. Inside a transaction,
+      the revision number is only incremented once, and all elements get the same revision number. */
    void incrementRevisionNumber(impl::ElementData &updatedElement);
 
+   /** Starts a transaction (may be nested).
+       \note Must be called with m_selfMutex held. */
+   void beginTransaction();
+
+   /** Ends a transaction.
+       \note Must be called with m_selfMutex held. */
+   void endTransaction();
+
+   // The number of open transactions
+   int m_transactionDepth;
+   // True if the current transaction has taken a revision number
+   bool m_transactionHasRevision;
+   // The revision number given to all elements modified by the current transaction
+   unsigned int m_transactionRevision;
+
 
    void addAnnotationHelper( std::string element, std::map<std::string, std::string>& );
 
@@ -414,6 +534,38 @@ private:
 
    unsigned int revisionNumber;
 
+   /** Immutable copy of stateHash and revisionNumber handed out to readers. */
+   struct StateSnapshot {
+      unsigned int revisionNumber;
+      std::map<std::string, boost::shared_ptr<const impl::ElementData> > elements;
+   };
+   typedef boost::shared_ptr<const StateSnapshot> StateSnapshotPtr;
+
+   /** The last published snapshot. Only replaced by writers holding
+       m_selfMutex, always read and written with boost::atomic_load/store. */
+   StateSnapshotPtr m_snapshot;
+
+   /** Keys modified since the last published snapshot. */
+   std::set<std::string> m_dirtyKeys;
+
+   /** Marks an element as modified since the last published snapshot.
+       \note Does not lock on the mutex */
+   void markDirty(const std::string& key);
+
+   /** Publishes the modified elements to the readers.
+       \note Must be called with m_selfMutex held. */
+   void publishSnapshot();
+
+   /** Calls visit(key, elementData) for each element. If the calling thread
+       holds m_selfMutex, stateHash is read in place (the thread must see its
+       own changes), otherwise the published snapshot is. */
+   template<class Visitor>
+   void forEachElementForReading(Visitor visit) const;
+
+   /** Finds an element for reading, throws if it isn't found.
+       \see forEachElementForReading */
+   boost::shared_ptr<const impl::ElementData> findElementForReading(const std::string& key) const;
+
    /** Helper function for element updating that handles the complexity of simple versus complex
         types. Just a wrapper around UpdateElementHelper-class.
        */
@@ -439,9 +591,29 @@ private:
    void fireStateElementModified(std::string key, const impl::ElementData& data);
 
 
+   boost::thread m_stateEventDispatcher;
+   void stopStateEventDispatcher();
+   void runStateEventDispatcher();
+
    // Locking made easy
-   typedef boost::recursive_mutex mutex_type;
-   typedef mutex_type::scoped_lock scoped_lock;
+
+   /** Recursive mutex for writers, publishing the state snapshot when the
+       outermost lock is released. */
+   class mutex_type {
+   public:
+      explicit mutex_type(ExposedModel& model);
+      void lock();
+      bool try_lock();
+      void unlock();
+      /** \return true if the calling thread holds the mutex. */
+      bool heldByCurrentThread() const;
+   private:
+      unsigned int& depth() const;
+      ExposedModel& m_model;
+      boost::recursive_mutex m_mutex;
+      mutable boost::thread_specific_ptr<unsigned int> m_depth;
+   };
+   typedef boost::unique_lock<mutex_type> scoped_lock;
    mutable mutex_type m_selfMutex;
 
    mutex_type& getExposedModelMutex();
@@ -695,20 +867,16 @@ ExposedModel::updateElement( std::string key, T value ) {
 template<typename T>
 void
 ExposedModel::getElementValue( std::string key, T& t ) {
-   // The whole method locks the model. This could be optimized, but leaving it
-   // like this for now.
-   scoped_lock lock(m_selfMutex);
-
-
-   impl::ElementData& elementData = findElementInternal(key);
+   // Reads from the published snapshot, so no locking is needed.
+   boost::shared_ptr<const impl::ElementData> elementData = findElementForReading(key);
    std::string myType = impl::TypeToXSDType<T>::getTypename();
-   std::string storedType = elementData.getXSDType();
+   std::string storedType = elementData->getXSDType();
    if ( storedType !=  myType ) {
        throw TypeException(myType, storedType);
    }
 
 
-   elementFactory.createT( elementData, t );
+   elementFactory.createT( *elementData, t );
 
 }
 
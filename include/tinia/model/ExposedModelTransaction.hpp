@@ -0,0 +1,67 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "boost/thread.hpp"
+#include "tinia/model/ExposedModel.hpp"
+#include <boost/shared_ptr.hpp>
+
+namespace tinia {
+namespace model {
+
+/**
+  Groups several updates of an ExposedModel into one revision.
+
+  Like ExposedModelLock, the model is locked for the lifetime of the object
+  (or until commit() is called) and state events are held. In addition:
+  - All elements modified by the transaction get the same revision number,
+    and the revision number of the model is only incremented once.
+  - Readers in other threads see either none or all of the updates.
+  - The held state events are delivered as one batch
+    (StateListener::stateElementsModified), with one event per key.
+
+  \code
+  {
+     model::ExposedModelTransaction transaction(model);
+     model->updateElement("viewer", viewer);
+     model->updateElement("timestep", 42);
+  } // Committed here.
+  \endcode
+
+  \note Updates are applied immediately, there is no rollback. If an update
+  throws, the updates made before it are still committed.
+  */
+class ExposedModelTransaction
+{
+public:
+   ExposedModelTransaction(boost::shared_ptr<ExposedModel> model);
+
+   /** Commits the transaction if commit() has not been called. */
+   ~ExposedModelTransaction();
+
+   /** Ends the transaction, unlocks the model and delivers the batched events. */
+   void commit();
+
+private:
+   ExposedModel::scoped_lock m_scoped_lock;
+   boost::shared_ptr<ExposedModel> m_model;
+   bool m_committed;
+};
+
+} // namespace model
+} // namespace tinia
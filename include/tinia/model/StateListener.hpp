@@ -19,6 +19,7 @@
 #pragma once
 #include "tinia/model/StateElement.hpp"
 #include <memory>
+#include <vector>
 
 
 namespace tinia {
@@ -37,6 +38,26 @@ public:
      responsible for the memory of this pointer
      */
    virtual void stateElementModified(model::StateElement * stateElement) = 0;
+
+   /**
+     This is called once for all the elements changed by an
+     ExposedModelTransaction. Each key appears at most once, with its value at
+     the end of the transaction.
+
+     The default implementation calls stateElementModified for each element.
+     \param stateElements the changed elements, in the order they were first
+     changed.
+     */
+   virtual void stateElementsModified(std::vector<model::StateElement>& stateElements);
+
+   /**
+     This is called once for the elements changed while an ExposedModelLock
+     was held, when the lock is released. The elements are in the order they
+     were changed, and a key may appear more than once.
+
+     The default implementation calls stateElementModified for each element.
+     */
+   virtual void stateElementsReleased(std::vector<model::StateElement>& stateElements);
 };
 }
 }
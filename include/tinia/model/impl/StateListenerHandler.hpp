@@ -22,29 +22,115 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <list>
+// QT's moc doesn't like BOOST_JOIN ( can be removed in QT 5.0 we think)
+#ifndef Q_MOC_RUN
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#endif
 
 namespace tinia {
 namespace model {
 namespace impl {
+/** Keeps track of the StateListeners of a model and delivers state events to them.
+
+    Events are either delivered immediately from fireStateElementModified, or
+    (when queueing is enabled) put in a queue that is emptied by
+    deliverQueuedEvents. The queue holds at most one event per key: a new event
+    for a key that is already pending replaces the pending value but keeps its
+    position in the queue. This gives the following guarantees:
+    - For a given key, listeners see values in the order they were set, and
+      the last value they see is the latest value set. Intermediate values may
+      be skipped.
+    - Across keys, events are delivered in the order the keys first became
+      pending since the last delivery.
+    - Deliveries never overlap; concurrent calls to deliverQueuedEvents are
+      serialized.
+
+    The listener lists are copied on write, and listeners are called from the
+    lists as they were when the delivery started, without any lock that
+    add/removeStateListener take. Listeners may thus be added and removed from
+    any thread while a delivery is in progress, also from the listeners
+    themselves. A listener removed during a delivery on another thread may
+    still get the events of that delivery.
+  */
 class StateListenerHandler
 {
 public:
-   StateListenerHandler() : m_isBuffering(false) {}
+   StateListenerHandler();
     void addStateListener(StateListener* listener);
     void addStateListener(std::string key, StateListener* listener);
     void removeStateListener(StateListener* listener);
     void removeStateListener(std::string key, StateListener* listener);
     void fireStateElementModified(StateElement* stateElement);
-    void holdEvents();
+
+    /** Buffers events until releaseEvents is called.
+        \param batch If true, the buffered events are coalesced per key and
+        delivered with StateListener::stateElementsModified on release.
+        Otherwise they are delivered with StateListener::stateElementsReleased.
+      */
+    void holdEvents(bool batch = false);
     void releaseEvents();
+
+    /** Enables or disables queueing of events. Events already in the queue
+        stay there until deliverQueuedEvents is called.
+        \param eventsPending Called when the queue goes from empty to
+        non-empty. It is called from the thread firing the event (usually with
+        the model locked) and should only schedule a call to
+        deliverQueuedEvents.
+      */
+    void setQueueEvents(bool queueEvents,
+                        boost::function<void()> eventsPending = boost::function<void()>());
+
+    /** Delivers all queued events to the listeners.
+        \return the number of events delivered.
+      */
+    size_t deliverQueuedEvents();
+
+    /** Blocks until there are events in the queue or stopWaiting is called.
+        \return false if stopWaiting was called.
+      */
+    bool waitForQueuedEvents();
+
+    /** Wakes up and stops all current and future calls to waitForQueuedEvents. */
+    void stopWaiting();
+
+    /** Makes waitForQueuedEvents block again after stopWaiting. */
+    void resumeWaiting();
+
 private:
-    std::list<StateListener*> m_listeners;
-    std::map<std::string, std::list<StateListener*> > m_keylisteners;
+    void deliverStateElementModified(StateElement* stateElement);
+    /** \param released Deliver with stateElementsReleased instead. */
+    void deliverStateElementsModified(std::vector<StateElement>& stateElements,
+                                      bool released = false);
+
+    typedef std::list<StateListener*> Listeners;
+    typedef std::map<std::string, Listeners> KeyListeners;
+
+    boost::shared_ptr<const Listeners> listeners();
+    boost::shared_ptr<const KeyListeners> keyListeners();
+
+    boost::shared_ptr<const Listeners> m_listeners;
+    boost::shared_ptr<const KeyListeners> m_keylisteners;
     std::vector<StateElement> m_buffer;
     bool m_isBuffering;
+    bool m_isBatching;
+
+    // Protects the listener list pointers. Never held while calling listeners.
+    boost::mutex m_listenerMutex;
+    // Serializes deliveries of queued events. Not taken by add/remove.
+    boost::recursive_mutex m_deliveryMutex;
 
+    // Queued delivery
+    bool m_queueEvents;
+    bool m_stopWaiting;
+    std::list<std::string> m_queueOrder;
+    std::map<std::string, StateElement> m_queue;
+    boost::function<void()> m_eventsPending;
+    boost::mutex m_queueMutex;
+    boost::condition_variable m_queueCondition;
 };
 }
 }
 }
-
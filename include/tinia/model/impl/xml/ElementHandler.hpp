@@ -18,6 +18,7 @@
 
 #pragma once
 #include <string>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include "tinia/model/ExposedModel.hpp"
 
@@ -34,6 +35,9 @@ public:
                                 const std::string& stringValue);
    void updateElementFromPTree(const std::string& key,
                                const model::StringStringPTree& tree);
+   void updateElementFields(const std::string& key,
+                            const std::vector< std::pair<std::string, std::string> >& fields);
+   void updateElements(const std::vector<model::ExposedModel::ElementUpdate>& updates);
 
 private:
    boost::shared_ptr<model::ExposedModel> m_model;
@@ -19,7 +19,7 @@
 #pragma once
 #include "tinia/model/ExposedModel.hpp"
 #include "tinia/model/impl/xml/XMLTransporter.hpp"
-#include "tinia/model/impl/xml/XMLReader.hpp"
+#include "tinia/model/impl/xml/XMLStreamReader.hpp"
 #include "tinia/model/impl/xml/ElementHandler.hpp"
 #include <memory>
 
@@ -34,6 +34,7 @@ public:
    XMLHandler(boost::shared_ptr<model::ExposedModel> model);
 
    /** The job can use this to update the state given new information from the client.
+      The buffer is parsed in a single pass (see XMLStreamReader), no document is built.
       \param buffer The memory buffer to which the xml document will be written.
       \param doc_len The size of the xml document in the buffer.
       \return True if everything is ok, otherwise false.
@@ -52,8 +53,7 @@ public:
 
 private:
    boost::shared_ptr<model::ExposedModel> m_model;
-   XMLTransporter m_xmlTransporter;
-   XMLReader m_xmlReader;
+   XMLStreamReader m_xmlStreamReader;
    ElementHandler m_elementHandler;
 };
 }
@@ -0,0 +1,122 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <libxml/parser.h>
+
+#include "tinia/model/ExposedModel.hpp"
+#include "tinia/model/impl/xml/ElementHandler.hpp"
+// QT's moc doesn't like BOOST_JOIN ( can be removed in QT 5.0 we think)
+#ifndef Q_MOC_RUN
+#include <boost/thread.hpp>
+#endif
+
+
+
+namespace tinia {
+namespace model {
+namespace impl {
+namespace xml {
+
+
+    /** \class XMLStreamReader
+     XMLStreamReader parses a state update straight from the raw buffer with the libxml2 SAX2
+     interface, in a single pass and without building a document.
+
+     It accepts the same documents as XMLTransporter::readXMLfromBuffer followed by
+     XMLReader::parseDocument: the first element named "State" (at any depth) is read, its
+     childless children are simple updates, and its children with children are complex types.
+     Complex types with one level of fields (such as Viewer) are applied with
+     ElementHandler::updateElementFields, deeper ones are converted to a ptree.
+
+     The updates are applied as one step with ElementHandler::updateElements after the whole
+     buffer has been parsed, so a malformed document or an invalid value changes nothing.
+     The parser context is reused between calls.
+    */
+
+    class XMLStreamReader {
+
+    public:
+        XMLStreamReader();
+        ~XMLStreamReader();
+
+        /** Parse a state update and apply it.
+            \param buffer The xml document.
+            \param length The size of the xml document in the buffer.
+            \param elementHandler Applies the updates to the model.
+            \return A list of the keys in the state that are updated is returned.
+            \throws std::runtime_error if the document is not well-formed.
+            \throws What ExposedModel::updateElements throws if a key or value is invalid.
+        */
+        std::vector<std::string> parseBuffer(const char* buffer,
+                                             const size_t length,
+                                             ElementHandler &elementHandler);
+
+    private:
+        XMLStreamReader(const XMLStreamReader&);
+        XMLStreamReader& operator=(const XMLStreamReader&);
+
+        /** An element inside a complex type, in document order. */
+        struct Node {
+            int         depth;  // 1 for the complex type itself.
+            std::string name;
+            std::string value;
+            bool        hasChildren;
+        };
+
+        /** A top level element in the State-section. */
+        struct PendingUpdate {
+            std::vector<Node> nodes; // nodes[0] is the element itself.
+            int               maxDepth;
+        };
+
+        static void startElementNs(void* ctx, const xmlChar* localname, const xmlChar* prefix,
+                                   const xmlChar* URI, int nb_namespaces, const xmlChar** namespaces,
+                                   int nb_attributes, int nb_defaulted, const xmlChar** attributes);
+        static void endElementNs(void* ctx, const xmlChar* localname, const xmlChar* prefix,
+                                 const xmlChar* URI);
+        static void characters(void* ctx, const xmlChar* ch, int len);
+        static void structuredError(void* ctx, xmlErrorPtr error);
+
+        void apply(ElementHandler &elementHandler, std::vector<std::string>& updatedKeys);
+
+        boost::mutex               m_mutex;
+        xmlSAXHandler              m_sax;
+        xmlParserCtxtPtr           m_ctxt;
+
+        // Parse state, only valid during parseBuffer.
+        int                        m_depth;
+        int                        m_stateDepth;   // -1 before "State", -2 after.
+        std::vector<size_t>        m_open;         // Indices into m_pending.back().nodes.
+        std::vector<PendingUpdate> m_pending;
+        size_t                     m_pendingCount; // m_pending is only grown, to reuse the strings.
+        std::string                m_error;
+        std::vector<model::ExposedModel::ElementUpdate> m_updates;
+    };
+
+
+
+
+}
+}
+}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <QVector>
+#ifndef Q_MOC_RUN
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#endif
+
+namespace tinia {
+namespace qtcontroller {
+namespace impl {
+
+/** An image read back from OpenGL, owned by whoever holds the pointer.
+ *
+ * The pixels are rows of 8-bit RGB, bottom row first, as given by glReadPixels.
+ */
+struct GrabbedImage
+{
+    std::vector<unsigned char>  pixels;
+    unsigned int                width;
+    unsigned int                height;
+};
+
+typedef boost::shared_ptr<GrabbedImage> GrabbedImagePtr;
+
+/** Recycles the storage of grabbed images.
+ *
+ * The images handed out by acquire() go back to the pool when the last
+ * reference is released, so that a steady stream of snapshots of the same
+ * size does not allocate.
+ */
+class ImagePool
+{
+public:
+    /** \param maxFree The number of released images that are kept for reuse. */
+    static boost::shared_ptr<ImagePool> create( size_t maxFree = 8 );
+
+    ~ImagePool();
+
+    /** Returns an image with room for bytes bytes of pixels. */
+    GrabbedImagePtr acquire( size_t bytes );
+
+    /** The number of released images that are waiting for reuse. */
+    size_t freeCount();
+
+private:
+    explicit ImagePool( size_t maxFree );
+    void release( GrabbedImage* image );
+
+    struct Releaser;
+
+    QMutex                      m_mutex;
+    std::vector<GrabbedImage*>  m_free;
+    size_t                      m_maxFree;
+    boost::weak_ptr<ImagePool>  m_self;
+};
+
+/** Flips a grabbed image to top row first, scales it to width x height if it
+ * has a different size, and encodes it as png, or jpeg with the given quality.
+ */
+QByteArray encodeImage( const GrabbedImage& image,
+                        unsigned int width,
+                        unsigned int height,
+                        bool png,
+                        int jpg_quality );
+
+/** Encodes a batch of grabbed images in parallel on a thread pool.
+ *
+ * Images are queued with add() as soon as they are grabbed, so that encoding
+ * overlaps with grabbing the next one, and result() waits for one of them.
+ */
+class ImageEncoder
+{
+public:
+    explicit ImageEncoder( QThreadPool* pool );
+
+    /** Waits for the queued images, since the tasks refer to this encoder. */
+    ~ImageEncoder();
+
+    /** Queues an image for encodeImage.
+     * \returns The index to give to result().
+     */
+    int add( GrabbedImagePtr image, unsigned int width, unsigned int height,
+             bool png, int jpg_quality );
+
+    /** Waits for the image with the given index to be encoded and returns it. */
+    QByteArray result( int index );
+
+private:
+    class Task;
+    void finished( int index, const QByteArray& encoded );
+
+    QThreadPool*        m_pool;
+    QMutex              m_mutex;
+    QWaitCondition      m_finished;
+    QVector<QByteArray> m_results;
+    QVector<bool>       m_done;
+    int                 m_pending;
+};
+
+} // namespace impl
+} // namespace qtcontroller
+} // namespace tinia
@@ -1,6 +1,8 @@
 #pragma once
 #include <QRunnable>
 #include <QTextStream>
+#include <QByteArray>
+#include <QObject>
 #include "tinia/jobcontroller.hpp"
 #include "tinia/model/impl/xml/XMLHandler.hpp"
 #include "tinia/qtcontroller/moc/OpenGLServerGrabber.hpp"
@@ -10,20 +12,26 @@ namespace tinia {
 namespace qtcontroller {
 namespace impl {
 
+/** Handles one request in a worker thread of the HTTPServer.
+ *
+ * The response is written to a buffer, and given back to the server (in the
+ * main thread) with HTTPServer::deliverResponse.
+ */
 class ServerThread : public QRunnable
 {
 public:
     explicit ServerThread(OpenGLServerGrabber* grabber,
                           Invoker* mainthread_invoker,
                           tinia::jobcontroller::Job* job,
-                          int socket );
+                          QObject* server,
+                          qulonglong connection,
+                          qulonglong sequence,
+                          const QByteArray& request );
 
     void run();
     
 private:
 
-    bool isLongPoll(const QString& request);
-
     /** Collects the rgb buffer data and returns it as text. Optionally also collects depth and transformation data.
      */
     void getSnapshotTxt( QTextStream &os, const QString &request,
@@ -43,6 +51,21 @@ private:
                               tinia::jobcontroller::Job* job,
                               tinia::qtcontroller::impl::OpenGLServerGrabber* grabber);
 
+    /** Collects the rgb images (png, or jpeg if jpeg is set) of the viewers
+     * in viewer_key_list, and optionally depth and transformation data, and
+     * writes them out in the binary snapshot container, see appendSnapshotHeader.
+     */
+    void getSnapshotBin( QTextStream &os, const QString &request,
+                         const bool with_depth, const bool jpeg );
+
+    /** Writes the rgb image of the viewer key as a raw png or jpeg. */
+    void getSnapshotImage( QTextStream &os, const QString &request, const bool jpeg );
+
+    /** Writes the tiles of the viewer key that changed since the frame the
+     * client has (the base parameter), each as a png, see FrameDelta.
+     */
+    void getSnapshotDelta( QTextStream &os, const QString &request );
+
     /** Handles non-static content, if applicable.
      * @returns true if the file is non-static, false otherwise.
      */
@@ -51,13 +74,19 @@ private:
 
     void updateState(QTextStream& os, const QString& request);
 
+    /** Writes header, the empty line and the binary body to the device of os. */
+    void writeBinary(QTextStream& os, const QString& header, const QByteArray& body);
+
     /** Writes the error code to the stream formated as HTTP requires,
      * with the optional message formated in HTML
      */
     void errorCode(QTextStream& os, unsigned int code, const QString& msg);
     QString getStaticContent(const QString& uri);
 
-    int m_socket;
+    QObject*                            m_server;
+    qulonglong                          m_connection;
+    qulonglong                          m_sequence;
+    QByteArray                          m_request;
 
     tinia::model::impl::xml::XMLHandler m_xmlHandler;
     tinia::jobcontroller::Job*          m_job;
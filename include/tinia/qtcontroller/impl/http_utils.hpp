@@ -1,8 +1,11 @@
 #pragma once
 
 #include <QString>
+#include <QByteArray>
 #include <QStringList>
 #include <QMap>
+#include <vector>
+#include <string>
 #include <stdexcept>
 #include <boost/lexical_cast.hpp>
 #include <boost/fusion/sequence.hpp>
@@ -23,6 +26,71 @@ QString getPostContent(const QString& request);
 
 QString httpHeader(const QString& mime, unsigned int code = 200, const QString& encoding = "utf-8");
 
+/** Finds the end of the first request in buffer.
+ * @returns the length of the first complete request (header and Content-Length
+ *          bytes of body), 0 if more data is needed, or -1 if the header is
+ *          longer than maxHeaderSize, or the body is (or would be) longer than
+ *          maxBodySize.
+ */
+int requestLength(const QByteArray& buffer, int maxHeaderSize, int maxBodySize);
+
+/** True if the connection may be reused after the response to request, i.e.
+ * HTTP/1.1 without "Connection: close", or HTTP/1.0 with "Connection: keep-alive".
+ */
+bool isKeepAlive(const QByteArray& request);
+
+/** Completes a response as written by the handlers (status line, headers, empty
+ * line and body) with Content-Length and Connection headers, so that the
+ * connection can be reused.
+ */
+QByteArray finishResponse(const QByteArray& response, bool keepAlive);
+
+/** Status line and Content-Type for binary content, i.e. without a charset. */
+QString binaryHeader(const QString& mime, unsigned int code = 200);
+
+/** Value of a header field of the request, or an empty string. */
+QString getHeaderField(const QString& request, const QString& field);
+
+/** The ETag header line, or an empty string if etag is empty. */
+QString etagHeader(const QString& etag);
+
+/** Status line of a 304 Not Modified reply, with the ETag header. */
+QString notModifiedHeader(const QString& etag);
+
+/** The ETag of a snapshot reply, which depends on the request line (for the
+ * echoed parameters) and on the cache keys of all the images. The timestamp
+ * parameter, which the client changes for every request, is left out, and the
+ * reply must not echo it.
+ */
+QString snapshotETag(const QString& request, const std::vector<std::string>& keys);
+
+/** True if the client already has the reply, i.e., If-None-Match of request is
+ * etag, which is not empty.
+ */
+bool isNotModified(const QString& request, const QString& etag);
+
+/** Flags of a viewer entry in the binary snapshot container. */
+enum SnapshotFlags {
+    SNAPSHOT_FLAG_DEPTH = 0x1,  ///< Depth image and matrices follow the rgb image.
+    SNAPSHOT_FLAG_JPEG  = 0x2   ///< The rgb image is a jpeg, not a png.
+};
+
+/** Appends value as a 32-bit little-endian unsigned integer. */
+void appendUInt32(QByteArray& out, quint32 value);
+
+/** Appends value as a 32-bit little-endian float. */
+void appendFloat32(QByteArray& out, float value);
+
+/** Appends the size of data (as appendUInt32) followed by data. */
+void appendSized(QByteArray& out, const QByteArray& data);
+
+/** Appends the header of the binary snapshot container returned by the .bin
+ * snapshot requests. The layout is the same as the one mod_trell uses, see
+ * tinia/trell/trell.h, so that the client has one decoder for both servers.
+ */
+void appendSnapshotHeader(QByteArray& out, unsigned int viewers, unsigned int revision,
+                          const QByteArray& timestamp, const QByteArray& snaptype);
+
 template<unsigned int i>
 struct ParseGetHelper {
 
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <QObject>
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+#include <QTimer>
+#include <QTime>
+#include <QAtomicInt>
+#include <QThreadPool>
+#include <tinia/model.hpp>
+#include "tinia/jobcontroller.hpp"
+
+namespace tinia {
+namespace qtcontroller {
+namespace impl {
+
+class HTTPServer;
+class OpenGLServerGrabber;
+class Invoker;
+
+/** Streams the snapshots of a viewer over one connection
+ * (snapshot_stream.png and snapshot_stream.jpg).
+ *
+ * The response is multipart/x-mixed-replace, which browsers show in an <img>
+ * element, with one part per frame. A frame is rendered in the worker pool
+ * (as snapshot.png or snapshot.jpg) when the model has changed since the last
+ * one, at most max_fps times per second, and only when the previous frame has
+ * been passed to the OS. Revisions that change while a frame is rendered or
+ * written are therefore dropped, and a slow client gets the latest frame
+ * instead of a queue of old ones.
+ *
+ * The parameters are those of snapshot.png/jpg (key, width, height and
+ * jpeg_quality), and max_fps (default 30). Each part has the headers
+ * Content-Type, Content-Length and X-Tinia-Revision, as the streams of
+ * mod_trell (see tinia/trell/trell.h).
+ *
+ * Lives in the main thread.
+ */
+class FrameStreamHandler : public QObject, public tinia::model::StateListener
+{
+    Q_OBJECT
+public:
+    explicit FrameStreamHandler(OpenGLServerGrabber* grabber,
+                                Invoker* mainthread_invoker,
+                                tinia::jobcontroller::Job* job,
+                                QThreadPool* workers,
+                                HTTPServer* server);
+
+    ~FrameStreamHandler();
+
+    /** Starts the stream requested by request number sequence on connection. */
+    void addStream(qulonglong connection, qulonglong sequence, const QString& request);
+
+    /** Forgets the stream of a closed connection. */
+    void cancel(qulonglong connection);
+
+    /** May be invoked from any thread. */
+    void stateElementModified(model::StateElement *stateElement);
+
+public slots:
+    /** A frame rendered by the worker pool, as a complete snapshot response. */
+    void deliverResponse(qulonglong connection, qulonglong sequence, QByteArray response);
+
+private slots:
+    void wake();
+
+private:
+    struct Stream {
+        qulonglong  sequence;
+        QByteArray  request;     // The snapshot.png/jpg request of a frame.
+        QString     mime;
+        bool        busy;        // A frame is being rendered.
+        bool        started;     // The header of the response is written.
+        unsigned int revision;   // Of the frame last rendered.
+        unsigned int renderRevision;  // Of the frame being rendered.
+        int         interval;    // Milliseconds between frames.
+        QTime       last;        // When the last frame was started.
+    };
+
+    /** Milliseconds until the stream can take a new frame, 0 if now, or -1
+     * if it waits for a change of the model.
+     */
+    int due(qulonglong connection, const Stream& stream, unsigned int revision) const;
+
+    OpenGLServerGrabber*        m_grabber;
+    Invoker*                    m_mainthread_invoker;
+    tinia::jobcontroller::Job*  m_job;
+    QThreadPool*                m_workers;
+    HTTPServer*                 m_server;
+    QHash<qulonglong, Stream>   m_streams;
+    QAtomicInt                  m_wakePending;
+    QTimer                      m_timer;
+};
+
+} // namespace impl
+} // namespace qtcontroller
+} // namespace tinia
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <QObject>
+#include <QByteArray>
+#include <QMap>
+#include <QTimer>
+#include <QTcpSocket>
+
+namespace tinia {
+namespace qtcontroller {
+namespace impl {
+
+class HTTPServer;
+
+/** One client connection to the HTTPServer.
+ *
+ * Lives in the main thread and never blocks: requests are read as they
+ * arrive (several may be pipelined on the same connection), handed to the
+ * server, and the responses are written back in request order when they
+ * are ready. The connection is kept open between requests (HTTP/1.1
+ * keep-alive), and closed when it has been idle for a while.
+ *
+ * A response may also be a stream (see startStream), which goes on until the
+ * connection is closed. No more requests are read from such a connection.
+ * Likewise, a connection may be upgraded to another protocol (see upgrade),
+ * and then everything read is given to HTTPServer::upgradedData.
+ */
+class HTTPConnection : public QObject
+{
+    Q_OBJECT
+public:
+    explicit HTTPConnection( int socket, qulonglong id, HTTPServer* server );
+
+    qulonglong
+    id() const
+    { return m_id; }
+
+    /** Queues the response to request number sequence on this connection. */
+    void
+    respond( qulonglong sequence, const QByteArray& response );
+
+    /** Queues the header of a streamed response to request number sequence.
+     * The header (status line and headers) is completed with
+     * "Connection: close", and written when it is the request's turn.
+     */
+    void
+    startStream( qulonglong sequence, const QByteArray& header );
+
+    /** Queues the response to request number sequence, which switches the
+     * connection to another protocol (101 Switching Protocols). The response
+     * is written as it is.
+     */
+    void
+    upgrade( qulonglong sequence, const QByteArray& response );
+
+    /** True when the header of the stream has been written, and parts can
+     * be written with writeStreamPart.
+     */
+    bool
+    isStreaming() const
+    { return m_streaming; }
+
+    /** Writes the next part of the stream. Parts given before the header is
+     * written are kept until then.
+     */
+    void
+    writeStreamPart( const QByteArray& part );
+
+    /** Number of bytes written (or kept) that have not yet been passed to the OS. */
+    qint64
+    bytesToWrite() const;
+
+private slots:
+    void
+    readRequests();
+
+    void
+    closeConnection();
+
+private:
+    void
+    writeResponses();
+
+    HTTPServer*                 m_server;
+    QTcpSocket*                 m_socket;       // Lifetime managed by Qt child-parent
+    qulonglong                  m_id;
+    QByteArray                  m_input;
+    qulonglong                  m_nextSequence;    // Sequence number of the next request read.
+    qulonglong                  m_nextResponse;    // Sequence number of the next response to write.
+    QMap<qulonglong, QByteArray> m_responses;      // Finished responses waiting for their turn.
+    QMap<qulonglong, bool>      m_keepAlive;
+    bool                        m_closing;         // No more requests are read.
+    bool                        m_stream;          // m_streamSequence is a stream.
+    bool                        m_streaming;       // The header of the stream is written.
+    bool                        m_upgrade;         // The stream is another protocol.
+    qulonglong                  m_streamSequence;
+    QByteArray                  m_streamPending;   // Parts waiting for the header.
+    QTimer                      m_idleTimer;
+};
+
+} // namespace impl
+} // namespace qtcontroller
+} // namespace tinia
@@ -6,11 +6,32 @@
 #include "tinia/model/impl/xml/XMLHandler.hpp"
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QThreadPool>
+#include <QHash>
+#include <QByteArray>
 
 namespace tinia {
 namespace qtcontroller {
 namespace impl {
 
+class HTTPConnection;
+class LongPollHandler;
+class FrameStreamHandler;
+class ModelChannelHandler;
+
+/** Event-driven HTTP/1.1 server for the job.
+ *
+ * All connections are handled by the main thread's event loop (see
+ * HTTPConnection), and support keep-alive and pipelining. Requests that need
+ * work (updating the model, snapshots, render lists, static content) are run
+ * by a bounded pool of worker threads. Long-polls wait for updates in the
+ * LongPollHandler without holding a thread, and frame streams are fed by the
+ * FrameStreamHandler. Clients may instead keep the model in sync over a
+ * WebSocket (model_channel), see ModelChannelHandler.
+ *
+ * The number of workers is read from env['TINIA_HTTP_WORKERS'] (default is the
+ * number of cores, at least 2).
+ */
 class HTTPServer : public QTcpServer
 {
     Q_OBJECT
@@ -18,17 +39,50 @@ public:
 
     /**
      * Takes control over imageSource
+     * \param port The port to listen on, 0 picks a free port (see serverPort()).
      */
     explicit HTTPServer( tinia::jobcontroller::Job*,
-        QObject *parent = 0);
+        QObject *parent = 0, quint16 port = 8080 );
+
+    ~HTTPServer();
 
     void incomingConnection(int socket);
-    
+
+    /** Handles a complete request read by connection. The response is given
+     * to connection->respond(sequence, ...) when ready.
+     */
+    void dispatch( HTTPConnection* connection, qulonglong sequence,
+                   const QByteArray& request );
+
+    /** Bytes read from a connection that has been upgraded to a WebSocket. */
+    void upgradedData( HTTPConnection* connection, const QByteArray& data );
+
+    /** Called by the connection when it is closed. */
+    void connectionClosed( HTTPConnection* connection );
+
+    /** True if the connection is still open. */
+    bool hasConnection( qulonglong connection ) const;
+
+    /** The connection, or NULL if it is closed. */
+    HTTPConnection* connection( qulonglong connection ) const;
+
+public slots:
+    /** Gives a response to the connection, if it is still open. May be
+     * invoked from the worker threads through a queued connection.
+     */
+    void deliverResponse( qulonglong connection, qulonglong sequence,
+                          QByteArray response );
+
 private:
     tinia::jobcontroller::Job*  m_job;
     OpenGLServerGrabber*        m_serverGrabber;    // Lifetime managed by Qt child-parent
     Invoker*                    m_mainthread_invoker;   // Lifetime managed by Qt child-parent.
-
+    LongPollHandler*            m_longPollHandler;      // Lifetime managed by Qt child-parent.
+    FrameStreamHandler*         m_frameStreamHandler;   // Lifetime managed by Qt child-parent.
+    ModelChannelHandler*        m_modelChannelHandler;  // Lifetime managed by Qt child-parent.
+    QThreadPool                 m_workers;
+    QHash<qulonglong, HTTPConnection*> m_connections;
+    qulonglong                  m_nextConnectionId;
 };
 
 }
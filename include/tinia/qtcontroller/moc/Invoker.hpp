@@ -4,6 +4,7 @@
 #include <QMutex>
 #include <QRunnable>
 #include <QWaitCondition>
+#include <vector>
 
 namespace tinia {
 namespace qtcontroller {
@@ -24,6 +25,15 @@ public:
     void
     invokeInMainThread( QRunnable* function, bool block = true );
 
+    /** Runs all the functions, in order, in one turn of the main thread, and
+     * waits for them to complete.
+     *
+     * This costs one round-trip through the event loop regardless of the
+     * number of functions.
+     */
+    void
+    invokeInMainThread( const std::vector<QRunnable*>& functions );
+
 
 signals:
 
@@ -1,46 +1,92 @@
 #pragma once
 
-#include <QThread>
-#include <QTextStream>
-#include <QTcpSocket>
+#include <QObject>
+#include <QList>
+#include <QMap>
 #include <QMutex>
-#include <QWaitCondition>
+#include <QString>
+#include <QByteArray>
+#include <QDateTime>
+#include <QTimer>
+#include <QAtomicInt>
+#include <QThreadPool>
 #include <tinia/model.hpp>
-#include <tinia/model/impl/xml/XMLHandler.hpp>
+#include <vector>
 
 namespace tinia {
 namespace qtcontroller {
 namespace impl {
 
+class HTTPServer;
+
+/** Answers the long-polls (getExposedModelUpdate.xml) of the HTTPServer.
+ *
+ * A long-poll is answered as soon as the model has an update newer than the
+ * revision the client has. Until then it is parked here, holding neither a
+ * thread nor a buffer. When the model changes, the parked polls are checked
+ * again in the worker pool. Polls are answered with 408 after 500 s.
+ *
+ * Lives in the main thread.
+ */
 class LongPollHandler : public QObject, public tinia::model::StateListener
 {
     Q_OBJECT
 public:
-    explicit LongPollHandler(QTextStream& os,
-                             const QString& request,
-                             boost::shared_ptr<tinia::model::ExposedModel> model,
-                             QObject *parent = 0);
+    explicit LongPollHandler(boost::shared_ptr<tinia::model::ExposedModel> model,
+                             QThreadPool* workers,
+                             HTTPServer* server);
 
     ~LongPollHandler();
 
-    void handle();
+    /** Answers request number sequence on connection when there is an update. */
+    void addLongPoll(qulonglong connection, qulonglong sequence, const QString& request);
+
+    /** Forgets the polls of a closed connection. */
+    void cancel(qulonglong connection);
 
+    /** May be invoked from any thread. */
     void stateElementModified(model::StateElement *stateElement);
     
-signals:
-    
+    /** The buffer a check writes the update into, one per connection. Polls
+     * pipelined on one connection take turns with it.
+     */
+    struct Buffer {
+        QMutex              mutex;
+        std::vector<char>   data;
+    };
+
 public slots:
+    /** Result of a check in the worker pool. The response is empty if there
+     * was no update newer than revision.
+     */
+    void checkDone(qulonglong connection, qulonglong sequence, uint revision,
+                   QDateTime deadline, int generation, QByteArray response);
+
+private slots:
+    void wake();
+    void expire();
 
 private:
-    char m_buffer[100000];
+    struct Poll {
+        qulonglong  connection;
+        qulonglong  sequence;
+        uint        revision;
+        QDateTime   deadline;
+    };
+
+    void check(const Poll& poll);
+
+    /** The buffer of connection, which is created on first use. */
+    boost::shared_ptr<Buffer> buffer(qulonglong connection);
 
-    bool addExposedModelUpdate(QTextStream& os, unsigned int revision);
-    QString m_request;
-    QWaitCondition m_waitCondition;
-    QMutex m_mutex;
     boost::shared_ptr<tinia::model::ExposedModel> m_model;
-    tinia::model::impl::xml::XMLHandler m_xmlHandler;
-    QTextStream& m_textStream;
+    QThreadPool*        m_workers;
+    HTTPServer*         m_server;
+    QList<Poll>         m_parked;
+    QMap<qulonglong, boost::shared_ptr<Buffer> > m_buffers;
+    QAtomicInt          m_generation;  // Incremented for every change in the model.
+    QAtomicInt          m_wakePending;
+    QTimer              m_expireTimer;
 };
 
 } // namespace impl
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QByteArray>
+#include <QVariant>
+#include <QAtomicInt>
+#include <QThreadPool>
+#include <tinia/model.hpp>
+#include "tinia/jobcontroller/ModelChannel.hpp"
+
+namespace tinia {
+namespace qtcontroller {
+namespace impl {
+
+class HTTPServer;
+
+/** Keeps the exposed model of the clients in sync over WebSockets
+ * (model_channel), see tinia::jobcontroller::ModelChannel for the protocol.
+ *
+ * Compared to the long-poll of getExposedModelUpdate.xml and the posts of
+ * updateState.xml, an update from the client costs one frame instead of a
+ * request, and an update from the job is pushed as soon as it is ready,
+ * without a poll being reissued.
+ *
+ * The updates of a channel are applied, and the model updates for it built,
+ * in the worker pool, one job at a time per channel so that the order is
+ * kept. Lives in the main thread.
+ */
+class ModelChannelHandler : public QObject, public tinia::model::StateListener
+{
+    Q_OBJECT
+public:
+    explicit ModelChannelHandler(boost::shared_ptr<tinia::model::ExposedModel> model,
+                                 QThreadPool* workers,
+                                 HTTPServer* server);
+
+    ~ModelChannelHandler();
+
+    /** Answers the handshake of request number sequence on connection. */
+    void addChannel(qulonglong connection, qulonglong sequence, const QString& request);
+
+    /** Bytes read from the connection of a channel. */
+    void receive(qulonglong connection, const QByteArray& data);
+
+    /** Forgets the channel of a closed connection. */
+    void cancel(qulonglong connection);
+
+    /** May be invoked from any thread. */
+    void stateElementModified(model::StateElement *stateElement);
+
+public slots:
+    /** Result of a job in the worker pool: the sequence numbers of the
+     * updates applied and the revision after each, and the model update for
+     * the client (empty if there was none).
+     */
+    void workDone(qulonglong connection, QVariantList sequences, QVariantList revisions,
+                  QByteArray update);
+
+private slots:
+    void wake();
+
+private:
+    struct Channel {
+        tinia::jobcontroller::ModelChannel      protocol;
+        bool                                    synced;     // Got the revision of the client.
+        bool                                    busy;       // A job is in the worker pool.
+        int                                     generation; // Of the model at the last job.
+        QList<QPair<qulonglong, QByteArray> >   updates;    // Waiting to be applied.
+    };
+
+    /** Starts a job for the channel if it has something to do and is idle. */
+    void work(qulonglong connection, Channel& channel);
+
+    /** Writes the output of the channel, and closes the connection if the
+     * channel is closed.
+     */
+    void flush(qulonglong connection, Channel& channel);
+
+    boost::shared_ptr<tinia::model::ExposedModel> m_model;
+    QThreadPool*                m_workers;
+    HTTPServer*                 m_server;
+    QHash<qulonglong, Channel>  m_channels;
+    QAtomicInt                  m_generation;  // Incremented for every change in the model.
+    QAtomicInt                  m_wakePending;
+};
+
+} // namespace impl
+} // namespace qtcontroller
+} // namespace tinia
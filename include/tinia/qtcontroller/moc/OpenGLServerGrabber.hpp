@@ -4,13 +4,26 @@
 #include <QMutex>
 #include <QWaitCondition>
 #include <QTextStream>
+#include <QThreadPool>
 #include "tinia/jobcontroller.hpp"
+#include "tinia/jobcontroller/SnapshotCache.hpp"
+#include "tinia/jobcontroller/RenderCoalescer.hpp"
+#include "tinia/jobcontroller/FrameDelta.hpp"
+#include "tinia/jobcontroller/ProgressiveRefinement.hpp"
+#include <boost/scoped_ptr.hpp>
 #include "tinia/qtcontroller/ImageSource.hpp"
+#include "tinia/qtcontroller/impl/ImageEncoder.hpp"
 
 namespace tinia {
 namespace qtcontroller {
 namespace impl {
 
+/** Renders views into an offscreen framebuffer and reads them back.
+ *
+ * The grabbed images are handed out as owned buffers from a pool, so that the
+ * framebuffer is only busy during rendering and readback, and the (much
+ * slower) encoding can run in parallel on encoderPool().
+ */
 class OpenGLServerGrabber : public QObject
 {
     Q_OBJECT
@@ -19,26 +32,56 @@ public:
 
     ~OpenGLServerGrabber();
 
-    /** Mutex that governs exclusive access to this object. */
-    QMutex*
-    exclusiveAccessMutex()
-    { return &m_mainMutex; }
+    /** Thread pool for encoding the grabbed images, see ImageEncoder.
+     *
+     * The number of threads is read from env['TINIA_ENCODE_THREADS'] (default
+     * is the number of cores).
+     */
+    QThreadPool*
+    encoderPool()
+    { return &m_encoders; }
+
+    /** Encoded snapshots, reused while the exposed model is unchanged.
+     *
+     * The size is read from env['TINIA_SNAPSHOT_CACHE_SIZE'] (default 0,
+     * which disables caching and ETags, see SnapshotCache).
+     */
+    tinia::jobcontroller::SnapshotCache*
+    snapshotCache()
+    { return &m_snapshots; }
+
+    /** Shares the renders of identical snapshot requests from different clients. */
+    tinia::jobcontroller::RenderCoalescer*
+    renderCoalescer()
+    { return &m_renders; }
 
-    /** Returns a pointer to the grabbed image.
+    /** The last frames sent to the clients of snapshot_delta.bin.
      *
-     * \note \ref exclusiveAccessMutex must be held before invocation.
+     * The whole frame is sent when more than env['TINIA_DELTA_THRESHOLD']
+     * (default 0.5) of it has changed.
      */
-    const unsigned char*
-    imageBuffer() const
-    { return m_buffer; }
+    tinia::jobcontroller::FrameDelta*
+    frameDelta()
+    { return &m_deltas; }
+
+    /** Sets the model of the job, which decides on progressive refinement. */
+    void
+    setExposedModel( boost::shared_ptr<tinia::model::ExposedModel> model );
+
+    /** Reduces the quality of snapshots during interaction, NULL until
+     * setExposedModel has been called.
+     */
+    tinia::jobcontroller::ProgressiveRefinement*
+    progressiveRefinement()
+    { return m_refinement.get(); }
 
     /** Grabs an image of a view
      *
      * \note Must be invoked in the thread that holds the OpenGL context,
      *       usually the main/GUI-thread.
-     * \note \ref exclusiveAccessMutex must be held before invocation.
+     * \returns The image, width x height.
      */
-    void
+    GrabbedImagePtr
     grabRGB( tinia::jobcontroller::OpenGLJob* job,
              unsigned int width,
              unsigned int height,
@@ -49,16 +92,16 @@ public:
      * \note The buffer is transformed to an RGB image with depth values encoded as fixed point numbers.
      * \note Must be invoked in the thread that holds the OpenGL context,
      *       usually the main/GUI-thread.
-     * \note \ref exclusiveAccessMutex must be held before invocation.
+     * \returns The image, depth_w x depth_h if these are given, width x height otherwise.
      */
-    void
+    GrabbedImagePtr
     grabDepth( tinia::jobcontroller::OpenGLJob* job,
                unsigned int width,
                unsigned int height,
                const std::string &key,
                const unsigned depth_w = 0,                  // The default value 0 means that the size of the canvas (i.e., width x height) will be used for the depth buffer also.
                const unsigned depth_h = 0,                  // NB! Downscaling may still be performed, but then by the caller of this routine. This happens when QImage.scaled() is
-                                                            // used for downscaling, this happens in ~SnapshotAsTextFetcher(), see ServerThread.cpp.
+                                                            // used for downscaling, this happens in encodeImage(), see ImageEncoder.cpp.
                const bool bi_linear_filtering = false,      // Only for our own downscaling, QImage.scaled() will never do filtering.
                const bool depth16 = false );
 
@@ -66,9 +109,17 @@ private:
     void setupOpenGL();
     void resize(unsigned int width, unsigned int height);
 
+    /** Serializes use of the framebuffer. */
     QMutex          m_mainMutex;
+    /** Scratch space for the float depth values. */
     unsigned char*  m_buffer;
     size_t          m_buffer_size;
+    boost::shared_ptr<ImagePool> m_images;
+    QThreadPool     m_encoders;
+    tinia::jobcontroller::SnapshotCache m_snapshots;
+    tinia::jobcontroller::RenderCoalescer m_renders;
+    tinia::jobcontroller::FrameDelta m_deltas;
+    boost::scoped_ptr<tinia::jobcontroller::ProgressiveRefinement> m_refinement;
     bool            m_openglIsReady;
     unsigned int    m_fbo;
     unsigned int    m_renderbufferRGBA;
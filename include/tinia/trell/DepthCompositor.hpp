@@ -0,0 +1,116 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <vector>
+#include <cstddef>
+
+namespace tinia {
+namespace trell {
+
+/** Sort-last compositing of images rendered by several jobs.
+  *
+  * Each layer is an RGB image and a depth image of the same size, with depth
+  * encoded as in TRELL_PIXEL_FORMAT_RGB_CUSTOM_DEPTH: three bytes per pixel,
+  * most significant first. The encoding preserves order, so depths are
+  * compared as 24 bit integer keys. For each pixel, the layer nearest the
+  * viewer wins; on equal depth, the first layer wins.
+  *
+  * The inner loops select without branches, such that the compiler can
+  * vectorize them, and the rows are split over a number of threads.
+  */
+class DepthCompositor
+{
+public:
+
+    /** One partial image, not owned by the compositor. */
+    struct Layer
+    {
+        Layer( const unsigned char* rgb = NULL, const unsigned char* depth = NULL )
+            : m_rgb( rgb ), m_depth( depth )
+        {}
+
+        /** Packed RGB, 3 bytes per pixel. */
+        const unsigned char*    m_rgb;
+        /** Encoded depth, 3 bytes per pixel. */
+        const unsigned char*    m_depth;
+    };
+
+    /** Constructor.
+      *
+      * \param threads                Maximum number of threads, 0 for one per
+      *                               core.
+      * \param min_pixels_per_thread  Smaller images use fewer threads.
+      */
+    DepthCompositor( unsigned int threads = 0, size_t min_pixels_per_thread = 16384 );
+
+    /** The maximum number of threads used. */
+    unsigned int
+    threads() const
+    { return m_threads; }
+
+    /** Composite layers of pixels pixels.
+      *
+      * \param rgb     Resulting RGB, 3 bytes per pixel.
+      * \param depth   Resulting depth as keys, see key().
+      * \param layers  At least one layer.
+      */
+    void
+    composite( unsigned char*              rgb,
+               unsigned int*               depth,
+               const std::vector<Layer>&   layers,
+               size_t                      pixels ) const;
+
+    /** The depth key of an encoded depth, (b0<<16) | (b1<<8) | b2. */
+    static
+    unsigned int
+    key( const unsigned char* depth )
+    { return (depth[0]<<16u) | (depth[1]<<8u) | depth[2]; }
+
+    /** Encode depth keys, resampled from width x height to depth_width x
+      * depth_height (nearest neighbour, as the rendering jobs do).
+      *
+      * \param depth16  Only keep the two most significant bytes.
+      */
+    static
+    void
+    encode( unsigned char*          encoded,
+            const unsigned int*     depth,
+            size_t                  width,
+            size_t                  height,
+            size_t                  depth_width,
+            size_t                  depth_height,
+            bool                    depth16 );
+
+protected:
+    unsigned int    m_threads;
+    size_t          m_min_pixels_per_thread;
+
+    /** Composite the pixels [begin, end). */
+    static
+    void
+    compositeRange( unsigned char*              rgb,
+                    unsigned int*               depth,
+                    const std::vector<Layer>&   layers,
+                    size_t                      begin,
+                    size_t                      end );
+
+};
+
+} // of namespace trell
+} // of namespace tinia
@@ -0,0 +1,136 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+
+namespace tinia {
+namespace trell {
+
+/** Accounting of the jobs on each rendering device, used by the master to
+  * place new jobs.
+  *
+  * The jobs report the time of their recent renders and readbacks, and their
+  * memory footprint, in their heartbeats. The cost of a device is the sum of
+  * the per-frame times of its jobs, where a job counts at least min_job_ms,
+  * such that jobs that have not rendered yet (or are idle) still count. A new
+  * job is placed on the device with the lowest cost, then fewest jobs, then
+  * least memory, then first in the list.
+  *
+  * The per-frame time is measured on the device, so a slower device (say, a
+  * software renderer) gets fewer jobs of the same kind than a fast one.
+  */
+class DevicePlacement
+{
+public:
+
+    /** What a job reports about itself. */
+    struct Load
+    {
+        Load();
+
+        /** Recent milliseconds per frame spent rendering. */
+        double          m_render_ms;
+        /** Recent milliseconds per frame spent reading back the frame. */
+        double          m_readback_ms;
+        /** Resident memory of the job, in kilobytes. */
+        unsigned long   m_memory_kb;
+    };
+
+    /** The sum over the jobs of a device. */
+    struct Device
+    {
+        Device();
+
+        std::string     m_id;
+        size_t          m_jobs;
+        double          m_render_ms;
+        double          m_readback_ms;
+        unsigned long   m_memory_kb;
+        /** The sum of the job costs, which placement minimizes. */
+        double          m_cost;
+    };
+
+    /** Constructor.
+      *
+      * \param min_job_ms  The least a job costs, even if idle.
+      */
+    DevicePlacement( double min_job_ms = 1.0 );
+
+    /** Set the devices that jobs may be placed on. Jobs on other devices (that
+      * is, pinned) are still accounted for.
+      */
+    void
+    setDevices( const std::vector<std::string>& devices );
+
+    /** The devices that jobs may be placed on. */
+    const std::vector<std::string>&
+    devices() const
+    { return m_devices; }
+
+    /** Place job on the least loaded device.
+      *
+      * \returns The device id, or an empty string if there are no devices.
+      */
+    const std::string
+    place( const std::string& job );
+
+    /** Note that job runs on device, for jobs that were pinned to a device. */
+    void
+    assign( const std::string& job, const std::string& device );
+
+    /** The device of job, or an empty string if unknown. */
+    const std::string
+    device( const std::string& job ) const;
+
+    /** Update the load that job reported. */
+    void
+    update( const std::string& job, const Load& load );
+
+    /** Forget job, when it has terminated. */
+    void
+    remove( const std::string& job );
+
+    /** Sums over the jobs on device. */
+    const Device
+    deviceLoad( const std::string& device ) const;
+
+    /** An xml-encoded <deviceLoad> element with the load of each device. */
+    const std::string
+    xml() const;
+
+protected:
+    struct Job
+    {
+        std::string     m_device;
+        Load            m_load;
+    };
+
+    double                          m_min_job_ms;
+    std::vector<std::string>        m_devices;
+    std::map<std::string, Job>      m_jobs;
+
+    double
+    cost( const Load& load ) const;
+
+};
+
+} // of namespace trell
+} // of namespace tinia
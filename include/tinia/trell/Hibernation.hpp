@@ -0,0 +1,71 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+
+namespace tinia {
+namespace trell {
+
+/** The file that a hibernated job keeps its state in.
+  *
+  * The file holds the xml-encoded state of the exposed model, its revision
+  * number, and the payload of the job's hibernate hook. It is written to a
+  * temporary file that is then renamed, so a job that dies while hibernating leaves no partial file, and
+  * it is removed when the job has been restored.
+  */
+class Hibernation
+{
+public:
+
+    /** The path of the hibernation file of a job. */
+    static
+    const std::string
+    path( const std::string& job_id );
+
+    /** Write the state of a job.
+      *
+      * \param path     The file to write.
+      * \param model    The xml-encoded exposed model.
+      * \param payload  The payload of the job's hibernate hook.
+      * \param revision The revision number of the exposed model, which the
+      *                 clients may hold.
+      * \returns True if the file was written.
+      */
+    static
+    bool
+    write( const std::string& path,
+           const std::string& model,
+           const std::string& payload,
+           unsigned int revision );
+
+    /** Read the state of a job.
+      *
+      * \returns True if the file exists and is complete.
+      */
+    static
+    bool
+    read( const std::string& path,
+          std::string& model,
+          std::string& payload,
+          unsigned int& revision );
+
+};
+
+} // of namespace trell
+} // of namespace tinia
@@ -0,0 +1,116 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <map>
+#include <vector>
+#include <string>
+#include "tinia/trell/IPCJobController.hpp"
+#include "tinia/trell/DepthCompositor.hpp"
+
+namespace tinia {
+namespace trell {
+
+/** Job controller that renders by compositing the snapshots of other jobs.
+  *
+  * Sort-last parallel rendering: each worker job holds a part of the scene
+  * and renders the same viewers. For each snapshot, this controller passes
+  * the viewer of its own exposed model on to the workers (as a state update,
+  * when it has changed), fetches their colour and depth
+  * (TRELL_PIXEL_FORMAT_RGB_CUSTOM_DEPTH) in parallel, and keeps the nearest
+  * fragment of each pixel, see DepthCompositor.
+  *
+  * The workers must expose viewers with the same keys. If a worker cannot be
+  * updated or does not reply, the snapshot fails (and is logged) rather than
+  * showing a frame with a part of the scene missing.
+  *
+  * The snapshot cache of the controller only knows about its own model, so it
+  * must stay disabled (the default) if the workers change their scenes by
+  * themselves.
+  */
+class IPCCompositingJobController : public IPCJobController
+{
+public:
+
+    /** Constructor.
+      *
+      * \param workers  Job ids of the workers. If empty, they are read from
+      *                 env['TINIA_COMPOSITE_WORKERS'], separated by ';'.
+      */
+    IPCCompositingJobController( const std::vector<std::string>& workers = std::vector<std::string>(),
+                                 bool is_master = false );
+
+    /** The job ids of the workers. */
+    const std::vector<std::string>&
+    workers() const
+    { return m_workers; }
+
+protected:
+    std::vector<std::string>                m_workers;
+    DepthCompositor                         m_compositor;
+    /** The last viewer sent, per worker and viewer key. */
+    std::map<std::string, std::string>      m_sent_viewers;
+    /** Reply buffers of the workers, reused between snapshots. */
+    std::vector< std::vector<char> >        m_replies;
+    std::vector<unsigned int>               m_depth;
+
+    /** \copydoc MessageBox::init */
+    virtual
+    bool
+    init();
+
+    /** Fetches and composites the snapshots of the workers. */
+    virtual
+    bool
+    onGetSnapshot( char*               buffer,
+                   TrellPixelFormat    pixel_format,
+                   const size_t        width,
+                   const size_t        height,
+                   const size_t        depth_width,
+                   const size_t        depth_height,
+                   const bool          depth16,
+                   const bool          dump_images,
+                   const std::string&  session,
+                   const std::string&  key );
+
+    /** An xml-encoded state update with the viewer key, as sent by clients. */
+    const std::string
+    viewerUpdate( const std::string& key );
+
+    /** Send a state update to worker, unless it was the last one sent for key. */
+    virtual
+    bool
+    updateWorker( const std::string& worker,
+                  const std::string& key,
+                  const std::string& xml );
+
+    /** Fetch the colour and depth of key from worker into reply. */
+    virtual
+    bool
+    fetchSnapshot( const std::string&   worker,
+                   const std::string&   key,
+                   const std::string&   session,
+                   size_t               width,
+                   size_t               height,
+                   std::vector<char>*   reply,
+                   char*                ok );
+
+};
+
+} // of namespace trell
+} // of namespace tinia
@@ -19,7 +19,9 @@
 #pragma once
 
 #include <string>
+#include <ctime>
 #include <semaphore.h>
+#include <boost/thread/shared_mutex.hpp>
 #include <tinia/ipc/ipc_msg.h>
 #include "trell.h"
 #include "tinia/jobcontroller/Controller.hpp"
@@ -91,10 +93,20 @@ public:
 
 
 
-    /** Notify long-pollers that they might fetch status. */
+    /** Notify long-pollers that they might fetch status.
+      *
+      * Thread-safe, also while a pooled job moves its message box.
+      */
     void
     notify();
 
+    /** Notify clients waiting for a reply rendered in the background.
+      *
+      * Long-pollers of the model are not woken. Thread-safe, as notify.
+      */
+    void
+    notifyRenders();
+
     /** Adds the script to the main script engine. This will be uploaded to javascript */
     void addScript(const std::string& script);
 
@@ -193,6 +205,17 @@ protected:
     size_t
     handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size ) = 0;
 
+    /** The recent rendering load of the job, reported in the heartbeats.
+      *
+      * \param render_ms    Milliseconds per frame spent rendering.
+      * \param readback_ms  Milliseconds per frame spent reading back frames.
+      *
+      * The default is zero for both, for jobs that do not render.
+      */
+    virtual
+    void
+    renderLoad( double& render_ms, double& readback_ms );
+
     /** Convenience function to send a message without payload to a message box.
       *
       * \param message_box_id   The id of the message box.
@@ -216,6 +239,9 @@ private:
     int             m_cleanup_pid;
 
     tinia_ipc_msg_server_t*  m_msgbox;
+    /** Held shared by users of m_msgbox outside run(), and exclusively by
+      * run() while the message box of a pooled job is moved. */
+    boost::shared_mutex      m_msgbox_mutex;
     /** The id of this message box. */
     std::string     m_id;
     /** True of this job is the master job. */
@@ -224,6 +250,12 @@ private:
     std::string     m_master_id;
     /** The current state of this job/messagebox */
     TrellJobState   m_job_state;
+    /** The job id given by the master to a pre-started job, which the message
+      * box is moved to when the mainloop has returned. */
+    std::string     m_assigned_id;
+    /** Monotonic time in seconds of the last message from a client, reported
+      * in the heartbeats such that the master can hibernate idle jobs. */
+    time_t          m_last_request;
 
     // /** A messenger to the master job's message box. */
     // tinia_ipc_msg_client_t*    m_master_mbox;
@@ -237,6 +269,16 @@ private:
     void
     shutdown();
 
+    /** Handles TRELL_MESSAGE_ASSIGN_JOB from the master.
+      *
+      * Notes the new job id and breaks the mainloop, and run() then recreates
+      * the message box under the new id.
+      *
+      * \returns The size of the reply message.
+      */
+    size_t
+    assign( tinia_msg_t* msg, size_t msg_size, size_t buf_size );
+
 
     struct Context
     {
@@ -21,11 +21,27 @@
 #include <unordered_map>
 #include "tinia/jobcontroller/OpenGLJob.hpp"
 #include "tinia/trell/OffscreenGL.hpp"
+#include "tinia/trell/RenderQueue.hpp"
 #include "IPCJobController.hpp"
 
 namespace tinia {
 namespace trell {
 
+/** Job controller for OpenGL jobs.
+  *
+  * The OpenGL context lives on a render thread (see RenderQueue), where
+  * initGL, renderFrame and the rest of the snapshot handling are run. By
+  * default, the message server thread waits while a snapshot is rendered, so
+  * renderFrame never runs at the same time as model updates or getRenderList
+  * from a client.
+  *
+  * A job that can render while its model is updated and its render list is
+  * read may set env['TINIA_ASYNC_SNAPSHOTS'] to 1. The server thread then
+  * keeps serving model updates, model long-polls and render lists while a
+  * snapshot is rendered. A snapshot query is answered with
+  * TRELL_MESSAGE_RETRY until it has been rendered, and the clients waiting for
+  * it are woken by notifyRenders when the snapshot is ready.
+  */
 class IPCGLJobController : public IPCJobController
 {
 public:
@@ -38,6 +54,8 @@ public:
      * This is a kludge to let specific jobs enable MSAA, and the API and
      * behaviour WILL most likely change.
      *
+     * Frames rendered during interaction in progressive refinement mode (see
+     * jobcontroller::ProgressiveRefinement) are never multisampled.
      */
     void
     setQuality( int quality );
@@ -56,6 +74,14 @@ protected:
     void
     cleanup();
 
+    /** The averages of the recent snapshots. */
+    void
+    renderLoad( double& render_ms, double& readback_ms );
+
+    /** Passes snapshot queries on to the render thread. */
+    size_t
+    handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size );
+
     virtual
     bool
     onGetSnapshot( char*               buffer,
@@ -100,6 +126,37 @@ private:
 
     std::unordered_map<std::string, RenderEnvironment>  m_render_environments;
 
+    RenderQueue*                                        m_render_queue;
+    bool                                                m_async_snapshots;
+    /** Snapshots are rendered here before they are copied to the reply,
+      * as the message buffer is reused by the server thread meanwhile.
+      */
+    char*                                               m_render_buffer;
+    size_t                                              m_render_buffer_size;
+    /** Moving averages of the time spent rendering and reading back
+      * snapshots, updated on the render thread, read by heartbeats. */
+    boost::mutex                                        m_load_mutex;
+    double                                              m_render_ms;
+    double                                              m_readback_ms;
+
+    /** Creates and binds the context, on the render thread. */
+    void
+    setupContext( bool* result );
+
+    /** Answers a snapshot query in place, on the render thread. */
+    void
+    renderSnapshot( tinia_msg_t* msg, size_t msg_size, size_t buf_size, size_t* reply_size );
+
+    /** Renders the reply to a queued snapshot query, on the render thread. */
+    void
+    renderReply( const std::string& query, std::string& reply, size_t buf_size );
+
+    void
+    initGL( bool* result );
+
+    void
+    releaseContext();
+
     RenderEnvironment*
     getRenderEnvironment( GLsizei width, GLsizei height, GLsizei samples );
     
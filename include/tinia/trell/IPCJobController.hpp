@@ -18,7 +18,11 @@
 
 #pragma once
 #include "IPCController.hpp"
+#include "NotificationCoalescer.hpp"
 #include "tinia/jobcontroller/Job.hpp"
+#include "tinia/jobcontroller/SnapshotCache.hpp"
+#include "tinia/jobcontroller/FrameDelta.hpp"
+#include "tinia/jobcontroller/ProgressiveRefinement.hpp"
 
 
 namespace tinia {
@@ -152,16 +156,82 @@ protected:
                    const size_t        buffer_size,
                    const std::string&  session );
 
+    /** Save the exposed model and the job's hibernate payload to path.
+      *
+      * \param scratch       Space for the xml-encoded model.
+      * \param scratch_size  The size of scratch.
+      * \returns True if the job can stop, and be restored from path.
+      */
+    virtual
+    bool
+    onHibernate( const std::string&  path,
+                 char*               scratch,
+                 const size_t        scratch_size );
+
+    /** Restore the exposed model and the job's payload from path, written by
+      * onHibernate, when the job is restarted with env['TINIA_RESTORE_STATE']
+      * set to path.
+      */
+    virtual
+    bool
+    restoreState( const std::string& path );
+
     void stateElementModified(model::StateElement *stateElement);
+    void stateElementsModified(std::vector<model::StateElement>& stateElements);
+    void stateElementsReleased(std::vector<model::StateElement>& stateElements);
     void stateSchemaElementAdded(model::StateSchemaElement *stateSchemaElement);
     void stateSchemaElementRemoved(model::StateSchemaElement *stateSchemaElement);
     void stateSchemaElementModified(model::StateSchemaElement *stateSchemaElement);
 
+    /** Ask for long-pollers to be notified, coalesced with other requests.
+      *
+      * The minimum time between two notifications is read from
+      * env['TINIA_NOTIFICATION_INTERVAL_MS'] (default 20 ms, 0 disables
+      * coalescing).
+      */
+    void
+    requestNotification();
+
+    /** Deliver a pending notification immediately (end of a batch of updates). */
+    void
+    flushNotifications();
+
 protected:
     boost::shared_ptr<model::ExposedModel>    m_model;
     jobcontroller::Job*                        m_job;
     model::impl::xml::XMLHandler*                m_xmlHandler;
     volatile bool                            m_updateOngoing;
+    NotificationCoalescer*                   m_notifications;
+
+    /** Pixels of the latest snapshots, reused while the model is unchanged.
+      *
+      * The size is read from env['TINIA_SNAPSHOT_CACHE_SIZE'] (default 0,
+      * which disables caching, see SnapshotCache). The hit rate is logged every
+      * 100 snapshot requests.
+      */
+    jobcontroller::SnapshotCache             m_snapshot_cache;
+
+    /** The last frame sent to each client in delta mode (snapshot_delta.bin).
+      *
+      * A whole frame is sent when more than env['TINIA_DELTA_THRESHOLD']
+      * (default 0.5) of it has changed.
+      */
+    jobcontroller::FrameDelta                m_frame_delta;
+    std::vector<unsigned char>               m_delta_frame;
+
+    /** Reduces the quality of snapshots during interaction, if the job has
+      * turned it on (see ProgressiveRefinement::enable).
+      */
+    jobcontroller::ProgressiveRefinement*    m_refinement;
+
+    /** Set while rendering a reduced quality frame, when onGetSnapshot
+      * should skip costly rendering such as multisampling.
+      */
+    bool                                     m_interactive_frame;
+
+    /** Replies to a TRELL_MESSAGE_GET_SNAPSHOT with TRELL_PIXEL_FORMAT_RGB_DELTA. */
+    size_t
+    handleDeltaSnapshot( tinia_msg_t* msg, size_t buf_size );
 
     /** Handles incoming messages (mainly from master job).
       *
@@ -0,0 +1,100 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace tinia {
+namespace trell {
+
+/** Coalesces and rate-limits notifications to long-polling clients.
+  *
+  * Every model modification results in a call to request(). Instead of
+  * waking the clients for each of them, the coalescer delivers at most one
+  * notification per interval: the first request after a quiet period is
+  * delivered immediately, and requests arriving while the interval is running
+  * are merged into a single notification delivered when it expires. flush()
+  * delivers a pending notification right away, and is used at the end of a
+  * batch of updates.
+  *
+  * No request is lost: a request is always followed by a delivery that
+  * happens after it.
+  *
+  * Delivery happens either from the thread calling request() or flush(), or
+  * from a helper thread owned by the coalescer.
+  */
+class NotificationCoalescer
+{
+public:
+
+    /** Constructor.
+      *
+      * \param deliver   Function that actually notifies the clients.
+      * \param interval  Minimum time between two notifications. Zero disables
+      *                  coalescing; every request is delivered immediately.
+      */
+    NotificationCoalescer( boost::function<void()> deliver,
+                           boost::posix_time::time_duration interval );
+
+    ~NotificationCoalescer();
+
+    /** Request that clients are notified. Thread-safe. */
+    void
+    request();
+
+    /** Deliver a pending notification now, ignoring the interval. */
+    void
+    flush();
+
+    /** Set the minimum time between two notifications. */
+    void
+    setInterval( boost::posix_time::time_duration interval );
+
+    /** Number of notifications requested so far. */
+    unsigned long
+    requested() const;
+
+    /** Number of notifications actually delivered so far. */
+    unsigned long
+    delivered() const;
+
+protected:
+    boost::function<void()>             m_deliver;
+    boost::posix_time::time_duration    m_interval;
+    boost::posix_time::ptime            m_last_delivery;
+    bool                                m_pending;
+    bool                                m_stop;
+    unsigned long                       m_requested;
+    unsigned long                       m_delivered;
+    mutable boost::mutex                m_mutex;
+    boost::condition_variable           m_cond;
+    boost::thread                       m_thread;
+
+    /** Delivers the pending notification, m_mutex must be held by lock. */
+    void
+    deliver( boost::mutex::scoped_lock& lock );
+
+    /** Body of the helper thread delivering deferred notifications. */
+    void
+    run();
+};
+
+} // of namespace trell
+} // of namespace tinia
@@ -17,6 +17,7 @@
  */
 #pragma once
 #include<string>
+#include<list>
 #include <X11/Xlib.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
@@ -25,6 +26,14 @@ namespace tinia {
 namespace trell {
 namespace impl {
 
+/** An OpenGL context without a visible window.
+ *
+ * The context is created with GLX on an X display (":0.0"), or, if the
+ * library is built with EGL (TINIA_HAVE_EGL), headless with EGL:
+ * "egl:surfaceless" uses the surfaceless platform of Mesa (llvmpipe on a box
+ * without a GPU), and "egl:N" the N'th device of EGL_EXT_device_enumeration.
+ * The EGL contexts need neither an X server nor X round-trips.
+ */
 class OffscreenGL
 {
 public:
@@ -34,6 +43,7 @@ public:
         STATE_NO_SCREENS,
         STATE_INSUFFICIENT_GLX,
         STATE_X_ERROR,
+        STATE_EGL_ERROR,
         STATE_INITIALIZED,
         STATE_CONTEXT_BOUND
     };
@@ -55,8 +65,35 @@ public:
     bool
     bindContext();
 
+    /** Unbinds the context from the calling thread, so it can be bound by another. */
+    bool
+    releaseContext();
+
+    /** True if display_string names an EGL device ("egl:..."). */
+    static
+    bool
+    isEGLDevice( const std::string& display_string );
+
+    /** True if the library is built with the EGL backend. */
+    static
+    bool
+    hasEGL();
+
+    /** Ids of the EGL devices that are available, see the class description. */
+    static
+    std::list<std::string>
+    eglDevices();
+
     ObjectState
     state() const { return m_state; }
+
+    /** True if the context is created with EGL, then display() is NULL. */
+    bool
+    isEGL() const { return m_egl_display != NULL; }
+
+    /** The EGLDisplay of an EGL context. */
+    void*
+    eglDisplay() { return m_egl_display; }
     
     Display*
     display() { return m_display; }
@@ -81,6 +118,12 @@ protected:
     Display*    m_display;
     GLXContext  m_context;
     Window      m_window;
+
+    // EGL types are pointers, kept as void* so that users of this header do
+    // not depend on whether the library is built with EGL.
+    void*       m_egl_display;
+    void*       m_egl_context;
+    void*       m_egl_surface;
     
     bool        m_req_profile;
     bool        m_req_debug;
@@ -97,6 +140,9 @@ protected:
     static
     int
     createContextErrorHandler( Display* display, XErrorEvent* error );
+
+    bool
+    setupEGLContext();
     
 };
 
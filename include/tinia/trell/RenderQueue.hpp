@@ -0,0 +1,150 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <string>
+#include <map>
+#include <deque>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace tinia {
+namespace trell {
+
+/** A render thread, fed by a queue, that hands its replies back to the
+  * message server thread.
+  *
+  * Snapshots are rendered on this thread, which owns the OpenGL context of the
+  * job, while the message server thread keeps serving model updates, model
+  * long-polls and render lists. A query for a snapshot is answered by reply():
+  * if no reply is ready, the query is queued for rendering and reply()
+  * returns false, after which the server tells the client to wait for a
+  * render notification (TRELL_MESSAGE_RETRY). When the render is done, notify
+  * is invoked, the client sends the same query again, and reply() returns the
+  * rendered reply.
+  *
+  * Queries are identified by their bytes. Each query waits for a model
+  * revision, which is the revision of the model when the client first asked,
+  * and is given back by the client when it sends the query again. The
+  * revision of the model is read when a render starts, and a reply is served
+  * to every query waiting for that revision or an earlier one. So a client is
+  * served by the first render that starts after it asked, even if the model
+  * keeps changing while it is rendered. A reply is kept until a later render
+  * of the same query replaces it, or until it is older than max_age.
+  */
+class RenderQueue
+{
+public:
+
+    /** Renders the reply to a query, invoked on the render thread. */
+    typedef boost::function<void( const std::string& query, std::string& reply )> Render;
+
+    /** Constructor, starts the render thread.
+      *
+      * \param notify    Wakes clients waiting for a render notification,
+      *                  invoked on the render thread when a reply is ready.
+      * \param revision  The current model revision, invoked on the render
+      *                  thread when a render starts.
+      * \param max_age   How long a reply is kept for its clients.
+      */
+    RenderQueue( boost::function<void()> notify,
+                 boost::function<unsigned int()> revision,
+                 boost::posix_time::time_duration max_age );
+
+    /** Stops the render thread. Queued renders are dropped. */
+    ~RenderQueue();
+
+    /** Runs task on the render thread, and waits until it is done. */
+    void
+    invoke( boost::function<void()> task );
+
+    /** Get the reply to query if it has been rendered.
+      *
+      * \param revision  The model revision the query waits for: the current
+      *                  revision when the query is first sent, and the same
+      *                  revision when it is sent again.
+      * \returns True, with the reply, if a render that started at revision or
+      *          later is done. Otherwise, the query is queued unless it
+      *          already is, and false is returned.
+      */
+    bool
+    reply( const std::string& query, unsigned int revision,
+           const Render& render, std::string& reply );
+
+    /** Number of replies rendered. */
+    unsigned long
+    rendered() const;
+
+    /** Number of times a client was told to wait for a reply. */
+    unsigned long
+    deferred() const;
+
+    /** Number of replies given from the queue, as reply() returned true. */
+    unsigned long
+    served() const;
+
+    /** Number of replies dropped, as they were older than max_age. */
+    unsigned long
+    expired() const;
+
+protected:
+    struct Entry
+    {
+        Entry()
+            : m_queued( false ), m_rendering( false ), m_done( false ), m_started( 0u )
+        {}
+
+        Render                      m_render;
+        bool                        m_queued;       // In m_renders.
+        bool                        m_rendering;    // On the render thread.
+        bool                        m_done;         // m_reply has been rendered.
+        unsigned int                m_started;      // Revision when m_reply was started.
+        std::string                 m_reply;
+        boost::posix_time::ptime    m_finished;
+    };
+
+    boost::function<void()>                 m_notify;
+    boost::function<unsigned int()>         m_revision;
+    boost::posix_time::time_duration        m_max_age;
+    std::map<std::string, Entry>            m_entries;
+    std::deque<std::string>                 m_renders;
+    std::deque< boost::function<void()> >   m_tasks;
+    bool                                    m_stop;
+    unsigned long                           m_tasks_queued;
+    unsigned long                           m_tasks_done;
+    unsigned long                           m_rendered;
+    unsigned long                           m_deferred;
+    unsigned long                           m_served;
+    unsigned long                           m_expired;
+    mutable boost::mutex                    m_mutex;
+    boost::condition_variable               m_cond;
+    boost::thread                           m_thread;
+
+    /** Drops replies older than max_age that are not about to be rendered
+      * again, m_mutex must be held. */
+    void
+    expire( const boost::posix_time::ptime& now );
+
+    /** Body of the render thread. */
+    void
+    run();
+};
+
+} // of namespace trell
+} // of namespace tinia
@@ -33,6 +33,7 @@ extern "C" {
 #define TRELL_VIEWER_KEY_LIST_MAXLENGTH (10*(TRELL_KEYID_MAXLENGTH))
 #define TRELL_JPEG_QUALITY_STRING_MAXLENGTH 8
 #define TRELL_SNAPTYPE_STRING_MAXLENGTH 8
+#define TRELL_ETAG_MAXLENGTH 32
 
 /** The pixel formats that is used in the trell system. */
 enum TrellPixelFormat {
@@ -43,9 +44,72 @@ enum TrellPixelFormat {
     /** 8-bit normalized rgb data + 24-bit fixed point depth. */
     TRELL_PIXEL_FORMAT_RGB_CUSTOM_DEPTH,
     /** 8-bit normalized rgb data */
-    TRELL_PIXEL_FORMAT_RGB_JPG_VERSION // @@@ possibly not an optimal idea, alternative is to add a TRELL_REQUEST_JPG similar to TRELL_REQUEST_PNG
+    TRELL_PIXEL_FORMAT_RGB_JPG_VERSION, // @@@ possibly not an optimal idea, alternative is to add a TRELL_REQUEST_JPG similar to TRELL_REQUEST_PNG
+    /** 8-bit normalized rgb data, only the tiles that changed since the
+     * client's last frame, see TRELL_DELTA_CONTAINER_MAGIC. */
+    TRELL_PIXEL_FORMAT_RGB_DELTA
 };
 
+/** Binary snapshot container, the reply to snapshot.bin, jpg_snapshot.bin and
+ * snapshot_bundle.bin.
+ *
+ * All integers are 32-bit unsigned little-endian, matrices are 16 32-bit
+ * little-endian floats, and strings and images are prefixed by their size in
+ * bytes (strings are not zero-terminated).
+ *
+ * Header:
+ * - magic TRELL_SNAPSHOT_CONTAINER_MAGIC and TRELL_SNAPSHOT_CONTAINER_VERSION.
+ * - number of viewers, revision, timestamp string, snaptype string.
+ *
+ * Then, for each viewer:
+ * - key string, flags, depth width, depth height.
+ * - rgb image (png, or jpeg if TRELL_SNAPSHOT_FLAG_JPEG is set).
+ * - if TRELL_SNAPSHOT_FLAG_DEPTH is set: depth image (png), view matrix and
+ *   projection matrix.
+ */
+#define TRELL_SNAPSHOT_CONTAINER_MAGIC "TSNP"
+#define TRELL_SNAPSHOT_CONTAINER_VERSION 1
+#define TRELL_SNAPSHOT_FLAG_DEPTH 0x1u
+#define TRELL_SNAPSHOT_FLAG_JPEG  0x2u
+
+/** Delta snapshot container, the reply to snapshot_delta.bin.
+ *
+ * Holds the tiles of a viewer's image that changed since the frame given by
+ * the 'base' parameter, which the client pastes onto that frame. Integers
+ * and images are encoded as in the snapshot container.
+ *
+ * Header:
+ * - magic TRELL_DELTA_CONTAINER_MAGIC and TRELL_DELTA_CONTAINER_VERSION.
+ * - flags, image width, image height, frame, number of tiles.
+ *
+ * Then, for each tile:
+ * - x, y (from the top left corner), width, height.
+ * - png image.
+ *
+ * If TRELL_DELTA_FLAG_FULL is set, there is a single tile with the whole
+ * image. The frame is given as 'base' in the next request.
+ *
+ * In the TRELL_MESSAGE_IMAGE reply from the job, the delta_tiles tiles are
+ * described by four unsigned ints each (x, y, width, height), followed by
+ * their rgb pixels, bottom row first, each tile padded to a multiple of four
+ * bytes.
+ */
+#define TRELL_DELTA_CONTAINER_MAGIC "TDLT"
+#define TRELL_DELTA_CONTAINER_VERSION 1
+#define TRELL_DELTA_FLAG_FULL 0x1u
+
+/** Frame stream, the reply to snapshot_stream.png and snapshot_stream.jpg.
+ *
+ * A multipart/x-mixed-replace reply with one part per frame of the viewer,
+ * separated by TRELL_STREAM_BOUNDARY. A new frame is sent when the exposed
+ * model has changed, at most max_fps times a second. Each part has the
+ * headers Content-Type (image/png or image/jpeg), Content-Length and
+ * X-Tinia-Revision, the revision of the model the frame shows.
+ */
+#define TRELL_STREAM_BOUNDARY "tiniaframe"
+#define TRELL_STREAM_DEFAULT_FPS 30
+#define TRELL_STREAM_MAX_FPS 60
+
 /** States that a MessageBox/Master/Job/InteractiveJob can be in */
 enum TrellJobState {
     /** Process has begun to be set up. */
@@ -59,7 +123,11 @@ enum TrellJobState {
     /** A successful process is dead. */
     TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY,
     /** An unsuccessful process is dead. */
-    TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY
+    TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY,
+    /** The process has saved its state to disk and stopped, and is
+     * restarted when the job is requested again.
+     */
+    TRELL_JOBSTATE_HIBERNATED
 };
 
 /** Types of messages that is passed between trell process. */
@@ -94,7 +162,30 @@ enum TrellMessageType {
 
     TRELL_MESSAGE_GET_RENDERLIST,
 
-    TRELL_MESSAGE_GET_SCRIPTS
+    TRELL_MESSAGE_GET_SCRIPTS,
+
+    /** Reply that the reply is not ready yet, see tinia_msg_retry_t. Wait for
+     * a notification and send the query again.
+     */
+    TRELL_MESSAGE_RETRY,
+
+    /** Gives a pre-started job of the pool its job id, see
+     * tinia_msg_assign_job_t. The job replies TRELL_MESSAGE_OK, and then
+     * moves its message box to the new id.
+     */
+    TRELL_MESSAGE_ASSIGN_JOB,
+
+    /** Sent by the master to itself when child processes have exited, no
+     * payload. The master replies TRELL_MESSAGE_OK.
+     */
+    TRELL_MESSAGE_CHILD_EXITED,
+
+    /** Sent by the master to a job that has been idle, see
+     * tinia_msg_hibernate_t. The job saves its state to the given path and
+     * replies TRELL_MESSAGE_OK before it exits, or replies
+     * TRELL_MESSAGE_ERROR if it cannot hibernate.
+     */
+    TRELL_MESSAGE_HIBERNATE
 };
 
 /** Base message struct.
@@ -106,18 +197,49 @@ enum TrellMessageType {
 typedef struct tinia_msg
 {
     enum TrellMessageType   type;    
+    /** In replies: the microseconds the server spent handling the query,
+     * which mod_trell reports as the job stage of a request. */
+    unsigned int            handle_us;
 } tinia_msg_t;
 
 
-/** Message struct for TRELL_MESSAGE_HEARTBEAT. */
+/** Message struct for TRELL_MESSAGE_HEARTBEAT.
+ *
+ * The load fields are used by the master to place new jobs on the least
+ * loaded rendering device, and are zero for jobs that do not render.
+ */
 typedef struct tinia_msg_heartbeat
 {
     tinia_msg_t         msg;
     enum TrellJobState  state;
     char                job_id[ TINIA_IPC_JOBID_MAXLENGTH+1 ];
+    /** Recent milliseconds per frame spent rendering. */
+    float               render_ms;
+    /** Recent milliseconds per frame spent reading back the frame. */
+    float               readback_ms;
+    /** Resident memory of the job, in kilobytes. */
+    unsigned int        memory_kb;
+    /** Seconds since the job last got a message from a client. */
+    unsigned int        idle_s;
 } tinia_msg_heartbeat_t;
 
 
+/** Message struct for TRELL_MESSAGE_ASSIGN_JOB. */
+typedef struct tinia_msg_assign_job
+{
+    tinia_msg_t         msg;
+    char                job_id[ TINIA_IPC_JOBID_MAXLENGTH+1 ];
+} tinia_msg_assign_job_t;
+
+
+/** Message struct for TRELL_MESSAGE_HIBERNATE. */
+typedef struct tinia_msg_hibernate
+{
+    tinia_msg_t         msg;
+    char                path[ 256 ];
+} tinia_msg_hibernate_t;
+
+
 /** Message struct for TRELL_MESSAGE_HEARTBEAT. */
 // Also for TRELL_MESSAGE_GET_SNAPSHOT
 typedef struct {
@@ -130,6 +252,15 @@ typedef struct {
     char                    session_id[TRELL_SESSIONID_MAXLENGTH + 1];
     char                    key[ TRELL_KEYID_MAXLENGTH + 1 ];
     char                    viewer_key_list[ TRELL_VIEWER_KEY_LIST_MAXLENGTH + 1 ];
+    /** The tag of the snapshot the client already has (from If-None-Match), or empty. */
+    char                    etag[ TRELL_ETAG_MAXLENGTH + 1 ];
+    /** For TRELL_PIXEL_FORMAT_RGB_DELTA: the client, and the frame it has (0 if none). */
+    char                    client_id[ TRELL_SESSIONID_MAXLENGTH + 1 ];
+    unsigned int            delta_base;
+    /** Zero when the query is first sent. When the query is sent again after a
+     * TRELL_MESSAGE_RETRY, the revision of the retry reply: any render started
+     * at that revision or later answers the query. */
+    unsigned int            render_revision;
 } tinia_msg_get_snapshot_t;
 
 /** Message struct for TRELL_MESSAGE_GET_SCRIPTS. */
@@ -174,11 +305,35 @@ typedef struct {
     unsigned int            height;
     unsigned int            depth_width;
     unsigned int            depth_height;
+    /** Tag identifying the pixels, empty if the job does not cache snapshots. */
+    char                    etag[ TRELL_ETAG_MAXLENGTH + 1 ];
+    /** Nonzero if the pixels match the etag of the query, and are left out. */
+    int                     not_modified;
+    /** For TRELL_PIXEL_FORMAT_RGB_DELTA: the frame, the number of tiles, and
+     * nonzero if the single tile is the whole image. */
+    unsigned int            delta_frame;
+    unsigned int            delta_tiles;
+    int                     delta_full;
+    /** Jpeg quality to encode the images with, 0 means the one of the query.
+     * Set for the reduced quality frames of progressive refinement. */
+    int                     jpeg_quality;
+    /** Revision of the exposed model the images show, or 0 if not known.
+     * Streams wait for a newer revision before the next frame. */
+    unsigned int            revision;
 } tinia_msg_image_t;
 
 
 
 
+/** Message struct for TRELL_MESSAGE_RETRY. */
+typedef struct {
+    tinia_msg_t             msg;
+    /** The revision the query waits for, to be passed back in the
+     * render_revision field of the query when it is sent again. */
+    unsigned int            revision;
+} tinia_msg_retry_t;
+
+
 /** Message struct for TRELL_MESSAGE_XML. */
 typedef struct {
     tinia_msg_t             msg;
@@ -27,6 +27,7 @@ dojo.require("gui.TrackBallViewer");
 dojo.require("dojo.touch");
 dojo.require("gui.ProxyRenderer");
 dojo.require("gui.SnapshotTimings");
+dojo.require("gui.SnapshotContainer");
 
 
 
@@ -35,8 +36,15 @@ dojo.declare("gui.Canvas", [dijit._Widget], {
 
     constructor: function (params) {
 
-        // Available snapshot signatures
-        this._snapshotStrings = { png: "snapshot.txt", jpg: "jpg_snapshot.txt" ,ap: "snapshot_bundle.txt" };
+        // Available snapshot signatures. The binary versions return the images as they are, without base64 and JSON,
+        // and are used unless the browser lacks support for them, or the exposed model turns them off.
+        this._binarySnapshots = gui.SnapshotContainer.isSupported() &&
+                !( params.modelLib.hasKey("ap_useBinarySnapshots") && !params.modelLib.getElementValue("ap_useBinarySnapshots") );
+        if (this._binarySnapshots) {
+            this._snapshotStrings = { png: "snapshot.bin", jpg: "jpg_snapshot.bin" ,ap: "snapshot_bundle.bin" };
+        } else {
+            this._snapshotStrings = { png: "snapshot.txt", jpg: "jpg_snapshot.txt" ,ap: "snapshot_bundle.txt" };
+        }
 
         if (!params.renderListURL) {
             params.renderListURL = "xml/getRenderList.xml";
@@ -159,6 +167,9 @@ dojo.declare("gui.Canvas", [dijit._Widget], {
         viewer.updateElement("width", w);
         viewer.updateElement("height", h);
         this._modelLib.updateElement(this._key, viewer);
+        if (this._useFrameStream()) {
+            this._startFrameStream();
+        }
     },
 
 
@@ -188,52 +199,186 @@ dojo.declare("gui.Canvas", [dijit._Widget], {
 
 
     _requestImageIfNotBusy: function() {
+        if (this._useFrameStream()) {
+            this._startFrameStream();
+            return;
+        }
         if (!this._imageLoading) {
-            // console.log("_requestImageIfNotBusy (/model/updateParsed or mouseUp): Getting new image, url=" + this._urlHandler.getURL());
-            var startTime = Date.now();
+            this._requestImage();
+        }
+    },
 
-            // Should this be done? It is done in ExposedModelSender._makeURL(), which is used when posting with dojo.rawXhrPost()!
-            this._urlHandler.updateParams( { "revision" : this._modelLib.getRevision(), "timestamp" : (new Date()).getTime() } );
-            var url_used = this._urlHandler.getURL();
 
-            dojo.xhrGet({ // Here we explicitly ask for a new image in a new HTTP connection.
-                            url: this._urlHandler.getURL(),
-                            preventCache: true,
-                            load: dojo.hitch(this, function (response, ioArgs) {
-                                var t0 = Date.now();
-                                // console.log("_requestImageIfNotBusy: response = " + response);
-                                var response_obj = eval( '(' + response + ')' );
-                                // console.log("/model/updateParsed: response[" + this._key + "].view = " + response_obj[this._key].view);
-                                // console.log("/model/updateParsed: response[" + this._key + "].proj = " + response_obj[this._key].proj);
-                                var depthwidth  = response_obj[this._key].depthwidth;   // Values from the server
-                                var depthheight = response_obj[this._key].depthheight;
-                                var apDepthHeight = depthheight;                        // Values from the GUI
-                                var apDepthWidth  = depthwidth;
-                                if ( (this._modelLib.hasKey("ap_depthWidth")) && (this._modelLib.hasKey("ap_depthHeight")) ) {
-                                    apDepthWidth  = this._modelLib.getElementValue("ap_depthWidth");
-                                    apDepthHeight = this._modelLib.getElementValue("ap_depthHeight");
-                                }
-                                // console.log("Received depth size 1: " + depthwidth + " " + depthheight + ", specified by GUI: " + apDepthWidth + " " + apDepthHeight);
-                                if ( ( ( (depthwidth ==apDepthWidth)  || (depthwidth ==0) || (depthwidth ===undefined) ) &&
-                                       ( (depthheight==apDepthHeight) || (depthheight==0) || (depthheight===undefined) ) ) ||
-                                        ( ! ( (this._modelLib.hasKey("ap_useAutoProxy")) && (this._modelLib.getElementValue("ap_useAutoProxy")) ) ) ) // ... or *not* in AP-mode at all, then, ...
-                                {
-                                    // Not completely sure, but it may be a good idea to not update with a received bundle, if the depth size does not match what the shader is told...
-                                    // Currently, the shader gets the macros DEPTH_* from these exposed model elements.
-                                    this._setImageFromText( response_obj[this._key].rgb, response_obj[this._key].depth, response_obj[this._key].view, response_obj[this._key].proj );
-                                    var snaptype = response_obj[this._key].snaptype;
-                                    if (response_obj[this._key].snaptype == "jpg") {
-                                        snaptype = snaptype + parseInt(this._modelLib.getElementValue("ap_jpgQuality")/10);
-                                    }
-                                    // console.log("new snaptype = " + snaptype);
-                                    this._snapshotTimings.update( snaptype, (t0 - response_obj[this._key].timestamp) );
-                                    // this._snapshotTimings.print();
-                                    this._autoSelectSnapshotType(this._snapshotTimings);
-                                } else {
-                                    console.log("Depth size of received bundle does not match what the shader has been told to expect. Ignoring this bundle. (1)");
-                                    console.log("From response: depthwidth=" + depthwidth + ", depthheight=" + depthheight + ", client: ap_depthWidth=" + apDepthWidth + ", ap_depthHeight=" + apDepthHeight);
+    // Gets a new image of the current model. Also used while updates are being sent over the model channel, where the
+    // acknowledgement of an update does not bring the image along.
+    _requestImage: function() {
+        if (this._useDeltaSnapshots()) {
+            this._getDeltaSnapshot();
+            return;
+        }
+        // console.log("_requestImage: Getting new image, url=" + this._urlHandler.getURL());
+        var startTime = Date.now();
+
+        // Should this be done? It is done in ExposedModelSender._makeURL(), which is used when posting with dojo.rawXhrPost()!
+        this._urlHandler.updateParams( { "revision" : this._modelLib.getRevision(), "timestamp" : (new Date()).getTime() } );
+        var url_used = this._urlHandler.getURL();
+
+        this._getSnapshot( this._urlHandler.getURL(), // Here we explicitly ask for a new image in a new HTTP connection.
+                           dojo.hitch(this, function (response_obj) {
+                            var t0 = Date.now();
+                            // console.log("/model/updateParsed: response[" + this._key + "].view = " + response_obj[this._key].view);
+                            // console.log("/model/updateParsed: response[" + this._key + "].proj = " + response_obj[this._key].proj);
+                            var depthwidth  = response_obj[this._key].depthwidth;   // Values from the server
+                            var depthheight = response_obj[this._key].depthheight;
+                            var apDepthHeight = depthheight;                        // Values from the GUI
+                            var apDepthWidth  = depthwidth;
+                            if ( (this._modelLib.hasKey("ap_depthWidth")) && (this._modelLib.hasKey("ap_depthHeight")) ) {
+                                apDepthWidth  = this._modelLib.getElementValue("ap_depthWidth");
+                                apDepthHeight = this._modelLib.getElementValue("ap_depthHeight");
+                            }
+                            // console.log("Received depth size 1: " + depthwidth + " " + depthheight + ", specified by GUI: " + apDepthWidth + " " + apDepthHeight);
+                            if ( ( ( (depthwidth ==apDepthWidth)  || (depthwidth ==0) || (depthwidth ===undefined) ) &&
+                                   ( (depthheight==apDepthHeight) || (depthheight==0) || (depthheight===undefined) ) ) ||
+                                    ( ! ( (this._modelLib.hasKey("ap_useAutoProxy")) && (this._modelLib.getElementValue("ap_useAutoProxy")) ) ) ) // ... or *not* in AP-mode at all, then, ...
+                            {
+                                // Not completely sure, but it may be a good idea to not update with a received bundle, if the depth size does not match what the shader is told...
+                                // Currently, the shader gets the macros DEPTH_* from these exposed model elements.
+                                this._setImageFromText( response_obj[this._key].rgb, response_obj[this._key].depth, response_obj[this._key].view, response_obj[this._key].proj );
+                                var snaptype = response_obj[this._key].snaptype;
+                                if (response_obj[this._key].snaptype == "jpg") {
+                                    snaptype = snaptype + parseInt(this._modelLib.getElementValue("ap_jpgQuality")/10);
                                 }
-                            })
+                                // console.log("new snaptype = " + snaptype);
+                                // Cacheable replies do not echo the timestamp, so the time is measured from the request.
+                                this._snapshotTimings.update( snaptype, (t0 - startTime) );
+                                // this._snapshotTimings.print();
+                                this._autoSelectSnapshotType(this._snapshotTimings);
+                            } else {
+                                console.log("Depth size of received bundle does not match what the shader has been told to expect. Ignoring this bundle. (1)");
+                                console.log("From response: depthwidth=" + depthwidth + ", depthheight=" + depthheight + ", client: ap_depthWidth=" + apDepthWidth + ", ap_depthHeight=" + apDepthHeight);
+                            }
+                        }) );
+    },
+
+
+    // True if the server is to push the frames over one connection, which is turned on by the exposed model element
+    // 'ap_useFrameStream'. Not used in AP-mode, where the depth buffer is needed as well.
+    _useFrameStream: function() {
+        return this._modelLib.hasKey("ap_useFrameStream") && this._modelLib.getElementValue("ap_useFrameStream") &&
+                !( (this._modelLib.hasKey("ap_useAutoProxy")) && (this._modelLib.getElementValue("ap_useAutoProxy")) );
+    },
+
+
+    // Points the image at the frame stream of the viewer (multipart/x-mixed-replace), in which the server sends a new frame
+    // whenever the model has changed, and the browser shows each frame as it arrives. The stream is only reopened when its
+    // parameters change, e.g., on resize; the old connection is then closed by the browser.
+    _startFrameStream: function() {
+        var jpg = (this._modelLib.hasKey("ap_useJpgProxy")) && (this._modelLib.getElementValue("ap_useJpgProxy"));
+        var url = (jpg ? "snapshot_stream.jpg" : "snapshot_stream.png") + "?key=" + encodeURIComponent(this._key) +
+                "&width=" + this._width + "&height=" + this._height;
+        if (jpg) {
+            url += "&jpeg_quality=" + (this._modelLib.hasKey("ap_jpgQuality") ? this._modelLib.getElementValue("ap_jpgQuality") : 50);
+        }
+        if (this._modelLib.hasKey("ap_frameStreamMaxFps")) {
+            url += "&max_fps=" + this._modelLib.getElementValue("ap_frameStreamMaxFps");
+        }
+        if (this._img && url != this._frameStreamURL) {
+            this._frameStreamURL = url;
+            this._img.src = url;
+        }
+    },
+
+
+    // True if only the changed tiles of the snapshots are to be fetched, which is turned on by the exposed model element
+    // 'ap_useDeltaSnapshots'. Not used in AP-mode, where the depth buffer is needed as well.
+    _useDeltaSnapshots: function() {
+        return this._binarySnapshots && (typeof HTMLCanvasElement.prototype.toBlob === "function") &&
+                this._modelLib.hasKey("ap_useDeltaSnapshots") && this._modelLib.getElementValue("ap_useDeltaSnapshots") &&
+                !( (this._modelLib.hasKey("ap_useAutoProxy")) && (this._modelLib.getElementValue("ap_useAutoProxy")) );
+    },
+
+
+    // Fetches the tiles that changed since the last frame we got, and draws them onto that frame. The server keeps the
+    // last frame of each client, and sends the whole frame if ours is not the one it has (base), e.g., after a failure.
+    // Only one request is in flight at a time, so that the tiles are always drawn onto the frame they were computed from.
+    _getDeltaSnapshot: function() {
+        if (this._deltaPending) {
+            this._deltaAgain = true;
+            return;
+        }
+        if (!this._deltaCanvas) {
+            this._deltaCanvas = document.createElement("canvas");
+            this._deltaClient = "c" + Math.floor( Math.random() * 1000000000 ) + "t" + Date.now();
+            this._deltaBase   = 0;
+        }
+        this._deltaPending = true;
+        this._deltaAgain   = false;
+
+        var done = dojo.hitch(this, function(ok) {
+            if (!ok) {
+                this._deltaBase = 0;
+            }
+            this._deltaPending = false;
+            if (this._deltaAgain) {
+                this._getDeltaSnapshot();
+            }
+        });
+
+        var xhr = new XMLHttpRequest();
+        xhr.open("GET", "snapshot_delta.bin?key=" + encodeURIComponent(this._key) + "&width=" + this._width + "&height=" + this._height
+                 + "&client=" + this._deltaClient + "&base=" + this._deltaBase + "&preventCache=" + Date.now(), true);
+        xhr.responseType = "arraybuffer";
+        xhr.onerror = function() { done(false); };
+        xhr.onload = dojo.hitch(this, function() {
+            if (xhr.status != 200) {
+                done(false);
+                return;
+            }
+            var delta = new gui.SnapshotContainer(xhr.response).parseDelta();
+            var canvas = this._deltaCanvas;
+            if ( delta.full || (canvas.width != delta.width) || (canvas.height != delta.height) ) {
+                canvas.width  = delta.width;
+                canvas.height = delta.height;
+            }
+            var bitmaps = [];
+            for (var i=0; i<delta.tiles.length; i++) {
+                bitmaps.push( createImageBitmap(delta.tiles[i].image) );
+            }
+            Promise.all(bitmaps).then( dojo.hitch(this, function(images) {
+                var context = canvas.getContext("2d");
+                for (var i=0; i<images.length; i++) {
+                    context.drawImage(images[i], delta.tiles[i].x, delta.tiles[i].y);
+                }
+                this._deltaBase = delta.frame;
+                canvas.toBlob( dojo.hitch(this, function(blob) {
+                    this._setImageFromText(blob);
+                    done(true);
+                }), "image/png" );
+            }), function() { done(false); } );
+        });
+        xhr.send();
+    },
+
+
+    // Fetches a snapshot and passes it on as an object keyed by viewer, decoded from either the binary container or the JSON text.
+    _getSnapshot: function(url, callback) {
+        if (this._binarySnapshots) {
+            var xhr = new XMLHttpRequest();
+            xhr.open("GET", url + "preventCache=" + Date.now(), true);
+            xhr.responseType = "arraybuffer";
+            xhr.onload = function() {
+                if (xhr.status == 200) {
+                    callback( new gui.SnapshotContainer(xhr.response).parse() );
+                }
+            };
+            xhr.send();
+        } else {
+            dojo.xhrGet({
+                            url: url,
+                            preventCache: true,
+                            load: function (response, ioArgs) {
+                                callback( eval( '(' + response + ')' ) );
+                            }
                         });
         }
     },
@@ -488,9 +633,19 @@ dojo.declare("gui.Canvas", [dijit._Widget], {
         // The "partial" bit says that we _may_ have another update to send after this as well.
         // Either way, we should show the image we just got from the server (it's newer than the one we have!).
         dojo.subscribe("/model/updateSendPartialComplete", dojo.hitch(this, function (params) {
-            if (params.response.match(/\"rgb\"\:/)) { // For the time being, we assume this to be an image.
+            if (this._useFrameStream()) {
+                // The stream brings the frame of this update.
+                return;
+            }
+            if (params.channel) {
+                // The update went over the model channel, and the image must be fetched.
+                this._requestImage();
+                return;
+            }
+            var binary = (typeof ArrayBuffer !== "undefined") && (params.response instanceof ArrayBuffer);
+            if ( binary || params.response.match(/\"rgb\"\:/)) { // For the time being, we assume this to be an image.
                 // console.log("/model/updateSendPartialComplete: response = " + params.response);
-                var response_obj = eval( '(' + params.response + ')' );
+                var response_obj = binary ? new gui.SnapshotContainer(params.response).parse() : eval( '(' + params.response + ')' );
 //                console.log("/model/updateSendPartialComplete: response[" + this._key + "].view = " + response_obj[this._key].view);
 //                console.log("/model/updateSendPartialComplete: response[" + this._key + "].proj = " + response_obj[this._key].proj);
                 var depthwidth  = response_obj[this._key].depthwidth;   // Values from the server
@@ -679,6 +834,21 @@ dojo.declare("gui.Canvas", [dijit._Widget], {
 
 
     _setImageFromText: function (response_rgb, response_depth, response_view, response_proj) {
+        if ( (typeof Blob !== "undefined") && (response_rgb instanceof Blob) ) {
+            // From a binary snapshot, the browser decodes the image as it is.
+            if (this._imgObjectURL) {
+                URL.revokeObjectURL(this._imgObjectURL);
+            }
+            this._imgObjectURL = URL.createObjectURL(response_rgb);
+            this._img.src = this._imgObjectURL;
+            if ( (this._modelLib.hasKey("ap_useAutoProxy")) && (this._modelLib.getElementValue("ap_useAutoProxy")) ) {
+                if (this._proxyRenderer) {
+                    this._proxyRenderer.setDepthData(response_rgb, response_depth, response_view, response_proj);
+                }
+            }
+            this._showCorrect();
+            return;
+        }
         if (!response_rgb.substring(response_rgb.length - 1).match(/^[0-9a-zA-z\=\+\/]/)) { // @@@ What is this about?
             response_rgb = response_rgb.substring(0, response_rgb.length - 1);
         }
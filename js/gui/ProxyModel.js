@@ -50,8 +50,7 @@ dojo.declare("gui.ProxyModel", null, {
         var depth_t0 = 0;
         var rgb_t0 = 0;
 
-        var depthImage = new Image();
-        depthImage.onload = dojo.hitch(this, function() {
+        this._loadImage(depthBufferAsText, dojo.hitch(this, function(depthImage) {
             this._gl.bindTexture(this._gl.TEXTURE_2D, this.depthTexture);
             this._gl.texImage2D(this._gl.TEXTURE_2D, 0, this._gl.RGB, this._gl.RGB, this._gl.UNSIGNED_BYTE, depthImage);
             this._gl.texParameteri(this._gl.TEXTURE_2D, this._gl.TEXTURE_MAG_FILTER, this._gl.NEAREST);
@@ -70,13 +69,11 @@ dojo.declare("gui.ProxyModel", null, {
                 this.dist = vec3.length( vec3.create( [this.to_world[12], this.to_world[13], this.to_world[14]] ) );
                 this.state = 2;
             }
-        });
+        }));
         depth_t0 = Date.now();
         // console.log("Starting depth image loading");
-        depthImage.src = "data:image/png;base64," + depthBufferAsText;
 
-        var rgbImage = new Image();
-        rgbImage.onload = dojo.hitch(this, function() {
+        this._loadImage(imageAsText, dojo.hitch(this, function(rgbImage) {
             // console.log("ProxyModel.setAll: RGB size = " + rgbImage.width + " x " + rgbImage.height);
             var pot_width  = parseInt(Math.pow(2.0, Math.floor(Math.log(rgbImage.width-1)/Math.log(2.0))+1));     // This *may* have numerical problems... not quite sure how to (elegantly) avoid this...
             var pot_height = parseInt(Math.pow(2.0, Math.floor(Math.log(rgbImage.height-1)/Math.log(2.0))+1));
@@ -107,11 +104,27 @@ dojo.declare("gui.ProxyModel", null, {
                 this.dist = vec3.length( vec3.create( [this.to_world[12], this.to_world[13], this.to_world[14]] ) );
                 this.state = 2;
             }
-        });
+        }));
         rgb_t0 = Date.now();
-        rgbImage.src = "data:image/png;base64," + imageAsText;
 
     },
 
 
+    // Decodes a base64 encoded png, or an image Blob from a binary snapshot, and passes the decoded image on to onload.
+    _loadImage: function(data, onload) {
+        if ( (typeof Blob !== "undefined") && (data instanceof Blob) ) {
+            createImageBitmap(data).then(onload, dojo.hitch(this, function() {
+                console.log("ProxyModel: could not decode image from binary snapshot.");
+                this.state = 0;
+            }));
+        } else {
+            var image = new Image();
+            image.onload = function() {
+                onload(image);
+            };
+            image.src = "data:image/png;base64," + data;
+        }
+    },
+
+
 });
@@ -0,0 +1,150 @@
+/* Copyright STIFTELSEN SINTEF 2014
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+dojo.provide("gui.SnapshotContainer");
+
+
+// Decoder for the binary snapshot container returned by snapshot.bin, jpg_snapshot.bin and snapshot_bundle.bin, see
+// include/tinia/trell/trell.h for the layout. parse() returns an object with the same shape as the JSON returned by the
+// corresponding .txt requests, except that the rgb and depth images are Blobs instead of base64 strings.
+dojo.declare("gui.SnapshotContainer", null, {
+
+
+    constructor: function(arrayBuffer) {
+        this._data   = new DataView(arrayBuffer);
+        this._bytes  = new Uint8Array(arrayBuffer);
+        this._offset = 0;
+    },
+
+
+    parse: function() {
+        if (this._string(4) != "TSNP") {
+            throw "Not a snapshot container";
+        }
+        var version = this._u32();
+        if (version != 1) {
+            throw "Unsupported snapshot container version " + version;
+        }
+        var viewers   = this._u32();
+        var revision  = this._u32();
+        var timestamp = Number(this._string());
+        var snaptype  = this._string();
+
+        var result = {};
+        for (var i=0; i<viewers; i++) {
+            var key   = this._string();
+            var flags = this._u32();
+            var entry = { revision: revision, timestamp: timestamp, snaptype: snaptype };
+            entry.depthwidth  = this._u32();
+            entry.depthheight = this._u32();
+            entry.rgb = new Blob( [this._sized()], { type: (flags & 2) ? "image/jpeg" : "image/png" } );
+            if (flags & 1) {
+                entry.depth = new Blob( [this._sized()], { type: "image/png" } );
+                entry.view  = this._matrix();
+                entry.proj  = this._matrix();
+            }
+            result[key] = entry;
+        }
+        return result;
+    },
+
+
+    // Decodes the delta container returned by snapshot_delta.bin. The tiles are given with the origin in the top left
+    // corner, and are to be drawn onto the frame the client already has, unless full is set.
+    parseDelta: function() {
+        if (this._string(4) != "TDLT") {
+            throw "Not a delta container";
+        }
+        var version = this._u32();
+        if (version != 1) {
+            throw "Unsupported delta container version " + version;
+        }
+        var result = {};
+        result.full   = (this._u32() & 1) != 0;
+        result.width  = this._u32();
+        result.height = this._u32();
+        result.frame  = this._u32();
+        result.tiles  = [];
+        var tiles = this._u32();
+        for (var i=0; i<tiles; i++) {
+            var tile = {};
+            tile.x      = this._u32();
+            tile.y      = this._u32();
+            tile.width  = this._u32();
+            tile.height = this._u32();
+            tile.image  = new Blob( [this._sized()], { type: "image/png" } );
+            result.tiles.push(tile);
+        }
+        return result;
+    },
+
+
+    _u32: function() {
+        var value = this._data.getUint32(this._offset, true);
+        this._offset += 4;
+        return value;
+    },
+
+
+    // Returned as a space-separated string, like the "view" and "proj" fields of the JSON replies.
+    _matrix: function() {
+        var m = [];
+        for (var i=0; i<16; i++) {
+            m.push( this._data.getFloat32(this._offset, true) );
+            this._offset += 4;
+        }
+        return m.join(" ");
+    },
+
+
+    _sized: function() {
+        var size = this._u32();
+        if (this._offset + size > this._bytes.length) {
+            throw "Truncated snapshot container";
+        }
+        var bytes = this._bytes.subarray(this._offset, this._offset + size);
+        this._offset += size;
+        return bytes;
+    },
+
+
+    // Reads a size-prefixed string, or 'length' characters if given (only used for the magic).
+    _string: function(length) {
+        var bytes;
+        if (length === undefined) {
+            bytes = this._sized();
+        } else {
+            bytes = this._bytes.subarray(this._offset, this._offset + length);
+            this._offset += length;
+        }
+        var s = "";
+        for (var i=0; i<bytes.length; i++) {
+            s += String.fromCharCode(bytes[i]);
+        }
+        return s;
+    }
+
+
+});
+
+
+// True if the browser can fetch and decode binary snapshots without going through base64.
+gui.SnapshotContainer.isSupported = function() {
+    return (typeof ArrayBuffer !== "undefined") && (typeof DataView !== "undefined") && (typeof Blob !== "undefined")
+            && (typeof window.URL !== "undefined") && (typeof window.createImageBitmap === "function");
+};
@@ -21,6 +21,7 @@ dojo.require("model.ExposedModel");
 dojo.require("model.ExposedModelParser");
 dojo.require("model.ExposedModelSender");
 dojo.require("model.ExposedModelReceiver");
+dojo.require("model.ExposedModelChannel");
 dojo.require("dijit.layout.BorderContainer");
 dojo.require("gui.GUIBuilder");
 dojo.require("model.Logger");
@@ -62,7 +63,15 @@ function run(getExposedModelUpdateURL, updateStateURL, renderlistURL, isLocal, d
 
             
             var receiver = new model.ExposedModelReceiver(getExposedModelUpdateURL, modelObj);
-            if(!isLocal) {
+            var channel = new model.ExposedModelChannel("model_channel", modelObj);
+            if(!isLocal && channel.available()) {
+                // Long-poll if the server has no model channel, or it is lost.
+                sender.setChannel(channel);
+                channel.open(function() {
+                    receiver.longPoll();
+                });
+            }
+            else if(!isLocal) {
                 receiver.longPoll();
             }
 
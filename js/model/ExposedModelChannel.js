@@ -0,0 +1,122 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+dojo.provide("model.ExposedModelChannel");
+dojo.require("model.ExposedModelParser");
+
+// Carries the model updates both ways over one WebSocket, instead of long-polls
+// for updates from the server and a POST for each update from the client.
+//
+// Messages are text frames of "<type> <sequence> <revision>\n<body>". The client
+// sends "sync" with the revision it has, and "update" with an updateState
+// document. The server answers an update with "ack", whose body is the
+// sequence number of the update, and sends "model" with the exposed model
+// update whenever the model changes.
+dojo.declare("model.ExposedModelChannel", null, {
+    constructor: function(url, modelLib) {
+        this._url = url;
+        this._modelLib = modelLib;
+        this._parser = new model.ExposedModelParser(modelLib);
+        this._socket = null;
+        this._open = false;
+        this._sequence = 0;
+        this._acks = {};
+    },
+
+    // True if the browser has WebSockets at all.
+    available: function() {
+        return typeof WebSocket !== "undefined";
+    },
+
+    isOpen: function() {
+        return this._open;
+    },
+
+    // Opens the channel. onFailure is called if it cannot be opened, or is
+    // lost, after which the caller falls back to long-polling.
+    open: function(onFailure) {
+        var failed = false;
+        var fail = dojo.hitch(this, function() {
+            this._open = false;
+            var acks = this._acks;
+            this._acks = {};
+            for (var sequence in acks) {
+                acks[sequence].onError();
+            }
+            if (!failed) {
+                failed = true;
+                onFailure();
+            }
+        });
+        try {
+            this._socket = new WebSocket(this._socketURL());
+        } catch (error) {
+            fail();
+            return;
+        }
+        this._socket.onopen = dojo.hitch(this, function() {
+            this._open = true;
+            this._message("sync", "");
+        });
+        this._socket.onmessage = dojo.hitch(this, function(event) {
+            this._receive(event.data);
+        });
+        this._socket.onerror = fail;
+        this._socket.onclose = fail;
+    },
+
+    // Sends an updateState document. onAck is called when the server has
+    // applied it, onError if the channel is lost before that.
+    send: function(xml, onAck, onError) {
+        var sequence = this._message("update", xml);
+        this._acks[sequence] = {"onAck": onAck, "onError": onError};
+    },
+
+    _socketURL: function() {
+        var url = this._url;
+        if (!url.match(/^\w+:/)) {
+            var base = document.location.href;
+            url = base.substring(0, base.lastIndexOf("/") + 1) + url;
+        }
+        return url.replace(/^http/, "ws");
+    },
+
+    _message: function(type, body) {
+        this._sequence++;
+        this._socket.send(type + " " + this._sequence + " " + this._modelLib.getRevision() + "\n" + body);
+        return this._sequence;
+    },
+
+    _receive: function(text) {
+        var newline = text.indexOf("\n");
+        var header = (newline < 0 ? text : text.substring(0, newline)).split(" ");
+        var body = newline < 0 ? "" : text.substring(newline + 1);
+        if (header[0] == "ack") {
+            var ack = this._acks[body];
+            delete this._acks[body];
+            if (ack) {
+                ack.onAck();
+            }
+        } else if (header[0] == "model" && body.length > 0) {
+            var response = new DOMParser().parseFromString(body, "text/xml");
+            dojo.publish("/model/updateReceived", [{"response": response, "ioArgs": null}]);
+            this._parser.parseXML(response);
+            dojo.publish("/model/updateParsed", [{"response": response, "ioArgs": null}]);
+        }
+    }
+});
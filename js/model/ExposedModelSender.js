@@ -29,6 +29,7 @@ dojo.declare("model.ExposedModelSender", null, {
         this._updateInProgress = false;
         this._pendingXML = false;
         this._keys = {};
+        this._channel = null;
         dojo.subscribe("/model/updateReceived", dojo.hitch(this, function() {
             this._parsingUpdate = true;
         }));
@@ -40,6 +41,11 @@ dojo.declare("model.ExposedModelSender", null, {
         this._modelLib.addElementAccepter(dojo.hitch(this, this.accept));
     },
     
+    // Updates are sent over the channel (a model.ExposedModelChannel) while it is open.
+    setChannel: function(channel) {
+        this._channel = channel;
+    },
+
     accept: function(key, value) {
         if ( this._keys[key]) {
             return false;
@@ -69,8 +75,19 @@ dojo.declare("model.ExposedModelSender", null, {
     _send: function(xml) {
         this._updateInProgress = true;
         // console.log("sending update");
+        if (this._channel && this._channel.isOpen()) {
+            this._channel.send(xml, dojo.hitch(this, function() {
+                this._updateComplete("", null, true);
+            }), dojo.hitch(this, this._updateError));
+            return;
+        }
+        var url = this._makeURL();
+        if (url.split("?")[0].match(/\.bin$/)) {
+            this._sendBinary(url, xml);
+            return;
+        }
         dojo.rawXhrPost({
-            url: this._makeURL(),
+            url: url,
             postData : xml,
             headers: {"Content-Type": "text/xml"},
             
@@ -92,9 +109,35 @@ dojo.declare("model.ExposedModelSender", null, {
         });
     },
     
-    _updateComplete: function(response, ioArgs) {
+    // Binary snapshot replies (see gui.SnapshotContainer) must be read as an ArrayBuffer, which dojo.rawXhrPost cannot do.
+    _sendBinary: function(url, xml) {
+        var xhr = new XMLHttpRequest();
+        xhr.open("POST", url, true);
+        xhr.setRequestHeader("Content-Type", "text/xml");
+        xhr.responseType = "arraybuffer";
+        var failed = dojo.hitch(this, function() {
+            this._updateError();
+            dojo.publish("/model/updateSendError", [{"response": xhr.response, "ioArgs" : xhr}]);
+        });
+        xhr.onload = dojo.hitch(this, function() {
+            if (xhr.status < 200 || xhr.status >= 300) {
+                failed();
+                return;
+            }
+            try {
+                this._updateComplete(xhr.response, xhr);
+            } catch( error ) {
+
+            }
+        });
+        xhr.onerror = failed;
+        xhr.send(xml);
+    },
+
+    // channel is true if the update went over the model channel, and then the reply has no image.
+    _updateComplete: function(response, ioArgs, channel) {
 
-        dojo.publish("/model/updateSendPartialComplete", [{"response": response, "ioArgs" : ioArgs}]);
+        dojo.publish("/model/updateSendPartialComplete", [{"response": response, "ioArgs" : ioArgs, "channel" : !!channel}]);
         if(this._pendingXML) {
             var xmlBuild = this._builder.buildXML(this._makeKeys());
             this._pendingXML = false;
@@ -104,7 +147,7 @@ dojo.declare("model.ExposedModelSender", null, {
             
             // Reset keys we have seen.
             this._keys = {};
-            dojo.publish("/model/updateSendComplete", [{"response": response, "ioArgs" : ioArgs}]);
+            dojo.publish("/model/updateSendComplete", [{"response": response, "ioArgs" : ioArgs, "channel" : !!channel}]);
         }
     },
     
@@ -22,6 +22,7 @@ dojo.require("model.ExposedModel");
 dojo.require("model.ExposedModelParser");
 dojo.require("model.ExposedModelSender");
 dojo.require("model.ExposedModelReceiver");
+dojo.require("model.ExposedModelChannel");
 dojo.require("dijit.layout.BorderContainer");
 dojo.require("gui.GUIBuilder");
 dojo.require("model.Logger");
@@ -380,6 +380,8 @@ DSRV.prototype = {
         var viewer = this.m_model.getElementValue( this.m_key );
         viewer.updateElement( "modelview", this.m_manipulator.modelviewMatrix() );
         viewer.updateElement( "projection", this.m_manipulator.projectionMatrix() );
+        // Lets the server tell interaction from single updates (progressive refinement).
+        viewer.updateElement( "timestamp", Date.now() );
         this.m_model.updateElement( this.m_key, viewer );   // needed?
     }
 }
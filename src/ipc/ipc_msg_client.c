@@ -385,9 +385,9 @@ ipc_msg_client_recv( char*                          errnobuf,
                        client->shmem_header_ptr->bytes,
                        part,
                        more );
-        // longpolling?
+        // longpolling? (2 waits on the render notification)
         if( rc > 0 ) {
-            do_wait_on_notification = 1;
+            do_wait_on_notification = rc;
         }
         // error? yes, tell server.
         else if( rc < 0 ) {
@@ -561,15 +561,17 @@ tinia_ipc_msg_client_sendrecv( tinia_ipc_msg_client_t*        client,
             
             // --- longpolling -------------------------------------------------
             // If ipc_msg_client_recv returned 1, the callback functions have
-            // indicated that we should longpoll. However, if longpoll timeout
-            // is zero, we ignore this.
+            // indicated that we should longpoll, and 2 that we should wait for
+            // a render. However, if longpoll timeout is zero, we ignore this.
             if( ret > 0 ) {
                 if( longpoll_timeout < 1 ) {
                     ret = 0;
                     break;  // no longpolling, just break out
                 }
                 client->logger_f( client->logger_d, 2, who, "Wait on notification from %s.", client->shmem_name );
-                rc = pthread_cond_timedwait( &client->shmem_header_ptr->notification_event,
+                rc = pthread_cond_timedwait( ret == 2
+                                             ? &client->shmem_header_ptr->render_event
+                                             : &client->shmem_header_ptr->notification_event,
                                              &client->shmem_header_ptr->transaction_lock,
                                              &timeout_lp );
                 if( rc != 0 ) {
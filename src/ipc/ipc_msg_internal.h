@@ -90,6 +90,12 @@ typedef struct {
      */
     pthread_cond_t      notification_event;
 
+    /** Allows clients to wait for a reply that is rendered in the background.
+     *
+     * Condition is associated with transaction_lock.
+     */
+    pthread_cond_t      render_event;
+
 
     /** True when a server is listening. */
     int                 mainloop_running;
@@ -147,7 +153,8 @@ struct tinia_ipc_msg_server_struct {
      * and the thread that invokes notifications w.r.t the transaction lock and
      * the exposed model mutex. To fix this, when failing to grab the
      * transaction lock, we set this flag and defer the notification until the
-     * mainloop polls this value.
+     * mainloop polls this value. Bitmask of IPC_MSG_NOTIFY_MODEL and
+     * IPC_MSG_NOTIFY_RENDERS.
      */
     volatile int        deferred_notification_event;
     pthread_mutex_t     deferred_notification_lock;
@@ -206,12 +213,24 @@ ipc_msg_client_recv( char* errnobuf,
 void*
 ipc_msg_server_signal_thread( void* data );
 
+/** Notification conditions, used as bits in deferred_notification_event. */
+enum {
+    IPC_MSG_NOTIFY_MODEL = 1,
+    IPC_MSG_NOTIFY_RENDERS = 2
+};
+
+int
+ipc_msg_set_deferred_notification_event( tinia_ipc_msg_server_t* server,
+                                         int events );
+
+/** Clears the events that have been delivered. */
 int
-ipc_msg_set_deferred_notification_event( tinia_ipc_msg_server_t* server );
+ipc_msg_clear_deferred_notification_event( tinia_ipc_msg_server_t* server,
+                                           int events );
 
 
 /*
- * Returns 1 if event, 0 if no event, and -2 if error.
+ * Returns the deferred events (0 if none), and -2 if error.
  *
  */
 int
@@ -265,6 +265,12 @@ do { \
     CHECK( pthread_cond_init( &server->shmem_header_ptr->notification_event, &condattr ) );
     CHECK( pthread_condattr_destroy( &condattr ) );
 
+    // --- initialize render notification condition variable -------------------
+    CHECK( pthread_condattr_init( &condattr ) );
+    CHECK( pthread_condattr_setpshared( &condattr, PTHREAD_PROCESS_SHARED ) );
+    CHECK( pthread_cond_init( &server->shmem_header_ptr->render_event, &condattr ) );
+    CHECK( pthread_condattr_destroy( &condattr ) );
+
     // --- initialize server wakeup condition variable -------------------------
     CHECK( pthread_condattr_init( &condattr ) );
     CHECK( pthread_condattr_setpshared( &condattr, PTHREAD_PROCESS_SHARED ) );
@@ -329,6 +335,7 @@ do { \
         CHECK( pthread_cond_destroy( &server->shmem_header_ptr->client_event ) );
         CHECK( pthread_cond_destroy( &server->shmem_header_ptr->server_event ) );
         CHECK( pthread_cond_destroy( &server->shmem_header_ptr->notification_event ) );
+        CHECK( pthread_cond_destroy( &server->shmem_header_ptr->render_event ) );
         CHECK( pthread_mutex_destroy( &server->shmem_header_ptr->operation_lock ) );
         CHECK( pthread_mutex_destroy( &server->shmem_header_ptr->transaction_lock ) );
 #undef CHECK
@@ -661,7 +668,8 @@ ipc_msg_poll_deferred_notification_event( tinia_ipc_msg_server_t* server )
 
 
 int
-ipc_msg_set_deferred_notification_event( tinia_ipc_msg_server_t* server )
+ipc_msg_set_deferred_notification_event( tinia_ipc_msg_server_t* server,
+                                         int events )
 {
     char errnobuf[256];
     int ret = 0;
@@ -674,7 +682,7 @@ ipc_msg_set_deferred_notification_event( tinia_ipc_msg_server_t* server )
         ret = -2;
     }
     else {
-        server->deferred_notification_event = 1;
+        server->deferred_notification_event |= events;
 
         rc = pthread_mutex_unlock( &server->deferred_notification_lock );
         if( rc != 0 ) {
@@ -690,7 +698,67 @@ ipc_msg_set_deferred_notification_event( tinia_ipc_msg_server_t* server )
 
 
 int
-ipc_msg_server_notify( tinia_ipc_msg_server_t* server )
+ipc_msg_clear_deferred_notification_event( tinia_ipc_msg_server_t* server,
+                                           int events )
+{
+    char errnobuf[256];
+    int ret = 0;
+
+    int rc = pthread_mutex_lock( &server->deferred_notification_lock );
+    if( rc != 0 ) {
+        server->logger_f( server->logger_d, 0, __func__,
+                          "pthread_mutex_lock( &server->deferred_notification_lock ) failed: %s",
+                          ipc_msg_strerror_wrap(rc, errnobuf, sizeof(errnobuf) ) );
+        ret = -2;
+    }
+    else {
+        server->deferred_notification_event &= ~events;
+
+        rc = pthread_mutex_unlock( &server->deferred_notification_lock );
+        if( rc != 0 ) {
+            server->logger_f( server->logger_d, 0, __func__,
+                              "pthread_mutex_unlock( &server->deferred_notification_lock ) failed: %s",
+                              ipc_msg_strerror_wrap(rc, errnobuf, sizeof(errnobuf) ) );
+            ret = -2;
+        }
+    }
+    return ret;
+}
+
+
+/** Broadcasts the conditions of events, transaction_lock must be held. */
+static int
+ipc_msg_server_broadcast( tinia_ipc_msg_server_t* server,
+                          const char* who,
+                          int events )
+{
+    char errnobuf[256];
+    int rc, ret = 0;
+    if( events & IPC_MSG_NOTIFY_MODEL ) {
+        rc = pthread_cond_broadcast( &server->shmem_header_ptr->notification_event );
+        if( rc != 0 ) {
+            server->logger_f( server->logger_d, 0, who,
+                              "pthread_cond_broadcast( notification_event ) failed: %s",
+                              ipc_msg_strerror_wrap(rc, errnobuf, sizeof(errnobuf) ) );
+            ret = -2;
+        }
+    }
+    if( events & IPC_MSG_NOTIFY_RENDERS ) {
+        rc = pthread_cond_broadcast( &server->shmem_header_ptr->render_event );
+        if( rc != 0 ) {
+            server->logger_f( server->logger_d, 0, who,
+                              "pthread_cond_broadcast( render_event ) failed: %s",
+                              ipc_msg_strerror_wrap(rc, errnobuf, sizeof(errnobuf) ) );
+            ret = -2;
+        }
+    }
+    return ret;
+}
+
+
+
+static int
+ipc_msg_server_notify_events( tinia_ipc_msg_server_t* server, int events )
 {
     static const char* who = "tinia.ipc.msg.server.mainloop.notify";
     char errnobuf[256];
@@ -703,13 +771,7 @@ ipc_msg_server_notify( tinia_ipc_msg_server_t* server )
         // --- we're the mainloop thread -------------------------------------------
 
         // --- signal notification condition (linked to transaction lock) ------
-        rc = pthread_cond_broadcast( &server->shmem_header_ptr->notification_event );
-        if( rc != 0 ) {
-            server->logger_f( server->logger_d, 0, who,
-                              "pthread_cond_broadcast( notification_event ) failed: %s",
-                              ipc_msg_strerror_wrap(rc, errnobuf, sizeof(errnobuf) ) );
-            ret = -2;
-        }
+        ret = ipc_msg_server_broadcast( server, who, events );
 
     }
     else {
@@ -721,7 +783,7 @@ ipc_msg_server_notify( tinia_ipc_msg_server_t* server )
 #endif
             // someone is interacting with the server, defer signaling until
             // main thread can handle it.
-            if( ipc_msg_set_deferred_notification_event( server ) != 0 ) {
+            if( ipc_msg_set_deferred_notification_event( server, events ) != 0 ) {
                 ret = -2;
             }
         }
@@ -738,13 +800,7 @@ ipc_msg_server_notify( tinia_ipc_msg_server_t* server )
 #endif
 
             // --- signal notification condition (linked to transaction lock) --
-            rc = pthread_cond_broadcast( &server->shmem_header_ptr->notification_event );
-            if( rc != 0 ) {
-                server->logger_f( server->logger_d, 0, who,
-                                  "pthread_cond_broadcast( notification_event ) failed: %s",
-                                  ipc_msg_strerror_wrap(rc, errnobuf, sizeof(errnobuf) ) );
-                ret = -2;
-            }
+            ret = ipc_msg_server_broadcast( server, who, events );
             
             // --- unlock transaction lock -------------------------------------
             rc = pthread_mutex_unlock( &server->shmem_header_ptr->transaction_lock );
@@ -759,6 +815,18 @@ ipc_msg_server_notify( tinia_ipc_msg_server_t* server )
     return ret;
 }
 
+int
+ipc_msg_server_notify( tinia_ipc_msg_server_t* server )
+{
+    return ipc_msg_server_notify_events( server, IPC_MSG_NOTIFY_MODEL );
+}
+
+int
+ipc_msg_server_notify_renders( tinia_ipc_msg_server_t* server )
+{
+    return ipc_msg_server_notify_events( server, IPC_MSG_NOTIFY_RENDERS );
+}
+
 int
 ipc_msg_server_mainloop_break( tinia_ipc_msg_server_t* server )
 {
@@ -941,7 +1009,7 @@ ipc_msg_server_mainloop_iteration( char* errnobuf,
 
         // --- Handle deferred notification events -----------------------------
         int deferred_notification_event = ipc_msg_poll_deferred_notification_event( server );
-        if( deferred_notification_event == 1 ) {
+        if( deferred_notification_event > 0 ) {
 
             // Avoid deadlock, Release operation lock (letting client finish)
             rc = pthread_mutex_unlock( &server->shmem_header_ptr->operation_lock );
@@ -972,20 +1040,14 @@ ipc_msg_server_mainloop_iteration( char* errnobuf,
                     int ret = 0;
 
                     // Got transaction lock, broadcast notifiaction
-                    rc = pthread_cond_broadcast( &server->shmem_header_ptr->notification_event );
-                    if( rc == 0 ) {
+                    ret = ipc_msg_server_broadcast( server, who, deferred_notification_event );
+                    if( ret == 0 ) {
 #ifdef TINIA_IPC_LOG_TRACE
                         server->logger_f( server->logger_d, 2, who,
                                           "Successfully delivered deferred notification event.",
                                           ipc_msg_strerror_wrap(rc, errnobuf, sizeof(errnobuf) ) );
 #endif
-                        server->deferred_notification_event = 0;
-                    }
-                    else {
-                        server->logger_f( server->logger_d, 0, who,
-                                          "pthread_cond_broadcast( notification_event ) failed: %s",
-                                          ipc_msg_strerror_wrap(rc, errnobuf, sizeof(errnobuf) ) );
-                        ret = -2;
+                        ret = ipc_msg_clear_deferred_notification_event( server, deferred_notification_event );
                     }
 
                     // Release Transaction lock
@@ -0,0 +1,181 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/FrameDelta.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+namespace tinia {
+namespace jobcontroller {
+
+FrameDelta::FrameDelta( unsigned int tile_size, double threshold, size_t max_clients )
+   : m_tile_size( std::max( 1u, tile_size ) ),
+     m_threshold( threshold ),
+     m_max_clients( std::max( size_t(1), max_clients ) ),
+     m_next_id( 1 ),
+     m_frame_count( 0 ),
+     m_full_count( 0 ),
+     m_pixels_total( 0.0 ),
+     m_pixels_sent( 0.0 )
+{
+}
+
+double
+FrameDelta::thresholdFromEnvironment()
+{
+   const char* threshold_env = getenv( "TINIA_DELTA_THRESHOLD" );
+   if( threshold_env != NULL && *threshold_env != '\0' ) {
+      return atof( threshold_env );
+   }
+   return 0.5;
+}
+
+FrameDelta::Delta
+FrameDelta::update( const std::string& client,
+                    unsigned int base,
+                    const unsigned char* rgb,
+                    unsigned int width,
+                    unsigned int height,
+                    size_t stride )
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+
+   Delta delta;
+   delta.full = true;
+
+   std::map<std::string, Frame>::iterator it = m_frames.find( client );
+   if( it == m_frames.end() ) {
+      while( m_frames.size() >= m_max_clients ) {
+         m_frames.erase( m_recency.back() );
+         m_recency.pop_back();
+      }
+      m_recency.push_front( client );
+      it = m_frames.insert( std::make_pair( client, Frame() ) ).first;
+      it->second.id = 0;
+      it->second.recency = m_recency.begin();
+   }
+   else {
+      m_recency.splice( m_recency.begin(), m_recency, it->second.recency );
+   }
+   Frame& last = it->second;
+
+   if( ( base != 0 ) && ( base == last.id ) &&
+       ( last.width == width ) && ( last.height == height ) && ( last.stride == stride ) )
+   {
+      double changed = 0.0;
+      for( unsigned int y=0; y<height; y+=m_tile_size ) {
+         for( unsigned int x=0; x<width; x+=m_tile_size ) {
+            Tile tile;
+            tile.x = x;
+            tile.y = y;
+            tile.width = std::min( m_tile_size, width - x );
+            tile.height = std::min( m_tile_size, height - y );
+            if( tileChanged( &last.pixels[0], rgb, height, stride, tile ) ) {
+               delta.tiles.push_back( tile );
+               changed += double( tile.width ) * tile.height;
+            }
+         }
+      }
+      delta.full = changed > m_threshold * double( width ) * height;
+   }
+   if( delta.full ) {
+      Tile tile;
+      tile.x = 0;
+      tile.y = 0;
+      tile.width = width;
+      tile.height = height;
+      delta.tiles.assign( 1, tile );
+      m_full_count++;
+   }
+
+   last.id = m_next_id++;
+   if( m_next_id == 0 ) {
+      m_next_id = 1;   // 0 means no frame.
+   }
+   last.width = width;
+   last.height = height;
+   last.stride = stride;
+   last.pixels.assign( rgb, rgb + stride*height );
+   delta.frame = last.id;
+
+   m_frame_count++;
+   m_pixels_total += double( width ) * height;
+   for( size_t i=0; i<delta.tiles.size(); i++ ) {
+      m_pixels_sent += double( delta.tiles[i].width ) * delta.tiles[i].height;
+   }
+   return delta;
+}
+
+void
+FrameDelta::copyTile( const unsigned char* rgb,
+                      unsigned int height,
+                      size_t stride,
+                      const Tile& tile,
+                      unsigned char* dst,
+                      size_t dst_stride )
+{
+   // Row 0 in memory is the bottom row of the frame.
+   const unsigned int bottom = height - ( tile.y + tile.height );
+   for( unsigned int j=0; j<tile.height; j++ ) {
+      memcpy( dst + j*dst_stride, rgb + ( bottom + j )*stride + 3*tile.x, 3*tile.width );
+   }
+}
+
+bool
+FrameDelta::tileChanged( const unsigned char* a,
+                         const unsigned char* b,
+                         unsigned int height,
+                         size_t stride,
+                         const Tile& tile )
+{
+   // The rows of a tile are contiguous, and memcmp is vectorized by the C
+   // library, so this compares 16 or 32 bytes at a time.
+   const unsigned int bottom = height - ( tile.y + tile.height );
+   for( unsigned int j=0; j<tile.height; j++ ) {
+      const size_t offset = ( bottom + j )*stride + 3*tile.x;
+      if( memcmp( a + offset, b + offset, 3*tile.width ) != 0 ) {
+         return true;
+      }
+   }
+   return false;
+}
+
+unsigned long
+FrameDelta::frames() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_frame_count;
+}
+
+unsigned long
+FrameDelta::fullFrames() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_full_count;
+}
+
+double
+FrameDelta::sentFraction() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_pixels_total > 0.0 ? m_pixels_sent / m_pixels_total : 0.0;
+}
+
+}
+}
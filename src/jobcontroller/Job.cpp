@@ -47,6 +47,17 @@ bool jobcontroller::Job::periodic()
    return true;
 }
 
+bool jobcontroller::Job::hibernate( std::string& payload )
+{
+   payload.clear();
+   return true;
+}
+
+bool jobcontroller::Job::restore( const std::string& payload )
+{
+   return true;
+}
+
 void jobcontroller::Job::quit()
 {
 	cleanup();
@@ -0,0 +1,389 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/ModelChannel.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <boost/cstdint.hpp>
+
+namespace tinia {
+namespace jobcontroller {
+
+namespace {
+
+boost::uint32_t
+rotate( boost::uint32_t x, int n )
+{
+   return ( x << n ) | ( x >> ( 32 - n ) );
+}
+
+/** SHA-1 of data (RFC 3174), only used for the handshake. */
+std::string
+sha1( const std::string& data )
+{
+   boost::uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+   std::string message = data;
+   const boost::uint64_t bits = boost::uint64_t( data.size() ) * 8;
+   message += char( 0x80 );
+   while( message.size() % 64 != 56 ) {
+      message += char( 0 );
+   }
+   for( int i=7; i>=0; i-- ) {
+      message += char( ( bits >> ( 8*i ) ) & 0xff );
+   }
+
+   for( size_t chunk=0; chunk<message.size(); chunk+=64 ) {
+      boost::uint32_t w[80];
+      for( int i=0; i<16; i++ ) {
+         const unsigned char* p = reinterpret_cast<const unsigned char*>( message.data() + chunk + 4*i );
+         w[i] = ( boost::uint32_t(p[0]) << 24 ) | ( boost::uint32_t(p[1]) << 16 ) |
+                ( boost::uint32_t(p[2]) << 8 ) | boost::uint32_t(p[3]);
+      }
+      for( int i=16; i<80; i++ ) {
+         w[i] = rotate( w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1 );
+      }
+      boost::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+      for( int i=0; i<80; i++ ) {
+         boost::uint32_t f, k;
+         if( i < 20 ) {
+            f = ( b & c ) | ( ~b & d );
+            k = 0x5a827999;
+         }
+         else if( i < 40 ) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+         }
+         else if( i < 60 ) {
+            f = ( b & c ) | ( b & d ) | ( c & d );
+            k = 0x8f1bbcdc;
+         }
+         else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+         }
+         const boost::uint32_t t = rotate( a, 5 ) + f + e + k + w[i];
+         e = d;
+         d = c;
+         c = rotate( b, 30 );
+         b = a;
+         a = t;
+      }
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+   }
+
+   std::string digest;
+   for( int i=0; i<5; i++ ) {
+      for( int j=3; j>=0; j-- ) {
+         digest += char( ( h[i] >> ( 8*j ) ) & 0xff );
+      }
+   }
+   return digest;
+}
+
+std::string
+base64( const std::string& data )
+{
+   static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   std::string result;
+   for( size_t i=0; i<data.size(); i+=3 ) {
+      boost::uint32_t v = boost::uint32_t( (unsigned char)data[i] ) << 16;
+      if( i+1 < data.size() ) {
+         v |= boost::uint32_t( (unsigned char)data[i+1] ) << 8;
+      }
+      if( i+2 < data.size() ) {
+         v |= boost::uint32_t( (unsigned char)data[i+2] );
+      }
+      result += alphabet[ ( v >> 18 ) & 0x3f ];
+      result += alphabet[ ( v >> 12 ) & 0x3f ];
+      result += i+1 < data.size() ? alphabet[ ( v >> 6 ) & 0x3f ] : '=';
+      result += i+2 < data.size() ? alphabet[ v & 0x3f ] : '=';
+   }
+   return result;
+}
+
+}
+
+const size_t ModelChannel::max_message_size = 16*1024*1024;
+
+ModelChannel::Message::Message()
+   : sequence( 0 ),
+     revision( 0 )
+{
+}
+
+ModelChannel::ModelChannel( bool server )
+   : m_server( server ),
+     m_closed( false ),
+     m_revision( 0 ),
+     m_last_received( 0 ),
+     m_last_sent( 0 )
+{
+}
+
+std::string
+ModelChannel::acceptKey( const std::string& client_key )
+{
+   return base64( sha1( client_key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" ) );
+}
+
+std::string
+ModelChannel::handshakeResponse( const std::string& client_key )
+{
+   return "HTTP/1.1 101 Switching Protocols\r\n"
+          "Upgrade: websocket\r\n"
+          "Connection: Upgrade\r\n"
+          "Sec-WebSocket-Accept: " + acceptKey( client_key ) + "\r\n\r\n";
+}
+
+std::string
+ModelChannel::encodeFrame( int opcode, const std::string& payload, unsigned int mask )
+{
+   std::string frame;
+   frame += char( 0x80 | ( opcode & 0x0f ) );
+   const char mask_bit = mask != 0 ? char( 0x80 ) : char( 0 );
+   const boost::uint64_t length = payload.size();
+   if( length < 126 ) {
+      frame += char( mask_bit | char( length ) );
+   }
+   else if( length < 0x10000 ) {
+      frame += char( mask_bit | 126 );
+      frame += char( ( length >> 8 ) & 0xff );
+      frame += char( length & 0xff );
+   }
+   else {
+      frame += char( mask_bit | 127 );
+      for( int i=7; i>=0; i-- ) {
+         frame += char( ( length >> ( 8*i ) ) & 0xff );
+      }
+   }
+   if( mask == 0 ) {
+      return frame + payload;
+   }
+   char key[4];
+   for( int i=0; i<4; i++ ) {
+      key[i] = char( ( mask >> ( 8*(3-i) ) ) & 0xff );
+   }
+   frame.append( key, 4 );
+   const size_t offset = frame.size();
+   frame += payload;
+   for( size_t i=0; i<payload.size(); i++ ) {
+      frame[ offset + i ] ^= key[ i % 4 ];
+   }
+   return frame;
+}
+
+size_t
+ModelChannel::decodeFrame( const char* data, size_t size, Frame& frame )
+{
+   const unsigned char* p = reinterpret_cast<const unsigned char*>( data );
+   if( size < 2 ) {
+      return 0;
+   }
+   if( ( p[0] & 0x70 ) != 0 ) {
+      throw std::runtime_error( "WebSocket extensions are not supported" );
+   }
+   frame.fin = ( p[0] & 0x80 ) != 0;
+   frame.opcode = p[0] & 0x0f;
+   const bool masked = ( p[1] & 0x80 ) != 0;
+   frame.masked = masked;
+   boost::uint64_t length = p[1] & 0x7f;
+   size_t header = 2;
+   if( length == 126 ) {
+      if( size < 4 ) {
+         return 0;
+      }
+      length = ( boost::uint64_t( p[2] ) << 8 ) | p[3];
+      header = 4;
+   }
+   else if( length == 127 ) {
+      if( size < 10 ) {
+         return 0;
+      }
+      length = 0;
+      for( int i=0; i<8; i++ ) {
+         length = ( length << 8 ) | p[2+i];
+      }
+      header = 10;
+   }
+   if( length > max_message_size ) {
+      throw std::runtime_error( "WebSocket frame too large" );
+   }
+   const size_t key_offset = header;
+   if( masked ) {
+      header += 4;
+   }
+   if( size < header + length ) {
+      return 0;
+   }
+   frame.payload.assign( data + header, size_t( length ) );
+   if( masked ) {
+      for( size_t i=0; i<frame.payload.size(); i++ ) {
+         frame.payload[i] ^= data[ key_offset + i % 4 ];
+      }
+   }
+   return header + size_t( length );
+}
+
+std::string
+ModelChannel::formatMessage( const Message& message )
+{
+   std::stringstream header;
+   header << message.type << ' ' << message.sequence << ' ' << message.revision << '\n';
+   return header.str() + message.body;
+}
+
+bool
+ModelChannel::parseMessage( const std::string& text, Message& message )
+{
+   const size_t end = text.find( '\n' );
+   std::stringstream header( text.substr( 0, end ) );
+   if( !( header >> message.type >> message.sequence >> message.revision ) ) {
+      return false;
+   }
+   message.body = end == std::string::npos ? std::string() : text.substr( end + 1 );
+   return true;
+}
+
+unsigned int
+ModelChannel::revisionOf( const std::string& xml )
+{
+   // The first revision attribute is the one of the root element.
+   const size_t at = xml.find( "revision=\"" );
+   if( at == std::string::npos ) {
+      return 0;
+   }
+   return static_cast<unsigned int>( strtoul( xml.c_str() + at + 10, NULL, 10 ) );
+}
+
+void
+ModelChannel::receive( const char* data, size_t size )
+{
+   if( !m_closed ) {
+      m_input.append( data, size );
+   }
+}
+
+bool
+ModelChannel::next( Message& message )
+{
+   while( !m_closed ) {
+      Frame frame;
+      size_t used;
+      try {
+         used = decodeFrame( m_input.data(), m_input.size(), frame );
+      }
+      catch( std::runtime_error& ) {
+         close();
+         return false;
+      }
+      if( used == 0 ) {
+         return false;
+      }
+      m_input.erase( 0, used );
+      if( m_server && !frame.masked ) {
+         close();    // Clients must mask every frame.
+         return false;
+      }
+
+      switch( frame.opcode ) {
+      case OPCODE_PING:
+         m_output += encodeFrame( OPCODE_PONG, frame.payload );
+         continue;
+      case OPCODE_PONG:
+         continue;
+      case OPCODE_CLOSE:
+         close();
+         return false;
+      case OPCODE_TEXT:
+      case OPCODE_BINARY:
+         m_fragments = frame.payload;
+         break;
+      case OPCODE_CONTINUATION:
+         m_fragments += frame.payload;
+         break;
+      default:
+         close();
+         return false;
+      }
+      if( m_fragments.size() > max_message_size ) {
+         close();
+         return false;
+      }
+      if( !frame.fin ) {
+         continue;
+      }
+
+      Message candidate;
+      const bool ok = parseMessage( m_fragments, candidate );
+      m_fragments.clear();
+      if( !ok || candidate.sequence <= m_last_received ) {
+         continue;   // Not a message, or one we already have.
+      }
+      m_last_received = candidate.sequence;
+      if( candidate.type == "sync" ) {
+         m_revision = candidate.revision;
+      }
+      message = candidate;
+      return true;
+   }
+   return false;
+}
+
+void
+ModelChannel::send( const std::string& type, unsigned int revision, const std::string& body )
+{
+   if( m_closed ) {
+      return;
+   }
+   Message message;
+   message.type = type;
+   message.sequence = ++m_last_sent;
+   message.revision = revision;
+   message.body = body;
+   m_output += encodeFrame( OPCODE_TEXT, formatMessage( message ) );
+   if( type == "model" ) {
+      m_revision = revision;
+   }
+}
+
+std::string
+ModelChannel::takeOutput()
+{
+   std::string output;
+   output.swap( m_output );
+   return output;
+}
+
+void
+ModelChannel::close()
+{
+   if( !m_closed ) {
+      m_output += encodeFrame( OPCODE_CLOSE, std::string() );
+      m_closed = true;
+      m_input.clear();
+   }
+}
+
+}
+}
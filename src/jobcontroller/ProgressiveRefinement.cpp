@@ -0,0 +1,237 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/ProgressiveRefinement.hpp"
+#include "tinia/model/Viewer.hpp"
+#include <algorithm>
+#include <limits>
+#include <iostream>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace tinia {
+namespace jobcontroller {
+
+namespace {
+   const std::string enabled_key      = "ap_progressive";
+   const std::string scale_key        = "ap_progressiveScale";
+   const std::string quality_key      = "ap_progressiveJpgQuality";
+   const std::string idle_key         = "ap_progressiveIdleTime";
+   const std::string refinements_key  = "ap_progressiveRefinements";
+}
+
+ProgressiveRefinement::Settings::Settings()
+   : scale( 0.5 ),
+     jpeg_quality( 30 ),
+     idle_ms( 300 )
+{
+}
+
+ProgressiveRefinement::Viewer::Viewer()
+   : timestamp( 0.0 ),
+     interval( std::numeric_limits<double>::max() ),
+     changed( 0.0 ),
+     idle_ms( 0 ),
+     pending( false )
+{
+}
+
+void
+ProgressiveRefinement::enable( model::ExposedModel& model, const Settings& settings )
+{
+   model.addElement( enabled_key, true );
+   model.addConstrainedElement( scale_key, settings.scale, 0.05, 1.0 );
+   model.addConstrainedElement( quality_key, settings.jpeg_quality, 1, 100 );
+   model.addElement( idle_key, settings.idle_ms );
+   model.addElement( refinements_key, 0 );
+}
+
+ProgressiveRefinement::ProgressiveRefinement( boost::shared_ptr<model::ExposedModel> model )
+   : m_model( model ),
+     m_interactive_frames( 0 ),
+     m_refinements( 0 ),
+     m_stop( false )
+{
+   m_thread = boost::thread( &ProgressiveRefinement::run, this );
+}
+
+ProgressiveRefinement::~ProgressiveRefinement()
+{
+   {
+      boost::mutex::scoped_lock lock( m_mutex );
+      m_stop = true;
+   }
+   m_cond.notify_all();
+   m_thread.join();
+}
+
+bool
+ProgressiveRefinement::settings( Settings& settings ) const
+{
+   if( !m_model || !m_model->hasElement( enabled_key ) ) {
+      return false;
+   }
+   bool enabled = false;
+   m_model->getElementValue( enabled_key, enabled );
+   if( !enabled ) {
+      return false;
+   }
+   settings = Settings();
+   if( m_model->hasElement( scale_key ) ) {
+      m_model->getElementValue( scale_key, settings.scale );
+   }
+   if( m_model->hasElement( quality_key ) ) {
+      m_model->getElementValue( quality_key, settings.jpeg_quality );
+   }
+   if( m_model->hasElement( idle_key ) ) {
+      m_model->getElementValue( idle_key, settings.idle_ms );
+   }
+   return true;
+}
+
+bool
+ProgressiveRefinement::interactive( const std::string& key )
+{
+   Settings s;
+   if( !settings( s ) || !m_model->hasElement( key ) ) {
+      return false;
+   }
+   model::Viewer viewer;
+   try {
+      m_model->getElementValue( key, viewer );
+   }
+   catch( std::exception& e ) {
+      return false;   // Not a viewer.
+   }
+   return interactive( key, viewer.timestamp, now(), s );
+}
+
+bool
+ProgressiveRefinement::interactive( const std::string& key,
+                                    double timestamp,
+                                    double now,
+                                    const Settings& settings )
+{
+   bool result = false;
+   {
+      boost::mutex::scoped_lock lock( m_mutex );
+      Viewer& viewer = m_viewers[ key ];
+      if( timestamp != viewer.timestamp ) {
+         viewer.interval = viewer.timestamp > 0.0 ? timestamp - viewer.timestamp
+                                                  : std::numeric_limits<double>::max();
+         viewer.timestamp = timestamp;
+         viewer.changed = now;
+      }
+      viewer.idle_ms = settings.idle_ms;
+      result = ( viewer.interval < settings.idle_ms ) && ( now - viewer.changed < settings.idle_ms );
+      if( result ) {
+         viewer.pending = true;
+         m_interactive_frames++;
+      }
+   }
+   if( result ) {
+      m_cond.notify_all();
+   }
+   return result;
+}
+
+std::vector<std::string>
+ProgressiveRefinement::due( double now )
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   std::vector<std::string> keys;
+   for( std::map<std::string, Viewer>::iterator it = m_viewers.begin(); it != m_viewers.end(); ++it ) {
+      Viewer& viewer = it->second;
+      if( viewer.pending && ( now - viewer.changed >= viewer.idle_ms ) ) {
+         viewer.pending = false;
+         keys.push_back( it->first );
+      }
+   }
+   return keys;
+}
+
+unsigned int
+ProgressiveRefinement::scaled( unsigned int size, double scale )
+{
+   return std::max( 1u, static_cast<unsigned int>( size*scale + 0.5 ) );
+}
+
+double
+ProgressiveRefinement::now()
+{
+   static const boost::posix_time::ptime epoch( boost::gregorian::date( 1970, 1, 1 ) );
+   return ( boost::posix_time::microsec_clock::universal_time() - epoch ).total_microseconds() / 1000.0;
+}
+
+unsigned long
+ProgressiveRefinement::interactiveFrames() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_interactive_frames;
+}
+
+unsigned long
+ProgressiveRefinement::refinements() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_refinements;
+}
+
+void
+ProgressiveRefinement::run()
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   while( !m_stop ) {
+      // Sleep until the first pending viewer has been idle long enough.
+      double first = std::numeric_limits<double>::max();
+      for( std::map<std::string, Viewer>::const_iterator it = m_viewers.begin(); it != m_viewers.end(); ++it ) {
+         if( it->second.pending ) {
+            first = std::min( first, it->second.changed + it->second.idle_ms );
+         }
+      }
+      if( first == std::numeric_limits<double>::max() ) {
+         m_cond.wait( lock );
+         continue;
+      }
+      const double wait_ms = first - now();
+      if( wait_ms > 0.0 ) {
+         m_cond.timed_wait( lock, boost::posix_time::microseconds( static_cast<long>( 1000.0*wait_ms ) + 1 ) );
+         continue;
+      }
+
+      lock.unlock();
+      const bool refine = !due( now() ).empty() && m_model && m_model->hasElement( refinements_key );
+      if( refine ) {
+         // Any change of the model makes the clients fetch new snapshots.
+         try {
+            int refinements = 0;
+            m_model->getElementValue( refinements_key, refinements );
+            m_model->updateElement( refinements_key, refinements + 1 );
+         }
+         catch( std::exception& e ) {
+            std::cerr << "ProgressiveRefinement: " << e.what() << std::endl;
+         }
+      }
+      lock.lock();
+      if( refine ) {
+         m_refinements++;
+      }
+   }
+}
+
+}
+}
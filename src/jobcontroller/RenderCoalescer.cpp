@@ -0,0 +1,118 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/RenderCoalescer.hpp"
+
+namespace tinia {
+namespace jobcontroller {
+
+RenderCoalescer::RenderCoalescer()
+   : m_renders( 0 ),
+     m_shared( 0 )
+{
+}
+
+RenderCoalescer::Ticket
+RenderCoalescer::join( const std::string& slot, const std::string& key )
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   Slot& s = m_slots[ slot ];
+   s.m_users++;
+
+   Ticket ticket;
+   ticket.m_slot = slot;
+   ticket.m_key = key;
+   ticket.m_generation = s.m_generation;
+   if( !s.m_running ) {
+      lead( s, ticket );
+   }
+   return ticket;
+}
+
+bool
+RenderCoalescer::wait( Ticket& ticket, Data& data )
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   Slot& s = m_slots[ ticket.m_slot ];
+   while( true ) {
+      if( s.m_generation != ticket.m_generation ) {
+         // A render has finished since we last looked.
+         ticket.m_generation = s.m_generation;
+         if( s.m_last_data && ( s.m_last_key == ticket.m_key ) ) {
+            data = s.m_last_data;
+            m_shared++;
+            release( ticket.m_slot, s );
+            return true;
+         }
+      }
+      if( !s.m_running ) {
+         lead( s, ticket );
+         return false;
+      }
+      m_published.wait( lock );
+   }
+}
+
+void
+RenderCoalescer::publish( const Ticket& ticket, const Data& data )
+{
+   {
+      boost::mutex::scoped_lock lock( m_mutex );
+      Slot& s = m_slots[ ticket.m_slot ];
+      s.m_running = false;
+      s.m_generation++;
+      s.m_last_key = ticket.m_key;
+      s.m_last_data = data;
+      release( ticket.m_slot, s );
+   }
+   m_published.notify_all();
+}
+
+unsigned long
+RenderCoalescer::renders() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_renders;
+}
+
+unsigned long
+RenderCoalescer::shared() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_shared;
+}
+
+void
+RenderCoalescer::lead( Slot& slot, Ticket& ticket )
+{
+   slot.m_running = true;
+   ticket.m_leader = true;
+   m_renders++;
+}
+
+void
+RenderCoalescer::release( const std::string& name, Slot& slot )
+{
+   slot.m_users--;
+   if( ( slot.m_users == 0 ) && !slot.m_running ) {
+      m_slots.erase( name );
+   }
+}
+
+}
+}
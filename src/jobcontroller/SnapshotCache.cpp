@@ -0,0 +1,157 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/SnapshotCache.hpp"
+#include <cstdlib>
+#include <cstdio>
+#include <sstream>
+
+namespace tinia {
+namespace jobcontroller {
+
+SnapshotCache::SnapshotCache( size_t capacity )
+   : m_capacity( capacity ),
+     m_hits( 0 ),
+     m_misses( 0 ),
+     m_not_modified( 0 )
+{
+}
+
+size_t
+SnapshotCache::capacityFromEnvironment()
+{
+   const char* size_env = getenv( "TINIA_SNAPSHOT_CACHE_SIZE" );
+   if( size_env != NULL && *size_env != '\0' ) {
+      const int size = atoi( size_env );
+      return size > 0 ? size_t( size ) : 0u;
+   }
+   return 0u;
+}
+
+std::string
+SnapshotCache::makeKey( const std::string& view,
+                        unsigned int width,
+                        unsigned int height,
+                        const std::string& format,
+                        unsigned int revision )
+{
+   std::stringstream key;
+   key << view << '/' << width << 'x' << height << '/' << format << '/' << revision;
+   return key.str();
+}
+
+std::string
+SnapshotCache::etag( const std::string& key )
+{
+   // 64-bit FNV-1a, the key is not meant to be readable by the client.
+   unsigned long long hash = 14695981039346656037ull;
+   for( size_t i=0; i<key.size(); i++ ) {
+      hash ^= (unsigned char)key[i];
+      hash *= 1099511628211ull;
+   }
+   char buffer[24];
+   snprintf( buffer, sizeof(buffer), "\"%016llx\"", hash );
+   return std::string( buffer );
+}
+
+SnapshotCache::Data
+SnapshotCache::lookup( const std::string& key )
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   std::map<std::string, Entry>::iterator it = m_entries.find( key );
+   if( it == m_entries.end() ) {
+      m_misses++;
+      return Data();
+   }
+   m_hits++;
+   m_recency.splice( m_recency.begin(), m_recency, it->second.second );
+   return it->second.first;
+}
+
+void
+SnapshotCache::insert( const std::string& key, const char* data, size_t size )
+{
+   if( m_capacity == 0 ) {
+      return;
+   }
+   Data copy( new std::vector<char>( data, data + size ) );
+
+   boost::mutex::scoped_lock lock( m_mutex );
+   std::map<std::string, Entry>::iterator it = m_entries.find( key );
+   if( it != m_entries.end() ) {
+      it->second.first = copy;
+      m_recency.splice( m_recency.begin(), m_recency, it->second.second );
+      return;
+   }
+   while( m_entries.size() >= m_capacity ) {
+      m_entries.erase( m_recency.back() );
+      m_recency.pop_back();
+   }
+   m_recency.push_front( key );
+   m_entries[ key ] = Entry( copy, m_recency.begin() );
+}
+
+void
+SnapshotCache::notModified()
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   m_not_modified++;
+}
+
+void
+SnapshotCache::clear()
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   m_entries.clear();
+   m_recency.clear();
+}
+
+unsigned long
+SnapshotCache::hits() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_hits;
+}
+
+unsigned long
+SnapshotCache::misses() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_misses;
+}
+
+unsigned long
+SnapshotCache::notModifiedCount() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   return m_not_modified;
+}
+
+double
+SnapshotCache::hitRate() const
+{
+   boost::mutex::scoped_lock lock( m_mutex );
+   const unsigned long total = m_hits + m_misses + m_not_modified;
+   if( total == 0 ) {
+      return 0.0;
+   }
+   return double( m_hits + m_not_modified ) / double( total );
+}
+
+}
+}
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <httpd.h>
 #include <http_config.h>
 #include <http_log.h>
@@ -5,6 +6,7 @@
 #include <util_filter.h>
 #include <apr_buckets.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
 //#include <libxml/parser.h>  // xmlReadMemory
 #include <libxml/xmlreader.h>
@@ -12,8 +14,150 @@
 
 typedef struct {
     apr_bucket_brigade*  m_bb;    
+    apr_off_t            m_bytes;
 } tinia_xml_in_ctx_t;
 
+/** A reader with a schema validator attached, kept between requests.
+ *
+ * Creating the validation context and the reader is a fair share of the cost
+ * of validating a small query, so a child keeps the ones of finished requests
+ * on a free list, one per schema and concurrent request.
+ */
+typedef struct tinia_xml_validator
+{
+    struct tinia_xml_validator*  m_next;
+    xmlSchemaPtr                 m_schema;
+    xmlSchemaValidCtxtPtr        m_ctx;
+    xmlTextReaderPtr             m_reader;
+} tinia_xml_validator_t;
+
+static tinia_xml_validator_t*  tinia_xml_validator_free_list = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t*     tinia_xml_validator_mutex = NULL;
+#endif
+
+
+
+
+static
+void
+tinia_xml_validator_lock()
+{
+#if APR_HAS_THREADS
+    if( tinia_xml_validator_mutex != NULL ) {
+        apr_thread_mutex_lock( tinia_xml_validator_mutex );
+    }
+#endif
+}
+
+
+
+
+static
+void
+tinia_xml_validator_unlock()
+{
+#if APR_HAS_THREADS
+    if( tinia_xml_validator_mutex != NULL ) {
+        apr_thread_mutex_unlock( tinia_xml_validator_mutex );
+    }
+#endif
+}
+
+
+
+
+static
+void
+tinia_xml_validator_destroy( tinia_xml_validator_t* validator )
+{
+    if( validator->m_reader != NULL ) {
+        xmlFreeTextReader( validator->m_reader );
+    }
+    if( validator->m_ctx != NULL ) {
+        xmlSchemaFreeValidCtxt( validator->m_ctx );
+    }
+    free( validator );
+}
+
+
+
+
+static
+apr_status_t
+tinia_xml_validator_child_exit( void* data )
+{
+    tinia_xml_validator_lock();
+    while( tinia_xml_validator_free_list != NULL ) {
+        tinia_xml_validator_t* validator = tinia_xml_validator_free_list;
+        tinia_xml_validator_free_list = validator->m_next;
+        tinia_xml_validator_destroy( validator );
+    }
+    tinia_xml_validator_unlock();
+    return APR_SUCCESS;
+}
+
+
+
+
+void
+tinia_validate_xml_child_init( apr_pool_t* pchild )
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_create( &tinia_xml_validator_mutex, APR_THREAD_MUTEX_DEFAULT, pchild );
+#endif
+    apr_pool_cleanup_register( pchild, NULL, tinia_xml_validator_child_exit, apr_pool_cleanup_null );
+}
+
+
+
+
+/** A validator for schema from the free list, or a new one. The reader is
+ * created on first use, as it needs a document. */
+static
+tinia_xml_validator_t*
+tinia_xml_validator_acquire( xmlSchemaPtr schema )
+{
+    tinia_xml_validator_lock();
+    tinia_xml_validator_t** it = &tinia_xml_validator_free_list;
+    while( (*it != NULL) && ((*it)->m_schema != schema) ) {
+        it = &(*it)->m_next;
+    }
+    tinia_xml_validator_t* validator = *it;
+    if( validator != NULL ) {
+        *it = validator->m_next;
+    }
+    tinia_xml_validator_unlock();
+
+    if( validator == NULL ) {
+        validator = (tinia_xml_validator_t*)calloc( 1, sizeof(tinia_xml_validator_t) );
+        if( validator == NULL ) {
+            return NULL;
+        }
+        validator->m_schema = schema;
+        validator->m_ctx = xmlSchemaNewValidCtxt( schema );
+        if( validator->m_ctx == NULL ) {
+            tinia_xml_validator_destroy( validator );
+            return NULL;
+        }
+    }
+    validator->m_next = NULL;
+    return validator;
+}
+
+
+
+
+static
+void
+tinia_xml_validator_release( tinia_xml_validator_t* validator )
+{
+    tinia_xml_validator_lock();
+    validator->m_next = tinia_xml_validator_free_list;
+    tinia_xml_validator_free_list = validator;
+    tinia_xml_validator_unlock();
+}
+
 /** Callback to be used with xmlSetGenericErrorFunc. */
 static
 void
@@ -81,61 +225,64 @@ tinia_validate_xml_helper( ap_filter_t *f,
     xmlGenericErrorFunc  old_error_func = xmlGenericError;
     xmlSetGenericErrorFunc( f, tinia_filter_libxml_generic_error_func );
     
-    // -- Create and attach input, reader and validator ------------------------
-    xmlParserInputBufferPtr input = xmlParserInputBufferCreateStatic( doc,
-                                                                      len,
-                                                                      XML_CHAR_ENCODING_NONE );
-    if( input == NULL ) {
+    // -- Get a reader and validator, and point the reader at the document -----
+    tinia_xml_validator_t* validator = tinia_xml_validator_acquire( schema );
+    if( validator == NULL ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
+                       "%s: Failed to create libxml2 schema validator.", f->frec->name );
+        xmlSetGenericErrorFunc( old_error_context, old_error_func );
+        return rv;
+    }
+    int ret = -1;
+    if( validator->m_reader == NULL ) {
+        validator->m_reader = xmlReaderForMemory( doc, len, url, NULL, 0 );
+        ret = validator->m_reader != NULL ? 0 : -1;
+    }
+    else {
+        ret = xmlReaderNewMemory( validator->m_reader, doc, len, url, NULL, 0 );
+    }
+    if( ret != 0 ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
+                       "%s: Failed to create libxml2 reader.", f->frec->name );
+        tinia_xml_validator_destroy( validator );
+        xmlSetGenericErrorFunc( old_error_context, old_error_func );
+        return rv;
+    }
+    xmlTextReaderPtr reader = validator->m_reader;
+    // Not sure if this one is used.
+    xmlTextReaderSetErrorHandler( reader, tinia_filter_libxml_error_func, f );
+    // Not sure if this one is used either.
+    xmlTextReaderSetStructuredErrorHandler( reader, tinia_filter_libxml_structured_error_func, f );
+    xmlTextReaderSchemaValidateCtxt( reader, validator->m_ctx, 0 );
+
+    // --- parse xml and check if it is valid ----------------------------------
+    ret = xmlTextReaderRead( reader );
+    while( ret == 1 ) {
+        ret = xmlTextReaderRead( reader );
+    }
+    if( ret != 0 ) {
         ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
-                       "%s: Failed to create libxml2 input buffer.", f->frec->name );
+                       "%s: Failed to parse XML: %s", f->frec->name, f->r->path_info );
     }
     else {
-        xmlTextReaderPtr reader = xmlNewTextReader( input, url );
-        if( reader == NULL ) {
+        if( xmlTextReaderIsValid( reader ) != 1 ) {
             ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
-                           "%s: Failed to create libxml2 reader.", f->frec->name );
+                           "%s: Failed to validate XML: %s", f->frec->name, f->r->path_info );
         }
         else {
-            // Not sure if this one is used.
-            xmlTextReaderSetErrorHandler( reader, tinia_filter_libxml_error_func, f );
-            // Not sure if this one is used either.
-            xmlTextReaderSetStructuredErrorHandler( reader, tinia_filter_libxml_structured_error_func, f );
-
-            xmlSchemaValidCtxtPtr validator = xmlSchemaNewValidCtxt( schema );
-            if( validator == NULL ) {
-                ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
-                               "%s: Failed to create libxml2 schema validator.", f->frec->name );
-            }
-            else {
-                xmlTextReaderSchemaValidateCtxt( reader, validator, 0 );
-    
-                // --- parse xml and check if it is valid ----------------------        
-                int ret = xmlTextReaderRead( reader );
-                while( ret == 1 ) {
-                    ret = xmlTextReaderRead( reader );
-                }
-                if( ret != 0 ) {
-                    ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
-                                   "%s: Failed to parse XML: %s", f->frec->name, f->r->path_info );
-                }
-                else {
-                    if( xmlTextReaderIsValid( reader ) != 1 ) {
-                        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
-                                       "%s: Failed to validate XML: %s", f->frec->name, f->r->path_info );
-                    }
-                    else {
-                        //ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, f->r,
-                        //               "%s: valid input xml: %s", f->frec->name, f->r->path_info );
-                        rv = APR_SUCCESS; // xml is parsed and validated!
-                    }
-                }
-                xmlTextReaderSchemaValidateCtxt( reader, NULL, 0 );
-                xmlSchemaFreeValidCtxt( validator );
-            }
-            xmlFreeTextReader( reader );
+            //ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, f->r,
+            //               "%s: valid input xml: %s", f->frec->name, f->r->path_info );
+            rv = APR_SUCCESS; // xml is parsed and validated!
         }
-        xmlFreeParserInputBuffer( input );
     }
+    // Detach everything that refers to this request before the reader is
+    // handed to the next one.
+    xmlTextReaderSchemaValidateCtxt( reader, NULL, 0 );
+    xmlTextReaderSetErrorHandler( reader, NULL, NULL );
+    xmlTextReaderSetStructuredErrorHandler( reader, NULL, NULL );
+    xmlTextReaderClose( reader );
+    tinia_xml_validator_release( validator );
+
     xmlSetGenericErrorFunc( old_error_context, old_error_func );
     return rv;
 }
@@ -158,7 +305,7 @@ tinia_validate_xml_in_filter( ap_filter_t *f,
     }
     
     // --- we need a schema if we're going to validate -------------------------
-    if( req_cfg->m_schema == NULL ) {
+    if( (req_cfg->m_schema == NULL) && !req_cfg->m_size_only ) {
         ap_log_rerror( APLOG_MARK, APLOG_WARNING, 0, f->r,
                        "%s: missing schema.", f->frec->name );
         
@@ -214,11 +361,32 @@ tinia_validate_xml_in_filter( ap_filter_t *f,
         
         // --- create filter context -------------------------------------------
         ctx = f->ctx = apr_palloc( f->r->pool, sizeof(tinia_xml_in_ctx_t) );
-        ctx->m_bb = apr_brigade_create( f->r->pool, f->r->connection->bucket_alloc);
+        ctx->m_bb = req_cfg->m_size_only ? NULL : apr_brigade_create( f->r->pool, f->r->connection->bucket_alloc);
+        ctx->m_bytes = 0;
     }
 
-    // --- pull data from previous filters and populate my own brigade ---------
+    // --- pull data from previous filters and enforce the size limit ----------
     apr_status_t rv = ap_get_brigade( f->next, bb, mode, block, readbytes );
+    if( rv != APR_SUCCESS ) {
+        return rv;
+    }
+    apr_off_t bytes = 0;
+    rv = apr_brigade_length( bb, 1, &bytes );
+    if( rv != APR_SUCCESS ) {
+        return rv;
+    }
+    ctx->m_bytes += bytes;
+    if( ctx->m_bytes > req_cfg->m_max_bytes ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
+                       "%s: XML larger than %" APR_OFF_T_FMT " bytes.", f->frec->name, req_cfg->m_max_bytes );
+        return APR_ENOSPC;
+    }
+    if( req_cfg->m_size_only ) {
+        // The receiver validates the query while it parses it.
+        return rv;
+    }
+
+    // --- populate my own brigade ---------------------------------------------
     apr_bucket* e = APR_BRIGADE_FIRST( bb );
     while( e != APR_BRIGADE_SENTINEL( bb ) ) {
         // copy bucket into our own private brigade
@@ -233,9 +401,9 @@ tinia_validate_xml_in_filter( ap_filter_t *f,
                                             ctx->m_bb,
                                             req_cfg->m_schema, 
                                             "tinia.sintef.no" );
-            // and clean up
-            rv = apr_brigade_destroy( ctx->m_bb );
-            if( rv != APR_SUCCESS ) {
+            // and clean up, an invalid document is not passed on.
+            apr_status_t drv = apr_brigade_destroy( ctx->m_bb );
+            if( drv != APR_SUCCESS ) {
                 ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, f->r,
                                "%s: apr_brigade_destroy failed.", f->frec->name );
             }
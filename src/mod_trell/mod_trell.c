@@ -49,8 +49,59 @@ const module* tinia_get_module()
 }
 
 
-/** Apache's entry-point to mod_trell. */
-static int trell_handler_body(request_rec *r)
+/** Dispatches a request to a job, returns DECLINED if the request is unknown. */
+static int
+trell_handle_job_request( trell_sconf_t*          sconf,
+                          request_rec*            r,
+                          trell_dispatch_info_t*  dispatch_info )
+{
+    switch( dispatch_info->m_request ) {
+    case TRELL_REQUEST_POLICY_UPDATE_XML:
+        return trell_handle_get_model_update( sconf, r, dispatch_info );
+        break;
+    case TRELL_REQUEST_STATE_UPDATE_XML:
+        return trell_handle_update_state( sconf, r, dispatch_info );
+        break;
+    case TRELL_REQUEST_PNG:
+        // Check if a model update is piggy-backed on request.
+        if( r->method_number == M_POST ) {
+            int rv = trell_handle_update_state( sconf, r, dispatch_info );
+            if( rv != OK ) {
+                // Something went wrong with the update, bail out.
+                return rv;
+            }
+        }
+        return trell_handle_get_snapshot( sconf, r, dispatch_info );
+        break;
+    case TRELL_REQUEST_SNAPSHOT_STREAM:
+        return trell_handle_get_snapshot_stream( sconf, r, dispatch_info );
+        break;
+    case TRELL_REQUEST_GET_RENDERLIST:
+        // Check if a model update is piggy-backed on request.
+        if( r->method_number == M_POST ) {
+            int rv = trell_handle_update_state( sconf, r, dispatch_info );
+            if( rv != OK ) {
+                // Something went wrong with the update, bail out.
+                return rv;
+            }
+        }
+        return trell_handle_get_renderlist( sconf, r, dispatch_info );
+        break;
+    case TRELL_REQUEST_GET_SCRIPT:
+        return trell_handle_get_script( sconf, r, dispatch_info);
+
+    default:
+        break;
+    }
+    return DECLINED;
+}
+
+/** Apache's entry-point to mod_trell.
+ *
+ * dispatch_info_out is set to the decoded request, such that it can be
+ * timed.
+ */
+static int trell_handler_body(request_rec *r, trell_dispatch_info_t** dispatch_info_out)
 {
     if (!r->handler || strcmp(r->handler, "trell") ) {
         return DECLINED;
@@ -79,6 +130,10 @@ static int trell_handler_body(request_rec *r)
         return code;
     }
     dispatch_info->m_entry = apr_time_now();
+    *dispatch_info_out = dispatch_info;
+    if( trell_timing_is_timed( dispatch_info ) ) {
+        trell_timing_add_filter( r, dispatch_info );
+    }
 
 #if 0
     ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r,
@@ -109,6 +164,9 @@ static int trell_handler_body(request_rec *r)
             case TRELL_MOD_ACTION_RESTART_MASTER:
                 return trell_ops_do_restart_master( sconf, r );
                 break;
+            case TRELL_MOD_ACTION_TIMING_STATS:
+                return trell_timing_stats( r );
+                break;
             default:
                 break;
             }
@@ -132,57 +190,20 @@ static int trell_handler_body(request_rec *r)
         break;
 
     case TRELL_COMPONENT_JOB:
-
-        switch( dispatch_info->m_request ) {
-        case TRELL_REQUEST_STATIC_FILE:
+        if( dispatch_info->m_request == TRELL_REQUEST_STATIC_FILE ) {
             return trell_send_reply_static_file( sconf, r, dispatch_info );
-            break;
-        case TRELL_REQUEST_POLICY_UPDATE_XML:
-            return trell_handle_get_model_update( sconf, r, dispatch_info );
-            break;
-        case TRELL_REQUEST_STATE_UPDATE_XML:
-            return trell_handle_update_state( sconf, r, dispatch_info );
-            break;
-        case TRELL_REQUEST_PNG:
-            // Check if a model update is piggy-backed on request.
-            if( r->method_number == M_POST ) {
-                int rv = trell_handle_update_state( sconf, r, dispatch_info );
-                if( rv != OK ) {
-                    // Something went wrong with the update, bail out.
-                    return rv;
-                }
-            }
-            int rv = trell_handle_get_snapshot( sconf, r, dispatch_info );
-            dispatch_info->m_exit = apr_time_now();
-
-//            ap_log_rerror( APLOG_MARK, APLOG_NOTICE, rv, r,
-//                           "mod_trell: request=%ldms, png=%ldms, filter=%ldms, compact=%ldms.",
-//                           apr_time_as_msec(dispatch_info->m_exit-dispatch_info->m_entry ),
-//                           apr_time_as_msec(dispatch_info->m_png_exit-dispatch_info->m_png_entry),
-//                           apr_time_as_msec(dispatch_info->m_png_filter_exit-dispatch_info->m_png_filter_entry),
-//                           apr_time_as_msec(dispatch_info->m_png_compress_exit-dispatch_info->m_png_compress_entry)
-//                           );
-            
-            return rv;
-            break;
-        case TRELL_REQUEST_GET_RENDERLIST:
-            // Check if a model update is piggy-backed on request.
-            if( r->method_number == M_POST ) {
-                int rv = trell_handle_update_state( sconf, r, dispatch_info );
-                if( rv != OK ) {
-                    // Something went wrong with the update, bail out.
-                    return rv;
-                }
-            }
-            return trell_handle_get_renderlist( sconf, r, dispatch_info );
-            break;
-        case TRELL_REQUEST_GET_SCRIPT:
-            return trell_handle_get_script( sconf, r, dispatch_info);
-
-        default:
+        }
+        code = trell_handle_job_request( sconf, r, dispatch_info );
+        if( code == DECLINED ) {
             break;
         }
-        break;
+        // The job could not be reached, it may be hibernated.
+        if( ( ( code == HTTP_REQUEST_TIME_OUT ) || ( code == HTTP_NOT_FOUND ) ) &&
+            ( trell_job_wake( sconf, r, dispatch_info->m_jobid ) == OK ) )
+        {
+            code = trell_handle_job_request( sconf, r, dispatch_info );
+        }
+        return code;
 
     default:
         break;
@@ -196,7 +217,20 @@ static int trell_handler_body(request_rec *r)
 static int trell_handler(request_rec *r)
 {
     //ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "mod_trell: %d: begin.", getpid() );
-    int retval = trell_handler_body( r );
+    trell_dispatch_info_t* dispatch_info = NULL;
+    int retval = trell_handler_body( r, &dispatch_info );
+    if( ( dispatch_info != NULL ) &&
+        trell_timing_is_timed( dispatch_info ) &&
+        ( ( retval == OK ) || ( retval == HTTP_NOT_MODIFIED ) ) )
+    {
+        if( dispatch_info->m_component == TRELL_COMPONENT_MASTER ) {
+            trell_sconf_t* sconf = ap_get_module_config( r->server->module_config, &trell_module );
+            trell_timing_record( r, sconf->m_master_id, dispatch_info );
+        }
+        else {
+            trell_timing_record( r, dispatch_info->m_jobid, dispatch_info );
+        }
+    }
     //ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "mod_trell: %d: end = %d.", getpid(), retval );
     return retval;
 }
@@ -304,6 +338,10 @@ trell_child_init(apr_pool_t *p, server_rec *s)
                        "mod_trell: Illegal configuration, giving up" );
     }
 
+    trell_arena_child_init( p );
+    tinia_validate_xml_child_init( p );
+    trell_timing_child_init( p );
+
 
 
     xmlInitParser();
@@ -356,6 +394,14 @@ trell_child_init(apr_pool_t *p, server_rec *s)
 }
 
 
+/** Creates what the child processes share. */
+static int
+trell_post_config( apr_pool_t* pconf, apr_pool_t* plog, apr_pool_t* ptemp, server_rec* s )
+{
+    return trell_timing_post_config( pconf, s );
+}
+
+
 /** Function to create our per-server configuration struct. */
 static void*
 mod_trell_create_svr_conf( apr_pool_t* pool, server_rec* s )
@@ -371,6 +417,8 @@ mod_trell_create_svr_conf( apr_pool_t* pool, server_rec* s )
     cfg->m_rpc_master_schema = NULL;
     cfg->m_rpc_job_schema = NULL;
     cfg->m_rpc_reply_schema = NULL;
+    cfg->m_validate_xml = TRELL_VALIDATE_XML_UNSET;
+    cfg->m_xml_max_bytes = 0;
     return cfg;
 }
 
@@ -386,6 +434,8 @@ mod_trell_merge_svr_conf( apr_pool_t* pool, void* base_, void* add_ )
     res->m_app_root_dir = (add->m_app_root_dir == NULL) ? base->m_app_root_dir : add->m_app_root_dir;
     res->m_schema_root_dir = (add->m_schema_root_dir == NULL) ? base->m_schema_root_dir : add->m_schema_root_dir;
     res->m_job_www_root = (add->m_job_www_root == NULL) ? base->m_job_www_root : add->m_job_www_root;
+    res->m_validate_xml = (add->m_validate_xml == TRELL_VALIDATE_XML_UNSET) ? base->m_validate_xml : add->m_validate_xml;
+    res->m_xml_max_bytes = (add->m_xml_max_bytes == 0) ? base->m_xml_max_bytes : add->m_xml_max_bytes;
     return res;
 }
 
@@ -403,6 +453,37 @@ mod_trell_conf_string_set_callback( cmd_parms* cmd, void* cfg, const char* val )
     return NULL;
 }
 
+/** Callback for TrellValidateXml, which is either 'filter' or 'job'. */
+static const char*
+mod_trell_conf_validate_xml_callback( cmd_parms* cmd, void* cfg, const char* val )
+{
+    struct mod_trell_svr_conf* svr = ap_get_module_config( cmd->server->module_config, &trell_module );
+    if( strcasecmp( val, "filter" ) == 0 ) {
+        svr->m_validate_xml = TRELL_VALIDATE_XML_FILTER;
+    }
+    else if( strcasecmp( val, "job" ) == 0 ) {
+        svr->m_validate_xml = TRELL_VALIDATE_XML_JOB;
+    }
+    else {
+        return "TrellValidateXml must be either 'filter' or 'job'";
+    }
+    return NULL;
+}
+
+/** Callback for TrellXmlMaxBytes. */
+static const char*
+mod_trell_conf_xml_max_bytes_callback( cmd_parms* cmd, void* cfg, const char* val )
+{
+    struct mod_trell_svr_conf* svr = ap_get_module_config( cmd->server->module_config, &trell_module );
+    char* end = NULL;
+    if( (apr_strtoff( &svr->m_xml_max_bytes, val, &end, 10 ) != APR_SUCCESS) ||
+        (*end != '\0') || (svr->m_xml_max_bytes <= 0) )
+    {
+        return "TrellXmlMaxBytes must be a positive number of bytes";
+    }
+    return NULL;
+}
+
 
 /** Definitions of the commands that we accept from httpd.conf. */
 static const command_rec mod_trell_commands[] = {
@@ -438,6 +519,18 @@ static const command_rec mod_trell_commands[] = {
                    RSRC_CONF,
                    "Root directory where static job www resources reside"
     ),
+    AP_INIT_TAKE1( "TrellValidateXml",
+                   mod_trell_conf_validate_xml_callback,
+                   NULL,
+                   RSRC_CONF,
+                   "Where posted XML is validated: 'filter' (default) or 'job'"
+    ),
+    AP_INIT_TAKE1( "TrellXmlMaxBytes",
+                   mod_trell_conf_xml_max_bytes_callback,
+                   NULL,
+                   RSRC_CONF,
+                   "Largest posted XML document, in bytes"
+    ),
 
 
     { NULL }
@@ -455,9 +548,13 @@ mod_trell_register_hooks (apr_pool_t *p)
                                tinia_validate_xml_out_filter,
                                NULL, // ap_init_filter_func
                                AP_FTYPE_RESOURCE );
+    ap_register_output_filter( "trell_timing",
+                               trell_timing_out_filter,
+                               NULL, // ap_init_filter_func
+                               AP_FTYPE_CONTENT_SET );
     ap_hook_handler(trell_handler, NULL, NULL, APR_HOOK_LAST );
 //    ap_hook_pre_config( trell_pre_config, NULL, NULL, APR_HOOK_LAST );
-//    ap_hook_post_config( trell_post_config, NULL, NULL, APR_HOOK_LAST );
+    ap_hook_post_config( trell_post_config, NULL, NULL, APR_HOOK_LAST );
     ap_hook_child_init( trell_child_init, NULL, NULL, APR_HOOK_LAST );
 }
 
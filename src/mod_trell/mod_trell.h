@@ -29,6 +29,9 @@
 #include "tinia/trell/trell.h"
 #include "apr_time.h"
 
+/** How long a request waits for a hibernated job to be restored. */
+#define TRELL_JOB_WAKE_TIMEOUT_S 30
+
 
 /** Trell configuration structure.
   *
@@ -59,10 +62,28 @@ typedef struct mod_trell_svr_conf
     xmlSchemaPtr  m_rpc_job_schema;
     /** Schema that validates XML RPC replies */
     xmlSchemaPtr  m_rpc_reply_schema;
+    /** Where posted XML is validated, use TrellValidateXml to set. */
+    int           m_validate_xml;
+    /** Largest posted XML document, use TrellXmlMaxBytes to set. */
+    apr_off_t     m_xml_max_bytes;
     /** 256-entry CRC table used by PNG encoder. */
     unsigned int* m_crc_table;
 } trell_sconf_t;
 
+/** Where XML RPC queries are validated against their schema. */
+enum TrellValidateXml {
+    TRELL_VALIDATE_XML_UNSET = 0,
+    /** The input filter parses and validates the query, and the receiver
+     * parses it again. This is the default. */
+    TRELL_VALIDATE_XML_FILTER,
+    /** The receiver validates while it parses the query, the input filter
+     * only enforces the size limit. */
+    TRELL_VALIDATE_XML_JOB
+};
+
+/** Largest posted XML document if TrellXmlMaxBytes is not set. */
+#define TRELL_XML_MAX_BYTES_DEFAULT (1024*1024)
+
 enum TrellComponent {
     TRELL_COMPONENT_NONE = 0,
     TRELL_COMPONENT_OPS,
@@ -79,18 +100,52 @@ enum TrellRequest {
     TRELL_REQUEST_PNG,
     //TRELL_REQUEST_JPG,
     TRELL_REQUEST_GET_RENDERLIST,
-    TRELL_REQUEST_GET_SCRIPT
+    TRELL_REQUEST_GET_SCRIPT,
+    TRELL_REQUEST_SNAPSHOT_STREAM
 };
 
 enum TrellModAction {
     TRELL_MOD_ACTION_NONE,
-    TRELL_MOD_ACTION_RESTART_MASTER
+    TRELL_MOD_ACTION_RESTART_MASTER,
+    TRELL_MOD_ACTION_TIMING_STATS
 };
 
+/** The stages of a request that are timed. */
+enum TrellTimingStage {
+    /** Opening the connection to the job. */
+    TRELL_TIMING_CONNECT,
+    /** Writing the query to the job. */
+    TRELL_TIMING_SEND,
+    /** The job handling the query, as reported in the reply. */
+    TRELL_TIMING_JOB,
+    /** The rest of the round trip, until the reply has been read. */
+    TRELL_TIMING_TRANSFER,
+    /** Png filtering of the images. */
+    TRELL_TIMING_FILTER,
+    /** Png or jpeg compression of the images. */
+    TRELL_TIMING_COMPRESS,
+    /** Base64-encoding of the images. */
+    TRELL_TIMING_BASE64,
+    /** The whole request, from it was decoded. */
+    TRELL_TIMING_TOTAL,
+    TRELL_TIMING_STAGES
+};
+
+/** The histograms of the timing statistics have a bucket for each power of
+ * two microseconds, the last bucket holds everything longer. */
+#define TRELL_TIMING_BUCKETS 24
+
+/** The number of (job, request) pairs that timing statistics are kept for,
+ * the least recently used pair is evicted when a new one does not fit. */
+#define TRELL_TIMING_SLOTS 256
+
 const module* tinia_get_module();
 
 typedef struct {
     xmlSchemaPtr    m_schema;
+    /** Only enforce m_max_bytes, the receiver validates. */
+    int             m_size_only;
+    apr_off_t       m_max_bytes;
 } req_cfg_t;
 
 
@@ -103,6 +158,9 @@ typedef struct mod_trell_dispatch_info
     int                  m_revision;
     /** Send response as a base64 encoded string. */
     int                  m_base64;
+    /** If not base64, wrap the images in the binary snapshot container
+      * instead of sending a single raw image, see trell.h. */
+    int                  m_container;
     int                  m_width;
     int                  m_height;
     int                  m_depth_w;
@@ -112,17 +170,20 @@ typedef struct mod_trell_dispatch_info
     char                 m_key[TRELL_KEYID_MAXLENGTH];
     char                 m_viewer_key_list[TRELL_VIEWER_KEY_LIST_MAXLENGTH]; // comma-separated list
     int                  m_jpeg_quality;
+    /** For snapshot_delta.bin: the client, and the frame it has (0 if none). */
+    char                 m_client[TRELL_SESSIONID_MAXLENGTH];
+    int                  m_delta_base;
+    /** For snapshot_stream.png/jpg: the images are parts of a stream, and
+      * the most frames per second to send. */
+    int                  m_stream;
+    int                  m_max_fps;
     char                 m_timestamp[ TRELL_TIMESTAMP_MAXLENGTH ];
     char                 m_snaptype[ TRELL_SNAPTYPE_STRING_MAXLENGTH ];
     char*                m_static_path;
+    /** When the request was decoded, or the frame of a stream began. */
     apr_time_t           m_entry;
-    apr_time_t           m_exit;
-    apr_time_t           m_png_entry;
-    apr_time_t           m_png_exit;
-    apr_time_t           m_png_filter_entry;
-    apr_time_t           m_png_filter_exit;
-    apr_time_t           m_png_compress_entry;
-    apr_time_t           m_png_compress_exit;
+    /** Time spent in each stage, see trell_timing_record. */
+    apr_interval_time_t  m_timing[TRELL_TIMING_STAGES];
 } trell_dispatch_info_t;
 
 
@@ -136,6 +197,10 @@ tinia_validate_xml_in_filter( ap_filter_t *f,
 apr_status_t
 tinia_validate_xml_out_filter( ap_filter_t *f, apr_bucket_brigade *bb );
 
+/** Sets up the validators that the input filter reuses in a child process. */
+void
+tinia_validate_xml_child_init( apr_pool_t* pchild );
+
 int
 trell_decode_path_info( trell_dispatch_info_t* dispatch_info,
                         request_rec*           r );
@@ -145,6 +210,26 @@ trell_handle_get_snapshot( trell_sconf_t*          sconf,
                            request_rec*            r,
                            trell_dispatch_info_t*  dispatch_info );
 
+/** Streams the frames of a viewer to the client.
+  *
+  * - Opens connection to job, if fails, returns HTTP_NOT_FOUND.
+  * - Until the client goes away:
+  * -- Waits until 1/max_fps seconds have passed since the last frame.
+  * -- Gets a snapshot and sends it as the next part of the reply.
+  * -- Waits for a notification of a model revision newer than the frame,
+  *    at most 30 seconds, after which the frame is sent again.
+  *
+  * The connection to the job is kept open, and the memory used for a frame
+  * is released before the next one. Frames are not queued: the
+  * snapshot is taken after the previous frame has been written to the
+  * client (which blocks while the client is behind), so intermediate
+  * revisions are dropped. Each frame is recorded in the timing statistics.
+  */
+int
+trell_handle_get_snapshot_stream( trell_sconf_t*          sconf,
+                                  request_rec*            r,
+                                  trell_dispatch_info_t*  dispatch_info );
+
 /** Handles long-polling request from client.
   *
   * - Opens connection to job, if fails, returns HTTP_NOT_FOUND.
@@ -167,6 +252,145 @@ typedef struct {
 
 /******************************************************************************/
 
+/** The buffers of an arena. */
+enum TrellArenaSlot {
+    /** The pixels of the job's reply. */
+    TRELL_ARENA_REPLY,
+    /** A png-filtered image. */
+    TRELL_ARENA_FILTERED,
+    /** An encoded image, before it is base64-encoded. */
+    TRELL_ARENA_ENCODED,
+    TRELL_ARENA_SLOTS
+};
+
+/** An arena gives back buffers that are larger than twice the largest of
+ * this many requests. */
+#define TRELL_ARENA_WINDOW 64
+
+/** Buffers of the snapshot handlers that are reused across requests.
+ *
+ * Each child process keeps the arenas of finished requests, so a request
+ * gets buffers that already have the size of the recent requests instead of
+ * allocating its pixels, filtered image and encoded image from the request
+ * pool.
+ */
+typedef struct trell_arena trell_arena_t;
+
+/** Creates the list of arenas of a child process. */
+void
+trell_arena_child_init( apr_pool_t* pchild );
+
+/** Takes an arena for the duration of a request.
+ *
+ * The arena is given back when the request pool is cleaned up. Returns NULL
+ * if out of memory.
+ */
+trell_arena_t*
+trell_arena_acquire( request_rec* r );
+
+/** A buffer of at least size bytes, the contents are not kept between
+ * invocations. Returns NULL if out of memory.
+ */
+void*
+trell_arena_get( trell_arena_t* arena, enum TrellArenaSlot slot, apr_size_t size );
+
+/******************************************************************************/
+
+/** Creates the table of timing statistics that the child processes share.
+ *
+ * Without it, requests still get a Server-Timing header, but are not
+ * recorded.
+ */
+int
+trell_timing_post_config( apr_pool_t* pconf, server_rec* s );
+
+/** Attaches a child process to the lock of the timing statistics. */
+void
+trell_timing_child_init( apr_pool_t* pchild );
+
+/** Nonzero if the request is timed: RPC to the master, and requests to jobs
+ * except static files. The frames of a stream are timed one by one by the
+ * stream handler.
+ */
+int
+trell_timing_is_timed( const trell_dispatch_info_t* dispatch_info );
+
+/** Adds the time since begin to a stage of a request. */
+void
+trell_timing_add( trell_dispatch_info_t* dispatch_info,
+                  enum TrellTimingStage stage,
+                  apr_time_t begin );
+
+/** Adds a filter that sets the Server-Timing header of the reply.
+ *
+ * The header holds the stages up to when the first part of the reply is
+ * written, the total is the time until then.
+ */
+void
+trell_timing_add_filter( request_rec* r, trell_dispatch_info_t* dispatch_info );
+
+/** Sets the Server-Timing header, see trell_timing_add_filter. */
+apr_status_t
+trell_timing_out_filter( ap_filter_t* f, apr_bucket_brigade* bb );
+
+/** Adds the stages of a finished request to the statistics of the job, and
+ * clears them for the next frame of a stream.
+ */
+void
+trell_timing_record( request_rec* r,
+                     const char* job,
+                     trell_dispatch_info_t* dispatch_info );
+
+/** Replies the timing statistics as XML.
+ *
+ * For each job and kind of request, a <request> element with the number of
+ * requests, and for each stage, the sum, the approximate median and 99th
+ * percentile, and a histogram where bucket i counts the times below
+ * 2^(i+1) microseconds. The evicted and dropped attributes of <timingStats>
+ * count the slots that have been reused and the requests recorded in them.
+ */
+int
+trell_timing_stats( request_rec* r );
+
+/** Opens a connection to a job, and times it as the connect stage. */
+int
+trell_timing_client_init( trell_dispatch_info_t*   dispatch_info,
+                          request_rec*             r,
+                          tinia_ipc_msg_client_t*  client,
+                          const char*              destination );
+
+/** tinia_ipc_msg_client_sendrecv, timing the send, job and transfer stages.
+ *
+ * The job reports how long it spent handling the query in the header of the
+ * reply, the rest of the time from the query was sent until the reply has
+ * been read is the transfer.
+ */
+int
+trell_timing_sendrecv( trell_dispatch_info_t*         dispatch_info,
+                       tinia_ipc_msg_client_t*        client,
+                       tinia_ipc_msg_producer_func_t  producer,
+                       void*                          producer_data,
+                       tinia_ipc_msg_consumer_func_t  consumer,
+                       void*                          consumer_data,
+                       int                            longpoll_timeout );
+
+/** tinia_ipc_msg_client_sendrecv_by_name, timing the connect stage as well.
+ *
+ * \returns -1 if the job could not be reached, as
+ *          tinia_ipc_msg_client_sendrecv_by_name.
+ */
+int
+trell_timing_sendrecv_by_name( trell_dispatch_info_t*         dispatch_info,
+                               request_rec*                   r,
+                               const char*                    destination,
+                               tinia_ipc_msg_producer_func_t  producer,
+                               void*                          producer_data,
+                               tinia_ipc_msg_consumer_func_t  consumer,
+                               void*                          consumer_data,
+                               int                            longpoll_timeout );
+
+/******************************************************************************/
+
 typedef struct
 {
     trell_sconf_t*          sconf;
@@ -187,6 +411,18 @@ typedef struct {
     char*                   buffer;
     char*                   filtered;
     size_t                  bytes_read;
+    /** The buffers above are taken from this arena. */
+    trell_arena_t*          arena;
+    /** Set if the job says the client already has the snapshot. */
+    int                     not_modified;
+    /** The delta_* fields of the reply, for TRELL_PIXEL_FORMAT_RGB_DELTA. */
+    unsigned int            delta_frame;
+    unsigned int            delta_tiles;
+    int                     delta_full;
+    /** The jpeg_quality of the reply, 0 to use the one of the request. */
+    int                     jpeg_quality;
+    /** The revision of the model the reply shows, 0 if not known. */
+    unsigned int            revision;
 } trell_encode_png_state_t;
         
 
@@ -263,6 +499,117 @@ trell_pass_reply_jpg( void* data,
                       const int part,
                       const int more );
 
+typedef struct {
+    tinia_ipc_msg_consumer_func_t   consumer;
+    void*                           consumer_data;
+    /** The render_revision field of the query, set from the retry reply. */
+    unsigned int*                   render_revision;
+} trell_pass_reply_when_ready_data_t;
+
+/** Callback that waits for a reply that the job renders in the background.
+ *
+ * \implements tinia_ipc_msg_consumer_func_t.
+ *
+ * A TRELL_MESSAGE_RETRY reply makes the client wait for a render
+ * notification and send the query again (requires a long-poll timeout), with
+ * the revision of the retry reply in render_revision. Any other reply is
+ * passed on to consumer.
+ */
+int
+trell_pass_reply_when_ready( void* data,
+                             const char* buffer,
+                             const size_t buffer_bytes,
+                             const int part,
+                             const int more );
+
+/** Appends a 32-bit unsigned little-endian integer to a brigade. */
+apr_status_t
+trell_bb_append_u32( apr_bucket_brigade* bb, apr_uint32_t value );
+
+/** Appends a 32-bit little-endian float to a brigade. */
+apr_status_t
+trell_bb_append_f32( apr_bucket_brigade* bb, float value );
+
+/** Appends the size of a block of data followed by the data to a brigade.
+ *
+ * The data is copied, so the source buffer may be reused afterwards.
+ */
+apr_status_t
+trell_bb_append_sized( apr_bucket_brigade* bb, const void* data, apr_size_t bytes );
+
+/** Memory for a block of data that is handed to trell_bb_append_heap.
+ *
+ * Lets an encoder write its output straight into the memory of a bucket.
+ */
+char*
+trell_bb_heap_alloc( apr_bucket_brigade* bb, apr_size_t bytes );
+
+/** Appends a block from trell_bb_heap_alloc to a brigade without copying it.
+ *
+ * The brigade takes over the block, which is freed when it has been sent.
+ */
+void
+trell_bb_append_heap( apr_bucket_brigade* bb, char* data, apr_size_t bytes );
+
+/** Appends a block from trell_bb_heap_alloc as a u32 length and the bytes.
+ *
+ * The brigade takes over the block, it is freed on failure as well.
+ */
+apr_status_t
+trell_bb_append_sized_heap( apr_bucket_brigade* bb, char* data, apr_size_t bytes );
+
+/** Appends a block of data to a brigade as base64, without a terminating zero.
+ *
+ * The time it takes is added to the base64 stage of the dispatch info.
+ */
+void
+trell_bb_append_base64( apr_bucket_brigade*     bb,
+                        trell_dispatch_info_t*  dispatch_info,
+                        const unsigned char*    data,
+                        apr_size_t              bytes );
+
+/** Appends the header of a binary snapshot container to a brigade.
+ *
+ * Revision, timestamp and snaptype are taken from the dispatch info.
+ */
+apr_status_t
+trell_bb_append_snapshot_header( apr_bucket_brigade* bb,
+                                 trell_dispatch_info_t* dispatch_info,
+                                 int viewers );
+
+/** Makes the content of a brigade the next part of a frame stream.
+ *
+ * Puts the part headers in front of the content, and the end of the part
+ * and a flush bucket after it, see TRELL_STREAM_BOUNDARY.
+ */
+apr_status_t
+trell_bb_finish_stream_part( apr_bucket_brigade* bb,
+                             const char* content_type,
+                             unsigned int revision );
+
+/** Extracts the job's tag from the If-None-Match header of a snapshot request.
+ *
+ * The ETag of a snapshot reply is the job's tag of the pixels combined with a
+ * hash of the request URI, since the encoding depends on the parameters, see
+ * trell_snapshot_reply_etag. The timestamp parameter, which differs for every
+ * request of the client, is left out of the hash. etag is set to the empty string if the header
+ * is missing or was not made for this URI.
+ */
+void
+trell_snapshot_query_etag( request_rec* r, char* etag );
+
+/** Sets the ETag of a snapshot reply from the tag of the job.
+ *
+ * A reply with an ETag does not echo the timestamp of the request, since it
+ * may be reused for requests with other timestamps.
+ *
+ * \returns Nonzero if the job left out the pixels since the client already
+ *          has them, the reply is then 304 Not Modified.
+ */
+int
+trell_snapshot_reply_etag( trell_encode_png_state_t* encoder_state,
+                           const tinia_msg_image_t* msg );
+
 /******************************************************************************/
 
 
@@ -312,6 +659,18 @@ void
 trell_messenger_log_wrapper( void* data, int level, const char* who, const char* message, ... );
 
 
+/** Restart a job that the master has hibernated.
+  *
+  * Sends <resumeJob> to the master, and asks again until the job runs, for at
+  * most TRELL_JOB_WAKE_TIMEOUT_S seconds. Invoked when a request to a job
+  * fails, such that requests to running jobs have no extra cost.
+  *
+  * \returns OK if the job was restarted and the request should be tried
+  *          again, DECLINED otherwise.
+  */
+int
+trell_job_wake( trell_sconf_t* sconf, request_rec* r, const char* jobid );
+
 /** Handle an RPC request that is directed to a job (i.e. passed over IPC).
   *
   * \param sconf  The server configuration.
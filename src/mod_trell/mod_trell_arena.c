@@ -0,0 +1,193 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <httpd.h>
+#include <stdlib.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_pools.h>
+#include <apr_thread_mutex.h>
+
+#include "mod_trell.h"
+
+/** Buffers that are reused by the snapshot requests of a child process. */
+struct trell_arena
+{
+    struct trell_arena*  m_next;
+    char*                m_data[ TRELL_ARENA_SLOTS ];
+    apr_size_t           m_size[ TRELL_ARENA_SLOTS ];
+    /** The largest size asked for during the current window of requests. */
+    apr_size_t           m_recent[ TRELL_ARENA_SLOTS ];
+    unsigned int         m_requests;
+};
+
+/** Arenas that are not in use by a request. There is usually one per thread
+ * that has served a snapshot request.
+ */
+static trell_arena_t*       trell_arena_free_list = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t*  trell_arena_mutex = NULL;
+#endif
+
+
+
+
+static
+void
+trell_arena_lock()
+{
+#if APR_HAS_THREADS
+    if( trell_arena_mutex != NULL ) {
+        apr_thread_mutex_lock( trell_arena_mutex );
+    }
+#endif
+}
+
+
+
+
+static
+void
+trell_arena_unlock()
+{
+#if APR_HAS_THREADS
+    if( trell_arena_mutex != NULL ) {
+        apr_thread_mutex_unlock( trell_arena_mutex );
+    }
+#endif
+}
+
+
+
+
+static
+void
+trell_arena_destroy( trell_arena_t* arena )
+{
+    int i;
+    for( i=0; i<TRELL_ARENA_SLOTS; i++ ) {
+        free( arena->m_data[i] );
+    }
+    free( arena );
+}
+
+
+
+
+static
+apr_status_t
+trell_arena_release( void* data )
+{
+    trell_arena_t* arena = (trell_arena_t*)data;
+
+    // Buffers much larger than the recent requests are given back, such that
+    // a single huge request does not pin its memory for the life of the child.
+    arena->m_requests++;
+    if( arena->m_requests >= TRELL_ARENA_WINDOW ) {
+        int i;
+        for( i=0; i<TRELL_ARENA_SLOTS; i++ ) {
+            if( arena->m_size[i] > 2*arena->m_recent[i] ) {
+                free( arena->m_data[i] );
+                arena->m_data[i] = NULL;
+                arena->m_size[i] = 0;
+            }
+            arena->m_recent[i] = 0;
+        }
+        arena->m_requests = 0;
+    }
+
+    trell_arena_lock();
+    arena->m_next = trell_arena_free_list;
+    trell_arena_free_list = arena;
+    trell_arena_unlock();
+    return APR_SUCCESS;
+}
+
+
+
+
+static
+apr_status_t
+trell_arena_child_exit( void* data )
+{
+    trell_arena_lock();
+    while( trell_arena_free_list != NULL ) {
+        trell_arena_t* arena = trell_arena_free_list;
+        trell_arena_free_list = arena->m_next;
+        trell_arena_destroy( arena );
+    }
+    trell_arena_unlock();
+    return APR_SUCCESS;
+}
+
+
+
+
+void
+trell_arena_child_init( apr_pool_t* pchild )
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_create( &trell_arena_mutex, APR_THREAD_MUTEX_DEFAULT, pchild );
+#endif
+    apr_pool_cleanup_register( pchild, NULL, trell_arena_child_exit, apr_pool_cleanup_null );
+}
+
+
+
+
+trell_arena_t*
+trell_arena_acquire( request_rec* r )
+{
+    trell_arena_lock();
+    trell_arena_t* arena = trell_arena_free_list;
+    if( arena != NULL ) {
+        trell_arena_free_list = arena->m_next;
+    }
+    trell_arena_unlock();
+
+    if( arena == NULL ) {
+        arena = (trell_arena_t*)calloc( 1, sizeof(trell_arena_t) );
+        if( arena == NULL ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_arena_acquire: out of memory." );
+            return NULL;
+        }
+    }
+    arena->m_next = NULL;
+    apr_pool_cleanup_register( r->pool, arena, trell_arena_release, apr_pool_cleanup_null );
+    return arena;
+}
+
+
+
+
+void*
+trell_arena_get( trell_arena_t* arena, enum TrellArenaSlot slot, apr_size_t size )
+{
+    if( size == 0 ) {
+        size = 1;
+    }
+    if( size > arena->m_recent[slot] ) {
+        arena->m_recent[slot] = size;
+    }
+    if( size > arena->m_size[slot] ) {
+        // The contents are not kept, so there is no need to copy as realloc would.
+        free( arena->m_data[slot] );
+        arena->m_data[slot] = (char*)malloc( size );
+        arena->m_size[slot] = arena->m_data[slot] != NULL ? size : 0;
+    }
+    return arena->m_data[slot];
+}
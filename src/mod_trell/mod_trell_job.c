@@ -25,6 +25,7 @@
 #include <apr_strings.h>
 #include <apr_buckets.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "mod_trell.h"
 #include "tinia/trell/trell.h"
@@ -55,11 +56,10 @@ trell_handle_get_script( trell_sconf_t           *sconf,
     pass_reply_data.brigade       = NULL;
     
     ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "%s", __func__ );
-    int rv = tinia_ipc_msg_client_sendrecv_by_name( dispatch_info->m_jobid,
-                                                    trell_messenger_log_wrapper, r,
-                                                    trell_pass_query_msg_post, &pass_query_data,
-                                                    trell_pass_reply, &pass_reply_data,
-                                                    0 );
+    int rv = trell_timing_sendrecv_by_name( dispatch_info, r, dispatch_info->m_jobid,
+                                            trell_pass_query_msg_post, &pass_query_data,
+                                            trell_pass_reply, &pass_reply_data,
+                                            0 );
     
     if( rv == 0 ) {
         return OK;
@@ -105,11 +105,10 @@ trell_handle_get_renderlist( trell_sconf_t*          sconf,
     pass_reply_data.brigade       = NULL;
 
     ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "%s", __func__ );
-    int rv = tinia_ipc_msg_client_sendrecv_by_name( dispatch_info->m_jobid,
-                                                    trell_messenger_log_wrapper, r,
-                                                    trell_pass_query_msg_post, &pass_query_data,
-                                                    trell_pass_reply, &pass_reply_data,
-                                                    0 );
+    int rv = trell_timing_sendrecv_by_name( dispatch_info, r, dispatch_info->m_jobid,
+                                            trell_pass_query_msg_post, &pass_query_data,
+                                            trell_pass_reply, &pass_reply_data,
+                                            0 );
     
     if( rv == 0 ) {
         return OK;
@@ -134,7 +133,9 @@ trell_handle_get_snapshot( trell_sconf_t*          sconf,
         return HTTP_INSUFFICIENT_STORAGE;
     }
 
+    // Zeroed, as the job recognizes a query it is rendering by its bytes.
     tinia_msg_get_snapshot_t query;
+    memset( &query, 0, sizeof(query) );
     query.msg.type     = TRELL_MESSAGE_GET_SNAPSHOT;
     query.pixel_format = dispatch_info->m_pixel_format;
     query.width        = dispatch_info->m_width;
@@ -147,6 +148,10 @@ trell_handle_get_snapshot( trell_sconf_t*          sconf,
     query.key[ TRELL_KEYID_MAXLENGTH ] = '\0';
     memcpy( query.viewer_key_list, dispatch_info->m_viewer_key_list, TRELL_VIEWER_KEY_LIST_MAXLENGTH );
     query.viewer_key_list[ TRELL_VIEWER_KEY_LIST_MAXLENGTH ] = '\0';
+    trell_snapshot_query_etag( r, query.etag );
+    memcpy( query.client_id, dispatch_info->m_client, TRELL_SESSIONID_MAXLENGTH );
+    query.client_id[ TRELL_SESSIONID_MAXLENGTH ] = '\0';
+    query.delta_base = dispatch_info->m_delta_base;
 
     // 141014: It may be redundant to copy data from the dispatch_info to the query, since the dispatch_info is also passed along!!
 
@@ -164,21 +169,39 @@ trell_handle_get_snapshot( trell_sconf_t*          sconf,
     encode_png_state.sconf         = sconf;
     encode_png_state.r             = r;
     encode_png_state.dispatch_info = dispatch_info;
+    encode_png_state.arena         = trell_arena_acquire( r );
+    if( encode_png_state.arena == NULL ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_handle_get_snapshot: Out of memory." );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
     encode_png_state.width         = 0;
     encode_png_state.height        = 0;
     encode_png_state.buffer        = NULL;
+    encode_png_state.not_modified  = 0;
+    encode_png_state.delta_frame   = 0;
+    encode_png_state.delta_tiles   = 0;
+    encode_png_state.delta_full    = 0;
+    encode_png_state.jpeg_quality  = 0;
+    encode_png_state.revision      = 0;
     
 //    ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "trell_handle_get_snapshot: viewer_key_list=%s", dispatch_info->m_viewer_key_list );
 //    ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "trell_handle_get_snapshot: pixel_format=%d", dispatch_info->m_pixel_format );
 //    ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "trell_handle_get_snapshot: jpeg_quality=%d", dispatch_info->m_jpeg_quality );
 
-    int rv = tinia_ipc_msg_client_sendrecv_by_name( dispatch_info->m_jobid,
-                                                    trell_messenger_log_wrapper, r,
-                                                    trell_pass_query_msg_post, &pass_query_data,
-                                                    dispatch_info->m_pixel_format==TRELL_PIXEL_FORMAT_RGB_JPG_VERSION ? trell_pass_reply_jpg : trell_pass_reply_png,
-                                                    &encode_png_state,
-                                                    0 );
-    if( rv == 0 ) {
+    // The job replies TRELL_MESSAGE_RETRY until the snapshot is rendered.
+    trell_pass_reply_when_ready_data_t when_ready;
+    when_ready.consumer      = dispatch_info->m_pixel_format==TRELL_PIXEL_FORMAT_RGB_JPG_VERSION ? trell_pass_reply_jpg : trell_pass_reply_png;
+    when_ready.consumer_data = &encode_png_state;
+    when_ready.render_revision = &query.render_revision;
+
+    int rv = trell_timing_sendrecv_by_name( dispatch_info, r, dispatch_info->m_jobid,
+                                            trell_pass_query_msg_post, &pass_query_data,
+                                            trell_pass_reply_when_ready, &when_ready,
+                                            30 );
+    if( (rv == 0) && encode_png_state.not_modified ) {
+        return HTTP_NOT_MODIFIED;
+    }
+    else if( rv == 0 ) {
         return OK;
     }
     else if( rv == -1 ) {
@@ -192,6 +215,175 @@ trell_handle_get_snapshot( trell_sconf_t*          sconf,
 }
 
 
+// Consumes the reply to the model update query of a stream, which is only
+// used to wait: returns 1 (wait for notification) if the job has nothing
+// newer than the frame, 0 if it has.
+static
+int
+trell_stream_wait_reply( void*         data,
+                         const char*   buffer,
+                         const size_t  buffer_bytes,
+                         const int     part,
+                         const int     more )
+{
+    if( part != 0 ) {
+        return 0;   // rest of the update, not needed.
+    }
+    const tinia_msg_t* msg = (const tinia_msg_t*)buffer;
+    if( msg->type == TRELL_MESSAGE_OK ) {
+        return 1;
+    }
+    else if( msg->type == TRELL_MESSAGE_XML ) {
+        return 0;
+    }
+    ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, (request_rec*)data,
+                   "trell_stream_wait_reply: Unexpected message type %d.", (int)msg->type );
+    return -1;
+}
+
+
+int
+trell_handle_get_snapshot_stream( trell_sconf_t*          sconf,
+                                  request_rec*            r,
+                                  trell_dispatch_info_t*  dispatch_info )
+{
+    if( ( dispatch_info->m_width < 1 ) || ( dispatch_info->m_width > 2048  ) ||
+        ( dispatch_info->m_height < 1 ) || ( dispatch_info->m_height > 2048 ) )
+    {
+        return HTTP_INSUFFICIENT_STORAGE;
+    }
+
+    tinia_ipc_msg_client_t* client = apr_palloc( r->pool, tinia_ipc_msg_client_t_sizeof );
+    if( trell_timing_client_init( dispatch_info, r, client, dispatch_info->m_jobid ) != 0 ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "%s: failed to open connection to job '%s'.",
+                       __func__, dispatch_info->m_jobid );
+        return HTTP_NOT_FOUND;
+    }
+
+    // The frames of a stream reuse the buffers of one arena.
+    trell_arena_t* arena = trell_arena_acquire( r );
+    if( arena == NULL ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_handle_get_snapshot_stream: Out of memory." );
+        tinia_ipc_msg_client_release( client );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ap_set_content_type( r, "multipart/x-mixed-replace; boundary=" TRELL_STREAM_BOUNDARY );
+    apr_table_setn( r->headers_out, "Cache-Control", "no-cache" );
+
+    // Everything allocated for a frame goes in a pool that is cleared before
+    // the next one, so a long stream does not grow the request pool. The
+    // encoders allocate from the pool of the request they are given.
+    apr_pool_t* frame_pool;
+    apr_pool_create( &frame_pool, r->pool );
+
+    const apr_interval_time_t min_interval = APR_USEC_PER_SEC / dispatch_info->m_max_fps;
+    apr_time_t last_frame = 0;
+    int frames = 0;
+    int rv = 0;
+    while( !r->connection->aborted ) {
+        // Waiting here, and not after the frame, means that the frame shows
+        // the latest revision, the ones in between are dropped.
+        const apr_interval_time_t wait = last_frame + min_interval - apr_time_now();
+        if( wait > 0 ) {
+            apr_sleep( wait );
+        }
+        // Each frame is timed as a request of its own, the first one
+        // includes opening the connection.
+        if( frames > 0 ) {
+            dispatch_info->m_entry = apr_time_now();
+        }
+        apr_pool_clear( frame_pool );
+        request_rec frame_r = *r;
+        frame_r.pool = frame_pool;
+
+        tinia_msg_get_snapshot_t query;
+        memset( &query, 0, sizeof(query) );
+        query.msg.type     = TRELL_MESSAGE_GET_SNAPSHOT;
+        query.pixel_format = dispatch_info->m_pixel_format;
+        query.width        = dispatch_info->m_width;
+        query.height       = dispatch_info->m_height;
+        memcpy( query.session_id, dispatch_info->m_sessionid, TRELL_SESSIONID_MAXLENGTH );
+        memcpy( query.key, dispatch_info->m_key, TRELL_KEYID_MAXLENGTH );
+        memcpy( query.viewer_key_list, dispatch_info->m_viewer_key_list, TRELL_VIEWER_KEY_LIST_MAXLENGTH );
+
+        trell_pass_query_msg_post_data_t pass_query_data;
+        pass_query_data.sconf          = sconf;
+        pass_query_data.r              = r;
+        pass_query_data.dispatch_info  = dispatch_info;
+        pass_query_data.message        = &query;
+        pass_query_data.message_offset = 0;
+        pass_query_data.message_size   = sizeof(query);
+        pass_query_data.pass_post      = 0;
+
+        trell_encode_png_state_t encode_png_state;
+        encode_png_state.sconf         = sconf;
+        encode_png_state.r             = &frame_r;
+        encode_png_state.dispatch_info = dispatch_info;
+        encode_png_state.arena         = arena;
+        encode_png_state.width         = 0;
+        encode_png_state.height        = 0;
+        encode_png_state.buffer        = NULL;
+        encode_png_state.not_modified  = 0;
+        encode_png_state.delta_frame   = 0;
+        encode_png_state.delta_tiles   = 0;
+        encode_png_state.delta_full    = 0;
+        encode_png_state.jpeg_quality  = 0;
+        encode_png_state.revision      = 0;
+
+        trell_pass_reply_when_ready_data_t when_ready;
+        when_ready.consumer      = dispatch_info->m_pixel_format==TRELL_PIXEL_FORMAT_RGB_JPG_VERSION ? trell_pass_reply_jpg : trell_pass_reply_png;
+        when_ready.consumer_data = &encode_png_state;
+        when_ready.render_revision = &query.render_revision;
+
+        last_frame = apr_time_now();
+        rv = trell_timing_sendrecv( dispatch_info, client,
+                                    trell_pass_query_msg_post, &pass_query_data,
+                                    trell_pass_reply_when_ready, &when_ready,
+                                    30 );
+        if( rv != 0 ) {
+            break;
+        }
+        frames++;
+        trell_timing_record( r, dispatch_info->m_jobid, dispatch_info );
+
+        // Wait for a revision newer than the frame. If there is none within
+        // the long-poll timeout, the frame is sent again, which also finds
+        // clients that have gone away.
+        tinia_msg_get_exposed_model_t poll;
+        memset( &poll, 0, sizeof(poll) );
+        poll.msg.type = TRELL_MESSAGE_GET_POLICY_UPDATE;
+        poll.revision = encode_png_state.revision;
+        memcpy( poll.session_id, dispatch_info->m_sessionid, TRELL_SESSIONID_MAXLENGTH );
+
+        pass_query_data.message        = &poll;
+        pass_query_data.message_size   = sizeof(poll);
+        rv = tinia_ipc_msg_client_sendrecv( client,
+                                            trell_pass_query_msg_post, &pass_query_data,
+                                            trell_stream_wait_reply, r,
+                                            30 );
+        if( rv < -1 ) {
+            break;
+        }
+    }
+    apr_pool_destroy( frame_pool );
+    tinia_ipc_msg_client_release( client );
+
+    ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "%s: sent %d frames of %s.",
+                   __func__, frames, dispatch_info->m_key );
+    if( frames > 0 ) {
+        return OK;      // the reply has been sent, the client has gone away.
+    }
+    else if( rv == -1 ) {
+        return HTTP_REQUEST_TIME_OUT;
+    }
+    else {
+        ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "%s: failed.", r->path_info );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+}
+
+
 int
 trell_handle_get_model_update( trell_sconf_t* sconf,
                                 request_rec* r,
@@ -220,11 +412,10 @@ trell_handle_get_model_update( trell_sconf_t* sconf,
     pass_reply_data.brigade       = NULL;
     
     ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "[%d] %s", getpid(), __func__ );
-    int rv = tinia_ipc_msg_client_sendrecv_by_name( dispatch_info->m_jobid,
-                                                    trell_messenger_log_wrapper, r,
-                                                    trell_pass_query_msg_post, &pass_query_data,
-                                                    trell_pass_reply, &pass_reply_data,
-                                                    30 );
+    int rv = trell_timing_sendrecv_by_name( dispatch_info, r, dispatch_info->m_jobid,
+                                            trell_pass_query_msg_post, &pass_query_data,
+                                            trell_pass_reply, &pass_reply_data,
+                                            30 );
     
     if( rv == 0 ) {
         return OK;
@@ -294,11 +485,10 @@ trell_handle_update_state( trell_sconf_t* sconf,
     rd.longpolling = 0;
     rd.brigade = NULL;
     
-    int rv = tinia_ipc_msg_client_sendrecv_by_name( dispatch_info->m_jobid,
-                                                    trell_messenger_log_wrapper, r,
-                                                    trell_pass_query_msg_post, &qd,
-                                                    trell_pass_reply, &rd,
-                                                    0 );
+    int rv = trell_timing_sendrecv_by_name( dispatch_info, r, dispatch_info->m_jobid,
+                                            trell_pass_query_msg_post, &qd,
+                                            trell_pass_reply, &rd,
+                                            0 );
 
     if( rv == 0 ) {
         return OK;
@@ -313,6 +503,65 @@ trell_handle_update_state( trell_sconf_t* sconf,
 }
 
 // -----------------------------------------------------------------------------
+int
+trell_job_wake( trell_sconf_t* sconf, request_rec* r, const char* jobid )
+{
+    const char* xml = apr_psprintf( r->pool,
+                                    "<?xml version=\"1.0\"?>"
+                                    "<resumeJob xmlns=\"http://cloudviz.sintef.no/trell/1.0\">"
+                                    "<job>%s</job>"
+                                    "</resumeJob>", jobid );
+    const size_t xml_size = strlen( xml );
+    const size_t query_size = sizeof(tinia_msg_xml_t) + xml_size;
+    char* query = apr_palloc( r->pool, query_size );
+    ((tinia_msg_xml_t*)query)->msg.type = TRELL_MESSAGE_XML;
+    memcpy( query + sizeof(tinia_msg_xml_t), xml, xml_size );
+
+    char reply[ 1024 ];
+    int pending = 0;
+    const apr_time_t start = apr_time_now();
+    while( 1 ) {
+        size_t reply_size = 0;
+        if( ipc_msg_client_sendrecv_buffered_by_name( sconf->m_master_id,
+                                                      trell_messenger_log_wrapper, r,
+                                                      query, query_size,
+                                                      reply, &reply_size, sizeof(reply)-1 ) != 0 )
+        {
+            return DECLINED;
+        }
+        if( ( reply_size <= sizeof(tinia_msg_xml_t) ) ||
+            ( ((tinia_msg_xml_t*)reply)->msg.type != TRELL_MESSAGE_XML ) )
+        {
+            return DECLINED;
+        }
+        reply[ reply_size ] = '\0';
+        const char* result = reply + sizeof(tinia_msg_xml_t);
+        if( strstr( result, "<result>PENDING</result>" ) != NULL ) {
+            if( pending == 0 ) {
+                ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r,
+                               "mod_trell: waking hibernated job '%s'.", jobid );
+            }
+            pending = 1;
+            if( apr_time_now() - start > apr_time_from_sec( TRELL_JOB_WAKE_TIMEOUT_S ) ) {
+                ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r,
+                               "mod_trell: job '%s' was not restored in time.", jobid );
+                return DECLINED;
+            }
+            apr_sleep( 50000 );
+        }
+        else if( ( strstr( result, "<result>SUCCESS</result>" ) != NULL ) && pending ) {
+            ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r,
+                           "mod_trell: job '%s' restored in %ld ms.",
+                           jobid, (long)apr_time_as_msec( apr_time_now() - start ) );
+            return OK;
+        }
+        else {
+            // Not hibernated, the request failed for some other reason.
+            return DECLINED;
+        }
+    }
+}
+
 int
 trell_job_rpc_handle( trell_sconf_t* sconf,
                       request_rec*r,
@@ -324,6 +573,8 @@ trell_job_rpc_handle( trell_sconf_t* sconf,
     // set up request config
     req_cfg_t* req_cfg = apr_palloc( r->pool, sizeof(*req_cfg) );
     req_cfg->m_schema = schema;
+    req_cfg->m_size_only = sconf->m_validate_xml == TRELL_VALIDATE_XML_JOB;
+    req_cfg->m_max_bytes = sconf->m_xml_max_bytes > 0 ? sconf->m_xml_max_bytes : TRELL_XML_MAX_BYTES_DEFAULT;
     ap_set_module_config( r->request_config, tinia_get_module(), req_cfg );
     // add validation filter
     ap_add_input_filter( "tinia_validate_xml", NULL, r, r->connection );
@@ -373,11 +624,10 @@ trell_job_rpc_handle( trell_sconf_t* sconf,
     pass_reply_data.brigade       = NULL;
     
 
-    int rv = tinia_ipc_msg_client_sendrecv_by_name( job,
-                                                    trell_messenger_log_wrapper, r,
-                                                    trell_pass_query_msg_post, &pass_query_data,
-                                                    trell_pass_reply, &pass_reply_data,
-                                                    0 );
+    int rv = trell_timing_sendrecv_by_name( dispatch_info, r, job,
+                                            trell_pass_query_msg_post, &pass_query_data,
+                                            trell_pass_reply, &pass_reply_data,
+                                            0 );
     if( rv == 0 ) {
         return OK;
     }
@@ -232,20 +232,27 @@ trell_start_master( trell_sconf_t* svr_conf,  request_rec* r )
     }
 
 
-    const char* env[7] = {
+    const char* env[8] = {
         apr_psprintf( r->pool, "TINIA_JOB_ID=%s",    svr_conf->m_master_id ),
         apr_psprintf( r->pool, "TINIA_MASTER_ID=%s", svr_conf->m_master_id ),
         apr_psprintf( r->pool, "TINIA_APP_ROOT=%s",  svr_conf->m_app_root_dir ),
+        NULL,   // TINIA_RPC_SCHEMA
         NULL,   // PATH
         NULL,   // LD_LIBRARY_PATH
         NULL,   // DISPLAY
         NULL
     };
+    int p = 3;
+
+    // The master validates the queries while it parses them, instead of the
+    // input filter parsing them first.
+    if( (svr_conf->m_validate_xml == TRELL_VALIDATE_XML_JOB) && (svr_conf->m_schema_root_dir != NULL) ) {
+        env[p++] = apr_psprintf( r->pool, "TINIA_RPC_SCHEMA=%s/rpc_master.xsd", svr_conf->m_schema_root_dir );
+    }
 
     // Copy PATH and LD_LIBRARY_PATH from the current environement, if set. It
     // might be an idea to pass these variables through the apache-config,
     // allowing more detailded control on jobs.
-    int p = 3;
     char* PATH = NULL;
     if( (apr_env_get( &PATH, "PATH", r->pool ) == APR_SUCCESS ) &&
             (PATH != NULL) )
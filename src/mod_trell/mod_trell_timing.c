@@ -0,0 +1,529 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <util_filter.h>
+#include <unixd.h>
+#include <apr_shm.h>
+#include <apr_global_mutex.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <string.h>
+
+#include "mod_trell.h"
+
+/** Timing statistics of one kind of request to one job. */
+typedef struct
+{
+    char            m_job[ TINIA_IPC_JOBID_MAXLENGTH+1 ];
+    /** The TrellRequest, TRELL_REQUEST_NONE if the slot is free. */
+    int             m_request;
+    apr_uint64_t    m_requests;
+    /** When a request was last recorded, for evicting the least recently used slot. */
+    apr_time_t      m_last;
+    /** The number of requests where a stage took any time at all. */
+    apr_uint64_t    m_count[ TRELL_TIMING_STAGES ];
+    apr_uint64_t    m_sum_us[ TRELL_TIMING_STAGES ];
+    apr_uint32_t    m_buckets[ TRELL_TIMING_STAGES ][ TRELL_TIMING_BUCKETS ];
+} trell_timing_slot_t;
+
+/** The statistics shared by the child processes. */
+typedef struct
+{
+    /** Slots that were evicted to make room for another job or request. */
+    apr_uint64_t        m_evicted;
+    /** Requests whose statistics went with the evicted slots. */
+    apr_uint64_t        m_dropped;
+    trell_timing_slot_t m_slots[ TRELL_TIMING_SLOTS ];
+} trell_timing_table_t;
+
+/** Created before the children are forked, so it is at the same address in
+ * all of them. */
+static trell_timing_table_t*    trell_timing_table = NULL;
+static apr_global_mutex_t*      trell_timing_mutex = NULL;
+
+static const char* trell_timing_stage_names[ TRELL_TIMING_STAGES ] = {
+    "connect",
+    "send",
+    "job",
+    "transfer",
+    "filter",
+    "compress",
+    "base64",
+    "total"
+};
+
+
+
+
+int
+trell_timing_post_config( apr_pool_t* pconf, server_rec* s )
+{
+    apr_shm_t* shm = NULL;
+    trell_timing_table = NULL;
+    trell_timing_mutex = NULL;
+
+    apr_status_t rv = apr_shm_create( &shm, sizeof(trell_timing_table_t), NULL, pconf );
+    if( rv != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_WARNING, rv, s,
+                      "mod_trell: Failed to create shared memory, timing statistics are disabled." );
+        return OK;
+    }
+    rv = apr_global_mutex_create( &trell_timing_mutex, NULL, APR_LOCK_DEFAULT, pconf );
+    if( rv == APR_SUCCESS ) {
+#if AP_MODULE_MAGIC_AT_LEAST(20081201,0)
+        rv = ap_unixd_set_global_mutex_perms( trell_timing_mutex );
+#else
+        rv = unixd_set_global_mutex_perms( trell_timing_mutex );
+#endif
+    }
+    if( rv != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_WARNING, rv, s,
+                      "mod_trell: Failed to create lock, timing statistics are disabled." );
+        trell_timing_mutex = NULL;
+        return OK;
+    }
+    trell_timing_table = apr_shm_baseaddr_get( shm );
+    memset( trell_timing_table, 0, sizeof(trell_timing_table_t) );
+    return OK;
+}
+
+
+
+
+void
+trell_timing_child_init( apr_pool_t* pchild )
+{
+    if( trell_timing_mutex == NULL ) {
+        return;
+    }
+    apr_status_t rv = apr_global_mutex_child_init( &trell_timing_mutex, NULL, pchild );
+    if( rv != APR_SUCCESS ) {
+        ap_log_perror( APLOG_MARK, APLOG_WARNING, rv, pchild,
+                       "mod_trell: Failed to attach to lock, timing statistics are disabled." );
+        trell_timing_mutex = NULL;
+        trell_timing_table = NULL;
+    }
+}
+
+
+
+
+int
+trell_timing_is_timed( const trell_dispatch_info_t* dispatch_info )
+{
+    switch( dispatch_info->m_component ) {
+    case TRELL_COMPONENT_MASTER:
+        return dispatch_info->m_request == TRELL_REQUEST_RPC_XML;
+    case TRELL_COMPONENT_JOB:
+        return ( dispatch_info->m_request != TRELL_REQUEST_NONE ) &&
+               ( dispatch_info->m_request != TRELL_REQUEST_STATIC_FILE ) &&
+               ( dispatch_info->m_request != TRELL_REQUEST_SNAPSHOT_STREAM );
+    default:
+        return 0;
+    }
+}
+
+
+
+
+void
+trell_timing_add( trell_dispatch_info_t* dispatch_info,
+                  enum TrellTimingStage stage,
+                  apr_time_t begin )
+{
+    dispatch_info->m_timing[ stage ] += apr_time_now() - begin;
+}
+
+
+
+
+void
+trell_timing_add_filter( request_rec* r, trell_dispatch_info_t* dispatch_info )
+{
+    ap_add_output_filter( "trell_timing", dispatch_info, r, r->connection );
+}
+
+
+
+
+apr_status_t
+trell_timing_out_filter( ap_filter_t* f, apr_bucket_brigade* bb )
+{
+    trell_dispatch_info_t* dispatch_info = (trell_dispatch_info_t*)f->ctx;
+    const apr_interval_time_t total = apr_time_now() - dispatch_info->m_entry;
+
+    // Server-Timing durations are in milliseconds.
+    const char* header = "";
+    int i;
+    for( i=0; i<TRELL_TIMING_TOTAL; i++ ) {
+        if( dispatch_info->m_timing[i] > 0 ) {
+            header = apr_psprintf( f->r->pool, "%s%s;dur=%.3f, ",
+                                   header,
+                                   trell_timing_stage_names[i],
+                                   dispatch_info->m_timing[i]/1000.0 );
+        }
+    }
+    header = apr_psprintf( f->r->pool, "%s%s;dur=%.3f",
+                           header,
+                           trell_timing_stage_names[ TRELL_TIMING_TOTAL ],
+                           total/1000.0 );
+    apr_table_setn( f->r->headers_out, "Server-Timing", header );
+
+    // The headers go out with the first part of the reply.
+    ap_remove_output_filter( f );
+    return ap_pass_brigade( f->next, bb );
+}
+
+
+
+
+/** The index of the histogram bucket of a time in microseconds. */
+static
+int
+trell_timing_bucket( apr_uint64_t us )
+{
+    int b = 0;
+    while( ( us > 1 ) && ( b < TRELL_TIMING_BUCKETS-1 ) ) {
+        us = us >> 1;
+        b++;
+    }
+    return b;
+}
+
+
+
+
+/** The slot of a job and request, claims a free slot if there is none.
+ *
+ * When the table is full, the least recently used slot, typically of a job
+ * that has ended, is cleared and reused. Slots are never freed, only reused,
+ * so a probe may still stop at the first free slot. Must be invoked with the
+ * lock held.
+ */
+static
+trell_timing_slot_t*
+trell_timing_slot( request_rec* r, const char* job, enum TrellRequest request )
+{
+    apr_ssize_t length = APR_HASH_KEY_STRING;
+    const unsigned int hash = apr_hashfunc_default( job, &length ) + 31u*request;
+
+    trell_timing_slot_t* oldest = NULL;
+    int i;
+    for( i=0; i<TRELL_TIMING_SLOTS; i++ ) {
+        trell_timing_slot_t* slot = &trell_timing_table->m_slots[ (hash+i) % TRELL_TIMING_SLOTS ];
+        if( slot->m_request == TRELL_REQUEST_NONE ) {
+            apr_cpystrn( slot->m_job, job, sizeof(slot->m_job) );
+            slot->m_request = request;
+            return slot;
+        }
+        else if( ( slot->m_request == request ) &&
+                 ( strncmp( slot->m_job, job, TINIA_IPC_JOBID_MAXLENGTH ) == 0 ) )
+        {
+            return slot;
+        }
+        if( ( oldest == NULL ) || ( slot->m_last < oldest->m_last ) ) {
+            oldest = slot;
+        }
+    }
+
+    ap_log_rerror( APLOG_MARK, APLOG_INFO, 0, r,
+                   "mod_trell: Timing statistics are full, evicting job '%s' with %" APR_UINT64_T_FMT " requests.",
+                   oldest->m_job, oldest->m_requests );
+    trell_timing_table->m_evicted++;
+    trell_timing_table->m_dropped += oldest->m_requests;
+    memset( oldest, 0, sizeof(trell_timing_slot_t) );
+    apr_cpystrn( oldest->m_job, job, sizeof(oldest->m_job) );
+    oldest->m_request = request;
+    return oldest;
+}
+
+
+
+
+void
+trell_timing_record( request_rec* r,
+                     const char* job,
+                     trell_dispatch_info_t* dispatch_info )
+{
+    dispatch_info->m_timing[ TRELL_TIMING_TOTAL ] = apr_time_now() - dispatch_info->m_entry;
+
+    if( ( trell_timing_table != NULL ) && ( job != NULL ) &&
+        ( apr_global_mutex_lock( trell_timing_mutex ) == APR_SUCCESS ) )
+    {
+        trell_timing_slot_t* slot = trell_timing_slot( r, job, dispatch_info->m_request );
+        slot->m_requests++;
+        slot->m_last = dispatch_info->m_entry;
+        int i;
+        for( i=0; i<TRELL_TIMING_STAGES; i++ ) {
+            if( dispatch_info->m_timing[i] > 0 ) {
+                const apr_uint64_t us = dispatch_info->m_timing[i];
+                slot->m_count[i]++;
+                slot->m_sum_us[i] += us;
+                slot->m_buckets[i][ trell_timing_bucket( us ) ]++;
+            }
+        }
+        apr_global_mutex_unlock( trell_timing_mutex );
+    }
+    memset( dispatch_info->m_timing, 0, sizeof(dispatch_info->m_timing) );
+}
+
+
+
+
+/** The upper bound of the bucket that holds the q-quantile of a stage. */
+static
+apr_uint64_t
+trell_timing_quantile( const trell_timing_slot_t* slot, int stage, double q )
+{
+    const apr_uint64_t rank = (apr_uint64_t)( q*slot->m_count[stage] + 0.5 );
+    apr_uint64_t sum = 0;
+    int b;
+    for( b=0; b<TRELL_TIMING_BUCKETS-1; b++ ) {
+        sum += slot->m_buckets[stage][b];
+        if( sum >= rank ) {
+            break;
+        }
+    }
+    return ((apr_uint64_t)1u) << (b+1);
+}
+
+
+
+
+static
+const char*
+trell_timing_request_name( int request )
+{
+    switch( request ) {
+    case TRELL_REQUEST_RPC_XML:             return "rpc";
+    case TRELL_REQUEST_POLICY_UPDATE_XML:   return "getExposedModelUpdate";
+    case TRELL_REQUEST_STATE_UPDATE_XML:    return "updateState";
+    case TRELL_REQUEST_PNG:                 return "snapshot";
+    case TRELL_REQUEST_GET_RENDERLIST:      return "getRenderList";
+    case TRELL_REQUEST_GET_SCRIPT:          return "getScript";
+    case TRELL_REQUEST_SNAPSHOT_STREAM:     return "snapshotStream";
+    default:                                return "other";
+    }
+}
+
+
+
+
+int
+trell_timing_stats( request_rec* r )
+{
+    // Copied, so the lock is not held while the reply is written.
+    trell_timing_table_t* table = NULL;
+    if( ( trell_timing_table != NULL ) &&
+        ( apr_global_mutex_lock( trell_timing_mutex ) == APR_SUCCESS ) )
+    {
+        table = apr_palloc( r->pool, sizeof(trell_timing_table_t) );
+        memcpy( table, trell_timing_table, sizeof(trell_timing_table_t) );
+        apr_global_mutex_unlock( trell_timing_mutex );
+    }
+
+    apr_bucket_brigade* bb = apr_brigade_create( r->pool, r->connection->bucket_alloc );
+    if( table == NULL ) {
+        apr_brigade_puts( bb, NULL, NULL, "<?xml version=\"1.0\"?><timingStats enabled=\"0\"/>" );
+    }
+    else {
+        apr_brigade_printf( bb, NULL, NULL,
+                            "<?xml version=\"1.0\"?><timingStats enabled=\"1\" evicted=\"%" APR_UINT64_T_FMT "\""
+                            " dropped=\"%" APR_UINT64_T_FMT "\">",
+                            table->m_evicted,
+                            table->m_dropped );
+        int i, j, b;
+        for( i=0; i<TRELL_TIMING_SLOTS; i++ ) {
+            const trell_timing_slot_t* slot = &table->m_slots[i];
+            if( slot->m_request == TRELL_REQUEST_NONE ) {
+                continue;
+            }
+            apr_brigade_printf( bb, NULL, NULL,
+                                "<request job=\"%s\" type=\"%s\" count=\"%" APR_UINT64_T_FMT "\">",
+                                ap_escape_html( r->pool, slot->m_job ),
+                                trell_timing_request_name( slot->m_request ),
+                                slot->m_requests );
+            for( j=0; j<TRELL_TIMING_STAGES; j++ ) {
+                if( slot->m_count[j] == 0 ) {
+                    continue;
+                }
+                apr_brigade_printf( bb, NULL, NULL,
+                                    "<stage name=\"%s\" count=\"%" APR_UINT64_T_FMT "\" sumUs=\"%" APR_UINT64_T_FMT "\""
+                                    " p50Us=\"%" APR_UINT64_T_FMT "\" p99Us=\"%" APR_UINT64_T_FMT "\" buckets=\"",
+                                    trell_timing_stage_names[j],
+                                    slot->m_count[j],
+                                    slot->m_sum_us[j],
+                                    trell_timing_quantile( slot, j, 0.5 ),
+                                    trell_timing_quantile( slot, j, 0.99 ) );
+                for( b=0; b<TRELL_TIMING_BUCKETS; b++ ) {
+                    apr_brigade_printf( bb, NULL, NULL, b==0 ? "%u" : " %u", slot->m_buckets[j][b] );
+                }
+                apr_brigade_puts( bb, NULL, NULL, "\"/>" );
+            }
+            apr_brigade_puts( bb, NULL, NULL, "</request>" );
+        }
+        apr_brigade_puts( bb, NULL, NULL, "</timingStats>" );
+    }
+
+    ap_set_content_type( r, "application/xml" );
+    apr_table_setn( r->headers_out, "Cache-Control", "no-cache" );
+    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_eos_create( bb->bucket_alloc ) );
+    apr_status_t rv = ap_pass_brigade( r->output_filters, bb );
+    if( rv != APR_SUCCESS ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, rv, r, "Output error" );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return OK;
+}
+
+
+
+
+/** Wraps the producer and consumer of a round trip to a job. */
+typedef struct {
+    trell_dispatch_info_t*          m_dispatch_info;
+    tinia_ipc_msg_producer_func_t   m_producer;
+    void*                           m_producer_data;
+    tinia_ipc_msg_consumer_func_t   m_consumer;
+    void*                           m_consumer_data;
+    apr_time_t                      m_send_begin;
+    apr_time_t                      m_sent;
+    apr_interval_time_t             m_job;
+} trell_timing_sendrecv_data_t;
+
+
+
+
+static
+int
+trell_timing_producer( void*           data,
+                       int*            more,
+                       char*           buffer,
+                       size_t*         bytes_written,
+                       const size_t    buffer_size,
+                       const int       part )
+{
+    trell_timing_sendrecv_data_t* d = (trell_timing_sendrecv_data_t*)data;
+    if( part == 0 ) {
+        d->m_send_begin = apr_time_now();
+        d->m_job = 0;
+    }
+    int rv = d->m_producer( d->m_producer_data, more, buffer, bytes_written, buffer_size, part );
+    if( ( rv == 0 ) && ( *more == 0 ) ) {
+        d->m_sent = apr_time_now();
+        d->m_dispatch_info->m_timing[ TRELL_TIMING_SEND ] += d->m_sent - d->m_send_begin;
+    }
+    return rv;
+}
+
+
+
+
+static
+int
+trell_timing_consumer( void*         data,
+                       const char*   buffer,
+                       const size_t  buffer_bytes,
+                       const int     part,
+                       const int     more )
+{
+    trell_timing_sendrecv_data_t* d = (trell_timing_sendrecv_data_t*)data;
+    if( ( part == 0 ) && ( buffer_bytes >= sizeof(tinia_msg_t) ) ) {
+        d->m_job = ((const tinia_msg_t*)buffer)->handle_us;
+        d->m_dispatch_info->m_timing[ TRELL_TIMING_JOB ] += d->m_job;
+    }
+    if( !more ) {
+        // Before the reply is encoded, which is timed by the encoders.
+        const apr_interval_time_t transfer = apr_time_now() - d->m_sent - d->m_job;
+        if( transfer > 0 ) {
+            d->m_dispatch_info->m_timing[ TRELL_TIMING_TRANSFER ] += transfer;
+        }
+    }
+    return d->m_consumer( d->m_consumer_data, buffer, buffer_bytes, part, more );
+}
+
+
+
+
+int
+trell_timing_client_init( trell_dispatch_info_t*   dispatch_info,
+                          request_rec*             r,
+                          tinia_ipc_msg_client_t*  client,
+                          const char*              destination )
+{
+    const apr_time_t begin = apr_time_now();
+    int rv = tinia_ipc_msg_client_init( client, destination, trell_messenger_log_wrapper, r );
+    trell_timing_add( dispatch_info, TRELL_TIMING_CONNECT, begin );
+    return rv;
+}
+
+
+
+
+int
+trell_timing_sendrecv( trell_dispatch_info_t*         dispatch_info,
+                       tinia_ipc_msg_client_t*        client,
+                       tinia_ipc_msg_producer_func_t  producer,
+                       void*                          producer_data,
+                       tinia_ipc_msg_consumer_func_t  consumer,
+                       void*                          consumer_data,
+                       int                            longpoll_timeout )
+{
+    trell_timing_sendrecv_data_t d;
+    d.m_dispatch_info = dispatch_info;
+    d.m_producer      = producer;
+    d.m_producer_data = producer_data;
+    d.m_consumer      = consumer;
+    d.m_consumer_data = consumer_data;
+    d.m_send_begin    = 0;
+    d.m_sent          = 0;
+    d.m_job           = 0;
+    return tinia_ipc_msg_client_sendrecv( client,
+                                          trell_timing_producer, &d,
+                                          trell_timing_consumer, &d,
+                                          longpoll_timeout );
+}
+
+
+
+
+int
+trell_timing_sendrecv_by_name( trell_dispatch_info_t*         dispatch_info,
+                               request_rec*                   r,
+                               const char*                    destination,
+                               tinia_ipc_msg_producer_func_t  producer,
+                               void*                          producer_data,
+                               tinia_ipc_msg_consumer_func_t  consumer,
+                               void*                          consumer_data,
+                               int                            longpoll_timeout )
+{
+    tinia_ipc_msg_client_t* client = apr_palloc( r->pool, tinia_ipc_msg_client_t_sizeof );
+    if( trell_timing_client_init( dispatch_info, r, client, destination ) != 0 ) {
+        ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r, "%s: Failed to open connection to '%s'.",
+                       __func__, destination );
+        return -1;
+    }
+    int rv = trell_timing_sendrecv( dispatch_info, client,
+                                    producer, producer_data,
+                                    consumer, consumer_data,
+                                    longpoll_timeout );
+    tinia_ipc_msg_client_release( client );
+    return rv;
+}
@@ -213,9 +213,14 @@ trell_hash_atoi( request_rec* r,
 // - rpc.xml
 // - getExposedModelUpdate.xml
 // - updateState.xml
-// - snapshot.png        (Not sure if this has ever been used or tested.)
-// - snapshot.txt
-// - jpg_snapshot.txt
+// - snapshot.png        (single raw png image of 'key')
+// - snapshot.jpg        (single raw jpeg image of 'key')
+// - snapshot.txt        (or snapshot.bin for the binary container)
+// - jpg_snapshot.txt    (or jpg_snapshot.bin)
+// - snapshot_bundle.txt (or snapshot_bundle.bin)
+// - snapshot_delta.bin  (changed tiles of 'key' since frame 'base' of 'client')
+// - snapshot_stream.png (stream of png frames of 'key', at most 'max_fps' a second)
+// - snapshot_stream.jpg (stream of jpeg frames of 'key')
 // - getRenderList.xml
 // - getScript.js
 // args is some of
@@ -238,9 +243,14 @@ trell_decode_path_info( trell_dispatch_info_t* dispatch_info, request_rec *r )
     dispatch_info->m_viewer_key_list[0] ='\0';
     dispatch_info->m_jpeg_quality = 100;
     dispatch_info->m_snaptype[0] = '\0';
+    dispatch_info->m_client[0] = '\0';
+    dispatch_info->m_delta_base = 0;
+    dispatch_info->m_stream = 0;
+    dispatch_info->m_max_fps = 0;
     dispatch_info->m_timestamp[0] = '\0';
     dispatch_info->m_revision = 0;
     dispatch_info->m_base64 = 0;
+    dispatch_info->m_container = 0;
     dispatch_info->m_width = 0;
     dispatch_info->m_height = 0;
     dispatch_info->m_depth_w = 0;
@@ -334,6 +344,9 @@ trell_decode_path_info( trell_dispatch_info_t* dispatch_info, request_rec *r )
             if( apr_strnatcmp( action, "restart_master" ) == 0 ) {
                 dispatch_info->m_mod_action = TRELL_MOD_ACTION_RESTART_MASTER;
             }
+            else if( apr_strnatcmp( action, "timing_stats" ) == 0 ) {
+                dispatch_info->m_mod_action = TRELL_MOD_ACTION_TIMING_STATS;
+            }
             else {
                 ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "%s: %s/%s: unknown action '%s'.",
                                r->handler, component, request, action );
@@ -360,12 +373,12 @@ trell_decode_path_info( trell_dispatch_info_t* dispatch_info, request_rec *r )
         dispatch_info->m_request = TRELL_REQUEST_STATE_UPDATE_XML;
         return OK;
     }
-    // --- snapshot.png ----------------------------------------------------
-    // (Not sure if this has ever been used or tested.)
-    else if( strcmp( request, "snapshot.png" ) == 0 ) {
+    // --- snapshot.png and snapshot.jpg -----------------------------------
+    // A single raw image of the viewer 'key', without any metadata.
+    else if( (strcmp( request, "snapshot.png" ) == 0) || (strcmp( request, "snapshot.jpg" ) == 0) ) {
         dispatch_info->m_request = TRELL_REQUEST_PNG;
-        dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB;
         dispatch_info->m_base64 = 0;
+        dispatch_info->m_container = 0;
         if( (trell_hash_strncpy( r, dispatch_info->m_key, form, "key", TRELL_KEYID_MAXLENGTH-1 ) == 0)
                 || (trell_hash_atoi( r, component, request, &dispatch_info->m_width, form, "width", 1 ) == 0)
                 || (trell_hash_atoi( r, component, request, &dispatch_info->m_height, form, "height", 1 ) == 0) )
@@ -374,12 +387,27 @@ trell_decode_path_info( trell_dispatch_info_t* dispatch_info, request_rec *r )
                            r->handler, request);
             return HTTP_BAD_REQUEST;
         }
+        // The job renders the viewers in the list, which is just this one.
+        strcpy( dispatch_info->m_viewer_key_list, dispatch_info->m_key );
+        if( strcmp( request, "snapshot.jpg" ) == 0 ) {
+            dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB_JPG_VERSION;
+            if( trell_hash_atoi( r, component, request, &dispatch_info->m_jpeg_quality, form, "jpeg_quality", 0 ) == 0 ) {
+                return HTTP_BAD_REQUEST;
+            }
+            if( dispatch_info->m_jpeg_quality <= 0 ) {
+                dispatch_info->m_jpeg_quality = 100;
+            }
+        }
+        else {
+            dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB;
+        }
     }
-    // --- snapshot.txt----------------------------------------------------
-    else if( strcmp( request, "snapshot.txt" ) == 0 ) {
+    // --- snapshot.txt and snapshot.bin ------------------------------------
+    else if( (strcmp( request, "snapshot.txt" ) == 0) || (strcmp( request, "snapshot.bin" ) == 0) ) {
         dispatch_info->m_request = TRELL_REQUEST_PNG;
         dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB;
-        dispatch_info->m_base64 = 1;
+        dispatch_info->m_base64 = ( strcmp( request, "snapshot.txt" ) == 0 );
+        dispatch_info->m_container = !dispatch_info->m_base64;
         if( (trell_hash_strncpy( r, dispatch_info->m_key, form, "key", TRELL_KEYID_MAXLENGTH-1 ) == 0 )
                 || (trell_hash_atoi( r, component, request, &dispatch_info->m_width, form, "width", 1 ) == 0 )
                 || (trell_hash_atoi( r, component, request, &dispatch_info->m_height, form, "height", 1 ) == 0 ) )
@@ -401,12 +429,13 @@ trell_decode_path_info( trell_dispatch_info_t* dispatch_info, request_rec *r )
             return HTTP_BAD_REQUEST;
         }
     }
-    // --- jpg_snapshot.txt----------------------------------------------------
-    else if( strcmp( request, "jpg_snapshot.txt" ) == 0 ) {
+    // --- jpg_snapshot.txt and jpg_snapshot.bin ------------------------------
+    else if( (strcmp( request, "jpg_snapshot.txt" ) == 0) || (strcmp( request, "jpg_snapshot.bin" ) == 0) ) {
         // ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "%s: 1 parsing %s commencing...", r->handler, request );
         dispatch_info->m_request = TRELL_REQUEST_PNG; // JPG;
         dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB_JPG_VERSION;
-        dispatch_info->m_base64 = 1;
+        dispatch_info->m_base64 = ( strcmp( request, "jpg_snapshot.txt" ) == 0 );
+        dispatch_info->m_container = !dispatch_info->m_base64;
         if( (trell_hash_strncpy( r, dispatch_info->m_key, form, "key", TRELL_KEYID_MAXLENGTH-1 ) == 0 )
                 || (trell_hash_atoi( r, component, request, &dispatch_info->m_width, form, "width", 1 ) == 0 )
                 || (trell_hash_atoi( r, component, request, &dispatch_info->m_height, form, "height", 1 ) == 0 ) )
@@ -434,11 +463,12 @@ trell_decode_path_info( trell_dispatch_info_t* dispatch_info, request_rec *r )
             return HTTP_BAD_REQUEST;
         }
     }
-    // --- snapshot_bundle.txt----------------------------------------------------
-    else if( strcmp( request, "snapshot_bundle.txt" ) == 0 ) {
+    // --- snapshot_bundle.txt and snapshot_bundle.bin ------------------------
+    else if( (strcmp( request, "snapshot_bundle.txt" ) == 0) || (strcmp( request, "snapshot_bundle.bin" ) == 0) ) {
         dispatch_info->m_request = TRELL_REQUEST_PNG;
         dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB_CUSTOM_DEPTH;
-        dispatch_info->m_base64 = 1;
+        dispatch_info->m_base64 = ( strcmp( request, "snapshot_bundle.txt" ) == 0 );
+        dispatch_info->m_container = !dispatch_info->m_base64;
         if( (trell_hash_strncpy( r, dispatch_info->m_key, form, "key", TRELL_KEYID_MAXLENGTH-1 ) == 0 )
             || (trell_hash_atoi( r, component, request, &dispatch_info->m_width, form, "width", 1 ) == 0 )
             || (trell_hash_atoi( r, component, request, &dispatch_info->m_height, form, "height", 1 ) == 0 )
@@ -461,6 +491,59 @@ trell_decode_path_info( trell_dispatch_info_t* dispatch_info, request_rec *r )
             return HTTP_BAD_REQUEST;
         }
     }
+    // --- snapshot_delta.bin -----------------------------------------------
+    else if( strcmp( request, "snapshot_delta.bin" ) == 0 ) {
+        dispatch_info->m_request = TRELL_REQUEST_PNG;
+        dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB_DELTA;
+        dispatch_info->m_base64 = 0;
+        dispatch_info->m_container = 1;
+        if( (trell_hash_strncpy( r, dispatch_info->m_key, form, "key", TRELL_KEYID_MAXLENGTH-1 ) == 0 )
+            || (trell_hash_atoi( r, component, request, &dispatch_info->m_width, form, "width", 1 ) == 0 )
+            || (trell_hash_atoi( r, component, request, &dispatch_info->m_height, form, "height", 1 ) == 0 )
+            || (trell_hash_strncpy( r, dispatch_info->m_client, form, "client", TRELL_SESSIONID_MAXLENGTH-1 ) == 0 )
+            || (trell_hash_atoi( r, component, request, &dispatch_info->m_delta_base, form, "base", 0 ) == 0 ) )
+        {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "%s: parsing %s failed.", r->handler, request );
+            return HTTP_BAD_REQUEST;
+        }
+        strcpy( dispatch_info->m_viewer_key_list, dispatch_info->m_key );
+    }
+    // --- snapshot_stream.png and snapshot_stream.jpg -----------------------
+    // Raw images of the viewer 'key', one part of the reply per frame.
+    else if( (strcmp( request, "snapshot_stream.png" ) == 0) || (strcmp( request, "snapshot_stream.jpg" ) == 0) ) {
+        dispatch_info->m_request = TRELL_REQUEST_SNAPSHOT_STREAM;
+        dispatch_info->m_base64 = 0;
+        dispatch_info->m_container = 0;
+        dispatch_info->m_stream = 1;
+        if( (trell_hash_strncpy( r, dispatch_info->m_key, form, "key", TRELL_KEYID_MAXLENGTH-1 ) == 0)
+                || (trell_hash_atoi( r, component, request, &dispatch_info->m_width, form, "width", 1 ) == 0)
+                || (trell_hash_atoi( r, component, request, &dispatch_info->m_height, form, "height", 1 ) == 0)
+                || (trell_hash_atoi( r, component, request, &dispatch_info->m_max_fps, form, "max_fps", 0 ) == 0) )
+        {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "%s: parsing %s failed.",
+                           r->handler, request);
+            return HTTP_BAD_REQUEST;
+        }
+        if( dispatch_info->m_max_fps <= 0 ) {
+            dispatch_info->m_max_fps = TRELL_STREAM_DEFAULT_FPS;
+        }
+        else if( dispatch_info->m_max_fps > TRELL_STREAM_MAX_FPS ) {
+            dispatch_info->m_max_fps = TRELL_STREAM_MAX_FPS;
+        }
+        strcpy( dispatch_info->m_viewer_key_list, dispatch_info->m_key );
+        if( strcmp( request, "snapshot_stream.jpg" ) == 0 ) {
+            dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB_JPG_VERSION;
+            if( trell_hash_atoi( r, component, request, &dispatch_info->m_jpeg_quality, form, "jpeg_quality", 0 ) == 0 ) {
+                return HTTP_BAD_REQUEST;
+            }
+            if( dispatch_info->m_jpeg_quality <= 0 ) {
+                dispatch_info->m_jpeg_quality = 100;
+            }
+        }
+        else {
+            dispatch_info->m_pixel_format = TRELL_PIXEL_FORMAT_RGB;
+        }
+    }
     // --- getRenderList.xml -----------------------------------------------
     else if( strcmp( request, "getRenderList.xml" ) == 0 ) {
         dispatch_info->m_request = TRELL_REQUEST_GET_RENDERLIST;
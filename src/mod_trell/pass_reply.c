@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <apr_strings.h>
+#include <apr_base64.h>
 #include <stdarg.h>
 
 
@@ -141,3 +142,260 @@ trell_pass_reply( void*         data,
     return 0;   // ok
 }
 
+
+
+
+
+apr_status_t
+trell_bb_append_u32( apr_bucket_brigade* bb, apr_uint32_t value )
+{
+    char le[4];
+    le[0] = (value>>0)&0xffu;
+    le[1] = (value>>8)&0xffu;
+    le[2] = (value>>16)&0xffu;
+    le[3] = (value>>24)&0xffu;
+    return apr_brigade_write( bb, NULL, NULL, le, 4 );
+}
+
+
+
+
+apr_status_t
+trell_bb_append_f32( apr_bucket_brigade* bb, float value )
+{
+    apr_uint32_t bits;
+    memcpy( &bits, &value, sizeof(bits) );
+    return trell_bb_append_u32( bb, bits );
+}
+
+
+
+
+apr_status_t
+trell_bb_append_sized( apr_bucket_brigade* bb, const void* data, apr_size_t bytes )
+{
+    apr_status_t rv = trell_bb_append_u32( bb, bytes );
+    if( (rv != APR_SUCCESS) || (bytes == 0) ) {
+        return rv;
+    }
+    // apr_brigade_write copies into heap buckets, unlike the transient buckets.
+    return apr_brigade_write( bb, NULL, NULL, (const char*)data, bytes );
+}
+
+
+
+
+char*
+trell_bb_heap_alloc( apr_bucket_brigade* bb, apr_size_t bytes )
+{
+    return (char*)apr_bucket_alloc( bytes > 0 ? bytes : 1, bb->bucket_alloc );
+}
+
+
+
+
+void
+trell_bb_append_heap( apr_bucket_brigade* bb, char* data, apr_size_t bytes )
+{
+    // A heap bucket with a free function owns the block instead of copying it.
+    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_heap_create( data, bytes, apr_bucket_free, bb->bucket_alloc ) );
+}
+
+
+
+
+apr_status_t
+trell_bb_append_sized_heap( apr_bucket_brigade* bb, char* data, apr_size_t bytes )
+{
+    apr_status_t rv = trell_bb_append_u32( bb, bytes );
+    if( rv != APR_SUCCESS ) {
+        apr_bucket_free( data );
+        return rv;
+    }
+    trell_bb_append_heap( bb, data, bytes );
+    return APR_SUCCESS;
+}
+
+
+
+
+void
+trell_bb_append_base64( apr_bucket_brigade*     bb,
+                        trell_dispatch_info_t*  dispatch_info,
+                        const unsigned char*    data,
+                        apr_size_t              bytes )
+{
+    const apr_time_t begin = apr_time_now();
+    char* base64 = trell_bb_heap_alloc( bb, apr_base64_encode_len( bytes ) );
+    int base64_size = apr_base64_encode( base64, (const char*)data, bytes );
+    // Seems like the zero-byte is included in the string size.
+    if( (base64_size > 0) && (base64[base64_size-1] == '\0') ) {
+        base64_size--;
+    }
+    trell_bb_append_heap( bb, base64, base64_size );
+    trell_timing_add( dispatch_info, TRELL_TIMING_BASE64, begin );
+}
+
+
+
+
+apr_status_t
+trell_bb_append_snapshot_header( apr_bucket_brigade* bb,
+                                 trell_dispatch_info_t* dispatch_info,
+                                 int viewers )
+{
+    apr_status_t rv = apr_brigade_write( bb, NULL, NULL, TRELL_SNAPSHOT_CONTAINER_MAGIC, 4 );
+    if( rv == APR_SUCCESS ) {
+        rv = trell_bb_append_u32( bb, TRELL_SNAPSHOT_CONTAINER_VERSION );
+    }
+    if( rv == APR_SUCCESS ) {
+        rv = trell_bb_append_u32( bb, viewers );
+    }
+    if( rv == APR_SUCCESS ) {
+        rv = trell_bb_append_u32( bb, dispatch_info->m_revision );
+    }
+    if( rv == APR_SUCCESS ) {
+        rv = trell_bb_append_sized( bb, dispatch_info->m_timestamp, strlen( dispatch_info->m_timestamp ) );
+    }
+    if( rv == APR_SUCCESS ) {
+        rv = trell_bb_append_sized( bb, dispatch_info->m_snaptype, strlen( dispatch_info->m_snaptype ) );
+    }
+    return rv;
+}
+
+
+
+
+apr_status_t
+trell_bb_finish_stream_part( apr_bucket_brigade* bb,
+                             const char* content_type,
+                             unsigned int revision )
+{
+    apr_off_t length = 0;
+    apr_status_t rv = apr_brigade_length( bb, 1, &length );
+    if( rv != APR_SUCCESS ) {
+        return rv;
+    }
+    const char* header = apr_psprintf( bb->p,
+                                       "--" TRELL_STREAM_BOUNDARY "\r\n"
+                                       "Content-Type: %s\r\n"
+                                       "Content-Length: %" APR_OFF_T_FMT "\r\n"
+                                       "X-Tinia-Revision: %u\r\n\r\n",
+                                       content_type, length, revision );
+    APR_BRIGADE_INSERT_HEAD( bb, apr_bucket_pool_create( header, strlen( header ), bb->p, bb->bucket_alloc ) );
+    rv = apr_brigade_puts( bb, NULL, NULL, "\r\n" );
+    if( rv == APR_SUCCESS ) {
+        APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_flush_create( bb->bucket_alloc ) );
+    }
+    return rv;
+}
+
+
+
+
+static
+apr_uint32_t
+trell_snapshot_uri_hash( request_rec* r )
+{
+    // 32-bit FNV-1a of the uri without the timestamp parameter, which the
+    // client changes for every request of the same snapshot.
+    static const char timestamp[] = "timestamp";
+    const size_t timestamp_length = sizeof(timestamp) - 1;
+    apr_uint32_t hash = 2166136261u;
+    const char* p = r->unparsed_uri;
+    int parameter_start = 0;
+    while( p != NULL && *p != '\0' ) {
+        if( parameter_start &&
+            ( strncmp( p, timestamp, timestamp_length ) == 0 ) &&
+            ( ( p[timestamp_length] == '=' ) || ( p[timestamp_length] == '&' ) || ( p[timestamp_length] == '\0' ) ) )
+        {
+            while( *p != '\0' && *p != '&' ) {
+                p++;
+            }
+            continue;
+        }
+        parameter_start = ( *p == '?' ) || ( *p == '&' );
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
+        p++;
+    }
+    return hash;
+}
+
+
+
+
+void
+trell_snapshot_query_etag( request_rec* r, char* etag )
+{
+    etag[0] = '\0';
+    const char* if_none_match = apr_table_get( r->headers_in, "If-None-Match" );
+    if( if_none_match == NULL ) {
+        return;
+    }
+    // "<job tag>-<uri hash>" where the job tag is quoted too.
+    const char* suffix = apr_psprintf( r->pool, "-%08x\"", trell_snapshot_uri_hash( r ) );
+    const size_t length = strlen( if_none_match );
+    const size_t suffix_length = strlen( suffix );
+    if( (length <= suffix_length) ||
+        (length - suffix_length + 1 > TRELL_ETAG_MAXLENGTH) ||
+        (strcmp( if_none_match + length - suffix_length, suffix ) != 0) )
+    {
+        return;
+    }
+    memcpy( etag, if_none_match, length - suffix_length );
+    etag[ length - suffix_length ] = '"';
+    etag[ length - suffix_length + 1 ] = '\0';
+}
+
+
+
+
+int
+trell_snapshot_reply_etag( trell_encode_png_state_t* encoder_state,
+                           const tinia_msg_image_t* msg )
+{
+    const size_t length = strnlen( msg->etag, TRELL_ETAG_MAXLENGTH );
+    if( length < 2 ) {
+        return 0;   // the job does not cache snapshots.
+    }
+    if( encoder_state->dispatch_info->m_stream ) {
+        return 0;   // the headers of a stream have been sent with the first frame.
+    }
+    const char* etag = apr_psprintf( encoder_state->r->pool, "%.*s-%08x\"",
+                                     (int)(length-1), msg->etag,
+                                     trell_snapshot_uri_hash( encoder_state->r ) );
+    if( msg->not_modified ) {
+        // A 304 is sent as an error response, which uses err_headers_out.
+        apr_table_setn( encoder_state->r->err_headers_out, "ETag", etag );
+        encoder_state->not_modified = 1;
+        return 1;
+    }
+    apr_table_setn( encoder_state->r->headers_out, "ETag", etag );
+    // The client may get this body again for a request with another
+    // timestamp (as a 304), so the timestamp is not echoed.
+    encoder_state->dispatch_info->m_timestamp[0] = '\0';
+    return 0;
+}
+
+
+
+
+int
+trell_pass_reply_when_ready( void*         data,
+                             const char*   buffer,
+                             const size_t  buffer_bytes,
+                             const int     part,
+                             const int     more )
+{
+    trell_pass_reply_when_ready_data_t* d = (trell_pass_reply_when_ready_data_t*)data;
+    if( ( part == 0 ) && ( buffer_bytes >= sizeof(tinia_msg_t) ) &&
+        ( ((const tinia_msg_t*)buffer)->type == TRELL_MESSAGE_RETRY ) )
+    {
+        if( ( buffer_bytes >= sizeof(tinia_msg_retry_t) ) && ( d->render_revision != NULL ) ) {
+            *d->render_revision = ((const tinia_msg_retry_t*)buffer)->revision;
+        }
+        return 2;   // not rendered yet, wait for the render and ask again.
+    }
+    return d->consumer( d->consumer_data, buffer, buffer_bytes, part, more );
+}
@@ -22,7 +22,6 @@
 #include <http_log.h>
 #include <http_protocol.h>
 
-#include <apr_base64.h>
 #include <apr_strings.h>
 
 #include "mod_trell.h"
@@ -39,33 +38,41 @@ static int trell_jpg_encode( void *data,
 {
     trell_encode_png_state_t* encoder_state = (trell_encode_png_state_t*)data;
 
-    long unsigned jpeg_size = 0;
-    unsigned char* compressed_image = NULL; //!< Memory is allocated by tjCompress2 if _jpegSize == 0
+    // The jpeg is written straight into *dst_ptr, which holds bound bytes, at
+    // least tjBufSize, so tjCompress2 neither allocates nor needs a copy.
+    long unsigned jpeg_size = bound;
     char *buffer = encoder_state->buffer + unfiltered_offset;
 
     tjhandle jpeg_compressor = tjInitCompress();
+    if( jpeg_compressor == NULL ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_jpg_encode: %s", tjGetErrorStr() );
+        return -1;
+    }
 
-    tjCompress2( jpeg_compressor,
-                 (unsigned char *)buffer,
-                 encoder_state->width,
-                 0,
-                 encoder_state->height,
-                 TJPF_RGB,
-                 &compressed_image,
-                 &jpeg_size,                        // Initialized to 0, so that tjCompress2 will allocate memory. Resulting size returned.
-                 TJSAMP_444,
-                 jpeg_quality,
-                 TJFLAG_FASTDCT | TJXOP_VFLIP );
+    const apr_time_t begin = apr_time_now();
+    int rv = tjCompress2( jpeg_compressor,
+                          (unsigned char *)buffer,
+                          encoder_state->width,
+                          0,
+                          encoder_state->height,
+                          TJPF_RGB,
+                          dst_ptr,
+                          &jpeg_size,
+                          TJSAMP_444,
+                          jpeg_quality,
+                          TJFLAG_FASTDCT | TJXOP_VFLIP | TJFLAG_NOREALLOC );
+    trell_timing_add( encoder_state->dispatch_info, TRELL_TIMING_COMPRESS, begin );
+    if( rv != 0 ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_jpg_encode: %s", tjGetErrorStr() );
+        tjDestroy(jpeg_compressor);
+        return -1;
+    }
+    tjDestroy(jpeg_compressor);
 
     if ( jpeg_size > bound ) {
         ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_jpg_encode: Not enough memory reserved for compressed jpeg!" );
         return -1;
     }
-    memcpy(*dst_ptr, compressed_image, jpeg_size);
-
-    tjDestroy(jpeg_compressor);
-    tjFree(compressed_image);
-
     *dst_ptr += jpeg_size;
 
     return OK;
@@ -74,15 +81,115 @@ static int trell_jpg_encode( void *data,
 
 
 
-#define BB_APPEND_STRING( pool, bb, ...) \
-{ \
-    char *tmp = apr_psprintf( pool, __VA_ARGS__ ); \
-    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_transient_create( tmp, strlen(tmp), bb->bucket_alloc ) ); \
+// Sends the images without base64, either as a single raw jpeg or in the
+// binary snapshot container described in trell.h. Each jpeg is encoded
+// straight into the bucket that sends it, and unless streaming, each viewer
+// is passed on as soon as it is encoded.
+static
+int
+trell_pass_reply_jpg_binary( trell_encode_png_state_t* encoder_state,
+                             const char * const        viewer_key_list,
+                             const int                 num_of_keys,
+                             const size_t              canvas_size,
+                             const int                 jpeg_quality,
+                             const size_t              total_bound )
+{
+    request_rec* r = encoder_state->r;
+    trell_dispatch_info_t* dispatch_info = encoder_state->dispatch_info;
+
+    if( !dispatch_info->m_container && (num_of_keys != 1) ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r,
+                       "trell_pass_reply_jpg_binary: a raw jpeg reply holds exactly one image (viewer_key_list=%s).", viewer_key_list );
+        return -1;
+    }
+    const char* content_type = dispatch_info->m_container ? "application/octet-stream" : "image/jpeg";
+    if( !dispatch_info->m_stream ) {
+        apr_table_setn( r->headers_out, "Content-Type", content_type );
+        ap_set_content_type( r, content_type );
+    }
+
+    struct apr_bucket_brigade* bb = apr_brigade_create( r->pool, r->connection->bucket_alloc );
+    apr_status_t arv = APR_SUCCESS;
+    if( dispatch_info->m_container ) {
+        arv = trell_bb_append_snapshot_header( bb, dispatch_info, num_of_keys );
+    }
+
+    int i;
+    char vkl_copy[TRELL_VIEWER_KEY_LIST_MAXLENGTH];
+    memcpy( vkl_copy, viewer_key_list, TRELL_VIEWER_KEY_LIST_MAXLENGTH );
+    const char * next_key = strtok( vkl_copy, "," );
+
+    for( i=0; (i<num_of_keys) && (arv==APR_SUCCESS); i++ ) {
+        if( next_key == NULL ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_jpg_binary: too few keys in viewer_key_list (%s)", viewer_key_list );
+            return -1;
+        }
+        if( dispatch_info->m_container ) {
+            if( (arv = trell_bb_append_sized( bb, next_key, strlen( next_key ) )) != APR_SUCCESS
+                    || (arv = trell_bb_append_u32( bb, TRELL_SNAPSHOT_FLAG_JPEG )) != APR_SUCCESS
+                    || (arv = trell_bb_append_u32( bb, 0 )) != APR_SUCCESS
+                    || (arv = trell_bb_append_u32( bb, 0 )) != APR_SUCCESS )
+            {
+                break;
+            }
+        }
+        unsigned char* jpg = (unsigned char*)trell_bb_heap_alloc( bb, total_bound );
+        unsigned char* p = jpg;
+        int rv = trell_jpg_encode( encoder_state, i*canvas_size, &p, total_bound, jpeg_quality );
+        if( rv != OK ) {
+            apr_bucket_free( jpg );
+            return rv;
+        }
+        if( dispatch_info->m_container ) {
+            arv = trell_bb_append_sized_heap( bb, (char*)jpg, p-jpg );
+        }
+        else {
+            trell_bb_append_heap( bb, (char*)jpg, p-jpg );
+        }
+        if( !dispatch_info->m_stream && (arv == APR_SUCCESS) ) {
+            // A stream part needs its length up front, everything else is
+            // sent viewer by viewer.
+            arv = ap_pass_brigade( r->output_filters, bb );
+            apr_brigade_cleanup( bb );
+        }
+        next_key = strtok( NULL, "," );
+    }
+    if( arv != APR_SUCCESS ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, r, "trell_pass_reply_jpg_binary: failed to build reply." );
+        return -1;
+    }
+
+    if( dispatch_info->m_stream ) {
+        // The reply goes on with the next frame.
+        arv = trell_bb_finish_stream_part( bb, content_type, encoder_state->revision );
+        if( arv != APR_SUCCESS ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, r, "trell_pass_reply_jpg_binary: failed to build stream part." );
+            return -1;
+        }
+    }
+    else {
+        APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_eos_create( bb->bucket_alloc ) );
+    }
+    arv = ap_pass_brigade( r->output_filters, bb );
+    if( arv != APR_SUCCESS ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, r, "ap_pass_brigade failed." );
+        return -1;
+    }
+    return 0;   // success
 }
 
 
 
 
+#define BB_APPEND_CONST( bb, str ) \
+    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_immortal_create( str, sizeof(str)-1, bb->bucket_alloc ) )
+
+#define BB_APPEND_STRING( bb, ...) \
+    apr_brigade_printf( bb, NULL, NULL, __VA_ARGS__ )
+
+
+
+
 int
 trell_pass_reply_jpg_main( void* data,
                            const char *buffer,
@@ -101,13 +208,6 @@ trell_pass_reply_jpg_main( void* data,
         return -1;
     }
 
-    if ( encoder_state->dispatch_info->m_base64 == 0 ) {
-        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r,
-                       "This routine is not meant for sending of non-base64-encoded image data: %s:%s:%d",
-                       encoder_state->r->handler, __FILE__, __LINE__ );
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
-
     static int num_of_keys = 0;
     size_t buffer_img_size=0, padded_img_size=0, canvas_size=0;
 
@@ -128,21 +228,28 @@ trell_pass_reply_jpg_main( void* data,
             }
         }
 
-        encoder_state->dispatch_info->m_png_entry = apr_time_now();
         // first invocation
         tinia_msg_image_t* msg = (tinia_msg_image_t*)buffer;
         if( msg->msg.type != TRELL_MESSAGE_IMAGE ) {
             ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "got reply of type %d.", msg->msg.type );
             return -1; // error
         }
+        if( trell_snapshot_reply_etag( encoder_state, msg ) ) {
+            return 0;   // not modified, there are no pixels.
+        }
         encoder_state->width  = msg->width;
         encoder_state->height = msg->height;
+        encoder_state->jpeg_quality = msg->jpeg_quality;
+        encoder_state->revision = msg->revision;
         buffer_img_size       = 3 * encoder_state->width * encoder_state->height;
         padded_img_size       = 4*( (buffer_img_size+3)/4 );
         canvas_size           = padded_img_size;
-        encoder_state->buffer = apr_palloc( encoder_state->r->pool, num_of_keys * canvas_size );
-        const size_t filtered_img_size_bound = (3*encoder_state->width+1) * encoder_state->height; // The +1 is for the png filter flag
-        encoder_state->filtered = apr_palloc( encoder_state->r->pool, filtered_img_size_bound ); // Just in case the image is smaller than 4*16 bytes!
+        encoder_state->buffer = trell_arena_get( encoder_state->arena, TRELL_ARENA_REPLY, num_of_keys * canvas_size );
+        if( encoder_state->buffer == NULL ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_pass_reply_jpg_main: Out of memory." );
+            return -1;
+        }
+        encoder_state->filtered = NULL;     // The jpeg encoder reads the pixels as they are.
         encoder_state->bytes_read = 0;
         offset += sizeof(tinia_msg_image_t);
     }
@@ -165,16 +272,28 @@ trell_pass_reply_jpg_main( void* data,
             return -1;
         }
 
-        const unsigned long bound = (3*encoder_state->width+1)*encoder_state->height + 1000; // @@@ Just adding some, in case JPG needs it for a header or something
-        const size_t total_bound = bound + 8 + 25 + 12 + 12 + 12; // @@@ Don't know where these amounts come from. encoder_state-header? png-specifics? ??
-        unsigned char* png = apr_palloc( encoder_state->r->pool, total_bound );
-        unsigned char* p = png;
+        // The job lowers the quality of the frames rendered during interaction.
+        const int quality = encoder_state->jpeg_quality > 0 ? encoder_state->jpeg_quality : jpeg_quality;
+        const size_t total_bound = tjBufSize( encoder_state->width, encoder_state->height, TJSAMP_444 );
 
         char* datestring = apr_palloc( encoder_state->r->pool, APR_RFC822_DATE_LEN );
         apr_rfc822_date( datestring, apr_time_now() );
         apr_table_setn( encoder_state->r->headers_out, "Last-Modified", datestring );
         apr_table_setn( encoder_state->r->headers_out, "Cache-Control", "no-cache" );
 
+        if( encoder_state->dispatch_info->m_base64 == 0 ) {
+            return trell_pass_reply_jpg_binary( encoder_state, viewer_key_list, num_of_keys, canvas_size,
+                                                quality, total_bound );
+        }
+
+        // The jpeg is only an intermediate here, so it is kept in the arena.
+        unsigned char* png = trell_arena_get( encoder_state->arena, TRELL_ARENA_ENCODED, total_bound );
+        if( png == NULL ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_pass_reply_jpg_main: Out of memory." );
+            return -1;
+        }
+        unsigned char* p = png;
+
         // Encode as base64 and send as string
         apr_table_setn( encoder_state->r->headers_out, "Content-Type", "text/plain" );
         ap_set_content_type( encoder_state->r, "text/plain" );
@@ -186,12 +305,13 @@ trell_pass_reply_jpg_main( void* data,
         memcpy( vkl_copy, viewer_key_list, TRELL_VIEWER_KEY_LIST_MAXLENGTH );
         const char * next_key = strtok( vkl_copy, "," );
 
-        BB_APPEND_STRING( encoder_state->r->pool, bb, "{ " );
-        for (i=0; i<num_of_keys; i++) {
-            BB_APPEND_STRING( encoder_state->r->pool, bb, "%s: { \"rgb\": \"", next_key );
+        apr_status_t arv = APR_SUCCESS;
+        BB_APPEND_CONST( bb, "{ " );
+        for (i=0; (i<num_of_keys) && (arv==APR_SUCCESS); i++) {
+            BB_APPEND_STRING( bb, "%s: { \"rgb\": \"", next_key );
             {
-                p = png; // Reusing the old buffer, should be ok when we use the "transient" buckets that copy data.
-                int rv = trell_jpg_encode( data, i*canvas_size, &p, total_bound, jpeg_quality );
+                p = png; // Reusing the arena buffer, the base64 is written to a bucket of its own.
+                int rv = trell_jpg_encode( data, i*canvas_size, &p, total_bound, quality );
                 if ( p-png > total_bound ) {
                     // @@@ This test should not be needed, the encoding routine checks this
                     ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_pass_reply_png_bundle: encoder has overrun the buffer!" );
@@ -199,31 +319,34 @@ trell_pass_reply_jpg_main( void* data,
                 }
                 if (rv!=OK)
                     return rv;
-                char* base64 = apr_palloc( encoder_state->r->pool, apr_base64_encode_len( p-png ) );
-                int base64_size = apr_base64_encode( base64, (char*)png, p-png );
-                // Seems like the zero-byte is included in the string size.
-                if( (base64_size > 0) && (base64[base64_size-1] == '\0') ) {
-                    base64_size--;
-                }
-                APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_transient_create( base64, base64_size, bb->bucket_alloc ) );
+                trell_bb_append_base64( bb, encoder_state->dispatch_info, png, p-png );
             }
-            BB_APPEND_STRING( encoder_state->r->pool, bb, "\"" );
+            BB_APPEND_CONST( bb, "\"" );
 
-            BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"revision\" : \"%d\"", encoder_state->dispatch_info->m_revision );
-            BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"timestamp\" : \"%s\"", encoder_state->dispatch_info->m_timestamp );
-            BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"snaptype\" : \"%s\"", encoder_state->dispatch_info->m_snaptype );
+            BB_APPEND_STRING( bb, ", \"revision\" : \"%d\"", encoder_state->dispatch_info->m_revision );
+            BB_APPEND_STRING( bb, ", \"timestamp\" : \"%s\"", encoder_state->dispatch_info->m_timestamp );
+            BB_APPEND_STRING( bb, ", \"snaptype\" : \"%s\"", encoder_state->dispatch_info->m_snaptype );
 
-            BB_APPEND_STRING( encoder_state->r->pool, bb, " }" );
+            BB_APPEND_CONST( bb, " }" );
             if (i<num_of_keys-1) {
-                BB_APPEND_STRING( encoder_state->r->pool, bb, ", " );
+                BB_APPEND_CONST( bb, ", " );
             }
             next_key = strtok( NULL, "," );
             if (   ( (i<num_of_keys-1) && (next_key==NULL) )   ||   ( (i==num_of_keys-1) && (next_key!=NULL) )   ) {
                 ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_pass_reply_png_bundle: strtok has not worked as expected. Problem with the viewer_key_list? (%s)", viewer_key_list );
                 return -1;
             }
+            if( !encoder_state->dispatch_info->m_stream ) {
+                // Send this viewer while the next is encoded.
+                arv = ap_pass_brigade( encoder_state->r->output_filters, bb );
+                apr_brigade_cleanup( bb );
+            }
+        }
+        if( arv != APR_SUCCESS ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, encoder_state->r, "ap_pass_brigade failed." );
+            return -1;
         }
-        BB_APPEND_STRING( encoder_state->r->pool, bb, " }" );
+        BB_APPEND_CONST( bb, " }" );
 
 #if 0
         // To inspect the resulting package, see the apache error log
@@ -237,7 +360,7 @@ trell_pass_reply_jpg_main( void* data,
 #endif
 
         APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_eos_create( bb->bucket_alloc ) );
-        apr_status_t arv = ap_pass_brigade( encoder_state->r->output_filters, bb );
+        arv = ap_pass_brigade( encoder_state->r->output_filters, bb );
 
         if( arv != APR_SUCCESS ) {
             ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, encoder_state->r, "ap_pass_brigade failed." );
@@ -252,6 +375,7 @@ trell_pass_reply_jpg_main( void* data,
 
 
 
+#undef BB_APPEND_CONST
 #undef BB_APPEND_STRING
 
 
@@ -22,7 +22,6 @@
 #include <http_log.h>
 #include <http_protocol.h>
 
-#include <apr_base64.h>
 #include <apr_strings.h>
 
 #include "mod_trell.h"
@@ -64,13 +63,13 @@ trell_png_encode( void* data,
     char* filtered   = encoder_state->filtered;
     char* unfiltered = encoder_state->buffer + unfiltered_offset;
 
-    encoder_state->dispatch_info->m_png_filter_entry = apr_time_now();
+    apr_time_t begin = apr_time_now();
     // We use png filter "none", and do a vertical flipping of the image
     for( j=0; j<height; j++ ) {
         filtered[ (3*width+1)*j + 0 ] = 0;
         memcpy( filtered + (3*width+1)*j + 1, unfiltered + 3*width*(height-j-1), width*3 );
     }
-    encoder_state->dispatch_info->m_png_filter_exit = apr_time_now();
+    trell_timing_add( encoder_state->dispatch_info, TRELL_TIMING_FILTER, begin );
 
     uLong bound = compressBound( (3*width+1)*height );
     // unsigned char* png = apr_palloc( encoder_state->r->pool, bound + 8 + 25 + 12 + 12 + 12 );
@@ -117,9 +116,9 @@ trell_png_encode( void* data,
 
     // IDAT chunk, 12 + payload bytes in total.
 
-    encoder_state->dispatch_info->m_png_compress_entry = apr_time_now();
+    begin = apr_time_now();
     int c = compress( (Bytef*)(p+8), &bound, (Bytef*)filtered, (3*width+1)*height );
-    encoder_state->dispatch_info->m_png_compress_exit = apr_time_now();
+    trell_timing_add( encoder_state->dispatch_info, TRELL_TIMING_COMPRESS, begin );
     if( c == Z_MEM_ERROR ) {
         ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "Z_MEM_ERROR" );
         return HTTP_INTERNAL_SERVER_ERROR;
@@ -179,6 +178,17 @@ trell_pass_reply_png_bundle( void*          data,
 
 
 
+static
+int
+trell_pass_reply_png_delta( void*          data,
+                            const char    *buffer,
+                            const size_t   buffer_bytes,
+                            const int      part,
+                            const int      more );
+
+
+
+
 int
 trell_pass_reply_png( void* data,
                       const char *buffer,
@@ -198,6 +208,10 @@ trell_pass_reply_png( void* data,
         return trell_pass_reply_png_bundle( data, buffer, buffer_bytes, part, more, encoder_state->dispatch_info->m_viewer_key_list, 0 );
     }
 
+    if ( encoder_state->dispatch_info->m_pixel_format == TRELL_PIXEL_FORMAT_RGB_DELTA ) {
+        return trell_pass_reply_png_delta( data, buffer, buffer_bytes, part, more );
+    }
+
     ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "Unknown trell pixel format: %d.", encoder_state->dispatch_info->m_pixel_format );
     return -1;
 }
@@ -205,15 +219,297 @@ trell_pass_reply_png( void* data,
 
 
 
-#define BB_APPEND_STRING( pool, bb, ...) \
-{ \
-    char *tmp = apr_psprintf( pool, __VA_ARGS__ ); \
-    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_transient_create( tmp, strlen(tmp), bb->bucket_alloc ) ); \
+// Sends the images without base64, either as a single raw png or in the
+// binary snapshot container described in trell.h. The rgb image of viewer i
+// is at i*canvas_size in the encoder buffer, followed by the depth image and
+// the two matrices if w_depth is set. Each png is encoded straight into the
+// bucket that sends it, and unless streaming, each viewer is passed on as
+// soon as it is encoded.
+static
+int
+trell_pass_reply_png_binary( trell_encode_png_state_t* encoder_state,
+                             const tinia_msg_image_t*  msg,
+                             const char * const        viewer_key_list,
+                             const int                 num_of_keys,
+                             const size_t              canvas_size,
+                             const size_t              padded_img_size,
+                             const size_t              padded_depth_size,
+                             const int                 w_depth,
+                             const size_t              total_bound )
+{
+    request_rec* r = encoder_state->r;
+    trell_dispatch_info_t* dispatch_info = encoder_state->dispatch_info;
+
+    if( !dispatch_info->m_container && ( (num_of_keys != 1) || w_depth ) ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r,
+                       "trell_pass_reply_png_binary: a raw png reply holds exactly one rgb image (viewer_key_list=%s).", viewer_key_list );
+        return -1;
+    }
+    const char* content_type = dispatch_info->m_container ? "application/octet-stream" : "image/png";
+    if( !dispatch_info->m_stream ) {
+        apr_table_setn( r->headers_out, "Content-Type", content_type );
+        ap_set_content_type( r, content_type );
+    }
+
+    struct apr_bucket_brigade* bb = apr_brigade_create( r->pool, r->connection->bucket_alloc );
+    apr_status_t arv = APR_SUCCESS;
+    if( dispatch_info->m_container ) {
+        arv = trell_bb_append_snapshot_header( bb, dispatch_info, num_of_keys );
+    }
+
+    int i, j;
+    char vkl_copy[TRELL_VIEWER_KEY_LIST_MAXLENGTH];
+    memcpy( vkl_copy, viewer_key_list, TRELL_VIEWER_KEY_LIST_MAXLENGTH );
+    const char * next_key = strtok( vkl_copy, "," );
+
+    for( i=0; (i<num_of_keys) && (arv==APR_SUCCESS); i++ ) {
+        if( next_key == NULL ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_png_binary: too few keys in viewer_key_list (%s)", viewer_key_list );
+            return -1;
+        }
+        if( dispatch_info->m_container ) {
+            if( (arv = trell_bb_append_sized( bb, next_key, strlen( next_key ) )) != APR_SUCCESS
+                    || (arv = trell_bb_append_u32( bb, w_depth ? TRELL_SNAPSHOT_FLAG_DEPTH : 0 )) != APR_SUCCESS
+                    || (arv = trell_bb_append_u32( bb, w_depth ? msg->depth_width : 0 )) != APR_SUCCESS
+                    || (arv = trell_bb_append_u32( bb, w_depth ? msg->depth_height : 0 )) != APR_SUCCESS )
+            {
+                break;
+            }
+        }
+
+        unsigned char* png = (unsigned char*)trell_bb_heap_alloc( bb, total_bound );
+        unsigned char* p = png;
+        int rv = trell_png_encode( encoder_state, i*canvas_size, &p );
+        if( rv != OK ) {
+            apr_bucket_free( png );
+            return rv;
+        }
+        if( p-png > total_bound ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_png_binary: encoder has overrun the buffer!" );
+            apr_bucket_free( png );
+            return -1;
+        }
+        if( dispatch_info->m_container ) {
+            arv = trell_bb_append_sized_heap( bb, (char*)png, p-png );
+        }
+        else {
+            trell_bb_append_heap( bb, (char*)png, p-png );
+        }
+
+        if( w_depth && (arv == APR_SUCCESS) ) {
+            encoder_state->width  = msg->depth_width;   // Now changing to size of depth image
+            encoder_state->height = msg->depth_height;
+            png = (unsigned char*)trell_bb_heap_alloc( bb, total_bound );
+            p = png;
+            rv = trell_png_encode( encoder_state, i*canvas_size + padded_img_size, &p );
+            encoder_state->width  = msg->width;         // And back to size of rgb image
+            encoder_state->height = msg->height;
+            if( rv != OK ) {
+                apr_bucket_free( png );
+                return rv;
+            }
+            if( p-png > total_bound ) {
+                ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_png_binary: encoder has overrun the buffer!" );
+                apr_bucket_free( png );
+                return -1;
+            }
+            arv = trell_bb_append_sized_heap( bb, (char*)png, p-png );
+
+            // View matrix followed by projection matrix.
+            const float * const M = (const float * const)( encoder_state->buffer + i*canvas_size + padded_img_size + padded_depth_size );
+            for( j=0; (j<32) && (arv==APR_SUCCESS); j++ ) {
+                arv = trell_bb_append_f32( bb, M[j] );
+            }
+        }
+        if( !dispatch_info->m_stream && (arv == APR_SUCCESS) ) {
+            // A stream part needs its length up front, everything else is
+            // sent viewer by viewer.
+            arv = ap_pass_brigade( r->output_filters, bb );
+            apr_brigade_cleanup( bb );
+        }
+        next_key = strtok( NULL, "," );
+    }
+    if( arv != APR_SUCCESS ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, r, "trell_pass_reply_png_binary: failed to build reply." );
+        return -1;
+    }
+
+    if( dispatch_info->m_stream ) {
+        // The reply goes on with the next frame.
+        arv = trell_bb_finish_stream_part( bb, content_type, encoder_state->revision );
+        if( arv != APR_SUCCESS ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, r, "trell_pass_reply_png_binary: failed to build stream part." );
+            return -1;
+        }
+    }
+    else {
+        APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_eos_create( bb->bucket_alloc ) );
+    }
+    arv = ap_pass_brigade( r->output_filters, bb );
+    if( arv != APR_SUCCESS ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, r, "ap_pass_brigade failed." );
+        return -1;
+    }
+    return 0;   // success
 }
 
 
 
 
+// Sends the changed tiles in the delta container described in trell.h, each
+// tile as a png of its own. The job's reply holds a table of the tiles
+// followed by their pixels, each tile padded to a multiple of four bytes.
+// The reply is gathered in the request's arena, and each tile is encoded
+// straight into the bucket that sends it.
+static
+int
+trell_pass_reply_png_delta( void*          data,
+                            const char    *buffer,
+                            const size_t   buffer_bytes,
+                            const int      part,
+                            const int      more )
+{
+    trell_encode_png_state_t* encoder_state = (trell_encode_png_state_t*)data;
+    request_rec* r = encoder_state->r;
+    // The tiles do not overlap, so their pixels fit in one frame, plus padding.
+    const size_t capacity = (4*sizeof(unsigned int) + 3) * encoder_state->delta_tiles
+                            + 3 * encoder_state->width * encoder_state->height;
+    size_t offset = 0;
+    unsigned int i;
+
+    if( part == 0 ) {
+        const tinia_msg_image_t* msg = (const tinia_msg_image_t*)buffer;
+        if( msg->msg.type != TRELL_MESSAGE_IMAGE ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "got reply of type %d.", msg->msg.type );
+            return -1;
+        }
+        encoder_state->width       = msg->width;
+        encoder_state->height      = msg->height;
+        encoder_state->delta_frame = msg->delta_frame;
+        encoder_state->delta_tiles = msg->delta_tiles;
+        encoder_state->delta_full  = msg->delta_full;
+        encoder_state->buffer      = trell_arena_get( encoder_state->arena, TRELL_ARENA_REPLY,
+                                                      (4*sizeof(unsigned int) + 3) * msg->delta_tiles
+                                                      + 3 * msg->width * msg->height );
+        if( encoder_state->buffer == NULL ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_png_delta: Out of memory." );
+            return -1;
+        }
+        encoder_state->bytes_read  = 0;
+        offset += sizeof(tinia_msg_image_t);
+        return trell_pass_reply_png_delta( data, buffer + offset, buffer_bytes - offset, 1, more );
+    }
+
+    if( buffer_bytes > 0 ) {
+        if( encoder_state->bytes_read + buffer_bytes > capacity ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_png_delta: reply larger than %lu bytes.",
+                           (unsigned long)capacity );
+            return -1;
+        }
+        memcpy( encoder_state->buffer + encoder_state->bytes_read, buffer, buffer_bytes );
+        encoder_state->bytes_read += buffer_bytes;
+    }
+    if( more != 0 ) {
+        return 0;
+    }
+
+    // last invocation
+    const unsigned int tiles = encoder_state->delta_tiles;
+    const unsigned int* table = (const unsigned int*)encoder_state->buffer;
+    size_t bytes_expected = 4*sizeof(unsigned int)*tiles;
+    size_t filtered_bound = 0;
+    for( i=0; i<tiles; i++ ) {
+        const size_t tw = table[4*i+2];
+        const size_t th = table[4*i+3];
+        if( (table[4*i+0] + tw > (size_t)encoder_state->width) || (table[4*i+1] + th > (size_t)encoder_state->height) ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_png_delta: tile %u is outside the image.", i );
+            return -1;
+        }
+        bytes_expected += 4*( (3*tw*th+3)/4 );
+        if( (3*tw+1)*th > filtered_bound ) {
+            filtered_bound = (3*tw+1)*th;
+        }
+    }
+    if( encoder_state->bytes_read != bytes_expected ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_png_delta: expected %lu bytes, got %lu bytes.",
+                       (unsigned long)bytes_expected, (unsigned long)encoder_state->bytes_read );
+        return -1;
+    }
+
+    encoder_state->filtered = trell_arena_get( encoder_state->arena, TRELL_ARENA_FILTERED, filtered_bound );
+    if( encoder_state->filtered == NULL ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r, "trell_pass_reply_png_delta: Out of memory." );
+        return -1;
+    }
+
+    apr_table_setn( r->headers_out, "Cache-Control", "no-cache" );
+    apr_table_setn( r->headers_out, "Content-Type", "application/octet-stream" );
+    ap_set_content_type( r, "application/octet-stream" );
+
+    struct apr_bucket_brigade* bb = apr_brigade_create( r->pool, r->connection->bucket_alloc );
+    apr_status_t arv = apr_brigade_write( bb, NULL, NULL, TRELL_DELTA_CONTAINER_MAGIC, 4 );
+    if( arv == APR_SUCCESS ) arv = trell_bb_append_u32( bb, TRELL_DELTA_CONTAINER_VERSION );
+    if( arv == APR_SUCCESS ) arv = trell_bb_append_u32( bb, encoder_state->delta_full ? TRELL_DELTA_FLAG_FULL : 0 );
+    if( arv == APR_SUCCESS ) arv = trell_bb_append_u32( bb, encoder_state->width );
+    if( arv == APR_SUCCESS ) arv = trell_bb_append_u32( bb, encoder_state->height );
+    if( arv == APR_SUCCESS ) arv = trell_bb_append_u32( bb, encoder_state->delta_frame );
+    if( arv == APR_SUCCESS ) arv = trell_bb_append_u32( bb, tiles );
+
+    const int width  = encoder_state->width;
+    const int height = encoder_state->height;
+    size_t pixels = 4*sizeof(unsigned int)*tiles;
+    for( i=0; (i<tiles) && (arv==APR_SUCCESS); i++ ) {
+        const unsigned int* tile = table + 4*i;
+        if( (arv = trell_bb_append_u32( bb, tile[0] )) != APR_SUCCESS
+                || (arv = trell_bb_append_u32( bb, tile[1] )) != APR_SUCCESS
+                || (arv = trell_bb_append_u32( bb, tile[2] )) != APR_SUCCESS
+                || (arv = trell_bb_append_u32( bb, tile[3] )) != APR_SUCCESS )
+        {
+            break;
+        }
+        // The png encoder works on a width x height image at the offset.
+        encoder_state->width  = tile[2];
+        encoder_state->height = tile[3];
+        unsigned char* png = (unsigned char*)trell_bb_heap_alloc( bb, compressBound( (3*tile[2]+1)*tile[3] ) + 8 + 25 + 12 + 12 + 12 );
+        unsigned char* p = png;
+        int rv = trell_png_encode( encoder_state, pixels, &p );
+        encoder_state->width  = width;
+        encoder_state->height = height;
+        if( rv != OK ) {
+            apr_bucket_free( png );
+            return -1;
+        }
+        arv = trell_bb_append_sized_heap( bb, (char*)png, p-png );
+        pixels += 4*( (3*tile[2]*tile[3]+3)/4 );
+    }
+    if( arv != APR_SUCCESS ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, r, "trell_pass_reply_png_delta: failed to build reply." );
+        return -1;
+    }
+
+    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_eos_create( bb->bucket_alloc ) );
+    arv = ap_pass_brigade( r->output_filters, bb );
+    if( arv != APR_SUCCESS ) {
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, r, "ap_pass_brigade failed." );
+        return -1;
+    }
+    return 0;   // success
+}
+
+
+
+
+// Constant strings are sent from where they are, formatted ones are written
+// into the brigade's own buffers instead of a pool string that is copied.
+#define BB_APPEND_CONST( bb, str ) \
+    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_immortal_create( str, sizeof(str)-1, bb->bucket_alloc ) )
+
+#define BB_APPEND_STRING( bb, ...) \
+    apr_brigade_printf( bb, NULL, NULL, __VA_ARGS__ )
+
+
+
+
 static int trell_pass_reply_png_bundle( void*          data,
                                         const char    *buffer,
                                         const size_t   buffer_bytes,
@@ -227,13 +523,6 @@ static int trell_pass_reply_png_bundle( void*          data,
     // ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_pass_reply_png_bundle: key=%s", encoder_state->dispatch_info->m_key );
     // This key is not the "list of keys", so we cannot use it to detect how many images we are to encode.
 
-    if ( encoder_state->dispatch_info->m_base64 == 0 ) {
-        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r,
-                       "This routine is not meant for sending of non-base64-encoded image data: %s:%s:%d",
-                       encoder_state->r->handler, __FILE__, __LINE__ );
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
-
     static int num_of_keys = 0;
     size_t buffer_img_size=0, depth_img_size=0, padded_img_size=0, padded_depth_size=0, matrix_size = sizeof(float)*16*w_depth, canvas_size=0;
 
@@ -257,24 +546,31 @@ static int trell_pass_reply_png_bundle( void*          data,
         // Some (all?) of this doesn't make (the same kind of) sense as before, now that we send two images from this routine, and they may
         // even differ in size...
 
-        encoder_state->dispatch_info->m_png_entry = apr_time_now();
         // first invocation
         tinia_msg_image_t* msg = (tinia_msg_image_t*)buffer;
         if( msg->msg.type != TRELL_MESSAGE_IMAGE ) {
             ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "got reply of type %d.", msg->msg.type );
             return -1; // error
         }
+        if( trell_snapshot_reply_etag( encoder_state, msg ) ) {
+            return 0;   // not modified, there are no pixels.
+        }
         encoder_state->width  = msg->width;
         encoder_state->height = msg->height;
+        encoder_state->revision = msg->revision;
         buffer_img_size       = 3 * encoder_state->width * encoder_state->height;
         depth_img_size        = 3 * msg->depth_width * msg->depth_height;
         ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "depth_img_size = %lu.", depth_img_size );
         padded_img_size       = 4*( (buffer_img_size+3)/4 );
         padded_depth_size     = 4*( (depth_img_size+3)/4 );
         canvas_size           = padded_img_size + w_depth*( padded_depth_size + 2*matrix_size );
-        encoder_state->buffer = apr_palloc( encoder_state->r->pool, num_of_keys * canvas_size );
+        encoder_state->buffer = trell_arena_get( encoder_state->arena, TRELL_ARENA_REPLY, num_of_keys * canvas_size );
         const size_t filtered_img_size_bound = (3*encoder_state->width+1) * encoder_state->height; // The +1 is for the png filter flag
-        encoder_state->filtered = apr_palloc( encoder_state->r->pool, filtered_img_size_bound + w_depth*2*matrix_size ); // Just in case the image is smaller than 4*16 bytes!
+        encoder_state->filtered = trell_arena_get( encoder_state->arena, TRELL_ARENA_FILTERED, filtered_img_size_bound + w_depth*2*matrix_size ); // Just in case the image is smaller than 4*16 bytes!
+        if( (encoder_state->buffer == NULL) || (encoder_state->filtered == NULL) ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_pass_reply_png_bundle: Out of memory." );
+            return -1;
+        }
 
         // hmm... hvorfor var det ikke satt av plass til to filtrerte bilder over? Hvis et er nok, hvorfor var det da satt av plass til to matriser?
         // Mistenker at det er en misforståelse å ta med de to matrisene
@@ -303,14 +599,26 @@ static int trell_pass_reply_png_bundle( void*          data,
 
         uLong bound = compressBound( (3*encoder_state->width+1)*encoder_state->height );
         const size_t total_bound = bound + 8 + 25 + 12 + 12 + 12 + w_depth*2*sizeof(float)*16; // misforståelse her også?
-        unsigned char* png = apr_palloc( encoder_state->r->pool, total_bound );
-        unsigned char* p = png;
 
         char* datestring = apr_palloc( encoder_state->r->pool, APR_RFC822_DATE_LEN );
         apr_rfc822_date( datestring, apr_time_now() );
         apr_table_setn( encoder_state->r->headers_out, "Last-Modified", datestring );
         apr_table_setn( encoder_state->r->headers_out, "Cache-Control", "no-cache" );
 
+        if( encoder_state->dispatch_info->m_base64 == 0 ) {
+            return trell_pass_reply_png_binary( encoder_state, (tinia_msg_image_t*)buffer, viewer_key_list,
+                                                num_of_keys, canvas_size, padded_img_size, padded_depth_size,
+                                                w_depth, total_bound );
+        }
+
+        // The png is only an intermediate here, so it is kept in the arena.
+        unsigned char* png = trell_arena_get( encoder_state->arena, TRELL_ARENA_ENCODED, total_bound );
+        if( png == NULL ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_pass_reply_png_bundle: Out of memory." );
+            return -1;
+        }
+        unsigned char* p = png;
+
         // Encode png as base64 and send as string
         apr_table_setn( encoder_state->r->headers_out, "Content-Type", "text/plain" );
         ap_set_content_type( encoder_state->r, "text/plain" );
@@ -323,11 +631,12 @@ static int trell_pass_reply_png_bundle( void*          data,
         memcpy( vkl_copy, viewer_key_list, TRELL_VIEWER_KEY_LIST_MAXLENGTH );
         const char * next_key = strtok( vkl_copy, "," );
 
-        BB_APPEND_STRING( encoder_state->r->pool, bb, "{ " );
-        for (i=0; i<num_of_keys; i++) {
-            BB_APPEND_STRING( encoder_state->r->pool, bb, "%s: { \"rgb\": \"", next_key );
+        apr_status_t arv = APR_SUCCESS;
+        BB_APPEND_CONST( bb, "{ " );
+        for (i=0; (i<num_of_keys) && (arv==APR_SUCCESS); i++) {
+            BB_APPEND_STRING( bb, "%s: { \"rgb\": \"", next_key );
             {
-                p = png; // Reusing the old buffer, should be ok when we use the "transient" buckets that copy data.
+                p = png; // Reusing the arena buffer, the base64 is written to a bucket of its own.
                 int rv = trell_png_encode( data, i*canvas_size, &p );
                 if ( p-png > total_bound ) {
                     // @@@ This test should not be needed, the encoding routine checks this
@@ -336,19 +645,13 @@ static int trell_pass_reply_png_bundle( void*          data,
                 }
                 if (rv!=OK)
                     return rv;
-                char* base64 = apr_palloc( encoder_state->r->pool, apr_base64_encode_len( p-png ) );
-                int base64_size = apr_base64_encode( base64, (char*)png, p-png );
-                // Seems like the zero-byte is included in the string size.
-                if( (base64_size > 0) && (base64[base64_size-1] == '\0') ) {
-                    base64_size--;
-                }
-                APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_transient_create( base64, base64_size, bb->bucket_alloc ) );
+                trell_bb_append_base64( bb, encoder_state->dispatch_info, png, p-png );
             }
-            BB_APPEND_STRING( encoder_state->r->pool, bb, "\" " );
+            BB_APPEND_CONST( bb, "\" " );
             if (w_depth) {
-                BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"depth\": \"" );
+                BB_APPEND_CONST( bb, ", \"depth\": \"" );
                 {
-                    p = png; // Reusing the old buffer, should be ok when we use the "transient" buckets that copy data.
+                    p = png;
 
                     // Is this safe, i.e., just poking into this structure?
                     tinia_msg_image_t* msg = (tinia_msg_image_t*)buffer;
@@ -365,13 +668,7 @@ static int trell_pass_reply_png_bundle( void*          data,
                     }
                     if (rv!=OK)
                         return rv;
-                    char* base64 = apr_palloc( encoder_state->r->pool, apr_base64_encode_len( p-png ) );
-                    int base64_size = apr_base64_encode( base64, (char*)png, p-png );
-                    // Seems like the zero-byte is included in the string size.
-                    if( (base64_size > 0) && (base64[base64_size-1] == '\0') ) {
-                        base64_size--;
-                    }
-                    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_transient_create( base64, base64_size, bb->bucket_alloc ) );
+                    trell_bb_append_base64( bb, encoder_state->dispatch_info, png, p-png );
 
                     // Setting size back again for rgb image
 //                    ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r,
@@ -382,30 +679,39 @@ static int trell_pass_reply_png_bundle( void*          data,
 
                 }
                 const float * const MV = (const float * const)( encoder_state->buffer + i*canvas_size + padded_img_size + padded_depth_size );
-                BB_APPEND_STRING( encoder_state->r->pool, bb, "\", view: \"%g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g\"",
+                BB_APPEND_STRING( bb, "\", view: \"%g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g\"",
                                   MV[0], MV[1], MV[2], MV[3], MV[4], MV[5], MV[6], MV[7], MV[8], MV[9], MV[10], MV[11], MV[12], MV[13], MV[14], MV[15] );
                 const float * const PM = (const float * const)( encoder_state->buffer + i*canvas_size + padded_img_size + padded_depth_size + sizeof(float)*16 );
-                BB_APPEND_STRING( encoder_state->r->pool, bb, ", proj: \"%g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g\"",
+                BB_APPEND_STRING( bb, ", proj: \"%g %g %g %g %g %g %g %g %g %g %g %g %g %g %g %g\"",
                                   PM[0], PM[1], PM[2], PM[3], PM[4], PM[5], PM[6], PM[7], PM[8], PM[9], PM[10], PM[11], PM[12], PM[13], PM[14], PM[15] );
             }
 
-            BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"revision\" : \"%d\"", encoder_state->dispatch_info->m_revision );
-            BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"timestamp\" : \"%s\"", encoder_state->dispatch_info->m_timestamp );
-            BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"snaptype\" : \"%s\"", encoder_state->dispatch_info->m_snaptype );
-            BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"depthwidth\" : \"%d\"", encoder_state->dispatch_info->m_depth_w );
-            BB_APPEND_STRING( encoder_state->r->pool, bb, ", \"depthheight\" : \"%d\"", encoder_state->dispatch_info->m_depth_h );
+            BB_APPEND_STRING( bb, ", \"revision\" : \"%d\"", encoder_state->dispatch_info->m_revision );
+            BB_APPEND_STRING( bb, ", \"timestamp\" : \"%s\"", encoder_state->dispatch_info->m_timestamp );
+            BB_APPEND_STRING( bb, ", \"snaptype\" : \"%s\"", encoder_state->dispatch_info->m_snaptype );
+            BB_APPEND_STRING( bb, ", \"depthwidth\" : \"%d\"", encoder_state->dispatch_info->m_depth_w );
+            BB_APPEND_STRING( bb, ", \"depthheight\" : \"%d\"", encoder_state->dispatch_info->m_depth_h );
 
-            BB_APPEND_STRING( encoder_state->r->pool, bb, " }" );
+            BB_APPEND_CONST( bb, " }" );
             if (i<num_of_keys-1) {
-                BB_APPEND_STRING( encoder_state->r->pool, bb, ", " );
+                BB_APPEND_CONST( bb, ", " );
             }
             next_key = strtok( NULL, "," );
             if (   ( (i<num_of_keys-1) && (next_key==NULL) )   ||   ( (i==num_of_keys-1) && (next_key!=NULL) )   ) {
                 ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, encoder_state->r, "trell_pass_reply_png_bundle: strtok has not worked as expected. Problem with the viewer_key_list? (%s)", viewer_key_list );
                 return -1;
             }
+            if( !encoder_state->dispatch_info->m_stream ) {
+                // Send this viewer while the next is encoded.
+                arv = ap_pass_brigade( encoder_state->r->output_filters, bb );
+                apr_brigade_cleanup( bb );
+            }
+        }
+        if( arv != APR_SUCCESS ) {
+            ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, encoder_state->r, "ap_pass_brigade failed." );
+            return -1;
         }
-        BB_APPEND_STRING( encoder_state->r->pool, bb, " }" );
+        BB_APPEND_CONST( bb, " }" );
 
 #if 0
         // To inspect the resulting package, see the apache error log
@@ -419,7 +725,7 @@ static int trell_pass_reply_png_bundle( void*          data,
 #endif
 
         APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_eos_create( bb->bucket_alloc ) );
-        apr_status_t arv = ap_pass_brigade( encoder_state->r->output_filters, bb );
+        arv = ap_pass_brigade( encoder_state->r->output_filters, bb );
 
         if( arv != APR_SUCCESS ) {
             ap_log_rerror( APLOG_MARK, APLOG_ERR, arv, encoder_state->r, "ap_pass_brigade failed." );
@@ -436,4 +742,5 @@ static int trell_pass_reply_png_bundle( void*          data,
 
 
 
+#undef BB_APPEND_CONST
 #undef BB_APPEND_STRING
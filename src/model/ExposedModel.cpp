@@ -49,11 +49,17 @@ using std::vector;
 using std::for_each;
 using std::pair;
 
-ExposedModel::ExposedModel() : revisionNumber( 1 ), m_gui(NULL), holdEventCounter(0)
+ExposedModel::ExposedModel() :
+    m_transactionDepth( 0 ), m_transactionHasRevision( false ), m_transactionRevision( 0 ),
+    revisionNumber( 1 ), m_selfMutex(*this), m_gui(NULL), holdEventCounter(0)
 {
+    boost::shared_ptr<StateSnapshot> snapshot( new StateSnapshot );
+    snapshot->revisionNumber = revisionNumber;
+    m_snapshot = snapshot;
 }
 
 ExposedModel::~ExposedModel() {
+    stopStateEventDispatcher();
     if(m_gui != NULL) {
         delete m_gui;
     }
@@ -61,10 +67,33 @@ ExposedModel::~ExposedModel() {
 
 void
 ExposedModel::incrementRevisionNumber(impl::ElementData &updatedElement) {
+   if ( m_transactionDepth > 0 ) {
+       if ( !m_transactionHasRevision ) {
+           m_transactionRevision = revisionNumber;
+           ++revisionNumber;
+           m_transactionHasRevision = true;
+       }
+       updatedElement.setRevisionNumber(m_transactionRevision);
+       return;
+   }
    updatedElement.setRevisionNumber(revisionNumber);
    ++revisionNumber;
 }
 
+void
+ExposedModel::beginTransaction() {
+   if ( m_transactionDepth++ == 0 ) {
+       m_transactionHasRevision = false;
+   }
+}
+
+void
+ExposedModel::endTransaction() {
+   if ( m_transactionDepth > 0 ) {
+       --m_transactionDepth;
+   }
+}
+
 
 
 
@@ -116,6 +145,69 @@ void ExposedModel::updateElementFromPTree( const std::string &key, const StringS
 }
 
 
+void ExposedModel::updateElementFields( const std::string &key,
+                                        const std::vector< std::pair<std::string, std::string> > &fields )
+{
+      std::vector<ElementUpdate> updates( 1 );
+      updates[0].kind = ElementUpdate::FIELDS;
+      updates[0].key = key;
+      updates[0].fields = fields;
+      updateElements( updates );
+}
+
+
+void ExposedModel::updateElements( const std::vector<ElementUpdate>& updates )
+{
+      scoped_lock lock(m_selfMutex);
+
+      // The new values are set on copies of the elements, which checks them
+      // without touching the model.
+      std::vector<impl::ElementData> updated;
+      updated.reserve( updates.size() );
+      for( size_t i = 0; i < updates.size(); ++i ) {
+         const ElementUpdate& update = updates[i];
+         updated.push_back( findElementInternal( update.key ) );
+         impl::ElementData& element = updated.back();
+         switch( update.kind ) {
+         case ElementUpdate::VALUE:
+            element.setStringValue( update.value );
+            break;
+         case ElementUpdate::FIELDS: {
+            impl::ElementData::PropertyTree& tree = element.getPropertyTree();
+            for( size_t j = 0; j < update.fields.size(); ++j ) {
+               impl::ElementData::PropertyTree::iterator field = tree.find( update.fields[j].first );
+               if( field == tree.end() ) {
+                  throw KeyNotFoundException( update.key + "." + update.fields[j].first );
+               }
+               field->second.setStringValue( update.fields[j].second );
+            }
+            break;
+         }
+         case ElementUpdate::TREE:
+            element.setPropertyTreeValue( update.tree.begin()->second );
+            break;
+         }
+      }
+
+      // All are valid, apply them as one transaction.
+      holdStateEvents( true );
+      beginTransaction();
+      for( size_t i = 0; i < updates.size(); ++i ) {
+         impl::ElementData& element = findElementInternal( updates[i].key );
+         const bool changed = ( updates[i].kind != ElementUpdate::VALUE ) ||
+                              ( element.getStringValue() != updated[i].getStringValue() );
+         element = updated[i];
+         incrementRevisionNumber( element );
+         if( changed ) {
+            fireStateElementModified( updates[i].key, element );
+         }
+      }
+      endTransaction();
+      lock.unlock();
+      releaseStateEvents();
+}
+
+
 void
 ExposedModel::addAnnotationHelper( std::string key, std::map<std::string, std::string> & annotationMap ) {
 
@@ -169,6 +261,7 @@ ExposedModel::addMatrixHelper(std::string key, const float *matrixData) {
     impl::ElementData elementData = elementFactory.createMatrixElement( matrixData );
    incrementRevisionNumber( elementData );
    stateHash[key] = elementData;
+   markDirty( key );
 }
 
 
@@ -195,34 +288,34 @@ ExposedModel::removeElement( std::string key ) {
    }
    impl::ElementData data = it->second;
    stateHash.erase( it );
+   markDirty( key );
    fireStateSchemaElementRemoved(key, data);
 }
 
 
 bool
 ExposedModel::hasElement( std::string elementName ) const {
-   scoped_lock lock(m_selfMutex);
-   return stateHash.find( elementName) != stateHash.end();
+   if ( m_selfMutex.heldByCurrentThread() ) {
+       return stateHash.find( elementName ) != stateHash.end();
+   }
+   StateSnapshotPtr snapshot = boost::atomic_load( &m_snapshot );
+   return snapshot->elements.find( elementName ) != snapshot->elements.end();
 }
 
 
 string
 ExposedModel::getElementValueAsString( string key)
 {
-   scoped_lock lock(m_selfMutex);
-   return findElementInternal(key).getStringValue();
+   return findElementForReading(key)->getStringValue();
 }
 
 void
 ExposedModel::getMatrixValue( std::string key, float* matrixData ) const {
-   // Locking whole method
-   scoped_lock lock(m_selfMutex);
-
-   const impl::ElementData& elementData = findElementInternal(key);
-   if (elementData.getLength() != impl::ElementData::MATRIX_LENGTH) {
-       throw TypeException(elementData.getXSDType(), "Matrix");
+   boost::shared_ptr<const impl::ElementData> elementData = findElementForReading(key);
+   if (elementData->getLength() != impl::ElementData::MATRIX_LENGTH) {
+       throw TypeException(elementData->getXSDType(), "Matrix");
    }
-   elementFactory.createMatrix( findElementInternal(key), matrixData );
+   elementFactory.createMatrix( *elementData, matrixData );
 
 }
 
@@ -233,16 +326,12 @@ ExposedModel::getMatrixValue( std::string key, float* matrixData ) const {
 // Updates to send *to* the client, version for non-xml-capable jobs/controllers.
 void ExposedModel::getExposedModelUpdate(std::vector< std::pair<std::string, impl::ElementData> > &updatedElements, const unsigned has_revision ) const
 {
-   scoped_lock lock(m_selfMutex);
    updatedElements.resize(0);
-   for(std::map<std::string, impl::ElementData>::const_iterator kv = stateHash.begin(); kv != stateHash.end(); ++kv) {
-                 
-         const impl::ElementData& elementData = kv->second;
-         // printf("Current rev=%d, rev_0=%d, element(%s) has rev=%d\n", revisionNumber, has_revision, kv.first.c_str(), elementData.getRevisionNumber());
+   forEachElementForReading( [&]( const std::string& key, const impl::ElementData& elementData ) {
+         // printf("Current rev=%d, rev_0=%d, element(%s) has rev=%d\n", revisionNumber, has_revision, key.c_str(), elementData.getRevisionNumber());
          if ( elementData.getRevisionNumber() >= has_revision )
-            updatedElements.push_back( std::make_pair( kv->first, elementData ) );
-
-   }
+            updatedElements.push_back( std::make_pair( key, elementData ) );
+   } );
 }
 
 
@@ -259,6 +348,121 @@ void
 ExposedModel::updateStateHash( std::string key,  impl::ElementData& elementData ) {
    incrementRevisionNumber( elementData );
    stateHash[key] = elementData;
+   markDirty( key );
+}
+
+int
+ExposedModel::getRevisionNumber() const {
+   if ( m_selfMutex.heldByCurrentThread() ) {
+       return revisionNumber;
+   }
+   return boost::atomic_load( &m_snapshot )->revisionNumber;
+}
+
+void
+ExposedModel::advanceRevisionNumber(unsigned int revision) {
+   scoped_lock lock(m_selfMutex);
+   if ( revisionNumber <= revision ) {
+      revisionNumber = revision + 1;
+   }
+}
+
+void
+ExposedModel::markDirty( const std::string& key ) {
+   m_dirtyKeys.insert( key );
+}
+
+void
+ExposedModel::publishSnapshot() {
+   if ( m_dirtyKeys.empty() && m_snapshot->revisionNumber == revisionNumber ) {
+       return;
+   }
+   // Unchanged elements are shared with the previous snapshot.
+   boost::shared_ptr<StateSnapshot> snapshot( new StateSnapshot( *m_snapshot ) );
+   snapshot->revisionNumber = revisionNumber;
+   for ( std::set<std::string>::const_iterator it = m_dirtyKeys.begin(); it != m_dirtyKeys.end(); ++it ) {
+       std::map<std::string, impl::ElementData>::const_iterator element = stateHash.find( *it );
+       if ( element == stateHash.end() ) {
+           snapshot->elements.erase( *it );
+       }
+       else {
+           snapshot->elements[*it].reset( new impl::ElementData( element->second ) );
+       }
+   }
+   m_dirtyKeys.clear();
+   boost::atomic_store( &m_snapshot, StateSnapshotPtr( snapshot ) );
+}
+
+template<class Visitor>
+void
+ExposedModel::forEachElementForReading( Visitor visit ) const {
+   if ( m_selfMutex.heldByCurrentThread() ) {
+       // We are in the middle of a write, and must see our own changes.
+       for ( std::map<std::string, impl::ElementData>::const_iterator it = stateHash.begin(); it != stateHash.end(); ++it ) {
+           visit( it->first, it->second );
+       }
+       return;
+   }
+   StateSnapshotPtr snapshot = boost::atomic_load( &m_snapshot );
+   for ( std::map<std::string, boost::shared_ptr<const impl::ElementData> >::const_iterator it = snapshot->elements.begin(); it != snapshot->elements.end(); ++it ) {
+       visit( it->first, *it->second );
+   }
+}
+
+boost::shared_ptr<const impl::ElementData>
+ExposedModel::findElementForReading( const std::string& key ) const {
+   if ( m_selfMutex.heldByCurrentThread() ) {
+       return boost::shared_ptr<const impl::ElementData>( new impl::ElementData( findElementInternal( key ) ) );
+   }
+   StateSnapshotPtr snapshot = boost::atomic_load( &m_snapshot );
+   std::map<std::string, boost::shared_ptr<const impl::ElementData> >::const_iterator it = snapshot->elements.find( key );
+   if ( it == snapshot->elements.end() ) {
+       throw KeyNotFoundException( key );
+   }
+   return it->second;
+}
+
+ExposedModel::mutex_type::mutex_type( ExposedModel& model )
+    : m_model( model )
+{
+}
+
+unsigned int&
+ExposedModel::mutex_type::depth() const {
+   if ( m_depth.get() == NULL ) {
+       m_depth.reset( new unsigned int( 0 ) );
+   }
+   return *m_depth;
+}
+
+void
+ExposedModel::mutex_type::lock() {
+   m_mutex.lock();
+   ++depth();
+}
+
+bool
+ExposedModel::mutex_type::try_lock() {
+   if ( !m_mutex.try_lock() ) {
+       return false;
+   }
+   ++depth();
+   return true;
+}
+
+void
+ExposedModel::mutex_type::unlock() {
+   unsigned int& d = depth();
+   if ( d == 1 ) {
+       m_model.publishSnapshot();
+   }
+   --d;
+   m_mutex.unlock();
+}
+
+bool
+ExposedModel::mutex_type::heldByCurrentThread() const {
+   return m_depth.get() != NULL && *m_depth > 0;
 }
 
 }
@@ -293,88 +497,130 @@ void model::ExposedModel::removeStateSchemaListener(std::string key,
    m_stateSchemaListenerHandler.removeStateSchemaListener(key, listener);
 }
 
+// The StateListenerHandler protects its own listener lists, and calls
+// listeners without holding that protection, so these do not lock the model.
+// This keeps listeners being called from the dispatcher thread from
+// deadlocking with (un)registration.
 void model::ExposedModel::addStateListener(model::StateListener *listener)
 {
-   scoped_lock lock(m_selfMutex);
    m_stateListenerHandler.addStateListener(listener);
 }
 
 
 void model::ExposedModel::removeStateListener(model::StateListener *listener)
 {
-   scoped_lock lock(m_selfMutex);
    m_stateListenerHandler.removeStateListener(listener);
 }
 
 void model::ExposedModel::addStateListener(std::string key, model::StateListener *listener)
 {
-   scoped_lock lock(m_selfMutex);
    m_stateListenerHandler.addStateListener(key,    listener);
 }
 
 void model::ExposedModel::removeStateListener(std::string key, model::StateListener *listener)
 {
-   scoped_lock lock(m_selfMutex);
    m_stateListenerHandler.removeStateListener(key, listener);
 }
 
+void model::ExposedModel::setStateEventDelivery(model::ExposedModel::StateEventDelivery delivery,
+                                                boost::function<void()> eventsPending)
+{
+   stopStateEventDispatcher();
+   {
+      scoped_lock lock(m_selfMutex);
+      switch(delivery) {
+      case DELIVER_SYNCHRONOUSLY:
+         m_stateListenerHandler.setQueueEvents(false);
+         break;
+      case DELIVER_QUEUED:
+         m_stateListenerHandler.setQueueEvents(true, eventsPending);
+         break;
+      case DELIVER_FROM_DISPATCHER_THREAD:
+         m_stateListenerHandler.setQueueEvents(true);
+         break;
+      }
+   }
+
+   if(delivery == DELIVER_FROM_DISPATCHER_THREAD)
+   {
+      m_stateListenerHandler.resumeWaiting();
+      m_stateEventDispatcher = boost::thread(&ExposedModel::runStateEventDispatcher, this);
+   }
+   else if(delivery == DELIVER_SYNCHRONOUSLY)
+   {
+      // Don't lose events that were queued before the switch.
+      m_stateListenerHandler.deliverQueuedEvents();
+   }
+}
+
+size_t model::ExposedModel::deliverQueuedStateEvents()
+{
+   return m_stateListenerHandler.deliverQueuedEvents();
+}
+
+void model::ExposedModel::stopStateEventDispatcher()
+{
+   if(m_stateEventDispatcher.joinable())
+   {
+      m_stateListenerHandler.stopWaiting();
+      m_stateEventDispatcher.join();
+   }
+}
+
+void model::ExposedModel::runStateEventDispatcher()
+{
+   while(m_stateListenerHandler.waitForQueuedEvents())
+   {
+      m_stateListenerHandler.deliverQueuedEvents();
+   }
+}
+
 void model::ExposedModel::getStateUpdate(
       std::vector<model::StateElement> &updatedElements,
       const unsigned int has_revision)
 {
-   scoped_lock lock(m_selfMutex);
-   for(std::map<std::string, impl::ElementData>::iterator it = stateHash.begin(); it!=stateHash.end(); it++)
-   {
-      impl::ElementData& data = it->second;
+   forEachElementForReading( [&]( const std::string& key, const impl::ElementData& data ) {
       if(data.getRevisionNumber()>=has_revision)
       {
-         updatedElements.push_back(StateElement(it->first, data));
+         updatedElements.push_back(StateElement(key, data));
       }
-   }
+   } );
 }
 
 void model::ExposedModel::getStateSchemaUpdate(
       std::vector<model::StateSchemaElement> &updatedElements,
       const unsigned int has_revision)
 {
-   scoped_lock lock(m_selfMutex);
-   for(std::map<std::string, impl::ElementData>::iterator it = stateHash.begin(); it!=stateHash.end(); it++)
-   {
-      impl::ElementData& data = it->second;
+   forEachElementForReading( [&]( const std::string& key, const impl::ElementData& data ) {
       if(data.getRevisionNumber()>=has_revision)
       {
-         updatedElements.push_back(StateSchemaElement(it->first, data));
+         updatedElements.push_back(StateSchemaElement(key, data));
       }
-   }
+   } );
 }
 
 
 void model::ExposedModel::getFullStateSchema(std::vector<model::StateSchemaElement> &stateSchemaElements)
 {
 
-   scoped_lock lock(m_selfMutex);
-
-   for(std::map<std::string, impl::ElementData>::iterator it = stateHash.begin(); it != stateHash.end(); it++)
-   {
-      std::string key(it->first.c_str());
-      impl::ElementData data = it->second;
+   forEachElementForReading( [&]( const std::string& key, const impl::ElementData& data ) {
       stateSchemaElements.push_back(StateSchemaElement(key, data));
-   }
+   } );
 }
 
 void model::ExposedModel::getFullState(std::vector<model::StateElement> &stateElements)
 {
-   scoped_lock lock(m_selfMutex);
-   for(std::map<std::string, impl::ElementData>::iterator it = stateHash.begin(); it != stateHash.end(); it++)
-   {
-      stateElements.push_back(StateElement(it->first, impl::ElementData(it->second)));
-   }
+   forEachElementForReading( [&]( const std::string& key, const impl::ElementData& data ) {
+      stateElements.push_back(StateElement(key, data));
+   } );
 }
 
 void model::ExposedModel::fireStateSchemaElementAdded(std::string key,
                                                        const model::impl::ElementData &data)
 {
    scoped_lock lock(m_selfMutex);
+   // Listeners in other threads must be able to read what they are told about.
+   publishSnapshot();
    model::StateSchemaElement element(key, data);
 
    m_stateSchemaListenerHandler.fireStateSchemaElementAdded(&element);
@@ -384,6 +630,7 @@ void model::ExposedModel::fireStateSchemaElementRemoved(std::string key,
                                                          const model::impl::ElementData &data)
 {
    scoped_lock lock(m_selfMutex);
+   publishSnapshot();
    model::StateSchemaElement element(key, data);
    m_stateSchemaListenerHandler.fireStateSchemaElementRemoved(&element);
 }
@@ -392,6 +639,7 @@ void model::ExposedModel::fireStateSchemaElementModified(std::string key,
                                                           const model::impl::ElementData &data)
 {
    scoped_lock lock(m_selfMutex);
+   publishSnapshot();
    model::StateSchemaElement element(key, data);
    m_stateSchemaListenerHandler.fireStateSchemaElementModified(&element);
 }
@@ -400,6 +648,10 @@ void model::ExposedModel::fireStateElementModified(std::string key,
                                                     const model::impl::ElementData &data)
 {
    scoped_lock lock(m_selfMutex);
+   // Held events are published when the ExposedModelLock is released.
+   if(holdEventCounter == 0) {
+      publishSnapshot();
+   }
    model::StateElement element(key, data);
    m_stateListenerHandler.fireStateElementModified(&element);
 }
@@ -433,6 +685,7 @@ model::impl::ElementData &model::ExposedModel::findElementInternal(const std::st
     if ( result == stateHash.end() ) {
         throw KeyNotFoundException(key);
     }
+    markDirty(key);
     return result->second;
 }
 
@@ -449,9 +702,8 @@ const model::impl::ElementData &model::ExposedModel::findElementInternal(const s
 std::set<std::string> model::ExposedModel::getRestrictionSet(std::string key)
 {
    // This returns a deep copy to avoid any possible threading-problems.
-   scoped_lock lock(m_selfMutex);
    std::set<std::string> destinationSet;
-   std::set<std::string> sourceSet = findElementInternal(key).getEnumerationSet();
+   std::set<std::string> sourceSet = findElementForReading(key)->getEnumerationSet();
    for(std::set<std::string>::iterator it = sourceSet.begin(); it!=sourceSet.end(); it++)
    {
       destinationSet.insert(it->c_str());
@@ -461,11 +713,7 @@ std::set<std::string> model::ExposedModel::getRestrictionSet(std::string key)
 
 bool model::ExposedModel::emptyRestrictionSet(std::string key)
 {
-   scoped_lock lock(m_selfMutex);
-
-
-   impl::ElementData& elementData = findElementInternal(key);
-   return elementData.emptyRestrictionSet();
+   return findElementForReading(key)->emptyRestrictionSet();
 }
 
 void model::ExposedModel::releaseAllListeners()
@@ -474,32 +722,17 @@ void model::ExposedModel::releaseAllListeners()
 
 model::StateSchemaElement model::ExposedModel::getStateSchemaElement(std::string key)
 {
-   // The whole method locks the model. This could be optimized, but leaving it
-   // like this for now.
-   scoped_lock lock(m_selfMutex);
-
-   impl::ElementData& elementData = findElementInternal(key);
-   return StateSchemaElement(key, elementData);
+   return StateSchemaElement(key, *findElementForReading(key));
 }
 
 std::string model::ExposedModel::getElementMaxConstraint(std::string key) const
 {
-   // The whole method locks the model. This could be optimized, but leaving it
-   // like this for now.
-    scoped_lock lock(m_selfMutex);
-
-   const impl::ElementData& elementData = findElementInternal(key);
-   return elementData.getMaxConstraint();
+   return findElementForReading(key)->getMaxConstraint();
 }
 
 std::string model::ExposedModel::getElementMinConstraint(std::string key) const
 {
-   // The whole method locks the model. This could be optimized, but leaving it
-   // like this for now.
-   scoped_lock lock(m_selfMutex);
-
-   const impl::ElementData& elementData = findElementInternal(key);
-   return elementData.getMinConstraint();
+   return findElementForReading(key)->getMinConstraint();
 }
 
 void model::ExposedModel::makeDefaultGUILayout()
@@ -528,11 +761,11 @@ void model::ExposedModel::makeDefaultGUILayout()
    m_gui = grid;
 }
 
-void model::ExposedModel::holdStateEvents()
+void model::ExposedModel::holdStateEvents(bool batch)
 {
     scoped_lock lock(m_selfMutex);
     holdEventCounter++;
-   m_stateListenerHandler.holdEvents();
+   m_stateListenerHandler.holdEvents(batch);
 }
 
 void model::ExposedModel::releaseStateEvents()
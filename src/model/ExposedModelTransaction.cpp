@@ -0,0 +1,52 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/model/ExposedModelTransaction.hpp"
+
+namespace tinia {
+namespace model {
+
+ExposedModelTransaction::ExposedModelTransaction(boost::shared_ptr<ExposedModel> model)
+   : m_scoped_lock(model->getExposedModelMutex()),
+     m_model(model),
+     m_committed(false)
+{
+   model->beginTransaction();
+   model->holdStateEvents(true);
+}
+
+ExposedModelTransaction::~ExposedModelTransaction()
+{
+   commit();
+}
+
+void ExposedModelTransaction::commit()
+{
+   if(m_committed)
+   {
+      return;
+   }
+   m_committed = true;
+   m_model->endTransaction();
+   // Publishes the snapshot if this is the outermost lock.
+   m_scoped_lock.unlock();
+   m_model->releaseStateEvents();
+}
+
+} // namespace model
+} // of namespace tinia
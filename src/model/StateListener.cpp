@@ -17,3 +17,21 @@
  */
 
 #include "tinia/model/StateListener.hpp"
+
+namespace tinia {
+void model::StateListener::stateElementsModified(std::vector<model::StateElement> &stateElements)
+{
+   for(size_t i = 0; i < stateElements.size(); ++i)
+   {
+      stateElementModified(&stateElements[i]);
+   }
+}
+
+void model::StateListener::stateElementsReleased(std::vector<model::StateElement> &stateElements)
+{
+   for(size_t i = 0; i < stateElements.size(); ++i)
+   {
+      stateElementModified(&stateElements[i]);
+   }
+}
+} // of namespace tinia
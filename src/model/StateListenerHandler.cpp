@@ -19,27 +19,65 @@
 #include "tinia/model/impl/StateListenerHandler.hpp"
 
 namespace tinia {
+model::impl::StateListenerHandler::StateListenerHandler()
+   : m_listeners(new Listeners),
+     m_keylisteners(new KeyListeners),
+     m_isBuffering(false),
+     m_isBatching(false),
+     m_queueEvents(false),
+     m_stopWaiting(false)
+{
+}
+
+// The lists are never modified in place; add and remove replace them with
+// modified copies, so a delivery can iterate its copy without the mutex held.
 void model::impl::StateListenerHandler::addStateListener(model::StateListener *listener)
 {
-   m_listeners.push_back(listener);
+   boost::mutex::scoped_lock lock(m_listenerMutex);
+   boost::shared_ptr<Listeners> listeners(new Listeners(*m_listeners));
+   listeners->push_back(listener);
+   m_listeners = listeners;
 }
 void model::impl::StateListenerHandler::addStateListener(std::string key, model::StateListener *listener)
 {
-   m_keylisteners[key].push_back(listener);
+   boost::mutex::scoped_lock lock(m_listenerMutex);
+   boost::shared_ptr<KeyListeners> keylisteners(new KeyListeners(*m_keylisteners));
+   (*keylisteners)[key].push_back(listener);
+   m_keylisteners = keylisteners;
 }
 
 void model::impl::StateListenerHandler::removeStateListener(std::string key, model::StateListener *listener)
 {
-   m_keylisteners[key].remove(listener);
-   if(m_keylisteners[key].size() == 0)
+   boost::mutex::scoped_lock lock(m_listenerMutex);
+   boost::shared_ptr<KeyListeners> keylisteners(new KeyListeners(*m_keylisteners));
+   (*keylisteners)[key].remove(listener);
+   if((*keylisteners)[key].size() == 0)
    {
-      m_keylisteners.erase(key);
+      keylisteners->erase(key);
    }
+   m_keylisteners = keylisteners;
 }
 
 void model::impl::StateListenerHandler::removeStateListener(model::StateListener *listener)
 {
-   m_listeners.remove(listener);
+   boost::mutex::scoped_lock lock(m_listenerMutex);
+   boost::shared_ptr<Listeners> listeners(new Listeners(*m_listeners));
+   listeners->remove(listener);
+   m_listeners = listeners;
+}
+
+boost::shared_ptr<const model::impl::StateListenerHandler::Listeners>
+model::impl::StateListenerHandler::listeners()
+{
+   boost::mutex::scoped_lock lock(m_listenerMutex);
+   return m_listeners;
+}
+
+boost::shared_ptr<const model::impl::StateListenerHandler::KeyListeners>
+model::impl::StateListenerHandler::keyListeners()
+{
+   boost::mutex::scoped_lock lock(m_listenerMutex);
+   return m_keylisteners;
 }
 
 
@@ -51,31 +89,223 @@ void model::impl::StateListenerHandler::fireStateElementModified(
       m_buffer.push_back(StateElement(*stateElement));
       return;
    }
-   for(std::list<model::StateListener*>::iterator it = m_listeners.begin(); it!= m_listeners.end(); it++)
+
+   bool wasEmpty = false;
+   boost::function<void()> eventsPending;
+   {
+      boost::mutex::scoped_lock lock(m_queueMutex);
+      if(!m_queueEvents)
+      {
+         lock.unlock();
+         deliverStateElementModified(stateElement);
+         return;
+      }
+      const std::string key = stateElement->getKey();
+      std::map<std::string, StateElement>::iterator it = m_queue.find(key);
+      if(it != m_queue.end())
+      {
+         // Coalesce with the pending event, keeping its position in the queue.
+         it->second = *stateElement;
+      }
+      else
+      {
+         wasEmpty = m_queue.empty();
+         m_queue.insert(std::make_pair(key, *stateElement));
+         m_queueOrder.push_back(key);
+      }
+      eventsPending = m_eventsPending;
+   }
+   if(wasEmpty)
+   {
+      m_queueCondition.notify_all();
+      if(eventsPending)
+      {
+         eventsPending();
+      }
+   }
+}
+
+void model::impl::StateListenerHandler::deliverStateElementModified(
+      model::StateElement *stateElement)
+{
+   boost::shared_ptr<const Listeners> all = listeners();
+   for(Listeners::const_iterator it = all->begin(); it!= all->end(); it++)
    {
       (*it)->stateElementModified(stateElement);
    }
 
-   std::list<model::StateListener*> &listeners = m_keylisteners[stateElement->getKey()];
-   for(std::list<model::StateListener*>::iterator it = listeners.begin(); it!= listeners.end(); it++)
+   boost::shared_ptr<const KeyListeners> keylisteners = keyListeners();
+   KeyListeners::const_iterator keyIt = keylisteners->find(stateElement->getKey());
+   if(keyIt == keylisteners->end())
+   {
+      return;
+   }
+   for(Listeners::const_iterator it = keyIt->second.begin(); it!= keyIt->second.end(); it++)
    {
       (*it)->stateElementModified(stateElement);
    }
 }
 
-void model::impl::StateListenerHandler::holdEvents()
+void model::impl::StateListenerHandler::deliverStateElementsModified(
+      std::vector<model::StateElement> &stateElements, bool released)
+{
+   boost::shared_ptr<const Listeners> all = listeners();
+   for(Listeners::const_iterator it = all->begin(); it!= all->end(); it++)
+   {
+      if(released)
+      {
+         (*it)->stateElementsReleased(stateElements);
+      }
+      else
+      {
+         (*it)->stateElementsModified(stateElements);
+      }
+   }
+
+   boost::shared_ptr<const KeyListeners> keylisteners = keyListeners();
+   for(KeyListeners::const_iterator keyIt = keylisteners->begin(); keyIt != keylisteners->end(); ++keyIt)
+   {
+      std::vector<model::StateElement> keyElements;
+      for(size_t i = 0; i < stateElements.size(); ++i)
+      {
+         if(stateElements[i].getKey() == keyIt->first)
+         {
+            keyElements.push_back(stateElements[i]);
+         }
+      }
+      if(keyElements.empty())
+      {
+         continue;
+      }
+      const Listeners &listeners = keyIt->second;
+      for(Listeners::const_iterator it = listeners.begin(); it!= listeners.end(); it++)
+      {
+         if(released)
+         {
+            (*it)->stateElementsReleased(keyElements);
+         }
+         else
+         {
+            (*it)->stateElementsModified(keyElements);
+         }
+      }
+   }
+}
+
+void model::impl::StateListenerHandler::holdEvents(bool batch)
 {
    m_isBuffering = true;
+   m_isBatching = m_isBatching || batch;
 }
 
 void model::impl::StateListenerHandler::releaseEvents()
 {
    m_isBuffering = false;
-   for(size_t i = 0; i < m_buffer.size(); i++ )
+   std::vector<StateElement> buffer;
+   buffer.swap(m_buffer);
+
+   bool batch = m_isBatching;
+   m_isBatching = false;
+
+   bool queueEvents;
+   {
+      boost::mutex::scoped_lock lock(m_queueMutex);
+      queueEvents = m_queueEvents;
+   }
+   if(queueEvents)
    {
-      fireStateElementModified(&m_buffer[i]);
+      // The queue coalesces on its own.
+      for(size_t i = 0; i < buffer.size(); i++ )
+      {
+         fireStateElementModified(&buffer[i]);
+      }
+      return;
    }
-   m_buffer.clear();
+   if(!batch)
+   {
+      if(!buffer.empty())
+      {
+         deliverStateElementsModified(buffer, true);
+      }
+      return;
+   }
+
+   // Keep one event per key, at the position of its first occurrence but with
+   // the last value.
+   std::vector<StateElement> batchElements;
+   std::map<std::string, size_t> positions;
+   for(size_t i = 0; i < buffer.size(); i++)
+   {
+      const std::string key = buffer[i].getKey();
+      std::map<std::string, size_t>::iterator it = positions.find(key);
+      if(it == positions.end())
+      {
+         positions[key] = batchElements.size();
+         batchElements.push_back(buffer[i]);
+      }
+      else
+      {
+         batchElements[it->second] = buffer[i];
+      }
+   }
+   if(!batchElements.empty())
+   {
+      deliverStateElementsModified(batchElements);
+   }
+}
+
+void model::impl::StateListenerHandler::setQueueEvents(bool queueEvents,
+                                                       boost::function<void()> eventsPending)
+{
+   boost::mutex::scoped_lock lock(m_queueMutex);
+   m_queueEvents = queueEvents;
+   m_eventsPending = eventsPending;
+}
+
+size_t model::impl::StateListenerHandler::deliverQueuedEvents()
+{
+   // Holding the delivery mutex while taking the queue ensures that a later
+   // batch can not overtake this one.
+   boost::recursive_mutex::scoped_lock deliveryLock(m_deliveryMutex);
+
+   std::list<std::string> order;
+   std::map<std::string, StateElement> events;
+   {
+      boost::mutex::scoped_lock lock(m_queueMutex);
+      order.swap(m_queueOrder);
+      events.swap(m_queue);
+   }
+
+   for(std::list<std::string>::iterator it = order.begin(); it != order.end(); ++it)
+   {
+      deliverStateElementModified(&events[*it]);
+   }
+   return order.size();
+}
+
+bool model::impl::StateListenerHandler::waitForQueuedEvents()
+{
+   boost::mutex::scoped_lock lock(m_queueMutex);
+   while(m_queue.empty() && !m_stopWaiting)
+   {
+      m_queueCondition.wait(lock);
+   }
+   return !m_stopWaiting;
+}
+
+void model::impl::StateListenerHandler::stopWaiting()
+{
+   {
+      boost::mutex::scoped_lock lock(m_queueMutex);
+      m_stopWaiting = true;
+   }
+   m_queueCondition.notify_all();
+}
+
+void model::impl::StateListenerHandler::resumeWaiting()
+{
+   boost::mutex::scoped_lock lock(m_queueMutex);
+   m_stopWaiting = false;
 }
 
 } // of namespace tinia
@@ -35,4 +35,15 @@ void model::impl::xml::ElementHandler::updateElementFromPTree(const std::string
 {
    m_model->updateElementFromPTree(key, tree);
 }
+
+void model::impl::xml::ElementHandler::updateElementFields(const std::string &key,
+                                                       const std::vector< std::pair<std::string, std::string> > &fields)
+{
+   m_model->updateElementFields(key, fields);
+}
+
+void model::impl::xml::ElementHandler::updateElements(const std::vector<model::ExposedModel::ElementUpdate>& updates)
+{
+   m_model->updateElements(updates);
+}
 }
@@ -34,10 +34,8 @@ XMLHandler::XMLHandler(boost::shared_ptr<model::ExposedModel> model)
 
 bool XMLHandler::updateState(const char *buffer, const size_t doc_len)
 {
-   xmlDocPtr doc = NULL;
    try {
-      doc = m_xmlTransporter.readXMLfromBuffer(buffer, doc_len);
-      m_xmlReader.parseDocument(doc, m_elementHandler);
+      m_xmlStreamReader.parseBuffer(buffer, doc_len, m_elementHandler);
    } catch(const std::exception& e) {
       std::cerr<<"XML ERROR: \n";
       std::cerr<<std::string(buffer, doc_len)<<std::endl;
@@ -47,9 +45,6 @@ bool XMLHandler::updateState(const char *buffer, const size_t doc_len)
       std::cerr<<"UNKNOWN ERROR: \n";
       std::cerr<<std::string(buffer, doc_len)<<std::endl;
    }
-   if(doc) {
-            xmlFreeDoc(doc);
-   }
    return true;
 }
 
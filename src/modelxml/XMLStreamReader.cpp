@@ -0,0 +1,236 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/model/impl/xml/XMLStreamReader.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+
+
+namespace tinia {
+namespace model {
+namespace impl {
+namespace xml {
+
+
+    XMLStreamReader::XMLStreamReader()
+        : m_ctxt(NULL),
+          m_depth(0),
+          m_stateDepth(-1),
+          m_pendingCount(0)
+    {
+        std::memset(&m_sax, 0, sizeof(m_sax));
+        m_sax.initialized    = XML_SAX2_MAGIC;
+        m_sax.startElementNs = &XMLStreamReader::startElementNs;
+        m_sax.endElementNs   = &XMLStreamReader::endElementNs;
+        m_sax.characters     = &XMLStreamReader::characters;
+        m_sax.cdataBlock     = &XMLStreamReader::characters;
+        m_sax.serror         = &XMLStreamReader::structuredError;
+    }
+
+
+
+
+    XMLStreamReader::~XMLStreamReader()
+    {
+        if (m_ctxt!=NULL)
+            xmlFreeParserCtxt(m_ctxt);
+    }
+
+
+
+
+    std::vector<std::string> XMLStreamReader::parseBuffer(const char* buffer,
+                                                          const size_t length,
+                                                          ElementHandler &elementHandler)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        if (m_ctxt==NULL) {
+            // The callbacks get the context as user data, and find us in _private.
+            m_ctxt = xmlCreatePushParserCtxt(&m_sax, NULL, NULL, 0, "noname.xml");
+            if (m_ctxt==NULL)
+                throw std::runtime_error("Could not create xml push parser.");
+            m_ctxt->_private = this;
+            xmlCtxtUseOptions(m_ctxt, XML_PARSE_NONET);
+        } else {
+            xmlCtxtResetPush(m_ctxt, NULL, 0, "noname.xml", NULL);
+        }
+
+        m_depth        = 0;
+        m_stateDepth   = -1;
+        m_pendingCount = 0;
+        m_open.clear();
+        m_error.clear();
+
+        const int r = xmlParseChunk(m_ctxt, buffer, static_cast<int>(length), 1);
+        if ( (r!=0) || (!m_ctxt->wellFormed) ) {
+            throw std::runtime_error("Could not parse buffer: " +
+                                     (m_error.empty() ? std::string("not well-formed.") : m_error));
+        }
+
+        std::vector<std::string> updatedKeys;
+        apply(elementHandler, updatedKeys);
+        return updatedKeys;
+    }
+
+
+
+
+    void XMLStreamReader::apply(ElementHandler &elementHandler, std::vector<std::string>& updatedKeys)
+    {
+        typedef model::ExposedModel::ElementUpdate ElementUpdate;
+        m_updates.clear();
+        for (size_t i=0; i<m_pendingCount; i++) {
+            const PendingUpdate& update = m_pending[i];
+            const Node& element = update.nodes[0];
+
+            // A simple type without a value is ignored, as with XMLReader.
+            if ( (!element.hasChildren) && (element.value.empty()) )
+                continue;
+
+            m_updates.push_back(ElementUpdate());
+            ElementUpdate& out = m_updates.back();
+            out.key = element.name;
+
+            if (!element.hasChildren) {
+                out.kind  = ElementUpdate::VALUE;
+                out.value = element.value;
+            }
+            else if (update.maxDepth==2) {
+                // A complex type with one level of fields, e.g. a Viewer.
+                out.kind = ElementUpdate::FIELDS;
+                for (size_t j=1; j<update.nodes.size(); j++) {
+                    if (!update.nodes[j].value.empty())
+                        out.fields.push_back(std::make_pair(update.nodes[j].name, update.nodes[j].value));
+                }
+            }
+            else {
+                // Deeper complex types are given to the model as a ptree, rooted at the element.
+                out.kind = ElementUpdate::TREE;
+                model::StringStringPTree& tree = out.tree;
+                std::vector<model::StringStringPTree*> parents(1, &tree);
+                for (size_t j=0; j<update.nodes.size(); j++) {
+                    const Node& node = update.nodes[j];
+                    parents.resize(node.depth);
+                    if (node.hasChildren) {
+                        model::StringStringPTree::iterator it =
+                                parents.back()->push_back(std::make_pair(node.name,
+                                                          model::StringStringPTree("contains fields on the level below, no value here")));
+                        parents.push_back(&it->second);
+                    }
+                    else if (!node.value.empty()) {
+                        parents.back()->push_back(std::make_pair(node.name, model::StringStringPTree(node.value)));
+                    }
+                }
+            }
+        }
+
+        elementHandler.updateElements(m_updates);
+        for (size_t i=0; i<m_updates.size(); i++)
+            updatedKeys.push_back(m_updates[i].key);
+    }
+
+
+
+
+    void XMLStreamReader::startElementNs(void* ctx, const xmlChar* localname, const xmlChar*,
+                                         const xmlChar*, int, const xmlChar**,
+                                         int, int, const xmlChar**)
+    {
+        XMLStreamReader* self = static_cast<XMLStreamReader*>(static_cast<xmlParserCtxtPtr>(ctx)->_private);
+        self->m_depth++;
+
+        if (self->m_stateDepth==-1) {
+            if (xmlStrEqual(localname, BAD_CAST "State"))
+                self->m_stateDepth = self->m_depth;
+            return;
+        }
+        if (self->m_stateDepth<0)
+            return;
+
+        const int depth = self->m_depth - self->m_stateDepth;
+        if (depth==1) {
+            if (self->m_pending.size()==self->m_pendingCount)
+                self->m_pending.push_back(PendingUpdate());
+            PendingUpdate& update = self->m_pending[self->m_pendingCount++];
+            update.nodes.resize(1);
+            update.maxDepth = 1;
+            self->m_open.clear();
+        }
+        else {
+            PendingUpdate& update = self->m_pending[self->m_pendingCount-1];
+            update.nodes[self->m_open.back()].hasChildren = true;
+            update.nodes.resize(update.nodes.size()+1);
+            update.maxDepth = std::max(update.maxDepth, depth);
+        }
+
+        PendingUpdate& update = self->m_pending[self->m_pendingCount-1];
+        Node& node       = update.nodes.back();
+        node.depth       = depth;
+        node.name.assign(reinterpret_cast<const char*>(localname));
+        node.value.clear();
+        node.hasChildren = false;
+        self->m_open.push_back(update.nodes.size()-1);
+    }
+
+
+
+
+    void XMLStreamReader::endElementNs(void* ctx, const xmlChar*, const xmlChar*, const xmlChar*)
+    {
+        XMLStreamReader* self = static_cast<XMLStreamReader*>(static_cast<xmlParserCtxtPtr>(ctx)->_private);
+
+        if (self->m_depth==self->m_stateDepth)
+            self->m_stateDepth = -2; // Only the first State-section is read.
+        else if ( (self->m_stateDepth>=0) && (self->m_depth>self->m_stateDepth) )
+            self->m_open.pop_back();
+        self->m_depth--;
+    }
+
+
+
+
+    void XMLStreamReader::characters(void* ctx, const xmlChar* ch, int len)
+    {
+        XMLStreamReader* self = static_cast<XMLStreamReader*>(static_cast<xmlParserCtxtPtr>(ctx)->_private);
+        if ( (self->m_stateDepth<0) || (self->m_open.empty()) )
+            return;
+        // Text between the children of a complex type ends up here too, but is ignored in apply().
+        self->m_pending[self->m_pendingCount-1].nodes[self->m_open.back()].value.append(
+                    reinterpret_cast<const char*>(ch), len);
+    }
+
+
+
+
+    void XMLStreamReader::structuredError(void* ctx, xmlErrorPtr error)
+    {
+        XMLStreamReader* self = static_cast<XMLStreamReader*>(static_cast<xmlParserCtxtPtr>(ctx)->_private);
+        if ( (self->m_error.empty()) && (error!=NULL) && (error->message!=NULL) )
+            self->m_error = error->message;
+    }
+
+
+
+
+}
+}
+}
+}
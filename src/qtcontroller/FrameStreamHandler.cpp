@@ -0,0 +1,180 @@
+#include "tinia/qtcontroller/moc/FrameStreamHandler.hpp"
+#include "tinia/qtcontroller/moc/HTTPServer.hpp"
+#include "tinia/qtcontroller/moc/HTTPConnection.hpp"
+#include "tinia/qtcontroller/impl/ServerThread.hpp"
+#include "tinia/qtcontroller/impl/http_utils.hpp"
+#include <QMetaObject>
+#include <algorithm>
+#include <iostream>
+
+namespace {
+
+// As TRELL_STREAM_BOUNDARY, TRELL_STREAM_DEFAULT_FPS and TRELL_STREAM_MAX_FPS
+// in tinia/trell/trell.h, so that both servers stream alike.
+const char* streamBoundary = "tiniaframe";
+const int defaultFps = 30;
+const int maxFps = 60;
+
+/** Time between checks of a stream whose last frame is not yet written out. */
+const int backpressureMilliseconds = 5;
+
+}
+
+namespace tinia {
+namespace qtcontroller {
+namespace impl {
+
+FrameStreamHandler::FrameStreamHandler(OpenGLServerGrabber* grabber,
+                                       Invoker* mainthread_invoker,
+                                       tinia::jobcontroller::Job* job,
+                                       QThreadPool* workers,
+                                       HTTPServer* server) :
+    QObject(server), m_grabber(grabber), m_mainthread_invoker(mainthread_invoker),
+    m_job(job), m_workers(workers), m_server(server), m_wakePending(0)
+{
+    m_job->getExposedModel()->addStateListener(this);
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(wake()));
+}
+
+FrameStreamHandler::~FrameStreamHandler()
+{
+    m_job->getExposedModel()->removeStateListener(this);
+}
+
+void FrameStreamHandler::addStream(qulonglong connection, qulonglong sequence,
+                                   const QString& request)
+{
+    const QMap<QString, QString> params = decodeGetParameters(request);
+    try {
+        parseGet<boost::tuple<std::string, unsigned int, unsigned int> >(params, "key width height");
+    } catch(std::invalid_argument& e) {
+        m_server->deliverResponse(connection, sequence,
+                                  (httpHeader("text/plain", 400) + "\r\n" + e.what() + "\n").toUtf8());
+        return;
+    }
+    int fps = defaultFps;
+    if(params.contains("max_fps")) {
+        fps = std::max(1, std::min(maxFps, params["max_fps"].toInt()));
+    }
+
+    // Each frame is the request line of a snapshot, without the headers.
+    QString line = request.left(request.indexOf("\r\n"));
+    line.replace("/snapshot_stream.", "/snapshot.");
+
+    Stream stream;
+    stream.sequence = sequence;
+    stream.request = (line + "\r\n\r\n").toUtf8();
+    stream.mime = getMimeType(getRequestURI(line));
+    stream.busy = false;
+    stream.started = false;
+    stream.revision = 0;
+    stream.renderRevision = 0;
+    stream.interval = 1000 / fps;
+    m_streams.insert(connection, stream);
+    wake();
+}
+
+void FrameStreamHandler::cancel(qulonglong connection)
+{
+    m_streams.remove(connection);
+}
+
+void FrameStreamHandler::stateElementModified(model::StateElement *stateElement)
+{
+    // One wake-up is enough for any number of changes.
+    if(m_wakePending.testAndSetOrdered(0, 1)) {
+        QMetaObject::invokeMethod(this, "wake", Qt::QueuedConnection);
+    }
+}
+
+int FrameStreamHandler::due(qulonglong connection, const Stream& stream, unsigned int revision) const
+{
+    if(stream.busy || (stream.started && stream.revision == revision)) {
+        return -1;
+    }
+    if(stream.started) {
+        HTTPConnection* c = m_server->connection(connection);
+        if(c != NULL && c->bytesToWrite() > 0) {
+            return backpressureMilliseconds;
+        }
+        const int elapsed = stream.last.elapsed();
+        if(elapsed < stream.interval) {
+            return stream.interval - elapsed;
+        }
+    }
+    return 0;
+}
+
+void FrameStreamHandler::wake()
+{
+    m_wakePending.fetchAndStoreOrdered(0);
+    const unsigned int revision = m_job->getExposedModel()->getRevisionNumber();
+    int next = -1;
+    for(QHash<qulonglong, Stream>::iterator it = m_streams.begin(); it != m_streams.end(); ++it) {
+        Stream& stream = it.value();
+        const int wait = due(it.key(), stream, revision);
+        if(wait == 0) {
+            stream.busy = true;
+            stream.renderRevision = revision;
+            stream.last.start();
+            m_workers->start(new ServerThread(m_grabber, m_mainthread_invoker, m_job, this,
+                                              it.key(), stream.sequence, stream.request));
+        }
+        else if(wait > 0) {
+            next = next < 0 ? wait : std::min(next, wait);
+        }
+    }
+    if(next >= 0 && (!m_timer.isActive() || next < m_timer.interval())) {
+        m_timer.start(next);
+    }
+}
+
+void FrameStreamHandler::deliverResponse(qulonglong connection, qulonglong sequence,
+                                         QByteArray response)
+{
+    QHash<qulonglong, Stream>::iterator it = m_streams.find(connection);
+    HTTPConnection* c = m_server->connection(connection);
+    if(it == m_streams.end() || c == NULL) {
+        return;
+    }
+    Stream& stream = it.value();
+    stream.busy = false;
+
+    const int headerEnd = response.indexOf("\r\n\r\n");
+    const bool ok = headerEnd >= 0 && response.startsWith("HTTP/1.1 200");
+    if(!ok) {
+        if(!stream.started) {
+            // Answered as the snapshot would have been, e.g., 400 for an unknown key.
+            m_streams.erase(it);
+            c->respond(sequence, response);
+        }
+        else {
+            std::cerr << "FrameStreamHandler: frame failed, closing the stream." << std::endl;
+            m_streams.erase(it);
+            QMetaObject::invokeMethod(c, "closeConnection", Qt::QueuedConnection);
+        }
+        return;
+    }
+    if(!stream.started) {
+        c->startStream(sequence, (binaryHeader(QString("multipart/x-mixed-replace; boundary=") + streamBoundary)
+                                  + "Cache-Control: no-cache\r\n").toUtf8());
+        stream.started = true;
+    }
+    const QByteArray body = response.mid(headerEnd + 4);
+    QByteArray part;
+    part.reserve(body.size() + 200);
+    part += QByteArray("--") + streamBoundary + "\r\n";
+    part += "Content-Type: " + stream.mime.toUtf8() + "\r\n";
+    part += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    part += "X-Tinia-Revision: " + QByteArray::number(stream.renderRevision) + "\r\n\r\n";
+    part += body;
+    part += "\r\n";
+    c->writeStreamPart(part);
+    stream.revision = stream.renderRevision;
+    wake();
+}
+
+} // namespace impl
+} // namespace qtcontroller
+} // namespace tinia
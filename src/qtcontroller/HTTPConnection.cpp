@@ -0,0 +1,201 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/qtcontroller/moc/HTTPConnection.hpp"
+#include "tinia/qtcontroller/moc/HTTPServer.hpp"
+#include "tinia/qtcontroller/impl/http_utils.hpp"
+
+namespace {
+/** Connections without outstanding requests are closed after this long. */
+const int idleTimeoutMs = 60000;
+
+/** Requests whose header does not fit in this are refused. */
+const int maxHeaderSize = 64 * 1024;
+
+/** Requests with a longer body (Content-Length) are refused. */
+const int maxBodySize = 16 * 1024 * 1024;
+}
+
+namespace tinia {
+namespace qtcontroller {
+namespace impl {
+
+HTTPConnection::HTTPConnection( int socket, qulonglong id, HTTPServer* server )
+    : QObject( server ),
+      m_server( server ),
+      m_socket( new QTcpSocket( this ) ),
+      m_id( id ),
+      m_nextSequence( 0 ),
+      m_nextResponse( 0 ),
+      m_closing( false ),
+      m_stream( false ),
+      m_streaming( false ),
+      m_upgrade( false ),
+      m_streamSequence( 0 )
+{
+    m_socket->setSocketDescriptor( socket );
+    connect( m_socket, SIGNAL( readyRead() ), this, SLOT( readRequests() ) );
+    connect( m_socket, SIGNAL( disconnected() ), this, SLOT( closeConnection() ) );
+
+    m_idleTimer.setSingleShot( true );
+    m_idleTimer.setInterval( idleTimeoutMs );
+    connect( &m_idleTimer, SIGNAL( timeout() ), this, SLOT( closeConnection() ) );
+    m_idleTimer.start();
+
+    // Data may have arrived before we connected to readyRead.
+    readRequests();
+}
+
+void
+HTTPConnection::readRequests()
+{
+    if( m_streaming && m_upgrade ) {
+        m_server->upgradedData( this, m_socket->readAll() );
+        return;
+    }
+    if( m_closing ) {
+        return;
+    }
+    m_input += m_socket->readAll();
+
+    int length = 0;
+    while( !m_closing && ( length = requestLength( m_input, maxHeaderSize, maxBodySize ) ) > 0 ) {
+        QByteArray request = m_input.left( length );
+        m_input.remove( 0, length );
+
+        const qulonglong sequence = m_nextSequence++;
+        const bool keepAlive = isKeepAlive( request );
+        m_keepAlive[ sequence ] = keepAlive;
+        m_closing = !keepAlive;
+        m_idleTimer.stop();
+
+        m_server->dispatch( this, sequence, request );
+    }
+
+    if( !m_closing && length < 0 ) {
+        // The request is not read, so the connection can't be reused.
+        m_closing = true;
+        m_input.clear();
+        m_keepAlive[ m_nextSequence ] = false;
+        respond( m_nextSequence++, QByteArray( "HTTP/1.1 413 Request Entity Too Large\r\n" ) );
+    }
+}
+
+void
+HTTPConnection::respond( qulonglong sequence, const QByteArray& response )
+{
+    m_responses[ sequence ] = response;
+    writeResponses();
+}
+
+void
+HTTPConnection::startStream( qulonglong sequence, const QByteArray& header )
+{
+    // Requests after this one would never be answered.
+    m_closing = true;
+    m_stream = true;
+    m_streamSequence = sequence;
+    m_responses[ sequence ] = header;
+    writeResponses();
+}
+
+void
+HTTPConnection::upgrade( qulonglong sequence, const QByteArray& response )
+{
+    m_upgrade = true;
+    startStream( sequence, response );
+}
+
+void
+HTTPConnection::writeStreamPart( const QByteArray& part )
+{
+    if( !m_streaming ) {
+        m_streamPending += part;
+    }
+    else if( m_socket->state() == QAbstractSocket::ConnectedState ) {
+        m_socket->write( part );
+    }
+}
+
+qint64
+HTTPConnection::bytesToWrite() const
+{
+    return m_socket->bytesToWrite() + m_streamPending.size();
+}
+
+void
+HTTPConnection::writeResponses()
+{
+    if( m_streaming ) {
+        // Responses to requests pipelined after the stream are never written.
+        return;
+    }
+    while( m_responses.contains( m_nextResponse ) ) {
+        if( m_stream && m_nextResponse == m_streamSequence ) {
+            if( m_upgrade ) {
+                m_socket->write( m_responses.take( m_nextResponse++ ) );
+            }
+            else {
+                // No Content-Length, the stream ends when the connection does.
+                m_socket->write( m_responses.take( m_nextResponse++ ).trimmed() + "\r\nConnection: close\r\n\r\n" );
+            }
+            m_socket->write( m_streamPending );
+            m_streamPending.clear();
+            m_streaming = true;
+            if( m_upgrade ) {
+                // What the client sent after the request, and while we waited.
+                m_input += m_socket->readAll();
+                if( !m_input.isEmpty() ) {
+                    QByteArray input;
+                    input.swap( m_input );
+                    m_server->upgradedData( this, input );
+                }
+            }
+            return;
+        }
+        const bool keepAlive = m_keepAlive.take( m_nextResponse );
+        m_socket->write( finishResponse( m_responses.take( m_nextResponse ), keepAlive ) );
+        m_nextResponse++;
+        if( !keepAlive ) {
+            // Pending data is written before the connection is closed.
+            m_socket->disconnectFromHost();
+            return;
+        }
+    }
+    if( m_nextResponse == m_nextSequence ) {
+        m_idleTimer.start();
+    }
+}
+
+void
+HTTPConnection::closeConnection()
+{
+    m_idleTimer.stop();
+    m_closing = true;
+    if( m_socket->state() != QAbstractSocket::UnconnectedState ) {
+        // Emits disconnected(), which brings us back here.
+        m_socket->disconnectFromHost();
+        return;
+    }
+    m_server->connectionClosed( this );
+    deleteLater();
+}
+
+} // namespace impl
+} // namespace qtcontroller
+} // namespace tinia
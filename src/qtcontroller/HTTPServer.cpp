@@ -21,7 +21,10 @@
 #include <QByteArray>
 #include <GL/glew.h>
 #include "tinia/qtcontroller/moc/HTTPServer.hpp"
+#include "tinia/qtcontroller/moc/HTTPConnection.hpp"
 #include "tinia/qtcontroller/moc/LongPollHandler.hpp"
+#include "tinia/qtcontroller/moc/FrameStreamHandler.hpp"
+#include "tinia/qtcontroller/moc/ModelChannelHandler.hpp"
 #include "tinia/qtcontroller/impl/ServerThread.hpp"
 #include "tinia/qtcontroller/impl/http_utils.hpp"
 #include "tinia/renderlist.hpp"
@@ -34,31 +37,113 @@
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/tuple/tuple_io.hpp>
 #include <QThreadPool>
+#include <QThread>
+#include <QCoreApplication>
+#include <algorithm>
+#include <cstdlib>
 
 namespace tinia {
 namespace qtcontroller {
 namespace impl {
 
 HTTPServer::HTTPServer( tinia::jobcontroller::Job* job,
-                        QObject *parent)
+                        QObject *parent, quint16 port)
     : QTcpServer(parent),
       m_job(job),
       m_serverGrabber( new OpenGLServerGrabber( this ) ),
-      m_mainthread_invoker( new Invoker( this ) )
+      m_mainthread_invoker( new Invoker( this ) ),
+      m_longPollHandler( NULL ),
+      m_frameStreamHandler( NULL ),
+      m_modelChannelHandler( NULL ),
+      m_nextConnectionId( 0 )
 {
-    listen(QHostAddress::Any, 8080);
+    int workers = QThread::idealThreadCount();
+    const char* workers_env = getenv( "TINIA_HTTP_WORKERS" );
+    if( workers_env != NULL && atoi( workers_env ) > 0 ) {
+        workers = atoi( workers_env );
+    }
+    m_workers.setMaxThreadCount( std::max( workers, 2 ) );
+
+    m_longPollHandler = new LongPollHandler( m_job->getExposedModel(), &m_workers, this );
+    m_frameStreamHandler = new FrameStreamHandler( m_serverGrabber, m_mainthread_invoker,
+                                                   m_job, &m_workers, this );
+    m_modelChannelHandler = new ModelChannelHandler( m_job->getExposedModel(), &m_workers, this );
+    m_serverGrabber->setExposedModel( m_job->getExposedModel() );
+    listen(QHostAddress::Any, port);
+}
+
+HTTPServer::~HTTPServer()
+{
+    close();
+    // The workers may be waiting for the main thread (Invoker), so keep
+    // processing events until they are done.
+    while( !m_workers.waitForDone( 10 ) ) {
+        QCoreApplication::processEvents();
+    }
 }
 
 void HTTPServer::incomingConnection(int socket)
 {
-    ServerThread* thread = new ServerThread( m_serverGrabber,
-                                             m_mainthread_invoker,
-                                             m_job,
-                                             socket );
+    HTTPConnection* connection = new HTTPConnection( socket, m_nextConnectionId++, this );
+    m_connections.insert( connection->id(), connection );
+}
+
+void HTTPServer::dispatch( HTTPConnection* connection, qulonglong sequence,
+                           const QByteArray& request )
+{
+    if( isGetOrPost( request ) && getRequestURI( request ) == "/getExposedModelUpdate.xml" ) {
+        m_longPollHandler->addLongPoll( connection->id(), sequence, request );
+    }
+    else if( isGetOrPost( request ) &&
+             ( getRequestURI( request ) == "/snapshot_stream.png" ||
+               getRequestURI( request ) == "/snapshot_stream.jpg" ) )
+    {
+        m_frameStreamHandler->addStream( connection->id(), sequence, request );
+    }
+    else if( isGetOrPost( request ) && getRequestURI( request ) == "/model_channel" ) {
+        m_modelChannelHandler->addChannel( connection->id(), sequence, request );
+    }
+    else {
+        m_workers.start( new ServerThread( m_serverGrabber,
+                                           m_mainthread_invoker,
+                                           m_job,
+                                           this,
+                                           connection->id(),
+                                           sequence,
+                                           request ) );
+    }
+}
+
+void HTTPServer::connectionClosed( HTTPConnection* connection )
+{
+    m_connections.remove( connection->id() );
+    m_longPollHandler->cancel( connection->id() );
+    m_frameStreamHandler->cancel( connection->id() );
+    m_modelChannelHandler->cancel( connection->id() );
+}
+
+bool HTTPServer::hasConnection( qulonglong connection ) const
+{
+    return m_connections.contains( connection );
+}
+
+void HTTPServer::upgradedData( HTTPConnection* connection, const QByteArray& data )
+{
+    m_modelChannelHandler->receive( connection->id(), data );
+}
 
-    //connect(thread, SIGNAL(finished()), thread, SLOT(deleteLater()));
+HTTPConnection* HTTPServer::connection( qulonglong connection ) const
+{
+    return m_connections.value( connection, NULL );
+}
 
-    QThreadPool::globalInstance()->start(thread);
+void HTTPServer::deliverResponse( qulonglong connection, qulonglong sequence,
+                                  QByteArray response )
+{
+    HTTPConnection* c = m_connections.value( connection, NULL );
+    if( c != NULL ) {
+        c->respond( sequence, response );
+    }
 }
 
 }
@@ -0,0 +1,194 @@
+#include "tinia/qtcontroller/impl/ImageEncoder.hpp"
+#include <QImage>
+#include <QBuffer>
+#include <QTransform>
+#include <QMutexLocker>
+#include <QRunnable>
+
+namespace tinia {
+namespace qtcontroller {
+namespace impl {
+
+struct ImagePool::Releaser
+{
+    boost::shared_ptr<ImagePool> m_pool;
+
+    void operator()( GrabbedImage* image )
+    {
+        m_pool->release( image );
+    }
+};
+
+boost::shared_ptr<ImagePool> ImagePool::create( size_t maxFree )
+{
+    boost::shared_ptr<ImagePool> pool( new ImagePool( maxFree ) );
+    pool->m_self = pool;
+    return pool;
+}
+
+ImagePool::ImagePool( size_t maxFree )
+    : m_maxFree( maxFree )
+{
+}
+
+ImagePool::~ImagePool()
+{
+    for( size_t i=0; i<m_free.size(); i++ ) {
+        delete m_free[i];
+    }
+}
+
+GrabbedImagePtr ImagePool::acquire( size_t bytes )
+{
+    GrabbedImage* image = NULL;
+    {
+        QMutexLocker locker( &m_mutex );
+        if( !m_free.empty() ) {
+            image = m_free.back();
+            m_free.pop_back();
+        }
+    }
+    if( image == NULL ) {
+        image = new GrabbedImage;
+    }
+    // Keeps the capacity of a recycled image, so this only allocates if it grows.
+    image->pixels.resize( bytes );
+    image->width = 0;
+    image->height = 0;
+
+    // The releaser keeps the pool alive as long as any of its images are.
+    Releaser releaser = { m_self.lock() };
+    return GrabbedImagePtr( image, releaser );
+}
+
+size_t ImagePool::freeCount()
+{
+    QMutexLocker locker( &m_mutex );
+    return m_free.size();
+}
+
+void ImagePool::release( GrabbedImage* image )
+{
+    {
+        QMutexLocker locker( &m_mutex );
+        if( m_free.size() < m_maxFree ) {
+            m_free.push_back( image );
+            return;
+        }
+    }
+    delete image;
+}
+
+
+QByteArray encodeImage( const GrabbedImage& image,
+                        unsigned int width,
+                        unsigned int height,
+                        bool png,
+                        int jpg_quality )
+{
+    QImage img( &image.pixels[0],
+                image.width,
+                image.height,
+                QImage::Format_RGB888 );
+    // This is a temporary fix. The image is reflected through the horizontal
+    // line y=height ((x, y) |--> (x, h-y) ).
+    QTransform flipTransformation(1, 0,
+                                  0, -1,
+                                  0, image.height);
+    img = img.transformed(flipTransformation);
+    if ( (width!=image.width) || (height!=image.height) ) {
+        img = img.scaled(width, height); // Should ignore aspect ratio, and do no (bi-)linear filtering, according to the man pages.
+    }
+    QBuffer qBuffer;
+    if (png) {
+        img.save(&qBuffer, "png");
+    } else {
+        img.save(&qBuffer, "jpg", jpg_quality);
+    }
+    return qBuffer.data();
+}
+
+
+class ImageEncoder::Task : public QRunnable
+{
+public:
+    Task( ImageEncoder* encoder, int index, GrabbedImagePtr image,
+          unsigned int width, unsigned int height, bool png, int jpg_quality )
+        : m_encoder( encoder ),
+          m_index( index ),
+          m_image( image ),
+          m_width( width ),
+          m_height( height ),
+          m_png( png ),
+          m_jpg_quality( jpg_quality )
+    {
+    }
+
+    void run()
+    {
+        QByteArray encoded = encodeImage( *m_image, m_width, m_height, m_png, m_jpg_quality );
+        // Give the buffer back to the pool before waking the waiting thread.
+        m_image.reset();
+        m_encoder->finished( m_index, encoded );
+    }
+
+private:
+    ImageEncoder*   m_encoder;
+    int             m_index;
+    GrabbedImagePtr m_image;
+    unsigned int    m_width;
+    unsigned int    m_height;
+    bool            m_png;
+    int             m_jpg_quality;
+};
+
+ImageEncoder::ImageEncoder( QThreadPool* pool )
+    : m_pool( pool ),
+      m_pending( 0 )
+{
+}
+
+ImageEncoder::~ImageEncoder()
+{
+    QMutexLocker locker( &m_mutex );
+    while( m_pending > 0 ) {
+        m_finished.wait( &m_mutex );
+    }
+}
+
+int ImageEncoder::add( GrabbedImagePtr image, unsigned int width, unsigned int height,
+                       bool png, int jpg_quality )
+{
+    int index;
+    {
+        QMutexLocker locker( &m_mutex );
+        index = m_results.size();
+        m_results.append( QByteArray() );
+        m_done.append( false );
+        m_pending++;
+    }
+    m_pool->start( new Task( this, index, image, width, height, png, jpg_quality ) );
+    return index;
+}
+
+QByteArray ImageEncoder::result( int index )
+{
+    QMutexLocker locker( &m_mutex );
+    while( !m_done[index] ) {
+        m_finished.wait( &m_mutex );
+    }
+    return m_results[index];
+}
+
+void ImageEncoder::finished( int index, const QByteArray& encoded )
+{
+    QMutexLocker locker( &m_mutex );
+    m_results[index] = encoded;
+    m_done[index] = true;
+    m_pending--;
+    m_finished.wakeAll();
+}
+
+} // namespace impl
+} // namespace qtcontroller
+} // namespace tinia
@@ -34,6 +34,41 @@ Invoker::invokeInMainThread( QRunnable* function, bool block )
 }
 
 
+namespace {
+
+class InvocationBatch : public QRunnable
+{
+public:
+    explicit InvocationBatch( const std::vector<QRunnable*>& functions )
+        : m_functions( functions )
+    {
+    }
+
+    void
+    run()
+    {
+        for( size_t i=0; i<m_functions.size(); i++ ) {
+            m_functions[i]->run();
+        }
+    }
+
+private:
+    const std::vector<QRunnable*>&  m_functions;
+};
+
+}
+
+void
+Invoker::invokeInMainThread( const std::vector<QRunnable*>& functions )
+{
+    if( functions.empty() ) {
+        return;
+    }
+    InvocationBatch batch( functions );
+    invokeInMainThread( &batch, true );
+}
+
+
 void
 Invoker::handleMainThreadInvocation( QRunnable* function, bool* i_am_done )
 {
@@ -1,18 +1,92 @@
 #include "tinia/qtcontroller/moc/LongPollHandler.hpp"
+#include "tinia/qtcontroller/moc/HTTPServer.hpp"
 #include "tinia/qtcontroller/impl/http_utils.hpp"
-#include <QDate>
+#include <tinia/model/impl/xml/XMLHandler.hpp>
+#include <QRunnable>
+#include <QBuffer>
+#include <QTextStream>
+#include <QMetaObject>
+#include <vector>
+
+namespace {
+
+/** Time a long-poll waits for an update before it is answered with 408. */
+const int longPollTimeoutSeconds = 500;
+
+/** Size of the buffer an update is written into. */
+const size_t updateBufferSize = 100000;
+
+/** Looks for an update for one long-poll, in the worker pool. */
+class LongPollCheck : public QRunnable
+{
+public:
+    LongPollCheck( QObject* handler,
+                   boost::shared_ptr<tinia::model::ExposedModel> model,
+                   boost::shared_ptr<tinia::qtcontroller::impl::LongPollHandler::Buffer> buffer,
+                   qulonglong connection, qulonglong sequence, uint revision,
+                   const QDateTime& deadline, int generation )
+        : m_handler( handler ), m_model( model ), m_buffer( buffer ),
+          m_connection( connection ), m_sequence( sequence ), m_revision( revision ),
+          m_deadline( deadline ), m_generation( generation )
+    {
+    }
+
+    void run()
+    {
+        using namespace tinia::qtcontroller::impl;
+
+        QBuffer response;
+        response.open( QIODevice::WriteOnly );
+        {
+            QMutexLocker lock( &m_buffer->mutex );
+            std::vector<char>& buffer = m_buffer->data;
+            if( buffer.empty() ) {
+                buffer.resize( updateBufferSize );
+            }
+            tinia::model::impl::xml::XMLHandler xmlHandler( m_model );
+            size_t length = xmlHandler.getExposedModelUpdate( &buffer[0], buffer.size(), m_revision );
+            if( length > 0 ) {
+                QTextStream os( &response );
+                os << httpHeader("application/xml") << "\r\n";
+                os << QString( QByteArray( &buffer[0], int( length ) ) ) << "\n";
+            }
+        }
+        QMetaObject::invokeMethod( m_handler, "checkDone", Qt::QueuedConnection,
+                                   Q_ARG( qulonglong, m_connection ),
+                                   Q_ARG( qulonglong, m_sequence ),
+                                   Q_ARG( uint, m_revision ),
+                                   Q_ARG( QDateTime, m_deadline ),
+                                   Q_ARG( int, m_generation ),
+                                   Q_ARG( QByteArray, response.data() ) );
+    }
+
+private:
+    QObject*                                        m_handler;
+    boost::shared_ptr<tinia::model::ExposedModel>   m_model;
+    boost::shared_ptr<tinia::qtcontroller::impl::LongPollHandler::Buffer> m_buffer;
+    qulonglong                                      m_connection;
+    qulonglong                                      m_sequence;
+    uint                                            m_revision;
+    QDateTime                                       m_deadline;
+    int                                             m_generation;
+};
+
+}
 
 namespace tinia {
 namespace qtcontroller {
 namespace impl {
 
-LongPollHandler::LongPollHandler(QTextStream& os,  const QString& request,
-                                           boost::shared_ptr<tinia::model::ExposedModel> model,
-                                           QObject *parent) :
-    QObject(parent), m_request(request),
-    m_model(model), m_xmlHandler(model), m_textStream(os)
+LongPollHandler::LongPollHandler(boost::shared_ptr<tinia::model::ExposedModel> model,
+                                 QThreadPool* workers,
+                                 HTTPServer* server) :
+    QObject(server), m_model(model), m_workers(workers), m_server(server),
+    m_generation(0), m_wakePending(0)
 {
     m_model->addStateListener(this);
+    m_expireTimer.setInterval(1000);
+    connect(&m_expireTimer, SIGNAL(timeout()), this, SLOT(expire()));
+    m_expireTimer.start();
 }
 
 LongPollHandler::~LongPollHandler()
@@ -20,46 +94,102 @@ LongPollHandler::~LongPollHandler()
     m_model->removeStateListener(this);
 }
 
-void LongPollHandler::handle()
+void LongPollHandler::addLongPoll(qulonglong connection, qulonglong sequence,
+                                  const QString& request)
 {
-    unsigned int revision = 0;
+    Poll poll;
+    poll.connection = connection;
+    poll.sequence = sequence;
+    poll.revision = 0;
+    poll.deadline = QDateTime::currentDateTime().addSecs(longPollTimeoutSeconds);
     try {
-        QMap<QString, QString> args = decodeGetParameters(m_request);
-        boost::tuple<unsigned int> params = parseGet<boost::tuple<unsigned int> >(decodeGetParameters(m_request), "revision");
-        revision = params.get<0>();
+        boost::tuple<unsigned int> params = parseGet<boost::tuple<unsigned int> >(decodeGetParameters(request), "revision");
+        poll.revision = params.get<0>();
     } catch(std::invalid_argument&) {
         // Don't have to do anything;
     }
+    check(poll);
+}
 
-    if(!addExposedModelUpdate(m_textStream, revision)) {
-        // Add http-timeout
-        m_mutex.lock();
-        m_waitCondition.wait(&m_mutex, 500000);
-        m_mutex.unlock();
-		if(!addExposedModelUpdate(m_textStream, revision)) {
-			m_textStream << httpHeader("text/plain", 408);
-		}
+void LongPollHandler::cancel(qulonglong connection)
+{
+    for(int i = m_parked.size() - 1; i >= 0; --i) {
+        if(m_parked[i].connection == connection) {
+            m_parked.removeAt(i);
+        }
     }
+    // A check that is running keeps the buffer until it is done.
+    m_buffers.remove(connection);
 }
 
 void LongPollHandler::stateElementModified(model::StateElement *stateElement)
 {
-    m_mutex.lock();
-    m_waitCondition.wakeAll();
-    m_mutex.unlock();
+    m_generation.ref();
+    // One wake-up is enough for any number of changes.
+    if(m_wakePending.testAndSetOrdered(0, 1)) {
+        QMetaObject::invokeMethod(this, "wake", Qt::QueuedConnection);
+    }
+}
+
+void LongPollHandler::check(const Poll& poll)
+{
+    m_workers->start(new LongPollCheck(this, m_model, buffer(poll.connection),
+                                       poll.connection, poll.sequence,
+                                       poll.revision, poll.deadline, int(m_generation)));
+}
+
+boost::shared_ptr<LongPollHandler::Buffer> LongPollHandler::buffer(qulonglong connection)
+{
+    boost::shared_ptr<Buffer>& buffer = m_buffers[connection];
+    if(!buffer) {
+        buffer.reset(new Buffer);
+    }
+    return buffer;
 }
 
-bool LongPollHandler::addExposedModelUpdate(QTextStream &os, unsigned int revision)
+void LongPollHandler::checkDone(qulonglong connection, qulonglong sequence, uint revision,
+                                QDateTime deadline, int generation, QByteArray response)
 {
-    //if(num>4) return true;
-    size_t length = m_xmlHandler.getExposedModelUpdate(m_buffer, sizeof(m_buffer), revision);
-    if(length > 0) {
-        os << httpHeader("application/xml")<<"\r\n";
-        os << QString(m_buffer)<< "\n";
-        return true;
+    if(!m_server->hasConnection(connection)) {
+        return;
+    }
+    if(!response.isEmpty()) {
+        m_server->deliverResponse(connection, sequence, response);
+        return;
+    }
+    Poll poll;
+    poll.connection = connection;
+    poll.sequence = sequence;
+    poll.revision = revision;
+    poll.deadline = deadline;
+    if(generation != int(m_generation)) {
+        // The model changed while we were looking.
+        check(poll);
     }
     else {
-        return false;
+        m_parked.append(poll);
+    }
+}
+
+void LongPollHandler::wake()
+{
+    m_wakePending.fetchAndStoreOrdered(0);
+    QList<Poll> parked;
+    parked.swap(m_parked);
+    for(int i = 0; i < parked.size(); ++i) {
+        check(parked[i]);
+    }
+}
+
+void LongPollHandler::expire()
+{
+    const QDateTime now = QDateTime::currentDateTime();
+    for(int i = m_parked.size() - 1; i >= 0; --i) {
+        if(m_parked[i].deadline <= now) {
+            const Poll poll = m_parked.takeAt(i);
+            m_server->deliverResponse(poll.connection, poll.sequence,
+                                      httpHeader("text/plain", 408).toUtf8());
+        }
     }
 }
 
@@ -0,0 +1,211 @@
+#include "tinia/qtcontroller/moc/ModelChannelHandler.hpp"
+#include "tinia/qtcontroller/moc/HTTPServer.hpp"
+#include "tinia/qtcontroller/moc/HTTPConnection.hpp"
+#include "tinia/qtcontroller/impl/http_utils.hpp"
+#include <tinia/model/impl/xml/XMLHandler.hpp>
+#include <QRunnable>
+#include <QMetaObject>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+/** Applies the updates of a channel, and looks for a model update newer than
+ * the revision of the client, in the worker pool.
+ */
+class ModelChannelWork : public QRunnable
+{
+public:
+    ModelChannelWork( QObject* handler,
+                      boost::shared_ptr<tinia::model::ExposedModel> model,
+                      qulonglong connection,
+                      const QList<QPair<qulonglong, QByteArray> >& updates,
+                      bool synced, uint revision )
+        : m_handler( handler ), m_model( model ), m_connection( connection ),
+          m_updates( updates ), m_synced( synced ), m_revision( revision )
+    {
+    }
+
+    void run()
+    {
+        tinia::model::impl::xml::XMLHandler xmlHandler( m_model );
+
+        QVariantList sequences;
+        QVariantList revisions;
+        for( int i=0; i<m_updates.size(); i++ ) {
+            const QByteArray& xml = m_updates[i].second;
+            if( !xmlHandler.updateState( xml.constData(), xml.size() ) ) {
+                std::cerr << "ModelChannelHandler: Failed to apply update " << m_updates[i].first << ".\n";
+            }
+            sequences.append( m_updates[i].first );
+            revisions.append( m_model->getRevisionNumber() );
+        }
+
+        QByteArray update;
+        if( m_synced ) {
+            std::vector<char> buffer( 100000 );
+            const size_t length = xmlHandler.getExposedModelUpdate( &buffer[0], buffer.size(), m_revision );
+            update = QByteArray( &buffer[0], int( length ) );
+        }
+        QMetaObject::invokeMethod( m_handler, "workDone", Qt::QueuedConnection,
+                                   Q_ARG( qulonglong, m_connection ),
+                                   Q_ARG( QVariantList, sequences ),
+                                   Q_ARG( QVariantList, revisions ),
+                                   Q_ARG( QByteArray, update ) );
+    }
+
+private:
+    QObject*                                        m_handler;
+    boost::shared_ptr<tinia::model::ExposedModel>   m_model;
+    qulonglong                                      m_connection;
+    QList<QPair<qulonglong, QByteArray> >           m_updates;
+    bool                                            m_synced;
+    uint                                            m_revision;
+};
+
+}
+
+namespace tinia {
+namespace qtcontroller {
+namespace impl {
+
+ModelChannelHandler::ModelChannelHandler(boost::shared_ptr<tinia::model::ExposedModel> model,
+                                         QThreadPool* workers,
+                                         HTTPServer* server) :
+    QObject(server), m_model(model), m_workers(workers), m_server(server),
+    m_generation(0), m_wakePending(0)
+{
+    m_model->addStateListener(this);
+}
+
+ModelChannelHandler::~ModelChannelHandler()
+{
+    m_model->removeStateListener(this);
+}
+
+void ModelChannelHandler::addChannel(qulonglong connection, qulonglong sequence,
+                                     const QString& request)
+{
+    HTTPConnection* c = m_server->connection(connection);
+    if(c == NULL) {
+        return;
+    }
+    const QString key = getHeaderField(request, "Sec-WebSocket-Key");
+    if(getHeaderField(request, "Upgrade").toLower() != "websocket" || key.isEmpty()) {
+        c->respond(sequence, (httpHeader("text/plain", 400) + "\r\nExpected a WebSocket handshake.\n").toUtf8());
+        return;
+    }
+    Channel channel;
+    channel.synced = false;
+    channel.busy = false;
+    channel.generation = int(m_generation);
+    m_channels.insert(connection, channel);
+    const std::string response = tinia::jobcontroller::ModelChannel::handshakeResponse(key.toStdString());
+    c->upgrade(sequence, QByteArray(response.data(), int(response.size())));
+}
+
+void ModelChannelHandler::receive(qulonglong connection, const QByteArray& data)
+{
+    QHash<qulonglong, Channel>::iterator it = m_channels.find(connection);
+    if(it == m_channels.end()) {
+        return;
+    }
+    Channel& channel = it.value();
+    channel.protocol.receive(data.constData(), data.size());
+    tinia::jobcontroller::ModelChannel::Message message;
+    while(channel.protocol.next(message)) {
+        if(message.type == "sync") {
+            channel.synced = true;
+        }
+        else if(message.type == "update") {
+            channel.updates.append(qMakePair(qulonglong(message.sequence),
+                                             QByteArray(message.body.data(), int(message.body.size()))));
+        }
+    }
+    work(connection, channel);
+    flush(connection, channel);
+}
+
+void ModelChannelHandler::cancel(qulonglong connection)
+{
+    m_channels.remove(connection);
+}
+
+void ModelChannelHandler::stateElementModified(model::StateElement *stateElement)
+{
+    m_generation.ref();
+    // One wake-up is enough for any number of changes.
+    if(m_wakePending.testAndSetOrdered(0, 1)) {
+        QMetaObject::invokeMethod(this, "wake", Qt::QueuedConnection);
+    }
+}
+
+void ModelChannelHandler::work(qulonglong connection, Channel& channel)
+{
+    if(channel.busy || channel.protocol.closed()) {
+        return;
+    }
+    const bool changed = channel.synced && channel.generation != int(m_generation);
+    if(channel.updates.isEmpty() && !changed && !(channel.synced && channel.protocol.lastSent() == 0)) {
+        return;
+    }
+    channel.busy = true;
+    channel.generation = int(m_generation);
+    m_workers->start(new ModelChannelWork(this, m_model, connection, channel.updates,
+                                          channel.synced, channel.protocol.revision()));
+    channel.updates.clear();
+}
+
+void ModelChannelHandler::workDone(qulonglong connection, QVariantList sequences,
+                                   QVariantList revisions, QByteArray update)
+{
+    QHash<qulonglong, Channel>::iterator it = m_channels.find(connection);
+    if(it == m_channels.end()) {
+        return;
+    }
+    Channel& channel = it.value();
+    channel.busy = false;
+    for(int i = 0; i < sequences.size(); ++i) {
+        channel.protocol.send("ack", revisions[i].toUInt(),
+                              QString::number(sequences[i].toULongLong()).toStdString());
+    }
+    if(!update.isEmpty()) {
+        const std::string xml(update.constData(), update.size());
+        channel.protocol.send("model", tinia::jobcontroller::ModelChannel::revisionOf(xml), xml);
+    }
+    else if(channel.synced && channel.protocol.lastSent() == 0) {
+        // Nothing newer than the client has, tell it so it knows we are listening.
+        channel.protocol.send("model", channel.protocol.revision());
+    }
+    // The model may have changed while we were looking.
+    work(connection, channel);
+    flush(connection, channel);
+}
+
+void ModelChannelHandler::wake()
+{
+    m_wakePending.fetchAndStoreOrdered(0);
+    for(QHash<qulonglong, Channel>::iterator it = m_channels.begin(); it != m_channels.end(); ++it) {
+        work(it.key(), it.value());
+    }
+}
+
+void ModelChannelHandler::flush(qulonglong connection, Channel& channel)
+{
+    HTTPConnection* c = m_server->connection(connection);
+    if(c == NULL) {
+        return;
+    }
+    const std::string output = channel.protocol.takeOutput();
+    if(!output.empty()) {
+        c->writeStreamPart(QByteArray(output.data(), int(output.size())));
+    }
+    if(channel.protocol.closed()) {
+        m_channels.remove(connection);
+        QMetaObject::invokeMethod(c, "closeConnection", Qt::QueuedConnection);
+    }
+}
+
+} // namespace impl
+} // namespace qtcontroller
+} // namespace tinia
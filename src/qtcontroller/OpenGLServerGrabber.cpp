@@ -4,6 +4,8 @@
 #include <QBuffer>
 #include <tinia/qtcontroller/impl/http_utils.hpp>
 #include "tinia/renderlist.hpp"
+#include <QMutexLocker>
+#include <cstdlib>
 
 namespace tinia {
 namespace qtcontroller {
@@ -14,29 +16,47 @@ OpenGLServerGrabber::OpenGLServerGrabber( QObject *parent)
     : QObject(parent),
       m_buffer( NULL ),
       m_buffer_size(0),
+      m_images( ImagePool::create() ),
+      m_snapshots( tinia::jobcontroller::SnapshotCache::capacityFromEnvironment() ),
+      m_deltas( 64, tinia::jobcontroller::FrameDelta::thresholdFromEnvironment() ),
       m_openglIsReady(false),
       m_width(500),
       m_height(500)
 {
+    const char* threads_env = getenv( "TINIA_ENCODE_THREADS" );
+    if( threads_env != NULL && atoi( threads_env ) > 0 ) {
+        m_encoders.setMaxThreadCount( atoi( threads_env ) );
+    }
 }
 
 
 OpenGLServerGrabber::~OpenGLServerGrabber()
 {
+    // Stops the helper thread before the OpenGL resources go away.
+    m_refinement.reset();
     if(m_openglIsReady) {
         glDeleteFramebuffers(1, &m_fbo);
         glDeleteRenderbuffers(1, &m_renderbufferRGBA);
         glDeleteRenderbuffers(1, &m_renderbufferDepth);
     }
+    delete[] m_buffer;
 }
 
 
 void
+OpenGLServerGrabber::setExposedModel( boost::shared_ptr<tinia::model::ExposedModel> model )
+{
+    m_refinement.reset( new tinia::jobcontroller::ProgressiveRefinement( model ) );
+}
+
+
+GrabbedImagePtr
 OpenGLServerGrabber::grabRGB( jobcontroller::OpenGLJob *job,
                               unsigned int width,
                               unsigned int height,
                               const std::string& key)
 {
+    QMutexLocker locker( &m_mainMutex );
     if( !m_openglIsReady ) {
         setupOpenGL();
     }
@@ -52,20 +72,12 @@ OpenGLServerGrabber::grabRGB( jobcontroller::OpenGLJob *job,
     size_t scanline_size = 4*((3*width+3)/4);
     glPixelStorei( GL_PACK_ALIGNMENT, 4 );
 
-    // make sure that buffer is large enough to hold raw image
-//    size_t req_buffer_size = scanline_size*height*3; // Why *3 here?!
-    size_t req_buffer_size = scanline_size*height;
-    //std::cout << "rgb scanline_size=" << scanline_size << ", width=" << width << ", height=" << height << ", req_buffer_size=" << req_buffer_size << ", w*h*3=" << width*height*3 << std::endl;
-    if( (m_buffer == NULL) || (m_buffer_size < req_buffer_size) ) {
-        if( m_buffer != NULL ) {
-            delete m_buffer;
-        }
-        m_buffer_size = req_buffer_size;
-        m_buffer = new unsigned char[m_buffer_size];
-    }
+    GrabbedImagePtr image = m_images->acquire( scanline_size*height );
+    image->width = width;
+    image->height = height;
 
     glBindFramebuffer( GL_FRAMEBUFFER, m_fbo );
-    glReadPixels( 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, m_buffer );
+    glReadPixels( 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &image->pixels[0] );
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 #if 0
         static int cntr=0;
@@ -74,15 +86,16 @@ OpenGLServerGrabber::grabRGB( jobcontroller::OpenGLJob *job,
             sprintf(fname, "/tmp/qtrgb_%05d.ppm", cntr);
             FILE *fp = fopen(fname, "w");
             fprintf(fp, "P6\n%d\n%d\n255\n", width, height);
-            fwrite(m_buffer, 1, 3*width*height, fp);
+            fwrite(&image->pixels[0], 1, 3*width*height, fp);
             fclose(fp);
         }
         cntr++;
 #endif
+    return image;
 }
 
 
-void
+GrabbedImagePtr
 OpenGLServerGrabber::grabDepth( jobcontroller::OpenGLJob *job,
                                 unsigned int width,
                                 unsigned int height,
@@ -92,6 +105,7 @@ OpenGLServerGrabber::grabDepth( jobcontroller::OpenGLJob *job,
                                 const bool bi_linear_filtering, /* = false */
                                 const bool depth16 ) /* = false */
 {
+    QMutexLocker locker( &m_mainMutex );
     if( !m_openglIsReady ) {
         setupOpenGL();
     }
@@ -116,7 +130,7 @@ OpenGLServerGrabber::grabDepth( jobcontroller::OpenGLJob *job,
     // std::cout << "depth scanline_size=" << scanline_size << ", width=" << width << ", height=" << height << ", req_buffer_size=" << req_buffer_size << ", w*h*4=" << width*height*4 << std::endl;
     if( (m_buffer == NULL) || (m_buffer_size < req_buffer_size) ) {
         if( m_buffer != NULL ) {
-            delete m_buffer;
+            delete[] m_buffer;
         }
         m_buffer_size = req_buffer_size;
         m_buffer = new unsigned char[m_buffer_size];
@@ -127,10 +141,18 @@ OpenGLServerGrabber::grabDepth( jobcontroller::OpenGLJob *job,
     glBindFramebuffer( GL_FRAMEBUFFER, m_fbo );
     glReadPixels( 0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, m_buffer );
 
+    // The floats are read from m_buffer, and the encoded depth goes to the image.
+    GrabbedImagePtr image;
+    unsigned char* rgb = NULL;
+
     if ( (depth_w!=0) || (depth_h!=0) ) {
         // New "downsampling" path. We grab the full depth buffer and downsample, before passing results back to QImage construction
         // This path is triggered by the exposed model variable 'ap_use_qt_img_scaling' set to false.
         std::cout << "non-Qt-based downsampling..." << std::endl;
+        image = m_images->acquire( 4*((3*depth_w+3)/4)*depth_h );
+        image->width = depth_w;
+        image->height = depth_h;
+        rgb = &image->pixels[0];
         float *tmp_buffer = new float[depth_w*depth_h];
         const float * const m_buf = (float *)m_buffer;
 
@@ -219,45 +241,49 @@ OpenGLServerGrabber::grabDepth( jobcontroller::OpenGLJob *job,
             // Depth encoded as 24 bit fixed point values, least significant bits set to 0
             for (size_t i=0; i<depth_w*depth_h; i++) {
                 float value = tmp_buffer[i];
-                ((unsigned char *)m_buffer)[3*i+0] = (unsigned char)( floor(value*255.0) );
+                rgb[3*i+0] = (unsigned char)( floor(value*255.0) );
                 value = 255.0*value - floor(value*255.0);
-                ((unsigned char *)m_buffer)[3*i+1] = (unsigned char)( floor(value*255.0) );
-                ((unsigned char *)m_buffer)[3*i+2] = 0;
+                rgb[3*i+1] = (unsigned char)( floor(value*255.0) );
+                rgb[3*i+2] = 0;
             }
         } else {
             // Depth encoded as 24 bit fixed point values.
             for (size_t i=0; i<depth_w*depth_h; i++) {
                 float value = tmp_buffer[i];
                 for (size_t j=0; j<3; j++) {
-                    ((unsigned char *)m_buffer)[3*i+j] = (unsigned char)( floor(value*255.0) );
+                    rgb[3*i+j] = (unsigned char)( floor(value*255.0) );
                     value = 255.0*value - floor(value*255.0);
                 }
             }
         }
 
-        delete tmp_buffer;
+        delete[] tmp_buffer;
 
     } else {
         
         // Old QImage path, we grab the whole depth buffer and don't downsample here
         // The downsampling will be done after the float->rgb encoding, by QImage.scaled(), so this is a bit dangerous.
-        // However, the QImage.scaled() should just downsample without filtering, so it should work. (See ServerThread.cpp)
+        // However, the QImage.scaled() should just downsample without filtering, so it should work. (See ImageEncoder.cpp)
+        image = m_images->acquire( 4*((3*width+3)/4)*height );
+        image->width = width;
+        image->height = height;
+        rgb = &image->pixels[0];
 
         if (depth16) {
             // Depth encoded as 24 bit fixed point values, least significant bits set to 0
             for (size_t i=0; i<width*height; i++) {
                 float value = ((float *)m_buffer)[i];
-                ((unsigned char *)m_buffer)[3*i+0] = (unsigned char)( floor(value*255.0) );
+                rgb[3*i+0] = (unsigned char)( floor(value*255.0) );
                 value = 255.0*value - floor(value*255.0);
-                ((unsigned char *)m_buffer)[3*i+1] = (unsigned char)( floor(value*255.0) );
-                ((unsigned char *)m_buffer)[3*i+2] = 0;
+                rgb[3*i+1] = (unsigned char)( floor(value*255.0) );
+                rgb[3*i+2] = 0;
             }
         } else {
             // Depth encoded as 24 bit fixed point values.
             for (size_t i=0; i<width*height; i++) {
                 float value = ((float *)m_buffer)[i];
                 for (size_t j=0; j<3; j++) {
-                    ((unsigned char *)m_buffer)[3*i+j] = (unsigned char)( floor(value*255.0) );
+                    rgb[3*i+j] = (unsigned char)( floor(value*255.0) );
                     value = 255.0*value - floor(value*255.0);
                 }
             }
@@ -270,7 +296,7 @@ OpenGLServerGrabber::grabDepth( jobcontroller::OpenGLJob *job,
             sprintf(fname, "/tmp/qtdepth_%05d.ppm", cntr);
             FILE *fp = fopen(fname, "w");
             fprintf(fp, "P6\n%d\n%d\n255\n", width, height);
-            fwrite(m_buffer, 1, 3*width*height, fp);
+            fwrite(rgb, 1, 3*width*height, fp);
             fclose(fp);
         }
         cntr++;
@@ -279,6 +305,7 @@ OpenGLServerGrabber::grabDepth( jobcontroller::OpenGLJob *job,
     }
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return image;
 }
 
 
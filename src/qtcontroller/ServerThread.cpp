@@ -1,14 +1,15 @@
 #include "tinia/qtcontroller/impl/ServerThread.hpp"
-#include <QTcpSocket>
+#include <QMetaObject>
 #include "tinia/qtcontroller/impl/http_utils.hpp"
 #include "GL/glew.h"
-#include <QImage>
 #include <QBuffer>
 #include <QRegExp>
 #include "tinia/renderlist.hpp"
 #include <QFile>
-#include <QMutexLocker>
-#include "tinia/qtcontroller/moc/LongPollHandler.hpp"
+#include <QVector>
+#include <vector>
+#include <algorithm>
+#include <sstream>
 #include "tinia/model/ExposedModelLock.hpp"
 
 namespace {
@@ -62,118 +63,108 @@ protected:
 };
 
 
-class SnapshotAsTextFetcher : public QRunnable
+/** Grabs the rgb or depth image of a viewer in the main thread.
+ *
+ * Only the rendering and readback happen here, the image is queued on an
+ * ImageEncoder right away, and encoded outside the main thread.
+ */
+class SnapshotGrabber : public QRunnable
 {
 public:
-    
-    explicit SnapshotAsTextFetcher( QTextStream& reply,
-                                    const QString& request,
-                                    const std::string &proper_key_to_use,
-                                    tinia::jobcontroller::Job* job,
-                                    tinia::qtcontroller::impl::OpenGLServerGrabber* gl_grabber,
-                                    const bool getRBGsnapshot,
-                                    const bool pngMode, // Could have used TrellRequest, but then we would have to drag in mod_trell.h...
-                                    const int jpg_quality,
-                                    const unsigned depth_w = 0, const unsigned depth_h = 0 ) // Default values will result in canvas size being used.
-        : m_reply( reply ),
-          m_request( request ),
-          m_job( NULL ),
+
+    explicit SnapshotGrabber( const QString& request,
+                              const std::string &proper_key_to_use,
+                              tinia::jobcontroller::Job* job,
+                              tinia::qtcontroller::impl::OpenGLServerGrabber* gl_grabber,
+                              tinia::qtcontroller::impl::ImageEncoder* encoder,
+                              const bool getRBGsnapshot,
+                              const bool pngMode,
+                              const int jpg_quality,
+                              const unsigned depth_w = 0, const unsigned depth_h = 0 ) // Default values will result in canvas size being used.
+        : m_job( NULL ),
           m_gl_grabber( gl_grabber ),
-          m_gl_grabber_locker( gl_grabber->exclusiveAccessMutex() ),
+          m_encoder( encoder ),
           m_getRGBsnapshot( getRBGsnapshot ),
           m_pngMode( pngMode ),
-          m_jpg_quality( jpg_quality ), // Could get this (and other) parameter from parsing below, like is done for m_ket etc. Same thing is done by the caller.
-                                        // (Better done by the caller, now that we (may) have multiple viewers...)
+          m_jpg_quality( jpg_quality ),
           m_depth_w( depth_w ),
-          m_depth_h( depth_h )
+          m_depth_h( depth_h ),
+          m_encoded( -1 )
     {
         using namespace tinia::qtcontroller::impl;
-        
+
         m_job = dynamic_cast<tinia::jobcontroller::OpenGLJob*>( job );
         if( m_job == NULL ) {
             throw std::invalid_argument("This is not an OpenGL job!");
         }
-        
+
         typedef boost::tuple<unsigned int, unsigned int, std::string> params_t;
         params_t arguments = parseGet<params_t >(decodeGetParameters(request),
                                                  "width height key" );
         m_width  = arguments.get<0>();
         m_height = arguments.get<1>();
-        if (depth_w==0) {
+        if ( (depth_w==0) || m_getRGBsnapshot ) {
             m_depth_w = m_width;
         }
-        if (depth_h==0) {
+        if ( (depth_h==0) || m_getRGBsnapshot ) {
             m_depth_h = m_height;
         }
         m_key    = ( proper_key_to_use != "" ? proper_key_to_use : arguments.get<2>() );
     }
 
-    ~SnapshotAsTextFetcher()
+    /** The index of the image in the encoder, valid after run(). */
+    int
+    encoded() const
     {
-        using namespace tinia::qtcontroller::impl;
+        return m_encoded;
+    }
 
-        bool use_qt_scaling = true;
-        if (m_job->getExposedModel()->hasElement("ap_use_qt_img_scaling")) {
-            m_job->getExposedModel()->getElementValue( "ap_use_qt_img_scaling", use_qt_scaling );
-        }
-        if (use_qt_scaling) {
-
-            QImage img( m_gl_grabber->imageBuffer(),
-                        m_width,
-                        m_height,
-                        QImage::Format_RGB888 );
-            // This is a temporary fix. The image is reflected through the horizontal
-            // line y=height ((x, y) |--> (x, h-y) ).
-            QTransform flipTransformation(1, 0,
-                                          0, -1,
-                                          0, m_height);
-            img = img.transformed(flipTransformation);
-            if ( (m_depth_w!=m_width) || (m_depth_h!=m_height) ) {
-                // std::cout << "Scaling (QImage) to " << m_depth_w << " x " << m_depth_h << std::endl;
-                img = img.scaled(m_depth_w, m_depth_h); // Should ignore aspect ratio, and do no (bi-)linear filtering, according to the man pages.
-            }
-            QBuffer qBuffer;
-            if (m_pngMode) {
-                img.save(&qBuffer, "png");
-            } else {
-                img.save(&qBuffer, "jpg", m_jpg_quality);
-            }
-            
-            QString str( QByteArray( qBuffer.data(), int(qBuffer.size()) ).toBase64() );
-            m_reply << str;
+    bool
+    isRGB() const
+    {
+        return m_getRGBsnapshot;
+    }
 
-        } else {
-            
-            QImage img( m_gl_grabber->imageBuffer(),
-                        m_depth_w,
-                        m_depth_h,
-                        QImage::Format_RGB888 );
-            // This is a temporary fix. The image is reflected through the horizontal
-            // line y=height ((x, y) |--> (x, h-y) ).
-            QTransform flipTransformation(1, 0,
-                                          0, -1,
-                                          0, m_depth_h);
-            img = img.transformed(flipTransformation);
-            QBuffer qBuffer;
-            if (m_pngMode) {
-                img.save(&qBuffer, "png");
-            } else {
-                img.save(&qBuffer, "jpg", m_jpg_quality);
-            }
-            
-            QString str( QByteArray( qBuffer.data(), int(qBuffer.size()) ).toBase64() );
-            m_reply << str;
+    const std::string&
+    key() const
+    {
+        return m_key;
+    }
 
-        }
+    /** Renders and encodes a reduced quality rgb image, see ProgressiveRefinement. */
+    void
+    reduce( const tinia::jobcontroller::ProgressiveRefinement::Settings& settings )
+    {
+        using tinia::jobcontroller::ProgressiveRefinement;
+        m_width  = m_depth_w = ProgressiveRefinement::scaled( m_width, settings.scale );
+        m_height = m_depth_h = ProgressiveRefinement::scaled( m_height, settings.scale );
+        m_jpg_quality = std::min( m_jpg_quality, settings.jpeg_quality );
     }
-    
+
+    /** Identifies the encoded image in the snapshot cache. */
+    std::string
+    cacheKey( unsigned int revision ) const
+    {
+        return tinia::jobcontroller::SnapshotCache::makeKey( m_key, m_width, m_height, format(), revision );
+    }
+
+    /** Identifies the renders that concurrent requests can share. */
+    std::string
+    renderSlot() const
+    {
+        std::stringstream slot;
+        slot << m_key << "/" << m_width << "x" << m_height << "/" << format();
+        return slot.str();
+    }
+
     void
     run()
     {
+        tinia::qtcontroller::impl::GrabbedImagePtr image;
         if ( m_getRGBsnapshot ) {
-            m_gl_grabber->grabRGB( m_job, m_width, m_height, m_key );
+            image = m_gl_grabber->grabRGB( m_job, m_width, m_height, m_key );
         } else {
-            
+
             bool use_qt_scaling = true;
             if ( m_job->getExposedModel()->hasElement("ap_use_qt_img_scaling") ) {
                 m_job->getExposedModel()->getElementValue( "ap_use_qt_img_scaling", use_qt_scaling );
@@ -183,24 +174,41 @@ public:
                 m_job->getExposedModel()->getElementValue( "ap_16_bit_depth", depth16 );
             }
             if (use_qt_scaling) {
-                m_gl_grabber->grabDepth( m_job, m_width, m_height, m_key, 0, 0, false, depth16 );
+                image = m_gl_grabber->grabDepth( m_job, m_width, m_height, m_key, 0, 0, false, depth16 );
             } else {
                 bool bi_linear_filtering = false;
                 if ( m_job->getExposedModel()->hasElement("ap_bi_linear_filtering") ) {
                     m_job->getExposedModel()->getElementValue( "ap_bi_linear_filtering", bi_linear_filtering );
                 }
-                m_gl_grabber->grabDepth( m_job, m_width, m_height, m_key, m_depth_w, m_depth_h, bi_linear_filtering, depth16 );
+                image = m_gl_grabber->grabDepth( m_job, m_width, m_height, m_key, m_depth_w, m_depth_h, bi_linear_filtering, depth16 );
             }
-            
+
         }
+        // Depth images grabbed at canvas size are scaled down by QImage when encoded.
+        m_encoded = m_encoder->add( image, m_depth_w, m_depth_h, m_pngMode, m_jpg_quality );
     }
-    
+
 protected:
-    QTextStream&                                    m_reply;
-    const QString&                                  m_request;
+    std::string
+    format() const
+    {
+        std::stringstream format;
+        if ( m_getRGBsnapshot ) {
+            format << "rgb:";
+        } else {
+            format << "depth:" << m_depth_w << "x" << m_depth_h << ":";
+        }
+        if ( m_pngMode ) {
+            format << "png";
+        } else {
+            format << "jpg" << m_jpg_quality;
+        }
+        return format.str();
+    }
+
     tinia::jobcontroller::OpenGLJob*                m_job;
     tinia::qtcontroller::impl::OpenGLServerGrabber* m_gl_grabber;
-    QMutexLocker                                    m_gl_grabber_locker;
+    tinia::qtcontroller::impl::ImageEncoder*        m_encoder;
     unsigned int                                    m_width;
     unsigned int                                    m_height;
     std::string                                     m_key;
@@ -208,9 +216,233 @@ protected:
     bool                                            m_pngMode;
     int                                             m_jpg_quality;
     unsigned                                        m_depth_w, m_depth_h;
+    int                                             m_encoded;
 };
 
 
+/** Grabs the rgb image of a viewer in the main thread, and keeps it unencoded. */
+class RawGrabber : public QRunnable
+{
+public:
+    RawGrabber( tinia::jobcontroller::Job* job,
+                tinia::qtcontroller::impl::OpenGLServerGrabber* gl_grabber,
+                unsigned int width,
+                unsigned int height,
+                const std::string& key )
+        : m_job( dynamic_cast<tinia::jobcontroller::OpenGLJob*>( job ) ),
+          m_gl_grabber( gl_grabber ),
+          m_width( width ),
+          m_height( height ),
+          m_key( key )
+    {
+        if( m_job == NULL ) {
+            throw std::invalid_argument("This is not an OpenGL job!");
+        }
+    }
+
+    void
+    run()
+    {
+        m_image = m_gl_grabber->grabRGB( m_job, m_width, m_height, m_key );
+    }
+
+    tinia::qtcontroller::impl::GrabbedImagePtr
+    image() const
+    {
+        return m_image;
+    }
+
+protected:
+    tinia::jobcontroller::OpenGLJob*                m_job;
+    tinia::qtcontroller::impl::OpenGLServerGrabber* m_gl_grabber;
+    unsigned int                                    m_width;
+    unsigned int                                    m_height;
+    std::string                                     m_key;
+    tinia::qtcontroller::impl::GrabbedImagePtr      m_image;
+};
+
+
+/** The snapshots needed to answer one request.
+ *
+ * All the images are grabbed in a single main thread invocation, instead of
+ * one blocking round-trip through the event loop per viewer and image.
+ * Images that are in the snapshot cache (same view, size, format and model
+ * revision) are not grabbed at all, and images that another request is
+ * already rendering are shared with it (see RenderCoalescer).
+ */
+class SnapshotBatch
+{
+public:
+    SnapshotBatch( const QString& request,
+                   tinia::jobcontroller::Job* job,
+                   tinia::qtcontroller::impl::OpenGLServerGrabber* gl_grabber )
+        : m_request( request ),
+          m_job( job ),
+          m_gl_grabber( gl_grabber ),
+          m_encoder( gl_grabber->encoderPool() ),
+          m_cache( gl_grabber->snapshotCache() ),
+          m_coalescer( gl_grabber->renderCoalescer() ),
+          m_revision( job->getExposedModel()->getRevisionNumber() ),
+          m_progressive( false )
+    {
+    }
+
+    ~SnapshotBatch()
+    {
+        for( size_t i=0; i<m_grabbers.size(); i++ ) {
+            delete m_grabbers[i];
+        }
+    }
+
+    /** Adds an image to grab.
+     *
+     * The depth image of a viewer relies on the rendering done for its rgb
+     * image, so it must be added right after it.
+     * \returns The index to give to result().
+     */
+    size_t
+    add( const std::string& key, const bool rgb, const bool png, const int jpg_quality,
+         const unsigned depth_w = 0, const unsigned depth_h = 0 )
+    {
+        m_grabbers.push_back( new SnapshotGrabber( m_request, key, m_job, m_gl_grabber, &m_encoder,
+                                                   rgb, png, jpg_quality, depth_w, depth_h ) );
+        if ( m_progressive && m_gl_grabber->progressiveRefinement()->interactive( m_grabbers.back()->key() ) ) {
+            m_grabbers.back()->reduce( m_settings );
+        }
+        m_keys.push_back( m_grabbers.back()->cacheKey( m_revision ) );
+        m_images.push_back( tinia::jobcontroller::SnapshotCache::Data() );
+        return m_grabbers.size() - 1;
+    }
+
+    /** Lets the rgb images added after this be of reduced quality while
+     * their viewers are being interacted with, if the job has turned on
+     * progressive refinement. Not for replies with depth images, whose
+     * size must match the rgb images.
+     */
+    void
+    progressive()
+    {
+        tinia::jobcontroller::ProgressiveRefinement* refinement = m_gl_grabber->progressiveRefinement();
+        m_progressive = ( refinement != NULL ) && refinement->settings( m_settings );
+    }
+
+    /** The ETag of the reply, see snapshotETag(). Empty if caching is disabled. */
+    QString
+    etag() const
+    {
+        if ( !m_cache->enabled() ) {
+            return QString();
+        }
+        return tinia::qtcontroller::impl::snapshotETag( m_request, m_keys );
+    }
+
+    /** True if the client already has the reply, i.e., If-None-Match is etag(). */
+    bool
+    notModified()
+    {
+        if ( !tinia::qtcontroller::impl::isNotModified( m_request, etag() ) ) {
+            return false;
+        }
+        m_cache->notModified();
+        return true;
+    }
+
+    /** Gets all the images.
+     *
+     * The images that are neither cached nor being rendered by another
+     * request are grabbed in one turn of the main thread, and handed to the
+     * requests waiting for them before this request waits for the rest.
+     */
+    void
+    grab( tinia::qtcontroller::impl::Invoker* invoker )
+    {
+        if ( m_cache->enabled() ) {
+            for( size_t i=0; i<m_grabbers.size(); i++ ) {
+                m_images[i] = m_cache->lookup( m_keys[i] );
+            }
+        }
+        std::vector<tinia::jobcontroller::RenderCoalescer::Ticket> tickets( m_grabbers.size() );
+        std::vector<size_t> leading;
+        for( size_t i=0; i<m_grabbers.size(); i++ ) {
+            if ( !m_images[i] ) {
+                tickets[i] = m_coalescer->join( m_grabbers[i]->renderSlot(), m_keys[i] );
+                if ( tickets[i].leader() ) {
+                    leading.push_back( i );
+                }
+            }
+        }
+        render( invoker, leading, tickets );
+
+        for( size_t i=0; i<m_grabbers.size(); i++ ) {
+            if ( !m_images[i] && !tickets[i].leader() ) {
+                if ( !m_coalescer->wait( tickets[i], m_images[i] ) ) {
+                    render( invoker, std::vector<size_t>( 1, i ), tickets );
+                }
+            }
+        }
+    }
+
+    /** Returns the image, valid after grab(). */
+    QByteArray
+    result( size_t index ) const
+    {
+        const tinia::jobcontroller::SnapshotCache::Data& image = m_images[index];
+        if ( !image || image->empty() ) {
+            return QByteArray();
+        }
+        return QByteArray( &(*image)[0], image->size() );
+    }
+
+private:
+    /** Grabs and encodes the images, and publishes them to other requests. */
+    void
+    render( tinia::qtcontroller::impl::Invoker* invoker,
+            const std::vector<size_t>& indices,
+            const std::vector<tinia::jobcontroller::RenderCoalescer::Ticket>& tickets )
+    {
+        if ( indices.empty() ) {
+            return;
+        }
+        std::vector<QRunnable*> grabbers;
+        for( size_t j=0; j<indices.size(); j++ ) {
+            const size_t i = indices[j];
+            // A depth grab needs the rendering done by the rgb grab before it.
+            if ( !m_grabbers[i]->isRGB() && ( i > 0 ) && m_grabbers[i-1]->isRGB() &&
+                 ( ( j == 0 ) || ( indices[j-1] != i-1 ) ) )
+            {
+                grabbers.push_back( m_grabbers[i-1] );
+            }
+            grabbers.push_back( m_grabbers[i] );
+        }
+        invoker->invokeInMainThread( grabbers );
+
+        for( size_t j=0; j<indices.size(); j++ ) {
+            const size_t i = indices[j];
+            QByteArray encoded = m_encoder.result( m_grabbers[i]->encoded() );
+            if ( !encoded.isEmpty() ) {
+                m_images[i].reset( new std::vector<char>( encoded.constData(), encoded.constData() + encoded.size() ) );
+                m_cache->insert( m_keys[i], encoded.constData(), encoded.size() );
+            }
+            // An empty image tells the waiting requests to render it themselves.
+            m_coalescer->publish( tickets[i], m_images[i] );
+        }
+    }
+
+    const QString&                                  m_request;
+    tinia::jobcontroller::Job*                      m_job;
+    tinia::qtcontroller::impl::OpenGLServerGrabber* m_gl_grabber;
+    tinia::qtcontroller::impl::ImageEncoder         m_encoder;
+    tinia::jobcontroller::SnapshotCache*            m_cache;
+    tinia::jobcontroller::RenderCoalescer*          m_coalescer;
+    unsigned int                                    m_revision;
+    std::vector<SnapshotGrabber*>                   m_grabbers;
+    std::vector<std::string>                        m_keys;
+    bool                                            m_progressive;
+    tinia::jobcontroller::ProgressiveRefinement::Settings m_settings;
+    /** The encoded images, set by grab(). */
+    std::vector<tinia::jobcontroller::SnapshotCache::Data> m_images;
+};
+
 }
 
 
@@ -221,8 +453,14 @@ namespace impl {
 ServerThread::ServerThread(OpenGLServerGrabber* grabber,
                            Invoker* mainthread_invoker,
                            tinia::jobcontroller::Job* job,
-                           int socket ) :
-    m_socket(socket),
+                           QObject* server,
+                           qulonglong connection,
+                           qulonglong sequence,
+                           const QByteArray& request ) :
+    m_server(server),
+    m_connection(connection),
+    m_sequence(sequence),
+    m_request(request),
     m_xmlHandler(job->getExposedModel()),
     m_job(job),
     m_grabber(grabber),
@@ -232,60 +470,30 @@ ServerThread::ServerThread(OpenGLServerGrabber* grabber,
 
 void ServerThread::run()
 {
-    QTcpSocket socket;
-
-    socket.setSocketDescriptor(m_socket);
-    socket.waitForReadyRead();
-
-    if (socket.canReadLine()) {
-
-        QByteArray request = socket.readAll();
-        while(!request.contains("\r\n\r\n")) {
-            socket.waitForBytesWritten();
-            request += socket.readAll();
-        }
-        //Now we have the whole header
-        QRegExp contentLengthExpression("Content-Length: (\\d+)\\s*\\r\\n");
-
-        if (contentLengthExpression.indexIn(request) != -1) {
-            QString contentLengthGroup = contentLengthExpression.cap(1);
-            int contentLength = contentLengthGroup.toInt();
-            
-            int headerSize = request.indexOf("\r\n\r\n") + 4;
-            while(request.size()  - headerSize < contentLength) {
-                socket.waitForBytesWritten();
-                request += socket.readAll();
-            }
-        }
-
-        QTextStream os(&socket);
+    // The request is complete, the HTTPConnection has read it.
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    {
+        QTextStream os(&buffer);
+        const QString request(m_request);
 
-        if(isLongPoll(request)) {
-            LongPollHandler handler(os, request, m_job->getExposedModel());
-            handler.handle();
-        }
-        else if (isGetOrPost(request)) {
+        if (isGetOrPost(request)) {
             os.setAutoDetectUnicode(true);
 
             if(!handleNonStatic(os, getRequestURI(request), request)) {
                 os << getStaticContent(getRequestURI(request)) << "\r\n";
             }
-
-           // socket.disconnectFromHost();
-
         }
-            
-
-        socket.close();
-        socket.waitForDisconnected();
-
+        else {
+            errorCode(os, 501, "Only GET and POST are supported.");
+        }
+        os.flush();
     }
-}
 
-
-bool ServerThread::isLongPoll(const QString &request)
-{
-    return getRequestURI(request) == "/getExposedModelUpdate.xml";
+    QMetaObject::invokeMethod( m_server, "deliverResponse", Qt::QueuedConnection,
+                               Q_ARG( qulonglong, m_connection ),
+                               Q_ARG( qulonglong, m_sequence ),
+                               Q_ARG( QByteArray, buffer.data() ) );
 }
 
 
@@ -305,28 +513,42 @@ void ServerThread::getSnapshotTxt( QTextStream &os, const QString &request,
     const int depth_w = arguments.get<8>();
     const int depth_h = arguments.get<9>();
 
-    os << httpHeader(getMimeType("file.txt")) << "\r\n{ ";
-
     QString viewer_keys(viewer_key_list.c_str());
     QStringList vk_list = viewer_keys.split(',');
 
+    // Grab all viewers in one main thread turn, the encoding of one overlaps with grabbing the next.
+    SnapshotBatch batch( request, job, grabber );
+    if (!with_depth) {
+        batch.progressive();
+    }
+    QVector<size_t> rgb_images, depth_images;
+    for (int i=0; i<vk_list.size(); i++) {
+        const std::string k = vk_list[i].toStdString();
+        rgb_images.append( batch.add( k, true /* RGB requested */, true /* png mode */, 0 /* jpeg-quality, unused for png */ ) );
+        if (with_depth) {
+            depth_images.append( batch.add( k, false /* Depth requested */, true /* png mode */, 0,
+                                            depth_w, depth_h ) ); // Only used for depth
+        }
+    }
+    if ( batch.notModified() ) {
+        os << notModifiedHeader( batch.etag() ) << "\r\n";
+        return;
+    }
+    batch.grab( m_mainthread_invoker );
+
+    const QString etag = batch.etag();
+    os << httpHeader(getMimeType("file.txt")) << etagHeader( etag ) << "\r\n{ ";
+
     for (int i=0; i<vk_list.size(); i++) {
         QString k = vk_list[i];
 
         // Now building the JSON entry for this viewer/key
         os << k << ": { \"rgb\": \"";
-        {
-            SnapshotAsTextFetcher f( os, request, k.toStdString(), job, grabber, true /* RGB requested */, true /* png mode */, 0 /* jpeg-quality, unused for png */ );
-            m_mainthread_invoker->invokeInMainThread( &f, true );
-        }
+        os << QString( batch.result( rgb_images[i] ).toBase64() );
         os << "\"";
         if (with_depth) {
             os << ", \"depth\": \"";
-            {
-                SnapshotAsTextFetcher f( os, request, k.toStdString(), job, grabber, false /* Depth requested */, true /* png mode */, 0 /* jpeg-quality, unused for png */,
-                                         depth_w, depth_h ); // Only used for depth
-                m_mainthread_invoker->invokeInMainThread( &f, true );
-            }
+            os << QString( batch.result( depth_images[i] ).toBase64() );
             os << "\", \"view\": \"";
             tinia::model::Viewer viewer;
             m_job->getExposedModel()->getElementValue( k.toStdString(), viewer );
@@ -345,7 +567,11 @@ void ServerThread::getSnapshotTxt( QTextStream &os, const QString &request,
             }
             os << "\"";
         }
-        os << ",\n\"revision\": " << revision << ",\n\"timestamp\": " << timestamp << ",\n\"snaptype\": " << "\"" << snaptype.c_str() << "\"";
+        os << ",\n\"revision\": " << revision;
+        if ( etag.isEmpty() ) {
+            os << ",\n\"timestamp\": " << timestamp;
+        }
+        os << ",\n\"snaptype\": " << "\"" << snaptype.c_str() << "\"";
         os << ",\n\"depthwidth\": " << depth_w << ",\"depthheight\": " << depth_h << " }";
         if ( i < vk_list.size() - 1 ) {
             os << ", ";
@@ -370,20 +596,34 @@ void ServerThread::getJpgSnapshotTxt( QTextStream &os, const QString &request,
     const long timestamp = arguments.get<6>();
     const std::string snaptype = arguments.get<7>();
 
-    os << httpHeader(getMimeType("file.txt")) << "\r\n{ ";
-
     QString viewer_keys(viewer_key_list.c_str());
     QStringList vk_list = viewer_keys.split(',');
 
+    SnapshotBatch batch( request, job, grabber );
+    batch.progressive();
+    QVector<size_t> images;
+    for (int i=0; i<vk_list.size(); i++) {
+        images.append( batch.add( vk_list[i].toStdString(), true /* RGB requested */, false /* jpg mode */, q ) );
+    }
+    if ( batch.notModified() ) {
+        os << notModifiedHeader( batch.etag() ) << "\r\n";
+        return;
+    }
+    batch.grab( m_mainthread_invoker );
+
+    const QString etag = batch.etag();
+    os << httpHeader(getMimeType("file.txt")) << etagHeader( etag ) << "\r\n{ ";
+
     for (int i=0; i<vk_list.size(); i++) {
         QString k = vk_list[i];
         // Now building the JSON entry for this viewer/key
         os << k << ": { \"rgb\": \"";
-        {
-            SnapshotAsTextFetcher f( os, request, k.toStdString(), job, grabber, true /* RGB requested */, false /* jpg mode */, q );
-            m_mainthread_invoker->invokeInMainThread( &f, true );
+        os << QString( batch.result( images[i] ).toBase64() );
+        os << "\",\n\"revision\": " << revision;
+        if ( etag.isEmpty() ) {
+            os << ",\n\"timestamp\": " << timestamp;
         }
-        os << "\",\n\"revision\": " << revision << ",\n\"timestamp\": " << timestamp << ",\n\"snaptype\": " << "\"" << snaptype.c_str() << "\" }";
+        os << ",\n\"snaptype\": " << "\"" << snaptype.c_str() << "\" }";
         if ( i < vk_list.size() - 1 ) {
             os << ", ";
         }
@@ -393,6 +633,147 @@ void ServerThread::getJpgSnapshotTxt( QTextStream &os, const QString &request,
 }
 
 
+void ServerThread::getSnapshotBin( QTextStream &os, const QString &request,
+                                   const bool with_depth, const bool jpeg )
+{
+    const QMap<QString, QString> parameters = decodeGetParameters(request);
+    boost::tuple<unsigned int, unsigned int, std::string, unsigned int, std::string, std::string> arguments =
+            parseGet< boost::tuple<unsigned int, unsigned int, std::string, unsigned int, std::string, std::string> >(
+                parameters, "width height viewer_key_list revision timestamp snaptype" );
+    const int q = parameters.value( "jpeg_quality", "100" ).toInt();
+    // Zero depth size means the size of the canvas, as for snapshot_bundle.txt.
+    const unsigned int depth_w = parameters.value( "depth_w", "0" ).toUInt();
+    const unsigned int depth_h = parameters.value( "depth_h", "0" ).toUInt();
+
+    const QStringList vk_list = QString( arguments.get<2>().c_str() ).split( ',' );
+
+    SnapshotBatch batch( request, m_job, m_grabber );
+    if (!with_depth) {
+        batch.progressive();
+    }
+    QVector<size_t> rgb_images, depth_images;
+    for (int i=0; i<vk_list.size(); i++) {
+        const std::string k = vk_list[i].toStdString();
+        rgb_images.append( batch.add( k, true /* RGB requested */, !jpeg, q ) );
+        if (with_depth) {
+            depth_images.append( batch.add( k, false /* Depth requested */, true /* png mode */, 0,
+                                            depth_w, depth_h ) );
+        }
+    }
+    if ( batch.notModified() ) {
+        os << notModifiedHeader( batch.etag() ) << "\r\n";
+        return;
+    }
+    batch.grab( m_mainthread_invoker );
+
+    // A reply with an ETag may be reused for other timestamps, which are not echoed.
+    const QString etag = batch.etag();
+    QByteArray body;
+    appendSnapshotHeader( body, vk_list.size(), arguments.get<3>(),
+                          etag.isEmpty() ? QByteArray( arguments.get<4>().c_str() ) : QByteArray(),
+                          arguments.get<5>().c_str() );
+    for (int i=0; i<vk_list.size(); i++) {
+        const std::string k = vk_list[i].toStdString();
+
+        appendSized( body, vk_list[i].toUtf8() );
+        appendUInt32( body, (with_depth ? SNAPSHOT_FLAG_DEPTH : 0) | (jpeg ? SNAPSHOT_FLAG_JPEG : 0) );
+        appendUInt32( body, with_depth ? ( depth_w != 0 ? depth_w : arguments.get<0>() ) : 0 );
+        appendUInt32( body, with_depth ? ( depth_h != 0 ? depth_h : arguments.get<1>() ) : 0 );
+
+        appendSized( body, batch.result( rgb_images[i] ) );
+
+        if (with_depth) {
+            appendSized( body, batch.result( depth_images[i] ) );
+
+            tinia::model::Viewer viewer;
+            m_job->getExposedModel()->getElementValue( k, viewer );
+            for (size_t j=0; j<16; j++) {
+                appendFloat32( body, viewer.modelviewMatrix[j] );
+            }
+            for (size_t j=0; j<16; j++) {
+                appendFloat32( body, viewer.projectionMatrix[j] );
+            }
+        }
+    }
+
+    writeBinary( os, binaryHeader( getMimeType( "file.bin" ) ) + etagHeader( etag ), body );
+}
+
+
+void ServerThread::getSnapshotImage( QTextStream &os, const QString &request, const bool jpeg )
+{
+    const int q = decodeGetParameters(request).value( "jpeg_quality", "100" ).toInt();
+
+    SnapshotBatch batch( request, m_job, m_grabber );
+    batch.progressive();
+    // An empty key makes the grabber use the key parameter of the request.
+    const size_t image = batch.add( "", true /* RGB requested */, !jpeg, q );
+    if ( batch.notModified() ) {
+        os << notModifiedHeader( batch.etag() ) << "\r\n";
+        return;
+    }
+    batch.grab( m_mainthread_invoker );
+    writeBinary( os, binaryHeader( getMimeType( jpeg ? "file.jpg" : "file.png" ) ) + etagHeader( batch.etag() ),
+                 batch.result( image ) );
+}
+
+
+void ServerThread::getSnapshotDelta( QTextStream &os, const QString &request )
+{
+    using tinia::jobcontroller::FrameDelta;
+
+    const QMap<QString, QString> parameters = decodeGetParameters(request);
+    boost::tuple<std::string, unsigned int, unsigned int, std::string> arguments =
+            parseGet< boost::tuple<std::string, unsigned int, unsigned int, std::string> >(
+                parameters, "key width height client" );
+    const unsigned int base = parameters.value( "base", "0" ).toUInt();
+    const unsigned int width = arguments.get<1>();
+    const unsigned int height = arguments.get<2>();
+
+    RawGrabber grabber( m_job, m_grabber, width, height, arguments.get<0>() );
+    m_mainthread_invoker->invokeInMainThread( &grabber, true );
+    GrabbedImagePtr frame = grabber.image();
+
+    // Rows of the grabbed image are padded to 32 bits, see grabRGB.
+    const size_t stride = 4*((3*width+3)/4);
+    const FrameDelta::Delta delta =
+            m_grabber->frameDelta()->update( arguments.get<3>() + "/" + arguments.get<0>(), base,
+                                             &frame->pixels[0], width, height, stride );
+
+    // The tiles are encoded in parallel, as the snapshots are.
+    ImageEncoder encoder( m_grabber->encoderPool() );
+    std::vector<int> encoded;
+    for( size_t i=0; i<delta.tiles.size(); i++ ) {
+        const FrameDelta::Tile& tile = delta.tiles[i];
+        GrabbedImagePtr image( new GrabbedImage );
+        image->width = tile.width;
+        image->height = tile.height;
+        // QImage requires scanline size to be a multiple of 32 bits.
+        const size_t tile_stride = 4*((3*tile.width+3)/4);
+        image->pixels.resize( tile_stride*tile.height );
+        FrameDelta::copyTile( &frame->pixels[0], height, stride, tile, &image->pixels[0], tile_stride );
+        encoded.push_back( encoder.add( image, tile.width, tile.height, true, 100 ) );
+    }
+
+    QByteArray body;
+    body.append( "TDLT" );
+    appendUInt32( body, 1 );                            // version
+    appendUInt32( body, delta.full ? 1 : 0 );           // flags, 1 is a full frame
+    appendUInt32( body, width );
+    appendUInt32( body, height );
+    appendUInt32( body, delta.frame );
+    appendUInt32( body, delta.tiles.size() );
+    for( size_t i=0; i<delta.tiles.size(); i++ ) {
+        appendUInt32( body, delta.tiles[i].x );
+        appendUInt32( body, delta.tiles[i].y );
+        appendUInt32( body, delta.tiles[i].width );
+        appendUInt32( body, delta.tiles[i].height );
+        appendSized( body, encoder.result( encoded[i] ) );
+    }
+    writeBinary( os, binaryHeader( getMimeType( "file.bin" ) ), body );
+}
+
+
 bool ServerThread::handleNonStatic(QTextStream &os, const QString& file,
                                    const QString& request)
 {
@@ -412,6 +793,51 @@ bool ServerThread::handleNonStatic(QTextStream &os, const QString& file,
             getSnapshotTxt( os, request, m_job, m_grabber, true );
             return true;
         }
+        else if ( file == "/snapshot.bin" ) {
+            updateState(os, request);
+            getSnapshotBin( os, request, false, false );
+            return true;
+        }
+        else if ( file == "/jpg_snapshot.bin" ) {
+            updateState(os, request);
+            getSnapshotBin( os, request, false, true );
+            return true;
+        }
+        else if ( file == "/snapshot_bundle.bin" ) {
+            updateState(os, request);
+            getSnapshotBin( os, request, true, false );
+            return true;
+        }
+        else if ( (file == "/snapshot.png") || (file == "/snapshot.jpg") ) {
+            updateState(os, request);
+            getSnapshotImage( os, request, file == "/snapshot.jpg" );
+            return true;
+        }
+        else if ( file == "/snapshot_delta.bin" ) {
+            updateState(os, request);
+            getSnapshotDelta( os, request );
+            return true;
+        }
+        else if ( file == "/snapshot_cache_stats.txt" ) {
+            const tinia::jobcontroller::SnapshotCache* cache = m_grabber->snapshotCache();
+            os << httpHeader(getMimeType("file.txt")) << "\r\n"
+               << "{ \"capacity\": " << cache->capacity()
+               << ", \"hits\": " << cache->hits()
+               << ", \"misses\": " << cache->misses()
+               << ", \"not_modified\": " << cache->notModifiedCount()
+               << ", \"hit_rate\": " << cache->hitRate()
+               << ", \"renders\": " << m_grabber->renderCoalescer()->renders()
+               << ", \"shared_renders\": " << m_grabber->renderCoalescer()->shared()
+               << ", \"delta_frames\": " << m_grabber->frameDelta()->frames()
+               << ", \"delta_full_frames\": " << m_grabber->frameDelta()->fullFrames()
+               << ", \"delta_sent_fraction\": " << m_grabber->frameDelta()->sentFraction();
+            if ( m_grabber->progressiveRefinement() != NULL ) {
+                os << ", \"interactive_frames\": " << m_grabber->progressiveRefinement()->interactiveFrames()
+                   << ", \"refinements\": " << m_grabber->progressiveRefinement()->refinements();
+            }
+            os << " }";
+            return true;
+        }
         else if(file == "/getRenderList.xml") {
             RenderListFetcher f( os, request, m_job );
             m_mainthread_invoker->invokeInMainThread( &f, true );
@@ -442,10 +868,18 @@ void ServerThread::updateState(QTextStream &os, const QString &request)
 }
 
 
+void ServerThread::writeBinary(QTextStream &os, const QString &header, const QByteArray &body)
+{
+    os << header << "\r\n";
+    os.flush();
+    os.device()->write( body );
+}
+
+
 void ServerThread::errorCode(QTextStream &os, unsigned int code, const QString &msg)
 {
     os << "HTTP/1.1 " << QString::number(code) << "\r\n"
-       << "Content-Type: text/html; charset=\"utf-8\"\r\n"
+       << "Content-Type: text/html; charset=\"utf-8\"\r\n\r\n"
        << "<html>\n<head>\n<title>Error: " << QString::number(code) << "</title>"
        << "</head>\n" <<"<body>\n" << "<h1>Error code: " << code << "</h1>\n"<<msg
        <<"</body>\n"<<"</html>\n";
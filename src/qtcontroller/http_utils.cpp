@@ -17,10 +17,12 @@
  */
 
 #include "tinia/qtcontroller/impl/http_utils.hpp"
+#include "tinia/jobcontroller/SnapshotCache.hpp"
 #include <QRegExp>
 #include <QStringList>
 #include <stdexcept>
 #include <QMap>
+#include <cstring>
 
 namespace tinia { namespace qtcontroller { namespace impl {
 QString getRequestURI(const QString& request) {
@@ -44,6 +46,9 @@ QString getMimeType(const QString& file) {
     extensions["txt"] = "text/plain";
     extensions["xml"] = "application/xml";
     extensions["css"] = "text/css";
+    extensions["png"] = "image/png";
+    extensions["jpg"] = "image/jpeg";
+    extensions["bin"] = "application/octet-stream";
 
     return extensions[extension];
 }
@@ -82,6 +87,135 @@ QString httpHeader(const QString& mime, unsigned int code, const QString& encodi
     return result;
 }
 
+namespace {
+/** Value of the header field, or an empty string. */
+QString headerField(const QString& header, const QString& field) {
+    QRegExp expression("\r\n" + field + ":[ \t]*([^\r\n]*)\r\n", Qt::CaseInsensitive);
+    if(expression.indexIn(header) == -1) {
+        return QString();
+    }
+    return expression.cap(1).trimmed();
+}
+}
+
+int requestLength(const QByteArray& buffer, int maxHeaderSize, int maxBodySize) {
+    const int headerEnd = buffer.indexOf("\r\n\r\n");
+    if(headerEnd == -1) {
+        return buffer.size() > maxHeaderSize ? -1 : 0;
+    }
+    const int headerSize = headerEnd + 4;
+    if(headerSize > maxHeaderSize) {
+        return -1;
+    }
+    const QString field = headerField(QString::fromLatin1(buffer.constData(), headerSize),
+                                      "Content-Length");
+    qlonglong contentLength = 0;
+    if(!field.isEmpty()) {
+        bool ok = false;
+        contentLength = field.toLongLong(&ok);
+        // A length we can't read can't be skipped either.
+        if(!ok || contentLength < 0 || contentLength > maxBodySize) {
+            return -1;
+        }
+    }
+    if(buffer.size() - headerSize < contentLength) {
+        return 0;
+    }
+    return headerSize + int(contentLength);
+}
+
+bool isKeepAlive(const QByteArray& request) {
+    const int headerEnd = request.indexOf("\r\n\r\n");
+    const QString header = QString::fromLatin1(request.constData(),
+                                               headerEnd == -1 ? request.size() : headerEnd + 4);
+    const QString connection = headerField(header, "Connection").toLower();
+    const QString requestLine = header.left(header.indexOf("\r\n"));
+    if(requestLine.endsWith("HTTP/1.0")) {
+        return connection == "keep-alive";
+    }
+    return connection != "close";
+}
+
+QByteArray finishResponse(const QByteArray& response, bool keepAlive) {
+    QByteArray header;
+    QByteArray body;
+    const int headerEnd = response.indexOf("\r\n\r\n");
+    if(headerEnd == -1) {
+        // Some handlers only write a status line (and headers).
+        header = response.trimmed();
+    }
+    else {
+        header = response.left(headerEnd);
+        body = response.mid(headerEnd + 4);
+    }
+    header += "\r\nContent-Length: " + QByteArray::number(body.size());
+    header += keepAlive ? "\r\nConnection: keep-alive" : "\r\nConnection: close";
+    return header + "\r\n\r\n" + body;
+}
+
+QString binaryHeader(const QString& mime, unsigned int code) {
+    return "HTTP/1.1 " + QString::number(code) + " OK\r\n"
+            + "Content-Type: " + mime + "\r\n";
+}
+
+QString getHeaderField(const QString& request, const QString& field) {
+    const int headerEnd = request.indexOf("\r\n\r\n");
+    return headerField(headerEnd == -1 ? request : request.left(headerEnd + 4), field);
+}
+
+QString etagHeader(const QString& etag) {
+    if(etag.isEmpty()) {
+        return QString();
+    }
+    return "ETag: " + etag + "\r\n";
+}
+
+QString notModifiedHeader(const QString& etag) {
+    return "HTTP/1.1 304 Not Modified\r\n" + etagHeader(etag);
+}
+
+QString snapshotETag(const QString& request, const std::vector<std::string>& keys) {
+    QString line = request.left(request.indexOf("\r\n"));
+    line.remove(QRegExp("[?&]timestamp(=[^& ]*)?(?=[& ])"));
+    std::string all = line.toStdString();
+    for(size_t i = 0; i < keys.size(); ++i) {
+        all += "\n" + keys[i];
+    }
+    return QString::fromStdString(tinia::jobcontroller::SnapshotCache::etag(all));
+}
+
+bool isNotModified(const QString& request, const QString& etag) {
+    return !etag.isEmpty() && (getHeaderField(request, "If-None-Match") == etag);
+}
+
+void appendUInt32(QByteArray& out, quint32 value) {
+    out.append(char(value & 0xffu));
+    out.append(char((value >> 8) & 0xffu));
+    out.append(char((value >> 16) & 0xffu));
+    out.append(char((value >> 24) & 0xffu));
+}
+
+void appendFloat32(QByteArray& out, float value) {
+    quint32 bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    appendUInt32(out, bits);
+}
+
+void appendSized(QByteArray& out, const QByteArray& data) {
+    appendUInt32(out, data.size());
+    out.append(data);
+}
+
+void appendSnapshotHeader(QByteArray& out, unsigned int viewers, unsigned int revision,
+                          const QByteArray& timestamp, const QByteArray& snaptype) {
+    out.append("TSNP", 4);
+    appendUInt32(out, 1);   // version
+    appendUInt32(out, viewers);
+    appendUInt32(out, revision);
+    appendSized(out, timestamp);
+    appendSized(out, snaptype);
+}
+
 
 
 }}}
@@ -0,0 +1,136 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "tinia/trell/DepthCompositor.hpp"
+
+namespace tinia {
+namespace trell {
+namespace {
+
+/** Pixels composited per inner loop, small enough to stay in the cache. */
+static const size_t block_pixels = 1024;
+
+} // of anonymous namespace
+
+DepthCompositor::DepthCompositor( unsigned int threads, size_t min_pixels_per_thread )
+    : m_threads( threads ),
+      m_min_pixels_per_thread( std::max( min_pixels_per_thread, (size_t)1 ) )
+{
+    if( m_threads == 0 ) {
+        m_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+}
+
+void
+DepthCompositor::composite( unsigned char*              rgb,
+                            unsigned int*               depth,
+                            const std::vector<Layer>&   layers,
+                            size_t                      pixels ) const
+{
+    if( layers.empty() || pixels == 0 ) {
+        return;
+    }
+    const size_t threads = std::max( (size_t)1,
+                                     std::min( (size_t)m_threads, pixels/m_min_pixels_per_thread ) );
+    const size_t chunk = (pixels + threads - 1)/threads;
+
+    // The calling thread does the first chunk.
+    boost::thread_group helpers;
+    for( size_t t=1; t<threads; t++ ) {
+        const size_t begin = std::min( pixels, t*chunk );
+        const size_t end = std::min( pixels, begin + chunk );
+        if( begin < end ) {
+            helpers.create_thread( boost::bind( &DepthCompositor::compositeRange,
+                                                rgb, depth, boost::cref( layers ), begin, end ) );
+        }
+    }
+    compositeRange( rgb, depth, layers, 0, std::min( pixels, chunk ) );
+    helpers.join_all();
+}
+
+void
+DepthCompositor::compositeRange( unsigned char*              rgb,
+                                 unsigned int*               depth,
+                                 const std::vector<Layer>&   layers,
+                                 size_t                      begin,
+                                 size_t                      end )
+{
+    unsigned int keys[ block_pixels ];
+    unsigned char masks[ block_pixels ];
+
+    for( size_t b=begin; b<end; b+=block_pixels ) {
+        const size_t n = std::min( block_pixels, end-b );
+        unsigned int* out_depth = depth + b;
+        unsigned char* out_rgb = rgb + 3*b;
+
+        // --- the first layer is copied ---------------------------------------
+        const unsigned char* d = layers[0].m_depth + 3*b;
+        for( size_t i=0; i<n; i++ ) {
+            out_depth[i] = (d[3*i]<<16u) | (d[3*i+1]<<8u) | d[3*i+2];
+        }
+        memcpy( out_rgb, layers[0].m_rgb + 3*b, 3*n );
+
+        // --- the others are selected where nearer ----------------------------
+        for( size_t l=1; l<layers.size(); l++ ) {
+            const unsigned char* ld = layers[l].m_depth + 3*b;
+            const unsigned char* lc = layers[l].m_rgb + 3*b;
+            for( size_t i=0; i<n; i++ ) {
+                keys[i] = (ld[3*i]<<16u) | (ld[3*i+1]<<8u) | ld[3*i+2];
+            }
+            for( size_t i=0; i<n; i++ ) {
+                const unsigned int nearer = keys[i] < out_depth[i] ? ~0u : 0u;
+                out_depth[i] = (keys[i] & nearer) | (out_depth[i] & ~nearer);
+                masks[i] = (unsigned char)nearer;
+            }
+            for( size_t i=0; i<3*n; i++ ) {
+                const unsigned char m = masks[i/3];
+                out_rgb[i] = (lc[i] & m) | (out_rgb[i] & ~m);
+            }
+        }
+    }
+}
+
+void
+DepthCompositor::encode( unsigned char*          encoded,
+                         const unsigned int*     depth,
+                         size_t                  width,
+                         size_t                  height,
+                         size_t                  depth_width,
+                         size_t                  depth_height,
+                         bool                    depth16 )
+{
+    const unsigned int keep = depth16 ? 0xffff00u : 0xffffffu;
+    for( size_t i=0; i<depth_height; i++ ) {
+        const size_t ii = std::min( height-1, (size_t)( (i*height)/double(depth_height) + 0.5 ) );
+        for( size_t j=0; j<depth_width; j++ ) {
+            const size_t jj = std::min( width-1, (size_t)( (j*width)/double(depth_width) + 0.5 ) );
+            const unsigned int k = depth[ ii*width + jj ] & keep;
+            unsigned char* e = encoded + 3*(i*depth_width + j);
+            e[0] = (unsigned char)( k>>16u );
+            e[1] = (unsigned char)( k>>8u );
+            e[2] = (unsigned char)( k );
+        }
+    }
+}
+
+} // of namespace trell
+} // of namespace tinia
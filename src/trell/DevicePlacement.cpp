@@ -0,0 +1,154 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sstream>
+#include <algorithm>
+#include "tinia/trell/DevicePlacement.hpp"
+
+namespace tinia {
+namespace trell {
+
+DevicePlacement::Load::Load()
+    : m_render_ms( 0.0 ),
+      m_readback_ms( 0.0 ),
+      m_memory_kb( 0 )
+{
+}
+
+DevicePlacement::Device::Device()
+    : m_jobs( 0 ),
+      m_render_ms( 0.0 ),
+      m_readback_ms( 0.0 ),
+      m_memory_kb( 0 ),
+      m_cost( 0.0 )
+{
+}
+
+DevicePlacement::DevicePlacement( double min_job_ms )
+    : m_min_job_ms( min_job_ms )
+{
+}
+
+void
+DevicePlacement::setDevices( const std::vector<std::string>& devices )
+{
+    m_devices = devices;
+}
+
+const std::string
+DevicePlacement::place( const std::string& job )
+{
+    if( m_devices.empty() ) {
+        return "";
+    }
+    Device best = deviceLoad( m_devices[0] );
+    for( size_t i=1; i<m_devices.size(); i++ ) {
+        Device d = deviceLoad( m_devices[i] );
+        if( (d.m_cost < best.m_cost) ||
+            ( (d.m_cost == best.m_cost) && (d.m_jobs < best.m_jobs) ) ||
+            ( (d.m_cost == best.m_cost) && (d.m_jobs == best.m_jobs) && (d.m_memory_kb < best.m_memory_kb) ) )
+        {
+            best = d;
+        }
+    }
+    assign( job, best.m_id );
+    return best.m_id;
+}
+
+void
+DevicePlacement::assign( const std::string& job, const std::string& device )
+{
+    Job& j = m_jobs[ job ];
+    j.m_device = device;
+    j.m_load = Load();
+}
+
+const std::string
+DevicePlacement::device( const std::string& job ) const
+{
+    std::map<std::string, Job>::const_iterator it = m_jobs.find( job );
+    return it == m_jobs.end() ? "" : it->second.m_device;
+}
+
+void
+DevicePlacement::update( const std::string& job, const Load& load )
+{
+    std::map<std::string, Job>::iterator it = m_jobs.find( job );
+    if( it != m_jobs.end() ) {
+        it->second.m_load = load;
+    }
+}
+
+void
+DevicePlacement::remove( const std::string& job )
+{
+    m_jobs.erase( job );
+}
+
+double
+DevicePlacement::cost( const Load& load ) const
+{
+    return std::max( m_min_job_ms, load.m_render_ms + load.m_readback_ms );
+}
+
+const DevicePlacement::Device
+DevicePlacement::deviceLoad( const std::string& device ) const
+{
+    Device d;
+    d.m_id = device;
+    for( std::map<std::string, Job>::const_iterator it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
+        if( it->second.m_device == device ) {
+            d.m_jobs++;
+            d.m_render_ms += it->second.m_load.m_render_ms;
+            d.m_readback_ms += it->second.m_load.m_readback_ms;
+            d.m_memory_kb += it->second.m_load.m_memory_kb;
+            d.m_cost += cost( it->second.m_load );
+        }
+    }
+    return d;
+}
+
+const std::string
+DevicePlacement::xml() const
+{
+    // Placeable devices first, then those that only have pinned jobs.
+    std::vector<std::string> devices = m_devices;
+    for( std::map<std::string, Job>::const_iterator it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
+        if( !it->second.m_device.empty() &&
+            std::find( devices.begin(), devices.end(), it->second.m_device ) == devices.end() )
+        {
+            devices.push_back( it->second.m_device );
+        }
+    }
+    std::stringstream o;
+    o << "<deviceLoad>";
+    for( size_t i=0; i<devices.size(); i++ ) {
+        Device d = deviceLoad( devices[i] );
+        o << "<device id=\"" << d.m_id << "\""
+          << " jobs=\"" << d.m_jobs << "\""
+          << " renderMs=\"" << d.m_render_ms << "\""
+          << " readbackMs=\"" << d.m_readback_ms << "\""
+          << " memoryKb=\"" << d.m_memory_kb << "\""
+          << " cost=\"" << d.m_cost << "\"/>";
+    }
+    o << "</deviceLoad>";
+    return o.str();
+}
+
+} // of namespace trell
+} // of namespace tinia
@@ -0,0 +1,96 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "tinia/trell/Hibernation.hpp"
+
+namespace tinia {
+namespace trell {
+
+namespace {
+static const std::string magic = "tinia-hibernation 2";
+}
+
+const std::string
+Hibernation::path( const std::string& job_id )
+{
+    return "/tmp/" + job_id + ".hibernate";
+}
+
+bool
+Hibernation::write( const std::string& path,
+                    const std::string& model,
+                    const std::string& payload,
+                    unsigned int revision )
+{
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream out( tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+        out << magic << "\n"
+            << model.size() << " " << payload.size() << " " << revision << "\n";
+        out.write( model.data(), model.size() );
+        out.write( payload.data(), payload.size() );
+        out.flush();
+        if( !out.good() ) {
+            out.close();
+            std::remove( tmp.c_str() );
+            return false;
+        }
+    }
+    if( std::rename( tmp.c_str(), path.c_str() ) != 0 ) {
+        std::remove( tmp.c_str() );
+        return false;
+    }
+    return true;
+}
+
+bool
+Hibernation::read( const std::string& path,
+                   std::string& model,
+                   std::string& payload,
+                   unsigned int& revision )
+{
+    std::ifstream in( path.c_str(), std::ios::in | std::ios::binary );
+    std::string line;
+    if( !std::getline( in, line ) || line != magic ) {
+        return false;
+    }
+    size_t model_size = 0;
+    size_t payload_size = 0;
+    if( !std::getline( in, line ) ) {
+        return false;
+    }
+    std::stringstream sizes( line );
+    if( !( sizes >> model_size >> payload_size >> revision ) ) {
+        return false;
+    }
+    model.resize( model_size );
+    payload.resize( payload_size );
+    if( ( model_size > 0 ) && !in.read( &model[0], model_size ) ) {
+        return false;
+    }
+    if( ( payload_size > 0 ) && !in.read( &payload[0], payload_size ) ) {
+        return false;
+    }
+    return in.peek() == std::ifstream::traits_type::eof();
+}
+
+} // of namespace trell
+} // of namespace tinia
@@ -0,0 +1,269 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>      // getenv
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/algorithm/string.hpp>
+#include "tinia/trell/IPCCompositingJobController.hpp"
+#include "tinia/model/Viewer.hpp"
+
+namespace tinia {
+namespace trell {
+namespace {
+    static const std::string package = "IPCCompositingJobController";
+
+    const std::string
+    escape( const std::string& text )
+    {
+        std::string result;
+        for( size_t i=0; i<text.size(); i++ ) {
+            switch( text[i] ) {
+            case '&': result += "&amp;"; break;
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            default:  result += text[i]; break;
+            }
+        }
+        return result;
+    }
+
+    size_t
+    padded( size_t bytes )
+    {
+        return 4*((bytes+3)/4);
+    }
+
+} // of anonymous namespace
+
+
+IPCCompositingJobController::IPCCompositingJobController( const std::vector<std::string>& workers,
+                                                          bool is_master )
+    : IPCJobController( is_master ),
+      m_workers( workers )
+{
+    const char* env = getenv( "TINIA_COMPOSITE_WORKERS" );
+    if( m_workers.empty() && ( env != NULL ) ) {
+        std::string list( env );
+        boost::split( m_workers, list, boost::is_any_of( ";" ) );
+        m_workers.erase( std::remove( m_workers.begin(), m_workers.end(), std::string() ),
+                         m_workers.end() );
+    }
+    m_replies.resize( m_workers.size() );
+}
+
+bool
+IPCCompositingJobController::init()
+{
+    if( !IPCJobController::init() ) {
+        return false;
+    }
+    if( m_workers.empty() ) {
+        m_logger_callback( m_logger_data, 0, package.c_str(), "No workers to composite." );
+        return false;
+    }
+    m_logger_callback( m_logger_data, 2, package.c_str(),
+                       "Compositing %d workers using up to %u threads.",
+                       (int)m_workers.size(), m_compositor.threads() );
+    return true;
+}
+
+const std::string
+IPCCompositingJobController::viewerUpdate( const std::string& key )
+{
+    model::Viewer viewer;
+    m_model->getElementValue( key, viewer );
+
+    std::stringstream xml;
+    xml.precision( 9 );
+    xml << "<State><" << key << "><modelview>";
+    for( size_t i=0; i<16; i++ ) {
+        xml << ( i ? " " : "" ) << viewer.modelviewMatrix[i];
+    }
+    xml << "</modelview><projection>";
+    for( size_t i=0; i<16; i++ ) {
+        xml << ( i ? " " : "" ) << viewer.projectionMatrix[i];
+    }
+    xml << "</projection>"
+        << "<width>" << viewer.width << "</width>"
+        << "<height>" << viewer.height << "</height>"
+        << "<timestamp>" << viewer.timestamp << "</timestamp>"
+        << "<sceneView>" << escape( viewer.sceneView ) << "</sceneView>"
+        << "</" << key << "></State>";
+    return xml.str();
+}
+
+bool
+IPCCompositingJobController::updateWorker( const std::string& worker,
+                                           const std::string& key,
+                                           const std::string& xml )
+{
+    const std::string sent_key = worker + '/' + key;
+    std::map<std::string, std::string>::iterator it = m_sent_viewers.find( sent_key );
+    if( ( it != m_sent_viewers.end() ) && ( it->second == xml ) ) {
+        return true;
+    }
+
+    std::vector<char> query( sizeof(tinia_msg_update_exposed_model_t) + xml.size() );
+    tinia_msg_update_exposed_model_t* q = reinterpret_cast<tinia_msg_update_exposed_model_t*>( &query[0] );
+    memset( q, 0, sizeof(*q) );
+    q->msg.type = TRELL_MESSAGE_UPDATE_STATE;
+    memcpy( &query[0] + sizeof(*q), xml.c_str(), xml.size() );
+
+    tinia_msg_t reply;
+    size_t reply_size = 0;
+    if( ( ipc_msg_client_sendrecv_buffered_by_name( worker.c_str(),
+                                                    m_logger_callback, m_logger_data,
+                                                    &query[0], query.size(),
+                                                    reinterpret_cast<char*>(&reply), &reply_size, sizeof(reply) ) != 0 )
+        || ( reply_size != sizeof(reply) ) || ( reply.type != TRELL_MESSAGE_OK ) )
+    {
+        m_logger_callback( m_logger_data, 0, package.c_str(),
+                           "Failed to update viewer '%s' of worker '%s'.", key.c_str(), worker.c_str() );
+        m_sent_viewers.erase( sent_key );
+        return false;
+    }
+    m_sent_viewers[ sent_key ] = xml;
+    return true;
+}
+
+bool
+IPCCompositingJobController::fetchSnapshot( const std::string&   worker,
+                                            const std::string&   key,
+                                            const std::string&   session,
+                                            size_t               width,
+                                            size_t               height,
+                                            std::vector<char>*   reply,
+                                            char*                ok )
+{
+    *ok = 0;
+
+    tinia_msg_get_snapshot_t query;
+    memset( &query, 0, sizeof(query) );
+    query.msg.type = TRELL_MESSAGE_GET_SNAPSHOT;
+    query.pixel_format = TRELL_PIXEL_FORMAT_RGB_CUSTOM_DEPTH;
+    query.width = width;
+    query.height = height;
+    query.depth_w = width;
+    query.depth_h = height;
+    strncpy( query.session_id, session.c_str(), TRELL_SESSIONID_MAXLENGTH );
+    strncpy( query.key, key.c_str(), TRELL_KEYID_MAXLENGTH );
+    strncpy( query.viewer_key_list, key.c_str(), TRELL_VIEWER_KEY_LIST_MAXLENGTH );
+
+    // Colour, depth and the two matrices.
+    const size_t payload = 2*padded( 3*width*height ) + sizeof(float)*16*2;
+    reply->resize( sizeof(tinia_msg_image_t) + payload );
+
+    size_t reply_size = 0;
+    if( ipc_msg_client_sendrecv_buffered_by_name( worker.c_str(),
+                                                  m_logger_callback, m_logger_data,
+                                                  reinterpret_cast<const char*>(&query), sizeof(query),
+                                                  &(*reply)[0], &reply_size, reply->size() ) != 0 )
+    {
+        m_logger_callback( m_logger_data, 0, package.c_str(),
+                           "Failed to fetch snapshot from worker '%s'.", worker.c_str() );
+        return false;
+    }
+    const tinia_msg_image_t* image = reinterpret_cast<const tinia_msg_image_t*>( &(*reply)[0] );
+    if( ( reply_size < sizeof(tinia_msg_image_t) + 2*padded( 3*width*height ) ) ||
+        ( image->msg.type != TRELL_MESSAGE_IMAGE ) ||
+        ( image->width != width ) || ( image->height != height ) ||
+        ( image->depth_width != width ) || ( image->depth_height != height ) )
+    {
+        m_logger_callback( m_logger_data, 0, package.c_str(),
+                           "Worker '%s' replied with something else than a %dx%d snapshot.",
+                           worker.c_str(), (int)width, (int)height );
+        return false;
+    }
+    *ok = 1;
+    return true;
+}
+
+bool
+IPCCompositingJobController::onGetSnapshot( char*               buffer,
+                                            TrellPixelFormat    pixel_format,
+                                            const size_t        width,
+                                            const size_t        height,
+                                            const size_t        depth_width,
+                                            const size_t        depth_height,
+                                            const bool          depth16,
+                                            const bool          dump_images,
+                                            const std::string&  session,
+                                            const std::string&  key )
+{
+    if( ( pixel_format != TRELL_PIXEL_FORMAT_RGB ) &&
+        ( pixel_format != TRELL_PIXEL_FORMAT_RGB_JPG_VERSION ) &&
+        ( pixel_format != TRELL_PIXEL_FORMAT_RGB_CUSTOM_DEPTH ) )
+    {
+        return false;
+    }
+    if( !m_model->hasElement( key ) ) {
+        m_logger_callback( m_logger_data, 0, package.c_str(), "No viewer '%s'.", key.c_str() );
+        return false;
+    }
+
+    // --- pass the viewer on to the workers -----------------------------------
+    // A worker that is not updated would render with a stale viewer.
+    const std::string xml = viewerUpdate( key );
+    for( size_t i=0; i<m_workers.size(); i++ ) {
+        if( !updateWorker( m_workers[i], key, xml ) ) {
+            return false;
+        }
+    }
+
+    // --- fetch the partial images in parallel --------------------------------
+    std::vector<char> ok( m_workers.size(), 0 );
+    boost::thread_group fetchers;
+    for( size_t i=1; i<m_workers.size(); i++ ) {
+        fetchers.create_thread( boost::bind( &IPCCompositingJobController::fetchSnapshot, this,
+                                             boost::cref( m_workers[i] ), boost::cref( key ),
+                                             boost::cref( session ), width, height,
+                                             &m_replies[i], &ok[i] ) );
+    }
+    fetchSnapshot( m_workers[0], key, session, width, height, &m_replies[0], &ok[0] );
+    fetchers.join_all();
+
+    // Without all the parts, the frame would miss a part of the scene.
+    std::vector<DepthCompositor::Layer> layers;
+    for( size_t i=0; i<m_workers.size(); i++ ) {
+        if( !ok[i] ) {
+            m_logger_callback( m_logger_data, 0, package.c_str(),
+                               "No snapshot of '%s' from worker '%s'.", key.c_str(), m_workers[i].c_str() );
+            return false;
+        }
+        const unsigned char* rgb = reinterpret_cast<const unsigned char*>( &m_replies[i][0] )
+                                   + sizeof(tinia_msg_image_t);
+        layers.push_back( DepthCompositor::Layer( rgb, rgb + padded( 3*width*height ) ) );
+    }
+
+    // --- composite -----------------------------------------------------------
+    m_depth.resize( width*height );
+    unsigned char* rgb = reinterpret_cast<unsigned char*>( buffer );
+    m_compositor.composite( rgb, m_depth.empty() ? NULL : &m_depth[0], layers, width*height );
+    if( pixel_format == TRELL_PIXEL_FORMAT_RGB_CUSTOM_DEPTH ) {
+        DepthCompositor::encode( rgb + padded( 3*width*height ), &m_depth[0],
+                                 width, height, depth_width, depth_height, depth16 );
+    }
+    return true;
+}
+
+} // of namespace trell
+} // of namespace tinia
@@ -27,6 +27,7 @@
 #include <cerrno>
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
 #include <iostream>
 #include "tinia/trell/IPCController.hpp"
 #include <tinia/ipc/ipc_msg.h>
@@ -37,6 +38,23 @@ namespace trell {
 namespace {
 static const std::string package = "IPCController";
 
+time_t
+monotonicSeconds()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec;
+}
+
+/** Microseconds since begin, a CLOCK_MONOTONIC time. */
+unsigned int
+elapsedMicroseconds( const struct timespec& begin )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned int)( 1000000l*( ts.tv_sec - begin.tv_sec ) + ( ts.tv_nsec - begin.tv_nsec )/1000l );
+}
+
 }
 
 
@@ -46,7 +64,8 @@ IPCController::IPCController( bool is_master )
       m_cleanup_pid( -1 ),
       m_msgbox( NULL ),
       m_is_master( is_master ),
-      m_job_state( TRELL_JOBSTATE_NOT_STARTED )
+      m_job_state( TRELL_JOBSTATE_NOT_STARTED ),
+      m_last_request( monotonicSeconds() )
 {
     //instances.push_back(this);
 }
@@ -54,15 +73,21 @@ IPCController::IPCController( bool is_master )
 void
 IPCController::finish()
 {
+    boost::shared_lock<boost::shared_mutex> lock( m_msgbox_mutex );
     m_job_state = TRELL_JOBSTATE_FINISHED;
-    ipc_msg_server_mainloop_break( m_msgbox );
+    if( m_msgbox != NULL ) {
+        ipc_msg_server_mainloop_break( m_msgbox );
+    }
 }
 
 void
 IPCController::fail()
 {
+    boost::shared_lock<boost::shared_mutex> lock( m_msgbox_mutex );
     m_job_state = TRELL_JOBSTATE_FAILED;
-    ipc_msg_server_mainloop_break( m_msgbox );
+    if( m_msgbox != NULL ) {
+        ipc_msg_server_mainloop_break( m_msgbox );
+    }
 }
 
 void
@@ -75,7 +100,19 @@ IPCController::failHard()
 void
 IPCController::notify()
 {
-    ipc_msg_server_notify( m_msgbox );
+    boost::shared_lock<boost::shared_mutex> lock( m_msgbox_mutex );
+    if( m_msgbox != NULL ) {
+        ipc_msg_server_notify( m_msgbox );
+    }
+}
+
+void
+IPCController::notifyRenders()
+{
+    boost::shared_lock<boost::shared_mutex> lock( m_msgbox_mutex );
+    if( m_msgbox != NULL ) {
+        ipc_msg_server_notify_renders( m_msgbox );
+    }
 }
 
 void IPCController::addScript(const std::string &script)
@@ -134,7 +171,11 @@ IPCController::shutdown()
     //    }
     //}
 
+    // Other threads may still be in notify() or finish().
+    boost::unique_lock<boost::shared_mutex> lock( m_msgbox_mutex );
     ipc_msg_server_delete( m_msgbox );
+    m_msgbox = NULL;
+    lock.unlock();
 
     std::cerr << "Done.\n";
     m_cleanup_pid = -1;
@@ -197,9 +238,30 @@ IPCController::message_consumer( void*                     data,
     
     if( !more ) {
         try {
-            ctx->m_output_bytes = ctx->m_ipc_controller->handle( reinterpret_cast<tinia_msg_t*>( ctx->m_buffer ),
-                                                                 ctx->m_buffer_offset,
-                                                                 ctx->m_buffer_size );
+            tinia_msg_t* msg = reinterpret_cast<tinia_msg_t*>( ctx->m_buffer );
+            // Messages from the master do not count as activity.
+            if( ( msg->type != TRELL_MESSAGE_HEARTBEAT ) &&
+                ( msg->type != TRELL_MESSAGE_DIE ) &&
+                ( msg->type != TRELL_MESSAGE_HIBERNATE ) )
+            {
+                ctx->m_ipc_controller->m_last_request = monotonicSeconds();
+            }
+            struct timespec begin;
+            clock_gettime( CLOCK_MONOTONIC, &begin );
+            if( msg->type == TRELL_MESSAGE_ASSIGN_JOB ) {
+                ctx->m_output_bytes = ctx->m_ipc_controller->assign( msg,
+                                                                     ctx->m_buffer_offset,
+                                                                     ctx->m_buffer_size );
+            }
+            else {
+                ctx->m_output_bytes = ctx->m_ipc_controller->handle( msg,
+                                                                     ctx->m_buffer_offset,
+                                                                     ctx->m_buffer_size );
+            }
+            // The reply has overwritten the query in the buffer.
+            if( ctx->m_output_bytes >= sizeof(tinia_msg_t) ) {
+                msg->handle_us = elapsedMicroseconds( begin );
+            }
         }
         catch( const std::exception& e ) {
             ctx->m_ipc_controller->m_logger_callback( ctx->m_ipc_controller->m_logger_data, 0, who.c_str(),
@@ -322,17 +384,48 @@ IPCController::run(int argc, char **argv)
                     ctx.m_ipc_controller = this;
                     ctx.m_buffer_size = 1000*1024*1024;
                     ctx.m_buffer = new char[ctx.m_buffer_size];
-                    if( ipc_msg_server_mainloop( m_msgbox,
-                                                 handle_periodic, &ctx,
-                                                 message_input_handler, &ctx,
-                                                 message_output_handler, &ctx ) == 0 )
-                    {
-                        m_job_state = TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY;
-                    }
-                    else {
-                        m_job_state = TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY;
+                    while( true ) {
+                        if( ipc_msg_server_mainloop( m_msgbox,
+                                                     handle_periodic, &ctx,
+                                                     message_input_handler, &ctx,
+                                                     message_output_handler, &ctx ) == 0 )
+                        {
+                            m_job_state = TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY;
+                        }
+                        else {
+                            m_job_state = TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY;
+                        }
+                        if( m_assigned_id.empty() ) {
+                            break;
+                        }
+
+                        // --- a pre-started job got its id, move message box --
+                        // The shared memory of the message box is named by
+                        // the job id, so the old box is deleted and a new is
+                        // created. A pooled job has no clients yet, but other
+                        // threads of the job (the notification coalescer and
+                        // the render queue) may notify, so they are held off
+                        // until the new box exists.
+                        m_logger_callback( m_logger_data, 2, who.c_str(),
+                                           "Moving message box from '%s' to '%s'.",
+                                           m_id.c_str(), m_assigned_id.c_str() );
+                        boost::unique_lock<boost::shared_mutex> move_lock( m_msgbox_mutex );
+                        ipc_msg_server_delete( m_msgbox );
+                        m_id = m_assigned_id;
+                        m_assigned_id.clear();
+                        m_msgbox = ipc_msg_server_create( m_id.c_str(), m_logger_callback, m_logger_data );
+                        move_lock.unlock();
+                        if( m_msgbox == NULL ) {
+                            m_logger_callback( m_logger_data, 0, who.c_str(),
+                                               "Problem initializing message server '%s'.",
+                                               m_id.c_str() );
+                            m_job_state = TRELL_JOBSTATE_FAILED;
+                            break;
+                        }
+                        m_job_state = TRELL_JOBSTATE_RUNNING;
+                        sendHeartBeat();
                     }
-                    delete reinterpret_cast<char*>( ctx.m_buffer );
+                    delete[] ctx.m_buffer;
                     sendHeartBeat();
                 }
             }
@@ -343,6 +436,35 @@ IPCController::run(int argc, char **argv)
     return EXIT_SUCCESS;
 }
 
+size_t
+IPCController::assign( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
+{
+    static const std::string who = package + ".assign";
+
+    tinia_msg_assign_job_t* query = reinterpret_cast<tinia_msg_assign_job_t*>( msg );
+    if( msg_size < sizeof(tinia_msg_assign_job_t) ) {
+        m_logger_callback( m_logger_data, 0, who.c_str(), "Message too small." );
+        msg->type = TRELL_MESSAGE_ERROR;
+        return sizeof(tinia_msg_t);
+    }
+    query->job_id[ TINIA_IPC_JOBID_MAXLENGTH ] = '\0';
+    if( m_is_master || !m_assigned_id.empty() ||
+        tinia_ipc_util_valid_jobid( m_logger_callback, m_logger_data, query->job_id ) == 0 )
+    {
+        m_logger_callback( m_logger_data, 0, who.c_str(), "Refusing job id." );
+        msg->type = TRELL_MESSAGE_ERROR;
+        return sizeof(tinia_msg_t);
+    }
+    m_logger_callback( m_logger_data, 2, who.c_str(), "Assigned job id '%s'.", query->job_id );
+    m_assigned_id = query->job_id;
+
+    // We're in the mainloop thread, so this just makes the mainloop return
+    // when the reply has been sent.
+    ipc_msg_server_mainloop_break( m_msgbox );
+    msg->type = TRELL_MESSAGE_OK;
+    return sizeof(tinia_msg_t);
+}
+
 TrellMessageType
 IPCController::sendSmallMessage( const std::string& message_box_id, TrellMessageType query )
 {
@@ -385,10 +507,29 @@ IPCController::sendHeartBeat()
     
 
     tinia_msg_heartbeat_t query;
+    memset( &query, 0, sizeof(query) );
     query.msg.type = TRELL_MESSAGE_HEARTBEAT;
     query.state = m_job_state;
     strncpy( query.job_id, m_id.c_str(), TINIA_IPC_JOBID_MAXLENGTH );
     query.job_id[ TINIA_IPC_JOBID_MAXLENGTH ] = '\0';
+
+    double render_ms = 0.0;
+    double readback_ms = 0.0;
+    renderLoad( render_ms, readback_ms );
+    query.render_ms = render_ms;
+    query.readback_ms = readback_ms;
+
+    // --- resident set size, second field of statm, in pages ------------------
+    FILE* statm = fopen( "/proc/self/statm", "r" );
+    if( statm != NULL ) {
+        unsigned long size = 0;
+        unsigned long resident = 0;
+        if( fscanf( statm, "%lu %lu", &size, &resident ) == 2 ) {
+            query.memory_kb = resident*(sysconf( _SC_PAGESIZE )/1024);
+        }
+        fclose( statm );
+    }
+    query.idle_s = monotonicSeconds() - m_last_request;
     
     tinia_msg_t reply;
     size_t reply_actual;
@@ -419,6 +560,13 @@ IPCController::periodic()
 }
 
 
+void
+IPCController::renderLoad( double& render_ms, double& readback_ms )
+{
+    render_ms = 0.0;
+    readback_ms = 0.0;
+}
+
 bool
 IPCController::init()
 {
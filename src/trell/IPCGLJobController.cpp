@@ -17,7 +17,10 @@
  */
 
 #include <cstdlib>      // getenv
+#include <cstring>
+#include <time.h>
 #include <sstream>
+#include <boost/bind.hpp>
 #include <tinia/renderlist/XMLWriter.hpp>
 #include "tinia/trell/IPCGLJobController.hpp"
 
@@ -84,6 +87,19 @@ GLDebugLogWrapper( GLenum source,
 }
 #endif
 
+/** Monotonic time in milliseconds. */
+static
+double
+nowMs()
+{
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return 1000.0*t.tv_sec + t.tv_nsec/1000000.0;
+}
+
+/** Weight of the latest snapshot in the render and readback averages. */
+static const double load_weight = 0.2;
+
 } // of anonymous namespace
 
 
@@ -95,7 +111,13 @@ IPCGLJobController::IPCGLJobController(bool is_master)
     : IPCJobController( is_master ),
       m_openGLJob( NULL ),
       m_context( m_logger_callback, m_logger_data ),
-      m_quality( 0 )
+      m_quality( 0 ),
+      m_render_queue( NULL ),
+      m_async_snapshots( true ),
+      m_render_buffer( NULL ),
+      m_render_buffer_size( 0 ),
+      m_render_ms( 0.0 ),
+      m_readback_ms( 0.0 )
 {
 }
 
@@ -105,18 +127,55 @@ IPCGLJobController::setQuality( int quality )
     m_quality = std::max( 0, std::min( 255, quality ) );
 }
 
+void
+IPCGLJobController::renderLoad( double& render_ms, double& readback_ms )
+{
+    boost::mutex::scoped_lock lock( m_load_mutex );
+    render_ms = m_render_ms;
+    readback_ms = m_readback_ms;
+}
+
 bool
 IPCGLJobController::init()
 {
     // Initialize this
     m_openGLJob = static_cast<jobcontroller::OpenGLJob*>(m_job);
 
+    const char* async_env = getenv( "TINIA_ASYNC_SNAPSHOTS" );
+    // Opt-in, existing jobs do not expect renderFrame to run concurrently
+    // with getRenderList and the model listeners.
+    m_async_snapshots = ( async_env != NULL ) && ( atoi( async_env ) != 0 );
+
+    // A reply is kept a while for its clients, which are woken by the render
+    // notification (model long-polls are not).
+    m_render_queue = new RenderQueue( boost::bind( &IPCController::notifyRenders, this ),
+                                      boost::bind( &model::ExposedModel::getRevisionNumber, m_model ),
+                                      boost::posix_time::seconds( 2 ) );
+    bool context = false;
+    m_render_queue->invoke( boost::bind( &IPCGLJobController::setupContext, this, &context ) );
+    if( !context ) {
+        return false;
+    }
+
+    bool ipcRetVal = IPCJobController::init();
+    bool glRetVal = false;
+    if( ipcRetVal ) {
+        m_render_queue->invoke( boost::bind( &IPCGLJobController::initGL, this, &glRetVal ) );
+    }
+    return (ipcRetVal && glRetVal);
+
+}
+
+void
+IPCGLJobController::setupContext( bool* result )
+{
     // How should we let the job enable debugging? Or specific GL versions?
     bool debug = true;
 
     
     // --- set up OpenGL context ------------------------------------------------
-    // The display to use is passed from the master job via an env-var.
+    // The display (or EGL device, "egl:N") to use is passed from the master job
+    // via an env-var.
     std::string displays;
     {
         const char* t = getenv( "TINIA_RENDERING_DEVICES" );
@@ -125,7 +184,8 @@ IPCGLJobController::init()
                 m_logger_callback( m_logger_data, 0, package.c_str(),
                                    "TINIA_RENDERING_DEVICES environment variable not set." );
             }
-            return false;
+            *result = false;
+            return;
         }
         displays = std::string( t );
     }
@@ -138,7 +198,8 @@ IPCGLJobController::init()
                                "Unable to determine first display in '%s'",
                                displays.c_str() );
         }
-        return false;
+        *result = false;
+        return;
     }
     if( debug ) {
         m_context.requestDebug();
@@ -151,7 +212,8 @@ IPCGLJobController::init()
                                "Failed to create OpenGL context on '%s'.",
                                display.c_str() );
         }
-        return false;
+        *result = false;
+        return;
     }
     if( !m_context.bindContext() ) {
         if( m_logger_callback != NULL ) {
@@ -159,7 +221,8 @@ IPCGLJobController::init()
                                "Failed to bind OpenGL context on '%s'.",
                                display.c_str() );
         }
-        return false;
+        *result = false;
+        return;
     }
     if( m_logger_callback != NULL ) {
         m_logger_callback( m_logger_data, 2, package.c_str(),
@@ -209,10 +272,84 @@ IPCGLJobController::init()
         }
     }
 #endif
-    
-    bool ipcRetVal = IPCJobController::init();
-    return (ipcRetVal && m_openGLJob->initGL());
+    *result = true;
+}
+
+void
+IPCGLJobController::initGL( bool* result )
+{
+    *result = m_openGLJob->initGL();
+}
+
+size_t
+IPCGLJobController::handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
+{
+    if( ( msg->type != TRELL_MESSAGE_GET_SNAPSHOT ) || ( m_render_queue == NULL ) ) {
+        return IPCJobController::handle( msg, msg_size, buf_size );
+    }
+    if( !m_async_snapshots ) {
+        size_t reply_size = 0;
+        m_render_queue->invoke( boost::bind( &IPCGLJobController::renderSnapshot, this,
+                                             msg, msg_size, buf_size, &reply_size ) );
+        return reply_size;
+    }
+
+    // The query is identified by its bytes without the revision it waits
+    // for, which is the current one when it is first sent.
+    std::string query( (const char*)msg, msg_size );
+    unsigned int revision = m_model->getRevisionNumber();
+    if( msg_size >= sizeof(tinia_msg_get_snapshot_t) ) {
+        tinia_msg_get_snapshot_t* q = (tinia_msg_get_snapshot_t*)&query[0];
+        if( q->render_revision != 0u ) {
+            revision = q->render_revision;
+        }
+        q->render_revision = 0u;
+    }
+
+    std::string reply;
+    if( m_render_queue->reply( query,
+                               revision,
+                               boost::bind( &IPCGLJobController::renderReply, this, _1, _2, buf_size ),
+                               reply ) )
+    {
+        if( reply.size() <= buf_size ) {
+            memcpy( msg, reply.data(), reply.size() );
+            return reply.size();
+        }
+        msg->type = TRELL_MESSAGE_ERROR;
+        return sizeof(tinia_msg_t);
+    }
+    tinia_msg_retry_t* retry = (tinia_msg_retry_t*)msg;
+    retry->msg.type = TRELL_MESSAGE_RETRY;
+    retry->revision = revision;
+    return sizeof(tinia_msg_retry_t);
+}
+
+void
+IPCGLJobController::renderSnapshot( tinia_msg_t* msg, size_t msg_size, size_t buf_size, size_t* reply_size )
+{
+    *reply_size = IPCJobController::handle( msg, msg_size, buf_size );
+}
 
+void
+IPCGLJobController::renderReply( const std::string& query, std::string& reply, size_t buf_size )
+{
+    // Only the pages that are written to are touched, so the buffer may be as
+    // large as the message buffer.
+    if( m_render_buffer_size < buf_size ) {
+        delete[] m_render_buffer;
+        m_render_buffer = new char[ buf_size ];
+        m_render_buffer_size = buf_size;
+    }
+    memcpy( m_render_buffer, query.data(), query.size() );
+    size_t reply_size = IPCJobController::handle( (tinia_msg_t*)m_render_buffer, query.size(), buf_size );
+    reply.assign( m_render_buffer, reply_size );
+}
+
+void
+IPCGLJobController::releaseContext()
+{
+    m_context.releaseContext();
 }
 
 bool
@@ -421,9 +558,10 @@ IPCGLJobController::onGetSnapshot( char*               buffer,
         return false;
     }
     
-    GLsizei samples = std::min( std::max( 0,
-                                          (m_max_samples*m_quality+127)/255),
-                                m_max_samples );
+    // No multisampling for the reduced quality frames of progressive refinement.
+    GLsizei samples = m_interactive_frame ? 0 : std::min( std::max( 0,
+                                                                    (m_max_samples*m_quality+127)/255),
+                                                          m_max_samples );
     
 
     // --- get render targets --------------------------------------------------    
@@ -460,6 +598,7 @@ IPCGLJobController::onGetSnapshot( char*               buffer,
         return false;
     }
 
+    const double render_start = nowMs();
     if( env_render->m_samples > 1 ) {
         glEnable( GL_MULTISAMPLE );
     }
@@ -492,6 +631,10 @@ IPCGLJobController::onGetSnapshot( char*               buffer,
                            GL_NEAREST );
     }
     
+    // Wait for the rendering, to tell it apart from the readback.
+    glFinish();
+    const double readback_start = nowMs();
+
     // --- read pixels ---------------------------------------------------------
     glBindFramebuffer( GL_FRAMEBUFFER, env_copy->m_fbo );
     glPixelStorei( GL_PACK_ALIGNMENT, 1 );
@@ -596,12 +739,37 @@ IPCGLJobController::onGetSnapshot( char*               buffer,
         return false;
     }
 
+    const double readback_end = nowMs();
+    {
+        boost::mutex::scoped_lock lock( m_load_mutex );
+        m_render_ms = (1.0-load_weight)*m_render_ms + load_weight*(readback_start-render_start);
+        m_readback_ms = (1.0-load_weight)*m_readback_ms + load_weight*(readback_end-readback_start);
+    }
+
     return true;
 }
 
 void
 IPCGLJobController::cleanup()
 {
+    if( m_render_queue != NULL ) {
+        if( m_logger_callback != NULL ) {
+            m_logger_callback( m_logger_data, 2, package.c_str(),
+                               "Render thread: %lu snapshots rendered, %lu served, %lu retries, %lu expired.",
+                               m_render_queue->rendered(),
+                               m_render_queue->served(),
+                               m_render_queue->deferred(),
+                               m_render_queue->expired() );
+        }
+        // The job's cleanup code runs on this thread, so the context moves here.
+        m_render_queue->invoke( boost::bind( &IPCGLJobController::releaseContext, this ) );
+        delete m_render_queue;
+        m_render_queue = NULL;
+        m_context.bindContext();
+    }
+    delete[] m_render_buffer;
+    m_render_buffer = NULL;
+    m_render_buffer_size = 0;
     IPCJobController::cleanup();
 }
 
@@ -18,8 +18,13 @@
 
 #include <iostream>
 #include <cstring>
+#include <cstdlib>      // getenv
+#include <unistd.h>     // unlink
+#include <sstream>
+#include <boost/bind.hpp>
 #include "tinia/trell/IPCJobController.hpp"
-#include "tinia/model/ExposedModelLock.hpp"
+#include "tinia/trell/Hibernation.hpp"
+#include "tinia/model/ExposedModelTransaction.hpp"
 #include "tinia/model/impl/xml/XMLHandler.hpp"
 
 // This should not be included here, but will be fixed when interface is
@@ -30,13 +35,52 @@ namespace tinia {
 namespace trell {
 namespace {
     static const std::string package = "IPCJobController";
+
+    /** Default minimum time between two notifications of long-pollers. */
+    static const long default_notification_interval_ms = 20;
+
+    /** The snapshot cache statistics are logged this often (in requests). */
+    static const unsigned long snapshot_cache_log_interval = 100;
+
+    /** Width and height of the tiles compared in delta mode. */
+    static const unsigned int delta_tile_size = 64;
+
+    void
+    setImageReply( tinia_msg_image_t* reply,
+                   TrellPixelFormat format,
+                   unsigned int w, unsigned int h,
+                   unsigned int depth_width, unsigned int depth_height,
+                   const std::string& etag,
+                   bool not_modified,
+                   int jpeg_quality = 0,
+                   unsigned int revision = 0 )
+    {
+        reply->msg.type     = TRELL_MESSAGE_IMAGE;
+        reply->width        = w;
+        reply->height       = h;
+        reply->depth_width  = depth_width;
+        reply->depth_height = depth_height;
+        reply->pixel_format = format;
+        strncpy( reply->etag, etag.c_str(), TRELL_ETAG_MAXLENGTH );
+        reply->etag[ TRELL_ETAG_MAXLENGTH ] = '\0';
+        reply->not_modified = not_modified ? 1 : 0;
+        reply->delta_frame  = 0;
+        reply->delta_tiles  = 0;
+        reply->delta_full   = 0;
+        reply->jpeg_quality = jpeg_quality;
+        reply->revision     = revision;
+    }
 } // of anonymous namespace
 
 
 
 IPCJobController::IPCJobController( bool is_master )
     : IPCController( is_master ),
-      m_job( NULL ), m_updateOngoing(false)
+      m_job( NULL ), m_updateOngoing(false), m_notifications( NULL ),
+      m_snapshot_cache( jobcontroller::SnapshotCache::capacityFromEnvironment() ),
+      m_frame_delta( delta_tile_size, jobcontroller::FrameDelta::thresholdFromEnvironment() ),
+      m_refinement( NULL ),
+      m_interactive_frame( false )
 {}
 
 IPCJobController::~IPCJobController()
@@ -61,8 +105,38 @@ bool
 IPCJobController::init()
 {
     bool ipcControllerResponse = IPCController::init( );
+
+    long interval_ms = default_notification_interval_ms;
+    const char* interval_env = getenv( "TINIA_NOTIFICATION_INTERVAL_MS" );
+    if( interval_env != NULL ) {
+        interval_ms = strtol( interval_env, NULL, 10 );
+        if( interval_ms < 0 ) {
+            interval_ms = 0;
+        }
+    }
+    m_notifications = new NotificationCoalescer( boost::bind( &IPCController::notify, this ),
+                                                 boost::posix_time::milliseconds( interval_ms ) );
+    m_logger_callback( m_logger_data, 2, package.c_str(),
+                       "Notification interval is %ld ms.", interval_ms );
+
     bool jobResponse = m_job->init( );
     m_xmlHandler = new model::impl::xml::XMLHandler(m_job->getExposedModel());
+    m_refinement = new jobcontroller::ProgressiveRefinement( m_model );
+
+    // --- a hibernated job is restarted ---------------------------------------
+    const char* restore_path = getenv( "TINIA_RESTORE_STATE" );
+    if( jobResponse && ( restore_path != NULL ) && ( restore_path[0] != '\0' ) ) {
+        const double start = jobcontroller::ProgressiveRefinement::now();
+        if( restoreState( restore_path ) ) {
+            m_logger_callback( m_logger_data, 2, package.c_str(),
+                               "Restored state from '%s' in %.1f ms.",
+                               restore_path, jobcontroller::ProgressiveRefinement::now() - start );
+        }
+        else {
+            m_logger_callback( m_logger_data, 0, package.c_str(),
+                               "Failed to restore state from '%s', starting afresh.", restore_path );
+        }
+    }
 
     return ipcControllerResponse && jobResponse;
 }
@@ -77,9 +151,43 @@ void
 IPCJobController::cleanup()
 {
     m_job->cleanup();
+    if( m_refinement != NULL ) {
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "Progressive refinement: %lu interactive frames, %lu refinements.",
+                           m_refinement->interactiveFrames(),
+                           m_refinement->refinements() );
+        // Stops the helper thread, which updates the model.
+        delete m_refinement;
+        m_refinement = NULL;
+    }
+    if( m_notifications != NULL ) {
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "Notifications requested=%lu, delivered=%lu.",
+                           m_notifications->requested(),
+                           m_notifications->delivered() );
+        // Stops the helper thread before the message server goes away.
+        delete m_notifications;
+        m_notifications = NULL;
+    }
     IPCController::cleanup();
 }
 
+void
+IPCJobController::requestNotification()
+{
+    if( m_notifications != NULL ) {
+        m_notifications->request();
+    }
+}
+
+void
+IPCJobController::flushNotifications()
+{
+    if( m_notifications != NULL ) {
+        m_notifications->flush();
+    }
+}
+
 bool
 IPCJobController::onGetSnapshot( char*               buffer,
                                  TrellPixelFormat    pixel_format,
@@ -125,20 +233,112 @@ IPCJobController::onUpdateState( const char*         buffer,
                                const std::string&  session )
 {
 
-   bool retVal = false;
-   { // Scope for modelLock;
-      model::ExposedModelLock lock(m_model);
+   // All updates from the client get one revision, and the long-pollers are
+   // notified once, when the transaction delivers its batch of events.
+   model::ExposedModelTransaction transaction(m_model);
+   return m_xmlHandler->updateState( buffer, buffer_size );
+}
 
-      // We don't want to be notified of updates when we're updating ourselves
-      m_updateOngoing = true;
-      retVal = m_xmlHandler->updateState( buffer, buffer_size );
-   }
-   // Now is probably a good time to update:
-   // Note: This is thread safe, the worst that can happen is that we post two
-   // updates to the client (instead of one) [in other words: no updates are lost]
-   m_updateOngoing = false;
-   notify();
-   return retVal;
+bool
+IPCJobController::onHibernate( const std::string&  path,
+                               char*               scratch,
+                               const size_t        scratch_size )
+{
+    // Revision 0 gives the whole model, which updateState takes back.
+    const size_t model_size = m_xmlHandler->getExposedModelUpdate( scratch, scratch_size, 0 );
+    if( model_size == 0 ) {
+        return false;
+    }
+    std::string payload;
+    if( !m_job->hibernate( payload ) ) {
+        return false;
+    }
+    return Hibernation::write( path, std::string( scratch, model_size ), payload,
+                               m_model->getRevisionNumber() );
+}
+
+bool
+IPCJobController::restoreState( const std::string& path )
+{
+    std::string model;
+    std::string payload;
+    unsigned int revision = 0u;
+    if( !Hibernation::read( path, model, payload, revision ) ) {
+        return false;
+    }
+    // The clients (and the snapshot caches) hold revisions of the model before
+    // hibernation, the restored elements must be newer than those.
+    m_model->advanceRevisionNumber( revision );
+    bool retVal = false;
+    {
+        model::ExposedModelTransaction transaction(m_model);
+        m_updateOngoing = true;
+        retVal = m_xmlHandler->updateState( model.data(), model.size() );
+    }
+    m_updateOngoing = false;
+    if( !retVal || !m_job->restore( payload ) ) {
+        return false;
+    }
+    unlink( path.c_str() );
+    return true;
+}
+
+size_t
+IPCJobController::handleDeltaSnapshot( tinia_msg_t* msg, size_t buf_size )
+{
+    tinia_msg_get_snapshot_t* q = (tinia_msg_get_snapshot_t*)msg;
+    const unsigned int w = q->width;
+    const unsigned int h = q->height;
+    const std::string session( q->session_id );
+    const std::string key( q->key );
+    const std::string client = std::string( q->client_id ) + "/" + key;
+    const unsigned int base = q->delta_base;
+    m_interactive_frame = false;
+
+    // The frame is compared with the last one before the reply is written
+    // over the query, so it is rendered aside.
+    m_delta_frame.resize( 4*((3*w*h+3)/4) );
+    if ( !onGetSnapshot( (char*)&m_delta_frame[0], TRELL_PIXEL_FORMAT_RGB, w, h, w, h, false, false, session, key ) ) {
+        m_logger_callback( m_logger_data, 0, package.c_str(), "Queried for delta snapshot, rendering error." );
+        msg->type = TRELL_MESSAGE_ERROR;
+        return sizeof(tinia_msg_t);
+    }
+    const jobcontroller::FrameDelta::Delta delta = m_frame_delta.update( client, base, &m_delta_frame[0], w, h, 3*w );
+
+    size_t data_size = 4*sizeof(unsigned int)*delta.tiles.size();
+    for ( size_t i=0; i<delta.tiles.size(); i++ ) {
+        data_size += 4*((3*delta.tiles[i].width*delta.tiles[i].height+3)/4);
+    }
+    if ( buf_size < sizeof(tinia_msg_image_t) + data_size ) {
+        m_logger_callback( m_logger_data, 0, package.c_str(), "Queried for delta snapshot, buffer too small." );
+        msg->type = TRELL_MESSAGE_ERROR;
+        return sizeof(tinia_msg_t);
+    }
+
+    unsigned int* table = (unsigned int*)( (char*)msg + sizeof(tinia_msg_image_t) );
+    unsigned char* pixels = (unsigned char*)( table + 4*delta.tiles.size() );
+    for ( size_t i=0; i<delta.tiles.size(); i++ ) {
+        const jobcontroller::FrameDelta::Tile& tile = delta.tiles[i];
+        table[4*i+0] = tile.x;
+        table[4*i+1] = tile.y;
+        table[4*i+2] = tile.width;
+        table[4*i+3] = tile.height;
+        jobcontroller::FrameDelta::copyTile( &m_delta_frame[0], h, 3*w, tile, pixels, 3*tile.width );
+        pixels += 4*((3*tile.width*tile.height+3)/4);
+    }
+
+    if ( m_frame_delta.frames() % snapshot_cache_log_interval == 0 ) {
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "Delta snapshots: %lu frames, %lu sent whole, %.1f%% of the pixels sent.",
+                           m_frame_delta.frames(), m_frame_delta.fullFrames(), 100.0*m_frame_delta.sentFraction() );
+    }
+
+    tinia_msg_image_t* reply = (tinia_msg_image_t*)msg;
+    setImageReply( reply, TRELL_PIXEL_FORMAT_RGB_DELTA, w, h, 0, 0, std::string(), false );
+    reply->delta_frame = delta.frame;
+    reply->delta_tiles = delta.tiles.size();
+    reply->delta_full  = delta.full ? 1 : 0;
+    return sizeof(tinia_msg_image_t) + data_size;
 }
 
 size_t
@@ -220,6 +420,9 @@ IPCJobController::handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
     case TRELL_MESSAGE_GET_SNAPSHOT:
     {
         tinia_msg_get_snapshot_t* q = (tinia_msg_get_snapshot_t*)msg;
+        if ( q->pixel_format == TRELL_PIXEL_FORMAT_RGB_DELTA ) {
+            return handleDeltaSnapshot( msg, buf_size );
+        }
 
         format  = q->pixel_format;
         w       = q->width;
@@ -228,15 +431,36 @@ IPCJobController::handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
         key     = std::string( q->key );
 
         // These are coming from the url-parameters depth_w and depth_h...
-        int depth_width = q->depth_h;
+        int depth_width = q->depth_w;
         int depth_height = q->depth_h;
         // bool depth16 = q->depth16; @@@ should probably be gotten this way, too... for now, fetching from exposed model below...
         // bool dump_images = q->dump_images; @@@ should probably be gotten this way, too... for now, fetching from exposed model below...
 
         std::string key_list_string = std::string( q->viewer_key_list );
+        // The reply is written over the query, so this must be read first.
+        const std::string client_etag = std::string( q->etag, strnlen( q->etag, TRELL_ETAG_MAXLENGTH ) );
         std::vector<std::string> key_list;
         boost::split( key_list, key_list_string, boost::is_any_of(",") );
 
+        // While the viewers are being interacted with, the frames are smaller
+        // and of lower quality. Not in AP-mode, where the depth must match.
+        jobcontroller::ProgressiveRefinement::Settings refinement;
+        int reply_jpeg_quality = 0;
+        m_interactive_frame = false;
+        if ( ( m_refinement != NULL ) && m_refinement->settings( refinement ) &&
+             ( ( format == TRELL_PIXEL_FORMAT_RGB ) || ( format == TRELL_PIXEL_FORMAT_RGB_JPG_VERSION ) ) )
+        {
+            for (size_t i=0; i<key_list.size(); i++) {
+                // Every viewer must be noted, so no short-circuit here.
+                m_interactive_frame = m_refinement->interactive( key_list[i] ) || m_interactive_frame;
+            }
+            if ( m_interactive_frame ) {
+                w = jobcontroller::ProgressiveRefinement::scaled( w, refinement.scale );
+                h = jobcontroller::ProgressiveRefinement::scaled( h, refinement.scale );
+                reply_jpeg_quality = refinement.jpeg_quality;
+            }
+        }
+
         size_t data_size=0, buf_size_required=0;
         switch ( format ) {
             // @@@
@@ -284,6 +508,42 @@ IPCJobController::handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
             m_model->getElementValue( "ap_dump", dump_images );
         }
 
+        // Unless the model has changed, the pixels are the same as last time.
+        const unsigned int model_revision = m_model->getRevisionNumber();
+        std::string cache_key, etag;
+        if ( m_snapshot_cache.enabled() && !dump_images ) {
+            std::stringstream variant;
+            variant << (int)format << ':' << depth_width << 'x' << depth_height << ':' << depth16
+                    << ':' << m_interactive_frame;
+            cache_key = jobcontroller::SnapshotCache::makeKey( key_list_string, w, h, variant.str(),
+                                                               model_revision );
+            etag = jobcontroller::SnapshotCache::etag( cache_key );
+
+            const unsigned long requests = m_snapshot_cache.hits() + m_snapshot_cache.misses()
+                                           + m_snapshot_cache.notModifiedCount() + 1;
+            if ( requests % snapshot_cache_log_interval == 0 ) {
+                m_logger_callback( m_logger_data, 2, package.c_str(),
+                                   "Snapshot cache: %lu hits, %lu misses, %lu not modified, hit rate %.1f%%.",
+                                   m_snapshot_cache.hits(), m_snapshot_cache.misses(),
+                                   m_snapshot_cache.notModifiedCount(), 100.0*m_snapshot_cache.hitRate() );
+            }
+
+            if ( client_etag == etag ) {
+                m_snapshot_cache.notModified();
+                setImageReply( (tinia_msg_image_t*)msg, format, w, h, depth_width, depth_height, etag, true );
+                return sizeof(tinia_msg_image_t);
+            }
+            jobcontroller::SnapshotCache::Data cached = m_snapshot_cache.lookup( cache_key );
+            if ( cached && ( cached->size() == data_size ) ) {
+                if ( data_size > 0 ) {
+                    memcpy( (char*)msg + sizeof(tinia_msg_image_t), &(*cached)[0], data_size );
+                }
+                setImageReply( (tinia_msg_image_t*)msg, format, w, h, depth_width, depth_height, etag, false,
+                               reply_jpeg_quality, model_revision );
+                return sizeof(tinia_msg_image_t) + data_size;
+            }
+        }
+
         // Looping through all keys and grabbing GL-content
         char *buf = (char*)msg + sizeof(tinia_msg_image_t);
         for (size_t i=0; i<key_list.size(); i++) {
@@ -330,13 +590,11 @@ IPCJobController::handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
             return sizeof(tinia_msg_t);
         }
 
-        tinia_msg_image_t* reply = (tinia_msg_image_t*)msg;
-        reply->msg.type     = TRELL_MESSAGE_IMAGE;
-        reply->width        = w;
-        reply->height       = h;
-        reply->depth_width  = depth_width;
-        reply->depth_height = depth_height;
-        reply->pixel_format = format;
+        if ( !cache_key.empty() ) {
+            m_snapshot_cache.insert( cache_key, (char*)msg + sizeof(tinia_msg_image_t), data_size );
+        }
+        setImageReply( (tinia_msg_image_t*)msg, format, w, h, depth_width, depth_height, etag, false,
+                       reply_jpeg_quality, model_revision );
         m_logger_callback( m_logger_data, 2, package.c_str(), "data_size = %d", data_size );
         return sizeof(tinia_msg_image_t) + data_size; // size of msg + payload
     }
@@ -402,6 +660,34 @@ IPCJobController::handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
     }
         break;
 
+    case TRELL_MESSAGE_HIBERNATE:
+    {
+        tinia_msg_hibernate_t* query = (tinia_msg_hibernate_t*)msg;
+        if( msg_size < sizeof(*query) ) {
+            msg->type = TRELL_MESSAGE_ERROR;
+            return sizeof(tinia_msg_t);
+        }
+        query->path[ sizeof(query->path)-1 ] = '\0';
+        const std::string path( query->path );
+        if( onHibernate( path,
+                         (char*)msg + sizeof(*query),
+                         buf_size - sizeof(*query) ) )
+        {
+            m_logger_callback( m_logger_data, 2, package.c_str(),
+                               "Hibernating to '%s'.", path.c_str() );
+            // The mainloop returns when the reply has been sent.
+            finish();
+            msg->type = TRELL_MESSAGE_OK;
+        }
+        else {
+            m_logger_callback( m_logger_data, 1, package.c_str(),
+                               "Cannot hibernate, keeps running." );
+            msg->type = TRELL_MESSAGE_ERROR;
+        }
+        return sizeof(tinia_msg_t);
+    }
+        break;
+
     case TRELL_MESSAGE_GET_SCRIPTS:
     {
         
@@ -451,7 +737,27 @@ void trell::IPCJobController::stateElementModified(model::StateElement *stateEle
 
    if(!m_updateOngoing)
    {
-      notify();
+      requestNotification();
+   }
+}
+
+void trell::IPCJobController::stateElementsModified(std::vector<model::StateElement>& stateElements)
+{
+   // The end of a transaction, one notification for the whole batch, now.
+   if(!m_updateOngoing)
+   {
+      requestNotification();
+      flushNotifications();
+   }
+}
+
+void trell::IPCJobController::stateElementsReleased(std::vector<model::StateElement>& stateElements)
+{
+   // The end of an ExposedModelLock, as for a transaction.
+   if(!m_updateOngoing)
+   {
+      requestNotification();
+      flushNotifications();
    }
 }
 
@@ -460,7 +766,7 @@ void trell::IPCJobController::stateSchemaElementAdded(model::StateSchemaElement
 
    if(!m_updateOngoing)
    {
-      notify();
+      requestNotification();
    }
 }
 
@@ -469,7 +775,7 @@ void trell::IPCJobController::stateSchemaElementRemoved(model::StateSchemaElemen
 
    if(!m_updateOngoing)
    {
-      notify();
+      requestNotification();
    }
 }
 
@@ -478,7 +784,7 @@ void trell::IPCJobController::stateSchemaElementModified(model::StateSchemaEleme
 
    if(!m_updateOngoing)
    {
-      notify();
+      requestNotification();
    }
 }
 
@@ -0,0 +1,127 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/trell/NotificationCoalescer.hpp"
+
+namespace tinia {
+namespace trell {
+
+NotificationCoalescer::NotificationCoalescer( boost::function<void()> deliver,
+                                              boost::posix_time::time_duration interval )
+    : m_deliver( deliver ),
+      m_interval( interval ),
+      m_last_delivery( boost::posix_time::min_date_time ),
+      m_pending( false ),
+      m_stop( false ),
+      m_requested( 0u ),
+      m_delivered( 0u )
+{
+    m_thread = boost::thread( &NotificationCoalescer::run, this );
+}
+
+NotificationCoalescer::~NotificationCoalescer()
+{
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+void
+NotificationCoalescer::request()
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    m_requested++;
+    m_pending = true;
+
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    if( m_last_delivery + m_interval <= now ) {
+        deliver( lock );
+    }
+    else {
+        // Let the helper thread deliver when the interval expires.
+        m_cond.notify_all();
+    }
+}
+
+void
+NotificationCoalescer::flush()
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    if( m_pending ) {
+        deliver( lock );
+    }
+}
+
+void
+NotificationCoalescer::setInterval( boost::posix_time::time_duration interval )
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    m_interval = interval;
+    m_cond.notify_all();
+}
+
+unsigned long
+NotificationCoalescer::requested() const
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    return m_requested;
+}
+
+unsigned long
+NotificationCoalescer::delivered() const
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    return m_delivered;
+}
+
+void
+NotificationCoalescer::deliver( boost::mutex::scoped_lock& lock )
+{
+    // Clear the flag before delivering, such that requests arriving while we
+    // deliver result in another notification.
+    m_pending = false;
+    m_delivered++;
+    m_last_delivery = boost::posix_time::microsec_clock::universal_time();
+    lock.unlock();
+    m_deliver();
+    lock.lock();
+}
+
+void
+NotificationCoalescer::run()
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    while( !m_stop ) {
+        if( !m_pending ) {
+            m_cond.wait( lock );
+            continue;
+        }
+        boost::posix_time::ptime due = m_last_delivery + m_interval;
+        if( boost::posix_time::microsec_clock::universal_time() < due ) {
+            m_cond.timed_wait( lock, due );
+            continue;
+        }
+        deliver( lock );
+    }
+}
+
+} // of namespace trell
+} // of namespace tinia
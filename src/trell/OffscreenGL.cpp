@@ -21,9 +21,15 @@
 #include <X11/Xutil.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
+#ifdef TINIA_HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include <vector>
 #include <iostream>
+#include <sstream>
 #include <cstring>
+#include <cstdlib>
 #include "tinia/trell/OffscreenGL.hpp"
 
 namespace tinia {
@@ -53,6 +59,9 @@ OffscreenGL::OffscreenGL( void (*logger)( void* data, int level, const char* who
       m_screen_number( -1 ),
       m_display( NULL ),
       m_context( NULL ),
+      m_egl_display( NULL ),
+      m_egl_context( NULL ),
+      m_egl_surface( NULL ),
       m_req_profile(false),
       m_req_debug( false )
 {
@@ -77,6 +86,10 @@ OffscreenGL::setupContext( const std::string& display_string )
     
     m_display_string = display_string;
     m_logger_who = "OffscreenGL|" + m_display_string;
+
+    if( isEGLDevice( m_display_string ) ) {
+        return setupEGLContext();
+    }
     
     XVisualInfo* vis = NULL;
     GLXFBConfig* glx_fb_configs = NULL;
@@ -303,8 +316,223 @@ cleanup:
     return m_state >= STATE_INITIALIZED;
 }
 
+bool
+OffscreenGL::isEGLDevice( const std::string& display_string )
+{
+    return display_string.compare( 0, 4, "egl:" ) == 0;
+}
+
+bool
+OffscreenGL::hasEGL()
+{
+#ifdef TINIA_HAVE_EGL
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::list<std::string>
+OffscreenGL::eglDevices()
+{
+    std::list<std::string> devices;
+#ifdef TINIA_HAVE_EGL
+    const char* client_extensions = eglQueryString( EGL_NO_DISPLAY, EGL_EXTENSIONS );
+    if( client_extensions == NULL ) {
+        return devices;     // No EGL 1.5 or EGL_EXT_client_extensions.
+    }
+    if( strstr( client_extensions, "EGL_EXT_device_enumeration" ) != NULL ) {
+        PFNEGLQUERYDEVICESEXTPROC eglQueryDevicesEXT_f =
+                (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress( "eglQueryDevicesEXT" );
+        EGLint count = 0;
+        if( ( eglQueryDevicesEXT_f != NULL ) && eglQueryDevicesEXT_f( 0, NULL, &count ) ) {
+            for( EGLint i=0; i<count; i++ ) {
+                std::stringstream id;
+                id << "egl:" << i;
+                devices.push_back( id.str() );
+            }
+        }
+    }
+    if( strstr( client_extensions, "EGL_MESA_platform_surfaceless" ) != NULL ) {
+        devices.push_back( "egl:surfaceless" );
+    }
+#endif
+    return devices;
+}
+
+bool
+OffscreenGL::setupEGLContext()
+{
+#ifdef TINIA_HAVE_EGL
+    const std::string device = m_display_string.substr( 4 );
+    const char* client_extensions = eglQueryString( EGL_NO_DISPLAY, EGL_EXTENSIONS );
+    PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT_f =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+    if( ( client_extensions == NULL ) || ( eglGetPlatformDisplayEXT_f == NULL ) ) {
+        if( m_logger != NULL ) {
+            m_logger( m_logger_data, 0, m_logger_who.c_str(), "EGL_EXT_platform_base not supported." );
+        }
+        m_state = STATE_FAILED_TO_OPEN_DISPLAY;
+        return false;
+    }
+
+    // --- get the display of the device ---------------------------------------
+    EGLDisplay display = EGL_NO_DISPLAY;
+    if( device == "surfaceless" ) {
+        if( strstr( client_extensions, "EGL_MESA_platform_surfaceless" ) != NULL ) {
+            display = eglGetPlatformDisplayEXT_f( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL );
+        }
+    }
+    else {
+        PFNEGLQUERYDEVICESEXTPROC eglQueryDevicesEXT_f =
+                (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress( "eglQueryDevicesEXT" );
+        char* end = NULL;
+        const long index = strtol( device.c_str(), &end, 10 );
+        EGLint count = 0;
+        if( !device.empty() && ( *end == '\0' )
+                && ( eglQueryDevicesEXT_f != NULL ) && eglQueryDevicesEXT_f( 0, NULL, &count )
+                && ( index >= 0 ) && ( index < count ) )
+        {
+            std::vector<EGLDeviceEXT> devices( count );
+            if( eglQueryDevicesEXT_f( count, devices.data(), &count ) && ( index < count ) ) {
+                display = eglGetPlatformDisplayEXT_f( EGL_PLATFORM_DEVICE_EXT, devices[index], NULL );
+            }
+        }
+    }
+    if( display == EGL_NO_DISPLAY ) {
+        if( m_logger != NULL ) {
+            m_logger( m_logger_data, 0, m_logger_who.c_str(), "No such EGL device." );
+        }
+        m_state = STATE_FAILED_TO_OPEN_DISPLAY;
+        return false;
+    }
+    EGLint egl_major, egl_minor;
+    if( !eglInitialize( display, &egl_major, &egl_minor ) ) {
+        if( m_logger != NULL ) {
+            m_logger( m_logger_data, 0, m_logger_who.c_str(),
+                      "eglInitialize failed: 0x%x.", eglGetError() );
+        }
+        m_state = STATE_FAILED_TO_OPEN_DISPLAY;
+        return false;
+    }
+    m_egl_display = display;
+    if( !eglBindAPI( EGL_OPENGL_API ) ) {
+        if( m_logger != NULL ) {
+            m_logger( m_logger_data, 0, m_logger_who.c_str(), "Desktop OpenGL not supported by EGL." );
+        }
+        m_state = STATE_EGL_ERROR;
+        return false;
+    }
+    const char* extensions = eglQueryString( display, EGL_EXTENSIONS );
+    const bool has_surfaceless_context = ( extensions != NULL ) && ( strstr( extensions, "EGL_KHR_surfaceless_context" ) != NULL );
+    const bool has_create_context = ( ( egl_major == 1 ) && ( egl_minor >= 5 ) ) || ( egl_major > 1 ) ||
+                                    ( ( extensions != NULL ) && ( strstr( extensions, "EGL_KHR_create_context" ) != NULL ) );
+
+    // --- choose a config, a pbuffer is needed without surfaceless contexts ---
+    EGLConfig config = NULL;
+    EGLint configs_N = 0;
+    EGLint config_attrib[] = {
+        EGL_SURFACE_TYPE,       EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE,    EGL_OPENGL_BIT,
+        EGL_RED_SIZE,           1,
+        EGL_GREEN_SIZE,         1,
+        EGL_BLUE_SIZE,          1,
+        EGL_NONE
+    };
+    if( !eglChooseConfig( display, config_attrib, &config, 1, &configs_N ) || ( configs_N < 1 ) ) {
+        config = NULL;
+        if( !has_surfaceless_context ) {
+            if( m_logger != NULL ) {
+                m_logger( m_logger_data, 0, m_logger_who.c_str(), "No suitable EGL config." );
+            }
+            m_state = STATE_EGL_ERROR;
+            return false;
+        }
+    }
+
+    // --- create context, first with the requested profile --------------------
+    if( has_create_context ) {
+        std::vector<EGLint> attribs;
+        if( m_req_profile ) {
+            attribs.push_back( EGL_CONTEXT_MAJOR_VERSION_KHR );
+            attribs.push_back( m_req_profile_args.m_major );
+            attribs.push_back( EGL_CONTEXT_MINOR_VERSION_KHR );
+            attribs.push_back( m_req_profile_args.m_minor );
+            attribs.push_back( EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR );
+            attribs.push_back( (m_req_profile_args.m_core ? EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR : 0 ) |
+                               (m_req_profile_args.m_compatibility ? EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT_KHR : 0 ) );
+        }
+        if( m_req_debug ) {
+            attribs.push_back( EGL_CONTEXT_FLAGS_KHR );
+            attribs.push_back( EGL_CONTEXT_OPENGL_DEBUG_BIT_KHR );
+        }
+        attribs.push_back( EGL_NONE );
+        m_egl_context = eglCreateContext( display, config, EGL_NO_CONTEXT, attribs.data() );
+        if( ( m_egl_context != EGL_NO_CONTEXT ) && ( m_logger != NULL ) ) {
+            m_logger( m_logger_data, 2, m_logger_who.c_str(),
+                      "eglCreateContext with attributes succeeded." );
+        }
+    }
+    if( m_egl_context == EGL_NO_CONTEXT ) {
+        m_egl_context = eglCreateContext( display, config, EGL_NO_CONTEXT, NULL );
+    }
+    if( m_egl_context == EGL_NO_CONTEXT ) {
+        m_egl_context = NULL;
+        if( m_logger != NULL ) {
+            m_logger( m_logger_data, 0, m_logger_who.c_str(),
+                      "eglCreateContext failed: 0x%x.", eglGetError() );
+        }
+        m_state = STATE_EGL_ERROR;
+        return false;
+    }
+
+    // --- a surface to use with our context, unless surfaceless ---------------
+    if( !has_surfaceless_context ) {
+        EGLint pbuffer_attrib[] = {
+            EGL_WIDTH,  32,
+            EGL_HEIGHT, 32,
+            EGL_NONE
+        };
+        m_egl_surface = eglCreatePbufferSurface( display, config, pbuffer_attrib );
+        if( m_egl_surface == EGL_NO_SURFACE ) {
+            m_egl_surface = NULL;
+            if( m_logger != NULL ) {
+                m_logger( m_logger_data, 0, m_logger_who.c_str(),
+                          "eglCreatePbufferSurface failed: 0x%x.", eglGetError() );
+            }
+            m_state = STATE_EGL_ERROR;
+            return false;
+        }
+    }
+    if( m_logger != NULL ) {
+        m_logger( m_logger_data, 2, m_logger_who.c_str(), "EGL %d.%d context created (%s).",
+                  egl_major, egl_minor, has_surfaceless_context ? "surfaceless" : "pbuffer" );
+    }
+    m_state = STATE_INITIALIZED;
+    return true;
+#else
+    if( m_logger != NULL ) {
+        m_logger( m_logger_data, 0, m_logger_who.c_str(), "Built without EGL support." );
+    }
+    m_state = STATE_FAILED_TO_OPEN_DISPLAY;
+    return false;
+#endif
+}
+
 OffscreenGL::~OffscreenGL()
 {
+#ifdef TINIA_HAVE_EGL
+    if( m_egl_display != NULL ) {
+        eglMakeCurrent( m_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+        if( m_egl_surface != NULL ) {
+            eglDestroySurface( m_egl_display, m_egl_surface );
+        }
+        if( m_egl_context != NULL ) {
+            eglDestroyContext( m_egl_display, m_egl_context );
+        }
+        eglTerminate( m_egl_display );
+    }
+#endif
     //XDestroyWindow( m_display, m_window );
     
     if( m_context != NULL ) {
@@ -320,6 +548,15 @@ bool
 OffscreenGL::bindContext()
 {
     if( m_state >= STATE_INITIALIZED ) {
+#ifdef TINIA_HAVE_EGL
+        if( m_egl_display != NULL ) {
+            EGLSurface surface = m_egl_surface != NULL ? m_egl_surface : EGL_NO_SURFACE;
+            if( eglMakeCurrent( m_egl_display, surface, surface, m_egl_context ) ) {
+                m_state = STATE_CONTEXT_BOUND;
+            }
+            return m_state == STATE_CONTEXT_BOUND;
+        }
+#endif
         if( glXMakeCurrent( m_display, m_window, m_context ) ) {
             m_state = STATE_CONTEXT_BOUND;
         }
@@ -329,6 +566,27 @@ OffscreenGL::bindContext()
     return true;    
 }
 
+bool
+OffscreenGL::releaseContext()
+{
+    if( m_state == STATE_CONTEXT_BOUND ) {
+#ifdef TINIA_HAVE_EGL
+        if( m_egl_display != NULL ) {
+            if( !eglMakeCurrent( m_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT ) ) {
+                return false;
+            }
+            m_state = STATE_INITIALIZED;
+            return true;
+        }
+#endif
+        if( !glXMakeCurrent( m_display, None, NULL ) ) {
+            return false;
+        }
+        m_state = STATE_INITIALIZED;
+    }
+    return true;
+}
+
 void
 OffscreenGL::requestProfile( int major, int minor, bool core, bool compatibility )
 {
@@ -0,0 +1,195 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/trell/RenderQueue.hpp"
+
+namespace tinia {
+namespace trell {
+
+RenderQueue::RenderQueue( boost::function<void()> notify,
+                          boost::function<unsigned int()> revision,
+                          boost::posix_time::time_duration max_age )
+    : m_notify( notify ),
+      m_revision( revision ),
+      m_max_age( max_age ),
+      m_stop( false ),
+      m_tasks_queued( 0u ),
+      m_tasks_done( 0u ),
+      m_rendered( 0u ),
+      m_deferred( 0u ),
+      m_served( 0u ),
+      m_expired( 0u )
+{
+    m_thread = boost::thread( &RenderQueue::run, this );
+}
+
+RenderQueue::~RenderQueue()
+{
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+void
+RenderQueue::invoke( boost::function<void()> task )
+{
+    if( boost::this_thread::get_id() == m_thread.get_id() ) {
+        task();
+        return;
+    }
+    boost::mutex::scoped_lock lock( m_mutex );
+    const unsigned long ticket = m_tasks_queued++;
+    m_tasks.push_back( task );
+    m_cond.notify_all();
+    // Tasks are run in order, so ours is done when as many have been done.
+    while( m_tasks_done <= ticket ) {
+        m_cond.wait( lock );
+    }
+}
+
+bool
+RenderQueue::reply( const std::string& query, unsigned int revision,
+                    const Render& render, std::string& reply )
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    expire( boost::posix_time::microsec_clock::universal_time() );
+
+    Entry& entry = m_entries[ query ];
+    if( entry.m_done && ( entry.m_started >= revision ) ) {
+        reply = entry.m_reply;
+        m_served++;
+        return true;
+    }
+    // The reply, if any, is kept for the clients it is good enough for until
+    // the new render replaces it. A render that is already running may have
+    // started before revision, so another one is queued.
+    if( !entry.m_queued ) {
+        entry.m_render = render;
+        entry.m_queued = true;
+        m_renders.push_back( query );
+        m_cond.notify_all();
+    }
+    m_deferred++;
+    return false;
+}
+
+unsigned long
+RenderQueue::rendered() const
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    return m_rendered;
+}
+
+unsigned long
+RenderQueue::deferred() const
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    return m_deferred;
+}
+
+unsigned long
+RenderQueue::served() const
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    return m_served;
+}
+
+unsigned long
+RenderQueue::expired() const
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    return m_expired;
+}
+
+void
+RenderQueue::expire( const boost::posix_time::ptime& now )
+{
+    std::map<std::string, Entry>::iterator it = m_entries.begin();
+    while( it != m_entries.end() ) {
+        const Entry& entry = it->second;
+        if( entry.m_done && !entry.m_queued && !entry.m_rendering &&
+            ( entry.m_finished + m_max_age < now ) )
+        {
+            m_entries.erase( it++ );
+            m_expired++;
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void
+RenderQueue::run()
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    while( true ) {
+        if( !m_tasks.empty() ) {
+            boost::function<void()> task = m_tasks.front();
+            m_tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+            m_tasks_done++;
+            m_cond.notify_all();
+            continue;
+        }
+        if( m_stop ) {
+            break;
+        }
+        if( m_renders.empty() ) {
+            m_cond.wait( lock );
+            continue;
+        }
+
+        const std::string query = m_renders.front();
+        m_renders.pop_front();
+        Render render;
+        {
+            Entry& entry = m_entries[ query ];
+            entry.m_queued = false;
+            entry.m_rendering = true;
+            render = entry.m_render;
+        }
+        lock.unlock();
+        // Read before rendering, so the reply shows this revision or a later.
+        const unsigned int started = m_revision();
+        std::string reply;
+        render( query, reply );
+        lock.lock();
+
+        // Entries that are rendering are not expired, so it is still here.
+        Entry& entry = m_entries[ query ];
+        entry.m_reply.swap( reply );
+        entry.m_rendering = false;
+        entry.m_done = true;
+        entry.m_started = started;
+        entry.m_finished = boost::posix_time::microsec_clock::universal_time();
+        m_rendered++;
+
+        lock.unlock();
+        m_notify();
+        lock.lock();
+    }
+}
+
+} // of namespace trell
+} // of namespace tinia
@@ -0,0 +1,511 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <boost/thread.hpp>
+#include <boost/algorithm/string.hpp>
+#include "tinia/ipc/ipc_msg.h"
+#include "tinia/trell/trell.h"
+#include "tinia/jobcontroller/ModelChannel.hpp"
+#include "Gateway.hpp"
+
+namespace tinia {
+namespace trell {
+namespace impl {
+namespace {
+
+using tinia::jobcontroller::ModelChannel;
+
+/** Seconds a long-poll to the job waits for a notification before it is
+ * reissued. Also bounds how long a closed channel keeps its poll thread.
+ */
+const int longPollTimeout = 10;
+
+/** Largest handshake request accepted. */
+const size_t maxHandshakeSize = 16384;
+
+void
+logger( void* data, int level, const char* who, const char* msg, ... )
+{
+    char buf[1024];
+    va_list args;
+    va_start( args, msg );
+    vsnprintf( buf, sizeof(buf), msg, args );
+    va_end( args );
+    switch( level ) {
+    case 0: std::cerr << "[E] "; break;
+    case 1: std::cerr << "[W] "; break;
+    default: return;    // Only problems, a busy gateway would drown in the rest.
+    }
+    std::cerr << '[' << ( who != NULL ? who : "" ) << "] " << buf << std::endl;
+}
+
+/** Writes all of data, false if the connection failed. */
+bool
+writeAll( int socket, const std::string& data )
+{
+    size_t offset = 0;
+    while( offset < data.size() ) {
+        const ssize_t n = send( socket, data.data() + offset, data.size() - offset, MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( n <= 0 ) {
+            return false;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+/** Value of a header field of the request, or an empty string. */
+std::string
+headerField( const std::string& request, const std::string& field )
+{
+    std::vector<std::string> lines;
+    boost::split( lines, request, boost::is_any_of( "\n" ) );
+    for( size_t i=1; i<lines.size(); i++ ) {
+        const size_t colon = lines[i].find( ':' );
+        if( colon != std::string::npos && boost::iequals( lines[i].substr( 0, colon ), field ) ) {
+            return boost::trim_copy( lines[i].substr( colon + 1 ) );
+        }
+    }
+    return std::string();
+}
+
+/** True if id is a non-empty, not too long string of [A-Za-z0-9_], as mod_trell requires. */
+bool
+validId( const std::string& id, size_t max_length )
+{
+    if( id.empty() || id.size() > max_length ) {
+        return false;
+    }
+    for( size_t i=0; i<id.size(); i++ ) {
+        if( !( isalnum( (unsigned char)id[i] ) || id[i] == '_' ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Finds the job and session of path /.../job/<jobid>/<sessionid>/model_channel. */
+bool
+parsePath( const std::string& request, std::string& jobid, std::string& sessionid )
+{
+    std::vector<std::string> words;
+    const std::string line = request.substr( 0, request.find( '\r' ) );
+    boost::split( words, line, boost::is_any_of( " " ) );
+    if( words.size() != 3 || words[0] != "GET" ) {
+        return false;
+    }
+    std::vector<std::string> items;
+    const std::string path = words[1].substr( 0, words[1].find( '?' ) );
+    boost::split( items, path, boost::is_any_of( "/" ), boost::token_compress_on );
+    for( size_t i=0; i+3<items.size(); i++ ) {
+        if( items[i] == "job" ) {
+            jobid = items[i+1];
+            sessionid = items[i+2];
+            return ( items[i+3] == "model_channel" ) &&
+                   validId( jobid, TINIA_IPC_JOBID_MAXLENGTH ) &&
+                   validId( sessionid, TRELL_SESSIONID_MAXLENGTH );
+        }
+    }
+    return false;
+}
+
+/** A query to the job: a message struct, followed by a body, in parts. */
+struct Query
+{
+    const char*         m_header;
+    size_t              m_header_size;
+    const std::string*  m_body;
+    size_t              m_offset;
+};
+
+int
+produceQuery( void* data, int* more, char* buffer, size_t* buffer_bytes,
+              const size_t buffer_size, const int part )
+{
+    Query* query = (Query*)data;
+    if( part == 0 ) {
+        query->m_offset = 0;    // Resent after a notification.
+    }
+    const size_t body_size = query->m_body != NULL ? query->m_body->size() : 0;
+    const size_t total = query->m_header_size + body_size;
+    size_t n = 0;
+    while( n < buffer_size && query->m_offset < total ) {
+        if( query->m_offset < query->m_header_size ) {
+            const size_t c = std::min( buffer_size - n, query->m_header_size - query->m_offset );
+            memcpy( buffer + n, query->m_header + query->m_offset, c );
+            n += c;
+            query->m_offset += c;
+        }
+        else {
+            const size_t o = query->m_offset - query->m_header_size;
+            const size_t c = std::min( buffer_size - n, body_size - o );
+            memcpy( buffer + n, query->m_body->data() + o, c );
+            n += c;
+            query->m_offset += c;
+        }
+    }
+    *buffer_bytes = n;
+    *more = query->m_offset < total ? 1 : 0;
+    return 0;
+}
+
+/** The reply of the job: its type, and the body after the message struct. */
+struct Reply
+{
+    int             m_type;
+    std::string     m_body;
+    bool            m_longpoll;     // Wait for a notification if the reply is OK.
+};
+
+int
+consumeReply( void* data, const char* buffer, const size_t buffer_bytes,
+              const int part, const int more )
+{
+    Reply* reply = (Reply*)data;
+    if( part == 0 ) {
+        if( buffer_bytes < sizeof(tinia_msg_t) ) {
+            return -1;
+        }
+        reply->m_type = ((const tinia_msg_t*)buffer)->type;
+        reply->m_body.clear();
+        if( reply->m_type == TRELL_MESSAGE_OK && reply->m_longpoll ) {
+            return 1;
+        }
+        if( reply->m_type == TRELL_MESSAGE_XML ) {
+            reply->m_body.append( buffer + sizeof(tinia_msg_xml_t), buffer_bytes - sizeof(tinia_msg_xml_t) );
+        }
+        return 0;
+    }
+    reply->m_body.append( buffer, buffer_bytes );
+    return 0;
+}
+
+/** One model channel: the client end is the socket, the job end two IPC
+ * clients, one for the updates and one for the long-poll.
+ */
+class Session
+{
+public:
+    Session( int socket, const std::string& jobid, const std::string& sessionid )
+        : m_socket( socket ),
+          m_jobid( jobid ),
+          m_sessionid( sessionid ),
+          m_client_buffer( tinia_ipc_msg_client_t_sizeof ),
+          m_client( NULL ),
+          m_synced( false ),
+          m_stop( false )
+    {
+    }
+
+    ~Session()
+    {
+        if( m_client != NULL ) {
+            tinia_ipc_msg_client_release( m_client );
+        }
+    }
+
+    /** Connects to the job, false if there is no such job. */
+    bool
+    open()
+    {
+        tinia_ipc_msg_client_t* client = (tinia_ipc_msg_client_t*)&m_client_buffer[0];
+        if( tinia_ipc_msg_client_init( client, m_jobid.c_str(), logger, NULL ) != 0 ) {
+            return false;
+        }
+        m_client = client;
+        return true;
+    }
+
+    /** Reads from the client until the channel or the socket is closed. */
+    void
+    run()
+    {
+        boost::thread poller( &Session::poll, this );
+
+        std::vector<char> buffer( 65536 );
+        while( true ) {
+            const ssize_t n = recv( m_socket, &buffer[0], buffer.size(), 0 );
+            if( n < 0 && errno == EINTR ) {
+                continue;
+            }
+            if( n <= 0 ) {
+                break;
+            }
+            std::vector<ModelChannel::Message> updates;
+            {
+                boost::mutex::scoped_lock lock( m_mutex );
+                m_channel.receive( &buffer[0], n );
+                ModelChannel::Message message;
+                while( m_channel.next( message ) ) {
+                    if( message.type == "sync" ) {
+                        m_synced = true;
+                        m_cond.notify_all();
+                    }
+                    else if( message.type == "update" ) {
+                        updates.push_back( message );
+                    }
+                }
+            }
+            for( size_t i=0; i<updates.size(); i++ ) {
+                if( !postUpdate( updates[i].body ) ) {
+                    logger( NULL, 0, "Gateway", "Job '%s' did not take update %lu.",
+                            m_jobid.c_str(), updates[i].sequence );
+                }
+                boost::mutex::scoped_lock lock( m_mutex );
+                std::stringstream sequence;
+                sequence << updates[i].sequence;
+                m_channel.send( "ack", 0, sequence.str() );
+            }
+            if( !flush() ) {
+                break;
+            }
+        }
+
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            m_stop = true;
+            m_cond.notify_all();
+        }
+        shutdown( m_socket, SHUT_RDWR );
+        poller.join();
+    }
+
+protected:
+    /** Sends the output of the channel, false if the channel is done. */
+    bool
+    flush()
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        const bool ok = writeAll( m_socket, m_channel.takeOutput() );
+        return ok && !m_channel.closed();
+    }
+
+    bool
+    postUpdate( const std::string& xml )
+    {
+        tinia_msg_update_exposed_model_t header;
+        memset( &header, 0, sizeof(header) );
+        header.msg.type = TRELL_MESSAGE_UPDATE_STATE;
+        strncpy( header.session_id, m_sessionid.c_str(), TRELL_SESSIONID_MAXLENGTH );
+
+        Query query = { (const char*)&header, sizeof(header), &xml, 0 };
+        Reply reply;
+        reply.m_longpoll = false;
+        const int rv = tinia_ipc_msg_client_sendrecv( m_client, produceQuery, &query,
+                                                      consumeReply, &reply, 0 );
+        return rv == 0 && reply.m_type == TRELL_MESSAGE_OK;
+    }
+
+    /** Long-polls the job for revisions newer than the client has, and
+      * pushes them. Runs until the session stops.
+      */
+    void
+    poll()
+    {
+        std::vector<char> poll_client_buffer( tinia_ipc_msg_client_t_sizeof );
+        tinia_ipc_msg_client_t* client = (tinia_ipc_msg_client_t*)&poll_client_buffer[0];
+        if( tinia_ipc_msg_client_init( client, m_jobid.c_str(), logger, NULL ) != 0 ) {
+            boost::mutex::scoped_lock lock( m_mutex );
+            m_channel.close();
+            writeAll( m_socket, m_channel.takeOutput() );
+            return;
+        }
+        bool first = true;
+        while( true ) {
+            tinia_msg_get_exposed_model_t header;
+            memset( &header, 0, sizeof(header) );
+            header.msg.type = TRELL_MESSAGE_GET_POLICY_UPDATE;
+            strncpy( header.session_id, m_sessionid.c_str(), TRELL_SESSIONID_MAXLENGTH );
+            {
+                boost::mutex::scoped_lock lock( m_mutex );
+                while( !m_synced && !m_stop ) {
+                    m_cond.wait( lock );
+                }
+                if( m_stop ) {
+                    break;
+                }
+                header.revision = m_channel.revision();
+            }
+
+            Query query = { (const char*)&header, sizeof(header), NULL, 0 };
+            Reply reply;
+            // The first answer is sent right away, so the client knows the
+            // channel is up even when it is up to date.
+            reply.m_longpoll = !first;
+            const int rv = tinia_ipc_msg_client_sendrecv( client, produceQuery, &query,
+                                                          consumeReply, &reply,
+                                                          first ? 0 : longPollTimeout );
+            if( rv < -1 ) {
+                logger( NULL, 0, "Gateway", "Long-poll to job '%s' failed.", m_jobid.c_str() );
+                boost::mutex::scoped_lock lock( m_mutex );
+                m_channel.close();
+                writeAll( m_socket, m_channel.takeOutput() );
+                shutdown( m_socket, SHUT_RDWR );
+                break;
+            }
+            if( rv != 0 ) {
+                continue;   // Timed out, nothing new.
+            }
+
+            boost::mutex::scoped_lock lock( m_mutex );
+            if( reply.m_type == TRELL_MESSAGE_XML ) {
+                const std::string xml( reply.m_body.c_str() );  // Without trailing zeros.
+                m_channel.send( "model", ModelChannel::revisionOf( xml ), xml );
+            }
+            else if( first ) {
+                m_channel.send( "model", m_channel.revision() );
+            }
+            first = false;
+            if( !writeAll( m_socket, m_channel.takeOutput() ) ) {
+                break;
+            }
+        }
+        tinia_ipc_msg_client_release( client );
+    }
+
+    int                         m_socket;
+    std::string                 m_jobid;
+    std::string                 m_sessionid;
+    std::vector<char>           m_client_buffer;
+    tinia_ipc_msg_client_t*     m_client;       // For the updates, NULL until open.
+    ModelChannel                m_channel;
+    bool                        m_synced;
+    bool                        m_stop;
+    boost::mutex                m_mutex;
+    boost::condition_variable   m_cond;
+};
+
+} // of anonymous namespace
+
+
+Gateway::Gateway( const std::string& address, int port )
+    : m_address( address ),
+      m_port( port )
+{
+}
+
+int
+Gateway::run()
+{
+    signal( SIGPIPE, SIG_IGN );
+
+    const int listener = socket( AF_INET, SOCK_STREAM, 0 );
+    if( listener < 0 ) {
+        logger( NULL, 0, "Gateway", "socket: %s", strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    int on = 1;
+    setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+
+    sockaddr_in address;
+    memset( &address, 0, sizeof(address) );
+    address.sin_family = AF_INET;
+    address.sin_port = htons( m_port );
+    if( inet_pton( AF_INET, m_address.c_str(), &address.sin_addr ) != 1 ) {
+        logger( NULL, 0, "Gateway", "Invalid address '%s'.", m_address.c_str() );
+        close( listener );
+        return EXIT_FAILURE;
+    }
+    if( bind( listener, (sockaddr*)&address, sizeof(address) ) != 0 || listen( listener, 64 ) != 0 ) {
+        logger( NULL, 0, "Gateway", "Cannot listen on %s:%d: %s", m_address.c_str(), m_port, strerror( errno ) );
+        close( listener );
+        return EXIT_FAILURE;
+    }
+    logger( NULL, 1, "Gateway", "Listening on %s:%d.", m_address.c_str(), m_port );
+
+    while( true ) {
+        const int connection = accept( listener, NULL, NULL );
+        if( connection < 0 ) {
+            if( errno == EINTR || errno == ECONNABORTED ) {
+                continue;
+            }
+            logger( NULL, 0, "Gateway", "accept: %s", strerror( errno ) );
+            break;
+        }
+        boost::thread( &Gateway::serve, connection ).detach();
+    }
+    close( listener );
+    return EXIT_FAILURE;
+}
+
+void
+Gateway::serve( int socket )
+{
+    // Small frames should go out at once, that is the point of the channel.
+    int on = 1;
+    setsockopt( socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+
+    std::string request;
+    std::vector<char> buffer( 4096 );
+    while( request.find( "\r\n\r\n" ) == std::string::npos && request.size() < maxHandshakeSize ) {
+        const ssize_t n = recv( socket, &buffer[0], buffer.size(), 0 );
+        if( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( n <= 0 ) {
+            close( socket );
+            return;
+        }
+        request.append( &buffer[0], n );
+    }
+    // Clients wait for the handshake before they send frames, so nothing
+    // follows the request.
+    std::string jobid;
+    std::string sessionid;
+    const std::string key = headerField( request, "Sec-WebSocket-Key" );
+    if( !parsePath( request, jobid, sessionid ) ||
+        !boost::iequals( headerField( request, "Upgrade" ), "websocket" ) || key.empty() )
+    {
+        writeAll( socket, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" );
+        close( socket );
+        return;
+    }
+    Session session( socket, jobid, sessionid );
+    if( !session.open() ) {
+        writeAll( socket, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" );
+        close( socket );
+        return;
+    }
+    if( writeAll( socket, ModelChannel::handshakeResponse( key ) ) ) {
+        session.run();
+    }
+    close( socket );
+}
+
+} // of namespace impl
+} // of namespace trell
+} // of namespace tinia
@@ -0,0 +1,75 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+namespace tinia {
+namespace trell {
+namespace impl {
+
+/** WebSocket gateway to the jobs of the server deployment.
+ *
+ * mod_trell answers one request per Apache child, which suits the long-poll
+ * and post transport, but not a WebSocket that stays open. The gateway is a
+ * standalone process that accepts the model channels of the clients (see
+ * tinia::jobcontroller::ModelChannel) on
+ *
+ *    /trell/job/<jobid>/<sessionid>/model_channel
+ *
+ * and speaks the tinia IPC protocol to the job, as mod_trell does: updates
+ * from the client are passed on as TRELL_MESSAGE_UPDATE_STATE, and a
+ * TRELL_MESSAGE_GET_POLICY_UPDATE long-poll is kept open to the job, whose
+ * replies are pushed to the client.
+ *
+ * Apache forwards the channels to the gateway with mod_proxy_wstunnel (see
+ * config/mod_trell.conf), so that they share origin with the rest of the job.
+ * Each channel has a thread that reads from the client, and a thread that
+ * waits on the job.
+ */
+class Gateway
+{
+public:
+    /** \param address  Address to listen on, usually the loopback.
+      * \param port     Port to listen on.
+      */
+    Gateway( const std::string& address, int port );
+
+    /** Accepts channels until the process is killed.
+      *
+      * \return EXIT_FAILURE if the socket could not be set up.
+      */
+    int
+    run();
+
+    /** Serves one connection, from the handshake until it is closed. Closes
+      * the socket.
+      */
+    static
+    void
+    serve( int socket );
+
+protected:
+    std::string     m_address;
+    int             m_port;
+};
+
+} // of namespace impl
+} // of namespace trell
+} // of namespace tinia
@@ -0,0 +1,38 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include "Gateway.hpp"
+
+// Usage: tinia_trell_gateway [port [address]]
+//
+// The defaults are env['TINIA_GATEWAY_PORT'] or 8082, on 127.0.0.1.
+int
+main( int argc, char** argv )
+{
+    int port = 8082;
+    const char* port_env = getenv( "TINIA_GATEWAY_PORT" );
+    if( port_env != NULL && atoi( port_env ) > 0 ) {
+        port = atoi( port_env );
+    }
+    if( argc > 1 ) {
+        port = atoi( argv[1] );
+    }
+    tinia::trell::impl::Gateway gateway( argc > 2 ? argv[2] : "127.0.0.1", port );
+    exit( gateway.run() );
+}
@@ -183,6 +183,18 @@ Applications::xml() const
     return xml.str();
 }
 
+const std::list<std::string>
+Applications::binaries() const
+{
+    std::list<std::string> binaries;
+    if( m_state == STATE_OK ) {
+        for( std::list<Application>::const_iterator it=m_applications.begin(); it != m_applications.end(); ++it ) {
+            binaries.push_back( it->appBinary() );
+        }
+    }
+    return binaries;
+}
+
 } // of namespace impl
 } // of namespace trell
 } // of namespace tinia
@@ -46,6 +46,10 @@ public:
     
     const std::string
     xml() const;
+
+    /** The binaries of the applications found at the last refresh. */
+    const std::list<std::string>
+    binaries() const;
     
 protected:
     State                   m_state;
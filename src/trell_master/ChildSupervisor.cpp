@@ -0,0 +1,299 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdint>
+#include "ChildSupervisor.hpp"
+
+namespace tinia {
+namespace trell {
+namespace impl {
+namespace {
+static const char* package = "ChildSupervisor";
+
+int
+pidfdOpen( pid_t pid )
+{
+#ifdef SYS_pidfd_open
+    return syscall( SYS_pidfd_open, pid, 0 );
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+} // of anonymous namespace
+
+ChildSupervisor::ChildSupervisor( void (*logger)( void* data, int level, const char* who, const char* message, ... ),
+                                  void* logger_data )
+    : m_logger( logger ),
+      m_logger_data( logger_data ),
+      m_signal_fd( -1 ),
+      m_event_fd( -1 ),
+      m_stop( false ),
+      m_wakeup_pending( false )
+{
+}
+
+ChildSupervisor::~ChildSupervisor()
+{
+    stop();
+}
+
+bool
+ChildSupervisor::blockInProcess()
+{
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGCHLD );
+    return pthread_sigmask( SIG_BLOCK, &mask, NULL ) == 0;
+}
+
+bool
+ChildSupervisor::start( const boost::function<bool ()>& wakeup )
+{
+    if( running() ) {
+        return true;
+    }
+    // Blocking it here would only cover this thread, not those that exist.
+    sigset_t mask;
+    if( (pthread_sigmask( SIG_BLOCK, NULL, &mask ) != 0) || (sigismember( &mask, SIGCHLD ) != 1) ) {
+        if( m_logger != NULL ) {
+            m_logger( m_logger_data, 0, package, "SIGCHLD is not blocked, see blockInProcess." );
+        }
+        return false;
+    }
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGCHLD );
+    m_signal_fd = signalfd( -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC );
+    if( m_signal_fd < 0 ) {
+        if( m_logger != NULL ) {
+            m_logger( m_logger_data, 0, package, "signalfd failed: %s", strerror( errno ) );
+        }
+        return false;
+    }
+    m_event_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( m_event_fd < 0 ) {
+        if( m_logger != NULL ) {
+            m_logger( m_logger_data, 0, package, "eventfd failed: %s", strerror( errno ) );
+        }
+        close( m_signal_fd );
+        m_signal_fd = -1;
+        return false;
+    }
+    m_wakeup = wakeup;
+    m_stop = false;
+    m_thread = boost::thread( &ChildSupervisor::run, this );
+    return true;
+}
+
+void
+ChildSupervisor::stop()
+{
+    if( !running() ) {
+        return;
+    }
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_stop = true;
+    }
+    poke();
+    m_thread.join();
+    for( std::map<pid_t, int>::iterator it=m_pidfds.begin(); it!=m_pidfds.end(); ++it ) {
+        close( it->second );
+    }
+    m_pidfds.clear();
+    m_children.clear();
+    close( m_event_fd );
+    close( m_signal_fd );
+    m_event_fd = -1;
+    m_signal_fd = -1;
+}
+
+void
+ChildSupervisor::watchChild( pid_t pid )
+{
+    if( !running() ) {
+        return;
+    }
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_children.insert( pid );
+    }
+    // It may have exited before it was added.
+    poke();
+}
+
+bool
+ChildSupervisor::watch( pid_t pid )
+{
+    if( !running() ) {
+        return false;
+    }
+    int fd = pidfdOpen( pid );
+    if( fd < 0 ) {
+        if( errno == ESRCH ) {
+            // Already gone.
+            {
+                boost::mutex::scoped_lock lock( m_mutex );
+                Exit exit = { pid, -1 };
+                m_exits.push_back( exit );
+            }
+            poke();
+            return true;
+        }
+        return false;
+    }
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_pidfds[ pid ] = fd;
+    }
+    poke();
+    return true;
+}
+
+std::vector<ChildSupervisor::Exit>
+ChildSupervisor::exits()
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    std::vector<Exit> exits;
+    exits.swap( m_exits );
+    m_wakeup_pending = false;
+    return exits;
+}
+
+void
+ChildSupervisor::unblockInChild()
+{
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGCHLD );
+    sigprocmask( SIG_UNBLOCK, &mask, NULL );
+}
+
+void
+ChildSupervisor::poke()
+{
+    uint64_t one = 1;
+    if( write( m_event_fd, &one, sizeof(one) ) < 0 ) {
+        // Counter full, the thread has plenty to wake up to.
+    }
+}
+
+void
+ChildSupervisor::reap()
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    for( std::set<pid_t>::iterator it=m_children.begin(); it!=m_children.end(); ) {
+        int status = -1;
+        pid_t pid = waitpid( *it, &status, WNOHANG );
+        if( (pid == 0) || ((pid < 0) && (errno == EINTR)) ) {
+            ++it;
+            continue;
+        }
+        // ECHILD if someone else reaped it, and then the status is unknown.
+        Exit exit = { *it, pid > 0 ? status : -1 };
+        m_exits.push_back( exit );
+        m_children.erase( it++ );
+    }
+}
+
+void
+ChildSupervisor::run()
+{
+    std::vector<struct pollfd> fds;
+    std::vector<pid_t> pids;
+    while( true ) {
+        // --- set up what to wait for -----------------------------------------
+        bool wakeup = false;
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            if( m_stop ) {
+                break;
+            }
+            fds.resize( 2 + m_pidfds.size() );
+            pids.resize( m_pidfds.size() );
+            fds[0].fd = m_signal_fd;
+            fds[1].fd = m_event_fd;
+            size_t i = 0;
+            for( std::map<pid_t, int>::iterator it=m_pidfds.begin(); it!=m_pidfds.end(); ++it, ++i ) {
+                fds[2+i].fd = it->second;
+                pids[i] = it->first;
+            }
+            for( size_t i=0; i<fds.size(); i++ ) {
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+            }
+            wakeup = !m_exits.empty() && !m_wakeup_pending;
+            m_wakeup_pending = m_wakeup_pending || wakeup;
+        }
+        if( wakeup && !m_wakeup() ) {
+            boost::mutex::scoped_lock lock( m_mutex );
+            m_wakeup_pending = false;
+        }
+
+        // --- wait ------------------------------------------------------------
+        if( poll( &fds[0], fds.size(), -1 ) < 0 ) {
+            if( errno != EINTR ) {
+                if( m_logger != NULL ) {
+                    m_logger( m_logger_data, 0, package, "poll failed: %s", strerror( errno ) );
+                }
+                break;
+            }
+            continue;
+        }
+        if( fds[0].revents & POLLIN ) {
+            struct signalfd_siginfo info;
+            while( read( m_signal_fd, &info, sizeof(info) ) == sizeof(info) ) {}
+        }
+        if( fds[1].revents & POLLIN ) {
+            uint64_t count;
+            if( read( m_event_fd, &count, sizeof(count) ) < 0 ) {
+                // Nothing to read, someone else got it.
+            }
+        }
+        // Also after a poke, as watchChild may come after the SIGCHLD.
+        if( (fds[0].revents | fds[1].revents) & POLLIN ) {
+            reap();
+        }
+        for( size_t i=0; i<pids.size(); i++ ) {
+            if( fds[2+i].revents != 0 ) {
+                boost::mutex::scoped_lock lock( m_mutex );
+                std::map<pid_t, int>::iterator it = m_pidfds.find( pids[i] );
+                if( it != m_pidfds.end() ) {
+                    close( it->second );
+                    m_pidfds.erase( it );
+                }
+                Exit exit = { pids[i], -1 };
+                m_exits.push_back( exit );
+            }
+        }
+    }
+}
+
+} // of namespace impl
+} // of namespace trell
+} // of namespace tinia
@@ -0,0 +1,139 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <sys/types.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+
+namespace tinia {
+namespace trell {
+namespace impl {
+
+/** Watches the processes of the master, and tells when they exit.
+  *
+  * A thread waits in poll() on a signalfd for SIGCHLD, which reaps the
+  * children that have been given to watchChild, and on a pidfd for each
+  * process that is not a child (jobs adopted from a previous master). Other
+  * children of the process are left alone. When processes have exited,
+  * the wakeup function is invoked from that thread, which the master uses to
+  * send a message to its own message box, so that the exits are handled in
+  * the mainloop as soon as they happen.
+  */
+class ChildSupervisor
+{
+public:
+
+    /** A process that has exited. */
+    struct Exit
+    {
+        pid_t   m_pid;
+        /** The status from waitpid, or -1 if the process was not a child. */
+        int     m_status;
+    };
+
+    ChildSupervisor( void (*logger)( void* data, int level, const char* who, const char* message, ... ) = NULL,
+                     void* logger_data = NULL );
+
+    ~ChildSupervisor();
+
+    /** Block SIGCHLD in the calling thread.
+      *
+      * Must be invoked in main before any threads are created, such that all
+      * threads inherit the mask and no thread takes SIGCHLD from the
+      * signalfd. Children must invoke unblockInChild before exec.
+      */
+    static
+    bool
+    blockInProcess();
+
+    /** Start the supervisor thread.
+      *
+      * Fails if SIGCHLD is not blocked, see blockInProcess.
+      *
+      * \param wakeup  Invoked when there are exits to fetch, returns false if
+      *                the exits could not be handed over (then it is invoked
+      *                again on the next exit).
+      */
+    bool
+    start( const boost::function<bool ()>& wakeup );
+
+    /** Stop the supervisor thread. */
+    void
+    stop();
+
+    /** True if the supervisor thread is running. */
+    bool
+    running() const
+    { return m_signal_fd >= 0; }
+
+    /** Watch a child of the master, which is reaped when it exits. */
+    void
+    watchChild( pid_t pid );
+
+    /** Watch a process that is not a child of the master.
+      *
+      * \returns False if the process could not be watched (no pidfd support).
+      */
+    bool
+    watch( pid_t pid );
+
+    /** The processes that have exited since last time. */
+    std::vector<Exit>
+    exits();
+
+    /** Unblock SIGCHLD in a forked child, before exec. */
+    static
+    void
+    unblockInChild();
+
+protected:
+    void                  (*m_logger)( void* data, int level, const char* who, const char* message, ... );
+    void*                   m_logger_data;
+    boost::function<bool ()> m_wakeup;
+    int                     m_signal_fd;
+    /** Written to when the thread should look at m_pidfds or m_stop again. */
+    int                     m_event_fd;
+    boost::thread           m_thread;
+    boost::mutex            m_mutex;
+    bool                    m_stop;
+    bool                    m_wakeup_pending;
+    std::map<pid_t, int>    m_pidfds;
+    /** The children to reap, see watchChild. */
+    std::set<pid_t>         m_children;
+    std::vector<Exit>       m_exits;
+
+    void
+    run();
+
+    /** Reap the exited children of m_children, invoked in the supervisor
+      * thread. */
+    void
+    reap();
+
+    /** Wake the supervisor thread. */
+    void
+    poke();
+
+};
+
+} // of namespace impl
+} // of namespace trell
+} // of namespace tinia
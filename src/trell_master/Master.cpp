@@ -23,14 +23,18 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <unistd.h>
 #include <iostream>
 #include <vector>
 #include <cstring>
 #include <sstream>
 #include <vector>
 #include <fstream>
+#include <algorithm>
 #include <libxml/xmlreader.h>
+#include <boost/bind.hpp>
 #include "Master.hpp"
+#include "tinia/trell/Hibernation.hpp"
 #include <sys/mman.h>
 #include <cstdarg>
 #include <cstdio>
@@ -53,6 +57,7 @@ static const std::string package = "Master";
         NODE_REVOKE_ACCESS,
         NODE_LIST_RENDERING_DEVICES,
         NODE_LIST_APPLICATIONS,
+        NODE_RESUME_JOB,
         // Parameter nodes
         NODE_JOB,
         NODE_APPLICATION,
@@ -71,7 +76,8 @@ static const std::string package = "Master";
 	    NODE_PID,
 	    NODE_APPLICATION,
 	    NODE_ARG,
-	    NODE_STATE
+	    NODE_STATE,
+	    NODE_WIPE
 	};
     };
 }
@@ -90,21 +96,36 @@ static const std::string ret_footer  = "</reply>";
 static const std::string ret_pong    = ret_header + "<pong/>" + ret_footer;
 static const std::string ret_success = ret_header + "<result>SUCCESS</result>" + ret_footer;
 static const std::string ret_failure = ret_header + "<result>FAILURE</result>" + ret_footer;
+static const std::string ret_pending = ret_header + "<result>PENDING</result>" + ret_footer;
 }
 
 namespace {
 
+static const std::string default_state_path = "/tmp/trell_master_state";
 
-static sig_atomic_t sigchild_flag = 0;
+/** The journal is folded into the state file when it has this many records,
+  * or twice as many as there are jobs. */
+static const size_t journal_min_records = 256;
 
+/** Splits a ';'-separated list from the environment. */
 static
-void
-handle_SIGCHLD( int )
+std::vector<std::string>
+getenvList( const char* name )
 {
-    sigchild_flag = 1;
-    std::cerr << "handle_SIGCHLD\n";
+    std::vector<std::string> items;
+    const char* value = getenv( name );
+    if( value != NULL ) {
+        std::stringstream list( value );
+        std::string item;
+        while( std::getline( list, item, ';' ) ) {
+            if( !item.empty() ) {
+                items.push_back( item );
+            }
+        }
+    }
+    return items;
 }
-    
+
 }
 
 const std::string
@@ -123,12 +144,72 @@ Master::Master( bool for_real )
 : IPCController( true ),
   m_for_real( for_real ),
   m_applications( getApplicationRoot() ),
-  m_rendering_devices( m_logger_callback, m_logger_data )
+  m_rendering_devices( m_logger_callback, m_logger_data ),
+  m_supervisor( m_logger_callback, m_logger_data ),
+  m_state_path( default_state_path ),
+  m_journal_path( default_state_path + ".journal" ),
+  m_journal_fd( -1 ),
+  m_journal_records( 0 ),
+  m_pool_size( 0 ),
+  m_pool_devices( getenvList( "TINIA_JOB_POOL_DEVICES" ) ),
+  m_pool_apps( getenvList( "TINIA_JOB_POOL_APPS" ) ),
+  m_pool_timestamp( 0 ),
+  m_pool_serial( 0 ),
+  m_pool_hits( 0 ),
+  m_pool_misses( 0 ),
+  m_cold_starts( 0 ),
+  m_cold_start_ms( 0.0 ),
+  m_warm_starts( 0 ),
+  m_warm_start_ms( 0.0 ),
+  m_hibernate_idle_s( 0 ),
+  m_hibernations( 0 ),
+  m_restores( 0 ),
+  m_restore_ms( 0.0 ),
+  m_rpc_schema( NULL ),
+  m_rpc_validator( NULL )
 {
     m_application_root = std::string( getApplicationRoot() );
+    const char* pool_size = getenv( "TINIA_JOB_POOL_SIZE" );
+    if( pool_size != NULL && atoi( pool_size ) > 0 ) {
+        m_pool_size = atoi( pool_size );
+    }
+    const char* hibernate_idle_s = getenv( "TINIA_HIBERNATE_IDLE_S" );
+    if( hibernate_idle_s != NULL && atoi( hibernate_idle_s ) > 0 ) {
+        m_hibernate_idle_s = atoi( hibernate_idle_s );
+    }
+    const char* rpc_schema = getenv( "TINIA_RPC_SCHEMA" );
+    if( rpc_schema != NULL ) {
+        xmlSchemaParserCtxtPtr pctx = xmlSchemaNewParserCtxt( rpc_schema );
+        if( pctx != NULL ) {
+            m_rpc_schema = xmlSchemaParse( pctx );
+            xmlSchemaFreeParserCtxt( pctx );
+        }
+        if( m_rpc_schema != NULL ) {
+            m_rpc_validator = xmlSchemaNewValidCtxt( m_rpc_schema );
+        }
+        if( m_rpc_validator == NULL ) {
+            std::cerr << "Failed to load schema '" << rpc_schema << "', queries are not validated." << std::endl;
+        }
+    }
     if( m_logger_callback != NULL ) {
         m_logger_callback( m_logger_data, 2, package.c_str(),
                            "TINIA_APP_ROOT=%s", m_application_root.c_str() );
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "TINIA_JOB_POOL_SIZE=%d", (int)m_pool_size );
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "TINIA_HIBERNATE_IDLE_S=%u", m_hibernate_idle_s );
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "TINIA_RPC_SCHEMA=%s", rpc_schema != NULL ? rpc_schema : "" );
+    }
+}
+
+Master::~Master()
+{
+    if( m_rpc_validator != NULL ) {
+        xmlSchemaFreeValidCtxt( m_rpc_validator );
+    }
+    if( m_rpc_schema != NULL ) {
+        xmlSchemaFree( m_rpc_schema );
     }
 }
 
@@ -205,6 +286,21 @@ Master::handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
                 retval = ret_failure;
             }
             break;
+        case ParsedXML::ACTION_RESUME_JOB:
+            switch( resumeJob( data.m_job ) ) {
+            case RESUME_RUNNING:
+                retval = ret_success;
+                break;
+            case RESUME_PENDING:
+                retval = ret_pending;
+                break;
+            case RESUME_FAILED:
+                m_logger_callback( m_logger_data, 1, package.c_str(),
+                                   "Received xml-rpc: resumeJob(%s): failure.", data.m_job.c_str() );
+                retval = ret_failure;
+                break;
+            }
+            break;
         case ParsedXML::ACTION_GET_JOB_LIST:
             m_logger_callback( m_logger_data, 2, package.c_str(),
                                "Received xml-rpc: getJobList." );
@@ -262,7 +358,28 @@ Master::handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
 
         std::string job = q->job_id;
         setJobState( job, q->state, true );
+        if( msg_size >= sizeof(tinia_msg_heartbeat_t) ) {
+            DevicePlacement::Load load;
+            load.m_render_ms = q->render_ms;
+            load.m_readback_ms = q->readback_ms;
+            load.m_memory_kb = q->memory_kb;
+            m_placement.update( job, load );
 
+            auto it = m_jobs.find( job );
+            if( it != m_jobs.end() ) {
+                it->second.m_idle_s = q->idle_s;
+                if( q->idle_s < m_hibernate_idle_s ) {
+                    it->second.m_hibernate_refused = false;
+                }
+            }
+        }
+
+        tinia_msg_t* reply = (tinia_msg_t*)msg;
+        reply->type = TRELL_MESSAGE_OK;
+        return sizeof(tinia_msg_t);
+    }
+    else if( msg->type == TRELL_MESSAGE_CHILD_EXITED ) {
+        reapChildren();
         tinia_msg_t* reply = (tinia_msg_t*)msg;
         reply->type = TRELL_MESSAGE_OK;
         return sizeof(tinia_msg_t);
@@ -282,27 +399,45 @@ Master::init( )
 {
     if( IPCController::init() ) {
         snarfMasterState();
+        dumpMasterState();
 
-        // --- Install signal handlers ---------------------------------------------
-        struct sigaction act;
-        memset( &act, 0, sizeof(act) );
-        sigemptyset( &act.sa_mask );
-    
-        act.sa_handler = handle_SIGCHLD;
-        if( sigaction( SIGCHLD, &act, NULL ) != 0 ) {
-            std::cerr << "sigaction/SIGCHLD failed: " << strerror( errno ) << "\n";
-            return false;
+        // --- devices that new jobs are placed on -----------------------------
+        if( m_for_real ) {
+            std::vector<std::string> devices = getenvList( "TINIA_RENDERING_DEVICES" );
+            if( devices.empty() ) {
+                const std::list<std::string> ids = m_rendering_devices.ids();
+                devices.assign( ids.begin(), ids.end() );
+            }
+            m_placement.setDevices( devices );
+            for( size_t i=0; i<devices.size(); i++ ) {
+                m_logger_callback( m_logger_data, 2, package.c_str(),
+                                   "Placing jobs on rendering device '%s'.", devices[i].c_str() );
+            }
         }
-    
-        // --- Unblock signals we want ---------------------------------------------
-        sigset_t mask;
-        sigemptyset( &mask );
-        sigaddset( &mask, SIGCHLD );
-        if( sigprocmask( SIG_UNBLOCK, &mask, NULL ) != 0 ) {
-            std::cerr << "sigprocmask failed: " << strerror( errno ) << "\n";
-            return false;
+        for( auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
+            if( !it->second.m_rendering_devices.empty() ) {
+                m_placement.assign( it->first, it->second.m_rendering_devices[0] );
+            }
+        }
+
+        // --- Watch the jobs ---------------------------------------------------
+        // The supervisor tells about exits by sending a message to ourselves.
+        if( m_for_real &&
+            !m_supervisor.start( boost::bind( &Master::sendSmallMessage, this, getMasterID(),
+                                              TRELL_MESSAGE_CHILD_EXITED ) == TRELL_MESSAGE_OK ) )
+        {
+            m_logger_callback( m_logger_data, 1, package.c_str(),
+                               "Failed to start supervisor, checking jobs periodically." );
+        }
+        // Jobs of a previous master are not our children.
+        for( auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
+            if( !alive( it->second ) ) {
+                continue;
+            }
+            if( !m_supervisor.watch( it->second.m_pid ) ) {
+                m_unwatched.insert( it->first );
+            }
         }
-        
         return true;
     }
     else {
@@ -313,51 +448,213 @@ Master::init( )
 bool
 Master::periodic()
 {
-    std::cerr << "Periodic func...\n";
     bool ret = IPCController::periodic();
-    dumpMasterState();
+    reapChildren();
+
+    // --- jobs that the supervisor does not watch -----------------------------
     for( auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
-        if( !( (it->second.m_state == TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY) ||
-               (it->second.m_state == TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY ) ) ) {
-            if( kill( it->second.m_pid, 0 ) < 0 ) {
-                std::cerr << "Job '" << it->second.m_id << "' cannot receive signals, probably dead.\n";
-                setJobState( it->second.m_id, TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY );
-            }
-            else {
-                std::cerr << "Job '" << it->second.m_id << "' is probably alive.\n";
-            }
+        if( m_supervisor.running() && (m_unwatched.find( it->first ) == m_unwatched.end()) ) {
+            continue;
+        }
+        if( alive( it->second ) && (kill( it->second.m_pid, 0 ) < 0) ) {
+            m_logger_callback( m_logger_data, 1, package.c_str(),
+                               "Job '%s' cannot receive signals, probably dead.", it->first.c_str() );
+            jobExited( it->second.m_pid, -1 );
         }
     }
+    hibernateIdleJobs();
+    refillPool();
     return ret;
 }
 
 void
-Master::often()
+Master::reapChildren()
 {
-    while( sigchild_flag != 0 ) {
-        sigchild_flag = 0;
-        
-        std::cerr << "Got SIGCHLD, checking for dead children.\n";
-        pid_t pid;
-        while( (pid = waitpid( -1, NULL, WNOHANG )) > 0 ) {
-            std::cerr << "pid=" << pid << " is dead.\n";
-            bool found_job = false;
-            for( auto it=m_jobs.begin(); (it!=m_jobs.end()) && (!found_job); ++it ) {
-                if( it->second.m_pid == pid ) {
-                    found_job = true;
-                    if( it->second.m_state != TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY ) {
-                        setJobState( it->second.m_id, TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY );
-                        cleanJobRemains( it->second.m_id );
-                    }
-                }
+    std::vector<ChildSupervisor::Exit> exits = m_supervisor.exits();
+    if( !m_supervisor.running() ) {
+        // Only our jobs, other children of the process are not ours to reap.
+        std::vector<pid_t> pids;
+        for( auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
+            if( alive( it->second ) ) {
+                pids.push_back( it->second.m_pid );
             }
-            if( !found_job ) {
-                std::cerr << "Got dead child pid=" << pid << " not in records...?\n";
+        }
+        for( auto it=m_pool.begin(); it!=m_pool.end(); ++it ) {
+            pids.push_back( it->second.m_pid );
+        }
+        for( size_t i=0; i<pids.size(); i++ ) {
+            int status;
+            if( (pids[i] > 0) && (waitpid( pids[i], &status, WNOHANG ) == pids[i]) ) {
+                ChildSupervisor::Exit exit = { pids[i], status };
+                exits.push_back( exit );
             }
         }
-        
     }
-    
+    for( size_t i=0; i<exits.size(); i++ ) {
+        jobExited( exits[i].m_pid, exits[i].m_status );
+    }
+}
+
+void
+Master::jobExited( pid_t pid, int status )
+{
+    for( auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
+        Job& job = it->second;
+        // Records of dead processes may have a reused pid.
+        if( (job.m_pid != pid) || !alive( job ) ) {
+            continue;
+        }
+        m_unwatched.erase( job.m_id );
+        if( job.m_state == TRELL_JOBSTATE_HIBERNATED ) {
+            m_logger_callback( m_logger_data, 2, package.c_str(),
+                               "Job '%s' (pid=%d) has hibernated, status=%d.", job.m_id.c_str(), pid, status );
+            job.m_hibernating = false;
+            cleanJobRemains( job.m_id );
+            if( job.m_resume_requested ) {
+                resumeJob( job.m_id );
+            }
+            return;
+        }
+        job.m_restoring = false;
+        if( (status != -1) && WIFEXITED( status ) && (WEXITSTATUS( status ) == EXIT_SUCCESS) ) {
+            setJobState( job.m_id, TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY );
+        }
+        else {
+            setJobState( job.m_id, TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY );
+        }
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "Job '%s' (pid=%d) has exited, status=%d.", job.m_id.c_str(), pid, status );
+        cleanJobRemains( job.m_id );
+        return;
+    }
+
+    for( auto it=m_pool.begin(); it!=m_pool.end(); ++it ) {
+        Job& job = it->second;
+        if( job.m_pid != pid ) {
+            continue;
+        }
+        if( (job.m_state != TRELL_JOBSTATE_RUNNING) &&
+            (job.m_state != TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY) )
+        {
+            m_logger_callback( m_logger_data, 0, package.c_str(),
+                               "Pooled job '%s' failed to start, see %s. Not pooling '%s' until applications change.",
+                               job.m_id.c_str(), stderrPath( job.m_id ).c_str(), job.m_executable.c_str() );
+            m_pool_failed.insert( job.m_executable );
+        }
+        else {
+            unlink( stdoutPath( job.m_id ).c_str() );
+            unlink( stderrPath( job.m_id ).c_str() );
+        }
+        cleanJobRemains( job.m_id );
+        m_placement.remove( job.m_id );
+        m_pool.erase( it );
+        return;
+    }
+    m_logger_callback( m_logger_data, 1, package.c_str(),
+                       "Got dead child pid=%d not in records.", pid );
+}
+
+bool
+Master::alive( const Job& job ) const
+{
+    switch( job.m_state ) {
+    case TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY:
+    case TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY:
+        return false;
+    case TRELL_JOBSTATE_HIBERNATED:
+        return job.m_hibernating;
+    default:
+        return true;
+    }
+}
+
+void
+Master::hibernateIdleJobs()
+{
+    if( m_hibernate_idle_s == 0 ) {
+        return;
+    }
+    for( auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
+        Job& job = it->second;
+        if( (job.m_state != TRELL_JOBSTATE_RUNNING) ||
+            (job.m_idle_s < m_hibernate_idle_s) ||
+            job.m_hibernate_refused )
+        {
+            continue;
+        }
+        tinia_msg_hibernate_t query;
+        memset( &query, 0, sizeof(query) );
+        query.msg.type = TRELL_MESSAGE_HIBERNATE;
+        strncpy( query.path, Hibernation::path( job.m_id ).c_str(), sizeof(query.path)-1 );
+
+        tinia_msg_t reply;
+        size_t reply_actual = 0;
+        if( (ipc_msg_client_sendrecv_buffered_by_name( job.m_id.c_str(),
+                                                       m_logger_callback, m_logger_data,
+                                                       reinterpret_cast<const char*>( &query ), sizeof(query),
+                                                       reinterpret_cast<char*>( &reply ), &reply_actual, sizeof(reply) ) == 0 )
+            && (reply_actual == sizeof(reply))
+            && (reply.type == TRELL_MESSAGE_OK) )
+        {
+            m_logger_callback( m_logger_data, 2, package.c_str(),
+                               "Job '%s' idle for %u s, hibernated.", job.m_id.c_str(), job.m_idle_s );
+            job.m_hibernating = true;
+            job.m_resume_requested = false;
+            m_hibernations++;
+            setJobState( job.m_id, TRELL_JOBSTATE_HIBERNATED );
+        }
+        else {
+            m_logger_callback( m_logger_data, 1, package.c_str(),
+                               "Job '%s' idle for %u s, but did not hibernate.", job.m_id.c_str(), job.m_idle_s );
+            job.m_hibernate_refused = true;
+        }
+    }
+}
+
+Master::ResumeResult
+Master::resumeJob( const std::string& id )
+{
+    auto it = m_jobs.find( id );
+    if( it == m_jobs.end() ) {
+        return RESUME_FAILED;
+    }
+    Job& job = it->second;
+    if( job.m_state == TRELL_JOBSTATE_RUNNING ) {
+        return RESUME_RUNNING;
+    }
+    if( (job.m_state == TRELL_JOBSTATE_NOT_STARTED) && job.m_restoring ) {
+        return RESUME_PENDING;
+    }
+    if( job.m_state != TRELL_JOBSTATE_HIBERNATED ) {
+        return RESUME_FAILED;
+    }
+    if( job.m_hibernating ) {
+        // Restarted by jobExited, as the message box is still in use.
+        job.m_resume_requested = true;
+        return RESUME_PENDING;
+    }
+    if( !m_for_real ) {
+        return RESUME_FAILED;
+    }
+
+    job.m_resume_requested = false;
+    job.m_requested = getTimeMs();
+    job.m_pid = spawn( job, true );
+    if( job.m_pid == -1 ) {
+        m_logger_callback( m_logger_data, 0, package.c_str(),
+                           "Failed to restart hibernated job '%s'.", id.c_str() );
+        return RESUME_FAILED;
+    }
+    m_logger_callback( m_logger_data, 2, package.c_str(),
+                       "Restarting hibernated job '%s', pid=%d.", id.c_str(), job.m_pid );
+    job.m_restoring = true;
+    job.m_idle_s = 0;
+    job.m_hibernate_refused = false;
+    if( !job.m_rendering_devices.empty() ) {
+        m_placement.assign( id, job.m_rendering_devices[0] );
+    }
+    setJobState( id, TRELL_JOBSTATE_NOT_STARTED );
+    return RESUME_PENDING;
 }
 
 
@@ -365,6 +662,12 @@ void
 Master::cleanup()
 {
     dumpMasterState();
+    drainPool();
+    m_supervisor.stop();
+    if( m_journal_fd >= 0 ) {
+        close( m_journal_fd );
+        m_journal_fd = -1;
+    }
     IPCController::cleanup();
 }
 
@@ -374,12 +677,56 @@ Master::setJobState( const std::string& job, TrellJobState state, bool heartbeat
     auto it = m_jobs.find( job );
     if( it != m_jobs.end() ) {
         TrellJobState old_state = it->second.m_state;
-        it->second.m_state = state;
         if( heartbeat ) {
             it->second.m_last_ping = getTime();
+            // The last heartbeats of a hibernating job.
+            if( old_state == TRELL_JOBSTATE_HIBERNATED ) {
+                return true;
+            }
         }
+        it->second.m_state = state;
         if( old_state != state ) {
-            dumpMasterState();
+            if( (old_state == TRELL_JOBSTATE_NOT_STARTED) && (state == TRELL_JOBSTATE_RUNNING)
+                && (it->second.m_requested > 0.0) )
+            {
+                double ms = getTimeMs() - it->second.m_requested;
+                if( it->second.m_restoring ) {
+                    it->second.m_restoring = false;
+                    m_restores++;
+                    m_restore_ms += ms;
+                    m_logger_callback( m_logger_data, 2, package.c_str(),
+                                       "Job '%s' restored after %.1f ms.", job.c_str(), ms );
+                }
+                else {
+                    if( it->second.m_pooled ) {
+                        m_warm_starts++;
+                        m_warm_start_ms += ms;
+                    }
+                    else {
+                        m_cold_starts++;
+                        m_cold_start_ms += ms;
+                    }
+                    m_logger_callback( m_logger_data, 2, package.c_str(),
+                                       "Job '%s' running after %.1f ms (%s).",
+                                       job.c_str(), ms, it->second.m_pooled ? "pooled" : "new process" );
+                }
+            }
+            if( (state == TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY) ||
+                (state == TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY) ||
+                (state == TRELL_JOBSTATE_HIBERNATED) )
+            {
+                m_placement.remove( job );
+            }
+            journalJob( job );
+        }
+        return true;
+    }
+    // Pooled jobs send heartbeats under their pool id.
+    it = m_pool.find( job );
+    if( it != m_pool.end() ) {
+        it->second.m_state = state;
+        if( heartbeat ) {
+            it->second.m_last_ping = getTime();
         }
         return true;
     }
@@ -399,8 +746,13 @@ Master::parseXML( ParsedXML& data, char* buf, size_t len )
                                                   NULL,
                                                   XML_PARSE_NOBLANKS );
     if( reader != NULL ) {
+        if( m_rpc_validator != NULL ) {
+            // Validated in the same pass as it is decoded.
+            xmlTextReaderSchemaValidateCtxt( reader, m_rpc_validator, 0 );
+        }
         vector<parse::NodeType> stack;
-        for( int r=xmlTextReaderRead(reader); r==1; r=xmlTextReaderRead(reader)) {
+        int r;
+        for( r=xmlTextReaderRead(reader); r==1; r=xmlTextReaderRead(reader)) {
             int type = xmlTextReaderNodeType( reader );
             // Begin element
             if( type == 1 ) {          // --- start of element
@@ -433,6 +785,10 @@ Master::parseXML( ParsedXML& data, char* buf, size_t len )
                     n = parse::NODE_WIPE_JOB;
                     data.m_action = ParsedXML::ACTION_WIPE_JOB;
                 }
+                else if( xmlStrEqual( name, BAD_CAST "resumeJob" ) ) {
+                    n = parse::NODE_RESUME_JOB;
+                    data.m_action = ParsedXML::ACTION_RESUME_JOB;
+                }
                 else if( xmlStrEqual( name, BAD_CAST "listRenderingDevices" ) ) {
                     n = parse::NODE_LIST_RENDERING_DEVICES;
                     data.m_action = ParsedXML::ACTION_LIST_RENDERING_DEVICES;
@@ -516,6 +872,14 @@ Master::parseXML( ParsedXML& data, char* buf, size_t len )
                 stack.pop_back();
             }
         }
+        if( m_rpc_validator != NULL ) {
+            if( (r != 0) || (xmlTextReaderIsValid( reader ) != 1) ) {
+                m_logger_callback( m_logger_data, 0, package.c_str(),
+                                   "Received xml-rpc that is not valid." );
+                data.m_action = ParsedXML::ACTION_NONE;
+            }
+            xmlTextReaderSchemaValidateCtxt( reader, NULL, 0 );
+        }
         xmlFreeTextReader( reader );
     }
 }
@@ -527,38 +891,81 @@ Master::encodeMasterState()
     o << ret_header;
     o << "<jobList>\n";
     for(auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
-        const Job& job = it->second;
-        o << "  <jobInfo>\n";
-        o << "    <job>" << job.m_id << "</job>\n";
-        o << "    <pid>" << job.m_pid << "</pid>\n";
-        o << "    <application>" << job.m_executable << "</application>\n";
-        for( auto kt=job.m_args.begin(); kt!=job.m_args.end(); ++kt ) {
-            o << "    <arg>" << (*kt) << "</arg>\n";
-        }
-        o << "    <state updated=\"" << job.m_last_ping << "\">";
-        switch( job.m_state ) {
-        case TRELL_JOBSTATE_NOT_STARTED: o << "NOT_STARTED"; break;
-        case TRELL_JOBSTATE_RUNNING: o << "RUNNING"; break;
-        case TRELL_JOBSTATE_FINISHED: o << "FINISHED"; break;
-        case TRELL_JOBSTATE_FAILED: o << "FAILED"; break;
-        case TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY: o << "TERMINATED_SUCCESSFULLY"; break;
-        case TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY: o << "TERMINATED_UNSUCCESSFULLY"; break;
-        }
-        o << "</state>\n";
-        o << "    <allowed>";
-        o << "</allowed>\n";
-        o << "  </jobInfo>";
+        o << encodeJob( it->second );
     }
     o << "</jobList>\n";
     o << ret_footer;
     return o.str();
 }
 
+const std::string
+Master::encodeJob( const Job& job )
+{
+    std::stringstream o;
+    o << "  <jobInfo>\n";
+    o << "    <job>" << job.m_id << "</job>\n";
+    o << "    <pid>" << job.m_pid << "</pid>\n";
+    o << "    <application>" << job.m_executable << "</application>\n";
+    for( auto kt=job.m_args.begin(); kt!=job.m_args.end(); ++kt ) {
+        o << "    <arg>" << (*kt) << "</arg>\n";
+    }
+    o << "    <state updated=\"" << job.m_last_ping << "\">";
+    switch( job.m_state ) {
+    case TRELL_JOBSTATE_NOT_STARTED: o << "NOT_STARTED"; break;
+    case TRELL_JOBSTATE_RUNNING: o << "RUNNING"; break;
+    case TRELL_JOBSTATE_FINISHED: o << "FINISHED"; break;
+    case TRELL_JOBSTATE_FAILED: o << "FAILED"; break;
+    case TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY: o << "TERMINATED_SUCCESSFULLY"; break;
+    case TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY: o << "TERMINATED_UNSUCCESSFULLY"; break;
+    case TRELL_JOBSTATE_HIBERNATED: o << "HIBERNATED"; break;
+    }
+    o << "</state>\n";
+    o << "    <allowed>";
+    o << "</allowed>\n";
+    o << "  </jobInfo>";
+    return o.str();
+}
+
 
 void
 Master::snarfMasterState()
 {
-    xmlTextReaderPtr reader = xmlReaderForFile( "/tmp/trell_master_state", NULL, XML_PARSE_NOBLANKS );
+    std::ifstream state( m_state_path.c_str() );
+    if( state ) {
+        std::stringstream xml;
+        xml << state.rdbuf();
+        snarfRecords( xml.str() );
+    }
+    // The records are not in a document, and the last may be cut short. The
+    // reader parses ahead and stops at the error before it has given us the
+    // records in front of it, so a cut record is dropped first.
+    std::ifstream journal( m_journal_path.c_str() );
+    if( journal ) {
+        std::stringstream contents;
+        contents << journal.rdbuf();
+        const std::string records = contents.str();
+        size_t end = 0;
+        const char* closers[] = { "</jobInfo>\n", "</wipe>\n" };
+        for( size_t i=0; i<sizeof(closers)/sizeof(closers[0]); i++ ) {
+            size_t pos = records.rfind( closers[i] );
+            if( pos != std::string::npos ) {
+                end = std::max( end, pos + strlen( closers[i] ) );
+            }
+        }
+        if( end < records.size() ) {
+            m_logger_callback( m_logger_data, 1, package.c_str(),
+                               "Dropping %d bytes of an incomplete record at the end of %s.",
+                               (int)(records.size() - end), m_journal_path.c_str() );
+        }
+        snarfRecords( "<journal>" + records.substr( 0, end ) + "</journal>" );
+    }
+    std::cerr << "Snarfed previous state." << getTime() << "\n";
+}
+
+void
+Master::snarfRecords( const std::string& xml )
+{
+    xmlTextReaderPtr reader = xmlReaderForMemory( xml.c_str(), xml.size(), NULL, NULL, XML_PARSE_NOBLANKS );
     if( reader != NULL ) {
 
         std::vector<snarf::NodeType> stack;
@@ -593,6 +1000,10 @@ Master::snarfMasterState()
                     else if( xmlStrEqual( name, BAD_CAST "state" ) ) {
                         type = snarf::NODE_STATE;
                     }
+                    else if( xmlStrEqual( name, BAD_CAST "wipe" ) ) {
+                        type = snarf::NODE_WIPE;
+                        job = Job();
+                    }
                     else if( xmlStrEqual( name, BAD_CAST "allowed" ) ) {
                         // TODO
                     }
@@ -645,6 +1056,10 @@ Master::snarfMasterState()
                             job.m_state = TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY;
                             fields |= (1<<stack.back());
                         }
+                        else if( xmlStrEqual( text, BAD_CAST "HIBERNATED" ) ) {
+                            job.m_state = TRELL_JOBSTATE_HIBERNATED;
+                            fields |= (1<<stack.back());
+                        }
                         else {
                             std::cerr << "Unrecognized state: " << reinterpret_cast<const char*>( text );
                         }
@@ -662,24 +1077,21 @@ Master::snarfMasterState()
 			               (1<<snarf::NODE_APPLICATION) |
 			               (1<<snarf::NODE_STATE);
                     if( fields == all ) {
-                        auto it = m_jobs.find( job.m_id );
-                        if( it != m_jobs.end() ) {
-                            std::cerr << "Job " << job.m_id << " already recorded.\n";
-                        }
-                        else {
-                            m_jobs[ job.m_id ] = job;
-                        }
+                        // Later records of the journal replace earlier.
+                        m_jobs[ job.m_id ] = job;
                     }
                     else {
                         std::cerr << "Missing fields: " << fields << "\n";
                     }
                 }
+                else if( stack.back() == snarf::NODE_WIPE ) {
+                    m_jobs.erase( job.m_id );
+                }
                 stack.pop_back();
             }
         }
         xmlFreeTextReader( reader );
     }
-    std::cerr << "Snarfed previous state." << getTime() << "\n";
 }
 
 bool
@@ -690,16 +1102,15 @@ Master::wipeJob( const std::string& id )
         std::cerr << "wipeJob: id '" << id << "' not recognized.\n";
         return false;
     }
-    if( !( (it->second.m_state == TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY) ||
-           (it->second.m_state == TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY) ) ) {
+    if( alive( it->second ) ) {
         std::cerr << "wipeJob: id '" << id << "' has not terminated.\n";
         return false;
     }
-    waitpid( it->second.m_pid, NULL, WNOHANG );
-
-
     m_jobs.erase( it );
-    dumpMasterState();
+    unlink( Hibernation::path( id ).c_str() );
+    m_placement.remove( id );
+    m_unwatched.erase( id );
+    journalWipe( id );
     std::cerr << "wipeJob: wiped '" << id << "'.\n";
     return true;
 }
@@ -712,6 +1123,13 @@ Master::killJob( const std::string& id, bool force )
     if( id.empty() ) {
         return false;
     }
+    auto jt = m_jobs.find( id );
+    if( (jt != m_jobs.end()) && (jt->second.m_state == TRELL_JOBSTATE_HIBERNATED) && !alive( jt->second ) ) {
+        // No process, just forget the state.
+        unlink( Hibernation::path( id ).c_str() );
+        setJobState( id, TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY );
+        return true;
+    }
     if( force ) {
         auto it = m_jobs.find( id );
         if( it != m_jobs.end() ) {
@@ -767,6 +1185,112 @@ Master::stdoutPath( const std::string job ) const
     return std::string( "/tmp/" ) + job + ".stdout";
 }
 
+pid_t
+Master::spawn( const Job& job, bool restore )
+{
+    fsync( 1 );
+    fsync( 2 );
+    pid_t pid = fork();
+    if( pid == 0 ) {
+        ChildSupervisor::unblockInChild();
+
+        // A restored job continues the output of the hibernated.
+        const int flags = O_WRONLY | O_CREAT | (restore ? O_APPEND : O_TRUNC);
+        int o = open( stdoutPath( job.m_id ).c_str(), flags, 0666 );
+        dup2( o, 1 );
+        close( o );
+
+        int e = open( stderrPath( job.m_id ).c_str(), flags, 0666 );
+        dup2( e, 2 );
+        close( e );
+
+        // create arguments
+        std::vector<char*> arg;
+        arg.push_back( strdup( job.m_executable.c_str() ) );
+        for(auto kt=job.m_args.begin(); kt!=job.m_args.end(); ++kt) {
+            arg.push_back( strdup( kt->c_str() ) );
+        }
+        arg.push_back( NULL );
+
+        // copy and add to environment             
+        std::string env_job_id    = "TINIA_JOB_ID=" + job.m_id;
+        std::string env_master_id = "TINIA_MASTER_ID=" + getMasterID();
+        std::vector<char*> env;
+        env.push_back( strdup( env_job_id.c_str() ) );
+        env.push_back( strdup( env_master_id.c_str() ) );
+        if( restore ) {
+            std::string env_restore = "TINIA_RESTORE_STATE=" + Hibernation::path( job.m_id );
+            env.push_back( strdup( env_restore.c_str() ) );
+        }
+
+        if( !job.m_rendering_devices.empty() ) {
+            std::string devices;
+            for( std::vector<std::string>::const_iterator kt = job.m_rendering_devices.begin();
+                 kt != job.m_rendering_devices.end(); ++kt )
+            {
+                if( !devices.empty() ) {
+                    devices.append( ";" );
+                }
+                devices.append( *kt );
+            }
+            devices = "TINIA_RENDERING_DEVICES=" + devices;
+            env.push_back( strdup( devices.c_str() ) );
+        }
+        
+        for( int i=0; environ[i] != NULL; i++ ) {
+            if( (strncmp( environ[i], "TINIA_", 6 ) != 0 ) ||
+                (strncmp( environ[i], "TINIA_APP_ROOT=", 15) == 0 )) {
+                    env.push_back( strdup( environ[i] ) );
+            }
+        }
+        env.push_back( NULL );
+        
+        // and run...
+        execvpe( job.m_executable.c_str(),
+                 reinterpret_cast<char* const*>( arg.data() ),
+                 reinterpret_cast<char* const*>( env.data() ) );
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "'%s' failed to exec.", job.m_id.c_str() );
+
+        // --- notify master that things went wrong ------------------------
+        tinia_msg_heartbeat_t query;
+        memset( &query, 0, sizeof(query) );
+        query.msg.type = TRELL_MESSAGE_HEARTBEAT;
+        query.state = TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY;
+        strncpy( query.job_id, job.m_id.c_str(), TINIA_IPC_JOBID_MAXLENGTH );
+        query.job_id[ TINIA_IPC_JOBID_MAXLENGTH ] = '\0';
+        
+        tinia_msg_t reply;
+        size_t reply_actual;
+    
+        
+        if( (ipc_msg_client_sendrecv_buffered_by_name( getMasterID().c_str(),
+                                                      m_logger_callback, m_logger_data,
+                                                      reinterpret_cast<const char*>( &query ), sizeof(query),
+                                                      reinterpret_cast<char*>( &reply ), &reply_actual, sizeof(reply) ) == 0 )
+            && (reply_actual == sizeof(reply))
+                && (reply.type == TRELL_MESSAGE_OK) )
+        {
+            m_logger_callback( m_logger_data, 2, package.c_str(),
+                               "Notified master that '%s' is about to terminate.",
+                               job.m_id.c_str() );
+        }
+        else {
+            m_logger_callback( m_logger_data, 0, package.c_str(),
+                               "Tried to notify master that '%s' is about terminate, but failed to send message.",
+                               job.m_id.c_str() );
+        }
+                                                        
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "'%s' exits.", job.m_id.c_str() );
+        exit( EXIT_FAILURE );
+    }
+    if( pid > 0 ) {
+        m_supervisor.watchChild( pid );
+    }
+    return pid;
+}
+
 bool
 Master::addJob( const std::string& id,
                 const std::string& exe,
@@ -795,10 +1319,15 @@ Master::addJob( const std::string& id,
         }
     }
     auto it = m_jobs.find( id );
-    if( it != m_jobs.end() ) {
+    if( (it != m_jobs.end()) || (m_pool.find( id ) != m_pool.end()) ) {
         std::cerr << "Job already exist.\n";
         return false;
     }
+    if( assignPooledJob( id, m_application_root + "/" + exe, args, rendering_devices ) ) {
+        journalJob( id );
+        return true;
+    }
+
     m_jobs[id] = Job();
     it = m_jobs.find( id );
     it->second.m_id = id;
@@ -808,115 +1337,299 @@ Master::addJob( const std::string& id,
     it->second.m_last_ping = getTime();
     it->second.m_args = args;
     it->second.m_rendering_devices = rendering_devices;
+    it->second.m_requested = getTimeMs();
+    it->second.m_pooled = false;
+    if( rendering_devices.empty() ) {
+        const std::string device = m_placement.place( id );
+        if( !device.empty() ) {
+            it->second.m_rendering_devices.push_back( device );
+            m_logger_callback( m_logger_data, 2, package.c_str(),
+                               "Placed job '%s' on rendering device '%s'.", id.c_str(), device.c_str() );
+        }
+    }
+    else {
+        // Pinned by the client.
+        m_placement.assign( id, rendering_devices[0] );
+    }
     if( m_for_real ) {
-        fsync( 1 );
-        fsync( 2 );
-        pid_t pid = fork();
-        if( pid == -1 ) {
+        it->second.m_pid = spawn( it->second );
+        if( it->second.m_pid == -1 ) {
             // Failed to fork.
-            it->second.m_pid = -1;
             it->second.m_state = TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY;
+            m_placement.remove( id );
         }
-        else if( pid == 0 ) {
-            int o = creat( stdoutPath( id ).c_str(), 0666 );
-            dup2( o, 1 );
-            close( o );
-
-            int e = creat( stderrPath( id ).c_str(), 0666 );
-            dup2( e, 2 );
-            close( e );
+    }
+    journalJob( id );
+    return true;
+}
 
-            // create arguments
-            std::vector<char*> arg;
-            arg.push_back( strdup( it->second.m_executable.c_str() ) );
-            for(auto kt=args.begin(); kt!=args.end(); ++kt) {
-                arg.push_back( strdup( kt->c_str() ) );
+bool
+Master::assignPooledJob( const std::string& id,
+                         const std::string& executable,
+                         const std::vector<std::string>& args,
+                         const std::vector<std::string>& rendering_devices )
+{
+    if( !m_for_real || (m_pool_size == 0) ) {
+        return false;
+    }
+    // Pooled jobs are started without arguments.
+    if( !args.empty() ) {
+        m_pool_misses++;
+        return false;
+    }
+    const double requested = getTimeMs();
+    std::set<std::string> refused;
+    while( true ) {
+        // The ready job on the least loaded device, or on the pinned device.
+        auto it = m_pool.end();
+        double it_cost = 0.0;
+        for( auto pt=m_pool.begin(); pt!=m_pool.end(); ++pt ) {
+            if( (pt->second.m_executable != executable) || (pt->second.m_state != TRELL_JOBSTATE_RUNNING) ||
+                (refused.find( pt->first ) != refused.end()) )
+            {
+                continue;
             }
-            arg.push_back( NULL );
+            if( !rendering_devices.empty() && (rendering_devices != pt->second.m_rendering_devices) ) {
+                continue;
+            }
+            double cost = 0.0;
+            if( !pt->second.m_rendering_devices.empty() ) {
+                cost = m_placement.deviceLoad( pt->second.m_rendering_devices[0] ).m_cost;
+            }
+            if( (it == m_pool.end()) || (cost < it_cost) ) {
+                it = pt;
+                it_cost = cost;
+            }
+        }
+        if( it == m_pool.end() ) {
+            break;
+        }
+        tinia_msg_assign_job_t query;
+        query.msg.type = TRELL_MESSAGE_ASSIGN_JOB;
+        strncpy( query.job_id, id.c_str(), TINIA_IPC_JOBID_MAXLENGTH );
+        query.job_id[ TINIA_IPC_JOBID_MAXLENGTH ] = '\0';
 
-            // copy and add to environment             
-            std::string env_job_id    = "TINIA_JOB_ID=" + it->second.m_id;
-            std::string env_master_id = "TINIA_MASTER_ID=" + getMasterID();
-            std::vector<char*> env;
-            env.push_back( strdup( env_job_id.c_str() ) );
-            env.push_back( strdup( env_master_id.c_str() ) );
+        tinia_msg_t reply;
+        size_t reply_actual;
+        if( (ipc_msg_client_sendrecv_buffered_by_name( it->second.m_id.c_str(),
+                                                       m_logger_callback, m_logger_data,
+                                                       reinterpret_cast<const char*>( &query ), sizeof(query),
+                                                       reinterpret_cast<char*>( &reply ), &reply_actual, sizeof(reply) ) != 0 )
+            || (reply_actual != sizeof(reply))
+            || (reply.type != TRELL_MESSAGE_OK) )
+        {
+            // Not asked again for this request, refillPool removes it if it
+            // has died.
+            m_logger_callback( m_logger_data, 1, package.c_str(),
+                               "Pooled job '%s' did not accept id '%s'.",
+                               it->second.m_id.c_str(), id.c_str() );
+            refused.insert( it->first );
+            continue;
+        }
 
-            if( !it->second.m_rendering_devices.empty() ) {
-                std::string devices;
-                for( std::vector<std::string>::iterator kt = it->second.m_rendering_devices.begin();
-                     kt != it->second.m_rendering_devices.end(); ++kt )
-                {
-                    if( !devices.empty() ) {
-                        devices.append( ";" );
-                    }
-                    devices.append( *kt );
-                }
-                devices = "TINIA_RENDERING_DEVICES=" + devices;
-                env.push_back( strdup( devices.c_str() ) );
-            }
-            
-            for( int i=0; environ[i] != NULL; i++ ) {
-                if( (strncmp( environ[i], "TINIA_", 6 ) != 0 ) ||
-                    (strncmp( environ[i], "TINIA_APP_ROOT=", 15) == 0 )) {
-                        env.push_back( strdup( environ[i] ) );
-                }
+        // The job has the files open, so they can be renamed under its feet.
+        rename( stdoutPath( it->second.m_id ).c_str(), stdoutPath( id ).c_str() );
+        rename( stderrPath( it->second.m_id ).c_str(), stderrPath( id ).c_str() );
+
+        // The job reports RUNNING again when its message box has moved.
+        Job job = it->second;
+        m_pool.erase( it );
+        m_placement.remove( job.m_id );
+        if( !job.m_rendering_devices.empty() ) {
+            m_placement.assign( id, job.m_rendering_devices[0] );
+        }
+        job.m_id = id;
+        job.m_state = TRELL_JOBSTATE_NOT_STARTED;
+        job.m_last_ping = getTime();
+        job.m_requested = requested;
+        job.m_pooled = true;
+        m_jobs[ id ] = job;
+        m_pool_hits++;
+        m_logger_callback( m_logger_data, 2, package.c_str(),
+                           "Job '%s' served by pooled process %d (hits=%lu, misses=%lu).",
+                           id.c_str(), job.m_pid, m_pool_hits, m_pool_misses );
+        return true;
+    }
+    m_pool_misses++;
+    return false;
+}
+
+void
+Master::refillPool()
+{
+    if( !m_for_real || (m_pool_size == 0) ) {
+        return;
+    }
+
+    // --- start jobs for applications that are short --------------------------
+    m_applications.refresh();
+    if( m_applications.timestamp() != m_pool_timestamp ) {
+        m_pool_timestamp = m_applications.timestamp();
+        m_pool_failed.clear();
+    }
+    const std::list<std::string> apps = m_applications.binaries();
+    for( auto at=apps.begin(); at!=apps.end(); ++at ) {
+        if( !m_pool_apps.empty() &&
+            (std::find( m_pool_apps.begin(), m_pool_apps.end(), *at ) == m_pool_apps.end() ) )
+        {
+            continue;
+        }
+        const std::string executable = m_application_root + "/" + *at;
+        if( m_pool_failed.find( executable ) != m_pool_failed.end() ) {
+            continue;
+        }
+        size_t n = 0;
+        for( auto it=m_pool.begin(); it!=m_pool.end(); ++it ) {
+            if( it->second.m_executable == executable ) {
+                n++;
             }
-            env.push_back( NULL );
-            
-            // and run...
-            execvpe( it->second.m_executable.c_str(),
-                     reinterpret_cast<char* const*>( arg.data() ),
-                     reinterpret_cast<char* const*>( env.data() ) );
-            m_logger_callback( m_logger_data, 2, package.c_str(),
-                               "'%s' failed to exec.", it->second.m_id.c_str() );
-
-            // --- notify master that things went wrong ------------------------
-            tinia_msg_heartbeat_t query;
-            query.msg.type = TRELL_MESSAGE_HEARTBEAT;
-            query.state = TRELL_JOBSTATE_TERMINATED_UNSUCCESSFULLY;
-            strncpy( query.job_id, it->second.m_id.c_str(), TINIA_IPC_JOBID_MAXLENGTH );
-            query.job_id[ TINIA_IPC_JOBID_MAXLENGTH ] = '\0';
-            
-            tinia_msg_t reply;
-            size_t reply_actual;
-        
-            
-            if( (ipc_msg_client_sendrecv_buffered_by_name( getMasterID().c_str(),
-                                                          m_logger_callback, m_logger_data,
-                                                          reinterpret_cast<const char*>( &query ), sizeof(query),
-                                                          reinterpret_cast<char*>( &reply ), &reply_actual, sizeof(reply) ) == 0 )
-                && (reply_actual == sizeof(reply))
-                    && (reply.type == TRELL_MESSAGE_OK) )
-            {
-                m_logger_callback( m_logger_data, 2, package.c_str(),
-                                   "Notified master that '%s' is about to terminate.",
-                                   it->second.m_id.c_str() );
+        }
+        for( ; n<m_pool_size; n++ ) {
+            std::stringstream pool_id;
+            pool_id << getMasterID() << "_pool" << (++m_pool_serial);
+
+            Job job = Job();
+            job.m_id = pool_id.str();
+            job.m_executable = executable;
+            job.m_state = TRELL_JOBSTATE_NOT_STARTED;
+            job.m_last_ping = getTime();
+            job.m_rendering_devices = m_pool_devices;
+            if( job.m_rendering_devices.empty() ) {
+                const std::string device = m_placement.place( job.m_id );
+                if( !device.empty() ) {
+                    job.m_rendering_devices.push_back( device );
+                }
             }
             else {
+                m_placement.assign( job.m_id, job.m_rendering_devices[0] );
+            }
+            job.m_pid = spawn( job );
+            if( job.m_pid == -1 ) {
                 m_logger_callback( m_logger_data, 0, package.c_str(),
-                                   "Tried to notify master that '%s' is about terminate, but failed to send message.",
-                                   it->second.m_id.c_str() );
+                                   "Failed to fork pooled job: %s", strerror( errno ) );
+                m_placement.remove( job.m_id );
+                return;
             }
-                                                            
             m_logger_callback( m_logger_data, 2, package.c_str(),
-                               "'%s' exits.", it->second.m_id.c_str() );
-            exit( EXIT_FAILURE );
+                               "Started pooled job '%s' for '%s'.",
+                               job.m_id.c_str(), executable.c_str() );
+            m_pool[ job.m_id ] = job;
         }
-        else {
-            it->second.m_pid = pid;
+    }
+}
+
+void
+Master::drainPool()
+{
+    for( auto it=m_pool.begin(); it!=m_pool.end(); ++it ) {
+        // SIGTERM breaks the mainloop of the job, which then cleans up.
+        kill( it->second.m_pid, SIGTERM );
+    }
+    m_pool.clear();
+}
+
+const std::string
+Master::getPoolStats()
+{
+    size_t ready = 0;
+    for( auto it=m_pool.begin(); it!=m_pool.end(); ++it ) {
+        if( it->second.m_state == TRELL_JOBSTATE_RUNNING ) {
+            ready++;
         }
     }
-    dumpMasterState();
-    return true;
+    std::stringstream o;
+    o << "<jobPool size=\"" << m_pool_size << "\""
+      << " ready=\"" << ready << "\""
+      << " starting=\"" << (m_pool.size()-ready) << "\""
+      << " hits=\"" << m_pool_hits << "\""
+      << " misses=\"" << m_pool_misses << "\">";
+    o << "<startup type=\"process\" count=\"" << m_cold_starts << "\" avgMs=\""
+      << (m_cold_starts > 0 ? m_cold_start_ms/m_cold_starts : 0.0) << "\"/>";
+    o << "<startup type=\"pool\" count=\"" << m_warm_starts << "\" avgMs=\""
+      << (m_warm_starts > 0 ? m_warm_start_ms/m_warm_starts : 0.0) << "\"/>";
+    o << "</jobPool>";
+    return o.str();
+}
+
+const std::string
+Master::getHibernationStats()
+{
+    size_t hibernated = 0;
+    for( auto it=m_jobs.begin(); it!=m_jobs.end(); ++it ) {
+        if( it->second.m_state == TRELL_JOBSTATE_HIBERNATED ) {
+            hibernated++;
+        }
+    }
+    std::stringstream o;
+    o << "<hibernation idleSeconds=\"" << m_hibernate_idle_s << "\""
+      << " hibernated=\"" << hibernated << "\""
+      << " hibernations=\"" << m_hibernations << "\""
+      << " restores=\"" << m_restores << "\""
+      << " avgRestoreMs=\"" << (m_restores > 0 ? m_restore_ms/m_restores : 0.0) << "\"/>";
+    return o.str();
 }
 
 void
 Master::dumpMasterState()
 {
+    // Written aside and renamed, such that there is always a whole state file.
+    const std::string tmp_path = m_state_path + ".tmp";
     std::ofstream o;
-    o.open( "/tmp/trell_master_state", std::ios_base::trunc );
+    o.open( tmp_path.c_str(), std::ios_base::trunc );
     o << encodeMasterState();
     o.close();
+    if( !o || (rename( tmp_path.c_str(), m_state_path.c_str() ) != 0) ) {
+        m_logger_callback( m_logger_data, 0, package.c_str(),
+                           "Failed to write %s.", m_state_path.c_str() );
+        return;
+    }
+
+    // Replaying the journal on top of the new state does no harm, so a crash
+    // before this is ok.
+    if( m_journal_fd < 0 ) {
+        m_journal_fd = open( m_journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666 );
+    }
+    if( (m_journal_fd < 0) || (ftruncate( m_journal_fd, 0 ) != 0) ) {
+        m_logger_callback( m_logger_data, 0, package.c_str(),
+                           "Failed to empty %s: %s.", m_journal_path.c_str(), strerror( errno ) );
+    }
+    m_journal_records = 0;
+}
+
+void
+Master::journalJob( const std::string& id )
+{
+    auto it = m_jobs.find( id );
+    if( it != m_jobs.end() ) {
+        journal( encodeJob( it->second ) + "\n" );
+    }
+}
+
+void
+Master::journalWipe( const std::string& id )
+{
+    journal( "  <wipe><job>" + id + "</job></wipe>\n" );
+}
+
+void
+Master::journal( const std::string& record )
+{
+    if( m_journal_fd < 0 ) {
+        m_journal_fd = open( m_journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666 );
+    }
+    // One write per record, such that records are not interleaved.
+    if( (m_journal_fd < 0) ||
+        (write( m_journal_fd, record.data(), record.size() ) != (ssize_t)record.size()) )
+    {
+        m_logger_callback( m_logger_data, 0, package.c_str(),
+                           "Failed to append to %s, writing the whole state.", m_journal_path.c_str() );
+        dumpMasterState();
+        return;
+    }
+    m_journal_records++;
+    if( m_journal_records >= std::max( journal_min_records, 2*m_jobs.size() ) ) {
+        dumpMasterState();
+    }
 }
 
 
@@ -929,6 +1642,14 @@ Master::getTime() const
     return rolex.tv_sec;
 }
 
+double
+Master::getTimeMs() const
+{
+    struct timeval rolex;
+    gettimeofday( &rolex, NULL );
+    return 1000.0*rolex.tv_sec + rolex.tv_usec/1000.0;
+}
+
 const std::string
 Master::getLoad()
 {
@@ -943,6 +1664,9 @@ Master::getLoad()
         o << "<avg interval=\"" << intervals[i] << "\">" << l << "</avg>";
     }
     o << "</serverLoad>";
+    o << getPoolStats();
+    o << getHibernationStats();
+    o << m_placement.xml();
     o << ret_footer;
     return o.str();
 }
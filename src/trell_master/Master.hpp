@@ -20,10 +20,14 @@
 
 #include <vector>
 #include <string>
+#include <set>
 #include <unordered_map>
+#include <libxml/xmlschemas.h>
 #include "tinia/trell/IPCController.hpp"
+#include "tinia/trell/DevicePlacement.hpp"
 #include "Applications.hpp"
 #include "RenderingDevices.hpp"
+#include "ChildSupervisor.hpp"
 
 namespace tinia {
 namespace trell {
@@ -47,11 +51,32 @@ public:
       */
     Master( bool for_real = false );
 
+    ~Master();
+
 protected:
     bool                                    m_for_real;
     std::string                             m_application_root;
     Applications                            m_applications;
     RenderingDevices                        m_rendering_devices;
+    /** Jobs per rendering device and their load, from the heartbeats. Jobs
+      * that are not pinned to a device are placed on the least loaded of
+      * env['TINIA_RENDERING_DEVICES'] (';'-separated), or of the devices
+      * found by m_rendering_devices if that is not set. */
+    DevicePlacement                         m_placement;
+    /** Tells when jobs exit, see reapChildren. */
+    ChildSupervisor                         m_supervisor;
+    /** Jobs adopted from a previous master that the supervisor cannot watch,
+      * probed by periodic instead. */
+    std::set<std::string>                   m_unwatched;
+    /** Where dumpMasterState writes the jobs, /tmp/trell_master_state. */
+    std::string                             m_state_path;
+    /** Where the changes since the last dumpMasterState are appended, the
+      * state path with ".journal" appended. */
+    std::string                             m_journal_path;
+    /** The journal of changes since the last dumpMasterState, -1 if not open. */
+    int                                     m_journal_fd;
+    /** Number of records in the journal. */
+    size_t                                  m_journal_records;
 
     static const std::string                getApplicationRoot();
     
@@ -72,10 +97,81 @@ protected:
         
         /** Rendering devices that job uses (currently should be 0 or 1). */
         std::vector<std::string>            m_rendering_devices;
+        /** When the job was requested, in milliseconds (not persisted). */
+        double                              m_requested;
+        /** True if the job was taken from the pool (not persisted). */
+        bool                                m_pooled;
+        /** Seconds since a client used the job, from the heartbeats (not
+          * persisted). */
+        unsigned int                        m_idle_s;
+        /** True if the job has refused to hibernate, until it is used again
+          * (not persisted). */
+        bool                                m_hibernate_refused;
+        /** True from when the job agreed to hibernate until its process has
+          * exited (not persisted). */
+        bool                                m_hibernating;
+        /** True if the job was asked for while it hibernated, and is restarted
+          * when its process has exited (not persisted). */
+        bool                                m_resume_requested;
+        /** True while a hibernated job is restarted (not persisted). */
+        bool                                m_restoring;
     };
     /** The set of managed jobs. */
     std::unordered_map<std::string, Job>    m_jobs;
 
+    /** Pre-started jobs that wait for an id, keyed by their pool id.
+      *
+      * For each application, TINIA_JOB_POOL_SIZE jobs are started without
+      * arguments, with the rendering devices of TINIA_JOB_POOL_DEVICES
+      * (';'-separated), or placed like other jobs if that is not set. addJob
+      * gives a request without arguments a ready job (on the least loaded
+      * device, or on the pinned device) instead of starting a new process, and
+      * periodic starts new jobs to fill up the pool. TINIA_JOB_POOL_APPS
+      * (';'-separated) restricts the pool to some applications.
+      */
+    std::unordered_map<std::string, Job>    m_pool;
+    /** Number of pre-started jobs per application, 0 disables the pool. */
+    size_t                                  m_pool_size;
+    std::vector<std::string>                m_pool_devices;
+    std::vector<std::string>                m_pool_apps;
+    /** Applications whose pooled jobs failed to start, not tried again until
+      * the list of applications changes. */
+    std::set<std::string>                   m_pool_failed;
+    int                                     m_pool_timestamp;
+    unsigned long                           m_pool_serial;
+    /** Number of addJob requests served from and not served from the pool. */
+    unsigned long                           m_pool_hits;
+    unsigned long                           m_pool_misses;
+    /** Number of and total milliseconds from request to running job, for new
+      * processes and for jobs taken from the pool. */
+    unsigned long                           m_cold_starts;
+    double                                  m_cold_start_ms;
+    unsigned long                           m_warm_starts;
+    double                                  m_warm_start_ms;
+
+    /** Jobs that no client has used for env['TINIA_HIBERNATE_IDLE_S'] seconds
+      * save their state to Hibernation::path and exit, and are restarted by
+      * resumeJob. 0 (or unset) disables hibernation. */
+    unsigned int                            m_hibernate_idle_s;
+    /** Number of jobs that have hibernated and that have been restored, and
+      * the total milliseconds from resumeJob to running job. */
+    unsigned long                           m_hibernations;
+    unsigned long                           m_restores;
+    double                                  m_restore_ms;
+
+    /** Schema that queries are validated against while they are parsed, from
+      * env['TINIA_RPC_SCHEMA'], such that mod_trell need not parse them
+      * first. NULL if not set. The validation context is reused. */
+    xmlSchemaPtr                            m_rpc_schema;
+    xmlSchemaValidCtxtPtr                   m_rpc_validator;
+
+    /** The outcome of resumeJob. */
+    enum ResumeResult {
+        RESUME_FAILED,
+        RESUME_PENDING,
+        RESUME_RUNNING
+    };
+
     /** Helper struct to extract contents from XML messages sent by the client. */
     struct ParsedXML
     {
@@ -88,7 +184,8 @@ protected:
             ACTION_ADD_JOB,
             ACTION_GET_JOB_LIST,
             ACTION_LIST_RENDERING_DEVICES,
-            ACTION_LIST_APPLICATIONS
+            ACTION_LIST_APPLICATIONS,
+            ACTION_RESUME_JOB
         }                           m_action;
         std::string                 m_job;
         std::string                 m_application;
@@ -101,7 +198,7 @@ protected:
     
     /** \copydoc MessageBox::init
       *
-      * Invokes snarfMasterState.
+      * Invokes snarfMasterState, and starts the supervisor.
       *
       */
     bool
@@ -109,16 +206,47 @@ protected:
 
     /** \copydoc MessageBox::periodic
       *
-      * Runs through the list of jobs, and checks if the pids of non-terminated
-      * jobs are valid. If the pid is not valid, the job is labeled as
-      * terminated.
+      * Handles exits that the supervisor could not hand over, checks the pids
+      * of the jobs that the supervisor does not watch, hibernates idle jobs,
+      * and fills up the pool.
       */
     bool
     periodic();
 
+    /** Update the jobs that the supervisor has seen exit.
+      *
+      * Invoked on TRELL_MESSAGE_CHILD_EXITED, which the supervisor sends when
+      * processes exit. If the supervisor is not running, the children are
+      * reaped here.
+      */
     void
-    often();
-    
+    reapChildren();
+
+    /** True if the process of job may still be running. */
+    bool
+    alive( const Job& job ) const;
+
+    /** Ask the jobs that have been idle for m_hibernate_idle_s to hibernate. */
+    void
+    hibernateIdleJobs();
+
+    /** Restart a hibernated job, which restores its state from its
+      * hibernation file.
+      *
+      * \returns RESUME_PENDING while the job is restarted (ask again),
+      *          RESUME_RUNNING when it runs, or RESUME_FAILED if the job does
+      *          not exist or cannot be restarted.
+      */
+    ResumeResult
+    resumeJob( const std::string& id );
+
+    /** Mark the job or pooled job of pid as terminated, and clean up after it.
+      *
+      * \param status  The status from waitpid, or -1 if unknown.
+      */
+    void
+    jobExited( pid_t pid, int status );
+
     /** \copydoc MessageBox::cleanup
       *
       * Invokes dumpMasterState.
@@ -127,29 +255,52 @@ protected:
     cleanup();
 
 
-    /** Dump list of managed jobs to disc.
+    /** Dump list of managed jobs to disc, and empty the journal.
       *
       * The list of jobs are maintained in the xml file /tmp/trell_master_state,
       * such that the list of managed jobs can be recovered if the master job
-      * is restarted.
+      * is restarted. Changes are appended to /tmp/trell_master_state.journal
+      * as they happen, and folded into the state file when the journal has
+      * grown.
       */
     void
     dumpMasterState();
 
-    /** Read list of managed jobs from disc.
+    /** Append a changed (or new) job to the journal. */
+    void
+    journalJob( const std::string& id );
+
+    /** Append a wiped job to the journal. */
+    void
+    journalWipe( const std::string& id );
+
+    /** Append an xml record to the journal, and compact if it has grown. */
+    void
+    journal( const std::string& record );
+
+    /** Read list of managed jobs from disc, the state file and then the journal.
       *
       * \sa dumpMasterState.
       */
     void
     snarfMasterState();
 
+    /** Apply the <jobInfo> and <wipe> records of an xml document to m_jobs. */
+    void
+    snarfRecords( const std::string& xml );
+
     /** Encode the list of managed jobs as XML, either for transmissing to client or for disc storage. */
     const std::string
     encodeMasterState();
 
+    /** Encode a job as a <jobInfo> element. */
+    const std::string
+    encodeJob( const Job& job );
+
     /** Parse XML sent from the client.
       *
-      * Helper function to decode the XML messages sent by the client.
+      * Helper function to decode the XML messages sent by the client. If
+      * m_rpc_schema is set, a query that is not valid gets no action.
       * \param data  The decoded data.
       * \param buf   The buffer that contains the XML document.
       * \param len   The size of the buffer that contains the XML document.
@@ -185,6 +336,40 @@ protected:
             const std::vector<std::string>& rendering_devices,
             const std::string& xml );
 
+    /** Fork and exec a job, returns the pid or -1.
+      *
+      * \param restore  Restart a hibernated job, which appends to its output
+      *                 and gets env['TINIA_RESTORE_STATE'].
+      */
+    pid_t
+    spawn( const Job& job, bool restore = false );
+
+    /** Give the id to a ready job of the pool that matches the request.
+      *
+      * \returns True if a pooled job was moved to m_jobs under the new id.
+      */
+    bool
+    assignPooledJob( const std::string& id,
+                     const std::string& executable,
+                     const std::vector<std::string>& args,
+                     const std::vector<std::string>& rendering_devices );
+
+    /** Start jobs to fill up the pool. */
+    void
+    refillPool();
+
+    /** Ask the pooled jobs to terminate. */
+    void
+    drainPool();
+
+    /** Get an XML-coded string with the pool size and startup statistics. */
+    const std::string
+    getPoolStats();
+
+    /** Get an XML-coded string with the hibernated jobs and restore times. */
+    const std::string
+    getHibernationStats();
+
     /** Kill a job.
       *
       * \arg id     The server-wide unique id of the job.
@@ -213,6 +398,10 @@ protected:
     const time_t
     getTime() const;
 
+    /** The current time in milliseconds. */
+    double
+    getTimeMs() const;
+
 
     /** Handle a raw trell message. */
     size_t
@@ -25,6 +25,9 @@
 #include <X11/Xutil.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
+#ifdef TINIA_HAVE_EGL
+#include <EGL/egl.h>
+#endif
 #include <dirent.h>
 #include "RenderingDevices.hpp"
 #include "tinia/trell/OffscreenGL.hpp"
@@ -74,15 +77,17 @@ RenderingDevices::xml()
     }
     
     std::stringstream xml;
+    m_ids.clear();
     xml << "  <renderingDevices>\n";
+    int devices = 0;
    
     DIR* dir = opendir( "/tmp/.X11-unix" );
     if( dir == NULL ) {
+        // Not an error if there are EGL devices.
         if( m_logger != NULL ) {
-            m_logger( m_logger_data, 0, package.c_str(),
+            m_logger( m_logger_data, 1, package.c_str(),
                       "opendir failed: %s.", strerror( errno ) );
         }
-        xml << "    <error>INTERNAL_ERROR</error>\n";
     }
     else {
         struct dirent* entry = NULL;
@@ -94,6 +99,7 @@ RenderingDevices::xml()
     
     
             
+            devices++;
             Display* display = XOpenDisplay( display_id.c_str() );
             if( display == NULL ) {
                 xml << "    <renderingDevice id=\"" << display_id << "\">\n";
@@ -137,7 +143,8 @@ RenderingDevices::xml()
                     }
                 }
                 else {
-                    
+                    m_ids.push_back( screen_id );
+
                     int glx_major = 0;
                     int glx_minor = 0;
                     glXQueryVersion( gl.display(), &glx_major, &glx_minor );
@@ -159,40 +166,88 @@ RenderingDevices::xml()
                     }
                     xml << "      </glx>\n";
                     
-                    GLint gl_major = 0;
-                    glGetIntegerv( GL_MAJOR_VERSION, &gl_major );
-                    GLint gl_minor = 0;
-                    glGetIntegerv( GL_MINOR_VERSION, &gl_minor );
-                    xml << "      <opengl major=\"" << gl_major
-                        << "\" minor=\"" << gl_minor
-                        << "\">\n";
-                    xml << "        <vendor>" << (const char*)glGetString( GL_VENDOR ) << "</vendor>\n";
-                    xml << "        <version>" << (const char*)glGetString( GL_VERSION ) << "</version>\n";
-                    xml << "        <renderer>" << (const char*)glGetString( GL_RENDERER) << "</renderer>\n";
-                    
-                    if( gl_major >= 2 ) {
-                        xml << "        <glsl><version>"
-                            << (const char*)glGetString( GL_SHADING_LANGUAGE_VERSION )
-                            << "</version></glsl>\n";
-                        
-                    }
-                    std::list<std::string> gl_extensions = parseExtensions( (const char*)glGetString( GL_EXTENSIONS ) );
-                    for( std::list<std::string>::iterator it=gl_extensions.begin(); it!=gl_extensions.end(); ++it ) {
-                        //xml << "        <extension>" << *it << "</extension>\n";
-                    }
-                    xml << "      </opengl>\n";
+                    openGLXML( xml );
                 }
                 xml << "    </renderingDevice>\n";
             }
         }
         closedir( dir );
     }
+
+    // --- headless devices, no X server needed --------------------------------
+    std::list<std::string> egl_devices = OffscreenGL::eglDevices();
+    for( std::list<std::string>::iterator it=egl_devices.begin(); it!=egl_devices.end(); ++it ) {
+        devices++;
+        xml << "    <renderingDevice id=\"" << *it << "\">\n";
+        OffscreenGL gl( m_logger, m_logger_data );
+        if( !gl.setupContext( *it ) || !gl.bindContext() ) {
+            switch ( gl.state() ) {
+            case OffscreenGL::STATE_FAILED_TO_OPEN_DISPLAY:
+                xml << "    <error>FAILED_TO_OPEN_DISPLAY</error>\n";
+                break;
+            default:
+                xml << "    <error>EGL_ERROR</error>\n";
+                break;
+            }
+        }
+        else {
+            m_ids.push_back( *it );
+#ifdef TINIA_HAVE_EGL
+            xml << "      <egl>\n";
+            xml << "        <vendor>" << eglQueryString( gl.eglDisplay(), EGL_VENDOR ) << "</vendor>\n";
+            xml << "        <version>" << eglQueryString( gl.eglDisplay(), EGL_VERSION ) << "</version>\n";
+            xml << "      </egl>\n";
+#endif
+            openGLXML( xml );
+        }
+        xml << "    </renderingDevice>\n";
+    }
+
+    if( ( dir == NULL ) && ( devices == 0 ) ) {
+        xml << "    <error>INTERNAL_ERROR</error>\n";
+    }
     xml << "  </renderingDevices>\n";
     m_hasRenderingInformation = true;
     m_xml = xml.str();
     return xml.str();
 }
 
+const std::list<std::string>
+RenderingDevices::ids()
+{
+    if( !m_hasRenderingInformation ) {
+        xml();
+    }
+    return m_ids;
+}
+
+void
+RenderingDevices::openGLXML( std::ostream& xml )
+{
+    GLint gl_major = 0;
+    glGetIntegerv( GL_MAJOR_VERSION, &gl_major );
+    GLint gl_minor = 0;
+    glGetIntegerv( GL_MINOR_VERSION, &gl_minor );
+    xml << "      <opengl major=\"" << gl_major
+        << "\" minor=\"" << gl_minor
+        << "\">\n";
+    xml << "        <vendor>" << (const char*)glGetString( GL_VENDOR ) << "</vendor>\n";
+    xml << "        <version>" << (const char*)glGetString( GL_VERSION ) << "</version>\n";
+    xml << "        <renderer>" << (const char*)glGetString( GL_RENDERER) << "</renderer>\n";
+    
+    if( gl_major >= 2 ) {
+        xml << "        <glsl><version>"
+            << (const char*)glGetString( GL_SHADING_LANGUAGE_VERSION )
+            << "</version></glsl>\n";
+        
+    }
+    std::list<std::string> gl_extensions = parseExtensions( (const char*)glGetString( GL_EXTENSIONS ) );
+    for( std::list<std::string>::iterator it=gl_extensions.begin(); it!=gl_extensions.end(); ++it ) {
+        //xml << "        <extension>" << *it << "</extension>\n";
+    }
+    xml << "      </opengl>\n";
+}
+
 } // of namespace impl
 } // of namespace trell
 } // of namespace tinia
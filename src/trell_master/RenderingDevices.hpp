@@ -18,6 +18,7 @@
 #pragma once
 #include <string>
 #include <list>
+#include <iosfwd>
 
 namespace tinia {
 namespace trell {
@@ -31,6 +32,10 @@ public:
 
     std::string
     xml();
+
+    /** The ids of the devices where an OpenGL context could be set up. */
+    const std::list<std::string>
+    ids();
     
 protected:
     std::string     m_display_name; ///< String used to open display.
@@ -40,9 +45,14 @@ protected:
     std::list<std::string>
     parseExtensions( const char* string );
 
+    /** Writes the <opengl> element of the context that is bound. */
+    void
+    openGLXML( std::ostream& xml );
+
 private:
     std::string m_xml;
     bool        m_hasRenderingInformation;
+    std::list<std::string>  m_ids;
 };
 
 } // of namespace impl
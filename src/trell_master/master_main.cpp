@@ -24,6 +24,8 @@
 int
 main( int argc, char** argv )
 {
+    // Before any thread exists, such that all of them have SIGCHLD blocked.
+    tinia::trell::impl::ChildSupervisor::blockInProcess();
     tinia::trell::impl::Master m(true);
     m.run( argc, argv );
     exit( EXIT_SUCCESS );
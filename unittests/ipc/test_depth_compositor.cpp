@@ -0,0 +1,255 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <set>
+#include <cmath>
+#include <boost/test/unit_test.hpp>
+#include "tinia/trell/DepthCompositor.hpp"
+#include "tinia/trell/IPCCompositingJobController.hpp"
+#include "tinia/jobcontroller/Job.hpp"
+#include "tinia/model/Viewer.hpp"
+
+using tinia::trell::DepthCompositor;
+
+BOOST_AUTO_TEST_SUITE( DepthCompositorTest )
+
+namespace {
+
+/** A partial image with pseudo-random colours and depths, the same every run. */
+struct Partition
+{
+    std::vector<unsigned char>  m_rgb;
+    std::vector<unsigned char>  m_depth;
+
+    Partition( size_t pixels, unsigned int seed )
+        : m_rgb( 3*pixels ), m_depth( 3*pixels )
+    {
+        unsigned int x = seed;
+        for( size_t i=0; i<pixels; i++ ) {
+            x = 1103515245u*x + 12345u;
+            m_rgb[3*i+0] = x>>8;
+            m_rgb[3*i+1] = x>>16;
+            m_rgb[3*i+2] = x>>24;
+            // A quarter of the pixels are background.
+            encode( &m_depth[3*i], ((x>>12)%4) == 0 ? 1.f : ((x>>14)%1000)/1000.f );
+        }
+    }
+
+    DepthCompositor::Layer
+    layer() const
+    { return DepthCompositor::Layer( &m_rgb[0], &m_depth[0] ); }
+
+    /** As the rendering jobs encode depth. */
+    static
+    void
+    encode( unsigned char* depth, float value )
+    {
+        for( size_t j=0; j<3; j++ ) {
+            depth[j] = (unsigned char)( floor(value*255.0) );
+            value = 255.0*value - floor(value*255.0);
+        }
+    }
+};
+
+} // of anonymous namespace
+
+BOOST_AUTO_TEST_CASE( KeysKeepTheOrderOfDepths )
+{
+    unsigned char a[3], b[3];
+    Partition::encode( a, 0.25f );
+    Partition::encode( b, 0.2501f );
+    BOOST_CHECK( DepthCompositor::key( a ) < DepthCompositor::key( b ) );
+    Partition::encode( b, 1.f );
+    BOOST_CHECK_EQUAL( DepthCompositor::key( b ), 0xff0000u );
+}
+
+BOOST_AUTO_TEST_CASE( NearestFragmentWins )
+{
+    const size_t pixels = 5000;
+    std::vector<Partition> partitions;
+    std::vector<DepthCompositor::Layer> layers;
+    for( unsigned int l=0; l<3; l++ ) {
+        partitions.push_back( Partition( pixels, 17u + l ) );
+    }
+    for( size_t l=0; l<partitions.size(); l++ ) {
+        layers.push_back( partitions[l].layer() );
+    }
+
+    std::vector<unsigned char> rgb( 3*pixels );
+    std::vector<unsigned int> depth( pixels );
+    DepthCompositor( 1 ).composite( &rgb[0], &depth[0], layers, pixels );
+
+    size_t wrong = 0;
+    for( size_t i=0; i<pixels; i++ ) {
+        size_t nearest = 0;
+        for( size_t l=1; l<layers.size(); l++ ) {
+            if( DepthCompositor::key( layers[l].m_depth + 3*i ) < DepthCompositor::key( layers[nearest].m_depth + 3*i ) ) {
+                nearest = l;
+            }
+        }
+        if( ( depth[i] != DepthCompositor::key( layers[nearest].m_depth + 3*i ) ) ||
+            !std::equal( &rgb[3*i], &rgb[3*i+3], layers[nearest].m_rgb + 3*i ) )
+        {
+            wrong++;
+        }
+    }
+    BOOST_CHECK_EQUAL( wrong, 0u );
+}
+
+BOOST_AUTO_TEST_CASE( EqualDepthsGoToTheFirstLayer )
+{
+    const unsigned char red[3] = { 255, 0, 0 };
+    const unsigned char blue[3] = { 0, 0, 255 };
+    unsigned char depth[3];
+    Partition::encode( depth, 0.5f );
+
+    std::vector<DepthCompositor::Layer> layers;
+    layers.push_back( DepthCompositor::Layer( red, depth ) );
+    layers.push_back( DepthCompositor::Layer( blue, depth ) );
+    unsigned char rgb[3];
+    unsigned int key;
+    DepthCompositor().composite( rgb, &key, layers, 1 );
+    BOOST_CHECK( std::equal( rgb, rgb+3, red ) );
+}
+
+BOOST_AUTO_TEST_CASE( ThreadsGiveTheSameImage )
+{
+    const size_t pixels = 333*211;
+    std::vector<Partition> partitions;
+    std::vector<DepthCompositor::Layer> layers;
+    for( unsigned int l=0; l<4; l++ ) {
+        partitions.push_back( Partition( pixels, 1000u + l ) );
+    }
+    for( size_t l=0; l<partitions.size(); l++ ) {
+        layers.push_back( partitions[l].layer() );
+    }
+
+    std::vector<unsigned char> rgb1( 3*pixels ), rgb4( 3*pixels );
+    std::vector<unsigned int> depth1( pixels ), depth4( pixels );
+    DepthCompositor( 1 ).composite( &rgb1[0], &depth1[0], layers, pixels );
+    DepthCompositor( 4, 1000 ).composite( &rgb4[0], &depth4[0], layers, pixels );
+    BOOST_CHECK( rgb1 == rgb4 );
+    BOOST_CHECK( depth1 == depth4 );
+}
+
+BOOST_AUTO_TEST_CASE( EncodedDepthIsResampled )
+{
+    // 4x2 keys, resampled to 2x1, and with the least significant byte dropped.
+    const unsigned int depth[8] = { 0x010203u, 0x040506u, 0x070809u, 0x0a0b0cu,
+                                    0x0d0e0fu, 0x101112u, 0x131415u, 0x161718u };
+    unsigned char encoded[6];
+    DepthCompositor::encode( encoded, depth, 4, 2, 2, 1, false );
+    BOOST_CHECK_EQUAL( DepthCompositor::key( encoded ), 0x010203u );
+    BOOST_CHECK_EQUAL( DepthCompositor::key( encoded+3 ), 0x070809u );
+
+    DepthCompositor::encode( encoded, depth, 4, 2, 2, 1, true );
+    BOOST_CHECK_EQUAL( DepthCompositor::key( encoded+3 ), 0x070800u );
+}
+
+namespace {
+
+/** Compositing controller with workers that reply from memory, some of which
+  * fail.
+  */
+class FakeWorkersController : public tinia::trell::IPCCompositingJobController
+{
+public:
+    FakeWorkersController( const std::vector<std::string>& workers )
+        : tinia::trell::IPCCompositingJobController( workers )
+    {}
+
+    std::set<std::string>   m_failing_updates;
+    std::set<std::string>   m_failing_fetches;
+
+    bool
+    snapshot( std::vector<unsigned char>& rgb, size_t width, size_t height )
+    {
+        rgb.resize( 4*((3*width*height+3)/4) );
+        return onGetSnapshot( reinterpret_cast<char*>( &rgb[0] ), TRELL_PIXEL_FORMAT_RGB,
+                              width, height, width, height, false, false, "session", "viewer" );
+    }
+
+protected:
+    bool
+    updateWorker( const std::string& worker, const std::string&, const std::string& )
+    {
+        return m_failing_updates.count( worker ) == 0;
+    }
+
+    // Each worker covers the image with its own colour, at its own depth.
+    bool
+    fetchSnapshot( const std::string&   worker,
+                   const std::string&,
+                   const std::string&,
+                   size_t               width,
+                   size_t               height,
+                   std::vector<char>*   reply,
+                   char*                ok )
+    {
+        *ok = 0;
+        if( m_failing_fetches.count( worker ) != 0 ) {
+            return false;
+        }
+        const size_t padded = 4*((3*width*height+3)/4);
+        reply->assign( sizeof(tinia_msg_image_t) + 2*padded + sizeof(float)*16*2, 0 );
+        const unsigned char colour = worker[0];
+        unsigned char* rgb = reinterpret_cast<unsigned char*>( &(*reply)[0] ) + sizeof(tinia_msg_image_t);
+        for( size_t i=0; i<width*height; i++ ) {
+            rgb[3*i+0] = rgb[3*i+1] = rgb[3*i+2] = colour;
+            Partition::encode( rgb + padded + 3*i, colour/256.f );
+        }
+        *ok = 1;
+        return true;
+    }
+};
+
+} // of anonymous namespace
+
+BOOST_AUTO_TEST_CASE( SnapshotFailsWithoutAllWorkers )
+{
+    tinia::jobcontroller::Job job;
+    job.getExposedModel()->addElement( "viewer", tinia::model::Viewer() );
+
+    std::vector<std::string> workers;
+    workers.push_back( "b_worker" );
+    workers.push_back( "a_worker" );
+    workers.push_back( "c_worker" );
+    FakeWorkersController controller( workers );
+    controller.setJob( &job );
+
+    // The nearest worker covers the whole image.
+    std::vector<unsigned char> rgb;
+    BOOST_REQUIRE( controller.snapshot( rgb, 8, 4 ) );
+    BOOST_CHECK_EQUAL( rgb[0], (unsigned char)'a' );
+    BOOST_CHECK_EQUAL( rgb[3*8*4-1], (unsigned char)'a' );
+
+    // A worker that does not reply leaves a part of the scene out.
+    controller.m_failing_fetches.insert( "c_worker" );
+    BOOST_CHECK( !controller.snapshot( rgb, 8, 4 ) );
+    controller.m_failing_fetches.clear();
+
+    // A worker that is not updated would render with a stale viewer.
+    controller.m_failing_updates.insert( "b_worker" );
+    BOOST_CHECK( !controller.snapshot( rgb, 8, 4 ) );
+    controller.m_failing_updates.clear();
+
+    BOOST_CHECK( controller.snapshot( rgb, 8, 4 ) );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
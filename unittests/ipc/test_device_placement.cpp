@@ -0,0 +1,222 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <boost/test/unit_test.hpp>
+#include "tinia/trell/DevicePlacement.hpp"
+
+using tinia::trell::DevicePlacement;
+
+BOOST_AUTO_TEST_SUITE( DevicePlacementTest )
+
+namespace {
+
+std::vector<std::string>
+threeDevices()
+{
+    std::vector<std::string> devices;
+    devices.push_back( "egl:0" );
+    devices.push_back( "egl:1" );
+    devices.push_back( "egl:surfaceless" );
+    return devices;
+}
+
+DevicePlacement::Load
+load( double render_ms, double readback_ms, unsigned long memory_kb = 0 )
+{
+    DevicePlacement::Load l;
+    l.m_render_ms = render_ms;
+    l.m_readback_ms = readback_ms;
+    l.m_memory_kb = memory_kb;
+    return l;
+}
+
+/** A simulated server: software rendered devices, each with a slowdown,
+  * and jobs with a per-frame cost on a unit-speed device, that report their
+  * load in heartbeats after they have been placed.
+  */
+struct Simulation
+{
+    std::map<std::string, double>       m_slowdown;
+    std::map<std::string, std::string>  m_device_of;
+    std::map<std::string, double>       m_cost_of;
+
+    Simulation()
+    {
+        m_slowdown["egl:0"] = 1.0;
+        m_slowdown["egl:1"] = 1.0;
+        m_slowdown["egl:surfaceless"] = 4.0;  // llvmpipe next to two GPUs.
+    }
+
+    /** Per-frame milliseconds of a job on device. */
+    DevicePlacement::Load
+    measure( const std::string& job, const std::string& device )
+    {
+        const double slowdown = m_slowdown[ device ];
+        return load( 0.8*m_cost_of[job]*slowdown, 0.2*m_cost_of[job]*slowdown, 50000 );
+    }
+
+    /** The busiest device, in milliseconds of frames per round. */
+    double
+    makespan()
+    {
+        std::map<std::string, double> busy;
+        for( std::map<std::string, std::string>::iterator it=m_device_of.begin(); it!=m_device_of.end(); ++it ) {
+            DevicePlacement::Load l = measure( it->first, it->second );
+            busy[ it->second ] += l.m_render_ms + l.m_readback_ms;
+        }
+        double max = 0.0;
+        for( std::map<std::string, double>::iterator it=busy.begin(); it!=busy.end(); ++it ) {
+            max = std::max( max, it->second );
+        }
+        return max;
+    }
+};
+
+/** Jobs with per-frame costs from 2 to 20 ms, the same sequence every run. */
+std::vector<double>
+jobCosts( size_t n )
+{
+    std::vector<double> costs;
+    unsigned int x = 12345u;
+    for( size_t i=0; i<n; i++ ) {
+        x = 1103515245u*x + 12345u;
+        costs.push_back( 2.0 + ((x>>16)%1000)*0.018 );
+    }
+    return costs;
+}
+
+} // of anonymous namespace
+
+BOOST_AUTO_TEST_CASE( NoDevicesNoPlacement )
+{
+    DevicePlacement placement;
+    BOOST_CHECK_EQUAL( placement.place( "job" ), "" );
+    BOOST_CHECK_EQUAL( placement.device( "job" ), "" );
+}
+
+BOOST_AUTO_TEST_CASE( IdleJobsAreSpreadEvenly )
+{
+    DevicePlacement placement;
+    placement.setDevices( threeDevices() );
+    std::map<std::string, int> jobs;
+    for( int i=0; i<6; i++ ) {
+        std::stringstream id;
+        id << "job" << i;
+        jobs[ placement.place( id.str() ) ]++;
+    }
+    BOOST_CHECK_EQUAL( jobs["egl:0"], 2 );
+    BOOST_CHECK_EQUAL( jobs["egl:1"], 2 );
+    BOOST_CHECK_EQUAL( jobs["egl:surfaceless"], 2 );
+}
+
+BOOST_AUTO_TEST_CASE( BusyDeviceIsAvoided )
+{
+    DevicePlacement placement;
+    placement.setDevices( threeDevices() );
+    placement.place( "a" );
+    placement.place( "b" );
+    placement.place( "c" );
+    placement.update( "a", load( 30.0, 5.0 ) );
+    placement.update( "c", load( 2.0, 1.0 ) );
+
+    // b is idle, and counts min_job_ms.
+    BOOST_CHECK_EQUAL( placement.place( "d" ), "egl:1" );
+    BOOST_CHECK_EQUAL( placement.place( "e" ), "egl:1" );
+    BOOST_CHECK_EQUAL( placement.place( "f" ), "egl:surfaceless" );
+    BOOST_CHECK_EQUAL( placement.deviceLoad( "egl:1" ).m_jobs, 3u );
+    BOOST_CHECK_CLOSE( placement.deviceLoad( "egl:0" ).m_cost, 35.0, 1e-9 );
+}
+
+BOOST_AUTO_TEST_CASE( PinnedAndRemovedJobs )
+{
+    DevicePlacement placement;
+    placement.setDevices( threeDevices() );
+
+    // Pinned to a listed device, and to one that jobs are not placed on.
+    placement.assign( "pinned", "egl:0" );
+    placement.update( "pinned", load( 50.0, 10.0, 1000 ) );
+    placement.assign( "elsewhere", ":0.0" );
+    placement.update( "elsewhere", load( 1.0, 1.0 ) );
+    BOOST_CHECK_EQUAL( placement.device( "pinned" ), "egl:0" );
+
+    BOOST_CHECK( placement.place( "x" ) != "egl:0" );
+    BOOST_CHECK( placement.place( "y" ) != "egl:0" );
+    BOOST_CHECK( placement.xml().find( "<device id=\":0.0\" jobs=\"1\"" ) != std::string::npos );
+    BOOST_CHECK( placement.xml().find( "memoryKb=\"1000\"" ) != std::string::npos );
+
+    placement.remove( "pinned" );
+    BOOST_CHECK_EQUAL( placement.deviceLoad( "egl:0" ).m_jobs, 0u );
+    BOOST_CHECK_EQUAL( placement.place( "z" ), "egl:0" );
+}
+
+BOOST_AUTO_TEST_CASE( SimulatedSoftwareDevices )
+{
+    const std::vector<std::string> devices = threeDevices();
+    const std::vector<double> costs = jobCosts( 30 );
+
+    // --- placed by load, jobs report their load before the next arrives ----
+    Simulation placed;
+    DevicePlacement placement;
+    placement.setDevices( devices );
+    for( size_t i=0; i<costs.size(); i++ ) {
+        std::stringstream id;
+        id << "job" << i;
+        placed.m_cost_of[ id.str() ] = costs[i];
+        placed.m_device_of[ id.str() ] = placement.place( id.str() );
+        for( std::map<std::string, std::string>::iterator it=placed.m_device_of.begin(); it!=placed.m_device_of.end(); ++it ) {
+            placement.update( it->first, placed.measure( it->first, it->second ) );
+        }
+    }
+
+    // --- round robin, as when the devices are handed out in turn -------------
+    Simulation round_robin;
+    for( size_t i=0; i<costs.size(); i++ ) {
+        std::stringstream id;
+        id << "job" << i;
+        round_robin.m_cost_of[ id.str() ] = costs[i];
+        round_robin.m_device_of[ id.str() ] = devices[ i % devices.size() ];
+    }
+
+    // --- all on the first device, as before ----------------------------------
+    Simulation first;
+    for( size_t i=0; i<costs.size(); i++ ) {
+        std::stringstream id;
+        id << "job" << i;
+        first.m_cost_of[ id.str() ] = costs[i];
+        first.m_device_of[ id.str() ] = devices[0];
+    }
+
+    BOOST_TEST_MESSAGE( "Busiest device per round of frames: first device " << first.makespan()
+                        << " ms, round robin " << round_robin.makespan()
+                        << " ms, placed by load " << placed.makespan() << " ms." );
+
+    BOOST_CHECK( placed.makespan() < round_robin.makespan() );
+    BOOST_CHECK( placed.makespan() < first.makespan() / 2.0 );
+    // The software device gets fewer jobs than each of the fast ones.
+    BOOST_CHECK( placement.deviceLoad( "egl:surfaceless" ).m_jobs < placement.deviceLoad( "egl:0" ).m_jobs );
+    BOOST_CHECK( placement.deviceLoad( "egl:surfaceless" ).m_jobs < placement.deviceLoad( "egl:1" ).m_jobs );
+    BOOST_CHECK_EQUAL( placement.deviceLoad( "egl:0" ).m_jobs +
+                       placement.deviceLoad( "egl:1" ).m_jobs +
+                       placement.deviceLoad( "egl:surfaceless" ).m_jobs, costs.size() );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,91 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <unistd.h>
+#include <boost/test/unit_test.hpp>
+#include "tinia/trell/Hibernation.hpp"
+
+using tinia::trell::Hibernation;
+
+BOOST_AUTO_TEST_SUITE( HibernationTest )
+
+namespace {
+
+const std::string
+testPath()
+{
+    std::stringstream o;
+    o << "test_hibernation_" << getpid();
+    return Hibernation::path( o.str() );
+}
+
+} // of anonymous namespace
+
+BOOST_AUTO_TEST_CASE( RoundTrip )
+{
+    const std::string path = testPath();
+    std::string payload( "binary\0payload\n", 15 );
+    const std::string model = "<ExposedModelUpdate><State><a>1</a></State></ExposedModelUpdate>";
+    BOOST_REQUIRE( Hibernation::write( path, model, payload, 1234u ) );
+
+    std::string model_read;
+    std::string payload_read;
+    unsigned int revision = 0u;
+    BOOST_REQUIRE( Hibernation::read( path, model_read, payload_read, revision ) );
+    BOOST_CHECK_EQUAL( model_read, model );
+    BOOST_CHECK( payload_read == payload );
+    BOOST_CHECK_EQUAL( revision, 1234u );
+
+    // An empty payload, overwriting the previous file.
+    BOOST_REQUIRE( Hibernation::write( path, model, "", 7u ) );
+    BOOST_REQUIRE( Hibernation::read( path, model_read, payload_read, revision ) );
+    BOOST_CHECK( payload_read.empty() );
+    BOOST_CHECK_EQUAL( revision, 7u );
+    std::remove( path.c_str() );
+}
+
+BOOST_AUTO_TEST_CASE( IncompleteFilesAreRejected )
+{
+    const std::string path = testPath();
+    std::string model;
+    std::string payload;
+    unsigned int revision;
+    BOOST_CHECK( !Hibernation::read( path, model, payload, revision ) );
+
+    BOOST_REQUIRE( Hibernation::write( path, "<model/>", "payload", 1u ) );
+    {
+        std::ifstream in( path.c_str(), std::ios::binary );
+        std::string contents( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+        std::ofstream out( path.c_str(), std::ios::binary | std::ios::trunc );
+        out << contents.substr( 0, contents.size() - 3 );
+    }
+    BOOST_CHECK( !Hibernation::read( path, model, payload, revision ) );
+
+    {
+        std::ofstream out( path.c_str(), std::ios::binary | std::ios::trunc );
+        out << "something else\n";
+    }
+    BOOST_CHECK( !Hibernation::read( path, model, payload, revision ) );
+    std::remove( path.c_str() );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,210 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "tinia/trell/IPCController.hpp"
+#include "../../src/ipc/ipc_msg_internal.h"
+
+using tinia::trell::IPCController;
+
+BOOST_AUTO_TEST_SUITE( JobPool )
+
+namespace {
+
+void
+quietLogger( void* data, int level, const char* who, const char* msg, ... )
+{
+}
+
+/** Replies OK to everything, and records the heartbeats like trell_master. */
+class FakeMaster : public IPCController
+{
+public:
+    FakeMaster()
+        : IPCController( true )
+    {
+        m_logger_callback = quietLogger;
+    }
+
+    /** Waits up to ten seconds for a heartbeat from job_id with state. */
+    bool
+    waitForHeartbeat( const std::string& job_id, TrellJobState state )
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        const boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds( 10 );
+        while( m_beats.find( job_id ) == m_beats.end() || m_beats[ job_id ] != state ) {
+            if( !m_cond.timed_wait( lock, deadline ) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+protected:
+    size_t
+    handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
+    {
+        if( (msg->type == TRELL_MESSAGE_HEARTBEAT) && (msg_size >= sizeof(tinia_msg_heartbeat_t)) ) {
+            tinia_msg_heartbeat_t* beat = reinterpret_cast<tinia_msg_heartbeat_t*>( msg );
+            boost::mutex::scoped_lock lock( m_mutex );
+            m_beats[ beat->job_id ] = beat->state;
+            m_cond.notify_all();
+        }
+        msg->type = TRELL_MESSAGE_OK;
+        return sizeof(tinia_msg_t);
+    }
+
+    boost::mutex                            m_mutex;
+    boost::condition_variable               m_cond;
+    std::map<std::string, TrellJobState>    m_beats;
+};
+
+/** A job that replies OK to everything. */
+class PooledJob : public IPCController
+{
+public:
+    PooledJob()
+        : IPCController( false )
+    {
+        m_logger_callback = quietLogger;
+    }
+
+protected:
+    size_t
+    handle( tinia_msg_t* msg, size_t msg_size, size_t buf_size )
+    {
+        msg->type = TRELL_MESSAGE_OK;
+        return sizeof(tinia_msg_t);
+    }
+};
+
+void
+runController( IPCController* controller )
+{
+    controller->run( 0, NULL );
+}
+
+/** Plays the part of the render queue and the notification coalescer. */
+void
+notifyUntil( IPCController* controller, volatile bool* stop, unsigned long* count )
+{
+    while( !*stop ) {
+        controller->notify();
+        (*count)++;
+    }
+}
+
+TrellMessageType
+send( const std::string& id, const char* query, size_t query_size )
+{
+    tinia_msg_t reply;
+    size_t reply_size;
+    if( ipc_msg_client_sendrecv_buffered_by_name( id.c_str(), quietLogger, NULL,
+                                                  query, query_size,
+                                                  reinterpret_cast<char*>( &reply ), &reply_size,
+                                                  sizeof(reply) ) != 0 )
+    {
+        return TRELL_MESSAGE_ERROR;
+    }
+    return reply.type;
+}
+
+TrellMessageType
+ping( const std::string& id )
+{
+    tinia_msg_t query;
+    memset( &query, 0, sizeof(query) );
+    query.type = TRELL_MESSAGE_GET_POLICY_UPDATE;
+    return send( id, reinterpret_cast<const char*>( &query ), sizeof(query) );
+}
+
+/** Pings id until it answers, for up to ten seconds. */
+bool
+waitForBox( const std::string& id )
+{
+    for( int i=0; i<1000; i++ ) {
+        if( ping( id ) == TRELL_MESSAGE_OK ) {
+            return true;
+        }
+        usleep( 10000 );
+    }
+    return false;
+}
+
+} // of anonymous namespace
+
+BOOST_AUTO_TEST_CASE( PooledJobMovesToAssignedId )
+{
+    std::stringstream o;
+    o << "test_pool_" << getpid();
+    const std::string master_id = o.str();
+    const std::string pool_id = master_id + "_pool1";
+    const std::string job_id = master_id + "_job";
+
+    // The job and the master find each other by name, in real shared memory.
+    ipc_msg_fake_shmem = 0;
+
+    // IPCController::run reads its ids from the environment.
+    setenv( "TINIA_JOB_ID", master_id.c_str(), 1 );
+    setenv( "TINIA_MASTER_ID", master_id.c_str(), 1 );
+    FakeMaster master;
+    boost::thread master_thread( boost::bind( runController, &master ) );
+    BOOST_REQUIRE( waitForBox( master_id ) );
+
+    // --- a job is started in the pool ----------------------------------------
+    setenv( "TINIA_JOB_ID", pool_id.c_str(), 1 );
+    PooledJob job;
+    boost::thread job_thread( boost::bind( runController, &job ) );
+    BOOST_REQUIRE( master.waitForHeartbeat( pool_id, TRELL_JOBSTATE_RUNNING ) );
+
+    // Other threads of the job notify throughout the move.
+    volatile bool stop = false;
+    unsigned long notifications = 0;
+    boost::thread notify_thread( boost::bind( notifyUntil, &job, &stop, &notifications ) );
+
+    // --- a request hits the pool and the job gets its id ---------------------
+    tinia_msg_assign_job_t assign;
+    memset( &assign, 0, sizeof(assign) );
+    assign.msg.type = TRELL_MESSAGE_ASSIGN_JOB;
+    strncpy( assign.job_id, job_id.c_str(), TINIA_IPC_JOBID_MAXLENGTH );
+    BOOST_CHECK_EQUAL( send( pool_id, reinterpret_cast<const char*>( &assign ), sizeof(assign) ),
+                       TRELL_MESSAGE_OK );
+
+    // --- the message box is renamed --------------------------------------------
+    BOOST_CHECK( master.waitForHeartbeat( job_id, TRELL_JOBSTATE_RUNNING ) );
+    BOOST_CHECK_EQUAL( ping( job_id ), TRELL_MESSAGE_OK );
+    BOOST_CHECK_EQUAL( ping( pool_id ), TRELL_MESSAGE_ERROR );
+
+    stop = true;
+    notify_thread.join();
+    BOOST_CHECK( notifications > 0 );
+
+    job.finish();
+    job_thread.join();
+    BOOST_CHECK_EQUAL( ping( job_id ), TRELL_MESSAGE_ERROR );
+    master.finish();
+    master_thread.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
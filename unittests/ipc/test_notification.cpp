@@ -15,6 +15,7 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <unistd.h>
 #include <boost/test/unit_test.hpp>
 #include "test_fixture.hpp"
 
@@ -27,12 +28,14 @@ struct NotificationFixture
     int             m_longpolling_clients;
     pthread_cond_t  m_longpolling_clients_cond;
     int             m_clients_that_got_flag;
+    int             m_wait_for_renders;     // Clients wait on render notifications.
 
     NotificationFixture()
         : m_flag(0),
           m_longpolling_clients(0),
           m_longpolling_clients_cond( PTHREAD_COND_INITIALIZER ),
-          m_clients_that_got_flag( 0 )
+          m_clients_that_got_flag( 0 ),
+          m_wait_for_renders( 0 )
     {}
     
     
@@ -70,13 +73,23 @@ struct NotificationFixture
             }
         }
 
+        if( m_wait_for_renders ) {
+            // A model notification doesn't wake clients waiting for renders,
+            // which would ask again and be counted once more.
+            BOOST_CHECK_EQUAL( ipc_msg_server_notify( m_server ), 0 );
+            usleep( 100000 );
+            Locker locker( client_lock );
+            BOOST_CHECK_EQUAL( m_longpolling_clients, m_clients );
+        }
+
         // All clients should be longpolling, now set the flag and notify server
         // that something has changed.
         {
             Locker locker( server_lock );
             m_flag = 1;
         }
-        int rc = ipc_msg_server_notify( m_server );
+        int rc = m_wait_for_renders ? ipc_msg_server_notify_renders( m_server )
+                                    : ipc_msg_server_notify( m_server );
         
         BOOST_REQUIRE( pthread_mutex_lock( &lock ) == 0 );
         BOOST_CHECK_EQUAL( rc, 0 );
@@ -136,7 +149,7 @@ struct NotificationFixture
             if( m_longpolling_clients == m_clients ) {
                 NOT_MAIN_THREAD_REQUIRE( this, pthread_cond_signal( &m_longpolling_clients_cond ) == 0  );
             }
-            return 1;
+            return m_wait_for_renders ? 2 : 1;
         }
         else {
             Locker locker( this->client_lock );
@@ -158,5 +171,17 @@ BOOST_FIXTURE_TEST_CASE( wait, NotificationFixture )
     BOOST_REQUIRE_EQUAL( m_clients_that_got_flag, m_clients );
 }
 
+BOOST_FIXTURE_TEST_CASE( waitForRenders, NotificationFixture )
+{
+    ipc_msg_fake_shmem = 1;
+    m_clients = 3;
+    m_failure_is_an_option = 0;
+    m_wait_for_renders = 1;
+    BOOST_REQUIRE_EQUAL( ipc_msg_fake_shmem_users, 0 );
+    run();
+    BOOST_REQUIRE_EQUAL( ipc_msg_fake_shmem_users, 0 );
+    BOOST_REQUIRE_EQUAL( m_clients_that_got_flag, m_clients );
+}
+
 
 BOOST_AUTO_TEST_SUITE_END()
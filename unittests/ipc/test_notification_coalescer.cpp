@@ -0,0 +1,136 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "tinia/trell/NotificationCoalescer.hpp"
+
+BOOST_AUTO_TEST_SUITE( NotificationCoalescer )
+
+namespace {
+
+/** Mimics a model revision and a long-poller that reads it when notified. */
+struct CoalescerFixture
+{
+    boost::mutex                m_mutex;
+    boost::condition_variable   m_cond;
+    unsigned long               m_revision;     // Bumped before each request.
+    unsigned long               m_seen;         // Revision seen at last delivery.
+    unsigned long               m_deliveries;
+
+    CoalescerFixture()
+        : m_revision( 0u ), m_seen( 0u ), m_deliveries( 0u )
+    {}
+
+    void
+    deliver()
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_seen = m_revision;
+        m_deliveries++;
+        m_cond.notify_all();
+    }
+
+    void
+    modify( tinia::trell::NotificationCoalescer& coalescer )
+    {
+        {
+            boost::mutex::scoped_lock lock( m_mutex );
+            m_revision++;
+        }
+        coalescer.request();
+    }
+
+    void
+    modifyMany( tinia::trell::NotificationCoalescer* coalescer, int n )
+    {
+        for( int i=0; i<n; i++ ) {
+            modify( *coalescer );
+        }
+    }
+
+    /** Waits until the last modification has been seen by a delivery. */
+    bool
+    waitUntilSeen( unsigned long revision )
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds( 5 );
+        while( m_seen != revision ) {
+            if( !m_cond.timed_wait( lock, timeout ) ) {
+                return m_seen == revision;
+            }
+        }
+        return true;
+    }
+};
+
+} // of anonymous namespace
+
+BOOST_FIXTURE_TEST_CASE( ZeroIntervalDeliversEveryRequest, CoalescerFixture )
+{
+    tinia::trell::NotificationCoalescer coalescer( boost::bind( &CoalescerFixture::deliver, this ),
+                                                   boost::posix_time::milliseconds( 0 ) );
+    modifyMany( &coalescer, 10 );
+    BOOST_CHECK_EQUAL( coalescer.requested(), 10u );
+    BOOST_CHECK_EQUAL( coalescer.delivered(), 10u );
+    BOOST_CHECK_EQUAL( m_seen, 10u );
+}
+
+BOOST_FIXTURE_TEST_CASE( BurstIsCoalescedAndNotLost, CoalescerFixture )
+{
+    tinia::trell::NotificationCoalescer coalescer( boost::bind( &CoalescerFixture::deliver, this ),
+                                                   boost::posix_time::milliseconds( 50 ) );
+    modifyMany( &coalescer, 1000 );
+    BOOST_CHECK( waitUntilSeen( 1000u ) );
+    BOOST_CHECK_EQUAL( coalescer.requested(), 1000u );
+    BOOST_CHECK_LT( coalescer.delivered(), 100u );
+    BOOST_CHECK_EQUAL( coalescer.delivered(), m_deliveries );
+}
+
+BOOST_FIXTURE_TEST_CASE( FlushDeliversPending, CoalescerFixture )
+{
+    tinia::trell::NotificationCoalescer coalescer( boost::bind( &CoalescerFixture::deliver, this ),
+                                                   boost::posix_time::seconds( 60 ) );
+    modify( coalescer );    // Delivered immediately, starts the interval.
+    modify( coalescer );    // Deferred for a minute...
+    BOOST_CHECK_EQUAL( m_seen, 1u );
+    coalescer.flush();      // ...unless the batch is finished.
+    BOOST_CHECK_EQUAL( m_seen, 2u );
+    BOOST_CHECK_EQUAL( coalescer.delivered(), 2u );
+
+    coalescer.flush();      // Nothing pending, nothing delivered.
+    BOOST_CHECK_EQUAL( coalescer.delivered(), 2u );
+}
+
+BOOST_FIXTURE_TEST_CASE( ConcurrentRequestersAreNotLost, CoalescerFixture )
+{
+    tinia::trell::NotificationCoalescer coalescer( boost::bind( &CoalescerFixture::deliver, this ),
+                                                   boost::posix_time::milliseconds( 5 ) );
+    const int threads = 4;
+    const int n = 2000;
+    boost::thread_group group;
+    for( int i=0; i<threads; i++ ) {
+        group.create_thread( boost::bind( &CoalescerFixture::modifyMany, this, &coalescer, n ) );
+    }
+    group.join_all();
+    BOOST_CHECK( waitUntilSeen( threads*n ) );
+    BOOST_CHECK_EQUAL( coalescer.requested(), (unsigned long)(threads*n) );
+    BOOST_CHECK_LE( coalescer.delivered(), coalescer.requested() );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
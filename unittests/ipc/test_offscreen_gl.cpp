@@ -0,0 +1,111 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+#include <algorithm>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "tinia/trell/OffscreenGL.hpp"
+
+BOOST_AUTO_TEST_SUITE( OffscreenGL )
+
+using tinia::trell::impl::OffscreenGL;
+
+BOOST_AUTO_TEST_CASE( EGLDevicesAreRecognizedByName )
+{
+    BOOST_CHECK( OffscreenGL::isEGLDevice( "egl:0" ) );
+    BOOST_CHECK( OffscreenGL::isEGLDevice( "egl:surfaceless" ) );
+    BOOST_CHECK( !OffscreenGL::isEGLDevice( ":0.0" ) );
+
+    OffscreenGL gl;
+    BOOST_CHECK( !gl.setupContext( "egl:no-such-device" ) );
+    BOOST_CHECK_EQUAL( gl.state(), OffscreenGL::STATE_FAILED_TO_OPEN_DISPLAY );
+}
+
+#ifdef TINIA_HAVE_EGL
+
+namespace {
+
+/** Clears a small framebuffer object and reads back a pixel. */
+void
+clearAndRead( OffscreenGL* gl, unsigned char* pixel, bool* bound )
+{
+    *bound = gl->bindContext();
+    if( !*bound ) {
+        return;
+    }
+    GLuint fbo, rb;
+    glGenFramebuffers( 1, &fbo );
+    glGenRenderbuffers( 1, &rb );
+    glBindRenderbuffer( GL_RENDERBUFFER, rb );
+    glRenderbufferStorage( GL_RENDERBUFFER, GL_RGBA8, 4, 4 );
+    glBindFramebuffer( GL_FRAMEBUFFER, fbo );
+    glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rb );
+    glViewport( 0, 0, 4, 4 );
+    glClearColor( 1.f, 0.f, 1.f, 1.f );
+    glClear( GL_COLOR_BUFFER_BIT );
+    glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+    glReadPixels( 1, 1, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, pixel );
+    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+    glDeleteFramebuffers( 1, &fbo );
+    glDeleteRenderbuffers( 1, &rb );
+    gl->releaseContext();
+}
+
+} // of anonymous namespace
+
+BOOST_AUTO_TEST_CASE( HeadlessContextRendersOnAnyThread )
+{
+    // Mesa provides the surfaceless platform, with llvmpipe if there is no GPU.
+    std::list<std::string> devices = OffscreenGL::eglDevices();
+    if( std::find( devices.begin(), devices.end(), "egl:surfaceless" ) == devices.end() ) {
+        BOOST_TEST_MESSAGE( "No egl:surfaceless, skipping." );
+        return;
+    }
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    OffscreenGL gl;
+    BOOST_REQUIRE( gl.setupContext( "egl:surfaceless" ) );
+    BOOST_CHECK( gl.isEGL() );
+    BOOST_CHECK( gl.display() == NULL );
+    BOOST_TEST_MESSAGE( "egl:surfaceless context created in "
+                        << ( boost::posix_time::microsec_clock::universal_time() - start ).total_microseconds()/1000.0
+                        << " ms" );
+
+    unsigned char pixel[3] = { 0, 0, 0 };
+    bool bound = false;
+    clearAndRead( &gl, pixel, &bound );
+    BOOST_REQUIRE( bound );
+    BOOST_CHECK_EQUAL( (int)pixel[0], 255 );
+    BOOST_CHECK_EQUAL( (int)pixel[1], 0 );
+    BOOST_CHECK_EQUAL( (int)pixel[2], 255 );
+    BOOST_CHECK_EQUAL( gl.state(), OffscreenGL::STATE_INITIALIZED );
+
+    // Released, the context can be bound by a render thread.
+    pixel[0] = pixel[1] = pixel[2] = 0;
+    bound = false;
+    boost::thread render( boost::bind( clearAndRead, &gl, pixel, &bound ) );
+    render.join();
+    BOOST_CHECK( bound );
+    BOOST_CHECK_EQUAL( (int)pixel[2], 255 );
+}
+
+#endif // TINIA_HAVE_EGL
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,330 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "tinia/trell/RenderQueue.hpp"
+
+BOOST_AUTO_TEST_SUITE( RenderQueue )
+
+namespace {
+
+/** Counts renders and notifications, and mimics a server that serves one
+  * transaction at a time.
+  */
+struct RenderQueueFixture
+{
+    boost::mutex                m_mutex;
+    boost::condition_variable   m_cond;
+    unsigned long               m_renders;
+    unsigned long               m_notifications;
+    boost::thread::id           m_render_thread;
+    bool                        m_one_render_thread;
+    std::vector<int>            m_order;
+    boost::posix_time::time_duration    m_render_time;
+    boost::mutex                m_transaction;  // Held while a transaction is served.
+    unsigned int                m_revision;     // Of the model.
+    bool                        m_bump;         // Change the model during each render.
+    unsigned int                m_max_tries;    // Queries sent for one snapshot.
+
+    RenderQueueFixture()
+        : m_renders( 0u ),
+          m_notifications( 0u ),
+          m_one_render_thread( true ),
+          m_render_time( boost::posix_time::milliseconds( 0 ) ),
+          m_revision( 0u ),
+          m_bump( false ),
+          m_max_tries( 0u )
+    {}
+
+    unsigned int
+    revision()
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        return m_revision;
+    }
+
+    void
+    notify()
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_notifications++;
+        m_cond.notify_all();
+    }
+
+    void
+    render( const std::string& query, std::string& reply )
+    {
+        boost::this_thread::sleep( m_render_time );
+        boost::mutex::scoped_lock lock( m_mutex );
+        if( m_bump ) {
+            m_revision++;
+        }
+        if( m_render_thread == boost::thread::id() ) {
+            m_render_thread = boost::this_thread::get_id();
+        }
+        m_one_render_thread = m_one_render_thread && ( m_render_thread == boost::this_thread::get_id() );
+        m_renders++;
+        reply = "rendered " + query;
+    }
+
+    void
+    task( int i )
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_order.push_back( i );
+        if( m_render_thread == boost::thread::id() ) {
+            m_render_thread = boost::this_thread::get_id();
+        }
+        m_one_render_thread = m_one_render_thread && ( m_render_thread == boost::this_thread::get_id() );
+    }
+
+    void
+    tasks( tinia::trell::RenderQueue* queue, int first, int n )
+    {
+        for( int i=first; i<first+n; i++ ) {
+            queue->invoke( boost::bind( &RenderQueueFixture::task, this, i ) );
+        }
+    }
+
+    /** Waits until notify has been invoked n times. */
+    bool
+    waitForNotifications( unsigned long n )
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds( 5 );
+        while( m_notifications < n ) {
+            if( !m_cond.timed_wait( lock, timeout ) ) {
+                return m_notifications >= n;
+            }
+        }
+        return true;
+    }
+
+    /** A snapshot transaction as the client sees it: the query is resent
+      * each time the server asks it to wait for a notification, with the
+      * revision it waits for.
+      */
+    std::string
+    snapshot( tinia::trell::RenderQueue* queue, const std::string& query )
+    {
+        std::string reply;
+        unsigned int wait = 0u;
+        unsigned int tries = 0u;
+        while( true ) {
+            unsigned long seen;
+            {
+                boost::mutex::scoped_lock lock( m_mutex );
+                seen = m_notifications;
+            }
+            {
+                boost::mutex::scoped_lock transaction( m_transaction );
+                if( queue == NULL ) {
+                    render( query, reply );
+                    return reply;
+                }
+                if( tries++ == 0u ) {
+                    wait = revision();
+                }
+                if( queue->reply( query, wait, boost::bind( &RenderQueueFixture::render, this, _1, _2 ), reply ) ) {
+                    boost::mutex::scoped_lock lock( m_mutex );
+                    m_max_tries = std::max( m_max_tries, tries );
+                    return reply;
+                }
+            }
+            // Given up, as when the request times out.
+            if( ( tries >= 100u ) || !waitForNotifications( seen + 1 ) ) {
+                return "";
+            }
+        }
+    }
+
+    void
+    snapshots( tinia::trell::RenderQueue* queue, volatile bool* stop )
+    {
+        while( !*stop ) {
+            snapshot( queue, "viewer" );
+        }
+    }
+
+    /** Milliseconds needed for n model update transactions, one at a time,
+      * while another client keeps asking for snapshots.
+      */
+    std::vector<double>
+    updateLatencies( tinia::trell::RenderQueue* queue, int n )
+    {
+        volatile bool stop = false;
+        boost::thread renderer( boost::bind( &RenderQueueFixture::snapshots, this, queue, &stop ) );
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 10 ) );
+
+        std::vector<double> latencies;
+        for( int i=0; i<n; i++ ) {
+            boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+            {
+                boost::mutex::scoped_lock transaction( m_transaction );
+            }
+            latencies.push_back( ( boost::posix_time::microsec_clock::universal_time() - start ).total_microseconds()/1000.0 );
+            boost::this_thread::sleep( boost::posix_time::milliseconds( 5 ) );
+        }
+        stop = true;
+        renderer.join();
+        std::sort( latencies.begin(), latencies.end() );
+        return latencies;
+    }
+};
+
+} // of anonymous namespace
+
+BOOST_FIXTURE_TEST_CASE( TasksRunInOrderOnTheRenderThread, RenderQueueFixture )
+{
+    tinia::trell::RenderQueue queue( boost::bind( &RenderQueueFixture::notify, this ),
+                                     boost::bind( &RenderQueueFixture::revision, this ),
+                                     boost::posix_time::seconds( 1 ) );
+    tasks( &queue, 0, 10 );
+    BOOST_REQUIRE_EQUAL( m_order.size(), 10u );
+    for( int i=0; i<10; i++ ) {
+        BOOST_CHECK_EQUAL( m_order[i], i );
+    }
+
+    boost::thread other( boost::bind( &RenderQueueFixture::tasks, this, &queue, 10, 100 ) );
+    tasks( &queue, 110, 100 );
+    other.join();
+    BOOST_CHECK_EQUAL( m_order.size(), 210u );
+    BOOST_CHECK( m_one_render_thread );
+    BOOST_CHECK( m_render_thread != boost::this_thread::get_id() );
+}
+
+BOOST_FIXTURE_TEST_CASE( ReplyIsDeferredUntilRendered, RenderQueueFixture )
+{
+    m_render_time = boost::posix_time::milliseconds( 50 );
+    tinia::trell::RenderQueue queue( boost::bind( &RenderQueueFixture::notify, this ),
+                                     boost::bind( &RenderQueueFixture::revision, this ),
+                                     boost::posix_time::seconds( 1 ) );
+    tinia::trell::RenderQueue::Render r = boost::bind( &RenderQueueFixture::render, this, _1, _2 );
+
+    std::string reply;
+    m_revision = 1u;
+    BOOST_CHECK( !queue.reply( "a", 1u, r, reply ) );
+    BOOST_CHECK( !queue.reply( "a", 1u, r, reply ) );   // Resent before ready, not queued again.
+    BOOST_REQUIRE( waitForNotifications( 1u ) );
+    BOOST_CHECK( queue.reply( "a", 1u, r, reply ) );
+    BOOST_CHECK_EQUAL( reply, "rendered a" );
+    BOOST_CHECK_EQUAL( m_renders, 1u );
+    BOOST_CHECK_EQUAL( queue.rendered(), 1u );
+    BOOST_CHECK_EQUAL( queue.deferred(), 2u );
+    BOOST_CHECK( m_one_render_thread );
+}
+
+BOOST_FIXTURE_TEST_CASE( ReplyIsSharedUntilSuperseded, RenderQueueFixture )
+{
+    tinia::trell::RenderQueue queue( boost::bind( &RenderQueueFixture::notify, this ),
+                                     boost::bind( &RenderQueueFixture::revision, this ),
+                                     boost::posix_time::seconds( 10 ) );
+    tinia::trell::RenderQueue::Render r = boost::bind( &RenderQueueFixture::render, this, _1, _2 );
+
+    std::string reply;
+    m_revision = 1u;
+    BOOST_CHECK( !queue.reply( "a", 1u, r, reply ) );
+    BOOST_REQUIRE( waitForNotifications( 1u ) );
+
+    // Several clients asking for the same snapshot get the one render.
+    for( int i=0; i<3; i++ ) {
+        reply.clear();
+        BOOST_CHECK( queue.reply( "a", 1u, r, reply ) );
+        BOOST_CHECK_EQUAL( reply, "rendered a" );
+    }
+    BOOST_CHECK_EQUAL( m_renders, 1u );
+    BOOST_CHECK_EQUAL( queue.served(), 3u );
+
+    // The model has changed, the reply is rendered again.
+    m_revision = 2u;
+    BOOST_CHECK( !queue.reply( "a", 2u, r, reply ) );
+    BOOST_REQUIRE( waitForNotifications( 2u ) );
+    BOOST_CHECK( queue.reply( "a", 2u, r, reply ) );
+    BOOST_CHECK_EQUAL( m_renders, 2u );
+
+    // A client that is behind gets the newer reply.
+    BOOST_CHECK( queue.reply( "a", 1u, r, reply ) );
+    BOOST_CHECK_EQUAL( m_renders, 2u );
+    BOOST_CHECK_EQUAL( queue.rendered(), 2u );
+}
+
+BOOST_FIXTURE_TEST_CASE( QueriesAreServedWhileTheModelChanges, RenderQueueFixture )
+{
+    // As during a trackball drag, the model is newer than each render by the
+    // time it is done.
+    m_bump = true;
+    m_render_time = boost::posix_time::milliseconds( 5 );
+    tinia::trell::RenderQueue queue( boost::bind( &RenderQueueFixture::notify, this ),
+                                     boost::bind( &RenderQueueFixture::revision, this ),
+                                     boost::posix_time::seconds( 10 ) );
+
+    volatile bool stop = false;
+    boost::thread other( boost::bind( &RenderQueueFixture::snapshots, this, &queue, &stop ) );
+    for( int i=0; i<20; i++ ) {
+        BOOST_REQUIRE_EQUAL( snapshot( &queue, "viewer" ), "rendered viewer" );
+    }
+    stop = true;
+    other.join();
+
+    // At worst, a query waits for a render that started before it was sent,
+    // and then for the one queued for it.
+    BOOST_CHECK_LE( m_max_tries, 3u );
+}
+
+BOOST_FIXTURE_TEST_CASE( UnclaimedRepliesExpire, RenderQueueFixture )
+{
+    tinia::trell::RenderQueue queue( boost::bind( &RenderQueueFixture::notify, this ),
+                                     boost::bind( &RenderQueueFixture::revision, this ),
+                                     boost::posix_time::milliseconds( 10 ) );
+    tinia::trell::RenderQueue::Render r = boost::bind( &RenderQueueFixture::render, this, _1, _2 );
+
+    std::string reply;
+    BOOST_CHECK( !queue.reply( "gone", 0u, r, reply ) );
+    BOOST_REQUIRE( waitForNotifications( 1u ) );
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 50 ) );
+
+    BOOST_CHECK( !queue.reply( "b", 0u, r, reply ) );
+    BOOST_CHECK_EQUAL( queue.expired(), 1u );
+    BOOST_REQUIRE( waitForNotifications( 2u ) );
+    BOOST_CHECK( queue.reply( "b", 0u, r, reply ) );
+    BOOST_CHECK_EQUAL( reply, "rendered b" );
+}
+
+BOOST_FIXTURE_TEST_CASE( UpdatesAreNotStuckBehindRenders, RenderQueueFixture )
+{
+    m_render_time = boost::posix_time::milliseconds( 100 );
+    const std::vector<double> before = updateLatencies( NULL, 20 );
+
+    tinia::trell::RenderQueue queue( boost::bind( &RenderQueueFixture::notify, this ),
+                                     boost::bind( &RenderQueueFixture::revision, this ),
+                                     boost::posix_time::seconds( 1 ) );
+    const std::vector<double> after = updateLatencies( &queue, 20 );
+
+    BOOST_TEST_MESSAGE( "Model update latency while rendering, rendering on the server thread: median "
+                        << before[ before.size()/2 ] << " ms, max " << before.back() << " ms" );
+    BOOST_TEST_MESSAGE( "Model update latency while rendering, rendering on the render thread: median "
+                        << after[ after.size()/2 ] << " ms, max " << after.back() << " ms" );
+    BOOST_CHECK_LT( after.back(), 50.0 );
+    BOOST_CHECK_LT( after[ after.size()/2 ], before[ before.size()/2 ] );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,140 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/FrameDelta.hpp"
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+using tinia::jobcontroller::FrameDelta;
+
+namespace {
+
+const unsigned int width  = 100;
+const unsigned int height = 50;
+// Padded to 32 bits, as the frames grabbed by qtcontroller.
+const size_t stride = 4*((3*width+3)/4);
+
+/** Sets the pixel at (x, y), with y from the top. */
+void
+setPixel( std::vector<unsigned char>& frame, unsigned int x, unsigned int y, unsigned char value )
+{
+   frame[ (height-1-y)*stride + 3*x + 1 ] = value;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE( FrameDeltaTest )
+
+BOOST_AUTO_TEST_CASE( FirstFrameIsFull )
+{
+   FrameDelta delta( 16, 0.5 );
+   std::vector<unsigned char> frame( stride*height, 0 );
+
+   FrameDelta::Delta d = delta.update( "client/viewer", 0, &frame[0], width, height, stride );
+   BOOST_CHECK( d.full );
+   BOOST_CHECK( d.frame != 0 );
+   BOOST_REQUIRE_EQUAL( d.tiles.size(), 1u );
+   BOOST_CHECK_EQUAL( d.tiles[0].width, width );
+   BOOST_CHECK_EQUAL( d.tiles[0].height, height );
+}
+
+BOOST_AUTO_TEST_CASE( OnlyChangedTilesAreSent )
+{
+   FrameDelta delta( 16, 0.5 );
+   std::vector<unsigned char> frame( stride*height, 0 );
+   FrameDelta::Delta first = delta.update( "c", 0, &frame[0], width, height, stride );
+
+   FrameDelta::Delta same = delta.update( "c", first.frame, &frame[0], width, height, stride );
+   BOOST_CHECK( !same.full );
+   BOOST_CHECK( same.tiles.empty() );
+
+   // The top left pixel, and the bottom right corner tile (which is cropped to 4x2).
+   setPixel( frame, 0, 0, 255 );
+   setPixel( frame, width-1, height-1, 255 );
+   FrameDelta::Delta d = delta.update( "c", same.frame, &frame[0], width, height, stride );
+   BOOST_CHECK( !d.full );
+   BOOST_REQUIRE_EQUAL( d.tiles.size(), 2u );
+   BOOST_CHECK_EQUAL( d.tiles[0].x, 0u );
+   BOOST_CHECK_EQUAL( d.tiles[0].y, 0u );
+   BOOST_CHECK_EQUAL( d.tiles[0].width, 16u );
+   BOOST_CHECK_EQUAL( d.tiles[1].x, 96u );
+   BOOST_CHECK_EQUAL( d.tiles[1].y, 48u );
+   BOOST_CHECK_EQUAL( d.tiles[1].width, 4u );
+   BOOST_CHECK_EQUAL( d.tiles[1].height, 2u );
+}
+
+BOOST_AUTO_TEST_CASE( FallsBackToFullFrame )
+{
+   FrameDelta delta( 16, 0.25 );
+   std::vector<unsigned char> frame( stride*height, 0 );
+   FrameDelta::Delta first = delta.update( "c", 0, &frame[0], width, height, stride );
+
+   // Changing the top half is more than a quarter.
+   for( unsigned int y=0; y<height/2; y++ ) {
+      for( unsigned int x=0; x<width; x++ ) {
+         setPixel( frame, x, y, 1 );
+      }
+   }
+   FrameDelta::Delta d = delta.update( "c", first.frame, &frame[0], width, height, stride );
+   BOOST_CHECK( d.full );
+   BOOST_CHECK_EQUAL( d.tiles.size(), 1u );
+   BOOST_CHECK_EQUAL( delta.fullFrames(), 2u );
+}
+
+BOOST_AUTO_TEST_CASE( WrongBaseGivesFullFrame )
+{
+   FrameDelta delta( 16, 0.5 );
+   std::vector<unsigned char> frame( stride*height, 0 );
+   FrameDelta::Delta first = delta.update( "a", 0, &frame[0], width, height, stride );
+   FrameDelta::Delta second = delta.update( "a", first.frame, &frame[0], width, height, stride );
+   BOOST_CHECK( !second.full );
+
+   // The client did not get the second reply.
+   BOOST_CHECK( delta.update( "a", first.frame, &frame[0], width, height, stride ).full );
+   // Clients are separate.
+   BOOST_CHECK( delta.update( "b", second.frame, &frame[0], width, height, stride ).full );
+}
+
+BOOST_AUTO_TEST_CASE( LeastRecentClientIsDropped )
+{
+   FrameDelta delta( 16, 0.5, 2 );
+   std::vector<unsigned char> frame( stride*height, 0 );
+   FrameDelta::Delta a = delta.update( "a", 0, &frame[0], width, height, stride );
+   delta.update( "b", 0, &frame[0], width, height, stride );
+   delta.update( "c", 0, &frame[0], width, height, stride );
+   BOOST_CHECK( delta.update( "a", a.frame, &frame[0], width, height, stride ).full );
+}
+
+BOOST_AUTO_TEST_CASE( CopyTileKeepsBottomRowFirst )
+{
+   std::vector<unsigned char> frame( stride*height, 0 );
+   setPixel( frame, 20, 10, 7 );      // Top left of the tile.
+   setPixel( frame, 21, 12, 9 );      // Bottom row of the tile.
+
+   FrameDelta::Tile tile;
+   tile.x = 20;
+   tile.y = 10;
+   tile.width = 2;
+   tile.height = 3;
+   std::vector<unsigned char> dst( 3*2*3, 0 );
+   FrameDelta::copyTile( &frame[0], height, stride, tile, &dst[0], 3*2 );
+   BOOST_CHECK_EQUAL( dst[ 0*6 + 3 + 1 ], 9 );
+   BOOST_CHECK_EQUAL( dst[ 2*6 + 0 + 1 ], 7 );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,167 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/ModelChannel.hpp"
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+using tinia::jobcontroller::ModelChannel;
+
+namespace {
+
+/** A frame as sent by a client. */
+std::string
+clientFrame( const std::string& type, unsigned long sequence, unsigned int revision,
+             const std::string& body = std::string() )
+{
+   ModelChannel::Message message;
+   message.type = type;
+   message.sequence = sequence;
+   message.revision = revision;
+   message.body = body;
+   return ModelChannel::encodeFrame( ModelChannel::OPCODE_TEXT,
+                                     ModelChannel::formatMessage( message ), 0x12345678 );
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE( ModelChannelTest )
+
+BOOST_AUTO_TEST_CASE( AcceptKeyOfRFC6455 )
+{
+   BOOST_CHECK_EQUAL( ModelChannel::acceptKey( "dGhlIHNhbXBsZSBub25jZQ==" ),
+                      "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" );
+}
+
+BOOST_AUTO_TEST_CASE( FramesRoundTrip )
+{
+   const std::string lengths[] = { std::string( 5, 'a' ), std::string( 300, 'b' ), std::string( 70000, 'c' ) };
+   for( size_t i=0; i<3; i++ ) {
+      for( unsigned int mask=0; mask<2; mask++ ) {
+         const std::string encoded = ModelChannel::encodeFrame( ModelChannel::OPCODE_TEXT, lengths[i], mask*0xdeadbeef );
+         ModelChannel::Frame frame;
+         BOOST_CHECK_EQUAL( ModelChannel::decodeFrame( encoded.data(), encoded.size() - 1, frame ), 0u );
+         BOOST_REQUIRE_EQUAL( ModelChannel::decodeFrame( encoded.data(), encoded.size(), frame ), encoded.size() );
+         BOOST_CHECK( frame.fin );
+         BOOST_CHECK_EQUAL( frame.opcode, int( ModelChannel::OPCODE_TEXT ) );
+         BOOST_CHECK( frame.payload == lengths[i] );
+      }
+   }
+}
+
+BOOST_AUTO_TEST_CASE( MessagesAreTakenInOrder )
+{
+   ModelChannel channel;
+   const std::string input = clientFrame( "sync", 1, 7 ) +
+                             clientFrame( "update", 2, 7, "<xml/>" ) +
+                             clientFrame( "update", 2, 7, "<again/>" );
+   // Byte by byte, as a slow network could give them.
+   ModelChannel::Message message;
+   std::vector<ModelChannel::Message> messages;
+   for( size_t i=0; i<input.size(); i++ ) {
+      channel.receive( input.data() + i, 1 );
+      while( channel.next( message ) ) {
+         messages.push_back( message );
+      }
+   }
+   BOOST_REQUIRE_EQUAL( messages.size(), 2u );
+   BOOST_CHECK_EQUAL( messages[0].type, "sync" );
+   BOOST_CHECK_EQUAL( channel.revision(), 7u );
+   BOOST_CHECK_EQUAL( messages[1].type, "update" );
+   BOOST_CHECK_EQUAL( messages[1].body, "<xml/>" );
+   BOOST_CHECK_EQUAL( channel.lastReceived(), 2u );
+}
+
+BOOST_AUTO_TEST_CASE( SentMessagesAreNumbered )
+{
+   ModelChannel channel;
+   channel.send( "ack", 3 );
+   channel.send( "model", 4, "<tns:State tns:revision=\"4\"/>" );
+   BOOST_CHECK_EQUAL( channel.revision(), 4u );
+
+   const std::string output = channel.takeOutput();
+   BOOST_CHECK( channel.takeOutput().empty() );
+   ModelChannel::Frame frame;
+   const size_t first = ModelChannel::decodeFrame( output.data(), output.size(), frame );
+   ModelChannel::Message message;
+   BOOST_REQUIRE( ModelChannel::parseMessage( frame.payload, message ) );
+   BOOST_CHECK_EQUAL( message.sequence, 1u );
+   BOOST_REQUIRE( ModelChannel::decodeFrame( output.data() + first, output.size() - first, frame ) > 0 );
+   BOOST_REQUIRE( ModelChannel::parseMessage( frame.payload, message ) );
+   BOOST_CHECK_EQUAL( message.type, "model" );
+   BOOST_CHECK_EQUAL( message.sequence, 2u );
+   BOOST_CHECK_EQUAL( ModelChannel::revisionOf( message.body ), 4u );
+}
+
+BOOST_AUTO_TEST_CASE( FragmentsAndControlFrames )
+{
+   ModelChannel channel;
+   ModelChannel::Message message;
+   message.type = "update";
+   message.sequence = 1;
+   message.body = "<a/>";
+   const std::string text = ModelChannel::formatMessage( message );
+
+   std::string first = ModelChannel::encodeFrame( ModelChannel::OPCODE_TEXT, text.substr( 0, 5 ), 1 );
+   first[0] &= 0x7f;     // Not the last fragment.
+   const std::string input = first +
+                             ModelChannel::encodeFrame( ModelChannel::OPCODE_PING, "p", 1 ) +
+                             ModelChannel::encodeFrame( ModelChannel::OPCODE_CONTINUATION, text.substr( 5 ), 1 );
+   channel.receive( input.data(), input.size() );
+   BOOST_REQUIRE( channel.next( message ) );
+   BOOST_CHECK_EQUAL( message.body, "<a/>" );
+
+   ModelChannel::Frame pong;
+   const std::string output = channel.takeOutput();
+   BOOST_REQUIRE( ModelChannel::decodeFrame( output.data(), output.size(), pong ) > 0 );
+   BOOST_CHECK_EQUAL( pong.opcode, int( ModelChannel::OPCODE_PONG ) );
+
+   const std::string close = ModelChannel::encodeFrame( ModelChannel::OPCODE_CLOSE, "", 1 );
+   channel.receive( close.data(), close.size() );
+   BOOST_CHECK( !channel.next( message ) );
+   BOOST_CHECK( channel.closed() );
+}
+
+BOOST_AUTO_TEST_CASE( UnmaskedClientFrameCloses )
+{
+   ModelChannel::Message message;
+   message.type = "update";
+   message.sequence = 1;
+   message.body = "<a/>";
+   const std::string unmasked = ModelChannel::encodeFrame( ModelChannel::OPCODE_TEXT,
+                                                           ModelChannel::formatMessage( message ) );
+
+   ModelChannel server;
+   server.receive( unmasked.data(), unmasked.size() );
+   BOOST_CHECK( !server.next( message ) );
+   BOOST_CHECK( server.closed() );
+
+   ModelChannel::Frame close;
+   const std::string output = server.takeOutput();
+   BOOST_REQUIRE( ModelChannel::decodeFrame( output.data(), output.size(), close ) > 0 );
+   BOOST_CHECK_EQUAL( close.opcode, int( ModelChannel::OPCODE_CLOSE ) );
+
+   // The client end reads the unmasked frames of the server.
+   ModelChannel client( false );
+   client.receive( unmasked.data(), unmasked.size() );
+   BOOST_REQUIRE( client.next( message ) );
+   BOOST_CHECK_EQUAL( message.body, "<a/>" );
+   BOOST_CHECK( !client.closed() );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,123 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/ProgressiveRefinement.hpp"
+#include "tinia/model/Viewer.hpp"
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using tinia::jobcontroller::ProgressiveRefinement;
+
+namespace {
+
+struct ModelFixture
+{
+   ModelFixture()
+      : model( new tinia::model::ExposedModel )
+   {
+      model->addElement( "viewer", tinia::model::Viewer() );
+   }
+
+   boost::shared_ptr<tinia::model::ExposedModel> model;
+};
+
+}
+
+BOOST_FIXTURE_TEST_SUITE( ProgressiveRefinementTest, ModelFixture )
+
+BOOST_AUTO_TEST_CASE( OffUnlessJobEnablesIt )
+{
+   ProgressiveRefinement refinement( model );
+   ProgressiveRefinement::Settings settings;
+   BOOST_CHECK( !refinement.settings( settings ) );
+   BOOST_CHECK( !refinement.interactive( "viewer" ) );
+
+   ProgressiveRefinement::Settings custom;
+   custom.scale = 0.25;
+   custom.idle_ms = 500;
+   ProgressiveRefinement::enable( *model, custom );
+   BOOST_REQUIRE( refinement.settings( settings ) );
+   BOOST_CHECK_EQUAL( settings.scale, 0.25 );
+   BOOST_CHECK_EQUAL( settings.idle_ms, 500 );
+
+   model->updateElement( "ap_progressive", false );
+   BOOST_CHECK( !refinement.settings( settings ) );
+}
+
+BOOST_AUTO_TEST_CASE( InteractionRateUpdatesAreInteractive )
+{
+   ProgressiveRefinement refinement( model );
+   ProgressiveRefinement::Settings settings;
+   settings.idle_ms = 100;
+
+   // A single update is not interaction.
+   BOOST_CHECK( !refinement.interactive( "viewer", 1000.0, 5000.0, settings ) );
+   // Updates 20 ms apart are.
+   BOOST_CHECK( refinement.interactive( "viewer", 1020.0, 5020.0, settings ) );
+   BOOST_CHECK( refinement.interactive( "viewer", 1040.0, 5040.0, settings ) );
+   // The same viewer, asked for again without updates, until it has been idle.
+   BOOST_CHECK( refinement.interactive( "viewer", 1040.0, 5100.0, settings ) );
+   BOOST_CHECK( !refinement.interactive( "viewer", 1040.0, 5140.0, settings ) );
+   // Slow updates are not interaction.
+   BOOST_CHECK( !refinement.interactive( "viewer", 2000.0, 6000.0, settings ) );
+   BOOST_CHECK_EQUAL( refinement.interactiveFrames(), 3u );
+}
+
+BOOST_AUTO_TEST_CASE( IdleViewersAreDueOnce )
+{
+   ProgressiveRefinement refinement( model );
+   ProgressiveRefinement::Settings settings;
+   settings.idle_ms = 100;
+
+   refinement.interactive( "viewer", 1000.0, 5000.0, settings );
+   BOOST_CHECK( refinement.due( 5050.0 ).empty() );      // Nothing interactive sent.
+   refinement.interactive( "viewer", 1020.0, 5020.0, settings );
+   BOOST_CHECK( refinement.due( 5050.0 ).empty() );      // Not idle yet.
+   const std::vector<std::string> due = refinement.due( 5120.0 );
+   BOOST_REQUIRE_EQUAL( due.size(), 1u );
+   BOOST_CHECK_EQUAL( due[0], "viewer" );
+   BOOST_CHECK( refinement.due( 5200.0 ).empty() );
+}
+
+BOOST_AUTO_TEST_CASE( HelperThreadAsksForRefinement )
+{
+   ProgressiveRefinement::Settings settings;
+   settings.idle_ms = 20;
+   ProgressiveRefinement::enable( *model, settings );
+   ProgressiveRefinement refinement( model );
+
+   const double now = ProgressiveRefinement::now();
+   refinement.interactive( "viewer", 1000.0, now, settings );
+   BOOST_REQUIRE( refinement.interactive( "viewer", 1010.0, now, settings ) );
+
+   int refinements = 0;
+   for( int i=0; ( i<200 ) && ( refinements == 0 ); i++ ) {
+      boost::this_thread::sleep( boost::posix_time::milliseconds( 10 ) );
+      model->getElementValue( "ap_progressiveRefinements", refinements );
+   }
+   BOOST_CHECK_EQUAL( refinements, 1 );
+   BOOST_CHECK_EQUAL( refinement.refinements(), 1u );
+}
+
+BOOST_AUTO_TEST_CASE( ScaledSizeIsAtLeastOne )
+{
+   BOOST_CHECK_EQUAL( ProgressiveRefinement::scaled( 640, 0.5 ), 320u );
+   BOOST_CHECK_EQUAL( ProgressiveRefinement::scaled( 1, 0.25 ), 1u );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,164 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/RenderCoalescer.hpp"
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <vector>
+
+using tinia::jobcontroller::RenderCoalescer;
+
+namespace {
+
+RenderCoalescer::Data
+makeData( const std::string& contents )
+{
+   return RenderCoalescer::Data( new std::vector<char>( contents.begin(), contents.end() ) );
+}
+
+std::string
+toString( const RenderCoalescer::Data& data )
+{
+   return data ? std::string( data->begin(), data->end() ) : std::string();
+}
+
+/** A snapshot request: joins, and renders if it leads or waits otherwise. */
+struct Request
+{
+   Request( RenderCoalescer* coalescer, const std::string& key )
+      : m_coalescer( coalescer ), m_key( key ), m_rendered( false )
+   {
+      m_ticket = m_coalescer->join( "viewer/640x480/png", m_key );
+   }
+
+   void
+   run()
+   {
+      if( !m_ticket.leader() && m_coalescer->wait( m_ticket, m_data ) ) {
+         return;
+      }
+      m_rendered = true;
+      m_data = makeData( m_key );
+      m_coalescer->publish( m_ticket, m_data );
+   }
+
+   RenderCoalescer*           m_coalescer;
+   std::string                m_key;
+   RenderCoalescer::Ticket    m_ticket;
+   RenderCoalescer::Data      m_data;
+   bool                       m_rendered;
+};
+
+}
+
+BOOST_AUTO_TEST_SUITE( RenderCoalescerTest )
+
+BOOST_AUTO_TEST_CASE( LoneRequestRenders )
+{
+   RenderCoalescer coalescer;
+   Request request( &coalescer, "1" );
+   BOOST_CHECK( request.m_ticket.leader() );
+   request.run();
+   BOOST_CHECK( request.m_rendered );
+
+   // Nothing is running, so the next request renders too.
+   Request next( &coalescer, "1" );
+   BOOST_CHECK( next.m_ticket.leader() );
+   next.run();
+   BOOST_CHECK_EQUAL( coalescer.renders(), 2u );
+   BOOST_CHECK_EQUAL( coalescer.shared(), 0u );
+}
+
+BOOST_AUTO_TEST_CASE( IdenticalRequestsShareRender )
+{
+   RenderCoalescer coalescer;
+   RenderCoalescer::Ticket leader = coalescer.join( "viewer/640x480/png", "1" );
+   BOOST_REQUIRE( leader.leader() );
+
+   std::vector<Request*> followers;
+   boost::thread_group threads;
+   for( int i=0; i<4; i++ ) {
+      followers.push_back( new Request( &coalescer, "1" ) );
+      BOOST_CHECK( !followers.back()->m_ticket.leader() );
+      threads.create_thread( boost::bind( &Request::run, followers.back() ) );
+   }
+   coalescer.publish( leader, makeData( "pixels" ) );
+   threads.join_all();
+
+   for( size_t i=0; i<followers.size(); i++ ) {
+      BOOST_CHECK( !followers[i]->m_rendered );
+      BOOST_CHECK_EQUAL( toString( followers[i]->m_data ), "pixels" );
+      delete followers[i];
+   }
+   BOOST_CHECK_EQUAL( coalescer.renders(), 1u );
+   BOOST_CHECK_EQUAL( coalescer.shared(), 4u );
+}
+
+BOOST_AUTO_TEST_CASE( LateRequestsMergeIntoNextRender )
+{
+   RenderCoalescer coalescer;
+   // A render of revision 1 is running when revision 2 is requested.
+   RenderCoalescer::Ticket leader = coalescer.join( "viewer/640x480/png", "1" );
+
+   std::vector<Request*> followers;
+   boost::thread_group threads;
+   for( int i=0; i<4; i++ ) {
+      followers.push_back( new Request( &coalescer, "2" ) );
+      threads.create_thread( boost::bind( &Request::run, followers.back() ) );
+   }
+   coalescer.publish( leader, makeData( "1" ) );
+   threads.join_all();
+
+   int rendered = 0;
+   for( size_t i=0; i<followers.size(); i++ ) {
+      rendered += followers[i]->m_rendered ? 1 : 0;
+      BOOST_CHECK_EQUAL( toString( followers[i]->m_data ), "2" );
+      delete followers[i];
+   }
+   BOOST_CHECK_EQUAL( rendered, 1 );
+   BOOST_CHECK_EQUAL( coalescer.renders(), 2u );
+}
+
+BOOST_AUTO_TEST_CASE( FailedRenderPassesLead )
+{
+   RenderCoalescer coalescer;
+   RenderCoalescer::Ticket leader = coalescer.join( "viewer/640x480/png", "1" );
+   Request follower( &coalescer, "1" );
+
+   boost::thread thread( boost::bind( &Request::run, &follower ) );
+   coalescer.publish( leader, RenderCoalescer::Data() );
+   thread.join();
+
+   BOOST_CHECK( follower.m_rendered );
+   BOOST_CHECK_EQUAL( toString( follower.m_data ), "1" );
+   BOOST_CHECK_EQUAL( coalescer.renders(), 2u );
+}
+
+BOOST_AUTO_TEST_CASE( SlotsAreIndependent )
+{
+   RenderCoalescer coalescer;
+   RenderCoalescer::Ticket a = coalescer.join( "a/640x480/png", "1" );
+   RenderCoalescer::Ticket b = coalescer.join( "b/640x480/png", "1" );
+   BOOST_CHECK( a.leader() );
+   BOOST_CHECK( b.leader() );
+   coalescer.publish( a, makeData( "a" ) );
+   coalescer.publish( b, makeData( "b" ) );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
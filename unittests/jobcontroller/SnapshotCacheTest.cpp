@@ -0,0 +1,108 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tinia/jobcontroller/SnapshotCache.hpp"
+#include <boost/test/unit_test.hpp>
+#include <cstring>
+#include <cstdlib>
+
+using tinia::jobcontroller::SnapshotCache;
+
+BOOST_AUTO_TEST_SUITE( SnapshotCacheTest )
+
+BOOST_AUTO_TEST_CASE( HitAfterInsert )
+{
+   SnapshotCache cache( 4 );
+   const std::string key = SnapshotCache::makeKey( "viewer", 640, 480, "png", 7 );
+
+   BOOST_CHECK( !cache.lookup( key ) );
+   cache.insert( key, "abc", 3 );
+   SnapshotCache::Data data = cache.lookup( key );
+   BOOST_REQUIRE( data );
+   BOOST_CHECK_EQUAL( data->size(), 3u );
+   BOOST_CHECK( std::memcmp( &(*data)[0], "abc", 3 ) == 0 );
+
+   BOOST_CHECK_EQUAL( cache.hits(), 1u );
+   BOOST_CHECK_EQUAL( cache.misses(), 1u );
+   BOOST_CHECK_CLOSE( cache.hitRate(), 0.5, 1e-9 );
+}
+
+BOOST_AUTO_TEST_CASE( KeyCoversRevisionSizeAndFormat )
+{
+   SnapshotCache cache( 4 );
+   cache.insert( SnapshotCache::makeKey( "viewer", 640, 480, "png", 7 ), "abc", 3 );
+
+   BOOST_CHECK( !cache.lookup( SnapshotCache::makeKey( "viewer", 640, 480, "png", 8 ) ) );
+   BOOST_CHECK( !cache.lookup( SnapshotCache::makeKey( "viewer", 640, 481, "png", 7 ) ) );
+   BOOST_CHECK( !cache.lookup( SnapshotCache::makeKey( "viewer", 640, 480, "jpg:80", 7 ) ) );
+   BOOST_CHECK( !cache.lookup( SnapshotCache::makeKey( "other", 640, 480, "png", 7 ) ) );
+
+   BOOST_CHECK( SnapshotCache::etag( SnapshotCache::makeKey( "viewer", 640, 480, "png", 7 ) ) !=
+                SnapshotCache::etag( SnapshotCache::makeKey( "viewer", 640, 480, "png", 8 ) ) );
+   BOOST_CHECK_EQUAL( SnapshotCache::etag( "a" ), SnapshotCache::etag( "a" ) );
+   BOOST_CHECK_EQUAL( SnapshotCache::etag( "a" )[0], '"' );
+}
+
+BOOST_AUTO_TEST_CASE( LeastRecentlyUsedIsDropped )
+{
+   SnapshotCache cache( 2 );
+   cache.insert( "a", "1", 1 );
+   cache.insert( "b", "2", 1 );
+   BOOST_CHECK( cache.lookup( "a" ) );   // b is now the least recently used
+   cache.insert( "c", "3", 1 );
+
+   BOOST_CHECK( cache.lookup( "a" ) );
+   BOOST_CHECK( !cache.lookup( "b" ) );
+   BOOST_CHECK( cache.lookup( "c" ) );
+
+   // Replacing does not grow the cache.
+   cache.insert( "c", "4", 1 );
+   BOOST_CHECK( cache.lookup( "a" ) );
+   BOOST_CHECK_EQUAL( (*cache.lookup( "c" ))[0], '4' );
+}
+
+BOOST_AUTO_TEST_CASE( ZeroCapacityDisables )
+{
+   SnapshotCache cache( 0 );
+   BOOST_CHECK( !cache.enabled() );
+   cache.insert( "a", "1", 1 );
+   BOOST_CHECK( !cache.lookup( "a" ) );
+}
+
+BOOST_AUTO_TEST_CASE( DisabledUnlessConfigured )
+{
+   // The revision does not cover frames that change without the model.
+   unsetenv( "TINIA_SNAPSHOT_CACHE_SIZE" );
+   BOOST_CHECK_EQUAL( SnapshotCache::capacityFromEnvironment(), 0u );
+   setenv( "TINIA_SNAPSHOT_CACHE_SIZE", "16", 1 );
+   BOOST_CHECK_EQUAL( SnapshotCache::capacityFromEnvironment(), 16u );
+   unsetenv( "TINIA_SNAPSHOT_CACHE_SIZE" );
+}
+
+BOOST_AUTO_TEST_CASE( NotModifiedCountsAsHit )
+{
+   SnapshotCache cache( 2 );
+   cache.lookup( "a" );
+   cache.notModified();
+   cache.notModified();
+   cache.notModified();
+   BOOST_CHECK_EQUAL( cache.notModifiedCount(), 3u );
+   BOOST_CHECK_CLOSE( cache.hitRate(), 0.75, 1e-9 );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,156 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "tinia/model/ExposedModel.hpp"
+#include "tinia/model/ExposedModelLock.hpp"
+#include "tinia/model/Viewer.hpp"
+#include <vector>
+#include <sstream>
+
+using namespace tinia;
+namespace {
+
+void readOutsideLock(boost::shared_ptr<model::ExposedModel> model, int* value)
+{
+   *value = model->getElementValue<int>("slider");
+}
+
+struct ContentionCounters {
+   ContentionCounters() : reads(0), writes(0), inconsistent(0), stop(false) {}
+   boost::mutex mutex;
+   unsigned long reads;
+   unsigned long writes;
+   unsigned long inconsistent;
+   volatile bool stop;
+};
+
+void viewerReader(boost::shared_ptr<model::ExposedModel> model, ContentionCounters* counters)
+{
+   unsigned long reads = 0;
+   unsigned long inconsistent = 0;
+   while(!counters->stop)
+   {
+      model::Viewer viewer;
+      model->getElementValue("viewer", viewer);
+      // The writer keeps width and height equal, a torn read would break this.
+      if(viewer.width != viewer.height)
+      {
+         inconsistent++;
+      }
+      reads++;
+   }
+   boost::mutex::scoped_lock lock(counters->mutex);
+   counters->reads += reads;
+   counters->inconsistent += inconsistent;
+}
+
+void sliderWriter(boost::shared_ptr<model::ExposedModel> model, ContentionCounters* counters, int id)
+{
+   std::stringstream ss;
+   ss << "slider" << id;
+   unsigned long writes = 0;
+   while(!counters->stop)
+   {
+      model->updateElement(ss.str(), int(writes % 100));
+      if(writes % 16 == 0)
+      {
+         model::Viewer viewer = model->getElementValue<model::Viewer>("viewer");
+         viewer.width = viewer.height = int(writes % 1000);
+         model->updateElement("viewer", viewer);
+      }
+      writes++;
+   }
+   boost::mutex::scoped_lock lock(counters->mutex);
+   counters->writes += writes;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(LockHolderReadsOwnWrites)
+{
+   boost::shared_ptr<model::ExposedModel> model(new model::ExposedModel());
+   model->addElement("slider", 0);
+   {
+      model::ExposedModelLock lock(model);
+      model->updateElement("slider", 1);
+      BOOST_CHECK_EQUAL(model->getElementValue<int>("slider"), 1);
+
+      // Other threads still see the last published state.
+      int value = -1;
+      boost::thread reader(&readOutsideLock, model, &value);
+      reader.join();
+      BOOST_CHECK_EQUAL(value, 0);
+   }
+   int value = -1;
+   boost::thread reader(&readOutsideLock, model, &value);
+   reader.join();
+   BOOST_CHECK_EQUAL(value, 1);
+}
+
+BOOST_AUTO_TEST_CASE(RemovedElementIsNotInSnapshot)
+{
+   boost::shared_ptr<model::ExposedModel> model(new model::ExposedModel());
+   model->addElement("slider", 0);
+   BOOST_CHECK(model->hasElement("slider"));
+   model->removeElement("slider");
+   BOOST_CHECK(!model->hasElement("slider"));
+}
+
+/** Benchmark: readers of a Viewer element run concurrently with writers
+    updating sliders (and now and then the Viewer). Reports throughput. */
+BOOST_AUTO_TEST_CASE(ViewerReadSliderWriteContention)
+{
+   const int readerCount = 4;
+   const int writerCount = 2;
+   boost::shared_ptr<model::ExposedModel> model(new model::ExposedModel());
+   model::Viewer viewer;
+   viewer.width = viewer.height = 0;
+   model->addElement("viewer", viewer);
+   for(int i = 0; i < writerCount; ++i)
+   {
+      std::stringstream ss;
+      ss << "slider" << i;
+      model->addConstrainedElement(ss.str(), 0, 0, 100);
+   }
+
+   ContentionCounters counters;
+   boost::thread_group threads;
+   for(int i = 0; i < readerCount; ++i)
+   {
+      threads.create_thread(boost::bind(&viewerReader, model, &counters));
+   }
+   for(int i = 0; i < writerCount; ++i)
+   {
+      threads.create_thread(boost::bind(&sliderWriter, model, &counters, i));
+   }
+   const double seconds = 0.5;
+   boost::this_thread::sleep(boost::posix_time::milliseconds(int(seconds*1000)));
+   counters.stop = true;
+   threads.join_all();
+
+   BOOST_CHECK_EQUAL(counters.inconsistent, 0u);
+   BOOST_CHECK_GT(counters.reads, 0u);
+   BOOST_CHECK_GT(counters.writes, 0u);
+   BOOST_TEST_MESSAGE("Contention benchmark: " << readerCount << " viewer readers, "
+                      << writerCount << " slider writers: "
+                      << counters.reads/seconds << " reads/s, "
+                      << counters.writes/seconds << " writes/s");
+}
@@ -0,0 +1,246 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include "tinia/model/ExposedModel.hpp"
+#include "tinia/model/ExposedModelLock.hpp"
+#include "tinia/model/StateListener.hpp"
+#include <vector>
+#include <string>
+using namespace tinia;
+namespace {
+class RecordingListenerFixture : public model::StateListener
+{
+public:
+   RecordingListenerFixture() : model(new model::ExposedModel())
+   {
+      model->addElement("a", 0);
+      model->addElement("b", 0);
+      model->addStateListener(this);
+   }
+
+   ~RecordingListenerFixture() { model->removeStateListener(this); }
+
+   void stateElementModified(model::StateElement *stateElement)
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      int value;
+      stateElement->getValue(value);
+      keys.push_back(stateElement->getKey());
+      values.push_back(value);
+      condition.notify_all();
+   }
+
+   void waitForEvents(size_t count)
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      while(keys.size() < count)
+      {
+         condition.wait(lock);
+      }
+   }
+
+   boost::shared_ptr<model::ExposedModel> model;
+   boost::mutex mutex;
+   boost::condition_variable condition;
+   std::vector<std::string> keys;
+   std::vector<int> values;
+};
+
+class BlockingListener : public model::StateListener
+{
+public:
+   BlockingListener() : entered(false), released(false) {}
+
+   void stateElementModified(model::StateElement *stateElement)
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      entered = true;
+      condition.notify_all();
+      while(!released)
+      {
+         condition.wait(lock);
+      }
+   }
+
+   void waitUntilEntered()
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      while(!entered)
+      {
+         condition.wait(lock);
+      }
+   }
+
+   void release()
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      released = true;
+      condition.notify_all();
+   }
+
+   boost::mutex mutex;
+   boost::condition_variable condition;
+   bool entered;
+   bool released;
+};
+
+void countCalls(int* calls)
+{
+   (*calls)++;
+}
+}
+
+BOOST_FIXTURE_TEST_CASE(QueuedDeliveryWaitsForOwner, RecordingListenerFixture)
+{
+   int pendingCalls = 0;
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_QUEUED,
+                                boost::bind(&countCalls, &pendingCalls));
+   model->updateElement("a", 1);
+   model->updateElement("b", 2);
+   BOOST_CHECK(keys.empty());
+   BOOST_CHECK_EQUAL(pendingCalls, 1);
+
+   BOOST_CHECK_EQUAL(model->deliverQueuedStateEvents(), 2u);
+   BOOST_REQUIRE_EQUAL(keys.size(), 2u);
+   BOOST_CHECK_EQUAL(keys[0], "a");
+   BOOST_CHECK_EQUAL(values[0], 1);
+   BOOST_CHECK_EQUAL(keys[1], "b");
+   BOOST_CHECK_EQUAL(values[1], 2);
+
+   BOOST_CHECK_EQUAL(model->deliverQueuedStateEvents(), 0u);
+   model->updateElement("a", 3);
+   BOOST_CHECK_EQUAL(pendingCalls, 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(QueuedDeliveryCoalescesSameKey, RecordingListenerFixture)
+{
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_QUEUED);
+   model->updateElement("a", 1);
+   model->updateElement("b", 10);
+   model->updateElement("a", 2);
+   model->updateElement("a", 3);
+
+   BOOST_CHECK_EQUAL(model->deliverQueuedStateEvents(), 2u);
+   BOOST_REQUIRE_EQUAL(keys.size(), 2u);
+   // "a" keeps the position of its first pending event, but has the last value.
+   BOOST_CHECK_EQUAL(keys[0], "a");
+   BOOST_CHECK_EQUAL(values[0], 3);
+   BOOST_CHECK_EQUAL(keys[1], "b");
+   BOOST_CHECK_EQUAL(values[1], 10);
+}
+
+BOOST_FIXTURE_TEST_CASE(QueuedDeliveryRespectsModelLock, RecordingListenerFixture)
+{
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_QUEUED);
+   {
+      model::ExposedModelLock lock(model);
+      model->updateElement("a", 1);
+      BOOST_CHECK_EQUAL(model->deliverQueuedStateEvents(), 0u);
+   }
+   BOOST_CHECK_EQUAL(model->deliverQueuedStateEvents(), 1u);
+   BOOST_CHECK_EQUAL(values.size(), 1u);
+}
+
+BOOST_FIXTURE_TEST_CASE(SwitchingToSynchronousFlushesQueue, RecordingListenerFixture)
+{
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_QUEUED);
+   model->updateElement("a", 1);
+   BOOST_CHECK(keys.empty());
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_SYNCHRONOUSLY);
+   BOOST_CHECK_EQUAL(keys.size(), 1u);
+   model->updateElement("a", 2);
+   BOOST_CHECK_EQUAL(keys.size(), 2u);
+}
+
+BOOST_FIXTURE_TEST_CASE(DispatcherThreadKeepsPerKeyOrder, RecordingListenerFixture)
+{
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_FROM_DISPATCHER_THREAD);
+   const int n = 1000;
+   for(int i = 1; i <= n; ++i)
+   {
+      model->updateElement("a", i);
+   }
+   // Values may be skipped, but never reordered, and the last one is always seen.
+   for(;;)
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      if(!values.empty() && values.back() == n)
+      {
+         break;
+      }
+      condition.wait(lock);
+   }
+   boost::mutex::scoped_lock lock(mutex);
+   for(size_t i = 1; i < values.size(); ++i)
+   {
+      BOOST_CHECK_LT(values[i-1], values[i]);
+   }
+   lock.unlock();
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_SYNCHRONOUSLY);
+}
+
+BOOST_AUTO_TEST_CASE(DispatcherThreadDoesNotHoldModelLock)
+{
+   boost::shared_ptr<model::ExposedModel> model(new model::ExposedModel());
+   model->addElement("a", 0);
+   BlockingListener listener;
+   model->addStateListener(&listener);
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_FROM_DISPATCHER_THREAD);
+
+   model->updateElement("a", 1);
+   listener.waitUntilEntered();
+
+   // The listener is blocked on the dispatcher thread; the model must still
+   // be usable from here.
+   model->updateElement("a", 2);
+   BOOST_CHECK_EQUAL(model->getElementValue<int>("a"), 2);
+
+   listener.release();
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_SYNCHRONOUSLY);
+   model->removeStateListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(ListenersCanChangeWhileDispatcherDelivers)
+{
+   boost::shared_ptr<model::ExposedModel> model(new model::ExposedModel());
+   model->addElement("a", 0);
+   BlockingListener listener;
+   model->addStateListener(&listener);
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_FROM_DISPATCHER_THREAD);
+
+   model->updateElement("a", 1);
+   listener.waitUntilEntered();
+
+   // The dispatcher is inside a listener; adding and removing listeners with
+   // the model locked must not wait for it.
+   BlockingListener other;
+   {
+      model::ExposedModelLock lock(model);
+      model->addStateListener(&other);
+      model->addStateListener("a", &other);
+      model->removeStateListener("a", &other);
+      model->removeStateListener(&other);
+   }
+
+   listener.release();
+   model->setStateEventDelivery(model::ExposedModel::DELIVER_SYNCHRONOUSLY);
+   model->removeStateListener(&listener);
+   BOOST_CHECK(!other.entered);
+}
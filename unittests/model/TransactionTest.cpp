@@ -0,0 +1,240 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include "tinia/model/ExposedModel.hpp"
+#include "tinia/model/ExposedModelLock.hpp"
+#include "tinia/model/ExposedModelTransaction.hpp"
+#include "tinia/model/StateListener.hpp"
+#include <vector>
+#include <string>
+using namespace tinia;
+namespace {
+class BatchListenerFixture : public model::StateListener
+{
+public:
+   BatchListenerFixture() : model(new model::ExposedModel()), single(0)
+   {
+      model->addElement("a", 0);
+      model->addElement("b", 0);
+      model->addElement("c", 0);
+      model->addStateListener(this);
+   }
+
+   ~BatchListenerFixture() { model->removeStateListener(this); }
+
+   void stateElementModified(model::StateElement *stateElement)
+   {
+      ++single;
+   }
+
+   void stateElementsModified(std::vector<model::StateElement>& stateElements)
+   {
+      batches.push_back(stateElements);
+   }
+
+   unsigned int revisionOf(const std::string& key)
+   {
+      std::vector< std::pair<std::string, model::impl::ElementData> > elements;
+      model->getExposedModelUpdate(elements, 0);
+      for(size_t i = 0; i < elements.size(); ++i)
+      {
+         if(elements[i].first == key)
+         {
+            return elements[i].second.getRevisionNumber();
+         }
+      }
+      BOOST_FAIL("No element named " + key);
+      return 0;
+   }
+
+   boost::shared_ptr<model::ExposedModel> model;
+   int single;
+   std::vector< std::vector<model::StateElement> > batches;
+};
+
+void readPairs(boost::shared_ptr<model::ExposedModel> model, int iterations,
+               int* torn)
+{
+   for(int i = 0; i < iterations; ++i)
+   {
+      int a, b;
+      std::vector<model::StateElement> elements;
+      model->getFullState(elements);
+      a = b = -1;
+      for(size_t j = 0; j < elements.size(); ++j)
+      {
+         if(elements[j].getKey() == "a") elements[j].getValue(a);
+         if(elements[j].getKey() == "b") elements[j].getValue(b);
+      }
+      if(a != b)
+      {
+         ++(*torn);
+      }
+   }
+}
+}
+
+BOOST_FIXTURE_TEST_CASE(TransactionBumpsRevisionOnce, BatchListenerFixture)
+{
+   const int before = model->getRevisionNumber();
+   {
+      model::ExposedModelTransaction transaction(model);
+      model->updateElement("a", 1);
+      model->updateElement("b", 2);
+      model->updateElement("c", 3);
+   }
+   BOOST_CHECK_EQUAL(model->getRevisionNumber(), before + 1);
+   BOOST_CHECK_EQUAL(revisionOf("a"), unsigned(before));
+   BOOST_CHECK_EQUAL(revisionOf("b"), unsigned(before));
+   BOOST_CHECK_EQUAL(revisionOf("c"), unsigned(before));
+
+   // Outside a transaction every update bumps the revision.
+   model->updateElement("a", 4);
+   model->updateElement("b", 5);
+   BOOST_CHECK_EQUAL(model->getRevisionNumber(), before + 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(AdvanceRevisionNumberMovesPastRevision, BatchListenerFixture)
+{
+   model->updateElement("a", 1);
+   const int before = model->getRevisionNumber();
+
+   // A revision behind the model leaves the counter alone.
+   model->advanceRevisionNumber(0u);
+   BOOST_CHECK_EQUAL(model->getRevisionNumber(), before);
+
+   model->advanceRevisionNumber(before + 100u);
+   BOOST_CHECK_EQUAL(model->getRevisionNumber(), before + 101);
+
+   // Later updates are newer than the revision moved past.
+   model->updateElement("a", 2);
+   BOOST_CHECK_EQUAL(revisionOf("a"), unsigned(before + 101));
+   BOOST_CHECK_EQUAL(model->getRevisionNumber(), before + 102);
+}
+
+BOOST_FIXTURE_TEST_CASE(TransactionDeliversOneBatch, BatchListenerFixture)
+{
+   {
+      model::ExposedModelTransaction transaction(model);
+      model->updateElement("a", 1);
+      model->updateElement("b", 2);
+      model->updateElement("a", 3);
+      BOOST_CHECK(batches.empty());
+   }
+   BOOST_CHECK_EQUAL(single, 0);
+   BOOST_REQUIRE_EQUAL(batches.size(), 1u);
+   BOOST_REQUIRE_EQUAL(batches[0].size(), 2u);
+
+   // Coalesced per key, in order of first modification, with the last value.
+   int value;
+   BOOST_CHECK_EQUAL(batches[0][0].getKey(), "a");
+   batches[0][0].getValue(value);
+   BOOST_CHECK_EQUAL(value, 3);
+   BOOST_CHECK_EQUAL(batches[0][1].getKey(), "b");
+   batches[0][1].getValue(value);
+   BOOST_CHECK_EQUAL(value, 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(ExplicitCommitReleasesLock, BatchListenerFixture)
+{
+   model::ExposedModelTransaction transaction(model);
+   model->updateElement("a", 1);
+   transaction.commit();
+   BOOST_CHECK_EQUAL(batches.size(), 1u);
+
+   // A second commit (e.g. from the destructor) does nothing.
+   transaction.commit();
+   BOOST_CHECK_EQUAL(batches.size(), 1u);
+}
+
+BOOST_FIXTURE_TEST_CASE(ExposedModelLockStillDeliversSingleEvents, BatchListenerFixture)
+{
+   {
+      model::ExposedModelLock lock(model);
+      model->updateElement("a", 1);
+      model->updateElement("b", 2);
+   }
+   BOOST_CHECK_EQUAL(single, 2);
+   BOOST_CHECK(batches.empty());
+}
+
+namespace {
+class ReleaseListener : public model::StateListener
+{
+public:
+   ReleaseListener() : single(0) {}
+
+   void stateElementModified(model::StateElement *stateElement)
+   {
+      ++single;
+   }
+
+   void stateElementsReleased(std::vector<model::StateElement>& stateElements)
+   {
+      releases.push_back(stateElements);
+   }
+
+   int single;
+   std::vector<std::vector<model::StateElement> > releases;
+};
+}
+
+BOOST_FIXTURE_TEST_CASE(ExposedModelLockReleasesEventsTogether, BatchListenerFixture)
+{
+   ReleaseListener listener;
+   model->addStateListener(&listener);
+   {
+      model::ExposedModelLock lock(model);
+      model->updateElement("a", 1);
+      model->updateElement("b", 2);
+      model->updateElement("a", 3);
+      BOOST_CHECK(listener.releases.empty());
+   }
+   // All the events, in order, in one call.
+   BOOST_CHECK_EQUAL(listener.single, 0);
+   BOOST_REQUIRE_EQUAL(listener.releases.size(), 1u);
+   BOOST_REQUIRE_EQUAL(listener.releases[0].size(), 3u);
+   BOOST_CHECK_EQUAL(listener.releases[0][0].getKey(), "a");
+   BOOST_CHECK_EQUAL(listener.releases[0][1].getKey(), "b");
+   BOOST_CHECK_EQUAL(listener.releases[0][2].getKey(), "a");
+
+   // Updates without the lock are delivered one by one.
+   model->updateElement("c", 4);
+   BOOST_CHECK_EQUAL(listener.single, 1);
+   BOOST_CHECK_EQUAL(listener.releases.size(), 1u);
+   model->removeStateListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(OtherThreadsDoNotSeeIntermediateState)
+{
+   boost::shared_ptr<model::ExposedModel> model(new model::ExposedModel());
+   model->addElement("a", 0);
+   model->addElement("b", 0);
+
+   int torn = 0;
+   boost::thread reader(boost::bind(&readPairs, model, 2000, &torn));
+   for(int i = 1; i <= 2000; ++i)
+   {
+      model::ExposedModelTransaction transaction(model);
+      model->updateElement("a", i);
+      model->updateElement("b", i);
+   }
+   reader.join();
+   BOOST_CHECK_EQUAL(torn, 0);
+}
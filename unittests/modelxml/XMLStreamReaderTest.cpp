@@ -0,0 +1,245 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ * 
+ * This file is part of the Tinia Framework.
+ * 
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cmath>
+#include <libxml/tree.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "tinia/model/ExposedModel.hpp"
+#include "tinia/model/impl/xml/XMLTransporter.hpp"
+#include "tinia/model/impl/xml/XMLReader.hpp"
+#include "tinia/model/impl/xml/XMLStreamReader.hpp"
+#include "tinia/model/impl/xml/XMLHandler.hpp"
+#include "tinia/model/impl/xml/ElementHandler.hpp"
+
+using namespace std;
+using namespace tinia;
+
+BOOST_AUTO_TEST_SUITE( XMLStreamReaderSuite )
+namespace {
+struct StreamFixture {
+    StreamFixture() :
+        model(new model::ExposedModel()),
+        xmlHandler(model),
+        elementHandler(model)
+    {
+        model->addElement("number", 1);
+        model->addElement("text", std::string("hello"));
+        model->addElement("viewer", model::Viewer());
+    }
+
+    std::vector<std::string> parse(const std::string& xml)
+    {
+        return streamReader.parseBuffer(xml.c_str(), xml.size(), elementHandler);
+    }
+
+    boost::shared_ptr<model::ExposedModel> model;
+    model::impl::xml::XMLHandler xmlHandler;
+    model::impl::xml::ElementHandler elementHandler;
+    model::impl::xml::XMLStreamReader streamReader;
+};
+
+// Builds the update the web client sends while the user drags in a TrackBallViewer
+// (see ExposedModelBuilder.js), rotating the modelview matrix by 'angle'.
+std::string trackballUpdate(double angle, int frame)
+{
+    const double c = std::cos(angle), s = std::sin(angle);
+    const double modelview[16] = { c, 0, -s, 0,   0, 1, 0, 0,   s, 0, c, 0,   0, 0, -5, 1 };
+    std::stringstream xml;
+    xml << "<State>\n<viewer>\n<modelview>";
+    for(int i = 0; i < 16; ++i) {
+        xml << modelview[i] << (i < 15 ? " " : "");
+    }
+    xml << "</modelview>\n"
+        << "<projection>1.81 0 0 0 0 2.41 0 0 0 0 -1.002 -1 0 0 -0.2002 0</projection>\n"
+        << "<width>640</width>\n<height>480</height>\n"
+        << "<timestamp>" << 1000 + 16 * frame << "</timestamp>\n"
+        << "<sceneView>---oooOOOooo---</sceneView>\n"
+        << "</viewer>\n</State>\n";
+    return xml.str();
+}
+}
+
+BOOST_FIXTURE_TEST_CASE( simpleElementsAreUpdated, StreamFixture )
+{
+    std::vector<std::string> keys = parse("<State><number>42</number><text>a &amp; b</text></State>");
+
+    BOOST_REQUIRE_EQUAL(keys.size(), 2u);
+    BOOST_CHECK_EQUAL(keys[0], "number");
+    BOOST_CHECK_EQUAL(keys[1], "text");
+
+    int number;
+    std::string text;
+    model->getElementValue("number", number);
+    model->getElementValue("text", text);
+    BOOST_CHECK_EQUAL(number, 42);
+    BOOST_CHECK_EQUAL(text, "a & b");
+}
+
+BOOST_FIXTURE_TEST_CASE( viewerIsUpdatedWithOneRevision, StreamFixture )
+{
+    const int revision = model->getRevisionNumber();
+    parse(trackballUpdate(0.5, 3));
+    BOOST_CHECK_EQUAL(model->getRevisionNumber(), revision + 1);
+
+    model::Viewer viewer;
+    model->getElementValue("viewer", viewer);
+    BOOST_CHECK_EQUAL(viewer.width, 640);
+    BOOST_CHECK_EQUAL(viewer.height, 480);
+    BOOST_CHECK_CLOSE(viewer.timestamp, 1048.0, 1e-9);
+    BOOST_CHECK_CLOSE(viewer.modelviewMatrix[0], float(std::cos(0.5)), 1e-3);
+    BOOST_CHECK_CLOSE(viewer.modelviewMatrix[14], -5.0f, 1e-3);
+    BOOST_CHECK_CLOSE(viewer.projectionMatrix[10], -1.002f, 1e-3);
+}
+
+BOOST_FIXTURE_TEST_CASE( stateInsideOtherElementsIsFound, StreamFixture )
+{
+    parse("<?xml version=\"1.0\"?>\n<root xmlns=\"http://cloudviz.sintef.no/V1/model\">"
+          "<StateSchema><number>7</number></StateSchema>"
+          "<State><number>8</number></State>"
+          "<State><number>9</number></State></root>");
+    int number;
+    model->getElementValue("number", number);
+    BOOST_CHECK_EQUAL(number, 8);
+}
+
+BOOST_FIXTURE_TEST_CASE( malformedDocumentChangesNothing, StreamFixture )
+{
+    const int revision = model->getRevisionNumber();
+    BOOST_CHECK_THROW(parse("<State><number>42</number><text>oops</State>"), std::runtime_error);
+    BOOST_CHECK_EQUAL(model->getRevisionNumber(), revision);
+
+    int number;
+    model->getElementValue("number", number);
+    BOOST_CHECK_EQUAL(number, 1);
+
+    // The parser can be used again after an error.
+    parse("<State><number>43</number></State>");
+    model->getElementValue("number", number);
+    BOOST_CHECK_EQUAL(number, 43);
+}
+
+BOOST_FIXTURE_TEST_CASE( unknownViewerFieldChangesNothing, StreamFixture )
+{
+    const int revision = model->getRevisionNumber();
+    BOOST_CHECK_THROW(parse("<State><viewer><width>10</width><bogus>1</bogus></viewer></State>"),
+                      std::invalid_argument);
+    BOOST_CHECK_EQUAL(model->getRevisionNumber(), revision);
+    model::Viewer viewer;
+    model->getElementValue("viewer", viewer);
+    BOOST_CHECK_EQUAL(viewer.width, 512);
+}
+
+BOOST_FIXTURE_TEST_CASE( invalidValueInLaterElementChangesNothing, StreamFixture )
+{
+    const int revision = model->getRevisionNumber();
+    BOOST_CHECK_THROW(parse("<State><number>42</number><text>bye</text>"
+                            "<viewer><width>wide</width></viewer></State>"),
+                      boost::bad_lexical_cast);
+    BOOST_CHECK_EQUAL(model->getRevisionNumber(), revision);
+
+    int number;
+    model->getElementValue("number", number);
+    BOOST_CHECK_EQUAL(number, 1);
+    std::string text;
+    model->getElementValue("text", text);
+    BOOST_CHECK_EQUAL(text, "hello");
+    model::Viewer viewer;
+    model->getElementValue("viewer", viewer);
+    BOOST_CHECK_EQUAL(viewer.width, 512);
+}
+
+BOOST_FIXTURE_TEST_CASE( elementsAreUpdatedWithOneRevision, StreamFixture )
+{
+    const int revision = model->getRevisionNumber();
+    parse("<State><number>42</number><text>bye</text>"
+          "<viewer><width>640</width></viewer></State>");
+    BOOST_CHECK_EQUAL(model->getRevisionNumber(), revision + 1);
+}
+
+BOOST_FIXTURE_TEST_CASE( completeDocumentRoundTrip, StreamFixture )
+{
+    model::Viewer viewer;
+    viewer.width = 100;
+    model->updateElement("viewer", viewer);
+    model->updateElement("number", 5);
+
+    std::vector<char> buffer(1024*1024, 0);
+    const size_t bytes = xmlHandler.getExposedModelUpdate(&buffer[0], buffer.size(), 0);
+    BOOST_REQUIRE(bytes > 0);
+
+    viewer.width = 200;
+    model->updateElement("viewer", viewer);
+    model->updateElement("number", 6);
+
+    BOOST_CHECK(xmlHandler.updateState(&buffer[0], bytes));
+
+    int number;
+    model->getElementValue("number", number);
+    model->getElementValue("viewer", viewer);
+    BOOST_CHECK_EQUAL(number, 5);
+    BOOST_CHECK_EQUAL(viewer.width, 100);
+}
+
+BOOST_FIXTURE_TEST_CASE( trackballStreamThroughput, StreamFixture )
+{
+    // A recorded drag: one update per frame, as sent by the client.
+    std::vector<std::string> stream;
+    for(int i = 0; i < 2000; ++i) {
+        stream.push_back(trackballUpdate(0.01 * i, i));
+    }
+    size_t bytes = 0;
+    for(size_t i = 0; i < stream.size(); ++i) {
+        bytes += stream[i].size();
+    }
+
+    model::impl::xml::XMLTransporter transporter;
+    model::impl::xml::XMLReader reader;
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    for(size_t i = 0; i < stream.size(); ++i) {
+        xmlDocPtr doc = transporter.readXMLfromBuffer(stream[i].c_str(), stream[i].size());
+        reader.parseDocument(doc, elementHandler);
+        xmlFreeDoc(doc);
+    }
+    const double domSeconds =
+            (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() * 1e-6;
+
+    start = boost::posix_time::microsec_clock::universal_time();
+    for(size_t i = 0; i < stream.size(); ++i) {
+        parse(stream[i]);
+    }
+    const double streamSeconds =
+            (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() * 1e-6;
+
+    model::Viewer viewer;
+    model->getElementValue("viewer", viewer);
+    BOOST_CHECK_CLOSE(viewer.timestamp, 1000.0 + 16 * 1999, 1e-9);
+
+    BOOST_TEST_MESSAGE("Trackball stream, " << stream.size() << " updates, " << bytes << " bytes:");
+    BOOST_TEST_MESSAGE("  xmlReadMemory + XMLReader: " << stream.size() / domSeconds << " updates/s, "
+                       << bytes / domSeconds / 1e6 << " MB/s");
+    BOOST_TEST_MESSAGE("  XMLStreamReader:           " << stream.size() / streamSeconds << " updates/s, "
+                       << bytes / streamSeconds / 1e6 << " MB/s");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
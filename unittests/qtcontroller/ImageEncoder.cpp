@@ -0,0 +1,123 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include "tinia/qtcontroller/impl/ImageEncoder.hpp"
+#include <QImage>
+#include <QThreadPool>
+#include <algorithm>
+#include <vector>
+
+using tinia::qtcontroller::impl::GrabbedImage;
+using tinia::qtcontroller::impl::GrabbedImagePtr;
+using tinia::qtcontroller::impl::ImagePool;
+using tinia::qtcontroller::impl::ImageEncoder;
+using tinia::qtcontroller::impl::encodeImage;
+
+namespace {
+
+// A width x height image, red in the bottom row (first in memory) and black elsewhere.
+GrabbedImagePtr
+makeImage( boost::shared_ptr<ImagePool> pool, unsigned int width, unsigned int height )
+{
+    GrabbedImagePtr image = pool->acquire( 4*((3*width+3)/4)*height );
+    image->width = width;
+    image->height = height;
+    std::fill( image->pixels.begin(), image->pixels.end(), 0 );
+    for( unsigned int i=0; i<width; i++ ) {
+        image->pixels[3*i] = 255;
+    }
+    return image;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(QtImageEncoder)
+
+BOOST_AUTO_TEST_CASE(PoolReusesImages) {
+    boost::shared_ptr<ImagePool> pool = ImagePool::create( 1 );
+
+    GrabbedImagePtr a = pool->acquire( 1024 );
+    BOOST_CHECK_EQUAL( 1024u, a->pixels.size() );
+    const unsigned char* storage = &a->pixels[0];
+    a.reset();
+    BOOST_CHECK_EQUAL( 1u, pool->freeCount() );
+
+    GrabbedImagePtr b = pool->acquire( 512 );
+    BOOST_CHECK_EQUAL( 0u, pool->freeCount() );
+    BOOST_CHECK_EQUAL( 512u, b->pixels.size() );
+    BOOST_CHECK( storage == &b->pixels[0] );
+
+    // Only maxFree images are kept.
+    GrabbedImagePtr c = pool->acquire( 512 );
+    b.reset();
+    c.reset();
+    BOOST_CHECK_EQUAL( 1u, pool->freeCount() );
+}
+
+BOOST_AUTO_TEST_CASE(ImagesOutliveThePool) {
+    GrabbedImagePtr image;
+    {
+        boost::shared_ptr<ImagePool> pool = ImagePool::create();
+        image = pool->acquire( 16 );
+    }
+    image.reset();
+}
+
+BOOST_AUTO_TEST_CASE(EncodeFlipsAndScales) {
+    boost::shared_ptr<ImagePool> pool = ImagePool::create();
+    GrabbedImagePtr image = makeImage( pool, 8, 4 );
+
+    QImage png;
+    BOOST_REQUIRE( png.loadFromData( encodeImage( *image, 8, 4, true, 0 ), "png" ) );
+    BOOST_CHECK_EQUAL( 8, png.width() );
+    BOOST_CHECK_EQUAL( 4, png.height() );
+    // The bottom row of the grabbed image is the bottom row of the picture.
+    BOOST_CHECK_EQUAL( qRgb( 255, 0, 0 ), png.pixel( 0, 3 ) );
+    BOOST_CHECK_EQUAL( qRgb( 0, 0, 0 ), png.pixel( 0, 0 ) );
+
+    QImage scaled;
+    BOOST_REQUIRE( scaled.loadFromData( encodeImage( *image, 4, 2, true, 0 ), "png" ) );
+    BOOST_CHECK_EQUAL( 4, scaled.width() );
+    BOOST_CHECK_EQUAL( 2, scaled.height() );
+
+    QImage jpg;
+    BOOST_REQUIRE( jpg.loadFromData( encodeImage( *image, 8, 4, false, 90 ), "jpg" ) );
+    BOOST_CHECK_EQUAL( 8, jpg.width() );
+}
+
+BOOST_AUTO_TEST_CASE(EncoderKeepsOrder) {
+    boost::shared_ptr<ImagePool> pool = ImagePool::create();
+    QThreadPool threads;
+    threads.setMaxThreadCount( 4 );
+
+    ImageEncoder encoder( &threads );
+    std::vector<int> indices;
+    for( unsigned int i=1; i<=6; i++ ) {
+        indices.push_back( encoder.add( makeImage( pool, 4*i, 4 ), 4*i, 4, true, 0 ) );
+    }
+    for( size_t i=0; i<indices.size(); i++ ) {
+        QImage img;
+        BOOST_REQUIRE( img.loadFromData( encoder.result( indices[i] ), "png" ) );
+        BOOST_CHECK_EQUAL( int(4*(i+1)), img.width() );
+    }
+    // The encoded images have been given back to the pool.
+    BOOST_CHECK_EQUAL( 6u, pool->freeCount() );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
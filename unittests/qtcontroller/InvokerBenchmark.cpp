@@ -0,0 +1,143 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <vector>
+#include <QCoreApplication>
+#include <QThread>
+#include <QTime>
+#include "tinia/qtcontroller/moc/Invoker.hpp"
+
+namespace {
+
+/** Stands in for grabbing one image, records where and in which order it ran. */
+class RecordingRunnable : public QRunnable
+{
+public:
+    RecordingRunnable( std::vector<int>* log, int id )
+        : m_log( log ), m_id( id ), m_thread( NULL )
+    {}
+
+    void run()
+    {
+        m_thread = QThread::currentThread();
+        m_log->push_back( m_id );
+    }
+
+    std::vector<int>*   m_log;
+    int                 m_id;
+    QThread*            m_thread;
+};
+
+/** Issues requests of images images each, like a snapshot_bundle request
+ * with images/2 viewers, and records the latency of each request.
+ */
+class SnapshotClient : public QThread
+{
+public:
+    SnapshotClient( tinia::qtcontroller::impl::Invoker* invoker, int requests, int images, bool batched )
+        : m_invoker( invoker ), m_requests( requests ), m_images( images ), m_batched( batched ),
+          m_errors( 0 )
+    {}
+
+    void run()
+    {
+        for( int r=0; r<m_requests; r++ ) {
+            std::vector<int> log;
+            std::vector<RecordingRunnable*> grabs;
+            for( int i=0; i<m_images; i++ ) {
+                grabs.push_back( new RecordingRunnable( &log, i ) );
+            }
+            QTime timer;
+            timer.start();
+            if( m_batched ) {
+                m_invoker->invokeInMainThread( std::vector<QRunnable*>( grabs.begin(), grabs.end() ) );
+            }
+            else {
+                for( size_t i=0; i<grabs.size(); i++ ) {
+                    m_invoker->invokeInMainThread( grabs[i], true );
+                }
+            }
+            m_latencies.push_back( timer.elapsed() );
+
+            for( size_t i=0; i<grabs.size(); i++ ) {
+                if( (log.size() != grabs.size()) || (log[i] != int(i)) || (grabs[i]->m_thread == this) ) {
+                    m_errors++;
+                }
+                delete grabs[i];
+            }
+        }
+    }
+
+    tinia::qtcontroller::impl::Invoker* m_invoker;
+    int                                 m_requests;
+    int                                 m_images;
+    bool                                m_batched;
+    int                                 m_errors;
+    std::vector<int>                    m_latencies;
+};
+
+/** Runs the client while the main thread spends 1 ms on other work (e.g.,
+ * painting the GUI) between each time it processes events.
+ */
+std::vector<int> runWithBusyMainThread( SnapshotClient& client )
+{
+    client.start();
+    while( !client.isFinished() ) {
+        QCoreApplication::processEvents( QEventLoop::AllEvents );
+        QTime busy;
+        busy.start();
+        while( busy.elapsed() < 1 ) {}
+    }
+    std::vector<int> latencies = client.m_latencies;
+    std::sort( latencies.begin(), latencies.end() );
+    return latencies;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(QtInvoker)
+
+BOOST_AUTO_TEST_CASE(BatchedInvocationLatency) {
+    // Four viewers with rgb and depth, as snapshot_bundle.txt in autoProxy-mode.
+    const int images = 8;
+    const int requests = 100;
+
+    tinia::qtcontroller::impl::Invoker invoker( NULL );
+
+    SnapshotClient single( &invoker, requests, images, false );
+    std::vector<int> single_latencies = runWithBusyMainThread( single );
+
+    SnapshotClient batched( &invoker, requests, images, true );
+    std::vector<int> batched_latencies = runWithBusyMainThread( batched );
+
+    BOOST_CHECK_EQUAL( single.m_errors, 0 );
+    BOOST_CHECK_EQUAL( batched.m_errors, 0 );
+    BOOST_REQUIRE_EQUAL( single_latencies.size(), size_t(requests) );
+    BOOST_REQUIRE_EQUAL( batched_latencies.size(), size_t(requests) );
+    BOOST_CHECK( batched_latencies[requests/2] <= single_latencies[requests/2] );
+
+    BOOST_TEST_MESSAGE( "Invoker, " << requests << " requests of " << images << " main thread invocations, busy main thread:" );
+    BOOST_TEST_MESSAGE( "  one invocation per image: p50 = " << single_latencies[requests/2] << " ms, p99 = "
+                        << single_latencies[(requests*99)/100] << " ms" );
+    BOOST_TEST_MESSAGE( "  batched:                  p50 = " << batched_latencies[requests/2] << " ms, p99 = "
+                        << batched_latencies[(requests*99)/100] << " ms" );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
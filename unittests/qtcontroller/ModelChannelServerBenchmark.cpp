@@ -0,0 +1,378 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <QCoreApplication>
+#include <QThread>
+#include <QTcpSocket>
+#include <QTime>
+#include <QRegExp>
+#include <boost/scoped_ptr.hpp>
+#include "tinia/jobcontroller.hpp"
+#include "tinia/jobcontroller/ModelChannel.hpp"
+#include "tinia/renderlist.hpp"
+#include "tinia/qtcontroller/moc/HTTPServer.hpp"
+
+using tinia::jobcontroller::ModelChannel;
+
+namespace {
+
+class ChannelTestJob : public tinia::jobcontroller::OpenGLJob
+{
+public:
+    ChannelTestJob()
+    {
+        m_model->addElement("counter", 0);
+    }
+
+    bool renderFrame(const std::string&, const std::string&, unsigned int,
+                     const size_t, const size_t)
+    {
+        return true;
+    }
+
+    const tinia::renderlist::DataBase* getRenderList(const std::string&, const std::string&)
+    {
+        return &m_db;
+    }
+
+    tinia::renderlist::DataBase m_db;
+};
+
+/** One step of the interaction: the client sets counter to value at at_ms. */
+struct Event {
+    int at_ms;
+    int value;
+};
+
+/** Three trackball drags of 40 moves each, at 60 Hz, with a pause between. */
+std::vector<Event> scriptedTrace()
+{
+    std::vector<Event> trace;
+    int at = 0;
+    int value = 1;
+    for(int drag = 0; drag < 3; ++drag) {
+        for(int move = 0; move < 40; ++move) {
+            Event event = { at, value++ };
+            trace.push_back(event);
+            at += 16;
+        }
+        at += 250;
+    }
+    return trace;
+}
+
+QByteArray stateUpdate(int value)
+{
+    return "<State><counter>" + QByteArray::number(value) + "</counter></State>";
+}
+
+/** The value of counter in a model update, or -1. */
+int counterIn(const QByteArray& xml)
+{
+    QRegExp counter("<counter>(\\d+)</counter>");
+    return counter.indexIn(QString::fromUtf8(xml)) == -1 ? -1 : counter.cap(1).toInt();
+}
+
+/** Reads one response, returns the status code and the body, or -1. */
+int readResponse(QTcpSocket& socket, QByteArray& buffer, QByteArray& body)
+{
+    int headerEnd;
+    while((headerEnd = buffer.indexOf("\r\n\r\n")) == -1) {
+        if(!socket.waitForReadyRead(30000)) {
+            return -1;
+        }
+        buffer += socket.readAll();
+    }
+    QRegExp contentLength("Content-Length: (\\d+)\r\n");
+    if(contentLength.indexIn(QString::fromLatin1(buffer.left(headerEnd + 2))) == -1) {
+        return -1;
+    }
+    const int total = headerEnd + 4 + contentLength.cap(1).toInt();
+    while(buffer.size() < total) {
+        if(!socket.waitForReadyRead(30000)) {
+            return -1;
+        }
+        buffer += socket.readAll();
+    }
+    const int code = buffer.mid(9, 3).toInt();
+    body = buffer.mid(headerEnd + 4, total - headerEnd - 4);
+    buffer.remove(0, total);
+    return code;
+}
+
+/** Plays the trace, and records for each event the milliseconds until the
+ * client had its value back in a model update. The sockets are opened in
+ * connect() and closed in disconnect(), both on the client thread.
+ */
+class TraceClient : public QThread
+{
+public:
+    TraceClient(quint16 port) : m_port(port), m_errors(0) {}
+
+    void run()
+    {
+        if(connect()) {
+            play();
+        }
+        else {
+            m_errors++;
+        }
+        disconnect();
+    }
+
+    void play()
+    {
+        const std::vector<Event> trace = scriptedTrace();
+        QTime clock;
+        clock.start();
+        for(size_t i = 0; i < trace.size(); ++i) {
+            const int wait = trace[i].at_ms - clock.elapsed();
+            if(wait > 0) {
+                msleep(wait);
+            }
+            QTime timer;
+            timer.start();
+            if(!sendUpdate(trace[i].value) || !awaitValue(trace[i].value)) {
+                m_errors++;
+                return;
+            }
+            m_latencies.push_back(timer.elapsed());
+        }
+    }
+
+    virtual bool connect() = 0;
+    virtual void disconnect() = 0;
+    virtual bool sendUpdate(int value) = 0;
+    virtual bool awaitValue(int value) = 0;
+
+    quint16             m_port;
+    int                 m_errors;
+    std::vector<int>    m_latencies;
+};
+
+/** Posts updateState.xml on one connection, and long-polls on another. */
+class LongPollTraceClient : public TraceClient
+{
+public:
+    LongPollTraceClient(quint16 port) : TraceClient(port), m_revision(0) {}
+
+    bool connect()
+    {
+        m_updates.reset(new QTcpSocket);
+        m_polls.reset(new QTcpSocket);
+        m_updates->connectToHost("127.0.0.1", m_port);
+        m_polls->connectToHost("127.0.0.1", m_port);
+        if(!m_updates->waitForConnected(10000) || !m_polls->waitForConnected(10000)) {
+            return false;
+        }
+        // The first poll is answered at once, then one is kept parked.
+        return poll() && readPoll() >= -1 && poll();
+    }
+
+    void disconnect()
+    {
+        m_updates.reset();
+        m_polls.reset();
+    }
+
+    bool sendUpdate(int value)
+    {
+        const QByteArray body = stateUpdate(value);
+        m_updates->write("POST /updateState.xml HTTP/1.1\r\nHost: localhost\r\nContent-Length: "
+                        + QByteArray::number(body.size()) + "\r\n\r\n" + body);
+        QByteArray reply;
+        return readResponse(*m_updates, m_updateBuffer, reply) == 200;
+    }
+
+    bool awaitValue(int value)
+    {
+        while(true) {
+            const int counter = readPoll();
+            if(counter < -1 || !poll()) {
+                return false;
+            }
+            if(counter == value) {
+                return true;
+            }
+        }
+    }
+
+    bool poll()
+    {
+        m_polls->write("GET /getExposedModelUpdate.xml?revision=" + QByteArray::number(m_revision)
+                      + " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+        return true;
+    }
+
+    /** The counter of the next poll answer, -1 if there is none, -2 on error. */
+    int readPoll()
+    {
+        QByteArray body;
+        if(readResponse(*m_polls, m_pollBuffer, body) != 200) {
+            return -2;
+        }
+        const std::string xml(body.constData(), body.size());
+        m_revision = std::max(m_revision, ModelChannel::revisionOf(xml));
+        return counterIn(body);
+    }
+
+    boost::scoped_ptr<QTcpSocket>   m_updates;
+    boost::scoped_ptr<QTcpSocket>   m_polls;
+    QByteArray                      m_updateBuffer;
+    QByteArray                      m_pollBuffer;
+    unsigned int                    m_revision;
+};
+
+/** Sends updates and gets the model over one model_channel WebSocket. */
+class ChannelTraceClient : public TraceClient
+{
+public:
+    ChannelTraceClient(quint16 port) : TraceClient(port), m_sequence(0) {}
+
+    bool connect()
+    {
+        m_socket.reset(new QTcpSocket);
+        m_socket->connectToHost("127.0.0.1", m_port);
+        if(!m_socket->waitForConnected(10000)) {
+            return false;
+        }
+        m_socket->write("GET /model_channel HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                       "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                       "Sec-WebSocket-Version: 13\r\n\r\n");
+        int headerEnd;
+        while((headerEnd = m_buffer.indexOf("\r\n\r\n")) == -1) {
+            if(!m_socket->waitForReadyRead(10000)) {
+                return false;
+            }
+            m_buffer += m_socket->readAll();
+        }
+        if(!m_buffer.startsWith("HTTP/1.1 101") ||
+           !m_buffer.contains("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")) {
+            return false;
+        }
+        m_buffer.remove(0, headerEnd + 4);
+        send("sync", std::string());
+        ModelChannel::Message message;
+        return readMessage("model", message);
+    }
+
+    void disconnect()
+    {
+        m_socket.reset();
+    }
+
+    bool sendUpdate(int value)
+    {
+        const QByteArray xml = stateUpdate(value);
+        send("update", std::string(xml.constData(), xml.size()));
+        return true;
+    }
+
+    bool awaitValue(int value)
+    {
+        ModelChannel::Message message;
+        while(readMessage("model", message)) {
+            if(counterIn(QByteArray(message.body.data(), int(message.body.size()))) == value) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void send(const std::string& type, const std::string& body)
+    {
+        ModelChannel::Message message;
+        message.type = type;
+        message.sequence = ++m_sequence;
+        message.body = body;
+        const std::string frame = ModelChannel::encodeFrame(ModelChannel::OPCODE_TEXT,
+                                                            ModelChannel::formatMessage(message),
+                                                            0x9abcdef1);
+        m_socket->write(frame.data(), frame.size());
+    }
+
+    /** Reads messages until one of type, false on error. */
+    bool readMessage(const std::string& type, ModelChannel::Message& message)
+    {
+        while(true) {
+            ModelChannel::Frame frame;
+            const size_t used = ModelChannel::decodeFrame(m_buffer.constData(), m_buffer.size(), frame);
+            if(used == 0) {
+                if(!m_socket->waitForReadyRead(30000)) {
+                    return false;
+                }
+                m_buffer += m_socket->readAll();
+                continue;
+            }
+            m_buffer.remove(0, int(used));
+            if(ModelChannel::parseMessage(frame.payload, message) && message.type == type) {
+                return true;
+            }
+        }
+    }
+
+    boost::scoped_ptr<QTcpSocket>   m_socket;
+    QByteArray                      m_buffer;
+    unsigned long                   m_sequence;
+};
+
+std::vector<int> replay(TraceClient& client)
+{
+    client.start();
+    while(!client.isFinished()) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+    std::vector<int> latencies = client.m_latencies;
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(QtModelChannel)
+
+BOOST_AUTO_TEST_CASE(ChannelAgainstLongPollLatency) {
+    const size_t events = scriptedTrace().size();
+
+    ChannelTestJob job;
+    tinia::qtcontroller::impl::HTTPServer server(&job, NULL, 0);
+    const quint16 port = server.serverPort();
+
+    LongPollTraceClient longPoll(port);
+    const std::vector<int> longPollLatencies = replay(longPoll);
+    ChannelTraceClient channel(port);
+    const std::vector<int> channelLatencies = replay(channel);
+
+    BOOST_CHECK_EQUAL(longPoll.m_errors, 0);
+    BOOST_CHECK_EQUAL(channel.m_errors, 0);
+    BOOST_REQUIRE_EQUAL(longPollLatencies.size(), events);
+    BOOST_REQUIRE_EQUAL(channelLatencies.size(), events);
+
+    BOOST_TEST_MESSAGE("Model round trip (update sent until it is back in a model update), "
+                       << events << " events of three 60 Hz drags:");
+    BOOST_TEST_MESSAGE("  long-poll and posts: p50 = " << longPollLatencies[events/2] << " ms, p99 = "
+                       << longPollLatencies[(events*99)/100] << " ms");
+    BOOST_TEST_MESSAGE("  model_channel:       p50 = " << channelLatencies[events/2] << " ms, p99 = "
+                       << channelLatencies[(events*99)/100] << " ms");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -19,6 +19,8 @@
 #include <boost/test/unit_test.hpp>
 #include "tinia/qtcontroller/impl/http_utils.hpp"
 #include <QString>
+#include <vector>
+#include <string>
 
 BOOST_AUTO_TEST_SUITE(QtServer)
 
@@ -81,4 +83,102 @@ BOOST_AUTO_TEST_CASE(PostContent) {
     BOOST_CHECK_EQUAL("CONTENT HERE", tinia::qtcontroller::impl::getPostContent(content).toStdString());
 }
 
+BOOST_AUTO_TEST_CASE(RequestLength) {
+    using tinia::qtcontroller::impl::requestLength;
+    const QByteArray get = "GET /a.txt HTTP/1.1\r\nHost: x\r\n\r\n";
+    BOOST_CHECK_EQUAL(0, requestLength(get.left(get.size() - 2), 1024, 1024));
+    BOOST_CHECK_EQUAL(get.size(), requestLength(get, 1024, 1024));
+
+    // Pipelined: only the first request is counted.
+    BOOST_CHECK_EQUAL(get.size(), requestLength(get + get, 1024, 1024));
+
+    const QByteArray post = "POST /updateState.xml HTTP/1.1\r\ncontent-length: 5\r\n\r\n";
+    BOOST_CHECK_EQUAL(0, requestLength(post + "abc", 1024, 1024));
+    BOOST_CHECK_EQUAL(post.size() + 5, requestLength(post + "abcde" + get, 1024, 1024));
+}
+
+BOOST_AUTO_TEST_CASE(RequestLengthLimits) {
+    using tinia::qtcontroller::impl::requestLength;
+    const QByteArray get = "GET /a.txt HTTP/1.1\r\nHost: x\r\n\r\n";
+    BOOST_CHECK_EQUAL(-1, requestLength(get, get.size() - 1, 1024));
+    BOOST_CHECK_EQUAL(-1, requestLength(get.left(get.size() - 2), 16, 1024));
+
+    // Refused before the body has arrived.
+    const QByteArray post = "POST /updateState.xml HTTP/1.1\r\nContent-Length: 2048\r\n\r\n";
+    BOOST_CHECK_EQUAL(-1, requestLength(post, 1024, 1024));
+    BOOST_CHECK_EQUAL(-1, requestLength("POST / HTTP/1.1\r\nContent-Length: 99999999999\r\n\r\n", 1024, 1024));
+    BOOST_CHECK_EQUAL(-1, requestLength("POST / HTTP/1.1\r\nContent-Length: five\r\n\r\n", 1024, 1024));
+}
+
+BOOST_AUTO_TEST_CASE(KeepAlive) {
+    using tinia::qtcontroller::impl::isKeepAlive;
+    BOOST_CHECK(isKeepAlive("GET / HTTP/1.1\r\nHost: x\r\n\r\n"));
+    BOOST_CHECK(!isKeepAlive("GET / HTTP/1.1\r\nConnection: close\r\n\r\n"));
+    BOOST_CHECK(!isKeepAlive("GET / HTTP/1.0\r\nHost: x\r\n\r\n"));
+    BOOST_CHECK(isKeepAlive("GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n"));
+}
+
+BOOST_AUTO_TEST_CASE(FinishResponse) {
+    using tinia::qtcontroller::impl::finishResponse;
+    BOOST_CHECK_EQUAL(std::string("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                                  "Content-Length: 4\r\nConnection: keep-alive\r\n\r\nbody"),
+                      finishResponse("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nbody", true).constData());
+    // Status line only.
+    BOOST_CHECK_EQUAL(std::string("HTTP/1.1 404 Not Found\r\n"
+                                  "Content-Length: 0\r\nConnection: close\r\n\r\n"),
+                      finishResponse("HTTP/1.1 404 Not Found\r\n", false).constData());
+}
+
+BOOST_AUTO_TEST_CASE(SnapshotContainer) {
+    using namespace tinia::qtcontroller::impl;
+    QByteArray out;
+    appendSnapshotHeader(out, 2, 0x01020304u, "123", "png");
+    const char header[] = "TSNP"
+            "\x01\x00\x00\x00"           // version
+            "\x02\x00\x00\x00"           // viewers
+            "\x04\x03\x02\x01"           // revision, little-endian
+            "\x03\x00\x00\x00" "123"     // timestamp
+            "\x03\x00\x00\x00" "png";    // snaptype
+    BOOST_CHECK(out == QByteArray(header, sizeof(header) - 1));
+
+    out.clear();
+    appendSized(out, QByteArray("\x89PNG\x00", 5));
+    BOOST_CHECK(out == QByteArray("\x05\x00\x00\x00\x89PNG\x00", 9));
+
+    out.clear();
+    appendFloat32(out, 1.0f);
+    BOOST_CHECK(out == QByteArray("\x00\x00\x80\x3f", 4));
+
+    BOOST_CHECK_EQUAL(std::string("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"),
+                      binaryHeader(getMimeType("snapshot.bin")).toStdString());
+}
+
+BOOST_AUTO_TEST_CASE(SnapshotETagIgnoresTimestamp) {
+    using namespace tinia::qtcontroller::impl;
+    // Two polls of an unchanged viewer, as Canvas.js sends them.
+    const std::vector<std::string> keys(1, "viewer@3");
+    const QString first = "GET /snapshot.txt?width=640&height=480&key=viewer&viewer_key_list=viewer"
+            "&jpeg_quality=90&revision=3&timestamp=1400000000000&snaptype=png HTTP/1.1\r\n"
+            "Host: localhost\r\n\r\n";
+    const QString etag = snapshotETag(first, keys);
+    BOOST_CHECK(!etag.isEmpty());
+    BOOST_CHECK(!isNotModified(first, etag));
+
+    const QString second = "GET /snapshot.txt?width=640&height=480&key=viewer&viewer_key_list=viewer"
+            "&jpeg_quality=90&revision=3&timestamp=1400000000250&snaptype=png HTTP/1.1\r\n"
+            "Host: localhost\r\nIf-None-Match: " + etag + "\r\n\r\n";
+    BOOST_CHECK(snapshotETag(second, keys) == etag);
+    BOOST_CHECK(isNotModified(second, snapshotETag(second, keys)));
+
+    // Other parameters, and the images, still make a new tag.
+    QString resized = second;
+    resized.replace("width=640", "width=320");
+    BOOST_CHECK(snapshotETag(resized, keys) != etag);
+    BOOST_CHECK(!isNotModified(resized, snapshotETag(resized, keys)));
+    BOOST_CHECK(snapshotETag(second, std::vector<std::string>(1, "viewer@4")) != etag);
+
+    // Caching disabled.
+    BOOST_CHECK(!isNotModified(second, QString()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,285 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <vector>
+#include <QCoreApplication>
+#include <QThread>
+#include <QTcpSocket>
+#include <QTime>
+#include <QAtomicInt>
+#include "tinia/jobcontroller.hpp"
+#include "tinia/renderlist.hpp"
+#include "tinia/qtcontroller/moc/HTTPServer.hpp"
+
+namespace {
+
+class LoadTestJob : public tinia::jobcontroller::OpenGLJob
+{
+public:
+    LoadTestJob()
+    {
+        m_model->addElement("counter", 0);
+    }
+
+    bool renderFrame(const std::string&, const std::string&, unsigned int,
+                     const size_t, const size_t)
+    {
+        return true;
+    }
+
+    const tinia::renderlist::DataBase* getRenderList(const std::string&, const std::string&)
+    {
+        return &m_db;
+    }
+
+    tinia::renderlist::DataBase m_db;
+};
+
+/** Reads one response. Returns the status code, or -1 on error. */
+int readResponse(QTcpSocket& socket, QByteArray& buffer)
+{
+    int headerEnd;
+    while((headerEnd = buffer.indexOf("\r\n\r\n")) == -1) {
+        if(!socket.waitForReadyRead(30000)) {
+            return -1;
+        }
+        buffer += socket.readAll();
+    }
+    QRegExp contentLength("Content-Length: (\\d+)\r\n");
+    if(contentLength.indexIn(QString::fromLatin1(buffer.left(headerEnd + 2))) == -1) {
+        return -1;
+    }
+    const int total = headerEnd + 4 + contentLength.cap(1).toInt();
+    while(buffer.size() < total) {
+        if(!socket.waitForReadyRead(30000)) {
+            return -1;
+        }
+        buffer += socket.readAll();
+    }
+    const int code = buffer.mid(9, 3).toInt();
+    buffer.remove(0, total);
+    return code;
+}
+
+/** Requests render lists and posts state updates on one keep-alive connection. */
+class FrameClient : public QThread
+{
+public:
+    FrameClient(quint16 port, int requests) : m_port(port), m_requests(requests), m_errors(0) {}
+
+    void run()
+    {
+        QTcpSocket socket;
+        socket.connectToHost("127.0.0.1", m_port);
+        if(!socket.waitForConnected(10000)) {
+            m_errors = m_requests;
+            return;
+        }
+        QByteArray buffer;
+        for(int i = 0; i < m_requests; ++i) {
+            QByteArray request;
+            if(i % 2 == 0) {
+                request = "GET /getRenderList.xml?key=viewer&timestamp=0 HTTP/1.1\r\nHost: localhost\r\n\r\n";
+            }
+            else {
+                const QByteArray body = "<State><counter>" + QByteArray::number(i) + "</counter></State>";
+                request = "POST /updateState.xml HTTP/1.1\r\nHost: localhost\r\nContent-Length: "
+                        + QByteArray::number(body.size()) + "\r\n\r\n" + body;
+            }
+            QTime timer;
+            timer.start();
+            socket.write(request);
+            if(readResponse(socket, buffer) != 200) {
+                m_errors++;
+            }
+            m_latencies.push_back(timer.elapsed());
+        }
+    }
+
+    quint16             m_port;
+    int                 m_requests;
+    int                 m_errors;
+    std::vector<int>    m_latencies;
+};
+
+/** Long-polls for updates until stopped. */
+class PollClient : public QThread
+{
+public:
+    PollClient(quint16 port, boost::shared_ptr<tinia::model::ExposedModel> model, QAtomicInt* stop)
+        : m_port(port), m_model(model), m_stop(stop), m_answered(0), m_errors(0) {}
+
+    void run()
+    {
+        QTcpSocket socket;
+        socket.connectToHost("127.0.0.1", m_port);
+        if(!socket.waitForConnected(10000)) {
+            m_errors++;
+            return;
+        }
+        QByteArray buffer;
+        while(!int(*m_stop)) {
+            const int revision = m_model->getRevisionNumber();
+            socket.write("GET /getExposedModelUpdate.xml?revision=" + QByteArray::number(revision)
+                         + " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+            if(readResponse(socket, buffer) == 200) {
+                m_answered++;
+            }
+            else {
+                m_errors++;
+                return;
+            }
+        }
+    }
+
+    quint16                                         m_port;
+    boost::shared_ptr<tinia::model::ExposedModel>   m_model;
+    QAtomicInt*                                     m_stop;
+    int                                             m_answered;
+    int                                             m_errors;
+};
+
+bool allFinished(const std::vector<QThread*>& threads)
+{
+    for(size_t i = 0; i < threads.size(); ++i) {
+        if(!threads[i]->isFinished()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(QtServerLoad)
+
+BOOST_AUTO_TEST_CASE(PipelinedRequestsAreAnsweredInOrder) {
+    LoadTestJob job;
+    tinia::qtcontroller::impl::HTTPServer server(&job, NULL, 0);
+    const quint16 port = server.serverPort();
+
+    // Three requests in one write. The second needs a main thread round-trip,
+    // the third is answered right away, but must still come last.
+    class Pipeliner : public QThread {
+    public:
+        Pipeliner(quint16 port) : m_port(port), m_closed(false) {}
+        void run() {
+            QTcpSocket socket;
+            socket.connectToHost("127.0.0.1", m_port);
+            if(!socket.waitForConnected(10000)) return;
+            const QByteArray body = "<State><counter>7</counter></State>";
+            socket.write("POST /updateState.xml HTTP/1.1\r\nContent-Length: "
+                         + QByteArray::number(body.size()) + "\r\n\r\n" + body
+                         + "GET /getRenderList.xml?key=viewer&timestamp=0 HTTP/1.1\r\n\r\n"
+                         + "GET /nosuchfile.txt HTTP/1.1\r\nConnection: close\r\n\r\n");
+            QByteArray buffer;
+            m_codes.push_back(readResponse(socket, buffer));
+            m_codes.push_back(readResponse(socket, buffer));
+            m_codes.push_back(readResponse(socket, buffer));
+            m_closed = !socket.waitForReadyRead(10000) && socket.state() != QAbstractSocket::ConnectedState;
+        }
+        quint16 m_port;
+        std::vector<int> m_codes;
+        bool m_closed;
+    } pipeliner(port);
+
+    pipeliner.start();
+    std::vector<QThread*> threads(1, &pipeliner);
+    while(!allFinished(threads)) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+    BOOST_REQUIRE_EQUAL(pipeliner.m_codes.size(), 3u);
+    BOOST_CHECK_EQUAL(pipeliner.m_codes[0], 200);
+    BOOST_CHECK_EQUAL(pipeliner.m_codes[1], 200);
+    BOOST_CHECK_EQUAL(pipeliner.m_codes[2], 404);
+    BOOST_CHECK(pipeliner.m_closed);
+}
+
+BOOST_AUTO_TEST_CASE(LongPollsDoNotStarveWorkers) {
+    // Many more parked long-polls than worker threads.
+    const int workers = 4;
+    const int pollClients = 64;
+    const int frameClients = 16;
+    const int requestsPerClient = 200;
+
+    qputenv("TINIA_HTTP_WORKERS", QByteArray::number(workers));
+    LoadTestJob job;
+    tinia::qtcontroller::impl::HTTPServer server(&job, NULL, 0);
+    const quint16 port = server.serverPort();
+
+    QAtomicInt stop(0);
+    std::vector<PollClient*> polls;
+    std::vector<FrameClient*> frames;
+    std::vector<QThread*> pollThreads, frameThreads;
+    for(int i = 0; i < pollClients; ++i) {
+        polls.push_back(new PollClient(port, job.getExposedModel(), &stop));
+        pollThreads.push_back(polls.back());
+        polls.back()->start();
+    }
+    for(int i = 0; i < frameClients; ++i) {
+        frames.push_back(new FrameClient(port, requestsPerClient));
+        frameThreads.push_back(frames.back());
+        frames.back()->start();
+    }
+
+    QTime elapsed;
+    elapsed.start();
+    while(!allFinished(frameThreads)) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+    const int milliseconds = elapsed.elapsed();
+
+    // Keep changing the model until all pollers have seen that they should stop.
+    stop.fetchAndStoreOrdered(1);
+    int counter = 0;
+    while(!allFinished(pollThreads)) {
+        job.getExposedModel()->updateElement("counter", --counter);
+        QTime wait;
+        wait.start();
+        while(wait.elapsed() < 20) {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+        }
+    }
+
+    std::vector<int> latencies;
+    int errors = 0, answered = 0;
+    for(size_t i = 0; i < frames.size(); ++i) {
+        latencies.insert(latencies.end(), frames[i]->m_latencies.begin(), frames[i]->m_latencies.end());
+        errors += frames[i]->m_errors;
+        delete frames[i];
+    }
+    for(size_t i = 0; i < polls.size(); ++i) {
+        errors += polls[i]->m_errors;
+        answered += polls[i]->m_answered;
+        delete polls[i];
+    }
+    qputenv("TINIA_HTTP_WORKERS", "");
+
+    BOOST_CHECK_EQUAL(errors, 0);
+    BOOST_REQUIRE_EQUAL(latencies.size(), size_t(frameClients * requestsPerClient));
+    std::sort(latencies.begin(), latencies.end());
+    BOOST_TEST_MESSAGE("HTTPServer, " << workers << " workers, " << pollClients << " long-polling clients, "
+                       << frameClients << " clients x " << requestsPerClient << " requests in " << milliseconds << " ms:");
+    BOOST_TEST_MESSAGE("  request latency p50 = " << latencies[latencies.size() / 2] << " ms, p99 = "
+                       << latencies[(latencies.size() * 99) / 100] << " ms, max = " << latencies.back() << " ms");
+    BOOST_TEST_MESSAGE("  long-polls answered: " << answered);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,182 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "ChildSupervisor.hpp"
+
+using tinia::trell::impl::ChildSupervisor;
+
+BOOST_AUTO_TEST_SUITE( ChildSupervisorTest )
+
+namespace {
+
+/** Counts the wakeups of a supervisor, like the message the master sends. */
+struct SupervisorFixture
+{
+    boost::mutex                m_mutex;
+    boost::condition_variable   m_cond;
+    unsigned int                m_wakeups;
+    ChildSupervisor             m_supervisor;
+
+    SupervisorFixture()
+        : m_wakeups( 0u )
+    {
+        // No other threads exist yet, as in main of the master.
+        BOOST_REQUIRE( ChildSupervisor::blockInProcess() );
+        BOOST_REQUIRE( m_supervisor.start( boost::bind( &SupervisorFixture::wakeup, this ) ) );
+    }
+
+    ~SupervisorFixture()
+    {
+        m_supervisor.stop();
+    }
+
+    bool
+    wakeup()
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_wakeups++;
+        m_cond.notify_all();
+        return true;
+    }
+
+    /** Waits up to ten seconds for exits, and fetches them. */
+    std::vector<ChildSupervisor::Exit>
+    waitForExits( size_t count )
+    {
+        std::vector<ChildSupervisor::Exit> exits;
+        const boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds( 10 );
+        boost::mutex::scoped_lock lock( m_mutex );
+        while( exits.size() < count ) {
+            if( m_wakeups == 0u && !m_cond.timed_wait( lock, deadline ) ) {
+                break;
+            }
+            m_wakeups = 0u;
+            lock.unlock();
+            std::vector<ChildSupervisor::Exit> more = m_supervisor.exits();
+            exits.insert( exits.end(), more.begin(), more.end() );
+            lock.lock();
+        }
+        return exits;
+    }
+};
+
+pid_t
+forkAndExit( int status, unsigned int delay_ms = 0u )
+{
+    pid_t pid = fork();
+    if( pid == 0 ) {
+        usleep( 1000*delay_ms );
+        _exit( status );
+    }
+    return pid;
+}
+
+} // of anonymous namespace
+
+BOOST_FIXTURE_TEST_CASE( WatchedChildIsReaped, SupervisorFixture )
+{
+    pid_t pid = forkAndExit( 3, 50 );
+    BOOST_REQUIRE( pid > 0 );
+    m_supervisor.watchChild( pid );
+
+    std::vector<ChildSupervisor::Exit> exits = waitForExits( 1 );
+    BOOST_REQUIRE_EQUAL( exits.size(), 1u );
+    BOOST_CHECK_EQUAL( exits[0].m_pid, pid );
+    BOOST_CHECK( WIFEXITED( exits[0].m_status ) );
+    BOOST_CHECK_EQUAL( WEXITSTATUS( exits[0].m_status ), 3 );
+}
+
+BOOST_FIXTURE_TEST_CASE( ChildThatExitedBeforeWatchIsReaped, SupervisorFixture )
+{
+    pid_t pid = forkAndExit( 4 );
+    BOOST_REQUIRE( pid > 0 );
+    // The SIGCHLD has been handled when the child is watched.
+    usleep( 100000 );
+    m_supervisor.watchChild( pid );
+
+    std::vector<ChildSupervisor::Exit> exits = waitForExits( 1 );
+    BOOST_REQUIRE_EQUAL( exits.size(), 1u );
+    BOOST_CHECK_EQUAL( exits[0].m_pid, pid );
+    BOOST_CHECK_EQUAL( WEXITSTATUS( exits[0].m_status ), 4 );
+}
+
+BOOST_FIXTURE_TEST_CASE( OtherChildrenAreLeftAlone, SupervisorFixture )
+{
+    pid_t other = forkAndExit( 5 );
+    pid_t job = forkAndExit( 6, 50 );
+    BOOST_REQUIRE( (other > 0) && (job > 0) );
+    m_supervisor.watchChild( job );
+
+    std::vector<ChildSupervisor::Exit> exits = waitForExits( 1 );
+    BOOST_REQUIRE_EQUAL( exits.size(), 1u );
+    BOOST_CHECK_EQUAL( exits[0].m_pid, job );
+
+    // The other child is still there for its owner to reap.
+    int status = 0;
+    BOOST_CHECK_EQUAL( waitpid( other, &status, 0 ), other );
+    BOOST_CHECK_EQUAL( WEXITSTATUS( status ), 5 );
+}
+
+BOOST_FIXTURE_TEST_CASE( ProcessThatIsNotAChildIsWatched, SupervisorFixture )
+{
+    // A grandchild, which is not our child when its parent has exited. It
+    // runs until the test closes its end of the hold pipe.
+    int pid_pipe[2];
+    int hold_pipe[2];
+    BOOST_REQUIRE( (pipe( pid_pipe ) == 0) && (pipe( hold_pipe ) == 0) );
+    pid_t parent = fork();
+    if( parent == 0 ) {
+        pid_t grandchild = fork();
+        if( grandchild == 0 ) {
+            close( hold_pipe[1] );
+            char c;
+            while( read( hold_pipe[0], &c, 1 ) > 0 ) {}
+            _exit( 0 );
+        }
+        if( write( pid_pipe[1], &grandchild, sizeof(grandchild) ) != sizeof(grandchild) ) {
+            _exit( 1 );
+        }
+        _exit( 0 );
+    }
+    close( pid_pipe[1] );
+    close( hold_pipe[0] );
+    BOOST_REQUIRE_EQUAL( waitpid( parent, NULL, 0 ), parent );
+    pid_t grandchild = -1;
+    BOOST_REQUIRE_EQUAL( read( pid_pipe[0], &grandchild, sizeof(grandchild) ), (ssize_t)sizeof(grandchild) );
+    close( pid_pipe[0] );
+
+    if( !m_supervisor.watch( grandchild ) ) {
+        BOOST_TEST_MESSAGE( "No pidfd support, processes that are not children are not watched." );
+        close( hold_pipe[1] );
+        return;
+    }
+    close( hold_pipe[1] );
+
+    std::vector<ChildSupervisor::Exit> exits = waitForExits( 1 );
+    BOOST_REQUIRE_EQUAL( exits.size(), 1u );
+    BOOST_CHECK_EQUAL( exits[0].m_pid, grandchild );
+    BOOST_CHECK_EQUAL( exits[0].m_status, -1 );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
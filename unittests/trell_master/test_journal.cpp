@@ -0,0 +1,138 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <boost/test/unit_test.hpp>
+#include "Master.hpp"
+
+BOOST_AUTO_TEST_SUITE( JournalTest )
+
+namespace {
+
+/** The master needs env['TINIA_APP_ROOT'], although the test does not use it. */
+bool
+notForReal()
+{
+    setenv( "TINIA_APP_ROOT", "/tmp", 0 );
+    return false;
+}
+
+/** A master that keeps its state in a file of its own, and does not fork. */
+class TestMaster : public tinia::trell::impl::Master
+{
+public:
+    explicit TestMaster( const std::string& state_path )
+        : Master( notForReal() )
+    {
+        m_state_path = state_path;
+        m_journal_path = state_path + ".journal";
+    }
+
+    ~TestMaster()
+    {
+        if( m_journal_fd >= 0 ) {
+            close( m_journal_fd );
+        }
+    }
+
+    void
+    addJob( const std::string& id, pid_t pid, TrellJobState state )
+    {
+        Job job = Job();
+        job.m_id = id;
+        job.m_pid = pid;
+        job.m_executable = "/bin/true";
+        job.m_state = state;
+        job.m_args.push_back( "--" + id );
+        m_jobs[ id ] = job;
+    }
+
+    using Master::m_jobs;
+    using Master::dumpMasterState;
+    using Master::journalJob;
+    using Master::journalWipe;
+    using Master::snarfMasterState;
+};
+
+const std::string
+testPath()
+{
+    std::stringstream o;
+    o << "/tmp/test_trell_master_state_" << getpid();
+    return o.str();
+}
+
+} // of anonymous namespace
+
+BOOST_AUTO_TEST_CASE( JournalIsReplayedOnTheState )
+{
+    const std::string path = testPath();
+    {
+        TestMaster master( path );
+        master.addJob( "kept", 101, TRELL_JOBSTATE_RUNNING );
+        master.addJob( "changed", 102, TRELL_JOBSTATE_RUNNING );
+        master.addJob( "wiped", 103, TRELL_JOBSTATE_TERMINATED_SUCCESSFULLY );
+        master.dumpMasterState();
+
+        // Changes after the state file are only in the journal.
+        master.m_jobs[ "changed" ].m_state = TRELL_JOBSTATE_HIBERNATED;
+        master.journalJob( "changed" );
+        master.m_jobs.erase( "wiped" );
+        master.journalWipe( "wiped" );
+        master.addJob( "added", 104, TRELL_JOBSTATE_RUNNING );
+        master.journalJob( "added" );
+    }
+    {
+        // A crash in the middle of appending a record.
+        std::ofstream journal( (path + ".journal").c_str(), std::ios::app );
+        journal << "  <jobInfo>\n    <job>cut</job>\n    <pid>10";
+    }
+
+    TestMaster master( path );
+    master.snarfMasterState();
+    BOOST_CHECK_EQUAL( master.m_jobs.size(), 3u );
+    BOOST_REQUIRE( master.m_jobs.count( "kept" ) == 1 );
+    BOOST_CHECK_EQUAL( master.m_jobs[ "kept" ].m_pid, 101 );
+    BOOST_CHECK_EQUAL( master.m_jobs[ "kept" ].m_state, TRELL_JOBSTATE_RUNNING );
+    BOOST_REQUIRE( master.m_jobs[ "kept" ].m_args.size() == 1 );
+    BOOST_CHECK_EQUAL( master.m_jobs[ "kept" ].m_args[0], "--kept" );
+    BOOST_REQUIRE( master.m_jobs.count( "changed" ) == 1 );
+    BOOST_CHECK_EQUAL( master.m_jobs[ "changed" ].m_state, TRELL_JOBSTATE_HIBERNATED );
+    BOOST_CHECK( master.m_jobs.count( "wiped" ) == 0 );
+    BOOST_REQUIRE( master.m_jobs.count( "added" ) == 1 );
+    BOOST_CHECK_EQUAL( master.m_jobs[ "added" ].m_pid, 104 );
+    BOOST_CHECK( master.m_jobs.count( "cut" ) == 0 );
+
+    // Writing the state folds the journal into it.
+    master.dumpMasterState();
+    std::ifstream journal( (path + ".journal").c_str() );
+    BOOST_CHECK( journal.peek() == std::ifstream::traits_type::eof() );
+    TestMaster reread( path );
+    reread.snarfMasterState();
+    BOOST_CHECK_EQUAL( reread.m_jobs.size(), 3u );
+    BOOST_CHECK_EQUAL( reread.m_jobs[ "changed" ].m_state, TRELL_JOBSTATE_HIBERNATED );
+
+    std::remove( path.c_str() );
+    std::remove( (path + ".journal").c_str() );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,241 @@
+/* Copyright STIFTELSEN SINTEF 2012
+ *
+ * This file is part of the Tinia Framework.
+ *
+ * The Tinia Framework is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * The Tinia Framework is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with the Tinia Framework.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <libxml/xmlreader.h>
+#include <libxml/xmlschemas.h>
+#include "Master.hpp"
+
+BOOST_AUTO_TEST_SUITE( RPCValidationBenchmark )
+
+namespace {
+
+const std::string rpc_schema = std::string( TRELL_MASTER_TEST_SCHEMA_DIR ) + "/rpc_master.xsd";
+
+const char* valid_query =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<query xmlns=\"http://cloudviz.sintef.no/trell/1.0\">"
+        "<killJob><job>benchmark_job</job><force>false</force></killJob>"
+        "</query>";
+
+// The force element is missing.
+const char* invalid_query =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<query xmlns=\"http://cloudviz.sintef.no/trell/1.0\">"
+        "<killJob><job>benchmark_job</job></killJob>"
+        "</query>";
+
+/** The master needs env['TINIA_APP_ROOT'], although the test does not use it. */
+bool
+notForReal()
+{
+    setenv( "TINIA_APP_ROOT", "/tmp", 0 );
+    return false;
+}
+
+/** Keeps libxml2 from printing the errors of the invalid query. */
+void
+quietErrors( void*, const char*, ... )
+{
+}
+
+/** A master that decodes queries without forking or touching its state. */
+class TestMaster : public tinia::trell::impl::Master
+{
+public:
+    TestMaster()
+        : Master( notForReal() )
+    {}
+
+    /** True if the master decodes the query as a killJob query. */
+    bool
+    killsJob( const std::string& query )
+    {
+        return decode( query ) == ParsedXML::ACTION_KILL_JOB;
+    }
+
+    /** True if the master gives the query no action. */
+    bool
+    ignores( const std::string& query )
+    {
+        return decode( query ) == ParsedXML::ACTION_NONE;
+    }
+
+private:
+    int
+    decode( const std::string& query )
+    {
+        std::vector<char> buf( query.begin(), query.end() );
+        ParsedXML data;
+        data.m_action = ParsedXML::ACTION_NONE;
+        parseXML( data, &buf[0], buf.size() );
+        return data.m_action;
+    }
+};
+
+/** Validates as the tinia_validate_xml filter did before it kept its
+ * validators: a new reader and validation context for every query.
+ */
+bool
+validateFresh( xmlSchemaPtr schema, const std::string& query )
+{
+    xmlSchemaValidCtxtPtr ctx = xmlSchemaNewValidCtxt( schema );
+    xmlTextReaderPtr reader = xmlReaderForMemory( query.c_str(), query.size(), "", NULL, 0 );
+    xmlTextReaderSchemaValidateCtxt( reader, ctx, 0 );
+    int ret = xmlTextReaderRead( reader );
+    while( ret == 1 ) {
+        ret = xmlTextReaderRead( reader );
+    }
+    bool valid = (ret == 0) && (xmlTextReaderIsValid( reader ) == 1);
+    xmlFreeTextReader( reader );
+    xmlSchemaFreeValidCtxt( ctx );
+    return valid;
+}
+
+/** Validates as the tinia_validate_xml filter does now: the reader and the
+ * validation context are kept and pointed at the next query.
+ */
+class CachedValidator
+{
+public:
+    explicit CachedValidator( xmlSchemaPtr schema )
+        : m_ctx( xmlSchemaNewValidCtxt( schema ) ),
+          m_reader( NULL )
+    {}
+
+    ~CachedValidator()
+    {
+        if( m_reader != NULL ) {
+            xmlFreeTextReader( m_reader );
+        }
+        xmlSchemaFreeValidCtxt( m_ctx );
+    }
+
+    bool
+    validate( const std::string& query )
+    {
+        if( m_reader == NULL ) {
+            m_reader = xmlReaderForMemory( query.c_str(), query.size(), "", NULL, 0 );
+        }
+        else if( xmlReaderNewMemory( m_reader, query.c_str(), query.size(), "", NULL, 0 ) != 0 ) {
+            return false;
+        }
+        xmlTextReaderSchemaValidateCtxt( m_reader, m_ctx, 0 );
+        int ret = xmlTextReaderRead( m_reader );
+        while( ret == 1 ) {
+            ret = xmlTextReaderRead( m_reader );
+        }
+        bool valid = (ret == 0) && (xmlTextReaderIsValid( m_reader ) == 1);
+        xmlTextReaderSchemaValidateCtxt( m_reader, NULL, 0 );
+        xmlTextReaderClose( m_reader );
+        return valid;
+    }
+
+private:
+    xmlSchemaValidCtxtPtr   m_ctx;
+    xmlTextReaderPtr        m_reader;
+};
+
+double
+queriesPerSecond( int queries, const boost::posix_time::ptime& start )
+{
+    boost::posix_time::time_duration d = boost::posix_time::microsec_clock::universal_time() - start;
+    return queries / (1e-6*std::max( d.total_microseconds(), boost::posix_time::time_duration::tick_type(1) ) );
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( KillJobValidationThroughput )
+{
+    using boost::posix_time::microsec_clock;
+    const int queries = 2000;
+
+    xmlSetGenericErrorFunc( NULL, quietErrors );
+
+    xmlSchemaParserCtxtPtr pctx = xmlSchemaNewParserCtxt( rpc_schema.c_str() );
+    BOOST_REQUIRE( pctx != NULL );
+    xmlSchemaPtr schema = xmlSchemaParse( pctx );
+    xmlSchemaFreeParserCtxt( pctx );
+    BOOST_REQUIRE( schema != NULL );
+
+    unsetenv( "TINIA_RPC_SCHEMA" );
+    TestMaster decoding;
+    setenv( "TINIA_RPC_SCHEMA", rpc_schema.c_str(), 1 );
+    TestMaster validating;
+    unsetenv( "TINIA_RPC_SCHEMA" );
+    CachedValidator cached( schema );
+
+    // Each mode accepts the valid query and rejects the invalid one.
+    BOOST_CHECK( validateFresh( schema, valid_query ) );
+    BOOST_CHECK( !validateFresh( schema, invalid_query ) );
+    BOOST_CHECK( cached.validate( valid_query ) );
+    BOOST_CHECK( !cached.validate( invalid_query ) );
+    BOOST_CHECK( cached.validate( valid_query ) );
+    BOOST_CHECK( decoding.killsJob( valid_query ) );
+    BOOST_CHECK( validating.killsJob( valid_query ) );
+    BOOST_CHECK( validating.ignores( invalid_query ) );
+    BOOST_CHECK( validating.killsJob( valid_query ) );
+
+    // Filter with a new validator per query, then the master decodes.
+    int accepted = 0;
+    boost::posix_time::ptime start = microsec_clock::universal_time();
+    for( int i=0; i<queries; i++ ) {
+        if( validateFresh( schema, valid_query ) && decoding.killsJob( valid_query ) ) {
+            accepted++;
+        }
+    }
+    double fresh_qps = queriesPerSecond( queries, start );
+    BOOST_CHECK_EQUAL( accepted, queries );
+
+    // Filter with a kept validator, then the master decodes.
+    accepted = 0;
+    start = microsec_clock::universal_time();
+    for( int i=0; i<queries; i++ ) {
+        if( cached.validate( valid_query ) && decoding.killsJob( valid_query ) ) {
+            accepted++;
+        }
+    }
+    double cached_qps = queriesPerSecond( queries, start );
+    BOOST_CHECK_EQUAL( accepted, queries );
+
+    // No filter, the master validates while it decodes.
+    accepted = 0;
+    start = microsec_clock::universal_time();
+    for( int i=0; i<queries; i++ ) {
+        if( validating.killsJob( valid_query ) ) {
+            accepted++;
+        }
+    }
+    double master_qps = queriesPerSecond( queries, start );
+    BOOST_CHECK_EQUAL( accepted, queries );
+
+    BOOST_TEST_MESSAGE( "Validation of " << queries << " killJob RPC queries to the master (rpc_master.xsd):" );
+    BOOST_TEST_MESSAGE( "  filter, new validator per query, then master decode: " << fresh_qps << " queries/s" );
+    BOOST_TEST_MESSAGE( "  filter, kept validator, then master decode:          " << cached_qps << " queries/s" );
+    BOOST_TEST_MESSAGE( "  master validates while it decodes:                   " << master_qps << " queries/s" );
+
+    xmlSchemaFree( schema );
+    xmlSetGenericErrorFunc( NULL, NULL );
+}
+
+BOOST_AUTO_TEST_SUITE_END()